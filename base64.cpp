@@ -0,0 +1,146 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "base64.hpp"
+
+namespace Fossilize
+{
+static char base64(uint32_t v)
+{
+	if (v == 63)
+		return '/';
+	else if (v == 62)
+		return '+';
+	else if (v >= 52)
+		return char('0' + (v - 52));
+	else if (v >= 26)
+		return char('a' + (v - 26));
+	else
+		return char('A' + v);
+}
+
+static uint32_t base64_index(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return uint32_t(c - 'A');
+	else if (c >= 'a' && c <= 'z')
+		return uint32_t(c - 'a') + 26;
+	else if (c >= '0' && c <= '9')
+		return uint32_t(c - '0') + 52;
+	else if (c == '+')
+		return 62;
+	else if (c == '/')
+		return 63;
+	else
+		return 0;
+}
+
+size_t compute_size_base64(size_t size)
+{
+	return 4 * ((size + 2) / 3);
+}
+
+char *encode_base64(char *buffer, const void *data_, size_t size)
+{
+	auto *data = static_cast<const uint8_t *>(data_);
+
+	for (size_t i = 0; i < size; i += 3)
+	{
+		uint32_t code = data[i] << 16;
+		if (i + 1 < size)
+			code |= data[i + 1] << 8;
+		if (i + 2 < size)
+			code |= data[i + 2] << 0;
+
+		auto c0 = base64((code >> 18) & 63);
+		auto c1 = base64((code >> 12) & 63);
+		auto c2 = base64((code >>  6) & 63);
+		auto c3 = base64((code >>  0) & 63);
+
+		auto outbytes = size - i;
+		if (outbytes == 1)
+		{
+			c2 = '=';
+			c3 = '=';
+		}
+		else if (outbytes == 2)
+			c3 = '=';
+
+		*buffer++ = c0;
+		*buffer++ = c1;
+		*buffer++ = c2;
+		*buffer++ = c3;
+	}
+
+	return buffer;
+}
+
+size_t decode_base64(void *buffer, size_t size, const char *data)
+{
+	auto *ptr = static_cast<uint8_t *>(buffer);
+	size_t i = 0;
+
+	while (i < size)
+	{
+		char c0 = *data++;
+		if (c0 == '\0')
+			break;
+		char c1 = *data++;
+		if (c1 == '\0')
+			break;
+		char c2 = *data++;
+		if (c2 == '\0')
+			break;
+		char c3 = *data++;
+		if (c3 == '\0')
+			break;
+
+		uint32_t values =
+				(base64_index(c0) << 18) |
+				(base64_index(c1) << 12) |
+				(base64_index(c2) << 6) |
+				(base64_index(c3) << 0);
+
+		size_t outbytes = 3;
+		if (c2 == '=' && c3 == '=')
+			outbytes = 1;
+		else if (c3 == '=')
+			outbytes = 2;
+
+		// Input without padding must not write past the end.
+		if (outbytes > size - i)
+			outbytes = size - i;
+
+		ptr[0] = uint8_t(values >> 16);
+		if (outbytes > 1)
+			ptr[1] = uint8_t(values >> 8);
+		if (outbytes > 2)
+			ptr[2] = uint8_t(values >> 0);
+
+		ptr += outbytes;
+		i += outbytes;
+	}
+
+	return i;
+}
+}
@@ -0,0 +1,488 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "database_transform.hpp"
+#include "path.hpp"
+#include "layer/utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <inttypes.h>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+
+namespace Fossilize
+{
+void DatabaseTransformOutput::write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags)
+{
+	Entry entry;
+	entry.tag = tag;
+	entry.hash = hash;
+	entry.flags = flags;
+	entry.blob.resize(size);
+	if (size)
+		memcpy(entry.blob.data(), blob, size);
+	entries.push_back(std::move(entry));
+}
+
+bool DatabaseTransform::init_worker(unsigned, DatabaseInterface &, DatabaseInterface &)
+{
+	return true;
+}
+
+bool DatabaseTransform::shared_entry(unsigned, ResourceTag, Hash, const void *, size_t)
+{
+	return true;
+}
+
+bool DatabaseTransform::end_worker(unsigned)
+{
+	return true;
+}
+
+bool database_transform_needs_serialized_reads(const char *path)
+{
+	return Path::ext(path) == "zip";
+}
+
+namespace
+{
+enum
+{
+	// How far ahead of the writer workers can get, per worker.
+	OrderedWindowPerThread = 64,
+	// How many unordered entries can be queued up before recording threads block.
+	MaxQueuedSinkEntries = 1024
+};
+
+struct TransformRunner;
+
+// Forwards reads to the input database so workers can use it as a resolver concurrently.
+struct ConcurrentInput : DatabaseInterface
+{
+	ConcurrentInput(DatabaseInterface &input_, bool serialize_)
+		: input(input_), serialize(serialize_)
+	{
+	}
+
+	bool prepare() override
+	{
+		return true;
+	}
+
+	bool read_entry(ResourceTag tag, Hash hash, size_t *size, void *buffer, PayloadReadFlags flags) override
+	{
+		flags |= PAYLOAD_READ_CONCURRENT_BIT;
+		if (serialize)
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			return input.read_entry(tag, hash, size, buffer, flags);
+		}
+		else
+			return input.read_entry(tag, hash, size, buffer, flags);
+	}
+
+	bool write_entry(ResourceTag, Hash, const void *, size_t, PayloadWriteFlags) override
+	{
+		return false;
+	}
+
+	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		return input.has_entry(tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+	{
+		return input.get_hash_list_for_resource_tag(tag, num_hashes, hashes);
+	}
+
+	void flush() override
+	{
+	}
+
+	DatabaseInterface &input;
+	bool serialize;
+	std::mutex lock;
+};
+
+// Entries written here are queued up for the writer thread as soon as possible.
+struct UnorderedSink : DatabaseInterface
+{
+	explicit UnorderedSink(TransformRunner &runner_)
+		: runner(runner_)
+	{
+	}
+
+	bool prepare() override
+	{
+		return true;
+	}
+
+	bool read_entry(ResourceTag, Hash, size_t *, void *, PayloadReadFlags) override
+	{
+		return false;
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override;
+	bool has_entry(ResourceTag tag, Hash hash) override;
+
+	bool get_hash_list_for_resource_tag(ResourceTag, size_t *, Hash *) override
+	{
+		return false;
+	}
+
+	void flush() override
+	{
+	}
+
+	TransformRunner &runner;
+};
+
+struct TransformRunner
+{
+	struct Job
+	{
+		ResourceTag tag;
+		Hash hash;
+	};
+
+	struct Slot
+	{
+		std::vector<DatabaseTransformOutput::Entry> entries;
+		bool ready = false;
+	};
+
+	TransformRunner(DatabaseInterface &input_, DatabaseInterface &output_,
+	                DatabaseTransform &transform_, bool serialize_reads)
+		: input(input_, serialize_reads), output(output_), transform(transform_), sink(*this)
+	{
+	}
+
+	bool gather_jobs(const ResourceTag *tags, size_t num_tags, std::vector<Job> &out_jobs)
+	{
+		for (size_t i = 0; i < num_tags; i++)
+		{
+			size_t hash_count = 0;
+			if (!input.input.get_hash_list_for_resource_tag(tags[i], &hash_count, nullptr))
+				return false;
+			std::vector<Hash> hashes(hash_count);
+			if (!input.input.get_hash_list_for_resource_tag(tags[i], &hash_count, hashes.data()))
+				return false;
+
+			// Not all backends sort the hash list.
+			std::sort(hashes.begin(), hashes.end());
+			for (auto hash : hashes)
+				out_jobs.push_back({ tags[i], hash });
+		}
+		return true;
+	}
+
+	bool read_job(const Job &job, std::vector<uint8_t> &buffer)
+	{
+		size_t size = 0;
+		if (!input.read_entry(job.tag, job.hash, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+		{
+			LOGE("Failed to read entry (tag: %d, hash: %016" PRIx64 ").\n", int(job.tag), job.hash);
+			return false;
+		}
+
+		buffer.resize(size);
+		if (!input.read_entry(job.tag, job.hash, &size, buffer.data(), PAYLOAD_READ_NO_FLAGS))
+		{
+			LOGE("Failed to read entry (tag: %d, hash: %016" PRIx64 ").\n", int(job.tag), job.hash);
+			return false;
+		}
+		return true;
+	}
+
+	bool read_shared_entries(const ResourceTag *tags, size_t num_tags)
+	{
+		if (!gather_jobs(tags, num_tags, shared_jobs))
+			return false;
+
+		shared_blobs.resize(shared_jobs.size());
+		for (size_t i = 0; i < shared_jobs.size(); i++)
+			if (!read_job(shared_jobs[i], shared_blobs[i]))
+				return false;
+		return true;
+	}
+
+	bool replay_shared_entries(unsigned worker_index)
+	{
+		for (size_t i = 0; i < shared_jobs.size(); i++)
+		{
+			auto &job = shared_jobs[i];
+			auto &blob = shared_blobs[i];
+			if (!transform.shared_entry(worker_index, job.tag, job.hash, blob.data(), blob.size()))
+				return false;
+		}
+		return true;
+	}
+
+	void fail()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		failed = true;
+		cond.notify_all();
+	}
+
+	bool process_job(unsigned worker_index, size_t index, std::vector<uint8_t> &buffer)
+	{
+		auto &job = jobs[index];
+		if (!read_job(job, buffer))
+			return false;
+
+		DatabaseTransformOutput result;
+		if (!transform.transform_entry(worker_index, job.tag, job.hash, buffer.data(), buffer.size(), result))
+			return false;
+
+		std::lock_guard<std::mutex> holder{lock};
+		auto &slot = slots[index % slots.size()];
+		slot.entries = std::move(result.entries);
+		slot.ready = true;
+		cond.notify_all();
+		return true;
+	}
+
+	void worker(unsigned worker_index)
+	{
+		std::vector<uint8_t> buffer;
+		bool ok = transform.init_worker(worker_index, input, sink) && replay_shared_entries(worker_index);
+
+		while (ok)
+		{
+			size_t index = next_job.fetch_add(1, std::memory_order_relaxed);
+			if (index >= jobs.size())
+				break;
+
+			// Don't run further ahead of the writer than there are slots.
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [&]() { return failed || index < next_write + slots.size(); });
+				if (failed)
+					break;
+			}
+
+			ok = process_job(worker_index, index, buffer);
+		}
+
+		// Always let the worker clean up, recording threads must be torn down.
+		if (!transform.end_worker(worker_index))
+			ok = false;
+
+		if (!ok)
+			fail();
+
+		std::lock_guard<std::mutex> holder{lock};
+		active_workers--;
+		cond.notify_all();
+	}
+
+	// Called with lock held. Deduplicates against everything written or queued so far.
+	bool claim_hash(ResourceTag tag, Hash hash)
+	{
+		return claimed[tag].insert(hash).second;
+	}
+
+	bool write_entry(const DatabaseTransformOutput::Entry &entry)
+	{
+		if (output.has_entry(entry.tag, entry.hash))
+			return true;
+
+		if (!output.write_entry(entry.tag, entry.hash, entry.blob.data(), entry.blob.size(), entry.flags))
+		{
+			LOGE("Failed to write entry (tag: %d, hash: %016" PRIx64 ").\n", int(entry.tag), entry.hash);
+			return false;
+		}
+		return true;
+	}
+
+	bool run_writer()
+	{
+		std::unique_lock<std::mutex> holder{lock};
+
+		for (;;)
+		{
+			cond.wait(holder, [&]() {
+				return failed || !queued.empty() || active_workers == 0 ||
+				       (next_write < jobs.size() && slots[next_write % slots.size()].ready);
+			});
+
+			if (failed)
+				return false;
+
+			while (!queued.empty())
+			{
+				auto entry = std::move(queued.front());
+				queued.pop_front();
+				cond.notify_all();
+
+				holder.unlock();
+				bool ok = write_entry(entry);
+				holder.lock();
+				if (!ok)
+				{
+					failed = true;
+					cond.notify_all();
+					return false;
+				}
+			}
+
+			while (next_write < jobs.size() && slots[next_write % slots.size()].ready)
+			{
+				auto &slot = slots[next_write % slots.size()];
+				auto entries = std::move(slot.entries);
+				slot.entries.clear();
+				slot.ready = false;
+				next_write++;
+				cond.notify_all();
+
+				for (auto &entry : entries)
+				{
+					if (!claim_hash(entry.tag, entry.hash))
+						continue;
+
+					holder.unlock();
+					bool ok = write_entry(entry);
+					holder.lock();
+					if (!ok)
+					{
+						failed = true;
+						cond.notify_all();
+						return false;
+					}
+				}
+			}
+
+			if (active_workers == 0 && queued.empty())
+				return next_write == jobs.size();
+		}
+	}
+
+	bool run(unsigned num_threads)
+	{
+		if (jobs.empty() && shared_jobs.empty())
+			return true;
+
+		if (num_threads == 0)
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		num_threads = unsigned(std::min<size_t>(num_threads, std::max<size_t>(jobs.size(), 1)));
+
+		slots.resize(size_t(num_threads) * OrderedWindowPerThread);
+		active_workers = num_threads;
+
+		std::vector<std::thread> workers;
+		workers.reserve(num_threads);
+		for (unsigned i = 0; i < num_threads; i++)
+			workers.emplace_back(&TransformRunner::worker, this, i);
+
+		bool ret = run_writer();
+		if (!ret)
+			fail();
+
+		for (auto &w : workers)
+			w.join();
+
+		output.flush();
+		return ret;
+	}
+
+	ConcurrentInput input;
+	DatabaseInterface &output;
+	DatabaseTransform &transform;
+	UnorderedSink sink;
+
+	std::vector<Job> jobs;
+	std::vector<Job> shared_jobs;
+	std::vector<std::vector<uint8_t>> shared_blobs;
+	std::atomic<size_t> next_job{0};
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<Slot> slots;
+	size_t next_write = 0;
+	unsigned active_workers = 0;
+	bool failed = false;
+	std::deque<DatabaseTransformOutput::Entry> queued;
+	std::unordered_set<Hash> claimed[RESOURCE_COUNT];
+};
+
+bool UnorderedSink::write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags)
+{
+	DatabaseTransformOutput::Entry entry;
+	entry.tag = tag;
+	entry.hash = hash;
+	entry.flags = flags;
+
+	std::unique_lock<std::mutex> holder{runner.lock};
+	if (runner.failed)
+		return false;
+	if (!runner.claim_hash(tag, hash))
+		return true;
+
+	// Copy outside the lock, the hash is claimed now.
+	holder.unlock();
+	entry.blob.resize(size);
+	if (size)
+		memcpy(entry.blob.data(), blob, size);
+	holder.lock();
+
+	runner.cond.wait(holder, [&]() { return runner.failed || runner.queued.size() < MaxQueuedSinkEntries; });
+	if (runner.failed)
+		return false;
+
+	runner.queued.push_back(std::move(entry));
+	runner.cond.notify_all();
+	return true;
+}
+
+bool UnorderedSink::has_entry(ResourceTag tag, Hash hash)
+{
+	std::lock_guard<std::mutex> holder{runner.lock};
+	return runner.claimed[tag].count(hash) != 0;
+}
+}
+
+bool run_database_transform(DatabaseInterface &input, DatabaseInterface &output,
+                            DatabaseTransform &transform, const DatabaseTransformOptions &options)
+{
+	TransformRunner runner(input, output, transform, options.serialize_input_reads);
+	if (!runner.gather_jobs(options.tags, options.num_tags, runner.jobs))
+	{
+		LOGE("Failed to get hash list from input database.\n");
+		return false;
+	}
+
+	if (!runner.read_shared_entries(options.shared_tags, options.num_shared_tags))
+	{
+		LOGE("Failed to read shared entries from input database.\n");
+		return false;
+	}
+
+	return runner.run(options.num_threads);
+}
+}
@@ -0,0 +1,96 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize_db.hpp"
+#include <vector>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Collects the entries a transform produces for a single input entry.
+// They are written to the output database in input order once all earlier entries are done.
+class DatabaseTransformOutput
+{
+public:
+	void write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags);
+
+	struct Entry
+	{
+		ResourceTag tag;
+		Hash hash;
+		PayloadWriteFlags flags;
+		std::vector<uint8_t> blob;
+	};
+	std::vector<Entry> entries;
+};
+
+class DatabaseTransform
+{
+public:
+	virtual ~DatabaseTransform() = default;
+
+	// Called on each worker thread before it processes any entries.
+	// input can be used as a StateReplayer resolver from the worker.
+	// Entries written to sink go straight to the output database in no particular order.
+	// It is meant for StateRecorder recording threads, which cannot be ordered.
+	virtual bool init_worker(unsigned worker_index, DatabaseInterface &input, DatabaseInterface &sink);
+
+	// Called on every worker after init_worker() for every entry of the shared tags, in order.
+	// This is for state which every worker needs to have seen, e.g. layouts a StateReplayer cannot resolve on its own.
+	virtual bool shared_entry(unsigned worker_index, ResourceTag tag, Hash hash, const void *blob, size_t size);
+
+	// Called concurrently from all workers, once for every input entry.
+	virtual bool transform_entry(unsigned worker_index, ResourceTag tag, Hash hash,
+	                             const void *blob, size_t size, DatabaseTransformOutput &output) = 0;
+
+	// Called on each worker thread after all entries are processed.
+	// Any writes to sink must be complete on return.
+	virtual bool end_worker(unsigned worker_index);
+};
+
+struct DatabaseTransformOptions
+{
+	// Entries are processed tag by tag in this order, hashes sorted within a tag.
+	const ResourceTag *tags = nullptr;
+	size_t num_tags = 0;
+
+	// Read once up front and passed to every worker through shared_entry().
+	const ResourceTag *shared_tags = nullptr;
+	size_t num_shared_tags = 0;
+
+	// 0 uses one worker per CPU core.
+	unsigned num_threads = 0;
+
+	// Zip archives cannot be read concurrently, other backends can.
+	bool serialize_input_reads = false;
+};
+
+// Reads every entry of input on a pool of workers, and writes the results to output from the calling thread.
+// Ordered output is identical for any thread count. Hashes which are already in output are not written again.
+bool run_database_transform(DatabaseInterface &input, DatabaseInterface &output,
+                            DatabaseTransform &transform, const DatabaseTransformOptions &options);
+
+// Whether reads from the database at path must be serialized.
+bool database_transform_needs_serialized_reads(const char *path);
+}
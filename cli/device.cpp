@@ -302,7 +302,31 @@ bool VulkanDevice::init_device(const Options &opts)
 		return strcmp(ext, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME) == 0;
 	}) != end(active_device_extensions);
 
+	// The extension is only useful with its feature enabled, and querying that needs Vulkan 1.1.
+	VkPhysicalDevicePipelineCreationCacheControlFeaturesEXT cache_control_features = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_CREATION_CACHE_CONTROL_FEATURES_EXT
+	};
+	auto cache_control_itr = find_if(begin(active_device_extensions), end(active_device_extensions), [](const char *ext) {
+		return strcmp(ext, VK_EXT_PIPELINE_CREATION_CACHE_CONTROL_EXTENSION_NAME) == 0;
+	});
+
+	if (cache_control_itr != end(active_device_extensions))
+	{
+		if (api_version >= VK_API_VERSION_1_1)
+		{
+			VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+			features2.pNext = &cache_control_features;
+			vkGetPhysicalDeviceFeatures2(gpu, &features2);
+		}
+
+		supports_pipeline_cache_control = cache_control_features.pipelineCreationCacheControl == VK_TRUE;
+		if (!supports_pipeline_cache_control)
+			active_device_extensions.erase(cache_control_itr);
+	}
+
 	VkDeviceCreateInfo device_info = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
+	if (supports_pipeline_cache_control)
+		device_info.pNext = &cache_control_features;
 	// FIXME: Use physical_device_features2.
 	device_info.pEnabledFeatures = &gpu_features;
 	device_info.pQueueCreateInfos = &queue_info;
@@ -471,6 +495,12 @@ get_pipeline_cache_data(VkDevice, VkPipelineCache, size_t *, void *)
 	return VK_ERROR_OUT_OF_HOST_MEMORY;
 }
 
+static VKAPI_ATTR VkResult VKAPI_CALL
+merge_pipeline_caches(VkDevice, VkPipelineCache, uint32_t, const VkPipelineCache *)
+{
+	return VK_SUCCESS;
+}
+
 static VKAPI_ATTR void VKAPI_CALL
 get_physical_device_properties(VkPhysicalDevice, VkPhysicalDeviceProperties *props)
 {
@@ -501,6 +531,7 @@ void VulkanDevice::init_null_device()
 	vkCreatePipelineCache = create_pipeline_cache;
 	vkDestroyPipelineCache = destroy_pipeline_cache;
 	vkGetPipelineCacheData = get_pipeline_cache_data;
+	vkMergePipelineCaches = merge_pipeline_caches;
 	vkGetPhysicalDeviceProperties = get_physical_device_properties;
 	is_null_device = true;
 }
@@ -24,6 +24,21 @@
 
 #include "volk.h"
 
+// VK_EXT_pipeline_creation_cache_control is newer than the Vulkan headers we ship.
+#ifndef VK_EXT_pipeline_creation_cache_control
+#define VK_EXT_pipeline_creation_cache_control 1
+#define VK_EXT_PIPELINE_CREATION_CACHE_CONTROL_EXTENSION_NAME "VK_EXT_pipeline_creation_cache_control"
+static const VkStructureType VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_CREATION_CACHE_CONTROL_FEATURES_EXT = VkStructureType(1000297000);
+static const VkPipelineCreateFlags VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT = 0x00000100;
+static const VkResult VK_PIPELINE_COMPILE_REQUIRED_EXT = VkResult(1000297000);
+typedef struct VkPhysicalDevicePipelineCreationCacheControlFeaturesEXT
+{
+	VkStructureType sType;
+	void *pNext;
+	VkBool32 pipelineCreationCacheControl;
+} VkPhysicalDevicePipelineCreationCacheControlFeaturesEXT;
+#endif
+
 namespace Fossilize
 {
 class VulkanDevice
@@ -68,6 +83,12 @@ public:
 		return supports_pipeline_feedback;
 	}
 
+	// Pipelines can be created with VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT.
+	bool pipeline_cache_control_enabled() const
+	{
+		return supports_pipeline_cache_control;
+	}
+
 private:
 	VkInstance instance = VK_NULL_HANDLE;
 	VkPhysicalDevice gpu = VK_NULL_HANDLE;
@@ -78,6 +99,7 @@ private:
 	void (*validation_callback)(void *) = nullptr;
 	void *validation_callback_userdata = nullptr;
 	bool supports_pipeline_feedback = false;
+	bool supports_pipeline_cache_control = false;
 
 	void init_null_device();
 	bool is_null_device = false;
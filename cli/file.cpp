@@ -22,6 +22,15 @@
 
 #include "file.hpp"
 #include <stdio.h>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace Fossilize
 {
@@ -76,4 +85,40 @@ bool write_buffer_to_file(const char *path, const void *data, size_t size)
 	fclose(file);
 	return true;
 }
+
+bool write_buffer_to_file_atomic(const char *path, const void *data, size_t size)
+{
+	std::string tmp_path = path;
+	tmp_path += ".tmp";
+
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ret = fwrite(data, 1, size, file) == size && fflush(file) == 0;
+
+	// Make sure the data is on disk before the rename, or a crash could leave us with an empty file.
+#ifdef _WIN32
+	if (ret)
+		ret = _commit(_fileno(file)) == 0;
+#else
+	if (ret)
+		ret = fsync(fileno(file)) == 0;
+#endif
+
+	if (fclose(file) != 0)
+		ret = false;
+
+#ifdef _WIN32
+	if (ret)
+		ret = MoveFileExA(tmp_path.c_str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	if (ret)
+		ret = rename(tmp_path.c_str(), path) == 0;
+#endif
+
+	if (!ret)
+		remove(tmp_path.c_str());
+	return ret;
+}
 }
@@ -31,4 +31,8 @@ namespace Fossilize
 std::vector<uint8_t> load_buffer_from_file(const char *path);
 bool write_string_to_file(const char *path, const char *text);
 bool write_buffer_to_file(const char *path, const void *data, size_t size);
+
+// Writes to a temporary file next to path, which then replaces path.
+// Readers and crashes only ever see the old or the new contents.
+bool write_buffer_to_file_atomic(const char *path, const void *data, size_t size);
 }
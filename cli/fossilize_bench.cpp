@@ -23,12 +23,31 @@
 #include "fossilize.hpp"
 #include "fossilize_db.hpp"
 #include "layer/utils.hpp"
+#include "cli_parser.hpp"
+#include "device.hpp"
+#include "database_transform.hpp"
+#include "path.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <memory>
 #include <random>
+#include <string>
+#include <thread>
 #include <vector>
+#include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
 using namespace Fossilize;
 
 static void bench_recorder(const char *path, bool compressed, bool checksum)
@@ -286,7 +305,7 @@ static bool dummy_replay_archive(const char *path)
 				return EXIT_FAILURE;
 			}
 
-			if (!state_replayer.parse(replayer, nullptr, state_json.data(), state_json.size()))
+			if (!state_replayer.parse(replayer, iface.get(), state_json.data(), state_json.size()))
 				LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
 		}
 	}
@@ -294,7 +313,1095 @@ static bool dummy_replay_archive(const char *path)
 	return true;
 }
 
-int main()
+static double elapsed_ms(std::chrono::steady_clock::time_point begin_time)
+{
+	auto end_time = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count() * 1e-6;
+}
+
+// Creates real objects through the --null-device entry points, so replay pays for handle allocation
+// like fossilize-replay --null-device does, without a driver in the way.
+struct NullDeviceCreator : StateCreatorInterface
+{
+	explicit NullDeviceCreator(VkDevice device_)
+		: device(device_)
+	{
+	}
+
+	~NullDeviceCreator()
+	{
+		for (auto sampler : samplers)
+			vkDestroySampler(device, sampler, nullptr);
+		for (auto layout : set_layouts)
+			vkDestroyDescriptorSetLayout(device, layout, nullptr);
+		for (auto layout : pipeline_layouts)
+			vkDestroyPipelineLayout(device, layout, nullptr);
+		for (auto module : shader_modules)
+			vkDestroyShaderModule(device, module, nullptr);
+		for (auto pass : render_passes)
+			vkDestroyRenderPass(device, pass, nullptr);
+		for (auto pipeline : pipelines)
+			vkDestroyPipeline(device, pipeline, nullptr);
+	}
+
+	NullDeviceCreator(const NullDeviceCreator &) = delete;
+	void operator=(const NullDeviceCreator &) = delete;
+
+	bool enqueue_create_sampler(Hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
+	{
+		if (vkCreateSampler(device, create_info, nullptr, sampler) != VK_SUCCESS)
+			return false;
+		samplers.push_back(*sampler);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash, const VkDescriptorSetLayoutCreateInfo *create_info,
+	                                          VkDescriptorSetLayout *layout) override
+	{
+		if (vkCreateDescriptorSetLayout(device, create_info, nullptr, layout) != VK_SUCCESS)
+			return false;
+		set_layouts.push_back(*layout);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash, const VkPipelineLayoutCreateInfo *create_info,
+	                                    VkPipelineLayout *layout) override
+	{
+		if (vkCreatePipelineLayout(device, create_info, nullptr, layout) != VK_SUCCESS)
+			return false;
+		pipeline_layouts.push_back(*layout);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		if (vkCreateShaderModule(device, create_info, nullptr, module) != VK_SUCCESS)
+			return false;
+		shader_modules.push_back(*module);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
+	{
+		if (vkCreateRenderPass(device, create_info, nullptr, render_pass) != VK_SUCCESS)
+			return false;
+		render_passes.push_back(*render_pass);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, create_info, nullptr, pipeline) != VK_SUCCESS)
+			return false;
+		pipelines.push_back(*pipeline);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, create_info, nullptr, pipeline) != VK_SUCCESS)
+			return false;
+		pipelines.push_back(*pipeline);
+		return true;
+	}
+
+	VkDevice device;
+	std::vector<VkSampler> samplers;
+	std::vector<VkDescriptorSetLayout> set_layouts;
+	std::vector<VkPipelineLayout> pipeline_layouts;
+	std::vector<VkShaderModule> shader_modules;
+	std::vector<VkRenderPass> render_passes;
+	std::vector<VkPipeline> pipelines;
+};
+
+// Output of the threaded runs, nothing is kept.
+struct DiscardDatabase : DatabaseInterface
+{
+	bool prepare() override
+	{
+		return true;
+	}
+
+	bool read_entry(ResourceTag, Hash, size_t *, void *, PayloadReadFlags) override
+	{
+		return false;
+	}
+
+	bool write_entry(ResourceTag, Hash, const void *, size_t, PayloadWriteFlags) override
+	{
+		return true;
+	}
+
+	bool has_entry(ResourceTag, Hash) override
+	{
+		return false;
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag, size_t *, Hash *) override
+	{
+		return false;
+	}
+
+	void flush() override
+	{
+	}
+};
+
+// Does no work per entry, so the run time is reading plus the cost of the scheduler itself.
+struct ScheduleTransform : DatabaseTransform
+{
+	bool transform_entry(unsigned, ResourceTag, Hash, const void *, size_t, DatabaseTransformOutput &) override
+	{
+		return true;
+	}
+};
+
+struct ReplayTransform : DatabaseTransform
+{
+	struct Worker
+	{
+		explicit Worker(VkDevice device)
+			: creator(device)
+		{
+		}
+
+		NullDeviceCreator creator;
+		StateReplayer replayer;
+		DatabaseInterface *resolver = nullptr;
+	};
+
+	bool init_worker(unsigned worker_index, DatabaseInterface &input, DatabaseInterface &) override
+	{
+		workers[worker_index]->resolver = &input;
+		return true;
+	}
+
+	bool shared_entry(unsigned worker_index, ResourceTag, Hash, const void *blob, size_t size) override
+	{
+		auto &worker = *workers[worker_index];
+		return worker.replayer.parse(worker.creator, worker.resolver, blob, size);
+	}
+
+	bool transform_entry(unsigned worker_index, ResourceTag, Hash, const void *blob, size_t size,
+	                     DatabaseTransformOutput &) override
+	{
+		auto &worker = *workers[worker_index];
+		return worker.replayer.parse(worker.creator, worker.resolver, blob, size);
+	}
+
+	std::vector<std::unique_ptr<Worker>> workers;
+};
+
+static const char *bench_tag_names[RESOURCE_COUNT] = {
+	"AppInfo",
+	"Sampler",
+	"Descriptor Set Layout",
+	"Pipeline Layout",
+	"Shader Module",
+	"Render Pass",
+	"Graphics Pipeline",
+	"Compute Pipeline",
+	"Application Blob Link",
+	"Graphics Pipeline State",
+	"Usage Metadata",
+};
+
+// Same order fossilize-replay uses. Trivial objects first, then everything which refers to them.
+static const ResourceTag parse_order[] = {
+	RESOURCE_APPLICATION_INFO,
+	RESOURCE_SHADER_MODULE,
+	RESOURCE_SAMPLER,
+	RESOURCE_DESCRIPTOR_SET_LAYOUT,
+	RESOURCE_PIPELINE_LAYOUT,
+	RESOURCE_RENDER_PASS,
+	RESOURCE_GRAPHICS_PIPELINE_STATE,
+	RESOURCE_GRAPHICS_PIPELINE,
+	RESOURCE_COMPUTE_PIPELINE,
+};
+
+// Objects which a StateReplayer cannot pull in through the resolver.
+static const ResourceTag static_order[] = {
+	RESOURCE_SAMPLER,
+	RESOURCE_DESCRIPTOR_SET_LAYOUT,
+	RESOURCE_PIPELINE_LAYOUT,
+	RESOURCE_RENDER_PASS,
+};
+
+static const ResourceTag threaded_order[] = {
+	RESOURCE_SHADER_MODULE,
+	RESOURCE_GRAPHICS_PIPELINE,
+	RESOURCE_COMPUTE_PIPELINE,
+};
+
+struct BenchOptions
+{
+	std::string database;
+	std::string json_path;
+	std::string scratch_directory = ".";
+	unsigned iterations = 3;
+	unsigned max_threads = 0;
+	unsigned entries = 10000;
+	unsigned payload_size = 4096;
+};
+
+struct TagResult
+{
+	std::vector<Hash> hashes;
+	std::vector<std::vector<uint8_t>> blobs;
+	uint64_t stored_bytes = 0;
+	uint64_t uncompressed_bytes = 0;
+	bool has_stored_size = false;
+	double read_ms = 0.0;
+	double raw_read_ms = -1.0;
+	double parse_ms = -1.0;
+	unsigned parse_failures = 0;
+};
+
+struct ThreadResult
+{
+	unsigned threads;
+	double schedule_ms;
+	double replay_ms;
+};
+
+static bool read_tag(DatabaseInterface &db, ResourceTag tag, const std::vector<Hash> &hashes,
+                     PayloadReadFlags flags, std::vector<std::vector<uint8_t>> *blobs)
+{
+	std::vector<uint8_t> blob;
+	for (size_t i = 0; i < hashes.size(); i++)
+	{
+		auto &target = blobs ? (*blobs)[i] : blob;
+		size_t size = 0;
+		if (!db.read_entry(tag, hashes[i], &size, nullptr, flags))
+			return false;
+		target.resize(size);
+		if (!db.read_entry(tag, hashes[i], &size, target.data(), flags))
+			return false;
+	}
+	return true;
+}
+
+static bool bench_read(DatabaseInterface &db, const BenchOptions &opts, TagResult *results)
+{
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		auto &result = results[i];
+
+		size_t hash_count = 0;
+		if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		result.hashes.resize(hash_count);
+		if (!db.get_hash_list_for_resource_tag(tag, &hash_count, result.hashes.data()))
+			return false;
+		result.blobs.resize(hash_count);
+
+		result.has_stored_size = true;
+		for (auto hash : result.hashes)
+		{
+			DatabaseEntryInfo info;
+			if (!db.get_entry_info(tag, hash, &info))
+			{
+				result.has_stored_size = false;
+				break;
+			}
+			result.stored_bytes += info.stored_size;
+		}
+
+		result.read_ms = 1e30;
+		for (unsigned iter = 0; iter < opts.iterations; iter++)
+		{
+			auto begin_time = std::chrono::steady_clock::now();
+			// Keep the last round around for the parse benchmarks.
+			if (!read_tag(db, tag, result.hashes, 0, iter + 1 == opts.iterations ? &result.blobs : nullptr))
+			{
+				LOGE("Failed to read %s entries.\n", bench_tag_names[tag]);
+				return false;
+			}
+			result.read_ms = std::min(result.read_ms, elapsed_ms(begin_time));
+		}
+
+		for (auto &blob : result.blobs)
+			result.uncompressed_bytes += blob.size();
+
+		// Raw reads skip decompression, so the difference is what decompression costs.
+		// Only Fossilize archives support them.
+		double raw_ms = 1e30;
+		for (unsigned iter = 0; iter < opts.iterations && raw_ms >= 0.0; iter++)
+		{
+			auto begin_time = std::chrono::steady_clock::now();
+			if (read_tag(db, tag, result.hashes, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT, nullptr))
+				raw_ms = std::min(raw_ms, elapsed_ms(begin_time));
+			else
+				raw_ms = -1.0;
+		}
+		result.raw_read_ms = raw_ms;
+	}
+
+	return true;
+}
+
+static void bench_parse(DatabaseInterface &db, VkDevice device, const BenchOptions &opts, TagResult *results)
+{
+	for (unsigned iter = 0; iter < opts.iterations; iter++)
+	{
+		NullDeviceCreator creator(device);
+		StateReplayer replayer;
+
+		for (auto tag : parse_order)
+		{
+			auto &result = results[tag];
+			unsigned failures = 0;
+
+			auto begin_time = std::chrono::steady_clock::now();
+			for (auto &blob : result.blobs)
+				if (!replayer.parse(creator, &db, blob.data(), blob.size()))
+					failures++;
+			double ms = elapsed_ms(begin_time);
+
+			result.parse_ms = result.parse_ms < 0.0 ? ms : std::min(result.parse_ms, ms);
+			result.parse_failures = failures;
+		}
+	}
+}
+
+// Parse pipelines in a replayer which has only seen the static objects,
+// so every shader module and pipeline state is pulled in through the resolver.
+static double bench_resolve(DatabaseInterface &db, VkDevice device, const BenchOptions &opts,
+                            const TagResult *results, unsigned *failures)
+{
+	double best_ms = 1e30;
+	for (unsigned iter = 0; iter < opts.iterations; iter++)
+	{
+		NullDeviceCreator creator(device);
+		StateReplayer replayer;
+		*failures = 0;
+
+		for (auto tag : static_order)
+			for (auto &blob : results[tag].blobs)
+				if (!replayer.parse(creator, &db, blob.data(), blob.size()))
+					(*failures)++;
+
+		auto begin_time = std::chrono::steady_clock::now();
+		for (auto tag : { RESOURCE_GRAPHICS_PIPELINE, RESOURCE_COMPUTE_PIPELINE })
+			for (auto &blob : results[tag].blobs)
+				if (!replayer.parse(creator, &db, blob.data(), blob.size()))
+					(*failures)++;
+		best_ms = std::min(best_ms, elapsed_ms(begin_time));
+	}
+	return best_ms;
+}
+
+static bool bench_threads(DatabaseInterface &db, VkDevice device, const BenchOptions &opts,
+                          std::vector<ThreadResult> &thread_results)
+{
+	unsigned max_threads = opts.max_threads ? opts.max_threads : std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<unsigned> thread_counts;
+	for (unsigned count = 1; count < max_threads; count *= 2)
+		thread_counts.push_back(count);
+	thread_counts.push_back(max_threads);
+
+	DatabaseTransformOptions options;
+	options.tags = threaded_order;
+	options.num_tags = sizeof(threaded_order) / sizeof(threaded_order[0]);
+	options.shared_tags = static_order;
+	options.num_shared_tags = sizeof(static_order) / sizeof(static_order[0]);
+	options.serialize_input_reads = database_transform_needs_serialized_reads(opts.database.c_str());
+
+	for (auto count : thread_counts)
+	{
+		ThreadResult result = { count, 1e30, 1e30 };
+		options.num_threads = count;
+
+		for (unsigned iter = 0; iter < opts.iterations; iter++)
+		{
+			DiscardDatabase output;
+			ScheduleTransform schedule;
+			auto begin_time = std::chrono::steady_clock::now();
+			if (!run_database_transform(db, output, schedule, options))
+				return false;
+			result.schedule_ms = std::min(result.schedule_ms, elapsed_ms(begin_time));
+
+			ReplayTransform replay;
+			for (unsigned i = 0; i < count; i++)
+				replay.workers.emplace_back(new ReplayTransform::Worker(device));
+			begin_time = std::chrono::steady_clock::now();
+			if (!run_database_transform(db, output, replay, options))
+				return false;
+			result.replay_ms = std::min(result.replay_ms, elapsed_ms(begin_time));
+		}
+
+		LOGI("[THREADS %u] schedule: %.3f ms, replay: %.3f ms\n", count, result.schedule_ms, result.replay_ms);
+		thread_results.push_back(result);
+	}
+
+	return true;
+}
+
+static double per_second(double count, double ms)
+{
+	return ms > 0.0 ? count * 1000.0 / ms : 0.0;
+}
+
+static void write_json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fputc('\\', file);
+		fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+static FILE *open_json_output(const BenchOptions &opts)
+{
+	if (opts.json_path.empty())
+		return stdout;
+
+	FILE *file = fopen(opts.json_path.c_str(), "w");
+	if (!file)
+		LOGE("Failed to open %s for writing.\n", opts.json_path.c_str());
+	return file;
+}
+
+static void write_replay_json(FILE *file, const BenchOptions &opts, double prepare_ms,
+                              const TagResult *results, double resolve_ms, unsigned resolve_failures,
+                              const std::vector<ThreadResult> &thread_results)
+{
+	fprintf(file, "{\n\t\"database\": ");
+	write_json_string(file, opts.database.c_str());
+	fprintf(file, ",\n\t\"iterations\": %u,\n", opts.iterations);
+	fprintf(file, "\t\"prepare_ms\": %.3f,\n", prepare_ms);
+
+	fprintf(file, "\t\"tags\": [\n");
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto &result = results[i];
+		fprintf(file, "\t\t{ \"tag\": \"%s\", \"count\": %u, \"uncompressed_bytes\": %" PRIu64,
+		        bench_tag_names[i], unsigned(result.hashes.size()), result.uncompressed_bytes);
+		if (result.has_stored_size)
+			fprintf(file, ", \"stored_bytes\": %" PRIu64, result.stored_bytes);
+
+		fprintf(file, ", \"read_ms\": %.3f, \"read_mb_per_s\": %.3f", result.read_ms,
+		        per_second(result.uncompressed_bytes * 1e-6, result.read_ms));
+		if (result.raw_read_ms >= 0.0)
+		{
+			double decompress_ms = std::max(result.read_ms - result.raw_read_ms, 0.0);
+			fprintf(file, ", \"raw_read_ms\": %.3f, \"decompress_ms\": %.3f, \"decompress_mb_per_s\": %.3f",
+			        result.raw_read_ms, decompress_ms,
+			        per_second(result.uncompressed_bytes * 1e-6, decompress_ms));
+		}
+
+		if (result.parse_ms >= 0.0)
+		{
+			fprintf(file, ", \"parse_ms\": %.3f, \"parse_per_s\": %.1f, \"parse_mb_per_s\": %.3f, \"parse_failures\": %u",
+			        result.parse_ms, per_second(double(result.hashes.size()), result.parse_ms),
+			        per_second(result.uncompressed_bytes * 1e-6, result.parse_ms), result.parse_failures);
+		}
+		fprintf(file, " }%s\n", i + 1 < RESOURCE_COUNT ? "," : "");
+	}
+	fprintf(file, "\t],\n");
+
+	// Pipelines parsed with all dependencies in place versus pulling them in through the resolver.
+	double eager_ms = results[RESOURCE_GRAPHICS_PIPELINE].parse_ms + results[RESOURCE_COMPUTE_PIPELINE].parse_ms;
+	fprintf(file, "\t\"resolve\": { \"pipelines\": %u, \"eager_ms\": %.3f, \"lazy_ms\": %.3f, \"resolution_ms\": %.3f, "
+	              "\"lazy_failures\": %u },\n",
+	        unsigned(results[RESOURCE_GRAPHICS_PIPELINE].hashes.size() + results[RESOURCE_COMPUTE_PIPELINE].hashes.size()),
+	        eager_ms, resolve_ms, std::max(resolve_ms - eager_ms, 0.0), resolve_failures);
+
+	size_t threaded_entries = 0;
+	for (auto tag : threaded_order)
+		threaded_entries += results[tag].hashes.size();
+
+	// Overhead is what the scheduler costs on top of the work, efficiency is relative to one thread.
+	fprintf(file, "\t\"threads\": [\n");
+	for (size_t i = 0; i < thread_results.size(); i++)
+	{
+		auto &result = thread_results[i];
+		double efficiency = thread_results.front().replay_ms / (result.replay_ms * result.threads);
+		fprintf(file, "\t\t{ \"threads\": %u, \"entries\": %u, \"schedule_ms\": %.3f, \"schedule_us_per_entry\": %.3f, "
+		              "\"replay_ms\": %.3f, \"replay_per_s\": %.1f, \"efficiency\": %.3f }%s\n",
+		        result.threads, unsigned(threaded_entries), result.schedule_ms,
+		        threaded_entries ? 1000.0 * result.schedule_ms / double(threaded_entries) : 0.0,
+		        result.replay_ms, per_second(double(threaded_entries), result.replay_ms), efficiency,
+		        i + 1 < thread_results.size() ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+}
+
+static int run_replay_bench(const BenchOptions &opts)
+{
+	VulkanDevice device;
+	VulkanDevice::Options device_opts;
+	device_opts.null_device = true;
+	if (!device.init_device(device_opts))
+		return EXIT_FAILURE;
+
+	double prepare_ms = 1e30;
+	for (unsigned iter = 0; iter < opts.iterations; iter++)
+	{
+		auto begin_time = std::chrono::steady_clock::now();
+		auto db = std::unique_ptr<DatabaseInterface>(create_database(opts.database.c_str(), DatabaseMode::ReadOnly));
+		if (!db || !db->prepare())
+		{
+			LOGE("Failed to open database: %s\n", opts.database.c_str());
+			return EXIT_FAILURE;
+		}
+		prepare_ms = std::min(prepare_ms, elapsed_ms(begin_time));
+	}
+	LOGI("[PREPARE] %.3f ms\n", prepare_ms);
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_database(opts.database.c_str(), DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return EXIT_FAILURE;
+
+	TagResult results[RESOURCE_COUNT];
+	if (!bench_read(*db, opts, results))
+		return EXIT_FAILURE;
+	bench_parse(*db, device.get_device(), opts, results);
+
+	for (auto tag : parse_order)
+	{
+		LOGI("[%s] %u entries, read: %.3f ms, parse: %.3f ms\n", bench_tag_names[tag],
+		     unsigned(results[tag].hashes.size()), results[tag].read_ms, results[tag].parse_ms);
+	}
+
+	unsigned resolve_failures = 0;
+	double resolve_ms = bench_resolve(*db, device.get_device(), opts, results, &resolve_failures);
+	LOGI("[RESOLVE] %.3f ms\n", resolve_ms);
+
+	std::vector<ThreadResult> thread_results;
+	if (!bench_threads(*db, device.get_device(), opts, thread_results))
+		return EXIT_FAILURE;
+
+	FILE *file = open_json_output(opts);
+	if (!file)
+		return EXIT_FAILURE;
+
+	write_replay_json(file, opts, prepare_ms, results, resolve_ms, resolve_failures, thread_results);
+	if (file != stdout)
+		fclose(file);
+	return EXIT_SUCCESS;
+}
+
+enum class BackendKind
+{
+	File,
+	Folder,
+	Concurrent
+};
+
+struct BackendConfig
+{
+	const char *name;
+	// Relative to the scratch directory. The folder backend uses it as a directory.
+	const char *filename;
+	BackendKind kind;
+	DatabaseMode read_mode;
+	// Zip archives cannot be read from several threads at once.
+	bool concurrent_reads;
+};
+
+static const BackendConfig backend_configs[] = {
+	{ "stream", "bench_stream.foz", BackendKind::File, DatabaseMode::ReadOnly, true },
+	{ "stream-mmap", "bench_stream_mmap.foz", BackendKind::File, DatabaseMode::ReadOnlyMemoryMap, true },
+	{ "zip", "bench_zip.zip", BackendKind::File, DatabaseMode::ReadOnly, false },
+	{ "folder", "bench_folder", BackendKind::Folder, DatabaseMode::ReadOnly, true },
+	{ "concurrent", "bench_concurrent", BackendKind::Concurrent, DatabaseMode::ReadOnly, true },
+};
+
+struct CompressionConfig
+{
+	const char *name;
+	PayloadWriteFlags flags;
+};
+
+static const CompressionConfig compression_configs[] = {
+	{ "none", 0 },
+	{ "deflate", PAYLOAD_WRITE_COMPRESS_BIT },
+	{ "deflate-best", PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_BEST_COMPRESSION_BIT },
+	{ "zstd", PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_ZSTD_BIT },
+	{ "zstd-best", PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_ZSTD_BIT | PAYLOAD_WRITE_BEST_COMPRESSION_BIT },
+	{ "lz4", PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_LZ4_BIT },
+	{ "lz4hc", PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_LZ4_BIT | PAYLOAD_WRITE_BEST_COMPRESSION_BIT },
+};
+
+static const char *bench_compression_names[DATABASE_COMPRESSION_COUNT] = {
+	"none",
+	"deflate",
+	"zstd",
+	"zstd+dictionary",
+	"lz4",
+	"unknown",
+};
+
+// What the layer writes with by default.
+static const PayloadWriteFlags backend_write_flags = PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+
+static const unsigned compression_payload_sizes[] = { 256, 1024, 4096, 16 * 1024, 64 * 1024 };
+
+// Caps how much data each compression run writes.
+static const size_t compression_bytes_per_run = 32 * 1024 * 1024;
+
+struct SyntheticPayloads
+{
+	std::vector<Hash> hashes;
+	std::vector<std::vector<uint8_t>> blobs;
+	uint64_t total_bytes = 0;
+};
+
+// Words from a narrow range like the SPIR-V in bench_recorder(), so payloads compress somewhat like real modules.
+// The top 16 bits of every hash are 0, which keeps the folder backend in a single shard directory.
+static SyntheticPayloads generate_payloads(unsigned count, unsigned payload_size, bool vary_size)
+{
+	SyntheticPayloads payloads;
+	std::mt19937 rnd(count ^ (payload_size << 8));
+	std::uniform_int_distribution<uint32_t> word_dist(1, 500);
+	std::uniform_int_distribution<unsigned> size_dist(payload_size / 2, payload_size + payload_size / 2);
+
+	payloads.hashes.reserve(count);
+	payloads.blobs.resize(count);
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		payloads.hashes.push_back((Hash(i + 1) << 16) | (rnd() & 0xffff));
+
+		unsigned size = vary_size ? size_dist(rnd) : payload_size;
+		std::vector<uint32_t> words((size + 3) / 4);
+		for (auto &w : words)
+			w = word_dist(rnd);
+		words[0] = i;
+
+		auto &blob = payloads.blobs[i];
+		blob.resize(words.size() * sizeof(uint32_t));
+		memcpy(blob.data(), words.data(), blob.size());
+		payloads.total_bytes += blob.size();
+	}
+
+	return payloads;
+}
+
+static void remove_directory(const std::string &path)
+{
+#ifdef _WIN32
+	RemoveDirectoryA(path.c_str());
+#else
+	rmdir(path.c_str());
+#endif
+}
+
+static void remove_backend_files(const BackendConfig &config, const std::string &path, const SyntheticPayloads &payloads)
+{
+	switch (config.kind)
+	{
+	case BackendKind::File:
+		remove(path.c_str());
+		break;
+
+	case BackendKind::Concurrent:
+		remove((path + ".1.foz").c_str());
+		break;
+
+	case BackendKind::Folder:
+	{
+		auto shard = Path::join(path, "00/00");
+		for (auto hash : payloads.hashes)
+		{
+			char filename[32];
+			snprintf(filename, sizeof(filename), "%02x.%016" PRIx64 ".json", unsigned(RESOURCE_SHADER_MODULE), hash);
+			remove(Path::join(shard, filename).c_str());
+		}
+		remove(Path::join(path, "fossilize_manifest.txt").c_str());
+		remove_directory(shard);
+		remove_directory(Path::join(path, "00"));
+		remove_directory(path);
+		break;
+	}
+	}
+}
+
+static DatabaseInterface *create_backend_database(const BackendConfig &config, const std::string &path, bool write)
+{
+	switch (config.kind)
+	{
+	case BackendKind::File:
+		return create_database(path.c_str(), write ? DatabaseMode::OverWrite : config.read_mode);
+
+	case BackendKind::Folder:
+		return create_dumb_folder_database(path.c_str(), write ? DatabaseMode::OverWrite : config.read_mode);
+
+	case BackendKind::Concurrent:
+	{
+		// Writes go to path.1.foz, which is then read back as an extra read-only database.
+		if (write)
+			return create_concurrent_database(path.c_str(), DatabaseMode::Append, nullptr, 0);
+		auto written_path = path + ".1.foz";
+		const char *extra_paths[] = { written_path.c_str() };
+		return create_concurrent_database(nullptr, config.read_mode, extra_paths, 1);
+	}
+	}
+
+	return nullptr;
+}
+
+static bool write_backend_database(const BackendConfig &config, const std::string &path,
+                                   const SyntheticPayloads &payloads, size_t count, PayloadWriteFlags flags,
+                                   double *ms)
+{
+	// Clear out what an interrupted run may have left behind.
+	remove_backend_files(config, path, payloads);
+
+	auto begin_time = std::chrono::steady_clock::now();
+	auto db = std::unique_ptr<DatabaseInterface>(create_backend_database(config, path, true));
+	if (!db || !db->prepare())
+	{
+		LOGE("Failed to create %s database in %s.\n", config.name, path.c_str());
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, payloads.hashes[i],
+		                     payloads.blobs[i].data(), payloads.blobs[i].size(), flags))
+		{
+			LOGE("Failed to write to %s database.\n", config.name);
+			return false;
+		}
+	}
+
+	// Closing the database is part of writing it, e.g. stream archives append their index here.
+	db->flush();
+	db.reset();
+	*ms = elapsed_ms(begin_time);
+	return true;
+}
+
+static bool read_payload(DatabaseInterface &db, Hash hash, PayloadReadFlags flags, std::vector<uint8_t> &blob)
+{
+	size_t size = 0;
+	if (!db.read_entry(RESOURCE_SHADER_MODULE, hash, &size, nullptr, flags))
+		return false;
+	blob.resize(size);
+	return db.read_entry(RESOURCE_SHADER_MODULE, hash, &size, blob.data(), flags);
+}
+
+static bool timed_read(DatabaseInterface &db, const std::vector<Hash> &order, double *ms)
+{
+	std::vector<uint8_t> blob;
+	auto begin_time = std::chrono::steady_clock::now();
+	for (auto hash : order)
+		if (!read_payload(db, hash, 0, blob))
+			return false;
+	*ms = elapsed_ms(begin_time);
+	return true;
+}
+
+// All threads are started before the clock starts, so thread creation is not part of the result.
+static bool timed_concurrent_read(DatabaseInterface &db, const std::vector<Hash> &order, unsigned num_threads,
+                                  double *ms)
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned ready_count = 0;
+	bool go = false;
+	std::atomic<bool> failed;
+	failed = false;
+
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads);
+	for (unsigned thread_index = 0; thread_index < num_threads; thread_index++)
+	{
+		threads.emplace_back([&, thread_index]() {
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				ready_count++;
+				cond.notify_all();
+				cond.wait(holder, [&]() { return go; });
+			}
+
+			std::vector<uint8_t> blob;
+			for (size_t i = thread_index; i < order.size(); i += num_threads)
+				if (!read_payload(db, order[i], PAYLOAD_READ_CONCURRENT_BIT, blob))
+					failed = true;
+		});
+	}
+
+	std::chrono::steady_clock::time_point begin_time;
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [&]() { return ready_count == num_threads; });
+		begin_time = std::chrono::steady_clock::now();
+		go = true;
+		cond.notify_all();
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+	*ms = elapsed_ms(begin_time);
+	return !failed;
+}
+
+struct BackendResult
+{
+	const BackendConfig *config;
+	double write_ms = 0.0;
+	std::vector<std::pair<size_t, double>> prepare_ms;
+	double random_read_ms = 0.0;
+	std::vector<std::pair<unsigned, double>> concurrent_read_ms;
+};
+
+struct CompressionResult
+{
+	const CompressionConfig *config;
+	DatabaseCompression stored_format;
+	unsigned payload_size;
+	size_t entries;
+	uint64_t uncompressed_bytes;
+	uint64_t stored_bytes;
+	double write_ms;
+	double read_ms;
+};
+
+static bool bench_backend(const BenchOptions &opts, const BackendConfig &config, const SyntheticPayloads &payloads,
+                          BackendResult &result)
+{
+	auto path = Path::join(opts.scratch_directory, config.filename);
+	result.config = &config;
+
+	// Open time versus archive size. The largest size is the one the read benchmarks use.
+	size_t count = payloads.hashes.size();
+	std::vector<size_t> prepare_counts;
+	for (size_t divider : { 100, 10 })
+		if (count / divider > 0)
+			prepare_counts.push_back(count / divider);
+	prepare_counts.push_back(count);
+
+	for (auto prepare_count : prepare_counts)
+	{
+		double write_ms = 0.0;
+		if (!write_backend_database(config, path, payloads, prepare_count, backend_write_flags, &write_ms))
+			return false;
+		result.write_ms = write_ms;
+
+		double best_ms = 1e30;
+		for (unsigned iter = 0; iter < opts.iterations; iter++)
+		{
+			auto begin_time = std::chrono::steady_clock::now();
+			auto db = std::unique_ptr<DatabaseInterface>(create_backend_database(config, path, false));
+			if (!db || !db->prepare())
+			{
+				LOGE("Failed to open %s database.\n", config.name);
+				return false;
+			}
+			best_ms = std::min(best_ms, elapsed_ms(begin_time));
+		}
+		result.prepare_ms.emplace_back(prepare_count, best_ms);
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_backend_database(config, path, false));
+	if (!db || !db->prepare())
+		return false;
+
+	auto order = payloads.hashes;
+	std::mt19937 rnd(1);
+	std::shuffle(order.begin(), order.end(), rnd);
+
+	result.random_read_ms = 1e30;
+	for (unsigned iter = 0; iter < opts.iterations; iter++)
+	{
+		double ms = 0.0;
+		if (!timed_read(*db, order, &ms))
+		{
+			LOGE("Failed to read from %s database.\n", config.name);
+			return false;
+		}
+		result.random_read_ms = std::min(result.random_read_ms, ms);
+	}
+
+	if (config.concurrent_reads)
+	{
+		unsigned max_threads = opts.max_threads ? opts.max_threads : 64;
+		for (unsigned num_threads = 1;; num_threads = std::min(num_threads * 2, max_threads))
+		{
+			double best_ms = 1e30;
+			for (unsigned iter = 0; iter < opts.iterations; iter++)
+			{
+				double ms = 0.0;
+				if (!timed_concurrent_read(*db, order, num_threads, &ms))
+				{
+					LOGE("Failed to read concurrently from %s database.\n", config.name);
+					return false;
+				}
+				best_ms = std::min(best_ms, ms);
+			}
+			result.concurrent_read_ms.emplace_back(num_threads, best_ms);
+
+			if (num_threads == max_threads)
+				break;
+		}
+	}
+
+	db.reset();
+	remove_backend_files(config, path, payloads);
+
+	LOGI("[%s] write: %.3f ms, prepare: %.3f ms, random read: %.3f ms\n", config.name,
+	     result.write_ms, result.prepare_ms.back().second, result.random_read_ms);
+	return true;
+}
+
+static bool bench_compression(const BenchOptions &opts, const CompressionConfig &config, unsigned payload_size,
+                              CompressionResult &result)
+{
+	static const BackendConfig stream_config = { "stream", "bench_compression.foz", BackendKind::File,
+	                                             DatabaseMode::ReadOnly, true };
+	auto path = Path::join(opts.scratch_directory, stream_config.filename);
+
+	size_t count = std::max<size_t>(64, std::min<size_t>(opts.entries, compression_bytes_per_run / payload_size));
+	auto payloads = generate_payloads(unsigned(count), payload_size, false);
+
+	result = {};
+	result.config = &config;
+	result.payload_size = payload_size;
+	result.entries = count;
+	result.uncompressed_bytes = payloads.total_bytes;
+	result.stored_format = DATABASE_COMPRESSION_UNKNOWN;
+
+	if (!write_backend_database(stream_config, path, payloads, count, config.flags, &result.write_ms))
+		return false;
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_backend_database(stream_config, path, false));
+	if (!db || !db->prepare())
+		return false;
+
+	// Builds without zstd or LZ4 fall back to deflate, so report what was actually stored.
+	for (size_t i = 0; i < count; i++)
+	{
+		DatabaseEntryInfo info;
+		if (!db->get_entry_info(RESOURCE_SHADER_MODULE, payloads.hashes[i], &info))
+			return false;
+		result.stored_bytes += info.stored_size;
+		if (i == 0)
+			result.stored_format = info.compression;
+	}
+
+	result.read_ms = 1e30;
+	for (unsigned iter = 0; iter < opts.iterations; iter++)
+	{
+		double ms = 0.0;
+		if (!timed_read(*db, payloads.hashes, &ms))
+			return false;
+		result.read_ms = std::min(result.read_ms, ms);
+	}
+
+	db.reset();
+	remove_backend_files(stream_config, path, payloads);
+	return true;
+}
+
+static void write_backend_json(FILE *file, const BenchOptions &opts, const SyntheticPayloads &payloads,
+                               const std::vector<BackendResult> &backend_results,
+                               const std::vector<CompressionResult> &compression_results)
+{
+	double total_mb = payloads.total_bytes * 1e-6;
+	fprintf(file, "{\n\t\"entries\": %u,\n\t\"payload_size\": %u,\n\t\"payload_bytes\": %" PRIu64 ",\n\t\"iterations\": %u,\n",
+	        unsigned(payloads.hashes.size()), opts.payload_size, payloads.total_bytes, opts.iterations);
+
+	fprintf(file, "\t\"backends\": [\n");
+	for (size_t i = 0; i < backend_results.size(); i++)
+	{
+		auto &result = backend_results[i];
+		fprintf(file, "\t\t{\n\t\t\t\"backend\": \"%s\",\n", result.config->name);
+		fprintf(file, "\t\t\t\"write_ms\": %.3f,\n\t\t\t\"write_mb_per_s\": %.3f,\n",
+		        result.write_ms, per_second(total_mb, result.write_ms));
+		fprintf(file, "\t\t\t\"random_read_ms\": %.3f,\n\t\t\t\"random_read_per_s\": %.1f,\n\t\t\t\"random_read_mb_per_s\": %.3f,\n",
+		        result.random_read_ms, per_second(double(payloads.hashes.size()), result.random_read_ms),
+		        per_second(total_mb, result.random_read_ms));
+
+		fprintf(file, "\t\t\t\"prepare\": [");
+		for (size_t j = 0; j < result.prepare_ms.size(); j++)
+		{
+			fprintf(file, "%s{ \"entries\": %u, \"ms\": %.3f }", j ? ", " : " ",
+			        unsigned(result.prepare_ms[j].first), result.prepare_ms[j].second);
+		}
+		fprintf(file, " ],\n");
+
+		// Speedup is relative to one thread reading with PAYLOAD_READ_CONCURRENT_BIT.
+		fprintf(file, "\t\t\t\"concurrent_reads\": [");
+		for (size_t j = 0; j < result.concurrent_read_ms.size(); j++)
+		{
+			auto &read = result.concurrent_read_ms[j];
+			fprintf(file, "%s\n\t\t\t\t{ \"threads\": %u, \"ms\": %.3f, \"reads_per_s\": %.1f, \"speedup\": %.3f }",
+			        j ? "," : "", read.first, read.second,
+			        per_second(double(payloads.hashes.size()), read.second),
+			        result.concurrent_read_ms.front().second / read.second);
+		}
+		fprintf(file, "%s]\n\t\t}%s\n", result.concurrent_read_ms.empty() ? "" : "\n\t\t\t",
+		        i + 1 < backend_results.size() ? "," : "");
+	}
+	fprintf(file, "\t],\n");
+
+	fprintf(file, "\t\"compression\": [\n");
+	for (size_t i = 0; i < compression_results.size(); i++)
+	{
+		auto &result = compression_results[i];
+		double mb = result.uncompressed_bytes * 1e-6;
+		fprintf(file, "\t\t{ \"format\": \"%s\", \"stored_format\": \"%s\", \"payload_size\": %u, \"entries\": %u, "
+		              "\"uncompressed_bytes\": %" PRIu64 ", \"stored_bytes\": %" PRIu64 ", \"ratio\": %.3f, "
+		              "\"write_mb_per_s\": %.3f, \"read_mb_per_s\": %.3f }%s\n",
+		        result.config->name, bench_compression_names[result.stored_format], result.payload_size,
+		        unsigned(result.entries), result.uncompressed_bytes, result.stored_bytes,
+		        result.stored_bytes ? double(result.uncompressed_bytes) / double(result.stored_bytes) : 0.0,
+		        per_second(mb, result.write_ms), per_second(mb, result.read_ms),
+		        i + 1 < compression_results.size() ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+}
+
+static int run_backend_bench(const BenchOptions &opts)
+{
+	auto payloads = generate_payloads(opts.entries, opts.payload_size, true);
+
+	std::vector<BackendResult> backend_results;
+	for (auto &config : backend_configs)
+	{
+		BackendResult result;
+		if (!bench_backend(opts, config, payloads, result))
+			return EXIT_FAILURE;
+		backend_results.push_back(std::move(result));
+	}
+
+	std::vector<CompressionResult> compression_results;
+	for (auto &config : compression_configs)
+	{
+		for (auto payload_size : compression_payload_sizes)
+		{
+			CompressionResult result;
+			if (!bench_compression(opts, config, payload_size, result))
+			{
+				LOGE("Failed to benchmark %s compression.\n", config.name);
+				return EXIT_FAILURE;
+			}
+			LOGI("[%s %u] ratio: %.3f, write: %.3f ms, read: %.3f ms\n", config.name, payload_size,
+			     result.stored_bytes ? double(result.uncompressed_bytes) / double(result.stored_bytes) : 0.0,
+			     result.write_ms, result.read_ms);
+			compression_results.push_back(result);
+		}
+	}
+
+	FILE *file = open_json_output(opts);
+	if (!file)
+		return EXIT_FAILURE;
+
+	write_backend_json(file, opts, payloads, backend_results, compression_results);
+	if (file != stdout)
+		fclose(file);
+	return EXIT_SUCCESS;
+}
+
+static void bench_write_and_read()
 {
 	for (unsigned i = 0; i < 2; i++)
 	{
@@ -338,3 +1445,57 @@ int main()
 		LOGI("===================\n\n");
 	}
 }
+
+static void print_help()
+{
+	LOGI("fossilize-bench\n"
+	     "\t[--replay database]\n"
+	     "\t[--threads max-threads]\n"
+	     "\t[--iterations count]\n"
+	     "\t[--backends]\n"
+	     "\t[--entries count]\n"
+	     "\t[--payload-size bytes]\n"
+	     "\t[--scratch directory]\n"
+	     "\t[--json results.json]\n"
+	     "Without --replay or --backends, benchmarks writing and reading synthetic archives.\n"
+	     "With --replay, benchmarks replaying an existing archive against a null device.\n"
+	     "With --backends, benchmarks every database backend on synthetic payloads in the scratch directory.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	bool backends = false;
+	CLICallbacks cbs;
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--replay", [&](CLIParser &parser) { opts.database = parser.next_string(); });
+	cbs.add("--threads", [&](CLIParser &parser) { opts.max_threads = parser.next_uint(); });
+	cbs.add("--iterations", [&](CLIParser &parser) { opts.iterations = parser.next_uint(); });
+	cbs.add("--json", [&](CLIParser &parser) { opts.json_path = parser.next_string(); });
+	cbs.add("--backends", [&](CLIParser &) { backends = true; });
+	cbs.add("--entries", [&](CLIParser &parser) { opts.entries = parser.next_uint(); });
+	cbs.add("--payload-size", [&](CLIParser &parser) { opts.payload_size = parser.next_uint(); });
+	cbs.add("--scratch", [&](CLIParser &parser) { opts.scratch_directory = parser.next_string(); });
+	cbs.error_handler = [] { print_help(); };
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (opts.iterations == 0)
+		opts.iterations = 1;
+	if (opts.entries == 0)
+		opts.entries = 1;
+	if (opts.payload_size < 16)
+		opts.payload_size = 16;
+
+	if (backends)
+		return run_backend_bench(opts);
+
+	if (!opts.database.empty())
+		return run_replay_bench(opts);
+
+	bench_write_and_read();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,557 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "fossilize.hpp"
+#include "fossilize_db.hpp"
+#include "varint.hpp"
+#include "base64.hpp"
+#include "crc32c.hpp"
+#include "xxhash64.hpp"
+#include "miniz.h"
+#include "cli_parser.hpp"
+#include "layer/utils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+using namespace Fossilize;
+
+// A corpus is a set of SPIR-V modules. Every kernel runs over each module in turn,
+// the same granularity the recorder and replayer work at.
+struct Corpus
+{
+	std::string name;
+	std::vector<std::vector<uint32_t>> modules;
+	uint64_t total_bytes = 0;
+};
+
+struct ModuleCollector : StateCreatorInterface
+{
+	bool enqueue_create_sampler(Hash, const VkSamplerCreateInfo *, VkSampler *) override
+	{
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *) override
+	{
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *) override
+	{
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		corpus->modules.emplace_back(create_info->pCode, create_info->pCode + create_info->codeSize / sizeof(uint32_t));
+		corpus->total_bytes += create_info->codeSize;
+		*module = (VkShaderModule)uint64_t(corpus->modules.size());
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash, const VkRenderPassCreateInfo *, VkRenderPass *) override
+	{
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash, const VkComputePipelineCreateInfo *, VkPipeline *) override
+	{
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash, const VkGraphicsPipelineCreateInfo *, VkPipeline *) override
+	{
+		return true;
+	}
+
+	Corpus *corpus = nullptr;
+};
+
+static bool load_archive_corpus(const char *path, Corpus &corpus)
+{
+	auto db = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+	{
+		LOGE("Failed to open database: %s\n", path);
+		return false;
+	}
+
+	size_t hash_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr))
+		return false;
+	std::vector<Hash> hashes(hash_count);
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, hashes.data()))
+		return false;
+
+	corpus.name = "archive";
+	ModuleCollector collector;
+	collector.corpus = &corpus;
+	StateReplayer replayer;
+	std::vector<uint8_t> blob;
+
+	for (auto hash : hashes)
+	{
+		size_t size = 0;
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &size, nullptr, 0))
+			return false;
+		blob.resize(size);
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &size, blob.data(), 0))
+			return false;
+		if (!replayer.parse(collector, db.get(), blob.data(), blob.size()))
+			LOGE("Failed to parse shader module %016" PRIx64 ".\n", hash);
+	}
+
+	if (corpus.modules.empty())
+	{
+		LOGE("No shader modules in %s.\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+// Instructions are a word count and opcode in one word followed by operands, mostly small IDs.
+static Corpus generate_spirv_corpus()
+{
+	Corpus corpus;
+	corpus.name = "synthetic-spirv";
+
+	std::mt19937 rnd(1);
+	std::uniform_int_distribution<uint32_t> opcode_dist(1, 400);
+	std::uniform_int_distribution<uint32_t> operand_count_dist(1, 6);
+	std::uniform_int_distribution<uint32_t> id_dist(1, 2000);
+	std::uniform_int_distribution<uint32_t> module_size_dist(256, 16 * 1024);
+
+	for (unsigned i = 0; i < 256; i++)
+	{
+		std::vector<uint32_t> words = { 0x07230203u, 0x00010300u, 0, 2000, 0 };
+		uint32_t target_size = module_size_dist(rnd);
+		while (words.size() < target_size)
+		{
+			uint32_t operand_count = operand_count_dist(rnd);
+			words.push_back(((operand_count + 1) << 16) | opcode_dist(rnd));
+			for (uint32_t j = 0; j < operand_count; j++)
+				words.push_back(id_dist(rnd));
+		}
+
+		corpus.total_bytes += words.size() * sizeof(uint32_t);
+		corpus.modules.push_back(std::move(words));
+	}
+
+	return corpus;
+}
+
+// Worst case for varint, every word needs five bytes.
+static Corpus generate_uniform_corpus()
+{
+	Corpus corpus;
+	corpus.name = "uniform-random";
+
+	std::mt19937 rnd(2);
+	for (unsigned i = 0; i < 256; i++)
+	{
+		std::vector<uint32_t> words(4096);
+		for (auto &w : words)
+			w = uint32_t(rnd());
+		corpus.total_bytes += words.size() * sizeof(uint32_t);
+		corpus.modules.push_back(std::move(words));
+	}
+
+	return corpus;
+}
+
+// Best case for varint, every word fits in one byte.
+static Corpus generate_small_value_corpus()
+{
+	Corpus corpus;
+	corpus.name = "small-values";
+
+	std::mt19937 rnd(3);
+	std::uniform_int_distribution<uint32_t> dist(0, 127);
+	for (unsigned i = 0; i < 256; i++)
+	{
+		std::vector<uint32_t> words(4096);
+		for (auto &w : words)
+			w = dist(rnd);
+		corpus.total_bytes += words.size() * sizeof(uint32_t);
+		corpus.modules.push_back(std::move(words));
+	}
+
+	return corpus;
+}
+
+// Per-module scratch which the kernels use, so allocation is not part of what gets timed.
+struct KernelScratch
+{
+	std::vector<std::vector<uint8_t>> varint;
+	std::vector<std::vector<uint8_t>> stream_vbyte;
+	std::vector<std::string> base64;
+	std::vector<uint32_t> words;
+	std::vector<uint8_t> bytes;
+	std::string chars;
+};
+
+// Running the kernel over the whole corpus is one pass. Results feed into this so nothing is optimized out.
+static volatile uint64_t kernel_sink;
+
+struct Kernel
+{
+	const char *name;
+	bool (*run)(const Corpus &corpus, KernelScratch &scratch);
+};
+
+static bool run_hash_shader_module(const Corpus &corpus, KernelScratch &)
+{
+	uint64_t acc = 0;
+	for (auto &module : corpus.modules)
+	{
+		VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		info.codeSize = module.size() * sizeof(uint32_t);
+		info.pCode = module.data();
+		acc ^= Hashing::compute_hash_shader_module(info);
+	}
+	kernel_sink = acc;
+	return true;
+}
+
+// Hasher is internal to fossilize.cpp, this is the same recurrence as Hasher::u32().
+static bool run_hasher_u32(const Corpus &corpus, KernelScratch &)
+{
+	uint64_t acc = 0;
+	for (auto &module : corpus.modules)
+	{
+		uint64_t h = 0xcbf29ce484222325ull;
+		for (auto w : module)
+			h = (h * 0x100000001b3ull) ^ w;
+		acc ^= h;
+	}
+	kernel_sink = acc;
+	return true;
+}
+
+static bool run_xxhash64(const Corpus &corpus, KernelScratch &)
+{
+	uint64_t acc = 0;
+	for (auto &module : corpus.modules)
+		acc ^= xxhash64(module.data(), module.size() * sizeof(uint32_t), 0);
+	kernel_sink = acc;
+	return true;
+}
+
+static bool run_varint_encode(const Corpus &corpus, KernelScratch &scratch)
+{
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		auto &module = corpus.modules[i];
+		auto &encoded = scratch.varint[i];
+		encoded.resize(compute_size_varint(module.data(), module.size()));
+		encode_varint(encoded.data(), module.data(), module.size());
+	}
+	kernel_sink = scratch.varint.front().size();
+	return true;
+}
+
+static bool run_varint_decode(const Corpus &corpus, KernelScratch &scratch)
+{
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		auto &module = corpus.modules[i];
+		auto &encoded = scratch.varint[i];
+		scratch.words.resize(module.size());
+		if (!decode_varint(scratch.words.data(), scratch.words.size(), encoded.data(), encoded.size()))
+			return false;
+	}
+	kernel_sink = scratch.words.back();
+	return true;
+}
+
+static bool run_stream_vbyte_encode(const Corpus &corpus, KernelScratch &scratch)
+{
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		auto &module = corpus.modules[i];
+		auto &encoded = scratch.stream_vbyte[i];
+		encoded.resize(compute_size_stream_vbyte(module.data(), module.size()));
+		encode_stream_vbyte(encoded.data(), module.data(), module.size());
+	}
+	kernel_sink = scratch.stream_vbyte.front().size();
+	return true;
+}
+
+static bool run_stream_vbyte_decode(const Corpus &corpus, KernelScratch &scratch)
+{
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		auto &module = corpus.modules[i];
+		auto &encoded = scratch.stream_vbyte[i];
+		scratch.words.resize(module.size());
+		if (!decode_stream_vbyte(scratch.words.data(), scratch.words.size(), encoded.data(), encoded.size()))
+			return false;
+	}
+	kernel_sink = scratch.words.back();
+	return true;
+}
+
+static bool run_base64_encode(const Corpus &corpus, KernelScratch &scratch)
+{
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		auto &module = corpus.modules[i];
+		auto &encoded = scratch.base64[i];
+		size_t size = module.size() * sizeof(uint32_t);
+		encoded.resize(compute_size_base64(size));
+		encode_base64(&encoded[0], module.data(), size);
+	}
+	kernel_sink = uint8_t(scratch.base64.front()[0]);
+	return true;
+}
+
+static bool run_base64_decode(const Corpus &corpus, KernelScratch &scratch)
+{
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		size_t size = corpus.modules[i].size() * sizeof(uint32_t);
+		scratch.bytes.resize(size);
+		if (decode_base64(scratch.bytes.data(), size, scratch.base64[i].c_str()) != size)
+			return false;
+	}
+	kernel_sink = scratch.bytes.back();
+	return true;
+}
+
+static bool run_mz_crc32(const Corpus &corpus, KernelScratch &)
+{
+	uint64_t acc = 0;
+	for (auto &module : corpus.modules)
+	{
+		acc ^= mz_crc32(MZ_CRC32_INIT, reinterpret_cast<const uint8_t *>(module.data()),
+		                module.size() * sizeof(uint32_t));
+	}
+	kernel_sink = acc;
+	return true;
+}
+
+static bool run_crc32c(const Corpus &corpus, KernelScratch &)
+{
+	uint64_t acc = 0;
+	for (auto &module : corpus.modules)
+		acc ^= crc32c(0, module.data(), module.size() * sizeof(uint32_t));
+	kernel_sink = acc;
+	return true;
+}
+
+static bool run_crc32c_portable(const Corpus &corpus, KernelScratch &)
+{
+	uint64_t acc = 0;
+	for (auto &module : corpus.modules)
+		acc ^= crc32c_portable(0, module.data(), module.size() * sizeof(uint32_t));
+	kernel_sink = acc;
+	return true;
+}
+
+// Decoders run after their encoders and reuse their output.
+static const Kernel kernels[] = {
+	{ "hash_shader_module", run_hash_shader_module },
+	{ "hasher_u32", run_hasher_u32 },
+	{ "xxhash64", run_xxhash64 },
+	{ "varint_encode", run_varint_encode },
+	{ "varint_decode", run_varint_decode },
+	{ "stream_vbyte_encode", run_stream_vbyte_encode },
+	{ "stream_vbyte_decode", run_stream_vbyte_decode },
+	{ "base64_encode", run_base64_encode },
+	{ "base64_decode", run_base64_decode },
+	{ "mz_crc32", run_mz_crc32 },
+	{ "crc32c", run_crc32c },
+	{ "crc32c_portable", run_crc32c_portable },
+};
+
+struct KernelResult
+{
+	const char *kernel;
+	const char *corpus;
+	uint64_t bytes;
+	unsigned passes;
+	double best_ms;
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point begin_time)
+{
+	auto end_time = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count() * 1e-6;
+}
+
+// Runs passes until min_time_ms has passed and at least three passes are done, and keeps the fastest one.
+static bool bench_kernel(const Kernel &kernel, const Corpus &corpus, KernelScratch &scratch,
+                         double min_time_ms, KernelResult &result)
+{
+	result = { kernel.name, corpus.name.c_str(), corpus.total_bytes, 0, 1e30 };
+	double total_ms = 0.0;
+
+	while (result.passes < 3 || total_ms < min_time_ms)
+	{
+		auto begin_time = std::chrono::steady_clock::now();
+		if (!kernel.run(corpus, scratch))
+		{
+			LOGE("Kernel %s failed on %s corpus.\n", kernel.name, corpus.name.c_str());
+			return false;
+		}
+		double ms = elapsed_ms(begin_time);
+		result.best_ms = std::min(result.best_ms, ms);
+		total_ms += ms;
+		result.passes++;
+	}
+
+	return true;
+}
+
+static bool verify_round_trips(const Corpus &corpus, const KernelScratch &scratch)
+{
+	std::vector<uint32_t> words;
+	for (size_t i = 0; i < corpus.modules.size(); i++)
+	{
+		auto &module = corpus.modules[i];
+		words.resize(module.size());
+
+		if (!decode_varint(words.data(), words.size(), scratch.varint[i].data(), scratch.varint[i].size()) ||
+		    words != module)
+			return false;
+
+		if (!decode_stream_vbyte(words.data(), words.size(), scratch.stream_vbyte[i].data(), scratch.stream_vbyte[i].size()) ||
+		    words != module)
+			return false;
+
+		if (decode_base64(words.data(), words.size() * sizeof(uint32_t), scratch.base64[i].c_str()) !=
+		    words.size() * sizeof(uint32_t) || words != module)
+			return false;
+	}
+
+	return true;
+}
+
+static double mb_per_second(uint64_t bytes, double ms)
+{
+	return ms > 0.0 ? bytes * 1e-6 * 1000.0 / ms : 0.0;
+}
+
+static void print_help()
+{
+	LOGI("fossilize-bench-kernels\n"
+	     "\t[--archive database]\n"
+	     "\t[--min-time milliseconds]\n"
+	     "\t[--json results.json]\n"
+	     "Times hashing, varint, base64 and checksum kernels over SPIR-V corpora.\n"
+	     "With --archive, the shader modules of the archive are used in addition to synthetic corpora.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string archive_path;
+	std::string json_path;
+	unsigned min_time_ms = 200;
+
+	CLICallbacks cbs;
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--archive", [&](CLIParser &parser) { archive_path = parser.next_string(); });
+	cbs.add("--min-time", [&](CLIParser &parser) { min_time_ms = parser.next_uint(); });
+	cbs.add("--json", [&](CLIParser &parser) { json_path = parser.next_string(); });
+	cbs.error_handler = [] { print_help(); };
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	std::vector<Corpus> corpora;
+	if (!archive_path.empty())
+	{
+		Corpus corpus;
+		if (!load_archive_corpus(archive_path.c_str(), corpus))
+			return EXIT_FAILURE;
+		corpora.push_back(std::move(corpus));
+	}
+	corpora.push_back(generate_spirv_corpus());
+	corpora.push_back(generate_uniform_corpus());
+	corpora.push_back(generate_small_value_corpus());
+
+	std::vector<KernelResult> results;
+	for (auto &corpus : corpora)
+	{
+		KernelScratch scratch;
+		scratch.varint.resize(corpus.modules.size());
+		scratch.stream_vbyte.resize(corpus.modules.size());
+		scratch.base64.resize(corpus.modules.size());
+
+		LOGI("=== %s: %u modules, %" PRIu64 " bytes ===\n", corpus.name.c_str(),
+		     unsigned(corpus.modules.size()), corpus.total_bytes);
+
+		for (auto &kernel : kernels)
+		{
+			KernelResult result;
+			if (!bench_kernel(kernel, corpus, scratch, double(min_time_ms), result))
+				return EXIT_FAILURE;
+			LOGI("  %-20s %10.3f MB/s\n", kernel.name, mb_per_second(result.bytes, result.best_ms));
+			results.push_back(result);
+		}
+
+		if (!verify_round_trips(corpus, scratch))
+		{
+			LOGE("Encoded %s corpus does not round-trip.\n", corpus.name.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	FILE *file = stdout;
+	if (!json_path.empty())
+	{
+		file = fopen(json_path.c_str(), "w");
+		if (!file)
+		{
+			LOGE("Failed to open %s for writing.\n", json_path.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Throughput is in bytes of SPIR-V, i.e. decoders are measured by what they produce.
+	fprintf(file, "{\n\t\"crc32c_hardware\": %s,\n\t\"results\": [\n", crc32c_is_hardware_accelerated() ? "true" : "false");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto &result = results[i];
+		fprintf(file, "\t\t{ \"kernel\": \"%s\", \"corpus\": \"%s\", \"bytes\": %" PRIu64 ", \"passes\": %u, "
+		              "\"best_ms\": %.3f, \"bytes_per_s\": %.0f }%s\n",
+		        result.kernel, result.corpus, result.bytes, result.passes, result.best_ms,
+		        result.best_ms > 0.0 ? result.bytes * 1000.0 / result.best_ms : 0.0,
+		        i + 1 < results.size() ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+
+	if (file != stdout)
+		fclose(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_application_filter.hpp"
+#include <stdlib.h>
+#include "layer/utils.hpp"
+
+using namespace Fossilize;
+
+static void print_help()
+{
+	LOGI("Usage: fossilize-compile-filter filter.json filter.bin\n");
+	LOGI("       Compiles an application info filter into a form which the layer can map directly.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (!ApplicationInfoFilter::compile(argv[1], argv[2]))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
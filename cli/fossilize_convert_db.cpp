@@ -21,66 +21,346 @@
  */
 
 #include "fossilize_db.hpp"
+#include "cli_parser.hpp"
+#include "database_transform.hpp"
+#include "pipeline_order.hpp"
+#include "path.hpp"
 #include <memory>
 #include <vector>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <unordered_set>
+#include <string.h>
 #include "layer/utils.hpp"
 
 using namespace Fossilize;
 
 static void print_help()
 {
-	LOGI("Usage: fossilize-convert-db input-db output-db\n");
+	LOGI("Usage: fossilize-convert-db input-db output-db\n"
+	     "\t[--zstd]\n"
+	     "\t[--lz4]\n"
+	     "\t[--zstd-dictionary-size bytes]\n"
+	     "\t[--threads count]\n"
+	     "\t[--reorder replay|first-use|shader-locality]\n");
+}
+
+enum class ReorderKey
+{
+	None,
+	// Hash order within each type, which is the order fossilize-replay reads objects in.
+	Replay,
+	// The order entries are stored in the input, which for recorded archives is the order the application used them in.
+	// With usage metadata, the earliest first use in any recorded session decides instead.
+	FirstUse,
+	// Pipelines which share shader modules back to back, as with fossilize-replay --shader-locality-order.
+	// Shader modules are ordered by the first pipeline which uses them.
+	ShaderLocality
+};
+
+// Types are kept together, in the order a replay needs them. Dependencies come before the objects which use them.
+static const ResourceTag reorder_tags[] = {
+	RESOURCE_APPLICATION_INFO,
+	RESOURCE_SAMPLER,
+	RESOURCE_DESCRIPTOR_SET_LAYOUT,
+	RESOURCE_PIPELINE_LAYOUT,
+	RESOURCE_RENDER_PASS,
+	RESOURCE_SHADER_MODULE,
+	RESOURCE_GRAPHICS_PIPELINE_STATE,
+	RESOURCE_GRAPHICS_PIPELINE,
+	RESOURCE_COMPUTE_PIPELINE,
+	RESOURCE_APPLICATION_BLOB_LINK,
+	RESOURCE_USAGE_METADATA,
+};
+static_assert(sizeof(reorder_tags) / sizeof(reorder_tags[0]) == RESOURCE_COUNT, "Missing resource tag.");
+
+static bool compute_entry_order(DatabaseInterface &db, ReorderKey key, PayloadReadFlags flags,
+                                std::vector<Hash> (&order)[RESOURCE_COUNT])
+{
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		size_t hash_count = 0;
+		if (!db.get_hash_list_for_resource_tag(static_cast<ResourceTag>(i), &hash_count, nullptr))
+			return false;
+		order[i].resize(hash_count);
+		if (!db.get_hash_list_for_resource_tag(static_cast<ResourceTag>(i), &hash_count, order[i].data()))
+			return false;
+		std::sort(order[i].begin(), order[i].end());
+	}
+
+	if (key == ReorderKey::FirstUse)
+	{
+		struct Visitor : DatabaseEntryVisitor
+		{
+			bool visit_entry(ResourceTag tag, Hash hash, const void *, size_t) override
+			{
+				order[tag].push_back(hash);
+				return true;
+			}
+			std::vector<Hash> order[RESOURCE_COUNT];
+		} visitor;
+
+		if (!db.for_each_entry(visitor, flags))
+			return false;
+
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			if (visitor.order[i].size() != order[i].size())
+				return false;
+			order[i] = std::move(visitor.order[i]);
+		}
+
+		// Objects without usage metadata go last, in stored order.
+		std::unordered_map<Hash, UsageSummary> usage[RESOURCE_COUNT];
+		if (!load_usage_summaries(db, usage))
+			return false;
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			if (usage[i].empty())
+				continue;
+			const auto first_use = [&](Hash hash) -> uint32_t {
+				auto itr = usage[i].find(hash);
+				return itr != usage[i].end() ? itr->second.first_use_ms : UINT32_MAX;
+			};
+			std::stable_sort(order[i].begin(), order[i].end(), [&](Hash a, Hash b) {
+				return first_use(a) < first_use(b);
+			});
+		}
+	}
+	else if (key == ReorderKey::ShaderLocality)
+	{
+		std::vector<Hash> module_order;
+		if (!sort_pipelines_by_shader_locality(db, RESOURCE_GRAPHICS_PIPELINE, order[RESOURCE_GRAPHICS_PIPELINE], &module_order))
+			return false;
+		if (!sort_pipelines_by_shader_locality(db, RESOURCE_COMPUTE_PIPELINE, order[RESOURCE_COMPUTE_PIPELINE], &module_order))
+			return false;
+
+		// Modules shared between graphics and compute show up twice, and references may point to missing modules.
+		// Modules no pipeline refers to go last.
+		std::unordered_set<Hash> placed;
+		std::vector<Hash> modules;
+		modules.reserve(order[RESOURCE_SHADER_MODULE].size());
+		for (auto hash : module_order)
+			if (std::binary_search(order[RESOURCE_SHADER_MODULE].begin(), order[RESOURCE_SHADER_MODULE].end(), hash) &&
+			    placed.insert(hash).second)
+				modules.push_back(hash);
+		for (auto hash : order[RESOURCE_SHADER_MODULE])
+			if (!placed.count(hash))
+				modules.push_back(hash);
+		order[RESOURCE_SHADER_MODULE] = std::move(modules);
+	}
+
+	return true;
+}
+
+// Rewrites the whole archive in the requested order. Both ends must be Fossilize archives for payloads to be copied
+// as-is. Otherwise, or when asked to recompress, payloads are decoded and encoded again with write_flags.
+static bool copy_reordered(DatabaseInterface &input_db, DatabaseInterface &output_db, ReorderKey key,
+                           bool raw, PayloadWriteFlags write_flags)
+{
+	PayloadReadFlags read_flags = raw ? PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT : PAYLOAD_READ_NO_FLAGS;
+	PayloadWriteFlags copy_flags = raw ? PayloadWriteFlags(PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) : write_flags;
+	std::vector<Hash> order[RESOURCE_COUNT];
+	if (!compute_entry_order(input_db, key, read_flags, order))
+	{
+		LOGE("Failed to determine entry order.\n");
+		return false;
+	}
+
+	// Reads go out in batches, so the input can pick up a batch in its own layout order.
+	constexpr size_t BatchSize = 256;
+	std::vector<DatabaseEntryRead> reads;
+	std::vector<std::vector<uint8_t>> buffers(BatchSize);
+	size_t total_entries = 0;
+
+	for (auto tag : reorder_tags)
+	{
+		auto &hashes = order[tag];
+		for (size_t base = 0; base < hashes.size(); base += BatchSize)
+		{
+			size_t count = std::min(BatchSize, hashes.size() - base);
+			reads.resize(count);
+			for (size_t i = 0; i < count; i++)
+				reads[i] = { tag, hashes[base + i], 0, nullptr };
+
+			if (!input_db.read_entries(reads.data(), count, read_flags))
+			{
+				LOGE("Failed to read entries from input.\n");
+				return false;
+			}
+
+			for (size_t i = 0; i < count; i++)
+			{
+				buffers[i].resize(reads[i].size);
+				reads[i].buffer = buffers[i].data();
+			}
+
+			if (!input_db.read_entries(reads.data(), count, read_flags))
+			{
+				LOGE("Failed to read entries from input.\n");
+				return false;
+			}
+
+			for (size_t i = 0; i < count; i++)
+			{
+				if (!output_db.write_entry(tag, reads[i].hash, reads[i].buffer, reads[i].size, copy_flags))
+				{
+					LOGE("Failed to write entry to output.\n");
+					return false;
+				}
+			}
+		}
+
+		total_entries += hashes.size();
+	}
+
+	LOGI("Wrote %u entries%s.\n", unsigned(total_entries), raw ? " without recompressing" : "");
+	return true;
+}
+
+static bool train_shader_module_dictionary(DatabaseInterface &input_db, DatabaseInterface &output_db, size_t dictionary_size)
+{
+	size_t hash_count = 0;
+	if (!input_db.get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr))
+		return false;
+	std::vector<Hash> hashes(hash_count);
+	if (!input_db.get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, hashes.data()))
+		return false;
+
+	// zstd recommends roughly 100x the dictionary size in samples. Don't bother going beyond that.
+	const size_t max_sample_size = 100 * dictionary_size;
+	std::vector<uint8_t> samples;
+	std::vector<size_t> sample_sizes;
+
+	for (auto &hash : hashes)
+	{
+		size_t blob_size = 0;
+		if (!input_db.read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+
+		size_t offset = samples.size();
+		samples.resize(offset + blob_size);
+		if (!input_db.read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, samples.data() + offset, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		sample_sizes.push_back(blob_size);
+
+		if (samples.size() >= max_sample_size)
+			break;
+	}
+
+	std::vector<uint8_t> dictionary(dictionary_size);
+	if (!train_compression_dictionary(samples.data(), sample_sizes.data(), unsigned(sample_sizes.size()),
+	                                  dictionary.data(), &dictionary_size))
+		return false;
+
+	LOGI("Trained %u byte dictionary from %u shader modules.\n", unsigned(dictionary_size), unsigned(sample_sizes.size()));
+	return output_db.set_compression_dictionary(RESOURCE_SHADER_MODULE, dictionary.data(), dictionary_size);
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc != 3)
+	std::vector<std::string> paths;
+	size_t dictionary_size = 0;
+	unsigned num_threads = 0;
+	ReorderKey reorder = ReorderKey::None;
+	bool recompress = false;
+	PayloadWriteFlags write_flags = PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT |
+	                                PAYLOAD_WRITE_COMPRESS_BIT |
+	                                PAYLOAD_WRITE_BEST_COMPRESSION_BIT;
+
+	CLICallbacks cbs;
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--zstd", [&](CLIParser &) { write_flags |= PAYLOAD_WRITE_COMPRESS_ZSTD_BIT; recompress = true; });
+	cbs.add("--lz4", [&](CLIParser &) { write_flags |= PAYLOAD_WRITE_COMPRESS_LZ4_BIT; recompress = true; });
+	cbs.add("--zstd-dictionary-size", [&](CLIParser &parser) {
+		dictionary_size = parser.next_uint();
+		write_flags |= PAYLOAD_WRITE_COMPRESS_ZSTD_BIT;
+		recompress = true;
+	});
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--reorder", [&](CLIParser &parser) {
+		const char *key = parser.next_string();
+		if (strcmp(key, "replay") == 0)
+			reorder = ReorderKey::Replay;
+		else if (strcmp(key, "first-use") == 0)
+			reorder = ReorderKey::FirstUse;
+		else if (strcmp(key, "shader-locality") == 0)
+			reorder = ReorderKey::ShaderLocality;
+		else
+		{
+			LOGE("Unknown reorder key %s.\n", key);
+			exit(EXIT_FAILURE);
+		}
+	});
+	cbs.default_handler = [&](const char *arg) { paths.push_back(arg); };
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (paths.size() != 2)
 	{
 		print_help();
 		return EXIT_FAILURE;
 	}
 
-	auto input_db = std::unique_ptr<DatabaseInterface>(create_database(argv[1], DatabaseMode::ReadOnly));
-	auto output_db = std::unique_ptr<DatabaseInterface>(create_database(argv[2], DatabaseMode::OverWrite));
+	auto input_db = std::unique_ptr<DatabaseInterface>(create_database(paths[0].c_str(), DatabaseMode::ReadOnly));
+	auto output_db = std::unique_ptr<DatabaseInterface>(create_database(paths[1].c_str(), DatabaseMode::OverWrite));
 	if (!input_db || !input_db->prepare())
 	{
-		LOGE("Failed to load database: %s\n", argv[1]);
+		LOGE("Failed to load database: %s\n", paths[0].c_str());
 		return EXIT_FAILURE;
 	}
 
 	if (!output_db || !output_db->prepare())
 	{
-		LOGE("Failed to open database for writing: %s\n", argv[2]);
+		LOGE("Failed to open database for writing: %s\n", paths[1].c_str());
 		return EXIT_FAILURE;
 	}
 
-	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	if (dictionary_size && !train_shader_module_dictionary(*input_db, *output_db, dictionary_size))
 	{
-		auto tag = static_cast<ResourceTag>(i);
+		LOGE("Failed to create compression dictionary.\n");
+		return EXIT_FAILURE;
+	}
 
-		size_t hash_count = 0;
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-			return EXIT_FAILURE;
-		std::vector<Hash> hashes(hash_count);
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-			return EXIT_FAILURE;
+	// Decoding the input is spread over the transform workers, compression goes to the archive's own pool.
+	output_db->set_compression_threads(num_threads ? num_threads : std::thread::hardware_concurrency());
+
+	if (reorder != ReorderKey::None)
+	{
+		bool raw = !recompress && Path::ext(paths[0]) == "foz" && Path::ext(paths[1]) == "foz";
+		return copy_reordered(*input_db, *output_db, reorder, raw, write_flags) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-		for (auto &hash : hashes)
+	struct Converter : DatabaseTransform
+	{
+		bool transform_entry(unsigned, ResourceTag tag, Hash hash, const void *blob, size_t size,
+		                     DatabaseTransformOutput &output) override
 		{
-			size_t blob_size = 0;
-			if (!input_db->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
-				return EXIT_FAILURE;
-			std::vector<uint8_t> blob(blob_size);
-			if (!input_db->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
-				return EXIT_FAILURE;
-
-			if (!output_db->write_entry(tag, hash, blob.data(), blob.size(),
-					PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT |
-					PAYLOAD_WRITE_COMPRESS_BIT |
-					PAYLOAD_WRITE_BEST_COMPRESSION_BIT))
-			{
-				return EXIT_FAILURE;
-			}
+			output.write_entry(tag, hash, blob, size, write_flags);
+			return true;
 		}
-	}
+
+		PayloadWriteFlags write_flags = 0;
+	};
+
+	ResourceTag tags[RESOURCE_COUNT];
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		tags[i] = static_cast<ResourceTag>(i);
+
+	Converter converter;
+	converter.write_flags = write_flags;
+
+	DatabaseTransformOptions options;
+	options.tags = tags;
+	options.num_tags = RESOURCE_COUNT;
+	options.num_threads = num_threads;
+	options.serialize_input_reads = database_transform_needs_serialized_reads(paths[0].c_str());
+	if (!run_database_transform(*input_db, *output_db, converter, options))
+		return EXIT_FAILURE;
 }
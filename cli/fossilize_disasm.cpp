@@ -27,10 +27,19 @@
 #include "logging.hpp"
 #include "file.hpp"
 #include "fossilize_db.hpp"
+#include "xxhash64.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include <functional>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
@@ -165,6 +174,7 @@ struct DisasmReplayer : StateCreatorInterface
 
 		module_to_index[*module] = shader_modules.size();
 		shader_modules.push_back(*module);
+		shader_module_hashes.push_back(hash);
 		shader_module_infos.push_back(create_info);
 		return true;
 	}
@@ -189,23 +199,11 @@ struct DisasmReplayer : StateCreatorInterface
 		return true;
 	}
 
+	// Pipelines are only created later on the disassembly workers, see create_pipeline().
 	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
-		if (device)
-		{
-			LOGI("Creating compute pipeline %0" PRIX64 "\n", hash);
-			if (vkCreateComputePipelines(device->get_device(), pipeline_cache, 1, create_info, nullptr, pipeline) !=
-			    VK_SUCCESS)
-			{
-				LOGE(" ... Failed!\n");
-				return false;
-			}
-			LOGI(" ... Succeeded!\n");
-		}
-		else
-			*pipeline = fake_handle<VkPipeline>(hash);
-
-		compute_pipelines.push_back(*pipeline);
+		*pipeline = fake_handle<VkPipeline>(hash);
+		compute_pipelines.push_back(device ? VK_NULL_HANDLE : *pipeline);
 		compute_infos.push_back(create_info);
 		compute_hashes.push_back(hash);
 		return true;
@@ -213,23 +211,48 @@ struct DisasmReplayer : StateCreatorInterface
 
 	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
-		if (device)
+		*pipeline = fake_handle<VkPipeline>(hash);
+		graphics_pipelines.push_back(device ? VK_NULL_HANDLE : *pipeline);
+		graphics_infos.push_back(create_info);
+		graphics_hashes.push_back(hash);
+		return true;
+	}
+
+	// Called concurrently from the workers, the pipeline cache is internally synchronized.
+	// Base pipelines are not known at this point, so derivatives are created as regular pipelines.
+	bool create_graphics_pipeline(size_t index)
+	{
+		auto info = *graphics_infos[index];
+		info.flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+		info.basePipelineHandle = VK_NULL_HANDLE;
+		info.basePipelineIndex = -1;
+
+		LOGI("Creating graphics pipeline %0" PRIX64 "\n", graphics_hashes[index]);
+		if (vkCreateGraphicsPipelines(device->get_device(), pipeline_cache, 1, &info, nullptr,
+		                              &graphics_pipelines[index]) != VK_SUCCESS)
 		{
-			LOGI("Creating graphics pipeline %0" PRIX64 "\n", hash);
-			if (vkCreateGraphicsPipelines(device->get_device(), pipeline_cache, 1, create_info, nullptr, pipeline) !=
-			    VK_SUCCESS)
-			{
-				LOGE(" ... Failed!\n");
-				return false;
-			}
-			LOGI(" ... Succeeded!\n");
+			LOGE(" ... Failed!\n");
+			return false;
 		}
-		else
-			*pipeline = fake_handle<VkPipeline>(hash);
+		LOGI(" ... Succeeded!\n");
+		return true;
+	}
 
-		graphics_pipelines.push_back(*pipeline);
-		graphics_infos.push_back(create_info);
-		graphics_hashes.push_back(hash);
+	bool create_compute_pipeline(size_t index)
+	{
+		auto info = *compute_infos[index];
+		info.flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+		info.basePipelineHandle = VK_NULL_HANDLE;
+		info.basePipelineIndex = -1;
+
+		LOGI("Creating compute pipeline %0" PRIX64 "\n", compute_hashes[index]);
+		if (vkCreateComputePipelines(device->get_device(), pipeline_cache, 1, &info, nullptr,
+		                             &compute_pipelines[index]) != VK_SUCCESS)
+		{
+			LOGE(" ... Failed!\n");
+			return false;
+		}
+		LOGI(" ... Succeeded!\n");
 		return true;
 	}
 
@@ -245,6 +268,7 @@ struct DisasmReplayer : StateCreatorInterface
 
 	vector<Hash> graphics_hashes;
 	vector<Hash> compute_hashes;
+	vector<Hash> shader_module_hashes;
 	unordered_map<VkShaderModule, unsigned> module_to_index;
 
 	vector<VkSampler> samplers;
@@ -433,6 +457,178 @@ static string disassemble_spirv(const VulkanDevice &device, VkPipeline pipeline,
 	}
 }
 
+// Keyed on the module hash, plus entry point and stage for GLSL, and seeded with the method and tool versions.
+// Only the SPIR-V level methods are cached, AMD disassembly depends on the driver.
+struct DisasmCache
+{
+	bool init(const char *path, DisasmMethod method)
+	{
+		unsigned major = 0, minor = 0, patch = 0;
+		spvc_get_version(&major, &minor, &patch);
+
+		string key = spvSoftwareVersionDetailsString();
+		key += "\nSPIRV-Cross " + to_string(major) + "." + to_string(minor) + "." + to_string(patch);
+		key += "\nmethod " + to_string(int(method));
+		seed = xxhash64(key.data(), key.size(), 0);
+
+		db.reset(create_database(path, DatabaseMode::Append));
+		return db && db->prepare();
+	}
+
+	Hash get_key(Hash module_hash, const char *entry, VkShaderStageFlagBits stage) const
+	{
+		Hash h = xxhash64(&module_hash, sizeof(module_hash), seed);
+		uint32_t stage_bits = stage;
+		h = xxhash64(&stage_bits, sizeof(stage_bits), h);
+		if (entry)
+			h = xxhash64(entry, strlen(entry), h);
+		return h;
+	}
+
+	bool lookup(Hash key, string &text)
+	{
+		lock_guard<mutex> holder{lock};
+		size_t size = 0;
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, key, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		text.resize(size);
+		return db->read_entry(RESOURCE_SHADER_MODULE, key, &size, &text[0], PAYLOAD_READ_NO_FLAGS);
+	}
+
+	void store(Hash key, const string &text)
+	{
+		lock_guard<mutex> holder{lock};
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, key, text.data(), text.size(),
+		                     PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+			LOGE("Failed to write disassembly to cache.\n");
+	}
+
+	unique_ptr<DatabaseInterface> db;
+	mutex lock;
+	Hash seed = 0;
+};
+
+static string disassemble_spirv_cached(DisasmCache *cache, const VulkanDevice &device, VkPipeline pipeline,
+                                       DisasmMethod method, VkShaderStageFlagBits stage,
+                                       const VkShaderModuleCreateInfo *module_create_info, Hash module_hash,
+                                       const char *entry_point)
+{
+	if (!cache || method == DisasmMethod::AMD)
+		return disassemble_spirv(device, pipeline, method, stage, module_create_info, entry_point);
+
+	// Assembly does not depend on the entry point.
+	Hash key = method == DisasmMethod::GLSL ?
+	           cache->get_key(module_hash, entry_point, stage) :
+	           cache->get_key(module_hash, nullptr, VK_SHADER_STAGE_ALL);
+
+	string text;
+	if (cache->lookup(key, text))
+		return text;
+
+	text = disassemble_spirv(device, pipeline, method, stage, module_create_info, entry_point);
+	if (!text.empty() && text != "// Failed")
+		cache->store(key, text);
+	return text;
+}
+
+struct DisasmOutput
+{
+	string path;
+	string text;
+};
+
+// Runs jobs on a pool of threads, while the calling thread writes the outputs of each job in job order.
+// Workers may only run a bounded number of jobs ahead of the writer.
+static bool run_disasm_jobs(size_t job_count, unsigned num_threads,
+                            const function<bool (size_t, vector<DisasmOutput> &)> &job)
+{
+	struct Slot
+	{
+		vector<DisasmOutput> outputs;
+		bool ready = false;
+		bool success = false;
+	};
+
+	num_threads = unsigned(std::max<size_t>(1, std::min<size_t>(num_threads, job_count)));
+	vector<Slot> slots(num_threads * 16);
+	atomic<size_t> next_job{0};
+	size_t next_write = 0;
+	bool failed = false;
+	mutex lock;
+	condition_variable cond;
+
+	auto worker = [&]() {
+		for (;;)
+		{
+			size_t index = next_job.fetch_add(1, memory_order_relaxed);
+			if (index >= job_count)
+				break;
+
+			{
+				unique_lock<mutex> holder{lock};
+				cond.wait(holder, [&]() { return failed || index < next_write + slots.size(); });
+				if (failed)
+					break;
+			}
+
+			vector<DisasmOutput> outputs;
+			bool success = job(index, outputs);
+
+			lock_guard<mutex> holder{lock};
+			auto &slot = slots[index % slots.size()];
+			slot.outputs = move(outputs);
+			slot.success = success;
+			slot.ready = true;
+			cond.notify_all();
+		}
+	};
+
+	vector<thread> workers;
+	for (unsigned i = 0; i < num_threads; i++)
+		workers.emplace_back(worker);
+
+	unique_lock<mutex> holder{lock};
+	while (next_write < job_count && !failed)
+	{
+		auto &slot = slots[next_write % slots.size()];
+		cond.wait(holder, [&]() { return slot.ready; });
+
+		auto outputs = move(slot.outputs);
+		bool success = slot.success;
+		slot.outputs.clear();
+		slot.ready = false;
+		next_write++;
+		cond.notify_all();
+		holder.unlock();
+
+		for (auto &output : outputs)
+		{
+			if (!success)
+				break;
+
+			LOGI("Dumping disassembly to: %s\n", output.path.c_str());
+			if (!write_string_to_file(output.path.c_str(), output.text.c_str()))
+			{
+				LOGE("Failed to write disassembly to file: %s\n", output.path.c_str());
+				success = false;
+			}
+		}
+
+		holder.lock();
+		if (!success)
+		{
+			failed = true;
+			cond.notify_all();
+		}
+	}
+	holder.unlock();
+
+	for (auto &w : workers)
+		w.join();
+
+	return !failed;
+}
+
 static void print_help()
 {
 	LOGI("fossilize-disasm\n"
@@ -441,6 +637,8 @@ static void print_help()
 	     "\t[--enable-validation]\n"
 	     "\t[--output <path>]\n"
 	     "\t[--target asm/glsl/amd]\n"
+	     "\t[--threads <count>]\n"
+	     "\t[--cache <path>]\n"
 	     "state.json\n");
 }
 
@@ -479,6 +677,8 @@ int main(int argc, char *argv[])
 	VulkanDevice::Options opts;
 	DisasmMethod method = DisasmMethod::Asm;
 	bool module_only = false;
+	unsigned num_threads = 0;
+	string cache_path;
 
 	CLICallbacks cbs;
 	cbs.default_handler = [&](const char *arg) { json_path = arg; };
@@ -490,6 +690,8 @@ int main(int argc, char *argv[])
 		method = method_from_string(parser.next_string());
 	});
 	cbs.add("--module-only", [&](CLIParser &) { module_only = true; });
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--cache", [&](CLIParser &parser) { cache_path = parser.next_string(); });
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -598,80 +800,92 @@ int main(int argc, char *argv[])
 		LOGI("Replayed tag: %s\n", tag_names[tag]);
 	}
 
-	unordered_set<VkShaderModule> unique_shader_modules;
+	DisasmCache cache;
+	if (!cache_path.empty() && !cache.init(cache_path.c_str(), method))
+	{
+		LOGE("Failed to open disassembly cache: %s\n", cache_path.c_str());
+		return EXIT_FAILURE;
+	}
+	DisasmCache *disasm_cache = cache_path.empty() ? nullptr : &cache;
+
+	if (!num_threads)
+		num_threads = max(1u, thread::hardware_concurrency());
 
 	if (module_only)
 	{
-		string disassembled;
 		size_t module_count = replayer.shader_module_infos.size();
-		for (size_t i = 0; i < module_count; i++)
-		{
-			auto *module_info = replayer.shader_module_infos[i];
-			disassembled = disassemble_spirv(device, VK_NULL_HANDLE, method, VK_SHADER_STAGE_ALL,
-			                                 module_info, nullptr);
+		auto disasm_module = [&](size_t i, vector<DisasmOutput> &outputs) -> bool {
+			DisasmOutput out;
+			out.text = disassemble_spirv_cached(disasm_cache, device, VK_NULL_HANDLE, method, VK_SHADER_STAGE_ALL,
+			                                    replayer.shader_module_infos[i], replayer.shader_module_hashes[i],
+			                                    nullptr);
 
 			auto module_hash = (Hash)replayer.shader_modules[i];
-			string path = output + "/" + uint64_string(module_hash);
+			out.path = output + "/" + uint64_string(module_hash);
+			outputs.push_back(move(out));
+			return true;
+		};
 
-			LOGI("Dumping disassembly to: %s\n", path.c_str());
-			if (!write_string_to_file(path.c_str(), disassembled.c_str()))
-			{
-				LOGE("Failed to write disassembly to file: %s\n", output.c_str());
-				return EXIT_FAILURE;
-			}
-		}
+		if (!run_disasm_jobs(module_count, num_threads, disasm_module))
+			return EXIT_FAILURE;
 	}
 	else
 	{
-		string disassembled;
-		size_t graphics_pipeline_count = replayer.graphics_infos.size();
-		for (size_t i = 0; i < graphics_pipeline_count; i++)
-		{
-			auto *info = replayer.graphics_infos[i];
+		// Look up everything the workers need up front, module_to_index must not be modified concurrently.
+		unordered_set<VkShaderModule> unique_shader_modules;
+		for (auto *info : replayer.graphics_infos)
 			for (uint32_t j = 0; j < info->stageCount; j++)
-			{
-				VkShaderModule module = info->pStages[j].module;
-				unique_shader_modules.insert(module);
-				auto *module_info = replayer.shader_module_infos[replayer.module_to_index[module]];
-				disassembled = disassemble_spirv(device, replayer.graphics_pipelines[i], method, info->pStages[j].stage,
-				                                 module_info, info->pStages[j].pName);
-
-				string path = output + "/" + uint64_string((uint64_t) module) + "." +
-				              info->pStages[j].pName + "." +
-				              uint64_string(replayer.graphics_hashes[i]) +
-				              "." + stage_to_string(info->pStages[j].stage);
-
-				LOGI("Dumping disassembly to: %s\n", path.c_str());
-				if (!write_string_to_file(path.c_str(), disassembled.c_str()))
-				{
-					LOGE("Failed to write disassembly to file: %s\n", output.c_str());
-					return EXIT_FAILURE;
-				}
-			}
-		}
+				if (replayer.module_to_index.count(info->pStages[j].module))
+					unique_shader_modules.insert(info->pStages[j].module);
+		for (auto *info : replayer.compute_infos)
+			if (replayer.module_to_index.count(info->stage.module))
+				unique_shader_modules.insert(info->stage.module);
 
+		size_t graphics_pipeline_count = replayer.graphics_infos.size();
 		size_t compute_pipeline_count = replayer.compute_infos.size();
-		for (size_t i = 0; i < compute_pipeline_count; i++)
-		{
-			auto *info = replayer.compute_infos[i];
-			VkShaderModule module = info->stage.module;
-			unique_shader_modules.insert(module);
-			auto *module_info = replayer.shader_module_infos[replayer.module_to_index[module]];
-			disassembled = disassemble_spirv(device, replayer.compute_pipelines[i], method, info->stage.stage,
-			                                 module_info, info->stage.pName);
-
-			string path = output + "/" + uint64_string((uint64_t) module) + "." +
-			              info->stage.pName + "." +
-			              uint64_string(replayer.compute_hashes[i]) +
-			              "." + stage_to_string(info->stage.stage);
-
-			LOGI("Dumping disassembly to: %s\n", path.c_str());
-			if (!write_string_to_file(path.c_str(), disassembled.c_str()))
+
+		auto disasm_stage = [&](VkPipeline pipeline, const VkPipelineShaderStageCreateInfo &stage, Hash pipeline_hash,
+		                        vector<DisasmOutput> &outputs) {
+			VkShaderModule module = stage.module;
+			auto itr = replayer.module_to_index.find(module);
+			if (itr == replayer.module_to_index.end())
+				return;
+
+			DisasmOutput out;
+			out.text = disassemble_spirv_cached(disasm_cache, device, pipeline, method, stage.stage,
+			                                    replayer.shader_module_infos[itr->second],
+			                                    replayer.shader_module_hashes[itr->second], stage.pName);
+			out.path = output + "/" + uint64_string((uint64_t) module) + "." +
+			           stage.pName + "." +
+			           uint64_string(pipeline_hash) +
+			           "." + stage_to_string(stage.stage);
+			outputs.push_back(move(out));
+		};
+
+		auto disasm_pipeline = [&](size_t index, vector<DisasmOutput> &outputs) -> bool {
+			if (index < graphics_pipeline_count)
 			{
-				LOGE("Failed to write disassembly to file: %s\n", output.c_str());
-				return EXIT_FAILURE;
+				if (device.get_device() && !replayer.create_graphics_pipeline(index))
+					return true;
+
+				auto *info = replayer.graphics_infos[index];
+				for (uint32_t j = 0; j < info->stageCount; j++)
+					disasm_stage(replayer.graphics_pipelines[index], info->pStages[j], replayer.graphics_hashes[index], outputs);
 			}
-		}
+			else
+			{
+				index -= graphics_pipeline_count;
+				if (device.get_device() && !replayer.create_compute_pipeline(index))
+					return true;
+
+				auto *info = replayer.compute_infos[index];
+				disasm_stage(replayer.compute_pipelines[index], info->stage, replayer.compute_hashes[index], outputs);
+			}
+			return true;
+		};
+
+		if (!run_disasm_jobs(graphics_pipeline_count + compute_pipeline_count, num_threads, disasm_pipeline))
+			return EXIT_FAILURE;
 
 		LOGI("Shader modules used: %u, shader modules in database: %u\n",
 		     unsigned(unique_shader_modules.size()), unsigned(replayer.shader_module_infos.size()));
@@ -25,6 +25,7 @@
 #include "layer/utils.hpp"
 #include <memory>
 #include <vector>
+#include <algorithm>
 #include <inttypes.h>
 
 using namespace Fossilize;
@@ -34,7 +35,137 @@ static void print_help()
 {
 	LOGI("Usage: fossilize-list\n"
 	     "\t<database path>\n"
-	     "\t[--tag index]\n");
+	     "\t[--tag index]\n"
+	     "\t[--stats]\n"
+	     "\t[--top count]\n");
+}
+
+static const char *tag_names[RESOURCE_COUNT] = {
+	"AppInfo",
+	"Sampler",
+	"Descriptor Set Layout",
+	"Pipeline Layout",
+	"Shader Module",
+	"Render Pass",
+	"Graphics Pipeline",
+	"Compute Pipeline",
+	"Application Blob Link",
+	"Graphics Pipeline State",
+	"Usage Metadata",
+};
+
+static const char *compression_names[DATABASE_COMPRESSION_COUNT] = {
+	"none",
+	"deflate",
+	"zstd",
+	"zstd+dictionary",
+	"lz4",
+	"unknown",
+};
+
+struct StatsEntry
+{
+	ResourceTag tag;
+	Hash hash;
+	DatabaseEntryInfo info;
+};
+
+static size_t percentile(const vector<size_t> &sorted_sizes, unsigned percent)
+{
+	if (sorted_sizes.empty())
+		return 0;
+	return sorted_sizes[(sorted_sizes.size() - 1) * percent / 100];
+}
+
+// Everything here comes from the archive index and payload headers, no payload is read.
+static bool print_stats(DatabaseInterface &db, unsigned top_count)
+{
+	vector<StatsEntry> all_entries;
+	uint64_t total_stored = 0;
+	uint64_t total_uncompressed = 0;
+
+	printf("%-24s %10s %14s %14s %7s %10s %10s %10s %10s\n",
+	       "Tag", "Count", "Stored", "Uncompressed", "Ratio", "Median", "P90", "P99", "Max");
+
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		size_t hash_count = 0;
+		if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		vector<Hash> hashes(hash_count);
+		if (!db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		uint64_t stored = 0;
+		uint64_t uncompressed = 0;
+		unsigned compression_counts[DATABASE_COMPRESSION_COUNT] = {};
+		unsigned checksum_count = 0;
+		vector<size_t> sizes;
+		sizes.reserve(hashes.size());
+
+		for (auto hash : hashes)
+		{
+			StatsEntry entry = { tag, hash, {} };
+			if (!db.get_entry_info(tag, hash, &entry.info))
+			{
+				LOGE("Database does not support reading entry information without payloads.\n");
+				return false;
+			}
+
+			stored += entry.info.stored_size;
+			uncompressed += entry.info.uncompressed_size;
+			compression_counts[entry.info.compression]++;
+			if (entry.info.has_checksum)
+				checksum_count++;
+			sizes.push_back(entry.info.stored_size);
+			all_entries.push_back(entry);
+		}
+
+		if (hashes.empty())
+			continue;
+
+		sort(sizes.begin(), sizes.end());
+		printf("%-24s %10u %14" PRIu64 " %14" PRIu64 " %6.2fx %10u %10u %10u %10u\n",
+		       tag_names[tag], unsigned(hashes.size()), stored, uncompressed,
+		       stored ? double(uncompressed) / double(stored) : 0.0,
+		       unsigned(percentile(sizes, 50)), unsigned(percentile(sizes, 90)),
+		       unsigned(percentile(sizes, 99)), unsigned(sizes.back()));
+
+		printf("%-24s", "");
+		for (unsigned c = 0; c < DATABASE_COMPRESSION_COUNT; c++)
+			if (compression_counts[c])
+				printf(" %s: %u", compression_names[c], compression_counts[c]);
+		printf(", checksummed: %u\n", checksum_count);
+
+		total_stored += stored;
+		total_uncompressed += uncompressed;
+	}
+
+	printf("%-24s %10u %14" PRIu64 " %14" PRIu64 " %6.2fx\n", "Total", unsigned(all_entries.size()),
+	       total_stored, total_uncompressed,
+	       total_stored ? double(total_uncompressed) / double(total_stored) : 0.0);
+
+	if (top_count)
+	{
+		top_count = unsigned(min<size_t>(top_count, all_entries.size()));
+		partial_sort(all_entries.begin(), all_entries.begin() + top_count, all_entries.end(),
+		             [](const StatsEntry &a, const StatsEntry &b) {
+			             return a.info.uncompressed_size > b.info.uncompressed_size;
+		             });
+
+		printf("\nLargest entries:\n");
+		for (unsigned i = 0; i < top_count; i++)
+		{
+			auto &entry = all_entries[i];
+			printf("%-24s %016" PRIx64 " %10u stored, %10u uncompressed, %s\n",
+			       tag_names[entry.tag], entry.hash,
+			       unsigned(entry.info.stored_size), unsigned(entry.info.uncompressed_size),
+			       compression_names[entry.info.compression]);
+		}
+	}
+
+	return true;
 }
 
 int main(int argc, char **argv)
@@ -42,9 +173,13 @@ int main(int argc, char **argv)
 	CLICallbacks cbs;
 	string db_path;
 	unsigned tag_uint = 0;
+	unsigned top_count = 10;
+	bool stats = false;
 	cbs.default_handler = [&](const char *path) { db_path = path; };
 	cbs.add("--help", [&](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--tag", [&](CLIParser &parser) { tag_uint = parser.next_uint(); });
+	cbs.add("--stats", [&](CLIParser &) { stats = true; });
+	cbs.add("--top", [&](CLIParser &parser) { top_count = parser.next_uint(); });
 	cbs.error_handler = [] { print_help(); };
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
 
@@ -66,6 +201,9 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (stats)
+		return print_stats(*input_db, top_count) ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	if (tag_uint >= RESOURCE_COUNT)
 	{
 		LOGE("--tag (%u) is out of range.\n", tag_uint);
@@ -23,18 +23,82 @@
 #include "fossilize_db.hpp"
 #include <memory>
 #include <vector>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
 #include "layer/utils.hpp"
+#include "file.hpp"
 
 using namespace Fossilize;
 
 static void print_help()
 {
 	LOGI("Usage: fossilize-merge-db append.foz [input1.foz] [input2.foz] ...\n");
+	LOGI("       fossilize-merge-db --compact base_path\n");
+	LOGI("       Merges all idle base_path.%%d.foz archives into base_path.foz and removes them.\n");
+	LOGI("       fossilize-merge-db --bulk shard_count base_path [input1.foz] [@list.txt] ...\n");
+	LOGI("       Merges all inputs at once into base_path.1.foz to base_path.<shard_count>.foz.\n");
+	LOGI("       @list.txt names a file with one input per line.\n");
+}
+
+// Thousands of inputs do not fit on a command line, so they can also be listed in a file.
+static bool add_bulk_input(std::vector<std::string> &paths, const char *arg)
+{
+	if (*arg != '@')
+	{
+		paths.emplace_back(arg);
+		return true;
+	}
+
+	auto list = load_buffer_from_file(arg + 1);
+	if (list.empty())
+	{
+		LOGE("Failed to read input list %s.\n", arg + 1);
+		return false;
+	}
+
+	std::string line;
+	for (auto c : list)
+	{
+		if (c == '\n' || c == '\r')
+		{
+			if (!line.empty())
+				paths.push_back(std::move(line));
+			line.clear();
+		}
+		else
+			line.push_back(char(c));
+	}
+
+	if (!line.empty())
+		paths.push_back(std::move(line));
+	return true;
+}
+
+static int run_bulk_merge(int argc, char **argv)
+{
+	unsigned num_shards = unsigned(strtoul(argv[2], nullptr, 0));
+	std::vector<std::string> paths;
+	for (int i = 4; i < argc; i++)
+		if (!add_bulk_input(paths, argv[i]))
+			return EXIT_FAILURE;
+
+	std::vector<const char *> inputs;
+	inputs.reserve(paths.size());
+	for (auto &path : paths)
+		inputs.push_back(path.c_str());
+
+	return bulk_merge_databases(argv[3], num_shards, inputs.data(), inputs.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char **argv)
 {
 	std::vector<const char *> inputs;
+	if (argc == 3 && strcmp(argv[1], "--compact") == 0)
+		return compact_concurrent_database(argv[2]) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (argc >= 4 && strcmp(argv[1], "--bulk") == 0)
+		return run_bulk_merge(argc, argv);
+
 	if (argc < 3)
 	{
 		print_help();
@@ -25,8 +25,17 @@
 #include "cli_parser.hpp"
 #include "fossilize_db.hpp"
 #include "file.hpp"
+#include "database_transform.hpp"
+#include "xxhash64.hpp"
 #include "spirv-tools/optimizer.hpp"
+#include "spirv-tools/libspirv.h"
 #include <inttypes.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace Fossilize;
@@ -37,10 +46,135 @@ static inline T fake_handle(uint64_t v)
 	return (T)v;
 }
 
+static void register_passes(spvtools::Optimizer &optimizer, bool optimize_size)
+{
+	if (optimize_size)
+		optimizer.RegisterSizePasses();
+	else
+		optimizer.RegisterPerformancePasses();
+}
+
+// Optimized modules keyed on the input module hash, the pass list and the SPIRV-Tools version.
+// Backed by a stream archive, so re-running over a grown archive only optimizes new modules.
+struct OptimizationCache
+{
+	bool init(const char *path, bool optimize_size)
+	{
+		spvtools::Optimizer optimizer(SPV_ENV_VULKAN_1_1);
+		register_passes(optimizer, optimize_size);
+
+		string key = spvSoftwareVersionDetailsString();
+		key += "\nvulkan1.1";
+		for (auto *name : optimizer.GetPassNames())
+		{
+			key += "\n";
+			key += name;
+		}
+		seed = xxhash64(key.data(), key.size(), 0);
+
+		db.reset(create_database(path, DatabaseMode::Append));
+		return db && db->prepare();
+	}
+
+	Hash get_key(Hash module_hash) const
+	{
+		return xxhash64(&module_hash, sizeof(module_hash), seed);
+	}
+
+	// Failed optimizations are cached as a single zero word, which is never valid SPIR-V.
+	bool lookup(Hash module_hash, vector<uint32_t> &code, bool *failed)
+	{
+		if (!db)
+			return false;
+
+		Hash key = get_key(module_hash);
+		lock_guard<mutex> holder{lock};
+		size_t size = 0;
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, key, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		if (size == 0 || (size % sizeof(uint32_t)) != 0)
+			return false;
+		code.resize(size / sizeof(uint32_t));
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, key, &size, code.data(), PAYLOAD_READ_NO_FLAGS))
+			return false;
+
+		*failed = code.size() == 1 && code.front() == 0;
+		return true;
+	}
+
+	void store(Hash module_hash, const vector<uint32_t> &code, bool failed)
+	{
+		if (!db)
+			return;
+
+		static const uint32_t failed_marker = 0;
+		const void *data = failed ? &failed_marker : code.data();
+		size_t size = failed ? sizeof(failed_marker) : code.size() * sizeof(uint32_t);
+
+		lock_guard<mutex> holder{lock};
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, get_key(module_hash), data, size,
+		                     PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+			LOGE("Failed to write shader module %016" PRIx64 " to optimization cache.\n", module_hash);
+	}
+
+	unique_ptr<DatabaseInterface> db;
+	mutex lock;
+	Hash seed = 0;
+};
+
+// Drops shader modules recorded by the pipeline recorder, which only records the original modules
+// so it can refer to them. Optimized modules are written by the module recorder instead.
+struct DropShaderModules : DatabaseInterface
+{
+	bool prepare() override
+	{
+		return true;
+	}
+
+	bool read_entry(ResourceTag, Hash, size_t *, void *, PayloadReadFlags) override
+	{
+		return false;
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	{
+		if (tag == RESOURCE_SHADER_MODULE)
+			return true;
+		return sink->write_entry(tag, hash, blob, size, flags);
+	}
+
+	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		// Makes the recorder skip serializing modules altogether.
+		if (tag == RESOURCE_SHADER_MODULE)
+			return true;
+		return sink->has_entry(tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag, size_t *, Hash *) override
+	{
+		return false;
+	}
+
+	void flush() override
+	{
+	}
+
+	DatabaseInterface *sink = nullptr;
+};
+
 struct OptimizeReplayer : StateCreatorInterface
 {
 	StateRecorder recorder;
-	bool optimize_size = false;
+	StateRecorder module_recorder;
+	StateReplayer replayer;
+	DropShaderModules pipeline_sink;
+	DatabaseInterface *resolver = nullptr;
+	unique_ptr<spvtools::Optimizer> optimizer;
+	OptimizationCache *cache = nullptr;
+
+	// Only modules which are replayed as their own entry are optimized, not the ones pulled in through the resolver.
+	bool optimize_modules = false;
 
 	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
 	{
@@ -60,30 +194,39 @@ struct OptimizeReplayer : StateCreatorInterface
 		return recorder.record_pipeline_layout(*layout, *create_info, hash);
 	}
 
+	bool optimize(Hash hash, const VkShaderModuleCreateInfo &create_info, vector<uint32_t> &compiled_spirv)
+	{
+		bool failed = false;
+		if (cache && cache->lookup(hash, compiled_spirv, &failed))
+			return !failed;
+
+		failed = !optimizer->Run(create_info.pCode, create_info.codeSize / sizeof(uint32_t), &compiled_spirv);
+		if (cache)
+			cache->store(hash, compiled_spirv, failed);
+		return !failed;
+	}
+
 	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
 	{
-		vector<uint32_t> compiled_spirv;
-		spvtools::Optimizer optimizer(SPV_ENV_VULKAN_1_1);
+		*module = fake_handle<VkShaderModule>(hash);
+		if (!recorder.record_shader_module(*module, *create_info, hash))
+			return false;
 
-		if (optimize_size)
-			optimizer.RegisterSizePasses();
-		else
-			optimizer.RegisterPerformancePasses();
+		if (!optimize_modules)
+			return true;
 
-		if (!optimizer.Run(create_info->pCode, create_info->codeSize / sizeof(uint32_t), &compiled_spirv))
+		vector<uint32_t> compiled_spirv;
+		if (!optimize(hash, *create_info, compiled_spirv))
 		{
 			LOGE("Failed to optimize shader module %016" PRIx64 ". Using original module.\n", hash);
-			*module = fake_handle<VkShaderModule>(hash);
-			return recorder.record_shader_module(*module, *create_info, hash);
+			return module_recorder.record_shader_module(*module, *create_info, hash);
 		}
 		else
 		{
 			auto info = *create_info;
 			info.pCode = compiled_spirv.data();
 			info.codeSize = compiled_spirv.size() * sizeof(uint32_t);
-
-			*module = fake_handle<VkShaderModule>(hash);
-			return recorder.record_shader_module(*module, info, hash);
+			return module_recorder.record_shader_module(*module, info, hash);
 		}
 	}
 
@@ -106,11 +249,69 @@ struct OptimizeReplayer : StateCreatorInterface
 	}
 };
 
+// One optimizer and pair of recorders per worker. Recorded objects keep their hashes,
+// so workers can record the same dependencies independently.
+struct OptimizeTransform : DatabaseTransform
+{
+	bool init_worker(unsigned worker_index, DatabaseInterface &input, DatabaseInterface &sink) override
+	{
+		auto &worker = *workers[worker_index];
+		worker.resolver = &input;
+		worker.cache = cache;
+		worker.optimizer.reset(new spvtools::Optimizer(SPV_ENV_VULKAN_1_1));
+		register_passes(*worker.optimizer, optimize_size);
+
+		worker.recorder.set_database_enable_checksum(true);
+		worker.recorder.set_database_enable_compression(true);
+		worker.module_recorder.set_database_enable_checksum(true);
+		worker.module_recorder.set_database_enable_compression(true);
+
+		worker.pipeline_sink.sink = &sink;
+		worker.recorder.init_recording_thread(&worker.pipeline_sink);
+		worker.module_recorder.init_recording_thread(&sink);
+		return true;
+	}
+
+	bool shared_entry(unsigned worker_index, ResourceTag tag, Hash hash, const void *blob, size_t size) override
+	{
+		auto &worker = *workers[worker_index];
+		// Every worker sees these, only complain once.
+		if (!worker.replayer.parse(worker, worker.resolver, blob, size) && worker_index == 0)
+			LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+		return true;
+	}
+
+	bool transform_entry(unsigned worker_index, ResourceTag tag, Hash hash, const void *blob, size_t size,
+	                     DatabaseTransformOutput &) override
+	{
+		auto &worker = *workers[worker_index];
+		worker.optimize_modules = tag == RESOURCE_SHADER_MODULE;
+		if (!worker.replayer.parse(worker, worker.resolver, blob, size))
+			LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+		worker.optimize_modules = false;
+		return true;
+	}
+
+	bool end_worker(unsigned worker_index) override
+	{
+		auto &worker = *workers[worker_index];
+		worker.recorder.tear_down_recording_thread();
+		worker.module_recorder.tear_down_recording_thread();
+		return true;
+	}
+
+	vector<unique_ptr<OptimizeReplayer>> workers;
+	OptimizationCache *cache = nullptr;
+	bool optimize_size = false;
+};
+
 static void print_help()
 {
 	LOGI("fossilize-opt\n"
 	     "\t[--help]\n"
 	     "\t[--optimize-size]\n"
+	     "\t[--threads <count>]\n"
+	     "\t[--cache <path>]\n"
 	     "\t[--input-db <path>]\n"
 	     "\t[--output-db <path>]\n");
 }
@@ -119,13 +320,17 @@ int main(int argc, char *argv[])
 {
 	string input_db_path;
 	string output_db_path;
+	string cache_path;
 	CLICallbacks cbs;
 	bool optimize_size = false;
+	unsigned num_threads = 0;
 
 	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--input-db", [&](CLIParser &parser) { input_db_path = parser.next_string(); });
 	cbs.add("--output-db", [&](CLIParser &parser) { output_db_path = parser.next_string(); });
 	cbs.add("--optimize-size", [&](CLIParser &) { optimize_size = true; });
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--cache", [&](CLIParser &parser) { cache_path = parser.next_string(); });
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -151,75 +356,56 @@ int main(int argc, char *argv[])
 	auto input_db = std::unique_ptr<DatabaseInterface>(create_database(input_db_path.c_str(), DatabaseMode::ReadOnly));
 	auto output_db = std::unique_ptr<DatabaseInterface>(create_database(output_db_path.c_str(), DatabaseMode::OverWrite));
 
-	OptimizeReplayer optimize_replayer;
-	optimize_replayer.optimize_size = optimize_size;
-
-	StateReplayer replayer;
-	optimize_replayer.recorder.set_database_enable_checksum(true);
-	optimize_replayer.recorder.set_database_enable_compression(true);
-
 	if (!input_db || !input_db->prepare())
 	{
-		LOGE("Failed to load database: %s\n", argv[1]);
+		LOGE("Failed to load database: %s\n", input_db_path.c_str());
 		return EXIT_FAILURE;
 	}
 
-	if (!output_db)
+	if (!output_db || !output_db->prepare())
 	{
-		LOGE("Failed to open database for writing: %s\n", argv[2]);
+		LOGE("Failed to open database for writing: %s\n", output_db_path.c_str());
 		return EXIT_FAILURE;
 	}
 
-	// Recording thread prepares.
-	optimize_replayer.recorder.init_recording_thread(output_db.get());
+	OptimizationCache cache;
+	if (!cache_path.empty() && !cache.init(cache_path.c_str(), optimize_size))
+	{
+		LOGE("Failed to open optimization cache: %s\n", cache_path.c_str());
+		return EXIT_FAILURE;
+	}
 
-	static const ResourceTag playback_order[] = {
-		RESOURCE_SHADER_MODULE,
+	OptimizeTransform transform;
+	transform.optimize_size = optimize_size;
+	transform.cache = cache_path.empty() ? nullptr : &cache;
+
+	if (!num_threads)
+		num_threads = max(1u, thread::hardware_concurrency());
+	for (unsigned i = 0; i < num_threads; i++)
+		transform.workers.emplace_back(new OptimizeReplayer);
+
+	// Pipelines can only refer to layouts and render passes which the same replayer has seen,
+	// so every worker replays those first. They are cheap compared to modules and pipelines.
+	static const ResourceTag shared_order[] = {
 		RESOURCE_SAMPLER,
 		RESOURCE_DESCRIPTOR_SET_LAYOUT,
 		RESOURCE_PIPELINE_LAYOUT,
 		RESOURCE_RENDER_PASS,
+	};
+
+	static const ResourceTag playback_order[] = {
+		RESOURCE_SHADER_MODULE,
 		RESOURCE_GRAPHICS_PIPELINE,
 		RESOURCE_COMPUTE_PIPELINE,
 	};
 
-	vector<uint8_t> state_json;
-	for (auto &tag : playback_order)
-	{
-		size_t hash_count = 0;
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-		{
-			LOGE("Failed to get hashes.\n");
-			return EXIT_FAILURE;
-		}
-
-		vector<Hash> hashes(hash_count);
-
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-		{
-			LOGE("Failed to get shader module hashes.\n");
-			return EXIT_FAILURE;
-		}
-
-		for (auto hash : hashes)
-		{
-			size_t state_json_size;
-			if (!input_db->read_entry(tag, hash, &state_json_size, nullptr, 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			state_json.resize(state_json_size);
-
-			if (!input_db->read_entry(tag, hash, &state_json_size, state_json.data(), 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			if (!replayer.parse(optimize_replayer, input_db.get(), state_json.data(), state_json.size()))
-				LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
-		}
-	}
+	DatabaseTransformOptions options;
+	options.tags = playback_order;
+	options.num_tags = sizeof(playback_order) / sizeof(playback_order[0]);
+	options.shared_tags = shared_order;
+	options.num_shared_tags = sizeof(shared_order) / sizeof(shared_order[0]);
+	options.num_threads = num_threads;
+	options.serialize_input_reads = database_transform_needs_serialized_reads(input_db_path.c_str());
+	if (!run_database_transform(*input_db, *output_db, transform, options))
+		return EXIT_FAILURE;
 }
@@ -26,8 +26,11 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <algorithm>
 #include "layer/utils.hpp"
 #include "cli_parser.hpp"
+#include "reference_graph.hpp"
+#include "pipeline_order.hpp"
 #include <inttypes.h>
 
 using namespace Fossilize;
@@ -46,17 +49,21 @@ static void print_help()
 	     "\t[--skip-compute hash]\n"
 	     "\t[--skip-module hash]\n"
 	     "\t[--skip-application-info-links]\n"
-	     "\t[--invert-module-pruning]\n");
+	     "\t[--invert-module-pruning]\n"
+	     "\t[--min-sessions count]\n"
+	     "\t[--reference-graph path]\n"
+	     "\t[--no-reference-graph-cache]\n");
 }
 
-template <typename T>
-static inline T fake_handle(uint64_t v)
+struct PruneFilter
 {
-	return (T)v;
-}
+	explicit PruneFilter(const ReferenceGraph &graph_)
+		: graph(graph_)
+	{
+	}
+
+	const ReferenceGraph &graph;
 
-struct PruneReplayer : StateCreatorInterface
-{
 	unordered_set<Hash> accessed_samplers;
 	unordered_set<Hash> accessed_descriptor_sets;
 	unordered_set<Hash> accessed_pipeline_layouts;
@@ -71,58 +78,28 @@ struct PruneReplayer : StateCreatorInterface
 	unordered_set<Hash> banned_compute;
 	unordered_set<Hash> banned_modules;
 
-	unordered_map<Hash, const VkDescriptorSetLayoutCreateInfo *> descriptor_sets;
-	unordered_map<Hash, const VkPipelineLayoutCreateInfo *> pipeline_layouts;
-
 	unordered_set<Hash> filtered_blob_hashes[RESOURCE_COUNT];
 
 	Hash filter_application_hash = 0;
 	bool should_filter_application_hash = false;
 
-	Hash application_info_blob = 0;
-	bool has_application_info_for_blob = false;
-	bool blob_belongs_to_application_info = false;
-
 	bool skip_application_info_links = false;
 
-	void set_application_info(Hash hash, const VkApplicationInfo *app,
-	                          const VkPhysicalDeviceFeatures2 *) override
-	{
-		LOGI("Available application feature hash: %016" PRIx64 "\n", hash);
-
-		if (app)
-		{
-			LOGI("  applicationInfo: engineName = %s, applicationName = %s, engineVersion = %u, appVersion = %u\n",
-			     app->pEngineName ? app->pEngineName : "N/A", app->pApplicationName ? app->pApplicationName : "N/A",
-			     app->engineVersion, app->applicationVersion);
-		}
-	}
-
-	void set_current_application_info(Hash hash) override
-	{
-		application_info_blob = hash;
-		has_application_info_for_blob = true;
-		blob_belongs_to_application_info = !should_filter_application_hash || (hash == filter_application_hash);
-	}
-
-	void notify_application_info_link(Hash link_hash, Hash app_hash, ResourceTag tag, Hash hash) override
+	void filter_application_info_links()
 	{
 		if (skip_application_info_links)
 			return;
 
-		if (should_filter_application_hash && app_hash == filter_application_hash)
+		for (auto &link : graph.links)
 		{
-			filtered_blob_hashes[tag].insert(hash);
-			filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK].insert(link_hash);
+			if (should_filter_application_hash && link.application == filter_application_hash)
+			{
+				filtered_blob_hashes[link.tag].insert(link.hash);
+				filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK].insert(link.link_hash);
+			}
+			else if (!should_filter_application_hash)
+				filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK].insert(link.link_hash);
 		}
-		else if (!should_filter_application_hash)
-			filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK].insert(link_hash);
-	}
-
-	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
-	{
-		*sampler = fake_handle<VkSampler>(hash);
-		return true;
 	}
 
 	void access_sampler(Hash hash)
@@ -136,20 +113,13 @@ struct PruneReplayer : StateCreatorInterface
 			return;
 		accessed_descriptor_sets.insert(hash);
 
-		auto *create_info = descriptor_sets[hash];
-		if (!create_info)
+		auto *node = graph.find_node(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash);
+		if (!node)
 			return;
 
-		for (uint32_t binding = 0; binding < create_info->bindingCount; binding++)
-		{
-			auto &bind = create_info->pBindings[binding];
-			if (bind.pImmutableSamplers && bind.descriptorCount != 0)
-			{
-				for (uint32_t i = 0; i < bind.descriptorCount; i++)
-					if (bind.pImmutableSamplers[i] != VK_NULL_HANDLE)
-						access_sampler((Hash)bind.pImmutableSamplers[i]);
-			}
-		}
+		auto *refs = graph.get_references(*node);
+		for (uint32_t i = 0; i < node->reference_count; i++)
+			access_sampler(refs[i].hash);
 	}
 
 	void access_pipeline_layout(Hash hash)
@@ -158,41 +128,16 @@ struct PruneReplayer : StateCreatorInterface
 			return;
 		accessed_pipeline_layouts.insert(hash);
 
-		auto *create_info = pipeline_layouts[hash];
-		if (!create_info)
+		auto *node = graph.find_node(RESOURCE_PIPELINE_LAYOUT, hash);
+		if (!node)
 			return;
 
-		for (uint32_t layout = 0; layout < create_info->setLayoutCount; layout++)
-			access_descriptor_set((Hash)create_info->pSetLayouts[layout]);
-	}
-
-	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
-	{
-		*layout = fake_handle<VkDescriptorSetLayout>(hash);
-		descriptor_sets[hash] = create_info;
-		return true;
-	}
-
-	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
-	{
-		*layout = fake_handle<VkPipelineLayout>(hash);
-		pipeline_layouts[hash] = create_info;
-		return true;
+		auto *refs = graph.get_references(*node);
+		for (uint32_t i = 0; i < node->reference_count; i++)
+			access_descriptor_set(refs[i].hash);
 	}
 
-	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
-	{
-		*module = fake_handle<VkShaderModule>(hash);
-		return true;
-	}
-
-	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
-	{
-		*render_pass = fake_handle<VkRenderPass>(hash);
-		return true;
-	}
-
-	bool filter_object(ResourceTag tag, Hash hash) const
+	bool filter_object(ResourceTag tag, Hash hash, const ReferenceGraph::Node &node) const
 	{
 		bool hash_filtering = !(filter_compute.empty() && filter_graphics.empty());
 		if (tag == RESOURCE_COMPUTE_PIPELINE)
@@ -210,6 +155,8 @@ struct PruneReplayer : StateCreatorInterface
 				return false;
 		}
 
+		bool blob_belongs_to_application_info = node.has_application &&
+		                                        (!should_filter_application_hash || node.application == filter_application_hash);
 		return blob_belongs_to_application_info || !should_filter_application_hash || (filtered_blob_hashes[tag].count(hash) != 0);
 	}
 
@@ -223,60 +170,56 @@ struct PruneReplayer : StateCreatorInterface
 		return filter_modules.count(hash) != 0;
 	}
 
-	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	void access_pipeline(ResourceTag tag, Hash hash, const ReferenceGraph::Node &node)
 	{
-		*pipeline = fake_handle<VkPipeline>(hash);
+		if (!filter_object(tag, hash, node))
+			return;
 
-		if (filter_object(RESOURCE_COMPUTE_PIPELINE, hash))
+		auto *refs = graph.get_references(node);
+		bool allow_pipeline = false;
+		for (uint32_t i = 0; i < node.reference_count; i++)
 		{
-			bool allow_pipeline = filter_shader_module((Hash)create_info->stage.module);
-
-			if (allow_pipeline)
+			if (refs[i].tag == RESOURCE_SHADER_MODULE && filter_shader_module(refs[i].hash))
 			{
-				access_pipeline_layout((Hash) create_info->layout);
-				accessed_shader_modules.insert((Hash) create_info->stage.module);
-				accessed_compute_pipelines.insert(hash);
+				allow_pipeline = true;
+				break;
 			}
 		}
-		return true;
-	}
 
-	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
-	{
-		*pipeline = fake_handle<VkPipeline>(hash);
-
-		if (filter_object(RESOURCE_GRAPHICS_PIPELINE, hash))
+		// Need to test this as well, if there is at least one banned module used, we don't allow the pipeline.
+		for (uint32_t i = 0; i < node.reference_count; i++)
 		{
-			bool allow_pipeline = false;
-			for (uint32_t i = 0; i < create_info->stageCount; i++)
+			if (refs[i].tag == RESOURCE_SHADER_MODULE && banned_modules.count(refs[i].hash))
 			{
-				if (filter_shader_module((Hash) create_info->pStages[i].module))
-				{
-					allow_pipeline = true;
-					break;
-				}
+				allow_pipeline = false;
+				break;
 			}
+		}
 
-			// Need to test this as well, if there is at least one banned module used, we don't allow the pipeline.
-			for (uint32_t i = 0; i < create_info->stageCount; i++)
-			{
-				if (banned_modules.count((Hash) create_info->pStages[i].module))
-				{
-					allow_pipeline = false;
-					break;
-				}
-			}
+		if (!allow_pipeline)
+			return;
 
-			if (allow_pipeline)
-			{
-				access_pipeline_layout((Hash) create_info->layout);
-				accessed_render_passes.insert((Hash) create_info->renderPass);
-				for (uint32_t stage = 0; stage < create_info->stageCount; stage++)
-					accessed_shader_modules.insert((Hash) create_info->pStages[stage].module);
-				accessed_graphics_pipelines.insert(hash);
-			}
+		for (uint32_t i = 0; i < node.reference_count; i++)
+		{
+			auto &ref = refs[i];
+			if (ref.tag == RESOURCE_PIPELINE_LAYOUT)
+				access_pipeline_layout(ref.hash);
+			else if (ref.tag == RESOURCE_RENDER_PASS)
+				accessed_render_passes.insert(ref.hash);
+			else if (ref.tag == RESOURCE_SHADER_MODULE)
+				accessed_shader_modules.insert(ref.hash);
 		}
-		return true;
+
+		if (tag == RESOURCE_GRAPHICS_PIPELINE)
+			accessed_graphics_pipelines.insert(hash);
+		else
+			accessed_compute_pipelines.insert(hash);
+	}
+
+	void access_pipelines(ResourceTag tag)
+	{
+		for (auto &node : graph.nodes[tag])
+			access_pipeline(tag, node.first, node.second);
 	}
 };
 
@@ -322,6 +265,9 @@ int main(int argc, char *argv[])
 	bool should_filter_application_hash = false;
 	bool skip_application_info_links = false;
 	bool invert_module_pruning = false;
+	bool use_reference_graph_cache = true;
+	string reference_graph_path;
+	unsigned min_sessions = 0;
 
 	unordered_set<Hash> filter_graphics;
 	unordered_set<Hash> filter_compute;
@@ -363,6 +309,17 @@ int main(int argc, char *argv[])
 		invert_module_pruning = true;
 	});
 
+	cbs.add("--min-sessions", [&](CLIParser &parser) {
+		min_sessions = parser.next_uint();
+	});
+
+	cbs.add("--reference-graph", [&](CLIParser &parser) {
+		reference_graph_path = parser.next_string();
+	});
+	cbs.add("--no-reference-graph-cache", [&](CLIParser &) {
+		use_reference_graph_cache = false;
+	});
+
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -391,24 +348,62 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	StateReplayer replayer;
-	PruneReplayer prune_replayer;
+	// Reachability comes from the reference graph, which is cached next to the input database.
+	ReferenceGraph graph;
+	if (reference_graph_path.empty())
+		reference_graph_path = input_db_path + ".refs";
+
+	if (!use_reference_graph_cache || !graph.load(*input_db, reference_graph_path.c_str()))
+	{
+		if (!graph.build(*input_db))
+		{
+			LOGE("Failed to build reference graph.\n");
+			return EXIT_FAILURE;
+		}
+
+		if (use_reference_graph_cache && !graph.save(*input_db, reference_graph_path.c_str()))
+			LOGI("Could not save reference graph to %s.\n", reference_graph_path.c_str());
+	}
+
+	// Pipelines which were recorded without usage metadata are kept.
+	if (min_sessions)
+	{
+		unordered_map<Hash, UsageSummary> usage[RESOURCE_COUNT];
+		if (!load_usage_summaries(*input_db, usage))
+		{
+			LOGE("Failed to read usage metadata.\n");
+			return EXIT_FAILURE;
+		}
 
-	replayer.set_resolve_shader_module_handles(false);
+		if (usage[RESOURCE_GRAPHICS_PIPELINE].empty() && usage[RESOURCE_COMPUTE_PIPELINE].empty())
+		{
+			LOGE("--min-sessions needs usage metadata, see FOSSILIZE_DUMP_USAGE_METADATA.\n");
+			return EXIT_FAILURE;
+		}
+
+		for (auto &entry : usage[RESOURCE_GRAPHICS_PIPELINE])
+			if (entry.second.session_count < min_sessions)
+				banned_graphics.insert(entry.first);
+		for (auto &entry : usage[RESOURCE_COMPUTE_PIPELINE])
+			if (entry.second.session_count < min_sessions)
+				banned_compute.insert(entry.first);
+	}
+
+	PruneFilter prune_filter(graph);
 
 	if (should_filter_application_hash)
 	{
-		prune_replayer.should_filter_application_hash = true;
-		prune_replayer.filter_application_hash = application_hash;
+		prune_filter.should_filter_application_hash = true;
+		prune_filter.filter_application_hash = application_hash;
 	}
 
-	prune_replayer.filter_graphics = move(filter_graphics);
-	prune_replayer.filter_compute = move(filter_compute);
-	prune_replayer.filter_modules = move(filter_modules);
-	prune_replayer.banned_graphics = move(banned_graphics);
-	prune_replayer.banned_compute = move(banned_compute);
-	prune_replayer.banned_modules = move(banned_modules);
-	prune_replayer.skip_application_info_links = skip_application_info_links;
+	prune_filter.filter_graphics = move(filter_graphics);
+	prune_filter.filter_compute = move(filter_compute);
+	prune_filter.filter_modules = move(filter_modules);
+	prune_filter.banned_graphics = move(banned_graphics);
+	prune_filter.banned_compute = move(banned_compute);
+	prune_filter.banned_modules = move(banned_modules);
+	prune_filter.skip_application_info_links = skip_application_info_links;
 
 	static const ResourceTag playback_order[] = {
 		RESOURCE_APPLICATION_INFO,
@@ -435,10 +430,10 @@ int main(int argc, char *argv[])
 		"Graphics Pipeline",
 		"Compute Pipeline",
 		"Application Blob Link",
+		"Graphics Pipeline State",
+		"Usage Metadata",
 	};
 
-	vector<uint8_t> state_json;
-
 	for (auto &tag : playback_order)
 	{
 		size_t hash_count = 0;
@@ -447,73 +442,45 @@ int main(int argc, char *argv[])
 			LOGE("Failed to get hashes.\n");
 			return EXIT_FAILURE;
 		}
-
 		per_tag_read[tag] = hash_count;
+	}
 
-		// No need to resolve this type.
-		if (tag == RESOURCE_SHADER_MODULE)
+	vector<uint8_t> state_json;
+
+	for (auto hash : graph.application_infos)
+	{
+		LOGI("Available application feature hash: %016" PRIx64 "\n", hash);
+		if (should_filter_application_hash && hash != application_hash)
 			continue;
 
-		vector<Hash> hashes(hash_count);
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-		{
-			LOGE("Failed to get shader module hashes.\n");
+		size_t compressed_size = 0;
+		if (!input_db->read_entry(RESOURCE_APPLICATION_INFO, hash, &compressed_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
 			return EXIT_FAILURE;
-		}
-
-		for (auto hash : hashes)
-		{
-			size_t state_json_size;
-			if (!input_db->read_entry(tag, hash, &state_json_size, nullptr, 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			state_json.resize(state_json_size);
-
-			if (!input_db->read_entry(tag, hash, &state_json_size, state_json.data(), 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			prune_replayer.has_application_info_for_blob = false;
-			prune_replayer.blob_belongs_to_application_info = false;
-			if (!replayer.parse(prune_replayer, input_db.get(), state_json.data(), state_json.size()))
-				LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
-
-			if (tag == RESOURCE_APPLICATION_INFO)
-			{
-				if (!should_filter_application_hash || hash == application_hash)
-				{
-					size_t compressed_size = 0;
-					if (!input_db->read_entry(tag, hash, &compressed_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-						return EXIT_FAILURE;
-					state_json.resize(compressed_size);
-					if (!input_db->read_entry(tag, hash, &compressed_size, state_json.data(),
-					                          PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-						return EXIT_FAILURE;
-					if (!output_db->write_entry(tag, hash, state_json.data(), state_json.size(),
-					                            PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
-						return EXIT_FAILURE;
-					per_tag_written[tag]++;
-				}
-			}
-		}
+		state_json.resize(compressed_size);
+		if (!input_db->read_entry(RESOURCE_APPLICATION_INFO, hash, &compressed_size, state_json.data(),
+		                          PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return EXIT_FAILURE;
+		if (!output_db->write_entry(RESOURCE_APPLICATION_INFO, hash, state_json.data(), state_json.size(),
+		                            PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+			return EXIT_FAILURE;
+		per_tag_written[RESOURCE_APPLICATION_INFO]++;
 	}
 
+	prune_filter.filter_application_info_links();
+	prune_filter.access_pipelines(RESOURCE_GRAPHICS_PIPELINE);
+	prune_filter.access_pipelines(RESOURCE_COMPUTE_PIPELINE);
+
 	if (invert_module_pruning)
 	{
 		// In this mode we're only interesting in emitting the shader modules we did not emit for whatever reason.
 		// A handy debug option in some scenarios.
-		prune_replayer.filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK].clear();
-		prune_replayer.accessed_samplers.clear();
-		prune_replayer.accessed_descriptor_sets.clear();
-		prune_replayer.accessed_render_passes.clear();
-		prune_replayer.accessed_pipeline_layouts.clear();
-		prune_replayer.accessed_graphics_pipelines.clear();
-		prune_replayer.accessed_compute_pipelines.clear();
+		prune_filter.filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK].clear();
+		prune_filter.accessed_samplers.clear();
+		prune_filter.accessed_descriptor_sets.clear();
+		prune_filter.accessed_render_passes.clear();
+		prune_filter.accessed_pipeline_layouts.clear();
+		prune_filter.accessed_graphics_pipelines.clear();
+		prune_filter.accessed_compute_pipelines.clear();
 
 		size_t hash_count = 0;
 		if (!input_db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr))
@@ -531,13 +498,13 @@ int main(int argc, char *argv[])
 
 		unordered_set<Hash> unreferenced_modules;
 		for (auto &h : hashes)
-			if (prune_replayer.accessed_shader_modules.count(h) == 0)
+			if (prune_filter.accessed_shader_modules.count(h) == 0)
 				unreferenced_modules.insert(h);
-		prune_replayer.accessed_shader_modules = move(unreferenced_modules);
+		prune_filter.accessed_shader_modules = move(unreferenced_modules);
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK],
+	                         prune_filter.filtered_blob_hashes[RESOURCE_APPLICATION_BLOB_LINK],
 	                         RESOURCE_APPLICATION_BLOB_LINK,
 	                         per_tag_written))
 	{
@@ -546,7 +513,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_samplers, RESOURCE_SAMPLER,
+	                         prune_filter.accessed_samplers, RESOURCE_SAMPLER,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy RESOURCE_SAMPLERs.\n");
@@ -554,7 +521,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_descriptor_sets, RESOURCE_DESCRIPTOR_SET_LAYOUT,
+	                         prune_filter.accessed_descriptor_sets, RESOURCE_DESCRIPTOR_SET_LAYOUT,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy DESCRIPTOR_SET_LAYOUTs.\n");
@@ -562,7 +529,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_shader_modules, RESOURCE_SHADER_MODULE,
+	                         prune_filter.accessed_shader_modules, RESOURCE_SHADER_MODULE,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy SHADER_MODULEs.\n");
@@ -570,7 +537,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_render_passes, RESOURCE_RENDER_PASS,
+	                         prune_filter.accessed_render_passes, RESOURCE_RENDER_PASS,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy RENDER_PASSes.\n");
@@ -578,7 +545,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_pipeline_layouts, RESOURCE_PIPELINE_LAYOUT,
+	                         prune_filter.accessed_pipeline_layouts, RESOURCE_PIPELINE_LAYOUT,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy PIPELINE_LAYOUTs.\n");
@@ -586,7 +553,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_graphics_pipelines, RESOURCE_GRAPHICS_PIPELINE,
+	                         prune_filter.accessed_graphics_pipelines, RESOURCE_GRAPHICS_PIPELINE,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy GRAPHICS_PIPELINEs.\n");
@@ -594,13 +561,46 @@ int main(int argc, char *argv[])
 	}
 
 	if (!copy_accessed_types(*input_db, *output_db, state_json,
-	                         prune_replayer.accessed_compute_pipelines, RESOURCE_COMPUTE_PIPELINE,
+	                         prune_filter.accessed_compute_pipelines, RESOURCE_COMPUTE_PIPELINE,
 	                         per_tag_written))
 	{
 		LOGE("Failed to copy COMPUTE_PIPELINEs.\n");
 		return EXIT_FAILURE;
 	}
 
+	// Pipeline states only exist in binary archives and are tiny compared to the pipelines referring to them,
+	// so keep all of them rather than tracking which ones the surviving pipelines use.
+	// Usage metadata is kept as is, records of pruned objects are simply never looked up.
+	static const ResourceTag kept_tags[] = {
+		RESOURCE_GRAPHICS_PIPELINE_STATE,
+		RESOURCE_USAGE_METADATA,
+	};
+
+	for (auto tag : kept_tags)
+	{
+		size_t hash_count = 0;
+		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		{
+			LOGE("Failed to get hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		vector<Hash> hashes(hash_count);
+		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		{
+			LOGE("Failed to get %s hashes.\n", tag_names[tag]);
+			return EXIT_FAILURE;
+		}
+
+		per_tag_read[tag] = hash_count;
+		unordered_set<Hash> kept_hashes(hashes.begin(), hashes.end());
+		if (!copy_accessed_types(*input_db, *output_db, state_json, kept_hashes, tag, per_tag_written))
+		{
+			LOGE("Failed to copy %s entries.\n", tag_names[tag]);
+			return EXIT_FAILURE;
+		}
+	}
+
 	for (auto tag : playback_order)
 		LOGI("Pruned %s entries: %u -> %u entries\n", tag_names[tag], per_tag_read[tag], per_tag_written[tag]);
 }
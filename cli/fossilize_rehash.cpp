@@ -27,14 +27,17 @@
 #include <unordered_map>
 #include "layer/utils.hpp"
 #include "cli_parser.hpp"
+#include "database_transform.hpp"
 #include <inttypes.h>
+#include <thread>
+#include <algorithm>
 
 using namespace Fossilize;
 using namespace std;
 
 static void print_help()
 {
-	LOGI("Usage: fossilize-rehash [--input-db path] [--output-db path] [--application hash]\n");
+	LOGI("Usage: fossilize-rehash [--input-db path] [--output-db path] [--application hash] [--binary] [--threads count]\n");
 }
 
 template <typename T>
@@ -51,12 +54,14 @@ struct RehashReplayer : StateCreatorInterface
 	Hash filter_application_hash = 0;
 	bool has_set_application_info = false;
 	bool should_filter_application_hash = false;
+	bool log_multiple_application_info = true;
 
 	void set_application_info(Hash hash, const VkApplicationInfo *info, const VkPhysicalDeviceFeatures2 *features) override
 	{
 		if (!should_filter_application_hash && has_set_application_info)
 		{
-			LOGE("There are multiple VkApplicationInfo in this database. All blobs in this input database will be assigned to the first application info.\n");
+			if (log_multiple_application_info)
+				LOGE("There are multiple VkApplicationInfo in this database. All blobs in this input database will be assigned to the first application info.\n");
 		}
 		else if (!has_set_application_info && (!should_filter_application_hash || hash == filter_application_hash))
 		{
@@ -113,26 +118,110 @@ struct RehashReplayer : StateCreatorInterface
 	}
 };
 
+// Every worker has its own recorder, since a recorder must see the dependencies of everything it records.
+// The recording threads write straight to the sink, so the output order depends on scheduling.
+struct RehashTransform : DatabaseTransform
+{
+	struct Worker
+	{
+		StateRecorder recorder;
+		StateReplayer replayer;
+		RehashReplayer rehash_replayer;
+		DatabaseInterface *resolver = nullptr;
+	};
+
+	bool init_worker(unsigned worker_index, DatabaseInterface &input, DatabaseInterface &sink) override
+	{
+		auto &worker = *workers[worker_index];
+		worker.resolver = &input;
+		worker.recorder.set_database_enable_checksum(true);
+		worker.recorder.set_database_enable_compression(true);
+		worker.recorder.set_database_enable_binary_format(binary);
+		worker.rehash_replayer.recorder = &worker.recorder;
+		worker.rehash_replayer.filter_application_hash = filter_application_hash;
+		worker.rehash_replayer.should_filter_application_hash = should_filter_application_hash;
+		worker.rehash_replayer.log_multiple_application_info = worker_index == 0;
+
+		// The application info must be recorded before the recording thread starts.
+		for (auto &info : application_infos)
+			if (!worker.replayer.parse(worker.rehash_replayer, &input, info.data(), info.size()))
+				LOGE("Failed to parse application info.\n");
+
+		worker.recorder.init_recording_thread(&sink);
+		return true;
+	}
+
+	bool shared_entry(unsigned worker_index, ResourceTag tag, Hash hash, const void *blob, size_t size) override
+	{
+		auto &worker = *workers[worker_index];
+		// Every worker sees these, only complain once.
+		if (!worker.replayer.parse(worker.rehash_replayer, worker.resolver, blob, size) && worker_index == 0)
+			LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+		return true;
+	}
+
+	bool transform_entry(unsigned worker_index, ResourceTag tag, Hash hash, const void *blob, size_t size,
+	                     DatabaseTransformOutput &) override
+	{
+		auto &worker = *workers[worker_index];
+		if (!worker.replayer.parse(worker.rehash_replayer, worker.resolver, blob, size))
+			LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+		return true;
+	}
+
+	bool end_worker(unsigned worker_index) override
+	{
+		workers[worker_index]->recorder.tear_down_recording_thread();
+		return true;
+	}
+
+	vector<unique_ptr<Worker>> workers;
+	vector<vector<uint8_t>> application_infos;
+	Hash filter_application_hash = 0;
+	bool should_filter_application_hash = false;
+	bool binary = false;
+};
+
+static bool read_application_infos(DatabaseInterface &input_db, vector<vector<uint8_t>> &infos)
+{
+	size_t hash_count = 0;
+	if (!input_db.get_hash_list_for_resource_tag(RESOURCE_APPLICATION_INFO, &hash_count, nullptr))
+		return false;
+	vector<Hash> hashes(hash_count);
+	if (!input_db.get_hash_list_for_resource_tag(RESOURCE_APPLICATION_INFO, &hash_count, hashes.data()))
+		return false;
+
+	for (auto hash : hashes)
+	{
+		size_t size = 0;
+		if (!input_db.read_entry(RESOURCE_APPLICATION_INFO, hash, &size, nullptr, 0))
+			return false;
+		vector<uint8_t> info(size);
+		if (!input_db.read_entry(RESOURCE_APPLICATION_INFO, hash, &size, info.data(), 0))
+			return false;
+		infos.push_back(move(info));
+	}
+
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	CLICallbacks cbs;
 	string input_db_path;
 	string output_db_path;
+	unsigned num_threads = 0;
 
-	unique_ptr<DatabaseInterface> output_db;
-
-	StateRecorder recorder;
-	recorder.set_database_enable_checksum(true);
-	recorder.set_database_enable_compression(true);
-	RehashReplayer rehash_replayer;
-	rehash_replayer.recorder = &recorder;
+	RehashTransform transform;
 
 	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--input-db", [&](CLIParser &parser) { input_db_path = parser.next_string(); });
 	cbs.add("--output-db", [&](CLIParser &parser) { output_db_path = parser.next_string(); });
+	cbs.add("--binary", [&](CLIParser &) { transform.binary = true; });
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
 	cbs.add("--application", [&](CLIParser &parser) {
-		rehash_replayer.filter_application_hash = strtoull(parser.next_string(), nullptr, 16);
-		rehash_replayer.should_filter_application_hash = true;
+		transform.filter_application_hash = strtoull(parser.next_string(), nullptr, 16);
+		transform.should_filter_application_hash = true;
 	});
 
 	cbs.error_handler = [] { print_help(); };
@@ -150,78 +239,52 @@ int main(int argc, char *argv[])
 	}
 
 	auto input_db = std::unique_ptr<DatabaseInterface>(create_database(input_db_path.c_str(), DatabaseMode::ReadOnly));
-	output_db.reset(create_database(output_db_path.c_str(), DatabaseMode::OverWrite));
+	auto output_db = std::unique_ptr<DatabaseInterface>(create_database(output_db_path.c_str(), DatabaseMode::OverWrite));
 	if (!input_db || !input_db->prepare())
 	{
-		LOGE("Failed to load database: %s\n", argv[1]);
+		LOGE("Failed to load database: %s\n", input_db_path.c_str());
 		return EXIT_FAILURE;
 	}
 
-	// Recording thread prepares.
-	if (!output_db)
+	if (!output_db || !output_db->prepare())
 	{
-		LOGE("Failed to open database for writing: %s\n", argv[2]);
+		LOGE("Failed to open database for writing: %s\n", output_db_path.c_str());
 		return EXIT_FAILURE;
 	}
 
-	StateReplayer replayer;
+	if (!read_application_infos(*input_db, transform.application_infos))
+	{
+		LOGE("Failed to load application info.\n");
+		return EXIT_FAILURE;
+	}
 
-	static const ResourceTag playback_order[] = {
-		RESOURCE_APPLICATION_INFO,
-		RESOURCE_SHADER_MODULE,
+	// Pipelines can only refer to layouts and render passes which the same replayer has seen,
+	// so every worker replays those first. They are cheap compared to modules and pipelines.
+	static const ResourceTag shared_order[] = {
 		RESOURCE_SAMPLER,
 		RESOURCE_DESCRIPTOR_SET_LAYOUT,
 		RESOURCE_PIPELINE_LAYOUT,
 		RESOURCE_RENDER_PASS,
+	};
+
+	static const ResourceTag playback_order[] = {
+		RESOURCE_SHADER_MODULE,
 		RESOURCE_GRAPHICS_PIPELINE,
 		RESOURCE_COMPUTE_PIPELINE,
 	};
 
-	vector<uint8_t> state_json;
-	for (auto &tag : playback_order)
-	{
-		size_t hash_count = 0;
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-		{
-			LOGE("Failed to get hashes.\n");
-			return EXIT_FAILURE;
-		}
-
-		vector<Hash> hashes(hash_count);
-
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-		{
-			LOGE("Failed to get shader module hashes.\n");
-			return EXIT_FAILURE;
-		}
-
-		for (auto hash : hashes)
-		{
-			size_t state_json_size;
-			if (!input_db->read_entry(tag, hash, &state_json_size, nullptr, 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			state_json.resize(state_json_size);
-
-			if (!input_db->read_entry(tag, hash, &state_json_size, state_json.data(), 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			if (!replayer.parse(rehash_replayer, input_db.get(), state_json.data(), state_json.size()))
-				LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
-		}
-
-		if (tag == RESOURCE_APPLICATION_INFO)
-		{
-			// Now we have set the application info, so we can start the recording thread now.
-			recorder.init_recording_thread(output_db.get());
-		}
-	}
+	if (!num_threads)
+		num_threads = max(1u, thread::hardware_concurrency());
+	for (unsigned i = 0; i < num_threads; i++)
+		transform.workers.emplace_back(new RehashTransform::Worker);
+
+	DatabaseTransformOptions options;
+	options.tags = playback_order;
+	options.num_tags = sizeof(playback_order) / sizeof(playback_order[0]);
+	options.shared_tags = shared_order;
+	options.num_shared_tags = sizeof(shared_order) / sizeof(shared_order[0]);
+	options.num_threads = num_threads;
+	options.serialize_input_reads = database_transform_needs_serialized_reads(input_db_path.c_str());
+	if (!run_database_transform(*input_db, *output_db, transform, options))
+		return EXIT_FAILURE;
 }
-
-
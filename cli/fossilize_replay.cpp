@@ -31,7 +31,18 @@
 #include "fossilize_external_replayer.hpp"
 #include "fossilize_external_replayer_control_block.hpp"
 #include "fossilize_errors.hpp"
-#include "util/object_cache.hpp"
+#include "xxhash64.hpp"
+#include "util/concurrent_object_cache.hpp"
+#include "util/entry_payload.hpp"
+#include "pipeline_stats.hpp"
+#include "replay_journal.hpp"
+#include "memory_status.hpp"
+#include "worker_scheduling.hpp"
+#include "replay_trace.hpp"
+#include "latency_stats.hpp"
+#include "pipeline_order.hpp"
+#include "replay_daemon.hpp"
+#include "fossilize_profiling.hpp"
 
 #include <inttypes.h>
 #include <string>
@@ -40,6 +51,7 @@
 #include <string.h>
 #include <chrono>	// VALVE
 #include <queue>	// VALVE
+#include <deque>
 #include <thread>	// VALVE
 #include <mutex>	// VALVE
 #include <condition_variable> // VALVE
@@ -49,6 +61,8 @@
 #include <algorithm>
 #include <utility>
 #include <assert.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 #ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
 #include "spirv-tools/libspirv.hpp"
@@ -164,21 +178,276 @@ BidirectionalItr unstable_remove_if(BidirectionalItr first, BidirectionalItr las
 	return first;
 }
 
-static unique_ptr<DatabaseInterface> create_database(const vector<const char *> &databases)
+// The store is opened once and shared by every database the process opens. It is safe to read from any thread.
+static DatabaseInterface *get_module_store(const string &path)
 {
+	static mutex lock;
+	static unique_ptr<DatabaseInterface> store;
+	static string store_path;
+	static bool prepared = false;
+
+	lock_guard<mutex> holder{lock};
+	if (!store || store_path != path)
+	{
+		store.reset(create_module_store_database(path.c_str(), DatabaseMode::ReadOnlyMemoryMap));
+		store_path = path;
+		prepared = store->prepare();
+		if (!prepared)
+			LOGE("Failed to prepare module store %s.\n", path.c_str());
+	}
+
+	return prepared ? store.get() : nullptr;
+}
+
+static unique_ptr<DatabaseInterface> create_database(const vector<const char *> &databases,
+                                                     const string &module_store_path)
+{
+	DatabaseInterface *module_store = nullptr;
+	if (!module_store_path.empty())
+		module_store = get_module_store(module_store_path);
+
 	unique_ptr<DatabaseInterface> resolver;
-	if (databases.size() == 1)
+	if (databases.size() == 1 && !module_store)
 	{
-		resolver.reset(create_database(databases.front(), DatabaseMode::ReadOnly));
+		resolver.reset(create_database(databases.front(), DatabaseMode::ReadOnlyMemoryMap));
 	}
 	else
 	{
-		resolver.reset(create_concurrent_database(nullptr, DatabaseMode::ReadOnly,
+		resolver.reset(create_concurrent_database(nullptr, DatabaseMode::ReadOnlyMemoryMap,
 		                                          databases.data(), databases.size()));
+		if (module_store)
+			resolver->set_module_store(module_store);
 	}
 	return resolver;
 }
 
+template <typename T>
+static inline T fake_handle(uint64_t value)
+{
+	static_assert(sizeof(T) == sizeof(uint64_t), "Handle size is not 64-bit.");
+	// reinterpret_cast does not work reliably on MSVC 2013 for Vulkan objects.
+	return (T)value;
+}
+
+// Re-records every object of an archive in the binary format, under its original hash,
+// so the pipeline ranges and hashes of a replay image match those of the archive it was made from.
+struct ReplayImageWriter : StateCreatorInterface
+{
+	StateRecorder *recorder = nullptr;
+	bool has_set_application_info = false;
+
+	void set_application_info(Hash, const VkApplicationInfo *info, const VkPhysicalDeviceFeatures2 *features) override
+	{
+		if (has_set_application_info)
+			return;
+
+		if (info)
+			if (!recorder->record_application_info(*info))
+				LOGE("Failed to record application info.\n");
+		if (features)
+			if (!recorder->record_physical_device_features(*features))
+				LOGE("Failed to record physical device features.\n");
+		has_set_application_info = true;
+	}
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		return recorder->record_sampler(*sampler, *create_info, hash);
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		return recorder->record_descriptor_set_layout(*layout, *create_info, hash);
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		return recorder->record_pipeline_layout(*layout, *create_info, hash);
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		return recorder->record_shader_module(*module, *create_info, hash);
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		return recorder->record_render_pass(*render_pass, *create_info, hash);
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		return recorder->record_compute_pipeline(*pipeline, *create_info, nullptr, 0, hash);
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		return recorder->record_graphics_pipeline(*pipeline, *create_info, nullptr, 0, hash);
+	}
+};
+
+// A replay image is named after the identity of the archives it was made from and the format version,
+// so a stale image is never picked up after an archive changes or Fossilize is updated.
+static string get_replay_image_path(const string &image_dir, const vector<const char *> &databases)
+{
+	string identity = to_string(int(FOSSILIZE_FORMAT_VERSION));
+	for (auto *path : databases)
+	{
+		struct stat s = {};
+		if (stat(path, &s) < 0)
+			return {};
+		identity += ';';
+		identity += path;
+		identity += ':' + to_string(uint64_t(s.st_size)) + ':' + to_string(int64_t(s.st_mtime));
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016" PRIx64 ".foz", xxhash64(identity.data(), identity.size(), 0));
+	return Path::join(image_dir, name);
+}
+
+// Shader modules from the module store are resolved while the image is written, so the image does not need the store.
+static bool write_replay_image(const vector<const char *> &databases, const string &module_store_path,
+                               const string &path)
+{
+	auto source = create_database(databases, module_store_path);
+	if (!source || !source->prepare())
+	{
+		LOGE("Failed to prepare database.\n");
+		return false;
+	}
+
+	// Write to a temporary file first, an interrupted run must not leave a truncated image behind.
+	string tmp_path = path + ".tmp.foz";
+	{
+		// The recording thread prepares the image.
+		auto image = unique_ptr<DatabaseInterface>(create_stream_archive_database(tmp_path.c_str(), DatabaseMode::OverWrite));
+		if (!image)
+			return false;
+
+		// Entries are left uncompressed, so reading them is a plain copy out of the memory mapped image.
+		StateRecorder recorder;
+		recorder.set_database_enable_binary_format(true);
+		ReplayImageWriter writer;
+		writer.recorder = &recorder;
+
+		StateReplayer replayer;
+		vector<Hash> hashes;
+		vector<uint8_t> blob;
+		bool started_recording = false;
+
+		static const ResourceTag playback_order[] = {
+			RESOURCE_APPLICATION_INFO,
+			RESOURCE_SHADER_MODULE,
+			RESOURCE_SAMPLER,
+			RESOURCE_DESCRIPTOR_SET_LAYOUT,
+			RESOURCE_PIPELINE_LAYOUT,
+			RESOURCE_RENDER_PASS,
+			RESOURCE_COMPUTE_PIPELINE,
+			RESOURCE_GRAPHICS_PIPELINE,
+		};
+
+		for (auto tag : playback_order)
+		{
+			size_t hash_count = 0;
+			if (!source->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+				return false;
+			hashes.resize(hash_count);
+			if (!source->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+				return false;
+
+			for (auto hash : hashes)
+			{
+				size_t blob_size = 0;
+				if (!source->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+					return false;
+				blob.resize(blob_size);
+				if (!source->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+					return false;
+
+				if (!replayer.parse(writer, source.get(), blob.data(), blob.size()))
+					LOGE("Failed to parse blob (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+			}
+
+			// The recorder needs the application info before it starts writing.
+			if (!started_recording)
+			{
+				recorder.init_recording_thread(image.get());
+				started_recording = true;
+			}
+			replayer.get_allocator().reset();
+		}
+	}
+
+	// The recording thread cannot report failure, so make sure every pipeline made it into the image.
+	{
+		auto image = unique_ptr<DatabaseInterface>(create_stream_archive_database(tmp_path.c_str(), DatabaseMode::ReadOnly));
+		bool complete = image && image->prepare();
+		for (auto tag : { RESOURCE_GRAPHICS_PIPELINE, RESOURCE_COMPUTE_PIPELINE })
+		{
+			size_t source_count = 0;
+			size_t image_count = 0;
+			if (!complete ||
+			    !source->get_hash_list_for_resource_tag(tag, &source_count, nullptr) ||
+			    !image->get_hash_list_for_resource_tag(tag, &image_count, nullptr) ||
+			    source_count != image_count)
+			{
+				complete = false;
+			}
+		}
+
+		if (!complete)
+		{
+			LOGE("Replay image %s is incomplete, discarding it.\n", tmp_path.c_str());
+			image.reset();
+			remove(tmp_path.c_str());
+			return false;
+		}
+	}
+
+	if (rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		LOGE("Failed to move replay image into place at %s.\n", path.c_str());
+		remove(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Replays from a pre-parsed image of the archives, creating it first if this is the first run against them.
+static bool resolve_replay_image(const string &image_dir, const string &module_store_path,
+                                 vector<const char *> &databases, string &image_path)
+{
+	image_path = get_replay_image_path(image_dir, databases);
+	if (image_path.empty())
+	{
+		LOGE("Failed to stat databases, not using a replay image.\n");
+		return false;
+	}
+
+	struct stat s = {};
+	if (stat(image_path.c_str(), &s) < 0)
+	{
+		LOGI("Writing replay image to %s.\n", image_path.c_str());
+		if (!write_replay_image(databases, module_store_path, image_path))
+			return false;
+	}
+	else
+		LOGI("Using replay image %s.\n", image_path.c_str());
+
+	databases.clear();
+	databases.push_back(image_path.c_str());
+	return true;
+}
+
 namespace Global
 {
 static thread_local unsigned worker_thread_index;
@@ -192,6 +461,88 @@ enum MemoryConstants
 	NUM_PIPELINE_MEMORY_CONTEXTS = NUM_MEMORY_CONTEXTS - 2
 };
 
+// Pipelines are parsed into a memory context a chunk at a time. The chunk size adapts to the create infos,
+// so that a chunk allocates about PIPELINE_CONTEXT_BUDGET bytes across all worker threads.
+static const unsigned DEFAULT_PIPELINES_PER_CONTEXT = 1024;
+static const unsigned MIN_PIPELINES_PER_CONTEXT = 64;
+static const unsigned MAX_PIPELINES_PER_CONTEXT = 16 * 1024;
+static const unsigned MIN_PIPELINES_PER_WORKER = 16;
+static const size_t PIPELINE_CONTEXT_BUDGET = 32 * 1024 * 1024;
+
+// Lets the children of a robust replay pull chunks of pipelines as they go, rather than getting a fixed slice each.
+// The master allocates it in memory shared with all of its children, followed by one slot per child.
+// A child publishes the chunk it works on in its slot before replaying it, so if the child crashes,
+// the master knows what is left of the chunk.
+struct SharedWorkQueue
+{
+	struct Range
+	{
+		std::atomic<uint32_t> start;
+		std::atomic<uint32_t> end;
+	};
+
+	struct Slot
+	{
+		Range graphics;
+		Range compute;
+	};
+
+	std::atomic<uint32_t> next_graphics_index;
+	std::atomic<uint32_t> next_compute_index;
+	uint32_t graphics_count;
+	uint32_t compute_count;
+	uint32_t graphics_chunk_size;
+	uint32_t compute_chunk_size;
+
+	static size_t get_size(unsigned num_slots)
+	{
+		return sizeof(SharedWorkQueue) + num_slots * sizeof(Slot);
+	}
+
+	Slot &get_slot(unsigned index)
+	{
+		return reinterpret_cast<Slot *>(this + 1)[index];
+	}
+
+	bool has_pending_chunks() const
+	{
+		return next_graphics_index.load(std::memory_order_relaxed) < graphics_count ||
+		       next_compute_index.load(std::memory_order_relaxed) < compute_count;
+	}
+
+	// Returns false once every chunk has been handed out.
+	bool claim_chunk(ResourceTag tag, unsigned slot, unsigned &start, unsigned &end)
+	{
+		bool graphics = tag == RESOURCE_GRAPHICS_PIPELINE;
+		auto &next_index = graphics ? next_graphics_index : next_compute_index;
+		uint32_t count = graphics ? graphics_count : compute_count;
+		uint32_t chunk_size = graphics ? graphics_chunk_size : compute_chunk_size;
+
+		// Don't let the cursor run off when children keep asking after the end.
+		if (next_index.load(std::memory_order_relaxed) >= count)
+			return false;
+		uint32_t index = next_index.fetch_add(chunk_size, std::memory_order_relaxed);
+		if (index >= count)
+			return false;
+
+		start = index;
+		end = std::min(index + chunk_size, count);
+
+		auto &range = graphics ? get_slot(slot).graphics : get_slot(slot).compute;
+		range.start.store(start, std::memory_order_relaxed);
+		range.end.store(end, std::memory_order_release);
+		return true;
+	}
+
+	// Everything in the slot has been replayed, a crash from here on leaves nothing of it over.
+	void complete_chunks(unsigned slot)
+	{
+		auto &s = get_slot(slot);
+		s.graphics.start.store(s.graphics.end.load(std::memory_order_relaxed), std::memory_order_release);
+		s.compute.start.store(s.compute.end.load(std::memory_order_relaxed), std::memory_order_release);
+	}
+};
+
 struct EnqueuedWork
 {
 	unsigned order_index;
@@ -200,23 +551,151 @@ struct EnqueuedWork
 
 static void on_validation_error(void *userdata);
 
+// Keeps Vulkan devices alive across replays in the daemon, so jobs for the same application only pay for the device once.
+// Devices are keyed by the application info hash and the least recently used one is destroyed beyond max_devices.
+struct ReplayDeviceCache
+{
+	struct Entry
+	{
+		Hash hash;
+		unique_ptr<VulkanDevice> device;
+	};
+	// Most recently used last.
+	vector<Entry> entries;
+	unsigned max_devices = 4;
+
+	VulkanDevice *acquire(Hash hash, const VulkanDevice::Options &opts)
+	{
+		for (auto itr = begin(entries); itr != end(entries); ++itr)
+		{
+			if (itr->hash == hash)
+			{
+				Entry entry = move(*itr);
+				entries.erase(itr);
+				entries.push_back(move(entry));
+				return entries.back().device.get();
+			}
+		}
+
+		unique_ptr<VulkanDevice> device(new VulkanDevice);
+		if (!device->init_device(opts))
+			return nullptr;
+
+		if (entries.size() >= max(max_devices, 1u))
+			entries.erase(begin(entries));
+		entries.push_back({ hash, move(device) });
+		return entries.back().device.get();
+	}
+};
+
+static bool write_pipeline_cache_data(VkDevice device, VkPipelineCache cache, const string &path)
+{
+	size_t size = 0;
+	if (vkGetPipelineCacheData(device, cache, &size, nullptr) != VK_SUCCESS)
+		return false;
+
+	// If the cache grew in the meantime, we get a smaller, but still valid cache.
+	vector<uint8_t> buffer(size);
+	VkResult result = vkGetPipelineCacheData(device, cache, &size, buffer.data());
+	if (result != VK_SUCCESS && result != VK_INCOMPLETE)
+		return false;
+
+	if (!write_buffer_to_file_atomic(path.c_str(), buffer.data(), size))
+	{
+		LOGE("Failed to write pipeline cache data to disk.\n");
+		return false;
+	}
+
+	return true;
+}
+
 struct ThreadedReplayer : StateCreatorInterface
 {
 	struct Options
 	{
 		bool pipeline_cache = false;
+		// Every worker compiles into its own VkPipelineCache, which are merged into pipeline_cache at sync points.
+		bool pipeline_cache_per_thread = false;
 		bool spirv_validate = false;
 		bool ignore_derived_pipelines = false;
+		bool huge_pages = false;
+		bool shader_locality_order = false;
+		bool cost_order = false;
+		// Static objects are only created once the pipelines which refer to them come up, so compiling starts
+		// before the entire archive has been decoded.
+		bool streaming_start = false;
 		string on_disk_pipeline_cache_path;
 
+		// The on-disk cache is also written while replaying, whenever either limit is reached, so that a replay
+		// which is killed keeps most of its work. Zero disables a limit.
+		unsigned pipeline_cache_checkpoint_seconds = 60;
+		unsigned pipeline_cache_checkpoint_pipelines = 0;
+
+		// Loaded instead if on_disk_pipeline_cache_path does not exist yet.
+		string on_disk_pipeline_cache_seed_path;
+
+		// Number of independent pipelines a worker may hand to a single vkCreate*Pipelines call.
+		unsigned pipeline_batch_size = 1;
+
+		// Compile times from earlier runs are read from pipeline_stats_path,
+		// and the compile times of this run are merged in and written to pipeline_stats_output_path.
+		string pipeline_stats_path;
+		string pipeline_stats_output_path;
+
+		// Pipelines in the journal were compiled successfully by an earlier run on the same driver and are skipped,
+		// unless full_replay is set. Pipelines compiled by this run are added to it either way.
+		string journal_path;
+		bool full_replay = false;
+
+		// Shader modules which are not in the databases are read from this module store.
+		string module_store_path;
+
+		// Replays pipelines which show up in the most databases first.
+		bool frequency_order = false;
+
+		// Stop replaying once this many seconds have passed since the replayer was created. 0 means no limit.
+		double time_budget_seconds = 0.0;
+
 		// VALVE: Add multi-threaded pipeline creation
 		unsigned num_threads = thread::hardware_concurrency();
 
+		// If non-zero, num_threads is only the upper bound. Workers are added while at least this much
+		// system memory stays available, and taken away when it does not, but never below min_threads.
+		unsigned memory_headroom_mb = 0;
+		unsigned min_threads = 1;
+
+		// Worker threads only run on these CPUs, e.g. "0-3,8". If a core type is given as well,
+		// the workers run on the CPUs of that type in the list, or all CPUs of that type if the list is empty.
+		string worker_cpu_list;
+		CoreType worker_core_type = CoreType::Any;
+
+		// Robust replays deal their child processes out to these devices round robin, e.g. "0-1,3".
+		// Every device gets at least one child. The device index in VulkanDevice::Options is not used in that case.
+		string device_index_list;
+
+		// Worker threads only get CPU time nothing else wants.
+		bool background_priority = false;
+
+		// Every pipeline is first created with VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT,
+		// which only succeeds if the driver does not have to compile anything. Misses are then compiled in full,
+		// unless cache_probe_only is set, in which case they are only counted. cache_probe_only implies cache_probe.
+		bool cache_probe = false;
+		bool cache_probe_only = false;
+
+		// Writes a Chrome trace of what every thread was doing to trace_path.
+		// Child processes append their events to a fragment which the parent merges.
+		string trace_path;
+		bool trace_fragment = false;
+
 		// VALVE: --loop option for testing performance
 		unsigned loop_count = 1;
 
 		unsigned shader_cache_size_mb = 256;
 
+		// Keep shader modules which are only used once on probation, so they don't evict the modules
+		// which are shared by many pipelines.
+		bool shader_cache_two_queue = false;
+
 		// Carve out a range of which pipelines to replay.
 		// Used for multi-process replays where each process gets its own slice to churn through.
 		unsigned start_graphics_index = 0;
@@ -224,11 +703,25 @@ struct ThreadedReplayer : StateCreatorInterface
 		unsigned start_compute_index = 0;
 		unsigned end_compute_index = ~0u;
 
+		// Only pipelines whose hash modulo shard_count is shard_index are replayed, before the ranges above apply.
+		// Unlike ranges, a pipeline stays in its shard when entries are added to the archive.
+		unsigned shard_index = 0;
+		unsigned shard_count = 1;
+
+		// Once the ranges above are done, more chunks are pulled from the work queue and published in work_queue_slot.
+		SharedWorkQueue *work_queue = nullptr;
+		unsigned work_queue_slot = 0;
+
 		SharedControlBlock *control_block = nullptr;
 
+		// Devices come from here instead of being created and destroyed with the replayer.
+		ReplayDeviceCache *device_cache = nullptr;
+
 		void (*on_thread_callback)(void *userdata) = nullptr;
 		void *on_thread_callback_userdata = nullptr;
 		void (*on_validation_error_callback)(ThreadedReplayer *) = nullptr;
+		// Called from worker threads when an object is among the slowest the thread has created.
+		void (*on_slow_object_callback)(ControlBlockLatencyType type, Hash hash, uint64_t duration_ns) = nullptr;
 	};
 
 	struct DeferredGraphicsInfo
@@ -288,12 +781,16 @@ struct ThreadedReplayer : StateCreatorInterface
 		unsigned current_compute_index = ~0u;
 		unsigned memory_context_index = 0;
 
+		VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+
 		Hash current_graphics_pipeline = 0;
 		Hash current_compute_pipeline = 0;
 		Hash failed_module_hashes[16] = {};
 		unsigned num_failed_module_hashes = 0;
 
 		bool force_outside_range = false;
+
+		LatencyHistogram latency[CONTROL_BLOCK_LATENCY_COUNT];
 	};
 
 	ThreadedReplayer(const VulkanDevice::Options &device_opts_, const Options &opts_)
@@ -312,8 +809,28 @@ struct ThreadedReplayer : StateCreatorInterface
 		thread_total_ns.store(0);
 		total_idle_ns.store(0);
 		total_peak_memory.store(0);
+		total_peak_memory_in_use.store(0);
+		total_allocator_blocks.store(0);
+		total_allocator_system_allocations.store(0);
 		pipeline_cache_hits.store(0);
 		pipeline_cache_misses.store(0);
+		cache_probe_hits.store(0);
+		cache_probe_misses.store(0);
+		pending_work_count.store(0);
+		static_object_generation.store(0);
+		active_worker_count.store(num_worker_threads);
+		deadline_hit.store(false);
+		if (opts.time_budget_seconds > 0.0)
+		{
+			deadline = chrono::steady_clock::now() +
+			           chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(opts.time_budget_seconds));
+			has_deadline = true;
+		}
+		for (unsigned i = 0; i < NUM_MEMORY_CONTEXTS; i++)
+		{
+			queued_count[i].store(0);
+			completed_count[i].store(0);
+		}
 
 		shader_module_total_compressed_size.store(0);
 		shader_module_total_size.store(0);
@@ -331,6 +848,38 @@ struct ThreadedReplayer : StateCreatorInterface
 #endif
 
 		shader_modules.set_target_size(target_size);
+		shader_modules.set_policy(opts.shader_cache_two_queue ? ObjectCachePolicy::TwoQueue : ObjectCachePolicy::LRU);
+
+		if (!opts.trace_path.empty())
+			trace.reset(new ReplayTrace(num_worker_threads + 1));
+	}
+
+	void record_latency(ControlBlockLatencyType type, Hash hash, uint64_t duration_ns)
+	{
+		bool slow = get_per_thread_data().latency[type].record(hash, duration_ns);
+		if (opts.control_block)
+			control_block_record_latency(opts.control_block, type, duration_ns / 1000);
+		if (slow && opts.on_slow_object_callback)
+			opts.on_slow_object_callback(type, hash, duration_ns);
+	}
+
+	// Only valid once the worker threads are torn down.
+	LatencyHistogram get_latency_histogram(ControlBlockLatencyType type) const
+	{
+		LatencyHistogram histogram;
+		for (auto &per_thread : per_thread_data)
+			histogram.merge(per_thread.latency[type]);
+		return histogram;
+	}
+
+	void record_trace_event(const char *category, const char *name, Hash hash,
+	                        chrono::steady_clock::time_point start_time, unsigned count = 1, uint64_t bytes = 0)
+	{
+		if (trace)
+		{
+			trace->record(Global::worker_thread_index, category, name, hash,
+			              start_time, chrono::steady_clock::now(), count, bytes);
+		}
 	}
 
 	PerThreadData &get_per_thread_data()
@@ -338,9 +887,46 @@ struct ThreadedReplayer : StateCreatorInterface
 		return per_thread_data[Global::worker_thread_index];
 	}
 
+	void resolve_worker_cpus()
+	{
+		worker_cpus.clear();
+		if (!opts.worker_cpu_list.empty() && !parse_cpu_list(opts.worker_cpu_list.c_str(), worker_cpus))
+			LOGE("Invalid CPU list \"%s\", not restricting worker threads.\n", opts.worker_cpu_list.c_str());
+
+		if (opts.worker_core_type == CoreType::Any)
+			return;
+
+		vector<unsigned> typed_cpus;
+		if (!get_cpus_for_core_type(opts.worker_core_type, typed_cpus))
+		{
+			LOGE("Cannot tell %s cores apart on this system, ignoring core type.\n",
+			     get_core_type_name(opts.worker_core_type));
+			return;
+		}
+
+		if (worker_cpus.empty())
+		{
+			worker_cpus = move(typed_cpus);
+			return;
+		}
+
+		auto itr = remove_if(begin(worker_cpus), end(worker_cpus), [&](unsigned cpu) {
+			return find(begin(typed_cpus), end(typed_cpus), cpu) == end(typed_cpus);
+		});
+
+		if (itr == begin(worker_cpus))
+			LOGE("None of the CPUs in \"%s\" are %s cores, ignoring core type.\n",
+			     opts.worker_cpu_list.c_str(), get_core_type_name(opts.worker_core_type));
+		else
+			worker_cpus.erase(itr, end(worker_cpus));
+	}
+
 	void start_worker_threads()
 	{
 		thread_initialized_count = 0;
+		resolve_worker_cpus();
+		worker_queues.reset(new WorkerQueue[num_worker_threads ? num_worker_threads : 1]);
+		next_worker_queue = 0;
 
 		// Make sure main thread sees degenerate current_*_index. Any crash in main thread is fatal.
 		for (unsigned i = 0; i < num_worker_threads; i++)
@@ -354,6 +940,24 @@ struct ThreadedReplayer : StateCreatorInterface
 		for (unsigned i = 0; i < num_worker_threads; i++)
 			thread_pool.push_back(std::thread(&ThreadedReplayer::worker_thread, this, i + 1));
 
+		if (opts.memory_headroom_mb && num_worker_threads > 1)
+		{
+			MemoryStatus status = {};
+			if (query_memory_status(status))
+			{
+				active_worker_count.store(std::min(std::max(opts.min_threads, 1u), num_worker_threads));
+				memory_monitor = std::thread(&ThreadedReplayer::memory_monitor_thread, this, status.resident_bytes);
+			}
+			else
+				LOGE("Cannot query memory usage on this system, using all %u worker threads.\n", num_worker_threads);
+		}
+
+		if (pipeline_cache != VK_NULL_HANDLE && !opts.on_disk_pipeline_cache_path.empty() &&
+		    (opts.pipeline_cache_checkpoint_seconds || opts.pipeline_cache_checkpoint_pipelines))
+		{
+			pipeline_cache_checkpoint = std::thread(&ThreadedReplayer::pipeline_cache_checkpoint_thread, this);
+		}
+
 		// Make sure all threads have started so we can poke around the per thread allocators from
 		// the main thread when the memory contexts in each thread have been drained.
 		{
@@ -368,30 +972,37 @@ struct ThreadedReplayer : StateCreatorInterface
 	{
 		for (unsigned i = 0; i < NUM_MEMORY_CONTEXTS; i++)
 			sync_worker_memory_context(i);
+		merge_pipeline_caches();
 	}
 
 	void sync_worker_memory_context(unsigned index)
 	{
 		assert(index < NUM_MEMORY_CONTEXTS);
-		unique_lock<mutex> lock(pipeline_work_queue_mutex);
-		work_done_condition[index].wait(lock, [&]() -> bool
-		{
-			return queued_count[index] == completed_count[index];
-		});
-	}
+		static const char *trace_names[NUM_MEMORY_CONTEXTS] = {
+			"sync pipelines 0", "sync pipelines 1", "sync parent pipelines", "sync shader modules",
+		};
+		auto start_time = chrono::steady_clock::now();
 
-	bool run_parse_work_item(StateReplayer &replayer, vector<uint8_t> &buffer, const PipelineWorkItem &work_item)
-	{
-		size_t json_size = 0;
-		if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+		// Anything still staged might be what we're waiting for.
+		flush_work_items();
 		{
-			LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
-			return false;
+			unique_lock<mutex> lock(pipeline_work_queue_mutex);
+			work_done_condition[index].wait(lock, [&]() -> bool
+			{
+				return queued_count[index].load(std::memory_order_acquire) ==
+				       completed_count[index].load(std::memory_order_acquire);
+			});
 		}
 
-		buffer.resize(json_size);
+		record_trace_event("sync", trace_names[index], 0, start_time);
+	}
 
-		if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, buffer.data(), PAYLOAD_READ_CONCURRENT_BIT))
+	// Memory mapped archives are parsed in place, without copying the payload.
+	bool run_parse_work_item(StateReplayer &replayer, EntryPayload &payload, const PipelineWorkItem &work_item)
+	{
+		FOSSILIZE_PROFILE_ZONE_HASH("parse work item", work_item.hash);
+		auto start_time = chrono::steady_clock::now();
+		if (!payload.read(*global_database, work_item.tag, work_item.hash, PAYLOAD_READ_CONCURRENT_BIT))
 		{
 			LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
 			return false;
@@ -402,7 +1013,11 @@ struct ThreadedReplayer : StateCreatorInterface
 		per_thread.force_outside_range = work_item.force_outside_range;
 		per_thread.memory_context_index = work_item.memory_context_index;
 
-		if (!replayer.parse(*this, global_database, buffer.data(), buffer.size()))
+		// Modules can be evicted and created again at any time, so the replayer must not remember that it has seen one.
+		if (work_item.tag == RESOURCE_SHADER_MODULE)
+			replayer.forget_handle_references();
+
+		if (!replayer.parse(*this, global_database, payload.data(), payload.size()))
 			LOGE("Failed to parse blob (tag: %d, hash: 0x%016" PRIx64 ").\n", work_item.tag, work_item.hash);
 
 		if (work_item.tag == RESOURCE_SHADER_MODULE)
@@ -411,16 +1026,33 @@ struct ThreadedReplayer : StateCreatorInterface
 			replayer.get_allocator().reset();
 
 			// Feed shader module statistics.
-			shader_module_total_size.fetch_add(json_size, std::memory_order_relaxed);
+			shader_module_total_size.fetch_add(payload.size(), std::memory_order_relaxed);
+			size_t json_size = 0;
 			if (global_database->read_entry(work_item.tag, work_item.hash, &json_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
 				shader_module_total_compressed_size.fetch_add(json_size, std::memory_order_relaxed);
 		}
 
+		record_latency(CONTROL_BLOCK_LATENCY_PARSE, work_item.hash,
+		               chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count());
+
+		if (trace)
+		{
+			const char *name;
+			if (work_item.tag == RESOURCE_GRAPHICS_PIPELINE)
+				name = "parse graphics pipeline";
+			else if (work_item.tag == RESOURCE_COMPUTE_PIPELINE)
+				name = "parse compute pipeline";
+			else
+				name = "parse shader module";
+			record_trace_event("parse", name, work_item.hash, start_time);
+		}
+
 		return true;
 	}
 
 	void run_creation_work_item(const PipelineWorkItem &work_item)
 	{
+		FOSSILIZE_PROFILE_ZONE_HASH("create work item", work_item.hash);
 		switch (work_item.tag)
 		{
 		case RESOURCE_GRAPHICS_PIPELINE:
@@ -483,14 +1115,34 @@ struct ThreadedReplayer : StateCreatorInterface
 				if (opts.pipeline_cache && device->pipeline_feedback_enabled())
 					const_cast<VkGraphicsPipelineCreateInfo *>(work_item.create_info.graphics_create_info)->pNext = &feedback;
 
-				if (vkCreateGraphicsPipelines(device->get_device(), pipeline_cache, 1, work_item.create_info.graphics_create_info,
-				                              nullptr, work_item.output.pipeline) == VK_SUCCESS)
+				auto *info = const_cast<VkGraphicsPipelineCreateInfo *>(work_item.create_info.graphics_create_info);
+				VkResult result = VK_PIPELINE_COMPILE_REQUIRED_EXT;
+				bool probe_hit = false;
+				if (cache_probe_enabled && i == 0)
+				{
+					info->flags |= VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+					result = vkCreateGraphicsPipelines(device->get_device(), get_pipeline_cache(), 1, info,
+					                                   nullptr, work_item.output.pipeline);
+					info->flags &= ~VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+					probe_hit = result == VK_SUCCESS;
+					if (!record_cache_probe_result(RESOURCE_GRAPHICS_PIPELINE, probe_hit))
+						break;
+				}
+
+				if (!probe_hit)
+				{
+					result = vkCreateGraphicsPipelines(device->get_device(), get_pipeline_cache(), 1, info,
+					                                   nullptr, work_item.output.pipeline);
+				}
+
+				if (result == VK_SUCCESS)
 				{
 					auto end_time = chrono::steady_clock::now();
 					auto duration_ns = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
 
 					graphics_pipeline_ns.fetch_add(duration_ns, std::memory_order_relaxed);
 					graphics_pipeline_count.fetch_add(1, std::memory_order_relaxed);
+					record_latency(CONTROL_BLOCK_LATENCY_GRAPHICS_PIPELINE, work_item.hash, duration_ns);
 
 					if (!opts.ignore_derived_pipelines && (work_item.create_info.graphics_create_info->flags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT) != 0)
 					{
@@ -507,6 +1159,7 @@ struct ThreadedReplayer : StateCreatorInterface
 					if (opts.control_block && i == 0)
 						opts.control_block->successful_graphics.fetch_add(1, std::memory_order_relaxed);
 
+					bool from_cache = false;
 					if (opts.pipeline_cache && i == 0 && (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0)
 					{
 						bool cache_hit = (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) != 0;
@@ -528,7 +1181,22 @@ struct ThreadedReplayer : StateCreatorInterface
 							pipeline_cache_hits.fetch_add(1, std::memory_order_relaxed);
 						else
 							pipeline_cache_misses.fetch_add(1, std::memory_order_relaxed);
+						from_cache = cache_hit;
+					}
+					from_cache = from_cache || probe_hit;
+
+					if (trace)
+					{
+						trace->record(Global::worker_thread_index, "compile",
+						              from_cache ? "graphics pipeline (cache hit)" : "graphics pipeline",
+						              work_item.hash, start_time, end_time);
 					}
+
+					// A cache hit tells us nothing about how expensive the pipeline is to compile.
+					if (i == 0 && !from_cache)
+						record_pipeline_cost(RESOURCE_GRAPHICS_PIPELINE, work_item.hash, duration_ns);
+					if (i == 0 && journal)
+						journal->record(RESOURCE_GRAPHICS_PIPELINE, work_item.hash);
 				}
 				else
 				{
@@ -596,15 +1264,34 @@ struct ThreadedReplayer : StateCreatorInterface
 				if (opts.pipeline_cache && device->pipeline_feedback_enabled())
 					const_cast<VkComputePipelineCreateInfo *>(work_item.create_info.compute_create_info)->pNext = &feedback;
 
-				if (vkCreateComputePipelines(device->get_device(), pipeline_cache, 1,
-				                             work_item.create_info.compute_create_info,
-				                             nullptr, work_item.output.pipeline) == VK_SUCCESS)
+				auto *info = const_cast<VkComputePipelineCreateInfo *>(work_item.create_info.compute_create_info);
+				VkResult result = VK_PIPELINE_COMPILE_REQUIRED_EXT;
+				bool probe_hit = false;
+				if (cache_probe_enabled && i == 0)
+				{
+					info->flags |= VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+					result = vkCreateComputePipelines(device->get_device(), get_pipeline_cache(), 1, info,
+					                                  nullptr, work_item.output.pipeline);
+					info->flags &= ~VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+					probe_hit = result == VK_SUCCESS;
+					if (!record_cache_probe_result(RESOURCE_COMPUTE_PIPELINE, probe_hit))
+						break;
+				}
+
+				if (!probe_hit)
+				{
+					result = vkCreateComputePipelines(device->get_device(), get_pipeline_cache(), 1, info,
+					                                  nullptr, work_item.output.pipeline);
+				}
+
+				if (result == VK_SUCCESS)
 				{
 					auto end_time = chrono::steady_clock::now();
 					auto duration_ns = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
 
 					compute_pipeline_ns.fetch_add(duration_ns, std::memory_order_relaxed);
 					compute_pipeline_count.fetch_add(1, std::memory_order_relaxed);
+					record_latency(CONTROL_BLOCK_LATENCY_COMPUTE_PIPELINE, work_item.hash, duration_ns);
 
 					if (!opts.ignore_derived_pipelines && (work_item.create_info.compute_create_info->flags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT) != 0)
 					{
@@ -621,6 +1308,7 @@ struct ThreadedReplayer : StateCreatorInterface
 					if (opts.control_block && i == 0)
 						opts.control_block->successful_compute.fetch_add(1, std::memory_order_relaxed);
 
+					bool from_cache = false;
 					if (opts.pipeline_cache && i == 0 && (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0)
 					{
 						bool cache_hit = (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) != 0;
@@ -636,7 +1324,22 @@ struct ThreadedReplayer : StateCreatorInterface
 							pipeline_cache_hits.fetch_add(1, std::memory_order_relaxed);
 						else
 							pipeline_cache_misses.fetch_add(1, std::memory_order_relaxed);
+						from_cache = cache_hit;
+					}
+					from_cache = from_cache || probe_hit;
+
+					if (trace)
+					{
+						trace->record(Global::worker_thread_index, "compile",
+						              from_cache ? "compute pipeline (cache hit)" : "compute pipeline",
+						              work_item.hash, start_time, end_time);
 					}
+
+					// A cache hit tells us nothing about how expensive the pipeline is to compile.
+					if (i == 0 && !from_cache)
+						record_pipeline_cost(RESOURCE_COMPUTE_PIPELINE, work_item.hash, duration_ns);
+					if (i == 0 && journal)
+						journal->record(RESOURCE_COMPUTE_PIPELINE, work_item.hash);
 				}
 				else
 				{
@@ -654,24 +1357,363 @@ struct ThreadedReplayer : StateCreatorInterface
 		}
 	}
 
-	void worker_thread(unsigned thread_index)
+	// Creates a batch of pipelines of the same kind with a single vkCreate*Pipelines call.
+	// Everything run_creation_work_item() does per pipeline is done per pipeline here as well,
+	// except for crash attribution. We cannot tell which pipeline the driver was working on,
+	// so a crash is blamed on the first pipeline in the batch. The robust replayer then resumes right after it,
+	// so the rest of the batch is replayed again.
+	void run_creation_work_items(const PipelineWorkItem *work_items, unsigned count)
 	{
-		Global::worker_thread_index = thread_index;
+		if (count == 1)
+		{
+			run_creation_work_item(work_items[0]);
+			return;
+		}
 
-		if (opts.on_thread_callback)
-			opts.on_thread_callback(opts.on_thread_callback_userdata);
+		FOSSILIZE_PROFILE_ZONE_HASH("create work item batch", work_items[0].hash);
 
-		uint64_t idle_ns = 0;
-		auto thread_start_time = chrono::steady_clock::now();
+		bool graphics = work_items[0].tag == RESOURCE_GRAPHICS_PIPELINE;
+		auto &per_thread = get_per_thread_data();
+
+		vector<const PipelineWorkItem *> items;
+		items.reserve(count);
+		for (unsigned i = 0; i < count; i++)
+		{
+			auto &work_item = work_items[i];
+			assert(work_item.tag == work_items[0].tag);
+
+			// Make sure to iterate the index so main thread and worker threads
+			// have a coherent idea of replayer state.
+			const void *info = graphics ? static_cast<const void *>(work_item.create_info.graphics_create_info) :
+			                              static_cast<const void *>(work_item.create_info.compute_create_info);
+			if (!info)
+			{
+				if (opts.control_block)
+				{
+					if (graphics)
+						opts.control_block->skipped_graphics.fetch_add(1, std::memory_order_relaxed);
+					else
+						opts.control_block->skipped_compute.fetch_add(1, std::memory_order_relaxed);
+				}
+				continue;
+			}
+
+			VkPipelineCreateFlags flags = graphics ? work_item.create_info.graphics_create_info->flags :
+			                                         work_item.create_info.compute_create_info->flags;
+			VkPipeline base_pipeline = graphics ? work_item.create_info.graphics_create_info->basePipelineHandle :
+			                                      work_item.create_info.compute_create_info->basePipelineHandle;
+
+			// This pipeline failed for some reason, don't try to compile this one either.
+			if ((flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) != 0 && base_pipeline == VK_NULL_HANDLE)
+			{
+				*work_item.output.pipeline = VK_NULL_HANDLE;
+				if (graphics)
+					LOGE("Invalid derivative pipeline!\n");
+				continue;
+			}
+
+			items.push_back(&work_item);
+		}
+
+		if (items.empty())
+			return;
+
+		auto &first = *items.front();
+		if (graphics)
+		{
+			per_thread.current_graphics_index = first.index + 1;
+			per_thread.current_graphics_pipeline = first.hash;
+			per_thread.current_compute_pipeline = 0;
+		}
+		else
+		{
+			per_thread.current_compute_index = first.index + 1;
+			per_thread.current_compute_pipeline = first.hash;
+			per_thread.current_graphics_pipeline = 0;
+		}
+
+		if (robustness)
+		{
+			if (graphics)
+			{
+				per_thread.num_failed_module_hashes = first.create_info.graphics_create_info->stageCount;
+				for (unsigned i = 0; i < first.create_info.graphics_create_info->stageCount; i++)
+				{
+					VkShaderModule module = first.create_info.graphics_create_info->pStages[i].module;
+					per_thread.failed_module_hashes[i] = shader_module_to_hash[module];
+				}
+			}
+			else
+			{
+				per_thread.num_failed_module_hashes = 1;
+				VkShaderModule module = first.create_info.compute_create_info->stage.module;
+				per_thread.failed_module_hashes[0] = shader_module_to_hash[module];
+			}
+		}
+
+		size_t batch_size = items.size();
+		bool use_feedback = opts.pipeline_cache && device->pipeline_feedback_enabled();
+		vector<VkGraphicsPipelineCreateInfo> graphics_infos;
+		vector<VkComputePipelineCreateInfo> compute_infos;
+		vector<VkPipelineCreationFeedbackEXT> feedbacks(batch_size * 16);
+		vector<VkPipelineCreationFeedbackEXT> primary_feedbacks(batch_size);
+		vector<VkPipelineCreationFeedbackCreateInfoEXT> feedback_infos(batch_size);
+		vector<VkPipeline> pipelines(batch_size);
+		vector<uint8_t> probe_hits(batch_size);
+		vector<uint8_t> probe_skipped(batch_size);
+
+		const auto create_pipelines = [&](uint32_t create_count, const VkGraphicsPipelineCreateInfo *graphics_create_infos,
+		                                  const VkComputePipelineCreateInfo *compute_create_infos, VkPipeline *created) {
+			if (graphics)
+			{
+				vkCreateGraphicsPipelines(device->get_device(), get_pipeline_cache(), create_count,
+				                          graphics_create_infos, nullptr, created);
+			}
+			else
+			{
+				vkCreateComputePipelines(device->get_device(), get_pipeline_cache(), create_count,
+				                         compute_create_infos, nullptr, created);
+			}
+		};
+
+		if (graphics)
+			graphics_infos.reserve(batch_size);
+		else
+			compute_infos.reserve(batch_size);
+
+		for (size_t j = 0; j < batch_size; j++)
+		{
+			auto &feedback = feedback_infos[j];
+			feedback = { VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT };
+			feedback.pPipelineStageCreationFeedbacks = &feedbacks[j * 16];
+			feedback.pPipelineCreationFeedback = &primary_feedbacks[j];
+
+			if (graphics)
+			{
+				graphics_infos.push_back(*items[j]->create_info.graphics_create_info);
+				feedback.pipelineStageCreationFeedbackCount = graphics_infos.back().stageCount;
+				if (use_feedback)
+					graphics_infos.back().pNext = &feedback;
+			}
+			else
+			{
+				compute_infos.push_back(*items[j]->create_info.compute_create_info);
+				feedback.pipelineStageCreationFeedbackCount = 1;
+				if (use_feedback)
+					compute_infos.back().pNext = &feedback;
+			}
+		}
+
+		for (unsigned i = 0; i < loop_count; i++)
+		{
+			for (auto *item : items)
+			{
+				// Avoid leak.
+				if (*item->hash_map_entry.pipeline != VK_NULL_HANDLE)
+					vkDestroyPipeline(device->get_device(), *item->hash_map_entry.pipeline, nullptr);
+				*item->hash_map_entry.pipeline = VK_NULL_HANDLE;
+			}
+
+			for (auto &feedback : primary_feedbacks)
+				feedback = {};
+			for (auto &feedback : feedbacks)
+				feedback = {};
+			for (auto &pipeline : pipelines)
+				pipeline = VK_NULL_HANDLE;
+
+			auto start_time = chrono::steady_clock::now();
+
+#ifdef SIMULATE_UNSTABLE_DRIVER
+			spurious_crash();
+#endif
+
+			// Pipelines which failed are returned as VK_NULL_HANDLE, the rest of the batch is still valid.
+			if (cache_probe_enabled && i == 0)
+			{
+				for (auto &info : graphics_infos)
+					info.flags |= VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+				for (auto &info : compute_infos)
+					info.flags |= VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+				create_pipelines(uint32_t(batch_size), graphics_infos.data(), compute_infos.data(), pipelines.data());
+				for (auto &info : graphics_infos)
+					info.flags &= ~VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+				for (auto &info : compute_infos)
+					info.flags &= ~VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_EXT;
+
+				// Compile all misses of the batch in one go.
+				vector<size_t> misses;
+				for (size_t j = 0; j < batch_size; j++)
+				{
+					probe_hits[j] = pipelines[j] != VK_NULL_HANDLE;
+					probe_skipped[j] = !record_cache_probe_result(items[j]->tag, probe_hits[j] != 0);
+					if (!probe_hits[j] && !probe_skipped[j])
+						misses.push_back(j);
+				}
+
+				if (!misses.empty())
+				{
+					vector<VkGraphicsPipelineCreateInfo> missed_graphics_infos;
+					vector<VkComputePipelineCreateInfo> missed_compute_infos;
+					vector<VkPipeline> missed_pipelines(misses.size());
+					for (auto j : misses)
+					{
+						if (graphics)
+							missed_graphics_infos.push_back(graphics_infos[j]);
+						else
+							missed_compute_infos.push_back(compute_infos[j]);
+					}
+
+					create_pipelines(uint32_t(misses.size()), missed_graphics_infos.data(), missed_compute_infos.data(),
+					                 missed_pipelines.data());
+					for (size_t j = 0; j < misses.size(); j++)
+						pipelines[misses[j]] = missed_pipelines[j];
+				}
+			}
+			else
+				create_pipelines(uint32_t(batch_size), graphics_infos.data(), compute_infos.data(), pipelines.data());
+
+			auto end_time = chrono::steady_clock::now();
+			uint64_t batch_ns = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+
+			if (trace)
+			{
+				trace->record(Global::worker_thread_index, "compile",
+				              graphics ? "graphics pipeline batch" : "compute pipeline batch",
+				              items[0]->hash, start_time, end_time, unsigned(batch_size));
+			}
+
+			for (size_t j = 0; j < batch_size; j++)
+			{
+				auto &work_item = *items[j];
+				*work_item.output.pipeline = pipelines[j];
+
+				if (i == 0 && probe_skipped[j])
+					continue;
+
+				if (pipelines[j] == VK_NULL_HANDLE)
+				{
+					LOGE("Failed to create %s pipeline for hash 0x%016" PRIx64 ".\n",
+					     graphics ? "graphics" : "compute", work_item.hash);
+					continue;
+				}
+
+				// The driver can tell us how long each pipeline took, otherwise split the time evenly.
+				auto &primary_feedback = primary_feedbacks[j];
+				uint64_t duration_ns = (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0 ?
+				                       primary_feedback.duration : batch_ns / batch_size;
+
+				if (graphics)
+				{
+					graphics_pipeline_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+					graphics_pipeline_count.fetch_add(1, std::memory_order_relaxed);
+					record_latency(CONTROL_BLOCK_LATENCY_GRAPHICS_PIPELINE, work_item.hash, duration_ns);
+				}
+				else
+				{
+					compute_pipeline_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+					compute_pipeline_count.fetch_add(1, std::memory_order_relaxed);
+					record_latency(CONTROL_BLOCK_LATENCY_COMPUTE_PIPELINE, work_item.hash, duration_ns);
+				}
+
+				VkPipelineCreateFlags flags = graphics ? graphics_infos[j].flags : compute_infos[j].flags;
+				if (!opts.ignore_derived_pipelines && (flags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT) != 0)
+				{
+					*work_item.hash_map_entry.pipeline = *work_item.output.pipeline;
+				}
+				else
+				{
+					// Destroy the pipeline right away to save memory if we don't need it for purposes of creating derived pipelines later.
+					*work_item.hash_map_entry.pipeline = VK_NULL_HANDLE;
+					vkDestroyPipeline(device->get_device(), *work_item.output.pipeline, nullptr);
+					*work_item.output.pipeline = VK_NULL_HANDLE;
+				}
+
+				if (opts.control_block && i == 0)
+				{
+					if (graphics)
+						opts.control_block->successful_graphics.fetch_add(1, std::memory_order_relaxed);
+					else
+						opts.control_block->successful_compute.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				bool from_cache = false;
+				if (opts.pipeline_cache && i == 0 && (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0)
+				{
+					bool cache_hit = (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) != 0;
+
+					// Check per-stage feedback.
+					if (!cache_hit)
+					{
+						cache_hit = true;
+						auto &feedback = feedback_infos[j];
+						for (uint32_t k = 0; k < feedback.pipelineStageCreationFeedbackCount; k++)
+						{
+							bool valid = (feedback.pPipelineStageCreationFeedbacks[k].flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0;
+							bool hit = (feedback.pPipelineStageCreationFeedbacks[k].flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) != 0;
+							if (!valid || !hit)
+								cache_hit = false;
+						}
+					}
+
+					if (cache_hit)
+						pipeline_cache_hits.fetch_add(1, std::memory_order_relaxed);
+					else
+						pipeline_cache_misses.fetch_add(1, std::memory_order_relaxed);
+					from_cache = cache_hit;
+				}
+				from_cache = from_cache || (i == 0 && probe_hits[j]);
+
+				// A cache hit tells us nothing about how expensive the pipeline is to compile.
+				if (i == 0 && !from_cache)
+					record_pipeline_cost(work_item.tag, work_item.hash, duration_ns);
+				if (i == 0 && journal)
+					journal->record(work_item.tag, work_item.hash);
+			}
+		}
+
+		// Everything in the batch is done, so the next crash can only be blamed on later pipelines.
+		if (graphics)
+			per_thread.current_graphics_index = items.back()->index + 1;
+		else
+			per_thread.current_compute_index = items.back()->index + 1;
+		per_thread.current_graphics_pipeline = 0;
+		per_thread.current_compute_pipeline = 0;
+	}
+
+	void worker_thread(unsigned thread_index)
+	{
+		Global::worker_thread_index = thread_index;
+
+#ifdef FOSSILIZE_PROFILING
+		char profile_thread_name[64];
+		snprintf(profile_thread_name, sizeof(profile_thread_name), "Replay worker %u", thread_index);
+		FOSSILIZE_PROFILE_THREAD_NAME(profile_thread_name);
+#endif
+
+		// Threads the driver spawns from here inherit this in most cases.
+		if (!worker_cpus.empty() && !set_current_thread_affinity(worker_cpus))
+			LOGE("Failed to set CPU affinity of worker thread %u.\n", thread_index);
+		if (opts.background_priority && !set_current_thread_background_priority())
+			LOGE("Failed to set background priority of worker thread %u.\n", thread_index);
+
+		if (opts.on_thread_callback)
+			opts.on_thread_callback(opts.on_thread_callback_userdata);
+
+		uint64_t idle_ns = 0;
+		auto thread_start_time = chrono::steady_clock::now();
 
 		// Pipelines and shader modules are decompressed and parsed in the worker threads.
 		// Inherit references to the trivial modules.
 		StateReplayer per_thread_replayer[NUM_MEMORY_CONTEXTS];
+		unsigned static_generation = static_object_generation.load(std::memory_order_acquire);
 		for (auto &r : per_thread_replayer)
 		{
 			r.set_resolve_derivative_pipeline_handles(false);
 			r.set_resolve_shader_module_handles(false);
 			r.copy_handle_references(*global_replayer);
+			// Memory contexts are reset for every batch of pipelines, keep their blocks around.
+			r.get_allocator().set_block_recycling(true);
+			r.get_allocator().set_huge_pages(opts.huge_pages);
 		}
 
 		get_per_thread_data().per_thread_replayers = per_thread_replayer;
@@ -682,41 +1724,88 @@ struct ThreadedReplayer : StateCreatorInterface
 			work_done_condition[0].notify_one();
 		}
 
-		vector<uint8_t> json_buffer;
+		EntryPayload payload;
+		vector<Hash> pinned_modules;
+		vector<PipelineWorkItem> batch;
+		batch.reserve(opts.pipeline_batch_size);
 
 		for (;;)
 		{
 			PipelineWorkItem work_item;
 			auto idle_start_time = chrono::steady_clock::now();
-			{
-				unique_lock<mutex> lock(pipeline_work_queue_mutex);
-				work_available_condition.wait(lock, [&]() -> bool {
-					return shutting_down || !pipeline_work_queue.empty();
-				});
-
-				if (shutting_down)
-					break;
+			if (!dequeue_work_item(thread_index - 1, work_item))
+				break;
 
-				work_item = pipeline_work_queue.front();
-				pipeline_work_queue.pop();
+			// Pipelines are enqueued once everything they depend on has completed,
+			// so any creation work of the same kind which is queued up behind this one can go in the same call.
+			batch.clear();
+			batch.push_back(work_item);
+			if (!work_item.parse_only && opts.pipeline_batch_size > 1)
+			{
+				PipelineWorkItem next_item;
+				while (batch.size() < opts.pipeline_batch_size &&
+				       try_dequeue_batched_work_item(thread_index - 1, work_item.tag, next_item))
+				{
+					batch.push_back(next_item);
+				}
 			}
 
 			auto idle_end_time = chrono::steady_clock::now();
 			auto duration_ns = chrono::duration_cast<chrono::nanoseconds>(idle_end_time - idle_start_time).count();
 			idle_ns += duration_ns;
 
-			if (work_item.parse_only)
-				run_parse_work_item(per_thread_replayer[work_item.memory_context_index], json_buffer, work_item);
+			// In streaming mode, the main thread only creates static objects while no work is queued,
+			// so nothing can be looking at the references we replace here.
+			unsigned generation = static_object_generation.load(std::memory_order_acquire);
+			if (generation != static_generation)
+			{
+				for (auto &r : per_thread_replayer)
+					r.copy_handle_references(*global_replayer);
+				static_generation = generation;
+			}
+
+			// Once the time budget is exhausted, we only drain the queues so the main thread can wrap up.
+			if (deadline_reached())
+			{
+				if (opts.control_block && !work_item.parse_only)
+				{
+					for (auto &item : batch)
+					{
+						if (item.tag == RESOURCE_GRAPHICS_PIPELINE)
+							opts.control_block->skipped_graphics.fetch_add(1, std::memory_order_relaxed);
+						else if (item.tag == RESOURCE_COMPUTE_PIPELINE)
+							opts.control_block->skipped_compute.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+			}
+			else if (work_item.parse_only)
+				run_parse_work_item(per_thread_replayer[work_item.memory_context_index], payload, work_item);
 			else
-				run_creation_work_item(work_item);
+			{
+				for (auto &item : batch)
+					resolve_shader_modules(item, payload, pinned_modules);
+				run_creation_work_items(batch.data(), unsigned(batch.size()));
+				for (auto hash : pinned_modules)
+					shader_modules.unpin_object(hash);
+				pinned_modules.clear();
+			}
+
+			// Pipelines skipped at the deadline still release their children, which are then skipped as well.
+			if (!work_item.parse_only)
+				for (auto &item : batch)
+					complete_parent_pipeline(thread_index - 1, item);
 
 			idle_start_time = chrono::steady_clock::now();
+			for (auto &item : batch)
 			{
-				unsigned context_index = work_item.memory_context_index;
-				lock_guard<mutex> lock(pipeline_work_queue_mutex);
-				completed_count[context_index]++;
-				if (completed_count[context_index] == queued_count[context_index]) // Makes sense to signal main thread now.
+				unsigned context_index = item.memory_context_index;
+				unsigned completed = completed_count[context_index].fetch_add(1, std::memory_order_acq_rel) + 1;
+				if (completed == queued_count[context_index].load(std::memory_order_acquire)) // Makes sense to signal main thread now.
+				{
+					// Taking the lock orders us against a main thread which is about to wait.
+					lock_guard<mutex> lock(pipeline_work_queue_mutex);
 					work_done_condition[context_index].notify_one();
+				}
 			}
 
 			idle_end_time = chrono::steady_clock::now();
@@ -730,33 +1819,84 @@ struct ThreadedReplayer : StateCreatorInterface
 		                          std::memory_order_relaxed);
 
 		size_t peak_memory = 0;
+		size_t peak_in_use = 0;
+		size_t blocks = 0;
+		size_t system_allocations = 0;
 		for (auto &r : per_thread_replayer)
-			peak_memory += r.get_allocator().get_peak_memory_consumption();
+		{
+			ScratchAllocator::Statistics stats;
+			r.get_allocator().get_statistics(&stats);
+			peak_memory += stats.peak_bytes_reserved;
+			peak_in_use += stats.peak_bytes_in_use;
+			blocks += stats.block_count + stats.free_block_count;
+			system_allocations += stats.system_allocations;
+		}
 
 		total_peak_memory.fetch_add(peak_memory, std::memory_order_relaxed);
+		total_peak_memory_in_use.fetch_add(peak_in_use, std::memory_order_relaxed);
+		total_allocator_blocks.fetch_add(blocks, std::memory_order_relaxed);
+		total_allocator_system_allocations.fetch_add(system_allocations, std::memory_order_relaxed);
+	}
+
+	VkPipelineCache get_pipeline_cache()
+	{
+		auto &per_thread = get_per_thread_data();
+		return per_thread.pipeline_cache != VK_NULL_HANDLE ? per_thread.pipeline_cache : pipeline_cache;
+	}
+
+	// Folds the per-thread caches into the main cache. Pipeline caches are internally synchronized,
+	// so workers can keep compiling into their own cache while we merge it.
+	void merge_pipeline_caches()
+	{
+		// The destination of vkMergePipelineCaches is externally synchronized.
+		lock_guard<mutex> lock(pipeline_cache_lock);
+		if (!device || pipeline_cache == VK_NULL_HANDLE)
+			return;
+
+		auto start_time = chrono::steady_clock::now();
+		VkPipelineCache caches[64];
+		uint32_t count = 0;
+		for (auto &per_thread : per_thread_data)
+		{
+			if (per_thread.pipeline_cache == VK_NULL_HANDLE)
+				continue;
+
+			caches[count++] = per_thread.pipeline_cache;
+			if (count == sizeof(caches) / sizeof(caches[0]))
+			{
+				if (vkMergePipelineCaches(device->get_device(), pipeline_cache, count, caches) != VK_SUCCESS)
+					LOGE("Failed to merge pipeline caches.\n");
+				count = 0;
+			}
+		}
+
+		if (count && vkMergePipelineCaches(device->get_device(), pipeline_cache, count, caches) != VK_SUCCESS)
+			LOGE("Failed to merge pipeline caches.\n");
+
+		record_trace_event("cache", "merge pipeline caches", 0, start_time);
 	}
 
 	void flush_pipeline_cache()
 	{
-		if (device && pipeline_cache)
+		merge_pipeline_caches();
+		if (device)
 		{
-			if (!opts.on_disk_pipeline_cache_path.empty())
+			for (auto &per_thread : per_thread_data)
 			{
-				size_t pipeline_cache_size = 0;
-				if (vkGetPipelineCacheData(device->get_device(), pipeline_cache, &pipeline_cache_size, nullptr) == VK_SUCCESS)
+				if (per_thread.pipeline_cache != VK_NULL_HANDLE)
 				{
-					vector<uint8_t> pipeline_buffer(pipeline_cache_size);
-					if (vkGetPipelineCacheData(device->get_device(), pipeline_cache, &pipeline_cache_size, pipeline_buffer.data()) == VK_SUCCESS)
-					{
-						// This isn't safe to do in a signal handler, but it's unlikely to be a problem in practice.
-						FILE *file = fopen(opts.on_disk_pipeline_cache_path.c_str(), "wb");
-						if (!file || fwrite(pipeline_buffer.data(), 1, pipeline_buffer.size(), file) != pipeline_buffer.size())
-							LOGE("Failed to write pipeline cache data to disk.\n");
-						if (file)
-							fclose(file);
-					}
+					vkDestroyPipelineCache(device->get_device(), per_thread.pipeline_cache, nullptr);
+					per_thread.pipeline_cache = VK_NULL_HANDLE;
 				}
 			}
+		}
+
+		lock_guard<mutex> lock(pipeline_cache_lock);
+		if (device && pipeline_cache)
+		{
+			// This isn't safe to do in a signal handler, but it's unlikely to be a problem in practice.
+			if (!opts.on_disk_pipeline_cache_path.empty())
+				write_pipeline_cache_data(device->get_device(), pipeline_cache, opts.on_disk_pipeline_cache_path);
 			vkDestroyPipelineCache(device->get_device(), pipeline_cache, nullptr);
 			pipeline_cache = VK_NULL_HANDLE;
 		}
@@ -765,6 +1905,7 @@ struct ThreadedReplayer : StateCreatorInterface
 	void tear_down_threads()
 	{
 		// Signal that it's time for threads to die.
+		flush_work_items();
 		{
 			lock_guard<mutex> lock(pipeline_work_queue_mutex);
 			shutting_down = true;
@@ -775,6 +1916,103 @@ struct ThreadedReplayer : StateCreatorInterface
 			if (thread.joinable())
 				thread.join();
 		thread_pool.clear();
+
+		if (memory_monitor.joinable())
+		{
+			{
+				lock_guard<mutex> lock(pipeline_work_queue_mutex);
+				memory_monitor_condition.notify_one();
+			}
+			memory_monitor.join();
+		}
+
+		if (pipeline_cache_checkpoint.joinable())
+		{
+			{
+				lock_guard<mutex> lock(pipeline_work_queue_mutex);
+				pipeline_cache_checkpoint_condition.notify_one();
+			}
+			pipeline_cache_checkpoint.join();
+		}
+	}
+
+	// Checkpoints only need the main cache, so the per-thread caches are merged in first.
+	void pipeline_cache_checkpoint_thread()
+	{
+		FOSSILIZE_PROFILE_THREAD_NAME("Pipeline cache checkpoint");
+		auto last_time = chrono::steady_clock::now();
+		uint32_t last_count = graphics_pipeline_count.load(std::memory_order_relaxed) +
+		                      compute_pipeline_count.load(std::memory_order_relaxed);
+
+		unique_lock<mutex> lock(pipeline_work_queue_mutex);
+		while (!pipeline_cache_checkpoint_condition.wait_for(lock, chrono::milliseconds(250), [&]() { return shutting_down; }))
+		{
+			lock.unlock();
+			auto current_time = chrono::steady_clock::now();
+			uint32_t count = graphics_pipeline_count.load(std::memory_order_relaxed) +
+			                 compute_pipeline_count.load(std::memory_order_relaxed);
+
+			bool checkpoint = false;
+			if (opts.pipeline_cache_checkpoint_seconds &&
+			    current_time - last_time >= chrono::seconds(opts.pipeline_cache_checkpoint_seconds))
+			{
+				checkpoint = true;
+			}
+			if (opts.pipeline_cache_checkpoint_pipelines &&
+			    count - last_count >= opts.pipeline_cache_checkpoint_pipelines)
+			{
+				checkpoint = true;
+			}
+
+			if (checkpoint && count != last_count)
+			{
+				merge_pipeline_caches();
+				bool written = false;
+				{
+					// An emergency teardown might have destroyed the cache already.
+					lock_guard<mutex> cache_lock(pipeline_cache_lock);
+					if (pipeline_cache != VK_NULL_HANDLE)
+					{
+						written = write_pipeline_cache_data(device->get_device(), pipeline_cache,
+						                                    opts.on_disk_pipeline_cache_path);
+					}
+				}
+				record_trace_event("cache", "checkpoint pipeline cache", 0, current_time);
+				if (written)
+					last_count = count;
+			}
+
+			if (checkpoint)
+				last_time = current_time;
+			lock.lock();
+		}
+	}
+
+	// Memory which the process used before any pipelines were compiled is not attributed to workers.
+	void memory_monitor_thread(uint64_t baseline_resident_bytes)
+	{
+		WorkerThrottle throttle(opts.min_threads, num_worker_threads, uint64_t(opts.memory_headroom_mb) * 1024 * 1024);
+		unique_lock<mutex> lock(pipeline_work_queue_mutex);
+		while (!memory_monitor_condition.wait_for(lock, chrono::milliseconds(250), [&]() { return shutting_down; }))
+		{
+			lock.unlock();
+			MemoryStatus status = {};
+			unsigned active = throttle.get_active_workers();
+			if (query_memory_status(status))
+			{
+				uint64_t worker_bytes = status.resident_bytes > baseline_resident_bytes ?
+				                        status.resident_bytes - baseline_resident_bytes : 0;
+				active = throttle.update(status.available_bytes, worker_bytes);
+			}
+			lock.lock();
+
+			if (active != active_worker_count.load(std::memory_order_relaxed))
+			{
+				LOGI("Memory pressure: %u of %u worker threads active.\n", active, num_worker_threads);
+				active_worker_count.store(active, std::memory_order_relaxed);
+				work_available_condition.notify_all();
+			}
+		}
 	}
 
 	~ThreadedReplayer()
@@ -782,6 +2020,9 @@ struct ThreadedReplayer : StateCreatorInterface
 		tear_down_threads();
 		flush_pipeline_cache();
 
+		if (trace && !trace->write(opts.trace_path.c_str(), opts.trace_fragment))
+			LOGE("Failed to write trace to %s.\n", opts.trace_path.c_str());
+
 		for (auto &sampler : samplers)
 			if (sampler.second)
 				vkDestroySampler(device->get_device(), sampler.second, nullptr);
@@ -805,9 +2046,13 @@ struct ThreadedReplayer : StateCreatorInterface
 			if (module != VK_NULL_HANDLE)
 				vkDestroyShaderModule(device->get_device(), module, nullptr);
 		});
+
+		// A cached device outlives the replayer.
+		if (opts.device_cache && device)
+			device->set_validation_error_callback(nullptr, nullptr);
 	}
 
-	bool validate_pipeline_cache_header(const vector<uint8_t> &blob)
+	static bool validate_pipeline_cache_header(VkPhysicalDevice gpu, const vector<uint8_t> &blob)
 	{
 		if (blob.size() < 16 + VK_UUID_SIZE)
 		{
@@ -837,7 +2082,7 @@ struct ThreadedReplayer : StateCreatorInterface
 		}
 
 		VkPhysicalDeviceProperties props = {};
-		vkGetPhysicalDeviceProperties(device->get_gpu(), &props);
+		vkGetPhysicalDeviceProperties(gpu, &props);
 		if (props.vendorID != read_le(8))
 		{
 			LOGI("Mismatch of vendorID and cache vendorID.\n");
@@ -859,7 +2104,7 @@ struct ThreadedReplayer : StateCreatorInterface
 		return true;
 	}
 
-	void set_application_info(Hash, const VkApplicationInfo *app, const VkPhysicalDeviceFeatures2 *features) override
+	void set_application_info(Hash hash, const VkApplicationInfo *app, const VkPhysicalDeviceFeatures2 *features) override
 	{
 		// TODO: Could use this to create multiple VkDevices for replay as necessary if app changes.
 
@@ -867,12 +2112,20 @@ struct ThreadedReplayer : StateCreatorInterface
 		{
 			// Now we can init the device with correct app info.
 			device_was_init = true;
-			device.reset(new VulkanDevice);
 			device_opts.application_info = app;
 			device_opts.features = features;
 			device_opts.need_disasm = false;
 			auto start_device = chrono::steady_clock::now();
-			if (!device->init_device(device_opts))
+			if (opts.device_cache)
+				device = opts.device_cache->acquire(hash, device_opts);
+			else
+			{
+				owned_device.reset(new VulkanDevice);
+				if (owned_device->init_device(device_opts))
+					device = owned_device.get();
+			}
+
+			if (!device)
 			{
 				LOGE("Failed to create Vulkan device, bailing ...\n");
 				exit(EXIT_FAILURE);
@@ -880,35 +2133,69 @@ struct ThreadedReplayer : StateCreatorInterface
 
 			device->set_validation_error_callback(on_validation_error, this);
 
-			if (opts.pipeline_cache)
+			if (opts.cache_probe)
 			{
-				VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
-				vector<uint8_t> on_disk_cache;
+				cache_probe_enabled = device->pipeline_cache_control_enabled();
+				if (!cache_probe_enabled)
+					LOGE("Device does not support VK_EXT_pipeline_creation_cache_control, cannot probe the pipeline cache.\n");
+			}
 
-				// Try to load on-disk cache.
-				if (!opts.on_disk_pipeline_cache_path.empty())
-				{
-					FILE *file = fopen(opts.on_disk_pipeline_cache_path.c_str(), "rb");
-					if (file)
-					{
-						fseek(file, 0, SEEK_END);
-						size_t len = ftell(file);
-						rewind(file);
+			if (!opts.pipeline_stats_path.empty() || !opts.pipeline_stats_output_path.empty())
+			{
+				if (!opts.pipeline_stats_path.empty() && !pipeline_stats.load(opts.pipeline_stats_path.c_str()))
+					LOGE("Failed to load pipeline stats, ignoring recorded compile times.\n");
+
+				VkPhysicalDeviceProperties props = {};
+				if (device->get_gpu() != VK_NULL_HANDLE)
+					vkGetPhysicalDeviceProperties(device->get_gpu(), &props);
+				pipeline_stats.set_device(props);
+			}
+
+			if (!opts.journal_path.empty())
+			{
+				VkPhysicalDeviceProperties props = {};
+				if (device->get_gpu() != VK_NULL_HANDLE)
+					vkGetPhysicalDeviceProperties(device->get_gpu(), &props);
+
+				journal.reset(new ReplayJournal);
+				if (journal->open(opts.journal_path.c_str(), props))
+				{
+					if (!opts.full_replay)
+						LOGI("Replay journal lists %u pipelines for this device, they will be skipped.\n", unsigned(journal->get_journaled_count()));
+				}
+				else
+					journal.reset();
+			}
+
+			if (trace)
+			{
+				VkPhysicalDeviceProperties props = {};
+				if (device->get_gpu() != VK_NULL_HANDLE)
+					vkGetPhysicalDeviceProperties(device->get_gpu(), &props);
+				trace->set_device(props);
+			}
+
+			if (opts.pipeline_cache)
+			{
+				VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+				vector<uint8_t> on_disk_cache;
+
+				// Try to load on-disk cache.
+				if (!opts.on_disk_pipeline_cache_path.empty())
+				{
+					on_disk_cache = load_buffer_from_file(opts.on_disk_pipeline_cache_path.c_str());
+					if (on_disk_cache.empty() && !opts.on_disk_pipeline_cache_seed_path.empty())
+						on_disk_cache = load_buffer_from_file(opts.on_disk_pipeline_cache_seed_path.c_str());
 
-						if (len != 0)
+					if (!on_disk_cache.empty())
+					{
+						if (validate_pipeline_cache_header(device->get_gpu(), on_disk_cache))
 						{
-							on_disk_cache.resize(len);
-							if (fread(on_disk_cache.data(), 1, len, file) == len)
-							{
-								if (validate_pipeline_cache_header(on_disk_cache))
-								{
-									info.pInitialData = on_disk_cache.data();
-									info.initialDataSize = on_disk_cache.size();
-								}
-								else
-									LOGI("Failed to validate pipeline cache. Creating a blank one.\n");
-							}
+							info.pInitialData = on_disk_cache.data();
+							info.initialDataSize = on_disk_cache.size();
 						}
+						else
+							LOGI("Failed to validate pipeline cache. Creating a blank one.\n");
 					}
 				}
 
@@ -923,6 +2210,21 @@ struct ThreadedReplayer : StateCreatorInterface
 						pipeline_cache = VK_NULL_HANDLE;
 					}
 				}
+
+				// Drivers tend to lock the whole cache for every insertion, so give every worker its own.
+				// They all start out with the on-disk data, so lookups hit regardless of which thread compiles what.
+				if (pipeline_cache != VK_NULL_HANDLE && opts.pipeline_cache_per_thread)
+				{
+					for (unsigned i = 0; i < num_worker_threads; i++)
+					{
+						auto &per_thread = per_thread_data[i + 1];
+						if (vkCreatePipelineCache(device->get_device(), &info, nullptr, &per_thread.pipeline_cache) != VK_SUCCESS)
+						{
+							LOGE("Failed to create pipeline cache for worker thread %u, using the shared one.\n", i);
+							per_thread.pipeline_cache = VK_NULL_HANDLE;
+						}
+					}
+				}
 			}
 
 			auto end_device = chrono::steady_clock::now();
@@ -948,48 +2250,49 @@ struct ThreadedReplayer : StateCreatorInterface
 
 	bool enqueue_create_sampler(Hash index, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
 	{
-		// Playback in-order.
+		// Static objects of the same type are created from several threads.
 		if (vkCreateSampler(device->get_device(), create_info, nullptr, sampler) != VK_SUCCESS)
 		{
 			LOGE("Creating sampler %0" PRIX64 " Failed!\n", index);
 			return false;
 		}
+		lock_guard<mutex> holder(static_object_lock);
 		samplers[index] = *sampler;
 		return true;
 	}
 
 	bool enqueue_create_descriptor_set_layout(Hash index, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
 	{
-		// Playback in-order.
 		if (vkCreateDescriptorSetLayout(device->get_device(), create_info, nullptr, layout) != VK_SUCCESS)
 		{
 			LOGE("Creating descriptor set layout %0" PRIX64 " Failed!\n", index);
 			return false;
 		}
+		lock_guard<mutex> holder(static_object_lock);
 		layouts[index] = *layout;
 		return true;
 	}
 
 	bool enqueue_create_pipeline_layout(Hash index, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
 	{
-		// Playback in-order.
 		if (vkCreatePipelineLayout(device->get_device(), create_info, nullptr, layout) != VK_SUCCESS)
 		{
 			LOGE("Creating pipeline layout %0" PRIX64 " Failed!\n", index);
 			return false;
 		}
+		lock_guard<mutex> holder(static_object_lock);
 		pipeline_layouts[index] = *layout;
 		return true;
 	}
 
 	bool enqueue_create_render_pass(Hash index, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
 	{
-		// Playback in-order.
 		if (vkCreateRenderPass(device->get_device(), create_info, nullptr, render_pass) != VK_SUCCESS)
 		{
 			LOGE("Creating render pass %0" PRIX64 " Failed!\n", index);
 			return false;
 		}
+		lock_guard<mutex> holder(static_object_lock);
 		render_passes[index] = *render_pass;
 		return true;
 	}
@@ -999,7 +2302,6 @@ struct ThreadedReplayer : StateCreatorInterface
 		*module = VK_NULL_HANDLE;
 		if (masked_shader_modules.count(hash))
 		{
-			lock_guard<mutex> lock(internal_enqueue_mutex);
 			//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
 			shader_modules.insert_object(hash, *module, 1);
 			return true;
@@ -1020,11 +2322,13 @@ struct ThreadedReplayer : StateCreatorInterface
 			auto duration_ns = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
 			shader_module_ns.fetch_add(duration_ns, std::memory_order_relaxed);
 
+			if (trace)
+				trace->record(Global::worker_thread_index, "validate", "shader module", hash, start_time, end_time);
+
 			if (!ret)
 			{
 				LOGE("Failed to validate SPIR-V module: %0" PRIX64 "\n", hash);
 				*module = VK_NULL_HANDLE;
-				lock_guard<mutex> lock(internal_enqueue_mutex);
 				//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
 				shader_modules.insert_object(hash, VK_NULL_HANDLE, 1);
 				shader_module_count.fetch_add(1, std::memory_order_relaxed);
@@ -1051,6 +2355,10 @@ struct ThreadedReplayer : StateCreatorInterface
 				auto duration_ns = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
 				shader_module_ns.fetch_add(duration_ns, std::memory_order_relaxed);
 				shader_module_count.fetch_add(1, std::memory_order_relaxed);
+				record_latency(CONTROL_BLOCK_LATENCY_SHADER_MODULE, hash, duration_ns);
+
+				if (trace)
+					trace->record(Global::worker_thread_index, "compile", "shader module", hash, start_time, end_time);
 
 				if (robustness)
 				{
@@ -1067,11 +2375,10 @@ struct ThreadedReplayer : StateCreatorInterface
 			}
 		}
 
-		{
-			lock_guard<mutex> lock(internal_enqueue_mutex);
-			//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
-			shader_modules.insert_object(hash, *module, create_info->codeSize);
-		}
+		//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
+		// A worker might have created the same module in the meantime, keep the one which is in the cache.
+		if (!shader_modules.insert_object(hash, *module, create_info->codeSize) && *module != VK_NULL_HANDLE)
+			vkDestroyShaderModule(device->get_device(), *module, nullptr);
 
 		return true;
 	}
@@ -1190,6 +2497,103 @@ struct ThreadedReplayer : StateCreatorInterface
 		return true;
 	}
 
+	// Returns false if the pipeline missed and must not be compiled.
+	bool record_cache_probe_result(ResourceTag tag, bool hit)
+	{
+		if (hit)
+		{
+			cache_probe_hits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		cache_probe_misses.fetch_add(1, std::memory_order_relaxed);
+		if (!opts.cache_probe_only)
+			return true;
+
+		if (opts.control_block)
+		{
+			if (tag == RESOURCE_GRAPHICS_PIPELINE)
+				opts.control_block->skipped_graphics.fetch_add(1, std::memory_order_relaxed);
+			else
+				opts.control_block->skipped_compute.fetch_add(1, std::memory_order_relaxed);
+		}
+		return false;
+	}
+
+	void record_pipeline_cost(ResourceTag tag, Hash hash, uint64_t cost_ns)
+	{
+		if (opts.pipeline_stats_output_path.empty())
+			return;
+		lock_guard<mutex> lock(pipeline_stats_lock);
+		pipeline_stats.record_cost(tag, hash, cost_ns);
+	}
+
+	bool deadline_reached()
+	{
+		if (!has_deadline)
+			return false;
+		if (deadline_hit.load(std::memory_order_relaxed))
+			return true;
+		if (chrono::steady_clock::now() < deadline)
+			return false;
+
+		if (!deadline_hit.exchange(true))
+			LOGI("Time budget of %.3f s is exhausted, stopping replay.\n", opts.time_budget_seconds);
+		return true;
+	}
+
+	bool is_journaled(ResourceTag tag, Hash hash) const
+	{
+		return journal && !opts.full_replay && journal->contains(tag, hash);
+	}
+
+	void save_pipeline_stats()
+	{
+		if (opts.pipeline_stats_output_path.empty())
+			return;
+		lock_guard<mutex> lock(pipeline_stats_lock);
+		pipeline_stats.save(opts.pipeline_stats_output_path.c_str());
+	}
+
+	// Longest processing time first. Expensive pipelines start early and cheap ones fill in the gaps at the end,
+	// which avoids a long tail where one thread is still compiling a huge pipeline while the others are idle.
+	// Pipelines we have no cost for are assumed to be of average cost.
+	void sort_pipelines_by_cost(ResourceTag tag, vector<Hash> &hashes)
+	{
+		vector<pair<uint64_t, Hash>> costs;
+		costs.reserve(hashes.size());
+
+		uint64_t total_cost = 0;
+		size_t known_count = 0;
+		for (auto hash : hashes)
+		{
+			uint64_t cost = 0;
+			bool known = pipeline_stats.find_cost(tag, hash, &cost);
+			if (known)
+			{
+				total_cost += cost;
+				known_count++;
+			}
+			costs.push_back({ known ? cost : UINT64_MAX, hash });
+		}
+
+		uint64_t average_cost = known_count ? total_cost / known_count : 0;
+		for (auto &cost : costs)
+			if (cost.first == UINT64_MAX)
+				cost.first = average_cost;
+
+		stable_sort(begin(costs), end(costs), [](const pair<uint64_t, Hash> &a, const pair<uint64_t, Hash> &b) {
+			return a.first > b.first;
+		});
+
+		for (size_t i = 0; i < hashes.size(); i++)
+			hashes[i] = costs[i].second;
+
+		LOGI("Sorted %s by recorded compile time, %u of %u pipelines have a recorded cost.\n",
+		     tag == RESOURCE_GRAPHICS_PIPELINE ? "graphics pipelines" : "compute pipelines",
+		     unsigned(known_count), unsigned(hashes.size()));
+	}
+
 	bool enqueue_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline,
 	                      unsigned index, unsigned memory_context_index)
 	{
@@ -1210,7 +2614,8 @@ struct ThreadedReplayer : StateCreatorInterface
 		//else
 		//	LOGE("Skipping replay of graphics pipeline index %u.\n", graphics_pipeline_index);
 
-		enqueue_work_item(work_item);
+		if (!work_item.create_info.compute_create_info || !defer_derived_pipeline(work_item, create_info->flags))
+			enqueue_work_item(work_item);
 
 		return true;
 	}
@@ -1240,14 +2645,96 @@ struct ThreadedReplayer : StateCreatorInterface
 		//else
 		//	LOGE("Skipping replay of graphics pipeline index %u.\n", graphics_pipeline_index);
 
-		enqueue_work_item(work_item);
+		if (!valid_handles || !defer_derived_pipeline(work_item, create_info->flags))
+			enqueue_work_item(work_item);
+
+		return true;
+	}
+
+	static unsigned get_parent_pipeline_state_index(ResourceTag tag)
+	{
+		return tag == RESOURCE_GRAPHICS_PIPELINE ? 0 : 1;
+	}
+
+	static VkPipeline &get_base_pipeline_handle(const PipelineWorkItem &work_item)
+	{
+		// The create infos live in the worker memory contexts and are ours to modify.
+		if (work_item.tag == RESOURCE_GRAPHICS_PIPELINE)
+			return const_cast<VkGraphicsPipelineCreateInfo *>(work_item.create_info.graphics_create_info)->basePipelineHandle;
+		else
+			return const_cast<VkComputePipelineCreateInfo *>(work_item.create_info.compute_create_info)->basePipelineHandle;
+	}
+
+	static VkPipelineCreateFlags get_pipeline_create_flags(const PipelineWorkItem &work_item)
+	{
+		if (work_item.tag == RESOURCE_GRAPHICS_PIPELINE)
+			return work_item.create_info.graphics_create_info->flags;
+		else
+			return work_item.create_info.compute_create_info->flags;
+	}
+
+	// Returns true if the pipeline has to wait for its parent, in which case the worker which creates the parent enqueues it.
+	// Until then, the pipeline still counts as queued in its memory context, so syncing the context waits for it.
+	bool defer_derived_pipeline(PipelineWorkItem &work_item, VkPipelineCreateFlags flags)
+	{
+		auto &states = parent_pipeline_states[get_parent_pipeline_state_index(work_item.tag)];
+		lock_guard<mutex> lock(parent_pipeline_lock);
+
+		if ((flags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT) != 0 && !opts.ignore_derived_pipelines)
+		{
+			// Parents are never derived themselves.
+			states[work_item.hash];
+			return false;
+		}
+
+		if ((flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) == 0)
+			return false;
+
+		// The base pipeline handle is still the hash of the parent.
+		auto &base_pipeline = get_base_pipeline_handle(work_item);
+		auto itr = states.find((Hash)base_pipeline);
+
+		// A parent which does not allow derivatives is destroyed right away, so there is nothing to wait for.
+		if (itr == end(states) || itr->second.complete)
+		{
+			base_pipeline = itr != end(states) ? itr->second.pipeline : VK_NULL_HANDLE;
+			return false;
+		}
 
+		queued_count[work_item.memory_context_index].fetch_add(1, std::memory_order_relaxed);
+		itr->second.waiting.push_back(work_item);
 		return true;
 	}
 
+	// Called by the worker which created a potential parent pipeline, whether it succeeded or not.
+	void complete_parent_pipeline(unsigned queue_index, const PipelineWorkItem &work_item)
+	{
+		if (opts.ignore_derived_pipelines || !work_item.hash_map_entry.pipeline ||
+		    (get_pipeline_create_flags(work_item) & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT) == 0)
+		{
+			return;
+		}
+
+		vector<PipelineWorkItem> released;
+		VkPipeline pipeline = *work_item.hash_map_entry.pipeline;
+		{
+			auto &states = parent_pipeline_states[get_parent_pipeline_state_index(work_item.tag)];
+			lock_guard<mutex> lock(parent_pipeline_lock);
+			auto &state = states[work_item.hash];
+			state.complete = true;
+			state.pipeline = pipeline;
+			swap(released, state.waiting);
+		}
+
+		for (auto &item : released)
+			get_base_pipeline_handle(item) = pipeline;
+		push_work_items_from_worker(queue_index, released);
+	}
+
 	bool enqueue_shader_module(VkShaderModule shader_module_hash)
 	{
-		if (enqueued_shader_modules.count(shader_module_hash) == 0)
+		if (enqueued_shader_modules.count(shader_module_hash) == 0 &&
+		    !shader_modules.has_object((Hash) shader_module_hash))
 		{
 			if (opts.control_block)
 				opts.control_block->total_modules.fetch_add(1, std::memory_order_relaxed);
@@ -1284,27 +2771,66 @@ struct ThreadedReplayer : StateCreatorInterface
 		return ret;
 	}
 
-	void resolve_shader_modules(VkGraphicsPipelineCreateInfo *info)
+
+	// Called from worker threads. The module stays pinned until the pipeline has been created,
+	// so pruning the cache on the main thread cannot destroy it in the meantime.
+	// If the module was evicted, or its work item has not run yet, we create it ourselves.
+	VkShaderModule acquire_shader_module(Hash hash, EntryPayload &payload, vector<Hash> &pinned_modules)
 	{
-		for (uint32_t i = 0; i < info->stageCount; i++)
+		VkShaderModule module = VK_NULL_HANDLE;
+		if (shader_modules.find_and_pin_object(hash, module))
 		{
-			auto result = shader_modules.find_object((Hash) info->pStages[i].module);
-			if (!result.second)
-			{
-				LOGE("Could not find shader module %016" PRIx64 " in cache.\n", (Hash) info->pStages[i].module);
-			}
-			const_cast<VkPipelineShaderStageCreateInfo *>(info->pStages)[i].module = result.first;
+			pinned_modules.push_back(hash);
+			return module;
+		}
+
+		if (opts.control_block)
+			opts.control_block->total_modules.fetch_add(1, std::memory_order_relaxed);
+
+		PipelineWorkItem work_item;
+		work_item.tag = RESOURCE_SHADER_MODULE;
+		work_item.hash = hash;
+		work_item.parse_only = true;
+		work_item.memory_context_index = SHADER_MODULE_MEMORY_CONTEXT;
+
+		// If the driver crashes here, make sure the module is blamed, so the next process skips it.
+		auto &per_thread = get_per_thread_data();
+		if (robustness)
+		{
+			per_thread.failed_module_hashes[0] = hash;
+			per_thread.num_failed_module_hashes = 1;
+		}
+
+		run_parse_work_item(per_thread.per_thread_replayers[SHADER_MODULE_MEMORY_CONTEXT], payload, work_item);
+		per_thread.num_failed_module_hashes = 0;
+
+		if (shader_modules.find_and_pin_object(hash, module))
+		{
+			pinned_modules.push_back(hash);
+			return module;
 		}
+
+		LOGE("Could not find shader module %016" PRIx64 " in cache.\n", hash);
+		return VK_NULL_HANDLE;
 	}
 
-	void resolve_shader_modules(VkComputePipelineCreateInfo *info)
+	void resolve_shader_modules(const PipelineWorkItem &work_item, EntryPayload &payload, vector<Hash> &pinned_modules)
 	{
-		auto result = shader_modules.find_object((Hash) info->stage.module);
-		if (!result.second)
+		if (work_item.tag == RESOURCE_GRAPHICS_PIPELINE && work_item.create_info.graphics_create_info)
+		{
+			auto *info = work_item.create_info.graphics_create_info;
+			for (uint32_t i = 0; i < info->stageCount; i++)
+			{
+				auto &stage = const_cast<VkPipelineShaderStageCreateInfo *>(info->pStages)[i];
+				stage.module = acquire_shader_module((Hash) stage.module, payload, pinned_modules);
+			}
+		}
+		else if (work_item.tag == RESOURCE_COMPUTE_PIPELINE && work_item.create_info.compute_create_info)
 		{
-			LOGE("Could not find shader module %016" PRIx64 " in cache.\n", (Hash) info->stage.module);
+			auto *info = work_item.create_info.compute_create_info;
+			const_cast<VkComputePipelineCreateInfo *>(info)->stage.module =
+					acquire_shader_module((Hash) info->stage.module, payload, pinned_modules);
 		}
-		const_cast<VkComputePipelineCreateInfo*>(info)->stage.module = result.first;
 	}
 
 	template <typename DerivedInfo>
@@ -1338,12 +2864,41 @@ struct ThreadedReplayer : StateCreatorInterface
 		derived.erase(itr, end(derived));
 	}
 
+	// Picks how many pipelines go into the next chunk of a memory context.
+	// Every active worker should have a few pipelines to chew on between two syncs,
+	// but big create infos make for smaller chunks so memory does not spike.
+	unsigned get_pipeline_chunk_size(size_t bytes_per_pipeline, unsigned left_to_submit) const
+	{
+		unsigned active = max(1u, active_worker_count.load(std::memory_order_relaxed));
+		unsigned total = max(1u, num_worker_threads);
+		unsigned count = DEFAULT_PIPELINES_PER_CONTEXT;
+
+		if (bytes_per_pipeline)
+		{
+			// Workers are only throttled when memory is tight, so shrink the budget along with them.
+			size_t budget = PIPELINE_CONTEXT_BUDGET / total * active;
+			count = unsigned(min<size_t>(budget / bytes_per_pipeline, MAX_PIPELINES_PER_CONTEXT));
+		}
+
+		count = max(count, max(MIN_PIPELINES_PER_CONTEXT, active * MIN_PIPELINES_PER_WORKER));
+		return min(count, left_to_submit);
+	}
+
 	template <typename DerivedInfo>
 	void enqueue_deferred_pipelines(vector<DerivedInfo> *deferred, const unordered_map<Hash, VkPipeline> &pipelines,
 	                                unordered_map<Hash, DerivedInfo> &parents,
 	                                vector<EnqueuedWork> &work, const vector<Hash> &hashes, unsigned start_index)
 	{
-		static const unsigned NUM_PIPELINES_PER_CONTEXT = 1024;
+		// Filled in by the parse pass of a chunk, and read by the passes which follow it.
+		struct ChunkPlan
+		{
+			unsigned next_offset = 0;
+			size_t bytes_per_pipeline = 0;
+			unsigned offset[NUM_PIPELINE_MEMORY_CONTEXTS] = {};
+			unsigned count[NUM_PIPELINE_MEMORY_CONTEXTS] = {};
+			unsigned parsed[NUM_PIPELINE_MEMORY_CONTEXTS] = {};
+		};
+		auto plan = make_shared<ChunkPlan>();
 
 		// Make sure that if we sort by work_index, we get an interleaved execution pattern which
 		// will naturally pipeline.
@@ -1382,28 +2937,82 @@ struct ThreadedReplayer : StateCreatorInterface
 			       memory_index;
 		};
 
-		for (unsigned hash_offset = 0; hash_offset < hashes.size(); hash_offset += NUM_PIPELINES_PER_CONTEXT, iteration++)
-		{
-			unsigned left_to_submit = hashes.size() - hash_offset;
-			unsigned to_submit = left_to_submit < NUM_PIPELINES_PER_CONTEXT ? left_to_submit : NUM_PIPELINES_PER_CONTEXT;
+		// Chunks are planned when they are parsed, so queue up enough iterations for the smallest chunk size.
+		// Iterations past the end of the hashes find an empty chunk and do nothing.
+		unsigned num_iterations = unsigned((hashes.size() + MIN_PIPELINES_PER_CONTEXT - 1) / MIN_PIPELINES_PER_CONTEXT);
 
+		for (; iteration < num_iterations; iteration++)
+		{
 			// State which is used between pipeline stages.
 			auto derived = make_shared<vector<DerivedInfo>>();
 
 			// Submit pipelines to be parsed.
 			work.push_back({ get_order_index(PARSE_ENQUEUE_OFFSET),
-			                 [this, &hashes, &pipelines, deferred, memory_index, to_submit, hash_offset]() {
+			                 [this, &hashes, &pipelines, deferred, plan, memory_index]() {
+				                 plan->offset[memory_index] = plan->next_offset;
+				                 plan->count[memory_index] = 0;
+				                 if (plan->next_offset >= hashes.size())
+					                 return;
+
 				                 // Drain old allocators.
 				                 sync_worker_memory_context(memory_index);
+				                 auto start_time = chrono::steady_clock::now();
+
+				                 // What the previous chunk of this context allocated decides the size of the next one.
+				                 size_t bytes_in_use = 0;
+				                 for (auto &data : per_thread_data)
+				                 {
+					                 if (data.per_thread_replayers)
+					                 {
+						                 ScratchAllocator::Statistics stats = {};
+						                 data.per_thread_replayers[memory_index].get_allocator().get_statistics(&stats);
+						                 bytes_in_use += stats.bytes_in_use;
+					                 }
+				                 }
+
+				                 if (plan->parsed[memory_index])
+				                 {
+					                 size_t bytes_per_pipeline = max<size_t>(1, bytes_in_use / plan->parsed[memory_index]);
+					                 // Mix in the other context, so a single odd chunk doesn't swing the size around.
+					                 if (plan->bytes_per_pipeline)
+						                 bytes_per_pipeline = (bytes_per_pipeline + plan->bytes_per_pipeline) / 2;
+					                 plan->bytes_per_pipeline = bytes_per_pipeline;
+				                 }
+
 				                 // Reset per memory-context allocators.
 				                 for (auto &data : per_thread_data)
 					                 if (data.per_thread_replayers)
 						                 data.per_thread_replayers[memory_index].get_allocator().reset();
 
+				                 unsigned hash_offset = plan->next_offset;
+				                 unsigned to_submit = get_pipeline_chunk_size(plan->bytes_per_pipeline,
+				                                                              unsigned(hashes.size()) - hash_offset);
+				                 plan->count[memory_index] = to_submit;
+				                 plan->parsed[memory_index] = 0;
+				                 plan->next_offset += to_submit;
+
+				                 static const char *trace_names[NUM_PIPELINE_MEMORY_CONTEXTS] = {
+					                 "plan pipelines 0", "plan pipelines 1",
+				                 };
+				                 record_trace_event("sync", trace_names[memory_index], 0, start_time, to_submit, bytes_in_use);
+
+				                 // Let the database read ahead while this chunk is being parsed and compiled.
+				                 // The first chunk has nothing ahead of it, so hint that one too.
+				                 // The next chunk is not planned yet, assume it will be about as large as this one.
+				                 unsigned prefetch_begin = hash_offset == 0 ? 0 : hash_offset + to_submit;
+				                 unsigned prefetch_end = hash_offset + 2 * to_submit;
+				                 if (prefetch_end > hashes.size())
+					                 prefetch_end = unsigned(hashes.size());
+				                 if (prefetch_begin < prefetch_end)
+				                 {
+					                 global_database->prefetch_entries(DerivedInfo::get_tag(), hashes.data() + prefetch_begin,
+					                                                   prefetch_end - prefetch_begin);
+				                 }
+
 				                 deferred[memory_index].resize(to_submit);
 				                 for (unsigned index = hash_offset; index < hash_offset + to_submit; index++)
 				                 {
-					                 if (pipelines.count(hashes[index]) == 0)
+					                 if (pipelines.count(hashes[index]) == 0 && !is_journaled(DerivedInfo::get_tag(), hashes[index]))
 					                 {
 						                 ThreadedReplayer::PipelineWorkItem work_item;
 						                 work_item.hash = hashes[index];
@@ -1422,24 +3031,47 @@ struct ThreadedReplayer : StateCreatorInterface
 						                 }
 
 						                 enqueue_work_item(work_item);
+						                 plan->parsed[memory_index]++;
 					                 }
 					                 else
 					                 {
-						                 // This pipeline has already been processed before in order to resolve parent pipelines.
+						                 // This pipeline has already been processed before in order to resolve parent pipelines,
+						                 // or an earlier run has compiled it already.
 						                 // Don't do anything with it this iteration since it has already been compiled.
+						                 // Skipping pipelines keeps the indices intact, so the robust replayer is not affected.
+						                 // A journaled pipeline which is the parent of a pipeline we do replay is still
+						                 // picked up as an out of range parent.
+						                 if (!pipelines.count(hashes[index]) && opts.control_block)
+						                 {
+							                 auto tag = DerivedInfo::get_tag();
+							                 if (tag == RESOURCE_GRAPHICS_PIPELINE)
+							                 {
+								                 opts.control_block->total_graphics.fetch_add(1, std::memory_order_relaxed);
+								                 opts.control_block->skipped_graphics.fetch_add(1, std::memory_order_relaxed);
+							                 }
+							                 else if (tag == RESOURCE_COMPUTE_PIPELINE)
+							                 {
+								                 opts.control_block->total_compute.fetch_add(1, std::memory_order_relaxed);
+								                 opts.control_block->skipped_compute.fetch_add(1, std::memory_order_relaxed);
+							                 }
+						                 }
 						                 deferred[memory_index][index - hash_offset] = {};
 					                 }
 				                 }
+				                 flush_work_items();
 			                 }});
 
 			if (memory_index == 0)
 			{
 				work.push_back({ get_order_index(MAINTAIN_SHADER_MODULE_LRU_CACHE),
-				                 [this]() {
-					                 // Now all worker threads are drained for any work which needs shader modules,
-					                 // so we can maintain the shader module LRU cache while we're parsing new pipelines in parallel.
+				                 [this, plan]() {
+					                 if (!plan->count[0])
+						                 return;
+
+					                 // Workers pin the modules of the pipelines they are creating,
+					                 // so we can maintain the shader module LRU cache while pipelines are still being compiled.
+					                 // Modules which were created by workers on demand were never enqueued.
 					                 shader_modules.prune_cache([this](Hash hash, VkShaderModule module) {
-						                 assert(enqueued_shader_modules.count((VkShaderModule) hash) != 0);
 						                 //LOGI("Removing shader module %016llx.\n", static_cast<unsigned long long>(hash));
 						                 enqueued_shader_modules.erase((VkShaderModule) hash);
 						                 if (module != VK_NULL_HANDLE)
@@ -1447,16 +3079,14 @@ struct ThreadedReplayer : StateCreatorInterface
 
 						                 shader_module_evicted_count.fetch_add(1, std::memory_order_relaxed);
 					                 });
-
-					                 // Need to forget that we have seen an object before so we can replay the same object multiple times.
-					                 for (auto &per_thread : per_thread_data)
-						                 if (per_thread.per_thread_replayers)
-							                 per_thread.per_thread_replayers[SHADER_MODULE_MEMORY_CONTEXT].forget_handle_references();
 				                 }});
 			}
 
 			work.push_back({ get_order_index(ENQUEUE_SHADER_MODULES_PRIMARY_OFFSET),
-			                 [this, derived, deferred, memory_index]() {
+			                 [this, derived, deferred, plan, memory_index]() {
+				                 if (!plan->count[memory_index])
+					                 return;
+
 				                 // Make sure all parsing of pipelines is complete for this memory context.
 				                 sync_worker_memory_context(memory_index);
 
@@ -1464,6 +3094,7 @@ struct ThreadedReplayer : StateCreatorInterface
 				                 for (auto &item : deferred[memory_index])
 					                 if (item.info)
 						                 enqueue_shader_modules(item.info);
+				                 flush_work_items();
 
 				                 // There are two primary kinds of pipelines, derived and non-derived. We split compilation in two here.
 				                 // Non-derived pipelines have no dependencies on other pipelines, so we can go ahead,
@@ -1473,26 +3104,40 @@ struct ThreadedReplayer : StateCreatorInterface
 			                 }});
 
 			work.push_back({ get_order_index(RESOLVE_SHADER_MODULE_AND_ENQUEUE_PIPELINES_PRIMARY_OFFSET),
-			                 [this, derived, deferred, memory_index, hash_offset, start_index]() {
-				                 // Make sure all VkShaderModules have been queued and completed.
-				                 // We reserve a special memory context for all shader modules since other memory indices
-				                 // might queue up shader module work which we need in our memory index.
-				                 // Remap VkShaderModule references from hashes to real handles and enqueue all non-derived pipelines for work.
-				                 sync_worker_memory_context(SHADER_MODULE_MEMORY_CONTEXT);
-
+			                 [this, derived, deferred, plan, memory_index, start_index]() {
+				                 // Enqueue all non-derived pipelines for work. The workers remap VkShaderModule references
+				                 // from hashes to real handles when they get to the pipeline, and create any module which is not done yet,
+				                 // so there is no need to wait for the shader module memory context here.
+				                 if (!plan->count[memory_index] || deadline_reached())
+					                 return;
+
+				                 unsigned hash_offset = plan->offset[memory_index];
 				                 for (auto &item : deferred[memory_index])
 				                 {
 					                 if (item.info)
 					                 {
-						                 resolve_shader_modules(item.info);
 						                 enqueue_pipeline(item.hash, item.info, item.pipeline,
 						                                  item.index + hash_offset + start_index, memory_index);
 					                 }
 				                 }
+				                 flush_work_items();
 			                 }});
 
 			work.push_back({ get_order_index(ENQUEUE_OUT_OF_RANGE_PARENT_PIPELINES),
-			                 [this, &pipelines, derived, outside_range_hashes]() {
+			                 [this, &pipelines, derived, outside_range_hashes, plan, memory_index]() {
+				                 if (!plan->count[memory_index])
+					                 return;
+
+				                 // The parent pipelines of the previous iteration have usually been created by now.
+				                 // Their create infos must not be reclaimed before that.
+				                 if (memory_index == 0)
+				                 {
+					                 sync_worker_memory_context(PARENT_PIPELINE_MEMORY_CONTEXT);
+					                 for (auto &per_thread : per_thread_data)
+						                 if (per_thread.per_thread_replayers)
+							                 per_thread.per_thread_replayers[PARENT_PIPELINE_MEMORY_CONTEXT].get_allocator().reset();
+				                 }
+
 				                 // Figure out which of the parent pipelines we need.
 				                 for (auto &d : *derived)
 				                 {
@@ -1522,14 +3167,20 @@ struct ThreadedReplayer : StateCreatorInterface
 						                 }
 					                 }
 				                 }
+				                 flush_work_items();
 			                 }});
 
 			if (memory_index == 0)
 			{
-				// This is a join-like operation. We need to wait for all parent pipelines and all shader modules to have completed.
+				// This is a join-like operation. We need to wait for all parent pipelines to have been parsed.
 				work.push_back({get_order_index(ENQUEUE_SHADER_MODULE_SECONDARY_OFFSET),
-				                [this, &parents, hash_offset, start_index]()
+				                [this, &parents, plan, start_index]()
 				                {
+					                if (!plan->count[0])
+						                return;
+
+					                unsigned hash_offset = plan->offset[0];
+
 					                // Wait until all parent pipelines have been parsed.
 					                sync_worker_memory_context(PARENT_PIPELINE_MEMORY_CONTEXT);
 
@@ -1552,14 +3203,16 @@ struct ThreadedReplayer : StateCreatorInterface
 							                                                            std::memory_order_relaxed);
 					                }
 
-					                sync_worker_memory_context(SHADER_MODULE_MEMORY_CONTEXT);
-					                // The shader module memory context recycles itself.
+					                if (deadline_reached())
+					                {
+						                parents.clear();
+						                return;
+					                }
 
 					                for (auto &parent : parents)
 					                {
 						                if (parent.second.info)
 						                {
-							                resolve_shader_modules(parent.second.info);
 							                assert((parent.second.info->flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) ==
 							                       0);
 							                enqueue_pipeline(parent.second.hash, parent.second.info,
@@ -1570,16 +3223,18 @@ struct ThreadedReplayer : StateCreatorInterface
 					                }
 
 					                parents.clear();
+					                flush_work_items();
 
-					                // We might be pulling in a parent pipeline from another memory context next iteration,
-					                // so we need to wait for all normal memory contexts.
-					                for (unsigned i = 0; i < NUM_PIPELINE_MEMORY_CONTEXTS; i++)
-						                sync_worker_memory_context(i);
+					                // Keep the main cache reasonably up to date in case we crash later.
+					                merge_pipeline_caches();
 				                }});
 			}
 
 			work.push_back({ get_order_index(ENQUEUE_DERIVED_PIPELINES_OFFSET),
-			                 [this, &pipelines, derived, memory_index, hash_offset, start_index]() {
+			                 [this, &pipelines, derived, plan, memory_index, start_index]() {
+				                 if (!plan->count[memory_index])
+					                 return;
+
 				                 // Go over all pipelines. If there are no further dependencies to resolve, we can go ahead and queue them up.
 				                 // If an entry exists in pipelines, we have queued up that hash earlier, but it might not be done compiling yet.
 				                 auto itr = unstable_remove_if(begin(*derived), end(*derived), [&](const DerivedInfo &info) -> bool {
@@ -1592,31 +3247,21 @@ struct ThreadedReplayer : StateCreatorInterface
 						                 return false;
 				                 });
 
-				                 // Wait for parent pipelines to complete.
-				                 // Only needed for first memory index.
-				                 if (memory_index == 0)
-				                 {
-					                 sync_worker_memory_context(PARENT_PIPELINE_MEMORY_CONTEXT);
-
-					                 // Now we have replayed the pipelines, so we can reclaim parent pipeline memory for this iteration.
-					                 for (auto &per_thread : per_thread_data)
-						                 if (per_thread.per_thread_replayers)
-							                 per_thread.per_thread_replayers[PARENT_PIPELINE_MEMORY_CONTEXT].get_allocator().reset();
-				                 }
+				                 if (deadline_reached())
+					                 return;
 
-				                 // Now we can enqueue pipeline compilation with correct pipeline handles.
+				                 // Every parent has been enqueued by now, but not necessarily created.
+				                 // A derived pipeline waits for its own parent only, and is enqueued once the parent is done.
+				                 unsigned hash_offset = plan->offset[memory_index];
 				                 for (auto i = itr; i != end(*derived); ++i)
 				                 {
 					                 if (i->info)
 					                 {
-						                 resolve_shader_modules(i->info);
-						                 auto base_itr = pipelines.find((Hash) i->info->basePipelineHandle);
-						                 i->info->basePipelineHandle =
-								                 base_itr != end(pipelines) ? base_itr->second : VK_NULL_HANDLE;
 						                 enqueue_pipeline(i->hash, i->info, i->pipeline,
 						                                  i->index + hash_offset + start_index, memory_index);
 					                 }
 				                 }
+				                 flush_work_items();
 
 				                 // It might be possible that we couldn't resolve some dependencies, log this.
 				                 if (itr != begin(*derived))
@@ -1660,17 +3305,22 @@ struct ThreadedReplayer : StateCreatorInterface
 #ifdef SIMULATE_UNSTABLE_DRIVER
 		spurious_deadlock();
 #endif
+		// Recording allocates, which isn't something to do from a signal handler. The process is about to die anyway.
+		trace.release();
 		flush_pipeline_cache();
-		device.reset();
+		owned_device.reset();
+		device = nullptr;
 	}
 
 	Options opts;
 
+	// Guards the static object maps below while they are created.
+	std::mutex static_object_lock;
 	std::unordered_map<Hash, VkSampler> samplers;
 	std::unordered_map<Hash, VkDescriptorSetLayout> layouts;
 	std::unordered_map<Hash, VkPipelineLayout> pipeline_layouts;
 
-	ObjectCache<VkShaderModule> shader_modules;
+	ConcurrentObjectCache<VkShaderModule> shader_modules;
 
 	std::unordered_map<Hash, VkRenderPass> render_passes;
 	std::unordered_map<Hash, VkPipeline> compute_pipelines;
@@ -1680,63 +3330,262 @@ struct ThreadedReplayer : StateCreatorInterface
 	std::unordered_set<VkShaderModule> enqueued_shader_modules;
 	VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
 
+	PipelineStats pipeline_stats;
+	std::mutex pipeline_stats_lock;
+	unique_ptr<ReplayJournal> journal;
+	unique_ptr<ReplayTrace> trace;
+
+	chrono::steady_clock::time_point deadline;
+	bool has_deadline = false;
+	std::atomic<bool> deadline_hit;
+
 	// VALVE: multi-threaded work queue for replayer
+	// Every worker owns a queue. It pops from the front of its own queue and steals from the back of
+	// the others when it runs dry, so workers only contend when the load is actually unbalanced.
+	// Only the main thread enqueues new work. Items are staged and handed out in batches of contiguous
+	// chunks by flush_work_items(), which keeps neighbouring pipelines on the same worker.
+	// Workers only enqueue the derived pipelines which were waiting for a parent they created.
 
 	void enqueue_work_item(const PipelineWorkItem &item)
 	{
-		lock_guard<mutex> lock(pipeline_work_queue_mutex);
-		pipeline_work_queue.push(item);
-		work_available_condition.notify_one();
-		queued_count[item.memory_context_index]++;
+		// Count before the item is visible to workers so completed_count can never run ahead.
+		queued_count[item.memory_context_index].fetch_add(1, std::memory_order_relaxed);
+		staged_work_items.push_back(item);
 	}
 
-	unsigned num_worker_threads = 0;
-	unsigned loop_count = 0;
+	void flush_work_items()
+	{
+		size_t count = staged_work_items.size();
+		if (!count)
+			return;
+
+		unsigned num_queues = num_worker_threads ? num_worker_threads : 1;
+		size_t chunk_size = (count + num_queues - 1) / num_queues;
+		size_t offset = 0;
+		while (offset < count)
+		{
+			size_t to_push = std::min(chunk_size, count - offset);
+			auto &queue = worker_queues[next_worker_queue];
+			{
+				lock_guard<mutex> lock(queue.lock);
+				queue.items.insert(queue.items.end(),
+				                   staged_work_items.begin() + offset,
+				                   staged_work_items.begin() + offset + to_push);
+			}
+			offset += to_push;
+			next_worker_queue = (next_worker_queue + 1) % num_queues;
+		}
+		staged_work_items.clear();
 
-	unsigned queued_count[NUM_MEMORY_CONTEXTS] = {};
-	unsigned completed_count[NUM_MEMORY_CONTEXTS] = {};
-	unsigned thread_initialized_count = 0;
-	std::condition_variable work_available_condition;
-	std::condition_variable work_done_condition[NUM_MEMORY_CONTEXTS];
+		pending_work_count.fetch_add(count, std::memory_order_release);
+		lock_guard<mutex> lock(pipeline_work_queue_mutex);
+		if (count >= num_queues)
+			work_available_condition.notify_all();
+		else
+			for (size_t i = 0; i < count; i++)
+				work_available_condition.notify_one();
+	}
 
-	std::vector<std::thread> thread_pool;
-	std::vector<PerThreadData> per_thread_data;
-	std::mutex pipeline_work_queue_mutex;
-	std::mutex internal_enqueue_mutex;
-	std::queue<PipelineWorkItem> pipeline_work_queue;
+	// The items were counted in queued_count when they were deferred.
+	void push_work_items_from_worker(unsigned queue_index, const vector<PipelineWorkItem> &items)
+	{
+		if (items.empty())
+			return;
 
-	std::mutex hash_lock;
-	std::unordered_map<Hash, DeferredGraphicsInfo> graphics_parents;
-	std::unordered_map<Hash, DeferredComputeInfo> compute_parents;
-	std::vector<DeferredGraphicsInfo> deferred_graphics[NUM_MEMORY_CONTEXTS];
-	std::vector<DeferredComputeInfo> deferred_compute[NUM_MEMORY_CONTEXTS];
+		{
+			auto &queue = worker_queues[queue_index];
+			lock_guard<mutex> lock(queue.lock);
+			queue.items.insert(queue.items.end(), items.begin(), items.end());
+		}
 
-	// Feed statistics from the worker threads.
-	std::atomic<std::uint64_t> graphics_pipeline_ns;
-	std::atomic<std::uint64_t> compute_pipeline_ns;
-	std::atomic<std::uint64_t> shader_module_ns;
-	std::atomic<std::uint64_t> total_idle_ns;
-	std::atomic<std::uint64_t> thread_total_ns;
-	std::atomic<std::uint32_t> graphics_pipeline_count;
-	std::atomic<std::uint32_t> compute_pipeline_count;
-	std::atomic<std::uint32_t> shader_module_count;
-	std::atomic<std::uint32_t> shader_module_evicted_count;
-	std::atomic<std::uint32_t> pipeline_cache_hits;
-	std::atomic<std::uint32_t> pipeline_cache_misses;
+		pending_work_count.fetch_add(items.size(), std::memory_order_release);
+		lock_guard<mutex> lock(pipeline_work_queue_mutex);
+		work_available_condition.notify_all();
+	}
 
-	std::atomic<std::uint64_t> shader_module_total_size;
-	std::atomic<std::uint64_t> shader_module_total_compressed_size;
+	bool try_dequeue_work_item(unsigned queue_index, PipelineWorkItem &item)
+	{
+		unsigned num_queues = num_worker_threads ? num_worker_threads : 1;
 
-	std::atomic<size_t> total_peak_memory;
+		{
+			auto &queue = worker_queues[queue_index];
+			lock_guard<mutex> lock(queue.lock);
+			if (!queue.items.empty())
+			{
+				item = queue.items.front();
+				queue.items.pop_front();
+				return true;
+			}
+		}
 
-	bool shutting_down = false;
+		for (unsigned i = 1; i < num_queues; i++)
+		{
+			auto &queue = worker_queues[(queue_index + i) % num_queues];
+			lock_guard<mutex> lock(queue.lock);
+			if (!queue.items.empty())
+			{
+				item = queue.items.back();
+				queue.items.pop_back();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Only takes work from the front of our own queue, and only creation work of the given kind.
+	bool try_dequeue_batched_work_item(unsigned queue_index, ResourceTag tag, PipelineWorkItem &item)
+	{
+		// Claim first, so that a worker which has claimed an item is guaranteed to find one.
+		size_t pending = pending_work_count.load(std::memory_order_acquire);
+		do
+		{
+			if (pending == 0)
+				return false;
+		} while (!pending_work_count.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel));
+
+		{
+			auto &queue = worker_queues[queue_index];
+			lock_guard<mutex> lock(queue.lock);
+			if (!queue.items.empty() && !queue.items.front().parse_only && queue.items.front().tag == tag)
+			{
+				item = queue.items.front();
+				queue.items.pop_front();
+				return true;
+			}
+		}
+
+		// Hand the claim back. Wake up a worker in case one went to sleep while we were holding it.
+		pending_work_count.fetch_add(1, std::memory_order_release);
+		lock_guard<mutex> lock(pipeline_work_queue_mutex);
+		work_available_condition.notify_one();
+		return false;
+	}
+
+	bool dequeue_work_item(unsigned queue_index, PipelineWorkItem &item)
+	{
+		for (;;)
+		{
+			// Throttled workers sit idle, the active ones steal whatever is left in our queue.
+			if (queue_index >= active_worker_count.load(std::memory_order_relaxed))
+			{
+				unique_lock<mutex> lock(pipeline_work_queue_mutex);
+				work_available_condition.wait(lock, [&]() -> bool {
+					return shutting_down || queue_index < active_worker_count.load(std::memory_order_relaxed);
+				});
+
+				if (shutting_down)
+					return false;
+			}
+
+			// A positive count means some queue holds an item we can claim.
+			size_t pending = pending_work_count.load(std::memory_order_acquire);
+			while (pending != 0)
+			{
+				if (pending_work_count.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel))
+				{
+					while (!try_dequeue_work_item(queue_index, item))
+						std::this_thread::yield();
+					return true;
+				}
+			}
+
+			unique_lock<mutex> lock(pipeline_work_queue_mutex);
+			work_available_condition.wait(lock, [&]() -> bool {
+				return shutting_down || pending_work_count.load(std::memory_order_acquire) != 0;
+			});
+
+			if (shutting_down)
+				return false;
+		}
+	}
+
+	unsigned num_worker_threads = 0;
+	unsigned loop_count = 0;
+
+	std::atomic<unsigned> queued_count[NUM_MEMORY_CONTEXTS];
+	std::atomic<unsigned> completed_count[NUM_MEMORY_CONTEXTS];
+	unsigned thread_initialized_count = 0;
+	// Bumped whenever the main thread created static objects, so workers inherit the references again.
+	std::atomic<unsigned> static_object_generation;
+	std::condition_variable work_available_condition;
+	std::condition_variable work_done_condition[NUM_MEMORY_CONTEXTS];
+
+	std::vector<std::thread> thread_pool;
+	std::vector<PerThreadData> per_thread_data;
+	std::mutex pipeline_work_queue_mutex;
+	std::mutex internal_enqueue_mutex;
 
-	unique_ptr<VulkanDevice> device;
+	struct WorkerQueue
+	{
+		std::mutex lock;
+		std::deque<PipelineWorkItem> items;
+	};
+	std::unique_ptr<WorkerQueue[]> worker_queues;
+	std::vector<PipelineWorkItem> staged_work_items;
+	std::atomic<size_t> pending_work_count;
+	unsigned next_worker_queue = 0;
+
+	// Every pipeline which may be a parent gets an entry when it is enqueued.
+	// Derived pipelines wait in their parent's entry until the parent has been created,
+	// and the worker which created the parent hands them out. Graphics first, then compute.
+	struct ParentPipelineState
+	{
+		bool complete = false;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		std::vector<PipelineWorkItem> waiting;
+	};
+	std::mutex parent_pipeline_lock;
+	std::unordered_map<Hash, ParentPipelineState> parent_pipeline_states[2];
+
+	std::vector<unsigned> worker_cpus;
+	std::atomic<unsigned> active_worker_count;
+	std::thread memory_monitor;
+	std::condition_variable memory_monitor_condition;
+	std::thread pipeline_cache_checkpoint;
+	std::condition_variable pipeline_cache_checkpoint_condition;
+	// Guards the main pipeline cache against merges while it is read back.
+	std::mutex pipeline_cache_lock;
+
+	std::mutex hash_lock;
+	std::unordered_map<Hash, DeferredGraphicsInfo> graphics_parents;
+	std::unordered_map<Hash, DeferredComputeInfo> compute_parents;
+	std::vector<DeferredGraphicsInfo> deferred_graphics[NUM_MEMORY_CONTEXTS];
+	std::vector<DeferredComputeInfo> deferred_compute[NUM_MEMORY_CONTEXTS];
+
+	// Feed statistics from the worker threads.
+	std::atomic<std::uint64_t> graphics_pipeline_ns;
+	std::atomic<std::uint64_t> compute_pipeline_ns;
+	std::atomic<std::uint64_t> shader_module_ns;
+	std::atomic<std::uint64_t> total_idle_ns;
+	std::atomic<std::uint64_t> thread_total_ns;
+	std::atomic<std::uint32_t> graphics_pipeline_count;
+	std::atomic<std::uint32_t> compute_pipeline_count;
+	std::atomic<std::uint32_t> shader_module_count;
+	std::atomic<std::uint32_t> shader_module_evicted_count;
+	std::atomic<std::uint32_t> pipeline_cache_hits;
+	std::atomic<std::uint32_t> pipeline_cache_misses;
+	std::atomic<std::uint32_t> cache_probe_hits;
+	std::atomic<std::uint32_t> cache_probe_misses;
+
+	std::atomic<std::uint64_t> shader_module_total_size;
+	std::atomic<std::uint64_t> shader_module_total_compressed_size;
+
+	std::atomic<size_t> total_peak_memory;
+	std::atomic<size_t> total_peak_memory_in_use;
+	std::atomic<size_t> total_allocator_blocks;
+	std::atomic<size_t> total_allocator_system_allocations;
+
+	bool shutting_down = false;
+
+	VulkanDevice *device = nullptr;
+	unique_ptr<VulkanDevice> owned_device;
 	bool device_was_init = false;
 	VulkanDevice::Options device_opts;
 
 	// Crash recovery.
 	bool robustness = false;
+	bool cache_probe_enabled = false;
 
 	const StateReplayer *global_replayer = nullptr;
 	DatabaseInterface *global_database = nullptr;
@@ -1775,18 +3624,55 @@ static void print_help()
 	LOGI("fossilize-replay\n"
 	     "\t[--help]\n"
 	     "\t[--device-index <index>]\n"
+	     "\t[--device-indices <list>]\n"
 	     "\t[--enable-validation]\n"
 	     "\t[--pipeline-cache]\n"
+	     "\t[--pipeline-cache-per-thread]\n"
 	     "\t[--spirv-val]\n"
 	     "\t[--num-threads <count>]\n"
+	     "\t[--memory-headroom <MiB>]\n"
+	     "\t[--min-threads <count>]\n"
+	     "\t[--worker-cpus <list>]\n"
+	     "\t[--core-type <any/performance/efficiency>]\n"
+	     "\t[--background-priority]\n"
+	     "\t[--resource-group <cgroup directory/job object name>]\n"
 	     "\t[--loop <count>]\n"
 	     "\t[--on-disk-pipeline-cache <path>]\n"
+	     "\t[--pipeline-cache-checkpoint-seconds <seconds>]\n"
+	     "\t[--pipeline-cache-checkpoint-pipelines <count>]\n"
 	     "\t[--graphics-pipeline-range <start> <end>]\n"
 	     "\t[--compute-pipeline-range <start> <end>]\n"
+	     "\t[--shard <index>/<count>]\n"
+	     "\t[--merge-pipeline-cache <path>]\n"
+	     "\t[--merge-journal <path>]\n"
 	     "\t[--shader-cache-size <value (MiB)>]\n"
 	     "\t[--ignore-derived-pipelines]\n"
 	     "\t[--log-memory]\n"
 	     "\t[--null-device]\n"
+	     "\t[--huge-pages]\n"
+	     "\t[--shader-locality-order]\n"
+	     "\t[--shader-cache-policy <lru/2q>]\n"
+	     "\t[--pipeline-stats <path>]\n"
+	     "\t[--pipeline-stats-output <path>]\n"
+	     "\t[--cost-order]\n"
+	     "\t[--streaming]\n"
+	     "\t[--cache-probe]\n"
+	     "\t[--cache-probe-only]\n"
+	     "\t[--pipeline-batch-size <count>]\n"
+	     "\t[--journal <path>]\n"
+	     "\t[--full]\n"
+	     "\t[--time-budget <seconds>]\n"
+	     "\t[--trace <path>]\n"
+	     "\t[--priority <database/cost/frequency>]\n"
+	     "\t[--replay-image-dir <path>]\n"
+	     "\t[--module-store <path>]\n"
+	     "\t[--daemon <socket path>]\n"
+	     "\t[--daemon-slice-size <count>]\n"
+	     "\t[--daemon-max-devices <count>]\n"
+	     "\t[--submit <socket path> [--job-priority <1-100>] [--wait]]\n"
+	     "\t[--daemon-status <socket path>]\n"
+	     "\t[--daemon-cancel <socket path> <job id>]\n"
+	     "\t[--daemon-shutdown <socket path>]\n"
 	     EXTRA_OPTIONS
 	     "\t<Database>\n");
 }
@@ -1804,6 +3690,7 @@ static void log_progress(const ExternalReplayer::Progress &progress)
 	LOGI("   Compile compute %u / %u, skipped %u\n", progress.compute.completed, progress.compute.total, progress.compute.skipped);
 	LOGI("   Clean crashes %u\n", progress.clean_crashes);
 	LOGI("   Dirty crashes %u\n", progress.dirty_crashes);
+	LOGI("   Active workers %u\n", progress.active_workers);
 	LOGI("=================\n");
 }
 
@@ -1870,7 +3757,16 @@ static int run_progress_process(const VulkanDevice::Options &device_opts,
 	opts.on_disk_pipeline_cache = replayer_opts.on_disk_pipeline_cache_path.empty() ?
 		nullptr : replayer_opts.on_disk_pipeline_cache_path.c_str();
 	opts.pipeline_cache = replayer_opts.pipeline_cache;
+	opts.pipeline_cache_per_thread = replayer_opts.pipeline_cache_per_thread;
 	opts.num_threads = replayer_opts.num_threads;
+	opts.memory_headroom_mb = replayer_opts.memory_headroom_mb;
+	opts.min_threads = replayer_opts.min_threads;
+	opts.worker_cpus = replayer_opts.worker_cpu_list.empty() ? nullptr : replayer_opts.worker_cpu_list.c_str();
+	opts.device_indices = replayer_opts.device_index_list.empty() ? nullptr : replayer_opts.device_index_list.c_str();
+	opts.core_type = replayer_opts.worker_core_type != CoreType::Any ?
+	                 get_core_type_name(replayer_opts.worker_core_type) : nullptr;
+	opts.background_priority = replayer_opts.background_priority;
+	opts.trace_path = replayer_opts.trace_path.empty() ? nullptr : replayer_opts.trace_path.c_str();
 	opts.quiet = true;
 	opts.databases = databases.data();
 	opts.num_databases = databases.size();
@@ -1881,6 +3777,22 @@ static int run_progress_process(const VulkanDevice::Options &device_opts,
 	opts.enable_validation = device_opts.enable_validation;
 	opts.ignore_derived_pipelines = replayer_opts.ignore_derived_pipelines;
 	opts.null_device = device_opts.null_device;
+	opts.shader_locality_order = replayer_opts.shader_locality_order;
+	opts.pipeline_stats_path = replayer_opts.pipeline_stats_path.empty() ?
+		nullptr : replayer_opts.pipeline_stats_path.c_str();
+	opts.cost_order = replayer_opts.cost_order;
+	opts.cache_probe = replayer_opts.cache_probe;
+	opts.cache_probe_only = replayer_opts.cache_probe_only;
+	opts.pipeline_batch_size = replayer_opts.pipeline_batch_size;
+	opts.journal_path = replayer_opts.journal_path.empty() ? nullptr : replayer_opts.journal_path.c_str();
+	opts.full_replay = replayer_opts.full_replay;
+	opts.frequency_order = replayer_opts.frequency_order;
+	opts.shader_cache_two_queue = replayer_opts.shader_cache_two_queue;
+	opts.time_budget_seconds = replayer_opts.time_budget_seconds;
+	opts.module_store_path = replayer_opts.module_store_path.empty() ? nullptr : replayer_opts.module_store_path.c_str();
+	opts.streaming = replayer_opts.streaming_start;
+	opts.shard_index = replayer_opts.shard_index;
+	opts.shard_count = replayer_opts.shard_count;
 
 	ExternalReplayer replayer;
 	if (!replayer.start(opts))
@@ -1948,16 +3860,426 @@ static int run_progress_process(const VulkanDevice::Options &device_opts,
 static void log_process_memory();
 #endif
 
-static int run_normal_process(ThreadedReplayer &replayer, const vector<const char *> &databases)
+// A pipeline which shows up in several archives, e.g. the .N.foz fragments recorded in different sessions,
+// is likely to be needed every time the application runs. Otherwise the database order is kept,
+// which is the order the pipelines were first used in.
+// Usage metadata counts sessions directly, so it works on merged archives as well, and is preferred when present.
+static bool sort_pipelines_by_frequency(DatabaseInterface &resolver, const vector<const char *> &databases,
+                                        ResourceTag tag, vector<Hash> &hashes)
+{
+	bool has_metadata = false;
+	if (!sort_pipelines_by_usage(resolver, tag, hashes, &has_metadata))
+	{
+		LOGE("Failed to read usage metadata.\n");
+		return false;
+	}
+
+	if (has_metadata || databases.size() < 2)
+		return true;
+
+	unordered_map<Hash, unsigned> frequency;
+	vector<Hash> database_hashes;
+	for (auto *path : databases)
+	{
+		unique_ptr<DatabaseInterface> db(create_database(path, DatabaseMode::ReadOnlyMemoryMap));
+		size_t count = 0;
+		if (!db || !db->prepare() || !db->get_hash_list_for_resource_tag(tag, &count, nullptr))
+		{
+			LOGE("Failed to get list of resource hashes from %s.\n", path);
+			return false;
+		}
+
+		database_hashes.resize(count);
+		if (!db->get_hash_list_for_resource_tag(tag, &count, database_hashes.data()))
+		{
+			LOGE("Failed to get list of resource hashes from %s.\n", path);
+			return false;
+		}
+
+		for (auto hash : database_hashes)
+			frequency[hash]++;
+	}
+
+	stable_sort(begin(hashes), end(hashes), [&](Hash a, Hash b) -> bool {
+		return frequency[a] > frequency[b];
+	});
+	return true;
+}
+
+static const ResourceTag initial_playback_order[] = {
+	RESOURCE_APPLICATION_INFO, // This will create the device, etc.
+	RESOURCE_SAMPLER,
+	RESOURCE_DESCRIPTOR_SET_LAYOUT, // Immutable samplers.
+	RESOURCE_PIPELINE_LAYOUT, // Set layouts.
+	RESOURCE_RENDER_PASS,
+};
+
+// What a replayer process can inherit from the process it is forked from, instead of setting it up again.
+// The Vulkan device cannot survive a fork(), so the static objects are only decoded here, not created.
+struct PreparedReplayState
+{
+	struct StaticObject
+	{
+		Hash hash;
+		size_t compressed_size;
+		vector<uint8_t> payload;
+	};
+
+	unique_ptr<DatabaseInterface> database;
+	vector<StaticObject> static_objects[RESOURCE_COUNT];
+};
+
+// In streaming mode, only the application info is decoded, the replay picks the other static objects itself.
+static bool prepare_replay_state(const vector<const char *> &databases, const string &module_store_path,
+                                 bool streaming, PreparedReplayState &state)
+{
+	state.database = create_database(databases, module_store_path);
+	if (!state.database->prepare())
+		return false;
+
+	for (auto &tag : initial_playback_order)
+	{
+		if (streaming && tag != RESOURCE_APPLICATION_INFO)
+			continue;
+
+		size_t count = 0;
+		if (!state.database->get_hash_list_for_resource_tag(tag, &count, nullptr))
+			return false;
+		vector<Hash> hashes(count);
+		if (!state.database->get_hash_list_for_resource_tag(tag, &count, hashes.data()))
+			return false;
+
+		auto &objects = state.static_objects[tag];
+		objects.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			auto &object = objects[i];
+			object.hash = hashes[i];
+
+			size_t size = 0;
+			if (!state.database->read_entry(tag, object.hash, &object.compressed_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+				return false;
+			if (!state.database->read_entry(tag, object.hash, &size, nullptr, 0))
+				return false;
+			object.payload.resize(size);
+			if (!state.database->read_entry(tag, object.hash, &size, object.payload.data(), 0))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// If prepared is not null, its database and static objects are used instead of the databases.
+// Below this, spreading static objects across threads costs more than it saves.
+static const size_t MinStaticObjectsPerThread = 256;
+
+// Static objects only refer to the types before them in initial_playback_order.
+// The objects of a type are parsed and created on several threads,
+// and merged into the main replayer before the next type refers to them.
+static bool replay_static_objects(ThreadedReplayer &replayer, StateReplayer &state_replayer, DatabaseInterface *resolver,
+                                  const PreparedReplayState *prepared, ResourceTag tag, const char *tag_name,
+                                  size_t &total_size, size_t &total_compressed_size)
+{
+	vector<Hash> hashes;
+	size_t count = 0;
+	if (prepared)
+		count = prepared->static_objects[tag].size();
+	else
+	{
+		if (!resolver->get_hash_list_for_resource_tag(tag, &count, nullptr))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return false;
+		}
+
+		hashes.resize(count);
+
+		if (!resolver->get_hash_list_for_resource_tag(tag, &count, hashes.data()))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return false;
+		}
+	}
+
+	// The application info creates the device.
+	unsigned num_threads = 1;
+	if (tag != RESOURCE_APPLICATION_INFO)
+		num_threads = unsigned(max<size_t>(1, min<size_t>(replayer.num_worker_threads, count / MinStaticObjectsPerThread)));
+
+	atomic<size_t> next_index;
+	atomic<uint64_t> size;
+	atomic<uint64_t> compressed_size;
+	atomic<bool> read_failed;
+	next_index.store(0);
+	size.store(0);
+	compressed_size.store(0);
+	read_failed.store(false);
+
+	const auto parse_objects = [&](StateReplayer &thread_replayer) {
+		PayloadReadFlags flags = num_threads > 1 ? PAYLOAD_READ_CONCURRENT_BIT : 0;
+		vector<uint8_t> state_json;
+
+		for (;;)
+		{
+			size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+			if (index >= count || read_failed.load(std::memory_order_relaxed))
+				break;
+
+			Hash hash;
+			const uint8_t *payload;
+			size_t payload_size;
+
+			if (prepared)
+			{
+				auto &object = prepared->static_objects[tag][index];
+				hash = object.hash;
+				payload = object.payload.data();
+				payload_size = object.payload.size();
+				compressed_size.fetch_add(object.compressed_size, std::memory_order_relaxed);
+			}
+			else
+			{
+				hash = hashes[index];
+				size_t state_json_size = 0;
+				if (!resolver->read_entry(tag, hash, &state_json_size, nullptr, flags | PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					read_failed.store(true);
+					break;
+				}
+				compressed_size.fetch_add(state_json_size, std::memory_order_relaxed);
+
+				if (!resolver->read_entry(tag, hash, &state_json_size, nullptr, flags))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					read_failed.store(true);
+					break;
+				}
+
+				state_json.resize(state_json_size);
+
+				if (!resolver->read_entry(tag, hash, &state_json_size, state_json.data(), flags))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					read_failed.store(true);
+					break;
+				}
+
+				payload = state_json.data();
+				payload_size = state_json.size();
+			}
+
+			size.fetch_add(payload_size, std::memory_order_relaxed);
+			if (!thread_replayer.parse(replayer, resolver, payload, payload_size))
+				LOGE("Failed to parse blob (tag: %s, hash: %016" PRIx64 ").\n", tag_name, hash);
+		}
+	};
+
+	if (num_threads > 1)
+	{
+		vector<unique_ptr<StateReplayer>> thread_replayers;
+		vector<thread> threads;
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			thread_replayers.emplace_back(new StateReplayer);
+			auto &thread_replayer = *thread_replayers.back();
+			thread_replayer.set_resolve_derivative_pipeline_handles(false);
+			thread_replayer.set_resolve_shader_module_handles(false);
+			thread_replayer.copy_handle_references(state_replayer);
+		}
+
+		for (auto &thread_replayer : thread_replayers)
+			threads.emplace_back(parse_objects, std::ref(*thread_replayer));
+		for (auto &t : threads)
+			t.join();
+
+		for (auto &thread_replayer : thread_replayers)
+			state_replayer.merge_handle_references(*thread_replayer);
+	}
+	else
+		parse_objects(state_replayer);
+
+	total_size = size_t(size.load());
+	total_compressed_size = size_t(compressed_size.load());
+	return !read_failed.load();
+}
+
+// In streaming mode, the first chunk covers both pipeline memory contexts, and chunks double in size from there.
+static const size_t StreamingFirstChunkSize = 2 * 1024;
+static const size_t StreamingMaxChunkSize = 32 * 1024;
+
+// Lists the static objects which the pipelines refer to, also through base pipelines outside of hashes.
+// Shader modules are left out, workers resolve those themselves. Pipelines which cannot be read or scanned are
+// skipped, replaying them reports the error.
+static void scan_pipeline_dependencies(DatabaseInterface &db, ResourceTag tag, const Hash *hashes, size_t count,
+                                       vector<StateReference> &dependencies)
+{
+	StateReplayer scanner;
+	EntryPayload payload;
+	vector<StateReference> pending;
+	unordered_set<Hash> visited;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		pending.push_back({ tag, hashes[i] });
+		visited.insert(hashes[i]);
+	}
+
+	while (!pending.empty())
+	{
+		auto pipeline = pending.back();
+		pending.pop_back();
+
+		if (!payload.read(db, pipeline.tag, pipeline.hash, PAYLOAD_READ_CONCURRENT_BIT))
+			continue;
+
+		const StateReference *refs = nullptr;
+		size_t ref_count = 0;
+		if (!scanner.scan_references(payload.data(), payload.size(), &refs, &ref_count))
+			continue;
+
+		for (size_t i = 0; i < ref_count; i++)
+		{
+			switch (refs[i].tag)
+			{
+			case RESOURCE_GRAPHICS_PIPELINE:
+			case RESOURCE_COMPUTE_PIPELINE:
+				if (visited.insert(refs[i].hash).second)
+					pending.push_back(refs[i]);
+				break;
+
+			case RESOURCE_SHADER_MODULE:
+			case RESOURCE_GRAPHICS_PIPELINE_STATE:
+				break;
+
+			default:
+				dependencies.push_back(refs[i]);
+				break;
+			}
+		}
+
+		scanner.get_allocator().reset();
+	}
+}
+
+// Keeps the pipelines which belong to the shard, in their current order.
+static void filter_pipeline_shard(const ThreadedReplayer::Options &opts, vector<Hash> &hashes)
+{
+	auto itr = remove_if(begin(hashes), end(hashes), [&](Hash hash) {
+		return hash % opts.shard_count != opts.shard_index;
+	});
+	hashes.erase(itr, end(hashes));
+}
+
+// Counts the pipelines of a tag which a replay with these options goes through, before pipeline ranges apply.
+static bool get_shard_pipeline_count(DatabaseInterface &db, const ThreadedReplayer::Options &opts,
+                                     ResourceTag tag, size_t *count)
+{
+	if (!db.get_hash_list_for_resource_tag(tag, count, nullptr))
+		return false;
+	if (opts.shard_count <= 1)
+		return true;
+
+	vector<Hash> hashes(*count);
+	if (!db.get_hash_list_for_resource_tag(tag, count, hashes.data()))
+		return false;
+	filter_pipeline_shard(opts, hashes);
+	*count = hashes.size();
+	return true;
+}
+
+// Creates the static objects in dependencies which have not been created yet, along with everything they refer to.
+// Objects which are not in the database are skipped, the pipelines which need them fail to parse later.
+static bool replay_static_dependencies(ThreadedReplayer &replayer, StateReplayer &state_replayer, DatabaseInterface *resolver,
+                                       const vector<StateReference> &dependencies, unordered_set<Hash> *replayed_objects,
+                                       size_t *total_size, size_t *total_compressed_size)
+{
+	vector<Hash> pending[RESOURCE_COUNT];
+	vector<vector<uint8_t>> payloads[RESOURCE_COUNT];
+	StateReplayer scanner;
+
+	const auto add_object = [&](const StateReference &ref) {
+		if (replayed_objects[ref.tag].insert(ref.hash).second && resolver->has_entry(ref.tag, ref.hash))
+			pending[ref.tag].push_back(ref.hash);
+	};
+
+	for (auto &ref : dependencies)
+		add_object(ref);
+
+	// Objects only refer to types before them in initial_playback_order,
+	// so going backwards finds everything a type needs before that type is read.
+	for (size_t i = sizeof(initial_playback_order) / sizeof(initial_playback_order[0]); i > 1; i--)
+	{
+		auto tag = initial_playback_order[i - 1];
+		for (auto hash : pending[tag])
+		{
+			size_t size = 0;
+			if (!resolver->read_entry(tag, hash, &size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT | PAYLOAD_READ_CONCURRENT_BIT))
+			{
+				LOGE("Failed to load blob from cache.\n");
+				return false;
+			}
+			total_compressed_size[tag] += size;
+
+			if (!resolver->read_entry(tag, hash, &size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+			{
+				LOGE("Failed to load blob from cache.\n");
+				return false;
+			}
+
+			payloads[tag].emplace_back(size);
+			auto &payload = payloads[tag].back();
+			if (!resolver->read_entry(tag, hash, &size, payload.data(), PAYLOAD_READ_CONCURRENT_BIT))
+			{
+				LOGE("Failed to load blob from cache.\n");
+				return false;
+			}
+			total_size[tag] += size;
+
+			const StateReference *refs = nullptr;
+			size_t ref_count = 0;
+			if (tag != RESOURCE_SAMPLER && tag != RESOURCE_RENDER_PASS &&
+			    scanner.scan_references(payload.data(), payload.size(), &refs, &ref_count))
+			{
+				for (size_t j = 0; j < ref_count; j++)
+					add_object(refs[j]);
+			}
+			scanner.get_allocator().reset();
+		}
+	}
+
+	for (auto &tag : initial_playback_order)
+	{
+		for (size_t i = 0; i < payloads[tag].size(); i++)
+		{
+			auto &payload = payloads[tag][i];
+			if (!state_replayer.parse(replayer, resolver, payload.data(), payload.size()))
+				LOGE("Failed to parse blob (tag: %d, hash: %016" PRIx64 ").\n", tag, pending[tag][i]);
+		}
+	}
+
+	state_replayer.get_allocator().reset();
+	return true;
+}
+
+static int run_normal_process(ThreadedReplayer &replayer, const vector<const char *> &databases,
+                              PreparedReplayState *prepared = nullptr)
 {
 	auto start_time = chrono::steady_clock::now();
 	auto start_create_archive = chrono::steady_clock::now();
-	auto resolver = create_database(databases);
+	unique_ptr<DatabaseInterface> owned_resolver;
+	DatabaseInterface *resolver = prepared ? prepared->database.get() : nullptr;
+	if (!resolver)
+	{
+		owned_resolver = create_database(databases, replayer.opts.module_store_path);
+		resolver = owned_resolver.get();
+	}
 
 	auto end_create_archive = chrono::steady_clock::now();
 
 	auto start_prepare = chrono::steady_clock::now();
-	if (!resolver->prepare())
+	if (owned_resolver && !resolver->prepare())
 	{
 		LOGE("Failed to prepare database.\n");
 		return EXIT_FAILURE;
@@ -1968,18 +4290,7 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 	state_replayer.set_resolve_derivative_pipeline_handles(false);
 	state_replayer.set_resolve_shader_module_handles(false);
 	replayer.global_replayer = &state_replayer;
-	replayer.global_database = resolver.get();
-
-	vector<Hash> resource_hashes;
-	vector<uint8_t> state_json;
-
-	static const ResourceTag initial_playback_order[] = {
-		RESOURCE_APPLICATION_INFO, // This will create the device, etc.
-		RESOURCE_SAMPLER, // Trivial, run in main thread.
-		RESOURCE_DESCRIPTOR_SET_LAYOUT, // Trivial, run in main thread
-		RESOURCE_PIPELINE_LAYOUT, // Trivial, run in main thread
-		RESOURCE_RENDER_PASS, // Trivial, run in main thread
-	};
+	replayer.global_database = resolver;
 
 	static const ResourceTag threaded_playback_order[] = {
 		RESOURCE_GRAPHICS_PIPELINE,
@@ -1997,84 +4308,81 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 		"Compute Pipeline",
 	};
 
+	// In streaming mode, static objects are created along with the first pipelines which need them.
+	bool streaming = replayer.opts.streaming_start;
+	unordered_set<Hash> streamed_objects[RESOURCE_COUNT];
+	size_t streamed_size[RESOURCE_COUNT] = {};
+	size_t streamed_compressed_size[RESOURCE_COUNT] = {};
+
 	for (auto &tag : initial_playback_order)
 	{
+		if (streaming && tag != RESOURCE_APPLICATION_INFO)
+			continue;
+
 		auto main_thread_start = std::chrono::steady_clock::now();
 		size_t tag_total_size = 0;
 		size_t tag_total_size_compressed = 0;
-		size_t resource_hash_count = 0;
 
-		if (!resolver->get_hash_list_for_resource_tag(tag, &resource_hash_count, nullptr))
-		{
-			LOGE("Failed to get list of resource hashes.\n");
+		if (!replay_static_objects(replayer, state_replayer, resolver, prepared, tag, tag_names[tag],
+		                           tag_total_size, tag_total_size_compressed))
 			return EXIT_FAILURE;
-		}
-
-		resource_hashes.resize(resource_hash_count);
 
-		if (!resolver->get_hash_list_for_resource_tag(tag, &resource_hash_count, resource_hashes.data()))
+		if (tag == RESOURCE_APPLICATION_INFO)
 		{
-			LOGE("Failed to get list of resource hashes.\n");
-			return EXIT_FAILURE;
+			// Just in case there was no application info in the database, we provide a dummy info,
+			// this makes sure the VkDevice is created.
+			replayer.set_application_info(0, nullptr, nullptr);
 		}
 
-		for (auto &hash : resource_hashes)
+		LOGI("Total binary size for %s: %" PRIu64 " (%" PRIu64 " compressed)\n", tag_names[tag],
+		     uint64_t(tag_total_size),
+		     uint64_t(tag_total_size_compressed));
+
+		auto main_thread_end = std::chrono::steady_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(main_thread_end - main_thread_start).count();
+		LOGI("Total time decoding %s: %.3f s\n", tag_names[tag], duration * 1e-9);
+	}
+
+	// Now we've laid the initial ground work, kick off worker threads.
+	replayer.start_worker_threads();
+
+	const auto log_pipeline_sizes = [&](ResourceTag tag, const vector<Hash> &hashes) -> bool {
+		size_t tag_total_size = 0;
+		size_t tag_total_size_compressed = 0;
+
+		for (auto &hash : hashes)
 		{
 			size_t state_json_size = 0;
 			if (!resolver->read_entry(tag, hash, &state_json_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
 			{
 				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
+				return false;
 			}
 			tag_total_size_compressed += state_json_size;
 
 			if (!resolver->read_entry(tag, hash, &state_json_size, nullptr, 0))
 			{
 				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
+				return false;
 			}
-
-			state_json.resize(state_json_size);
 			tag_total_size += state_json_size;
-
-			if (!resolver->read_entry(tag, hash, &state_json_size, state_json.data(), 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
-			}
-
-			if (!state_replayer.parse(replayer, resolver.get(), state_json.data(), state_json.size()))
-				LOGE("Failed to parse blob (tag: %s, hash: %016" PRIx64 ").\n", tag_names[tag], hash);
-		}
-
-		if (tag == RESOURCE_APPLICATION_INFO)
-		{
-			// Just in case there was no application info in the database, we provide a dummy info,
-			// this makes sure the VkDevice is created.
-			replayer.set_application_info(0, nullptr, nullptr);
 		}
 
 		LOGI("Total binary size for %s: %" PRIu64 " (%" PRIu64 " compressed)\n", tag_names[tag],
 		     uint64_t(tag_total_size),
 		     uint64_t(tag_total_size_compressed));
-
-		auto main_thread_end = std::chrono::steady_clock::now();
-		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(main_thread_end - main_thread_start).count();
-		LOGI("Total time decoding %s in main thread: %.3f s\n", tag_names[tag], duration * 1e-9);
-	}
-
-	// Now we've laid the initial ground work, kick off worker threads.
-	replayer.start_worker_threads();
+		return true;
+	};
 
 	vector<Hash> graphics_hashes;
 	vector<Hash> compute_hashes;
+	vector<Hash> all_graphics_hashes;
+	vector<Hash> all_compute_hashes;
 	unsigned graphics_start_index = 0;
 	unsigned compute_start_index = 0;
 
 	for (auto &tag : threaded_playback_order)
 	{
-		size_t tag_total_size = 0;
-		size_t tag_total_size_compressed = 0;
 		size_t resource_hash_count = 0;
 
 		if (!resolver->get_hash_list_for_resource_tag(tag, &resource_hash_count, nullptr))
@@ -2111,65 +4419,220 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 		assert(hashes);
 		hashes->resize(resource_hash_count);
 
-		if (!resolver->get_hash_list_for_resource_tag(tag, &resource_hash_count, hashes->data()))
+		if (!resolver->get_hash_list_for_resource_tag(tag, &resource_hash_count, hashes->data()))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		// Pipeline ranges and work queue chunks index into the shard.
+		if (replayer.opts.shard_count > 1)
+		{
+			filter_pipeline_shard(replayer.opts, *hashes);
+			start_index = min(start_index, unsigned(hashes->size()));
+			end_index = min(end_index, unsigned(hashes->size()));
+			if (tag == RESOURCE_GRAPHICS_PIPELINE)
+				graphics_start_index = start_index;
+			else
+				compute_start_index = start_index;
+		}
+
+		// Sort the entire list before slicing it, so that the pipeline range means the same thing in every process.
+		if (replayer.opts.shader_locality_order)
+		{
+			auto sort_start = chrono::steady_clock::now();
+			if (!sort_pipelines_by_shader_locality(*resolver, tag, *hashes))
+				return EXIT_FAILURE;
+			auto sort_end = chrono::steady_clock::now();
+			LOGI("Sorted %s by shader module locality in %.3f s.\n", tag_names[tag],
+			     chrono::duration_cast<chrono::nanoseconds>(sort_end - sort_start).count() * 1e-9);
+		}
+
+		// Done after the locality sort, so pipelines of equal priority keep their locality.
+		if (replayer.opts.frequency_order && !sort_pipelines_by_frequency(*resolver, databases, tag, *hashes))
+			return EXIT_FAILURE;
+		if (replayer.opts.cost_order)
+			replayer.sort_pipelines_by_cost(tag, *hashes);
+
+		// Chunks from the work queue are sliced out of the entire list.
+		if (replayer.opts.work_queue)
+		{
+			if (tag == RESOURCE_GRAPHICS_PIPELINE)
+				all_graphics_hashes = *hashes;
+			else
+				all_compute_hashes = *hashes;
+		}
+
+		move(begin(*hashes) + start_index, begin(*hashes) + end_index, begin(*hashes));
+		hashes->erase(begin(*hashes) + (end_index - start_index), end(*hashes));
+
+		// Nothing in here is needed to replay, so streaming does not wait for it.
+		if (!streaming && !log_pipeline_sizes(tag, *hashes))
+			return EXIT_FAILURE;
+	}
+
+	// Done parsing static objects.
+	state_replayer.get_allocator().reset();
+
+	const auto replay_pipelines = [&](const vector<Hash> &graphics, unsigned graphics_start,
+	                                  const vector<Hash> &compute, unsigned compute_start) {
+		vector<EnqueuedWork> graphics_workload;
+		vector<EnqueuedWork> compute_workload;
+		replayer.enqueue_deferred_pipelines(replayer.deferred_graphics, replayer.graphics_pipelines, replayer.graphics_parents,
+		                                    graphics_workload,
+		                                    graphics, graphics_start);
+		replayer.enqueue_deferred_pipelines(replayer.deferred_compute, replayer.compute_pipelines, replayer.compute_parents,
+		                                    compute_workload, compute,
+		                                    compute_start);
+
+		sort(begin(graphics_workload), end(graphics_workload), [](const EnqueuedWork &a, const EnqueuedWork &b) {
+			return a.order_index < b.order_index;
+		});
+		sort(begin(compute_workload), end(compute_workload), [](const EnqueuedWork &a, const EnqueuedWork &b) {
+			return a.order_index < b.order_index;
+		});
+
+		for (auto &work : graphics_workload)
+		{
+			if (replayer.deadline_reached())
+				break;
+			work.func();
+		}
+
+		for (auto &work : compute_workload)
+		{
+			if (replayer.deadline_reached())
+				break;
+			work.func();
+		}
+
+		// VALVE: drain all outstanding pipeline compiles
+		replayer.sync_worker_threads();
+	};
+
+	const auto create_static_dependencies = [&](const vector<StateReference> &dependencies) -> bool {
+		if (!replay_static_dependencies(replayer, state_replayer, resolver, dependencies, streamed_objects,
+		                                streamed_size, streamed_compressed_size))
+			return false;
+		replayer.static_object_generation.fetch_add(1, std::memory_order_release);
+		return true;
+	};
+
+	const auto create_chunk_dependencies = [&](ResourceTag tag, const vector<Hash> &chunk) -> bool {
+		vector<StateReference> dependencies;
+		scan_pipeline_dependencies(*resolver, tag, chunk.data(), chunk.size(), dependencies);
+		return create_static_dependencies(dependencies);
+	};
+
+	// Chunks start out small so the first compiles start early, and grow so that later chunks rarely wait on each other.
+	// The next chunk is scanned while the current one compiles.
+	const auto stream_pipelines = [&](ResourceTag tag, const vector<Hash> &hashes, unsigned start_index) -> bool {
+		const vector<Hash> no_hashes;
+		vector<StateReference> dependencies;
+		vector<StateReference> next_dependencies;
+
+		size_t offset = 0;
+		size_t count = min<size_t>(StreamingFirstChunkSize, hashes.size());
+		scan_pipeline_dependencies(*resolver, tag, hashes.data(), count, dependencies);
+
+		while (offset < hashes.size() && !replayer.deadline_reached())
 		{
-			LOGE("Failed to get list of resource hashes.\n");
-			return EXIT_FAILURE;
+			if (!create_static_dependencies(dependencies))
+				return false;
+
+			size_t next_offset = offset + count;
+			size_t next_count = min(min(count * 2, StreamingMaxChunkSize), hashes.size() - next_offset);
+			next_dependencies.clear();
+			std::thread scanner;
+			if (next_count)
+			{
+				scanner = std::thread(scan_pipeline_dependencies, std::ref(*resolver), tag,
+				                      hashes.data() + next_offset, next_count, std::ref(next_dependencies));
+			}
+
+			vector<Hash> chunk(begin(hashes) + offset, begin(hashes) + next_offset);
+			if (tag == RESOURCE_GRAPHICS_PIPELINE)
+				replay_pipelines(chunk, unsigned(start_index + offset), no_hashes, 0);
+			else
+				replay_pipelines(no_hashes, 0, chunk, unsigned(start_index + offset));
+
+			if (scanner.joinable())
+				scanner.join();
+			swap(dependencies, next_dependencies);
+			offset = next_offset;
+			count = next_count;
 		}
 
-		move(begin(*hashes) + start_index, begin(*hashes) + end_index, begin(*hashes));
-		hashes->erase(begin(*hashes) + (end_index - start_index), end(*hashes));
+		return true;
+	};
+
+	if (streaming)
+	{
+		if (!stream_pipelines(RESOURCE_GRAPHICS_PIPELINE, graphics_hashes, graphics_start_index) ||
+		    !stream_pipelines(RESOURCE_COMPUTE_PIPELINE, compute_hashes, compute_start_index))
+			return EXIT_FAILURE;
+	}
+	else
+		replay_pipelines(graphics_hashes, graphics_start_index, compute_hashes, compute_start_index);
 
-		for (auto &hash : *hashes)
+	if (replayer.opts.work_queue)
+	{
+		// Graphics pipelines are handed out before compute, like in a static slice.
+		// A chunk is drained completely before the next one is claimed, so the slot always covers what a crash leaves over.
+		const vector<Hash> no_hashes;
+		unsigned chunk_count = 0;
+		unsigned start = 0, end = 0;
+		if (!replayer.deadline_reached())
+			replayer.opts.work_queue->complete_chunks(replayer.opts.work_queue_slot);
+
+		while (!replayer.deadline_reached() &&
+		       replayer.opts.work_queue->claim_chunk(RESOURCE_GRAPHICS_PIPELINE, replayer.opts.work_queue_slot, start, end))
 		{
-			size_t state_json_size = 0;
-			if (!resolver->read_entry(tag, hash, &state_json_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-			{
-				LOGE("Failed to load blob from cache.\n");
+			end = min(end, unsigned(all_graphics_hashes.size()));
+			if (start >= end)
+				break;
+			vector<Hash> chunk(begin(all_graphics_hashes) + start, begin(all_graphics_hashes) + end);
+			if (streaming && !create_chunk_dependencies(RESOURCE_GRAPHICS_PIPELINE, chunk))
 				return EXIT_FAILURE;
-			}
-			tag_total_size_compressed += state_json_size;
+			replay_pipelines(chunk, start, no_hashes, 0);
+			replayer.opts.work_queue->complete_chunks(replayer.opts.work_queue_slot);
+			chunk_count++;
+		}
 
-			if (!resolver->read_entry(tag, hash, &state_json_size, nullptr, 0))
-			{
-				LOGE("Failed to load blob from cache.\n");
+		while (!replayer.deadline_reached() &&
+		       replayer.opts.work_queue->claim_chunk(RESOURCE_COMPUTE_PIPELINE, replayer.opts.work_queue_slot, start, end))
+		{
+			end = min(end, unsigned(all_compute_hashes.size()));
+			if (start >= end)
+				break;
+			vector<Hash> chunk(begin(all_compute_hashes) + start, begin(all_compute_hashes) + end);
+			if (streaming && !create_chunk_dependencies(RESOURCE_COMPUTE_PIPELINE, chunk))
 				return EXIT_FAILURE;
-			}
-			tag_total_size += state_json_size;
+			replay_pipelines(no_hashes, 0, chunk, start);
+			replayer.opts.work_queue->complete_chunks(replayer.opts.work_queue_slot);
+			chunk_count++;
 		}
 
-		LOGI("Total binary size for %s: %" PRIu64 " (%" PRIu64 " compressed)\n", tag_names[tag],
-		     uint64_t(tag_total_size),
-		     uint64_t(tag_total_size_compressed));
+		LOGI("Replayed %u chunks from the shared work queue.\n", chunk_count);
 	}
+	replayer.tear_down_threads();
+	replayer.save_pipeline_stats();
 
-	// Done parsing static objects.
-	state_replayer.get_allocator().reset();
-
-	vector<EnqueuedWork> graphics_workload;
-	vector<EnqueuedWork> compute_workload;
-	replayer.enqueue_deferred_pipelines(replayer.deferred_graphics, replayer.graphics_pipelines, replayer.graphics_parents,
-	                                    graphics_workload,
-	                                    graphics_hashes, graphics_start_index);
-	replayer.enqueue_deferred_pipelines(replayer.deferred_compute, replayer.compute_pipelines, replayer.compute_parents,
-	                                    compute_workload, compute_hashes,
-	                                    compute_start_index);
-
-	sort(begin(graphics_workload), end(graphics_workload), [](const EnqueuedWork &a, const EnqueuedWork &b) {
-		return a.order_index < b.order_index;
-	});
-	sort(begin(compute_workload), end(compute_workload), [](const EnqueuedWork &a, const EnqueuedWork &b) {
-		return a.order_index < b.order_index;
-	});
-
-	for (auto &work : graphics_workload)
-		work.func();
-	for (auto &work : compute_workload)
-		work.func();
+	if (streaming)
+	{
+		for (auto &tag : initial_playback_order)
+		{
+			if (tag == RESOURCE_APPLICATION_INFO)
+				continue;
+			LOGI("Total binary size for %s: %" PRIu64 " (%" PRIu64 " compressed)\n", tag_names[tag],
+			     uint64_t(streamed_size[tag]),
+			     uint64_t(streamed_compressed_size[tag]));
+		}
 
-	// VALVE: drain all outstanding pipeline compiles
-	replayer.sync_worker_threads();
-	replayer.tear_down_threads();
+		if (!log_pipeline_sizes(RESOURCE_GRAPHICS_PIPELINE, graphics_hashes) ||
+		    !log_pipeline_sizes(RESOURCE_COMPUTE_PIPELINE, compute_hashes))
+			return EXIT_FAILURE;
+	}
 
 	LOGI("Total binary size for %s: %" PRIu64 " (%" PRIu64 " compressed)\n", tag_names[RESOURCE_SHADER_MODULE],
 	     uint64_t(replayer.shader_module_total_size.load()),
@@ -2197,6 +4660,13 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 		LOGI("Pipeline cache misses reported: %u\n", replayer.pipeline_cache_misses.load());
 	}
 
+	if (replayer.cache_probe_enabled)
+	{
+		LOGI("Cache probe found %u pipelines which did not need a compile, and %u which did%s.\n",
+		     replayer.cache_probe_hits.load(), replayer.cache_probe_misses.load(),
+		     replayer.opts.cache_probe_only ? " (not compiled)" : "");
+	}
+
 	LOGI("Playing back %u shader modules took %.3f s (accumulated time)\n",
 	     replayer.shader_module_count.load(),
 	     replayer.shader_module_ns.load() * 1e-9);
@@ -2212,6 +4682,11 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 	     replayer.compute_pipeline_count.load(),
 	     replayer.compute_pipeline_ns.load() * 1e-9);
 
+	log_latency_histogram("Shader module", replayer.get_latency_histogram(CONTROL_BLOCK_LATENCY_SHADER_MODULE));
+	log_latency_histogram("Graphics pipeline", replayer.get_latency_histogram(CONTROL_BLOCK_LATENCY_GRAPHICS_PIPELINE));
+	log_latency_histogram("Compute pipeline", replayer.get_latency_histogram(CONTROL_BLOCK_LATENCY_COMPUTE_PIPELINE));
+	log_latency_histogram("Parse", replayer.get_latency_histogram(CONTROL_BLOCK_LATENCY_PARSE));
+
 	LOGI("Threads were idling in total for %.3f s (accumulated time)\n",
 	     replayer.total_idle_ns.load() * 1e-9);
 
@@ -2221,6 +4696,11 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 	LOGI("Total peak memory consumption by parser: %.3f MB.\n",
 	     (replayer.total_peak_memory.load() + state_replayer.get_allocator().get_peak_memory_consumption()) * 1e-6);
 
+	LOGI("Worker parsers used at most %.3f MB at once in %lu blocks, with %lu block allocations in total.\n",
+	     replayer.total_peak_memory_in_use.load() * 1e-6,
+	     (unsigned long)replayer.total_allocator_blocks.load(),
+	     (unsigned long)replayer.total_allocator_system_allocations.load());
+
 	LOGI("Replayed %lu objects in %ld ms:\n", total_size, elapsed_ms);
 	LOGI("  samplers:              %7lu\n", (unsigned long)replayer.samplers.size());
 	LOGI("  descriptor set layouts:%7lu\n", (unsigned long)replayer.layouts.size());
@@ -2232,6 +4712,336 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 	return EXIT_SUCCESS;
 }
 
+// Every slice is replayed by a fresh ThreadedReplayer, but jobs keep their archives open and static objects read,
+// and devices are shared through the cache.
+struct DaemonReplayRunner : ReplayDaemonRunner
+{
+	DaemonReplayRunner(const VulkanDevice::Options &device_opts_, const ThreadedReplayer::Options &replayer_opts_)
+		: device_opts(device_opts_), replayer_opts(replayer_opts_)
+	{
+	}
+
+	static vector<const char *> get_databases(const ReplayDaemonJob &job)
+	{
+		vector<const char *> databases;
+		for (auto &database : job.databases)
+			databases.push_back(database.c_str());
+		return databases;
+	}
+
+	bool open_job(ReplayDaemonJob &job) override
+	{
+		unique_ptr<PreparedReplayState> state(new PreparedReplayState);
+		if (!prepare_replay_state(get_databases(job), replayer_opts.module_store_path,
+		                          replayer_opts.streaming_start, *state))
+			return false;
+
+		size_t graphics_count = 0;
+		size_t compute_count = 0;
+		if (!state->database->get_hash_list_for_resource_tag(RESOURCE_GRAPHICS_PIPELINE, &graphics_count, nullptr) ||
+		    !state->database->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &compute_count, nullptr))
+			return false;
+
+		job.graphics_total = unsigned(graphics_count);
+		job.compute_total = unsigned(compute_count);
+		states[job.id] = move(state);
+		return true;
+	}
+
+	bool replay_slice(const ReplayDaemonJob &job, const ReplayDaemonSlice &slice) override
+	{
+		auto itr = states.find(job.id);
+		if (itr == end(states))
+			return false;
+
+		auto opts = replayer_opts;
+		opts.start_graphics_index = slice.graphics_start;
+		opts.end_graphics_index = slice.graphics_end;
+		opts.start_compute_index = slice.compute_start;
+		opts.end_compute_index = slice.compute_end;
+		opts.device_cache = &devices;
+
+		ThreadedReplayer replayer(device_opts, opts);
+		return run_normal_process(replayer, get_databases(job), itr->second.get()) == EXIT_SUCCESS;
+	}
+
+	void close_job(const ReplayDaemonJob &job) override
+	{
+		states.erase(job.id);
+	}
+
+	VulkanDevice::Options device_opts;
+	ThreadedReplayer::Options replayer_opts;
+	ReplayDeviceCache devices;
+	unordered_map<unsigned, unique_ptr<PreparedReplayState>> states;
+};
+
+static int run_daemon_process(const VulkanDevice::Options &device_opts, const ThreadedReplayer::Options &replayer_opts,
+                              const char *socket_path, unsigned slice_size, unsigned max_devices)
+{
+	DaemonReplayRunner runner(device_opts, replayer_opts);
+	runner.devices.max_devices = max_devices;
+
+	ReplayDaemon daemon(runner, slice_size);
+	if (!daemon.listen(socket_path))
+		return EXIT_FAILURE;
+	daemon.run();
+	return EXIT_SUCCESS;
+}
+
+// The daemon runs in another working directory.
+static bool get_absolute_database_path(const char *path, string &absolute_path)
+{
+#ifdef _WIN32
+	absolute_path = path;
+#else
+	char *resolved = realpath(path, nullptr);
+	if (!resolved)
+	{
+		LOGE("Failed to find database %s.\n", path);
+		return false;
+	}
+	absolute_path = resolved;
+	free(resolved);
+#endif
+	return true;
+}
+
+static bool is_finished_job_status(const string &status)
+{
+	static const ReplayDaemonJobState finished_states[] = {
+		ReplayDaemonJobState::Done,
+		ReplayDaemonJobState::Failed,
+		ReplayDaemonJobState::Cancelled,
+	};
+
+	for (auto state : finished_states)
+	{
+		string pattern = string(" ") + get_replay_daemon_job_state_name(state) + ":";
+		if (status.find(pattern) != string::npos)
+			return true;
+	}
+	return false;
+}
+
+static int run_daemon_client(const char *socket_path, const string &command, bool wait)
+{
+	string reply;
+	if (!send_replay_daemon_command(socket_path, command, reply))
+		return EXIT_FAILURE;
+
+	printf("%s\n", reply.c_str());
+	if (reply.compare(0, 6, "error ") == 0)
+		return EXIT_FAILURE;
+	if (!wait)
+		return EXIT_SUCCESS;
+
+	// Only submit waits, and it replies with the job id.
+	string status_command = "status\t" + reply.substr(3);
+	string last_status;
+	for (;;)
+	{
+		string status;
+		if (!send_replay_daemon_command(socket_path, status_command, status))
+			return EXIT_FAILURE;
+
+		if (status != last_status)
+		{
+			printf("%s\n", status.c_str());
+			fflush(stdout);
+			last_status = status;
+		}
+
+		if (status.compare(0, 6, "error ") == 0)
+			return EXIT_FAILURE;
+		if (is_finished_job_status(status))
+		{
+			string done = string(" ") + get_replay_daemon_job_state_name(ReplayDaemonJobState::Done) + ":";
+			return status.find(done) != string::npos ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+
+		this_thread::sleep_for(chrono::seconds(1));
+	}
+}
+
+static void create_pipeline_cache_from_file(const VulkanDevice &device, const string &path,
+                                            vector<VkPipelineCache> &caches)
+{
+	auto blob = load_buffer_from_file(path.c_str());
+	if (blob.empty() || !ThreadedReplayer::validate_pipeline_cache_header(device.get_gpu(), blob))
+		return;
+
+	VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+	info.pInitialData = blob.data();
+	info.initialDataSize = blob.size();
+	VkPipelineCache cache = VK_NULL_HANDLE;
+	if (vkCreatePipelineCache(device.get_device(), &info, nullptr, &cache) == VK_SUCCESS)
+		caches.push_back(cache);
+}
+
+// Merges the caches in paths into the cache at output_path, which does not have to exist yet.
+// Caches which were not written by this device and driver are skipped.
+static bool merge_pipeline_cache_files(const VulkanDevice &device, const string &output_path, const vector<string> &paths)
+{
+	vector<VkPipelineCache> caches;
+	create_pipeline_cache_from_file(device, output_path, caches);
+	if (caches.empty())
+	{
+		VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+		VkPipelineCache cache = VK_NULL_HANDLE;
+		if (vkCreatePipelineCache(device.get_device(), &info, nullptr, &cache) != VK_SUCCESS)
+		{
+			LOGE("Failed to create pipeline cache.\n");
+			return false;
+		}
+		caches.push_back(cache);
+	}
+
+	for (auto &path : paths)
+		create_pipeline_cache_from_file(device, path, caches);
+
+	bool written = false;
+	if (caches.size() > 1 &&
+	    vkMergePipelineCaches(device.get_device(), caches.front(),
+	                          uint32_t(caches.size() - 1), caches.data() + 1) != VK_SUCCESS)
+	{
+		LOGE("Failed to merge pipeline caches.\n");
+	}
+	else if (write_pipeline_cache_data(device.get_device(), caches.front(), output_path))
+	{
+		LOGI("Merged %u pipeline caches into %s.\n", unsigned(caches.size()), output_path.c_str());
+		written = true;
+	}
+
+	for (auto cache : caches)
+		vkDestroyPipelineCache(device.get_device(), cache, nullptr);
+	return written;
+}
+
+// Folds the pipeline caches and replay journals written by the machines of a sharded replay
+// into the cache given with --on-disk-pipeline-cache and the journal given with --journal.
+static int run_merge_shards(const VulkanDevice::Options &device_opts, const ThreadedReplayer::Options &replayer_opts,
+                            const vector<string> &cache_paths, const vector<const char *> &journal_paths)
+{
+	if (!journal_paths.empty())
+	{
+		if (replayer_opts.journal_path.empty())
+		{
+			LOGE("--merge-journal needs --journal for the merged journal.\n");
+			return EXIT_FAILURE;
+		}
+
+		if (!merge_replay_journals(replayer_opts.journal_path.c_str(), journal_paths.data(), journal_paths.size()))
+			return EXIT_FAILURE;
+	}
+
+	if (!cache_paths.empty())
+	{
+		if (replayer_opts.on_disk_pipeline_cache_path.empty())
+		{
+			LOGE("--merge-pipeline-cache needs --on-disk-pipeline-cache for the merged pipeline cache.\n");
+			return EXIT_FAILURE;
+		}
+
+		VulkanDevice device;
+		if (!device.init_device(device_opts))
+		{
+			LOGE("Failed to create device to merge pipeline caches.\n");
+			return EXIT_FAILURE;
+		}
+
+		if (!merge_pipeline_cache_files(device, replayer_opts.on_disk_pipeline_cache_path, cache_paths))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef NO_ROBUST_REPLAYER
+static bool parse_device_index_list(const string &list, vector<unsigned> &indices)
+{
+	indices.clear();
+	if (list.empty())
+		return true;
+
+	if (!parse_cpu_list(list.c_str(), indices) || indices.empty())
+	{
+		LOGE("Invalid device index list \"%s\".\n", list.c_str());
+		return false;
+	}
+	return true;
+}
+
+static unsigned get_child_device_index(const VulkanDevice::Options &opts, const vector<unsigned> &device_indices,
+                                       unsigned child_index)
+{
+	return device_indices.empty() ? opts.device_index : device_indices[child_index % device_indices.size()];
+}
+
+// With a device list, the first child on every device writes <path>.device<index>, so there is one cache per device.
+// Other children write to their own file next to it, since they would otherwise overwrite each other.
+static string get_child_pipeline_cache_path(const string &path, const vector<unsigned> &device_indices,
+                                            unsigned child_index)
+{
+	string child_path = path;
+	unsigned first_children = 1;
+	if (!device_indices.empty())
+	{
+		child_path += ".device";
+		child_path += to_string(device_indices[child_index % device_indices.size()]);
+		first_children = unsigned(device_indices.size());
+	}
+
+	if (child_index >= first_children)
+	{
+		child_path += ".";
+		child_path += to_string(child_index);
+	}
+	return child_path;
+}
+
+// Folds the caches of the other children on a device into the cache of the first child on that device,
+// so the next run starts out with everything which was compiled by any of them.
+static void merge_pipeline_cache_shards(const VulkanDevice::Options &opts, const string &path,
+                                        const vector<unsigned> &device_indices, unsigned processes)
+{
+	unsigned first_children = device_indices.empty() ? 1 : unsigned(device_indices.size());
+	for (unsigned first = 0; first < first_children && first < processes; first++)
+	{
+		vector<string> shard_paths;
+		for (unsigned index = first + first_children; index < processes; index += first_children)
+		{
+			auto shard_path = get_child_pipeline_cache_path(path, device_indices, index);
+			FILE *file = fopen(shard_path.c_str(), "rb");
+			if (file)
+			{
+				fclose(file);
+				shard_paths.push_back(move(shard_path));
+			}
+		}
+
+		if (shard_paths.empty())
+			continue;
+
+		auto device_opts = opts;
+		device_opts.device_index = get_child_device_index(opts, device_indices, first);
+		VulkanDevice device;
+		if (!device.init_device(device_opts))
+		{
+			LOGE("Failed to create device to merge pipeline caches.\n");
+			continue;
+		}
+
+		auto primary_path = get_child_pipeline_cache_path(path, device_indices, first);
+
+		// Children without a cache of their own start out from the merged one.
+		if (merge_pipeline_cache_files(device, primary_path, shard_paths))
+			for (auto &shard_path : shard_paths)
+				remove(shard_path.c_str());
+	}
+}
+#endif
+
 // The implementations are drastically different.
 // To simplify build system, just include implementation inline here.
 #ifndef NO_ROBUST_REPLAYER
@@ -2266,27 +5076,75 @@ int main(int argc, char *argv[])
 #endif
 
 	bool log_memory = false;
+	const char *daemon_socket = nullptr;
+	unsigned daemon_slice_size = 1024;
+	unsigned daemon_max_devices = 4;
+	const char *daemon_client_socket = nullptr;
+	string daemon_command;
+	unsigned job_priority = REPLAY_DAEMON_DEFAULT_PRIORITY;
+	bool wait_for_job = false;
+	string resource_group;
+	string replay_image_dir;
+	string replay_image_path;
+	vector<string> merge_cache_paths;
+	vector<const char *> merge_journal_paths;
 
 	CLICallbacks cbs;
 	cbs.default_handler = [&](const char *arg) { databases.push_back(arg); };
 	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--device-index", [&](CLIParser &parser) { opts.device_index = parser.next_uint(); });
+	cbs.add("--device-indices", [&](CLIParser &parser) { replayer_opts.device_index_list = parser.next_string(); });
 	cbs.add("--enable-validation", [&](CLIParser &) { opts.enable_validation = true; });
 	cbs.add("--pipeline-cache", [&](CLIParser &) { replayer_opts.pipeline_cache = true; });
+	cbs.add("--pipeline-cache-per-thread", [&](CLIParser &) {
+		replayer_opts.pipeline_cache = true;
+		replayer_opts.pipeline_cache_per_thread = true;
+	});
 	cbs.add("--spirv-val", [&](CLIParser &) { replayer_opts.spirv_validate = true; });
 	cbs.add("--on-disk-pipeline-cache", [&](CLIParser &parser) { replayer_opts.on_disk_pipeline_cache_path = parser.next_string(); });
+	cbs.add("--on-disk-pipeline-cache-seed", [&](CLIParser &parser) { replayer_opts.on_disk_pipeline_cache_seed_path = parser.next_string(); });
+	cbs.add("--pipeline-cache-checkpoint-seconds", [&](CLIParser &parser) {
+		replayer_opts.pipeline_cache_checkpoint_seconds = parser.next_uint();
+	});
+	cbs.add("--pipeline-cache-checkpoint-pipelines", [&](CLIParser &parser) {
+		replayer_opts.pipeline_cache_checkpoint_pipelines = parser.next_uint();
+	});
 	cbs.add("--num-threads", [&](CLIParser &parser) { replayer_opts.num_threads = parser.next_uint(); });
+	cbs.add("--memory-headroom", [&](CLIParser &parser) { replayer_opts.memory_headroom_mb = parser.next_uint(); });
+	cbs.add("--min-threads", [&](CLIParser &parser) { replayer_opts.min_threads = parser.next_uint(); });
+	cbs.add("--worker-cpus", [&](CLIParser &parser) { replayer_opts.worker_cpu_list = parser.next_string(); });
+	cbs.add("--core-type", [&](CLIParser &parser) {
+		const char *type = parser.next_string();
+		if (!parse_core_type(type, replayer_opts.worker_core_type))
+		{
+			LOGE("Unknown core type %s.\n", type);
+			exit(EXIT_FAILURE);
+		}
+	});
+	cbs.add("--background-priority", [&](CLIParser &) { replayer_opts.background_priority = true; });
+	cbs.add("--resource-group", [&](CLIParser &parser) { resource_group = parser.next_string(); });
 	cbs.add("--loop", [&](CLIParser &parser) { replayer_opts.loop_count = parser.next_uint(); });
 	cbs.add("--graphics-pipeline-range", [&](CLIParser &parser) {
 		replayer_opts.start_graphics_index = parser.next_uint();
 		replayer_opts.end_graphics_index = parser.next_uint();
 	});
+	cbs.add("--shard", [&](CLIParser &parser) {
+		const char *shard = parser.next_string();
+		if (sscanf(shard, "%u/%u", &replayer_opts.shard_index, &replayer_opts.shard_count) != 2 ||
+		    replayer_opts.shard_count < 1 || replayer_opts.shard_index >= replayer_opts.shard_count)
+		{
+			LOGE("Invalid shard %s, expected <index>/<count>.\n", shard);
+			exit(EXIT_FAILURE);
+		}
+	});
 	cbs.add("--compute-pipeline-range", [&](CLIParser &parser) {
 		replayer_opts.start_compute_index = parser.next_uint();
 		replayer_opts.end_compute_index = parser.next_uint();
 	});
 
 #ifndef NO_ROBUST_REPLAYER
+	cbs.add("--merge-pipeline-cache", [&](CLIParser &parser) { merge_cache_paths.push_back(parser.next_string()); });
+	cbs.add("--merge-journal", [&](CLIParser &parser) { merge_journal_paths.push_back(parser.next_string()); });
 	cbs.add("--quiet-slave", [&](CLIParser &) { quiet_slave = true; });
 	cbs.add("--master-process", [&](CLIParser &) { master_process = true; });
 	cbs.add("--slave-process", [&](CLIParser &) { slave_process = true; });
@@ -2305,6 +5163,71 @@ int main(int argc, char *argv[])
 	cbs.add("--ignore-derived-pipelines", [&](CLIParser &) { replayer_opts.ignore_derived_pipelines = true; });
 	cbs.add("--log-memory", [&](CLIParser &) { log_memory = true; });
 	cbs.add("--null-device", [&](CLIParser &) { opts.null_device = true; });
+	cbs.add("--huge-pages", [&](CLIParser &) { replayer_opts.huge_pages = true; });
+	cbs.add("--shader-locality-order", [&](CLIParser &) { replayer_opts.shader_locality_order = true; });
+	cbs.add("--pipeline-stats", [&](CLIParser &parser) { replayer_opts.pipeline_stats_path = parser.next_string(); });
+	cbs.add("--pipeline-stats-output", [&](CLIParser &parser) { replayer_opts.pipeline_stats_output_path = parser.next_string(); });
+	cbs.add("--trace", [&](CLIParser &parser) { replayer_opts.trace_path = parser.next_string(); });
+	cbs.add("--cost-order", [&](CLIParser &) { replayer_opts.cost_order = true; });
+	cbs.add("--streaming", [&](CLIParser &) { replayer_opts.streaming_start = true; });
+	cbs.add("--cache-probe", [&](CLIParser &) { replayer_opts.cache_probe = true; });
+	cbs.add("--cache-probe-only", [&](CLIParser &) {
+		replayer_opts.cache_probe = true;
+		replayer_opts.cache_probe_only = true;
+	});
+	cbs.add("--pipeline-batch-size", [&](CLIParser &parser) { replayer_opts.pipeline_batch_size = parser.next_uint(); });
+	cbs.add("--journal", [&](CLIParser &parser) { replayer_opts.journal_path = parser.next_string(); });
+	cbs.add("--module-store", [&](CLIParser &parser) { replayer_opts.module_store_path = parser.next_string(); });
+	cbs.add("--full", [&](CLIParser &) { replayer_opts.full_replay = true; });
+	cbs.add("--time-budget", [&](CLIParser &parser) { replayer_opts.time_budget_seconds = parser.next_double(); });
+	cbs.add("--shader-cache-policy", [&](CLIParser &parser) {
+		const char *policy = parser.next_string();
+		if (strcmp(policy, "2q") == 0)
+			replayer_opts.shader_cache_two_queue = true;
+		else if (strcmp(policy, "lru") == 0)
+			replayer_opts.shader_cache_two_queue = false;
+		else
+		{
+			LOGE("Unknown shader cache policy %s.\n", policy);
+			exit(EXIT_FAILURE);
+		}
+	});
+	cbs.add("--priority", [&](CLIParser &parser) {
+		const char *priority = parser.next_string();
+		replayer_opts.cost_order = false;
+		replayer_opts.frequency_order = false;
+		if (strcmp(priority, "cost") == 0)
+			replayer_opts.cost_order = true;
+		else if (strcmp(priority, "frequency") == 0)
+			replayer_opts.frequency_order = true;
+		else if (strcmp(priority, "database") != 0)
+		{
+			LOGE("Unknown priority %s.\n", priority);
+			exit(EXIT_FAILURE);
+		}
+	});
+	cbs.add("--replay-image-dir", [&](CLIParser &parser) { replay_image_dir = parser.next_string(); });
+	cbs.add("--daemon", [&](CLIParser &parser) { daemon_socket = parser.next_string(); });
+	cbs.add("--daemon-slice-size", [&](CLIParser &parser) { daemon_slice_size = parser.next_uint(); });
+	cbs.add("--daemon-max-devices", [&](CLIParser &parser) { daemon_max_devices = parser.next_uint(); });
+	cbs.add("--submit", [&](CLIParser &parser) {
+		daemon_client_socket = parser.next_string();
+		daemon_command = "submit";
+	});
+	cbs.add("--job-priority", [&](CLIParser &parser) { job_priority = parser.next_uint(); });
+	cbs.add("--wait", [&](CLIParser &) { wait_for_job = true; });
+	cbs.add("--daemon-status", [&](CLIParser &parser) {
+		daemon_client_socket = parser.next_string();
+		daemon_command = "status";
+	});
+	cbs.add("--daemon-cancel", [&](CLIParser &parser) {
+		daemon_client_socket = parser.next_string();
+		daemon_command = "cancel\t" + to_string(parser.next_uint());
+	});
+	cbs.add("--daemon-shutdown", [&](CLIParser &parser) {
+		daemon_client_socket = parser.next_string();
+		daemon_command = "shutdown";
+	});
 
 	cbs.error_handler = [] { print_help(); };
 
@@ -2314,7 +5237,45 @@ int main(int argc, char *argv[])
 	if (parser.is_ended_state())
 		return EXIT_SUCCESS;
 
-	if (databases.empty())
+	if (daemon_client_socket)
+	{
+		if (daemon_command == "submit")
+		{
+			if (databases.empty())
+			{
+				LOGE("No databases to submit.\n");
+				return EXIT_FAILURE;
+			}
+
+			daemon_command += "\t" + to_string(job_priority);
+			for (auto *database : databases)
+			{
+				string path;
+				if (!get_absolute_database_path(database, path))
+					return EXIT_FAILURE;
+				daemon_command += "\t" + path;
+			}
+		}
+		else
+			wait_for_job = false;
+
+		return run_daemon_client(daemon_client_socket, daemon_command, wait_for_job);
+	}
+
+	if (!merge_cache_paths.empty() || !merge_journal_paths.empty())
+		return run_merge_shards(opts, replayer_opts, merge_cache_paths, merge_journal_paths);
+
+	// A shard only needs the static objects of its own pipelines.
+	if (replayer_opts.shard_count > 1)
+		replayer_opts.streaming_start = true;
+
+	if (daemon_socket && !databases.empty())
+	{
+		LOGE("Databases are submitted to the daemon with --submit.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (databases.empty() && !daemon_socket)
 	{
 		LOGE("No path to serialized state provided.\n");
 		print_help();
@@ -2335,16 +5296,47 @@ int main(int argc, char *argv[])
 
 	if (!replayer_opts.on_disk_pipeline_cache_path.empty())
 		replayer_opts.pipeline_cache = true;
+
+	// Only robust replays have more than one process to spread across devices.
+	if (!master_process && !progress && !replayer_opts.device_index_list.empty())
+	{
+		vector<unsigned> device_indices;
+		if (!parse_device_index_list(replayer_opts.device_index_list, device_indices))
+			return EXIT_FAILURE;
+		if (device_indices.size() > 1)
+			LOGE("--device-indices needs --progress to use more than one device, using device %u.\n", device_indices.front());
+		opts.device_index = device_indices.front();
+	}
 #endif
 
+	// Child processes stay in here as well.
+	if (!resource_group.empty() && !join_resource_group(resource_group.c_str()))
+		return EXIT_FAILURE;
+
+	if (replayer_opts.pipeline_stats_output_path.empty())
+		replayer_opts.pipeline_stats_output_path = replayer_opts.pipeline_stats_path;
+	if (replayer_opts.pipeline_batch_size < 1)
+		replayer_opts.pipeline_batch_size = 1;
+	if (replayer_opts.cost_order && replayer_opts.pipeline_stats_path.empty())
+		LOGE("--cost-order is used without --pipeline-stats, pipelines will be replayed in database order.\n");
+
+	// Done before any child processes are started, so they are all handed the image.
+	if (!replay_image_dir.empty())
+		if (!resolve_replay_image(replay_image_dir, replayer_opts.module_store_path, databases, replay_image_path))
+			LOGE("Replaying from the archives directly.\n");
+
 #ifndef FOSSILIZE_REPLAYER_SPIRV_VAL
 	if (replayer_opts.spirv_validate)
 		LOGE("--spirv-val is used, but SPIRV-Tools support was not enabled in fossilize-replay. Will be ignored.\n");
 #endif
 
 	int ret;
+	if (daemon_socket)
+	{
+		ret = run_daemon_process(opts, replayer_opts, daemon_socket, daemon_slice_size, daemon_max_devices);
+	}
 #ifndef NO_ROBUST_REPLAYER
-	if (progress)
+	else if (progress)
 	{
 		ret = run_progress_process(opts, replayer_opts, databases, timeout);
 	}
@@ -2364,8 +5356,8 @@ int main(int argc, char *argv[])
 		ret = run_slave_process(opts, replayer_opts, databases);
 #endif
 	}
-	else
 #endif
+	else
 	{
 		ThreadedReplayer replayer(opts, replayer_opts);
 		ret = run_normal_process(replayer, databases);
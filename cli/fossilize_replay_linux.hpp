@@ -70,8 +70,13 @@ static int signal_fd;
 static int epoll_fd;
 static VulkanDevice::Options device_options;
 static bool quiet_slave;
+static chrono::steady_clock::time_point start_time;
 
 static SharedControlBlock *control_block;
+static SharedWorkQueue *work_queue;
+static vector<unsigned> device_indices;
+// Children are forked from the master, so they inherit the prepared databases and decoded static objects.
+static unique_ptr<PreparedReplayState> prepared_state;
 }
 
 struct ProcessProgress
@@ -87,6 +92,10 @@ struct ProcessProgress
 	int compute_progress = -1;
 	int graphics_progress = -1;
 
+	// Under memory pressure, children are held back with SIGSTOP or not started yet.
+	bool started = false;
+	bool stopped = false;
+
 	bool process_once();
 	bool process_shutdown(int wstatus);
 	bool start_child_process();
@@ -95,6 +104,23 @@ struct ProcessProgress
 	uint32_t index = 0;
 };
 
+static void notify_control_block_progress()
+{
+	if (Global::control_block && shared_control_block_bump_progress(Global::control_block))
+		futex_wrapper_wake_all(reinterpret_cast<uint32_t *>(&Global::control_block->progress_sequence));
+}
+
+static void forward_control_block_message(const char *msg)
+{
+	// Only the master writes to the ring, so current control blocks need no lock.
+	bool legacy = shared_control_block_is_legacy(Global::control_block);
+	if (legacy)
+		futex_wrapper_lock(&Global::control_block->futex_lock);
+	shared_control_block_write_message(Global::control_block, msg);
+	if (legacy)
+		futex_wrapper_unlock(&Global::control_block->futex_lock);
+}
+
 void ProcessProgress::parse(const char *cmd)
 {
 	if (strncmp(cmd, "CRASH", 5) == 0)
@@ -120,18 +146,12 @@ void ProcessProgress::parse(const char *cmd)
 		else
 			LOGE("Failed to creater timerfd. Cannot support timeout for process.\n");
 	}
-	else if (strncmp(cmd, "GRAPHICS_VERR", 13) == 0 || strncmp(cmd, "COMPUTE_VERR", 12) == 0)
+	else if (strncmp(cmd, "GRAPHICS_VERR", 13) == 0 || strncmp(cmd, "COMPUTE_VERR", 12) == 0 ||
+	         strncmp(cmd, "SLOW", 4) == 0)
 	{
+		// Just forward the message.
 		if (Global::control_block)
-		{
-			// Just forward the message.
-			char buffer[ControlBlockMessageSize] = {};
-			strcpy(buffer, cmd);
-
-			futex_wrapper_lock(&Global::control_block->futex_lock);
-			shared_control_block_write(Global::control_block, buffer, sizeof(buffer));
-			futex_wrapper_unlock(&Global::control_block->futex_lock);
-		}
+			forward_control_block_message(cmd);
 	}
 	else if (strncmp(cmd, "GRAPHICS", 8) == 0)
 		graphics_progress = int(strtol(cmd + 8, nullptr, 0));
@@ -145,12 +165,7 @@ void ProcessProgress::parse(const char *cmd)
 		if (Global::control_block)
 		{
 			Global::control_block->banned_modules.fetch_add(1, std::memory_order_relaxed);
-			char buffer[ControlBlockMessageSize] = {};
-			strcpy(buffer, cmd);
-
-			futex_wrapper_lock(&Global::control_block->futex_lock);
-			shared_control_block_write(Global::control_block, buffer, sizeof(buffer));
-			futex_wrapper_unlock(&Global::control_block->futex_lock);
+			forward_control_block_message(cmd);
 		}
 	}
 	else
@@ -231,7 +246,19 @@ bool ProcessProgress::process_shutdown(int wstatus)
 
 	start_graphics_index = uint32_t(graphics_progress);
 	start_compute_index = uint32_t(compute_progress);
-	if (start_graphics_index >= end_graphics_index && start_compute_index >= end_compute_index)
+
+	// The child was working on the chunks in its slot, only the part it did not get to is left over.
+	if (Global::work_queue)
+	{
+		auto &slot = Global::work_queue->get_slot(index);
+		end_graphics_index = slot.graphics.end.load(std::memory_order_acquire);
+		end_compute_index = slot.compute.end.load(std::memory_order_acquire);
+		start_graphics_index = min(max(start_graphics_index, slot.graphics.start.load(std::memory_order_relaxed)), end_graphics_index);
+		start_compute_index = min(max(start_compute_index, slot.compute.start.load(std::memory_order_relaxed)), end_compute_index);
+	}
+
+	if (start_graphics_index >= end_graphics_index && start_compute_index >= end_compute_index &&
+	    !(Global::work_queue && Global::work_queue->has_pending_chunks()))
 	{
 		LOGE("Process index %u (PID: %d) crashed, but there is nothing more to replay.\n", index, wait_pid);
 		return false;
@@ -261,14 +288,26 @@ bool ProcessProgress::start_child_process()
 {
 	graphics_progress = -1;
 	compute_progress = -1;
+	started = true;
+	stopped = false;
 
 	if (start_graphics_index >= end_graphics_index &&
-	    start_compute_index >= end_compute_index)
+	    start_compute_index >= end_compute_index &&
+	    !(Global::work_queue && Global::work_queue->has_pending_chunks()))
 	{
 		// Nothing to do.
 		return true;
 	}
 
+	// A restarted child only gets what is left of the time budget.
+	double time_budget = Global::base_replayer_options.time_budget_seconds;
+	if (time_budget > 0.0)
+	{
+		time_budget -= chrono::duration<double>(chrono::steady_clock::now() - Global::start_time).count();
+		if (time_budget <= 0.0)
+			return true;
+	}
+
 	int crash_fds[2];
 	int input_fds[2];
 	if (pipe(crash_fds) < 0)
@@ -276,6 +315,16 @@ bool ProcessProgress::start_child_process()
 	if (pipe(input_fds) < 0)
 		return false;
 
+	// What is left of a crashed child's chunks is its first chunk after the restart.
+	if (Global::work_queue)
+	{
+		auto &slot = Global::work_queue->get_slot(index);
+		slot.graphics.start.store(start_graphics_index, std::memory_order_relaxed);
+		slot.graphics.end.store(end_graphics_index, std::memory_order_relaxed);
+		slot.compute.start.store(start_compute_index, std::memory_order_relaxed);
+		slot.compute.end.store(end_compute_index, std::memory_order_relaxed);
+	}
+
 	pid_t new_pid = fork(); // Fork off a child.
 	if (new_pid > 0)
 	{
@@ -341,18 +390,104 @@ bool ProcessProgress::start_child_process()
 		copy_opts.start_compute_index = start_compute_index;
 		copy_opts.end_compute_index = end_compute_index;
 		copy_opts.control_block = Global::control_block;
-		if (!copy_opts.on_disk_pipeline_cache_path.empty() && index != 0)
+		copy_opts.time_budget_seconds = time_budget;
+		copy_opts.work_queue = Global::work_queue;
+		copy_opts.work_queue_slot = index;
+		if (!copy_opts.on_disk_pipeline_cache_path.empty())
+		{
+			copy_opts.on_disk_pipeline_cache_seed_path =
+				get_child_pipeline_cache_path(copy_opts.on_disk_pipeline_cache_path, Global::device_indices,
+				                              index % std::max<unsigned>(Global::device_indices.size(), 1));
+			copy_opts.on_disk_pipeline_cache_path =
+				get_child_pipeline_cache_path(copy_opts.on_disk_pipeline_cache_path, Global::device_indices, index);
+		}
+
+		// Every child reads the same stats so they agree on the pipeline order, the parent merges what they record.
+		if (!copy_opts.pipeline_stats_output_path.empty())
+		{
+			copy_opts.pipeline_stats_output_path += ".";
+			copy_opts.pipeline_stats_output_path += std::to_string(index);
+		}
+
+		if (!copy_opts.trace_path.empty())
 		{
-			copy_opts.on_disk_pipeline_cache_path += ".";
-			copy_opts.on_disk_pipeline_cache_path += std::to_string(index);
+			copy_opts.trace_path += ".";
+			copy_opts.trace_path += std::to_string(index);
 		}
 
-		exit(run_slave_process(Global::device_options, copy_opts, Global::databases));
+		auto device_opts = Global::device_options;
+		device_opts.device_index = get_child_device_index(Global::device_options, Global::device_indices, index);
+		exit(run_slave_process(device_opts, copy_opts, Global::databases));
 	}
 	else
 		return false;
 }
 
+static uint64_t get_child_resident_bytes(pid_t pid)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/statm", int(pid));
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	unsigned long long total_pages = 0, resident_pages = 0;
+	if (fscanf(file, "%llu %llu", &total_pages, &resident_pages) != 2)
+		resident_pages = 0;
+	fclose(file);
+	return uint64_t(resident_pages) * uint64_t(sysconf(_SC_PAGESIZE));
+}
+
+// Stops or resumes child processes until target_processes of them are running.
+// Children which are recovering from a crash are never stopped, their timeout is ticking.
+static bool balance_child_processes(vector<ProcessProgress> &child_processes, unsigned target_processes)
+{
+	unsigned running = 0;
+	for (auto &child : child_processes)
+		if (child.pid >= 0 && !child.stopped)
+			running++;
+
+	for (auto itr = child_processes.rbegin(); itr != child_processes.rend() && running > target_processes; ++itr)
+	{
+		if (itr->pid >= 0 && !itr->stopped && itr->timer_fd < 0 && kill(itr->pid, SIGSTOP) == 0)
+		{
+			itr->stopped = true;
+			running--;
+		}
+	}
+
+	for (auto &child : child_processes)
+	{
+		if (running >= target_processes)
+			break;
+
+		if (child.pid >= 0 && child.stopped)
+		{
+			if (kill(child.pid, SIGCONT) == 0)
+				child.stopped = false;
+			running++;
+		}
+	}
+
+	for (auto &child : child_processes)
+	{
+		if (running >= target_processes)
+			break;
+
+		if (!child.started)
+		{
+			if (!child.start_child_process())
+				return false;
+			if (child.pid >= 0)
+				running++;
+		}
+	}
+
+	if (Global::control_block)
+		Global::control_block->active_workers.store(running, std::memory_order_relaxed);
+	return true;
+}
+
 static int run_master_process(const VulkanDevice::Options &opts,
                               const ThreadedReplayer::Options &replayer_opts,
                               const vector<const char *> &databases,
@@ -361,13 +496,44 @@ static int run_master_process(const VulkanDevice::Options &opts,
 	Global::quiet_slave = quiet_slave;
 	Global::device_options = opts;
 	Global::base_replayer_options = replayer_opts;
+	Global::start_time = chrono::steady_clock::now();
 	Global::databases = databases;
 	unsigned processes = replayer_opts.num_threads;
 
+	if (!parse_device_index_list(replayer_opts.device_index_list, Global::device_indices))
+		return EXIT_FAILURE;
+	if (processes < Global::device_indices.size())
+		processes = unsigned(Global::device_indices.size());
+	if (!Global::device_indices.empty())
+		LOGI("Replaying with %u processes across %u devices.\n", processes, unsigned(Global::device_indices.size()));
+
 	// Split shader cache overhead across all processes.
-	Global::base_replayer_options.shader_cache_size_mb /= max(Global::base_replayer_options.num_threads, 1u);
+	Global::base_replayer_options.shader_cache_size_mb /= max(processes, 1u);
 	Global::base_replayer_options.num_threads = 1;
 
+	// Children append to their trace fragment every time they are restarted.
+	if (!Global::base_replayer_options.trace_path.empty())
+		remove_trace_fragments(Global::base_replayer_options.trace_path.c_str(), processes);
+
+	// With one thread per child, memory pressure is handled by stopping and resuming whole processes.
+	unsigned memory_headroom_mb = Global::base_replayer_options.memory_headroom_mb;
+	Global::base_replayer_options.memory_headroom_mb = 0;
+	unique_ptr<WorkerThrottle> throttle;
+	unsigned target_processes = processes;
+	if (memory_headroom_mb && processes > 1)
+	{
+		MemoryStatus status = {};
+		if (query_memory_status(status))
+		{
+			throttle.reset(new WorkerThrottle(replayer_opts.min_threads, processes,
+			                                  uint64_t(memory_headroom_mb) * 1024 * 1024));
+			target_processes = throttle->get_active_workers();
+		}
+		else
+			LOGE("Cannot query memory usage on this system, using all %u processes.\n", processes);
+	}
+	auto last_throttle_update = chrono::steady_clock::now();
+
 	// Try to map the shared control block.
 	if (shmem_fd >= 0)
 	{
@@ -383,9 +549,10 @@ static int run_master_process(const VulkanDevice::Options &opts,
 				const auto is_pot = [](size_t size) { return (size & (size - 1)) == 0; };
 				// Detect some obvious shenanigans.
 				Global::control_block = static_cast<SharedControlBlock *>(mapped);
-				if (Global::control_block->version_cookie != ControlBlockMagic ||
+				if ((Global::control_block->version_cookie != ControlBlockMagic &&
+				     Global::control_block->version_cookie != ControlBlockLegacyMagic) ||
 				    Global::control_block->ring_buffer_offset < sizeof(SharedControlBlock) ||
-				    Global::control_block->ring_buffer_size == 0 ||
+				    Global::control_block->ring_buffer_size < ControlBlockMessageSize ||
 				    !is_pot(Global::control_block->ring_buffer_size) ||
 				    Global::control_block->ring_buffer_offset + Global::control_block->ring_buffer_size > size_t(s.st_size))
 				{
@@ -402,22 +569,27 @@ static int run_master_process(const VulkanDevice::Options &opts,
 	size_t num_graphics_pipelines;
 	size_t num_compute_pipelines;
 	{
-		auto db = create_database(databases);
-		if (!db->prepare())
+		// Read-only archives are memory mapped or read with positional reads, so the children can share them.
+		// The master never creates a Vulkan device or any threads, so it is safe to fork() from.
+		Global::prepared_state.reset(new PreparedReplayState);
+		if (!prepare_replay_state(databases, replayer_opts.module_store_path, replayer_opts.streaming_start,
+		                          *Global::prepared_state))
 		{
 			for (auto &path : databases)
 				LOGE("Failed to parse database %s.\n", path);
 			return EXIT_FAILURE;
 		}
 
-		if (!db->get_hash_list_for_resource_tag(RESOURCE_GRAPHICS_PIPELINE, &num_graphics_pipelines, nullptr))
+		auto *db = Global::prepared_state->database.get();
+
+		if (!get_shard_pipeline_count(*db, replayer_opts, RESOURCE_GRAPHICS_PIPELINE, &num_graphics_pipelines))
 		{
 			for (auto &path : databases)
 				LOGE("Failed to parse database %s.\n", path);
 			return EXIT_FAILURE;
 		}
 
-		if (!db->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &num_compute_pipelines, nullptr))
+		if (!get_shard_pipeline_count(*db, replayer_opts, RESOURCE_COMPUTE_PIPELINE, &num_compute_pipelines))
 		{
 			for (auto &path : databases)
 				LOGE("Failed to parse database %s.\n", path);
@@ -427,6 +599,7 @@ static int run_master_process(const VulkanDevice::Options &opts,
 
 	if (Global::control_block)
 		Global::control_block->progress_started.store(1, std::memory_order_release);
+	notify_control_block_progress();
 
 	Global::active_processes = 0;
 
@@ -475,26 +648,58 @@ static int run_master_process(const VulkanDevice::Options &opts,
 		}
 	}
 
+	// Children pull chunks of pipelines from a shared work queue, so a child which is stuck on slow pipelines
+	// or recovering from a crash does not hold up the rest. Fall back to a fixed slice per child without one.
+	size_t work_queue_size = SharedWorkQueue::get_size(processes);
+	void *work_queue_mapping = mmap(nullptr, work_queue_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (work_queue_mapping != MAP_FAILED)
+	{
+		// Small enough chunks to even out the tail, large enough to keep the per-chunk sync rare.
+		const auto get_chunk_size = [&](size_t count) -> uint32_t {
+			return uint32_t(max<size_t>(16, min<size_t>(1024, count / (8 * processes))));
+		};
+
+		// Anonymous mappings are zero-filled, so every slot starts out empty.
+		Global::work_queue = static_cast<SharedWorkQueue *>(work_queue_mapping);
+		Global::work_queue->graphics_count = uint32_t(num_graphics_pipelines);
+		Global::work_queue->compute_count = uint32_t(num_compute_pipelines);
+		Global::work_queue->graphics_chunk_size = get_chunk_size(num_graphics_pipelines);
+		Global::work_queue->compute_chunk_size = get_chunk_size(num_compute_pipelines);
+	}
+	else
+		LOGE("Failed to map shared work queue, every child process replays a fixed slice.\n");
+
 	// fork() and pipe() strategy.
 	for (unsigned i = 0; i < processes; i++)
 	{
 		auto &progress = child_processes[i];
-		progress.start_graphics_index = (i * unsigned(num_graphics_pipelines)) / processes;
-		progress.end_graphics_index = ((i + 1) * unsigned(num_graphics_pipelines)) / processes;
-		progress.start_compute_index = (i * unsigned(num_compute_pipelines)) / processes;
-		progress.end_compute_index = ((i + 1) * unsigned(num_compute_pipelines)) / processes;
-		progress.index = i;
-		if (!progress.start_child_process())
+		if (Global::work_queue)
 		{
-			LOGE("Failed to start child process.\n");
-			return EXIT_FAILURE;
+			progress.start_graphics_index = 0;
+			progress.end_graphics_index = 0;
+			progress.start_compute_index = 0;
+			progress.end_compute_index = 0;
+		}
+		else
+		{
+			progress.start_graphics_index = (i * unsigned(num_graphics_pipelines)) / processes;
+			progress.end_graphics_index = ((i + 1) * unsigned(num_graphics_pipelines)) / processes;
+			progress.start_compute_index = (i * unsigned(num_compute_pipelines)) / processes;
+			progress.end_compute_index = ((i + 1) * unsigned(num_compute_pipelines)) / processes;
 		}
+		progress.index = i;
+	}
+
+	if (!balance_child_processes(child_processes, target_processes))
+	{
+		LOGE("Failed to start child process.\n");
+		return EXIT_FAILURE;
 	}
 
 	while (Global::active_processes != 0)
 	{
 		epoll_event events[64];
-		int ret = epoll_wait(Global::epoll_fd, events, 64, -1);
+		int ret = epoll_wait(Global::epoll_fd, events, 64, throttle ? 250 : -1);
 		if (ret < 0)
 		{
 			LOGE("epoll_wait() failed.\n");
@@ -588,10 +793,67 @@ static int run_master_process(const VulkanDevice::Options &opts,
 				}
 			}
 		}
+
+		// Children report every pipeline they start on, so this keeps up with their progress counters.
+		notify_control_block_progress();
+
+		auto current_time = chrono::steady_clock::now();
+		if (throttle && current_time - last_throttle_update >= chrono::milliseconds(250))
+		{
+			last_throttle_update = current_time;
+			MemoryStatus status = {};
+			if (query_memory_status(status))
+			{
+				uint64_t worker_bytes = 0;
+				for (auto &child : child_processes)
+					if (child.pid >= 0 && !child.stopped)
+						worker_bytes += get_child_resident_bytes(child.pid);
+
+				unsigned new_target = throttle->update(status.available_bytes, worker_bytes);
+				if (new_target != target_processes)
+					LOGI("Memory pressure: %u of %u replayer processes active.\n", new_target, processes);
+				target_processes = new_target;
+			}
+		}
+
+		// Children which finish leave room for the ones which have not started yet.
+		if (!balance_child_processes(child_processes, target_processes))
+		{
+			LOGE("Failed to start child process.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!Global::base_replayer_options.pipeline_stats_output_path.empty())
+		merge_pipeline_stats_shards(Global::base_replayer_options.pipeline_stats_output_path.c_str(), processes);
+	if (!Global::base_replayer_options.trace_path.empty())
+		merge_trace_fragments(Global::base_replayer_options.trace_path.c_str(), processes);
+	if (!Global::base_replayer_options.on_disk_pipeline_cache_path.empty())
+	{
+		merge_pipeline_cache_shards(Global::device_options, Global::base_replayer_options.on_disk_pipeline_cache_path,
+		                            Global::device_indices, processes);
+	}
+
+	if (Global::work_queue)
+	{
+		munmap(Global::work_queue, work_queue_size);
+		Global::work_queue = nullptr;
+	}
+	Global::prepared_state.reset();
+
+	if (Global::control_block && !shared_control_block_is_legacy(Global::control_block))
+	{
+		uint32_t dropped = Global::control_block->messages_dropped.load(std::memory_order_relaxed);
+		if (dropped)
+		{
+			LOGE("Dropped %u of %u messages to the control block.\n", dropped,
+			     dropped + Global::control_block->messages_written.load(std::memory_order_relaxed));
+		}
 	}
 
 	if (Global::control_block)
 		Global::control_block->progress_complete.store(1, std::memory_order_release);
+	notify_control_block_progress();
 
 	return EXIT_SUCCESS;
 }
@@ -618,6 +880,13 @@ static void validation_error_cb(ThreadedReplayer *replayer)
 	}
 }
 
+static void slow_object_cb(ControlBlockLatencyType type, Hash hash, uint64_t duration_ns)
+{
+	char buffer[ControlBlockMessageSize];
+	control_block_format_slow_object(buffer, type, hash, duration_ns / 1000000);
+	write_all(crash_fd, buffer);
+}
+
 static void crash_handler(int)
 {
 	// stderr is reserved for generic logging.
@@ -694,6 +963,8 @@ static int run_slave_process(const VulkanDevice::Options &opts,
 	auto tmp_opts = replayer_opts;
 	tmp_opts.on_thread_callback = thread_callback;
 	tmp_opts.on_validation_error_callback = validation_error_cb;
+	tmp_opts.on_slow_object_callback = slow_object_cb;
+	tmp_opts.trace_fragment = true;
 	ThreadedReplayer replayer(opts, tmp_opts);
 	replayer.robustness = true;
 
@@ -747,7 +1018,7 @@ static int run_slave_process(const VulkanDevice::Options &opts,
 	if (pthread_sigmask(SIG_BLOCK, &mask, &old_mask) < 0)
 		return EXIT_FAILURE;
 
-	int ret = run_normal_process(replayer, databases);
+	int ret = run_normal_process(replayer, databases, Global::prepared_state.get());
 	global_replayer = nullptr;
 
 	// Cannot reliably handle these signals if they occur during teardown of the process.
@@ -762,13 +1033,7 @@ static int run_slave_process(const VulkanDevice::Options &opts,
 
 #if 0
 	if (Global::control_block)
-	{
-		futex_wrapper_lock(&Global::control_block->futex_lock);
-		char msg[ControlBlockMessageSize] = {};
-		sprintf(msg, "SLAVE_FINISHED\n");
-		shared_control_block_write(Global::control_block, msg, sizeof(msg));
-		futex_wrapper_unlock(&Global::control_block->futex_lock);
-	}
+		forward_control_block_message("SLAVE_FINISHED\n");
 #endif
 
 	return ret;
@@ -62,7 +62,12 @@ static SharedControlBlock *control_block;
 static const char *shm_name;
 static const char *shm_mutex_name;
 static HANDLE shared_mutex;
+static HANDLE progress_event;
 static HANDLE job_handle;
+// Pipe reads and process exits of all children complete here.
+static HANDLE completion_port;
+static chrono::steady_clock::time_point start_time;
+static vector<unsigned> device_indices;
 }
 
 struct ProcessProgress
@@ -73,8 +78,7 @@ struct ProcessProgress
 	unsigned end_compute_index = ~0u;
 	HANDLE process = nullptr;
 	HANDLE crash_file_handle = INVALID_HANDLE_VALUE;
-	HANDLE timer_handle = nullptr;
-	HANDLE pipe_event = nullptr;
+	HANDLE exit_wait = nullptr;
 
 	OVERLAPPED overlapped_pipe = {};
 	char async_pipe_buffer[1024];
@@ -82,19 +86,43 @@ struct ProcessProgress
 	int compute_progress = -1;
 	int graphics_progress = -1;
 
-	bool process_once();
+	// Once a child has crashed, it has until the deadline to exit on its own.
+	bool has_crash_deadline = false;
+	chrono::steady_clock::time_point crash_deadline;
+
+	// A child is only shut down once it has exited and we have read everything it sent us,
+	// the two can complete in either order.
+	bool exited = false;
+	bool pipe_closed = false;
+
+	bool process_once(bool success, DWORD did_read);
 	bool process_shutdown();
 	bool start_child_process();
 	void parse(const char *cmd);
 	bool kick_overlapped_io();
+	ULONG_PTR get_completion_key(unsigned type) const;
 
 	uint32_t index = 0;
+	// Bumped every time the child is started, so completions for an earlier process can be ignored.
+	uint32_t generation = 0;
 };
 
+enum { COMPLETION_PIPE = 0, COMPLETION_EXIT = 1 };
+
+// Must fit in 32 bits.
+ULONG_PTR ProcessProgress::get_completion_key(unsigned type) const
+{
+	return (ULONG_PTR(generation & 0xffffu) << 16) | (ULONG_PTR(index & 0x3fffu) << 2) | type;
+}
+
+static void CALLBACK on_child_process_exit(void *context, BOOLEAN)
+{
+	PostQueuedCompletionStatus(Global::completion_port, 0, reinterpret_cast<ULONG_PTR>(context), nullptr);
+}
+
 bool ProcessProgress::kick_overlapped_io()
 {
 	memset(&overlapped_pipe, 0, sizeof(overlapped_pipe));
-	overlapped_pipe.hEvent = pipe_event;
 
 	// The PIPE_TYPE_MESSSAGE mode makes sure that we read messages one at a time and not random binary data,
 	// so it's safe to do a large read here.
@@ -107,42 +135,35 @@ bool ProcessProgress::kick_overlapped_io()
 	return true;
 }
 
-void ProcessProgress::parse(const char *cmd)
+static void forward_control_block_message(const char *msg)
 {
-	if (strncmp(cmd, "CRASH", 5) == 0)
+	// Only the master writes to the ring, so current control blocks need no lock.
+	if (shared_control_block_is_legacy(Global::control_block))
 	{
-		// We crashed ... Set up a timeout in case the process hangs while trying to recover.
-		if (timer_handle)
+		if (WaitForSingleObject(Global::shared_mutex, INFINITE) == WAIT_OBJECT_0)
 		{
-			CloseHandle(timer_handle);
-			timer_handle = nullptr;
+			shared_control_block_write_message(Global::control_block, msg);
+			ReleaseMutex(Global::shared_mutex);
 		}
+	}
+	else
+		shared_control_block_write_message(Global::control_block, msg);
+}
 
-		timer_handle = CreateWaitableTimer(nullptr, TRUE, nullptr);
-		if (timer_handle)
-		{
-			LARGE_INTEGER due_time;
-			due_time.QuadPart = -10000000ll;
-			if (!SetWaitableTimer(timer_handle, &due_time, 0, nullptr, nullptr, 0))
-				LOGE("Failed to set waitable timer.\n");
-		}
-		else
-			LOGE("Failed to create waitable timer.\n");
+void ProcessProgress::parse(const char *cmd)
+{
+	if (strncmp(cmd, "CRASH", 5) == 0)
+	{
+		// We crashed ... Set up a timeout in case the process hangs while trying to recover.
+		has_crash_deadline = true;
+		crash_deadline = chrono::steady_clock::now() + chrono::seconds(1);
 	}
-	else if (strncmp(cmd, "GRAPHICS_VERR", 13) == 0 || strncmp(cmd, "COMPUTE_VERR", 12) == 0)
+	else if (strncmp(cmd, "GRAPHICS_VERR", 13) == 0 || strncmp(cmd, "COMPUTE_VERR", 12) == 0 ||
+	         strncmp(cmd, "SLOW", 4) == 0)
 	{
+		// Just forward the message.
 		if (Global::control_block)
-		{
-			// Just forward the message.
-			char buffer[ControlBlockMessageSize] = {};
-			strcpy(buffer, cmd);
-
-			if (WaitForSingleObject(Global::shared_mutex, INFINITE) == WAIT_OBJECT_0)
-			{
-				shared_control_block_write(Global::control_block, buffer, sizeof(buffer));
-				ReleaseMutex(Global::shared_mutex);
-			}
-		}
+			forward_control_block_message(cmd);
 	}
 	else if (strncmp(cmd, "GRAPHICS", 8) == 0)
 		graphics_progress = int(strtol(cmd + 8, nullptr, 0));
@@ -156,35 +177,17 @@ void ProcessProgress::parse(const char *cmd)
 		if (Global::control_block)
 		{
 			Global::control_block->banned_modules.fetch_add(1, std::memory_order_relaxed);
-			char buffer[ControlBlockMessageSize] = {};
-			strcpy(buffer, cmd);
-
-			if (WaitForSingleObject(Global::shared_mutex, INFINITE) == WAIT_OBJECT_0)
-			{
-				shared_control_block_write(Global::control_block, buffer, sizeof(buffer));
-				ReleaseMutex(Global::shared_mutex);
-			}
+			forward_control_block_message(cmd);
 		}
 	}
 	else
 		LOGE("Got unexpected message from child: %s\n", cmd);
 }
 
-bool ProcessProgress::process_once()
+// Handles a completed read from the pipe. Returns false once the pipe is done.
+bool ProcessProgress::process_once(bool success, DWORD did_read)
 {
-	if (crash_file_handle == INVALID_HANDLE_VALUE)
-		return false;
-
-	DWORD did_read = 0;
-
-	// The event should be reset when calling kick_overlapped_io, but we might fail before that.
-	if (!ResetEvent(pipe_event))
-	{
-		LOGE("Failed to reset event.\n");
-		return false;
-	}
-
-	if (!GetOverlappedResult(crash_file_handle, &overlapped_pipe, &did_read, TRUE))
+	if (crash_file_handle == INVALID_HANDLE_VALUE || !success)
 		return false;
 
 	if (did_read < sizeof(async_pipe_buffer))
@@ -203,38 +206,32 @@ bool ProcessProgress::process_once()
 		return false;
 }
 
+// Called once the process has exited and its pipe is closed, so all messages have been seen.
 bool ProcessProgress::process_shutdown()
 {
-	// Flush out all messages we got.
-	while (process_once());
 	if (crash_file_handle != INVALID_HANDLE_VALUE)
 		CloseHandle(crash_file_handle);
 	crash_file_handle = INVALID_HANDLE_VALUE;
+	has_crash_deadline = false;
 
-	// Close some handles.
-	if (timer_handle)
+	// The wait callback has already run, this just releases it.
+	if (exit_wait)
 	{
-		CloseHandle(timer_handle);
-		timer_handle = nullptr;
-	}
-
-	if (pipe_event)
-	{
-		CloseHandle(pipe_event);
-		pipe_event = nullptr;
+		UnregisterWaitEx(exit_wait, INVALID_HANDLE_VALUE);
+		exit_wait = nullptr;
 	}
 
 	// Reap child process.
 	DWORD code = 0;
 	if (process)
 	{
-		if (WaitForSingleObject(process, INFINITE) != WAIT_OBJECT_0)
-			return false;
 		if (!GetExitCodeProcess(process, &code))
 			LOGE("Failed to get exit code of process.\n");
 		CloseHandle(process);
 		process = nullptr;
 		Global::active_processes--;
+		if (Global::control_block)
+			Global::control_block->active_workers.store(Global::active_processes, std::memory_order_relaxed);
 	}
 
 	// If application exited in normal manner, we are done.
@@ -285,9 +282,8 @@ static void send_faulty_modules_and_close(HANDLE file)
 static bool CreateCustomPipe(HANDLE *read_pipe, HANDLE *write_pipe, LPSECURITY_ATTRIBUTES attrs, bool overlapped_read)
 {
 	// This is a very unfortunate detail of this implementation.
-	// Windows does not support using WaitFor*Object on Pipes, so CreatePipe() is out the window.
-	// We have to use overlapped I/O to make this work in practice.
-	// When we have overlapped I/O on pipes, we can use CreateEvent to get WaitFor*() working.
+	// Anonymous pipes from CreatePipe() do not support overlapped I/O,
+	// which we need to have every child report to the same completion port.
 	// We also really want to use PIPE_TYPE_MESSAGE here.
 	// This is so that we can safely read one message at a time with ReadFile rather than rely on fgets to delimit each message for us.
 	static unsigned pipe_serial;
@@ -313,6 +309,10 @@ bool ProcessProgress::start_child_process()
 {
 	graphics_progress = -1;
 	compute_progress = -1;
+	has_crash_deadline = false;
+	exited = false;
+	pipe_closed = false;
+	generation++;
 
 	if (start_graphics_index >= end_graphics_index && start_compute_index >= end_compute_index)
 	{
@@ -320,6 +320,15 @@ bool ProcessProgress::start_child_process()
 		return true;
 	}
 
+	// A restarted child only gets what is left of the time budget.
+	double time_budget = Global::base_replayer_options.time_budget_seconds;
+	if (time_budget > 0.0)
+	{
+		time_budget -= chrono::duration<double>(chrono::steady_clock::now() - Global::start_time).count();
+		if (time_budget <= 0.0)
+			return true;
+	}
+
 	// We cannot use fork() on Windows, so we need to create a new process which references ourselves.
 
 	char filename[MAX_PATH];
@@ -350,7 +359,7 @@ bool ProcessProgress::start_child_process()
 	cmdline += to_string(end_compute_index);
 
 	cmdline += " --device-index ";
-	cmdline += std::to_string(Global::device_options.device_index);
+	cmdline += std::to_string(get_child_device_index(Global::device_options, Global::device_indices, index));
 
 	if (Global::device_options.enable_validation)
 		cmdline += " --enable-validation";
@@ -369,6 +378,8 @@ bool ProcessProgress::start_child_process()
 
 	if (Global::base_replayer_options.pipeline_cache)
 		cmdline += " --pipeline-cache";
+	if (Global::base_replayer_options.pipeline_cache_per_thread)
+		cmdline += " --pipeline-cache-per-thread";
 	if (Global::base_replayer_options.spirv_validate)
 		cmdline += " --spirv-val";
 	if (Global::device_options.null_device)
@@ -378,15 +389,19 @@ bool ProcessProgress::start_child_process()
 	{
 		cmdline += " --on-disk-pipeline-cache ";
 		cmdline += "\"";
-		cmdline += Global::base_replayer_options.on_disk_pipeline_cache_path;
-		if (index != 0)
-		{
-			cmdline += ".";
-			cmdline += std::to_string(index);
-		}
+		cmdline += get_child_pipeline_cache_path(Global::base_replayer_options.on_disk_pipeline_cache_path,
+		                                         Global::device_indices, index);
+		cmdline += "\"";
+		cmdline += " --on-disk-pipeline-cache-seed ";
+		cmdline += "\"";
+		cmdline += get_child_pipeline_cache_path(Global::base_replayer_options.on_disk_pipeline_cache_path,
+		                                         Global::device_indices,
+		                                         index % std::max<unsigned>(Global::device_indices.size(), 1));
 		cmdline += "\"";
-		// TODO: Merge the on-disk pipeline caches, but it's probably not that important.
-		// We're supposed to populate the driver caches here first and foremost.
+		cmdline += " --pipeline-cache-checkpoint-seconds ";
+		cmdline += std::to_string(Global::base_replayer_options.pipeline_cache_checkpoint_seconds);
+		cmdline += " --pipeline-cache-checkpoint-pipelines ";
+		cmdline += std::to_string(Global::base_replayer_options.pipeline_cache_checkpoint_pipelines);
 	}
 
 	cmdline += " --shader-cache-size ";
@@ -395,6 +410,104 @@ bool ProcessProgress::start_child_process()
 	if (Global::base_replayer_options.ignore_derived_pipelines)
 		cmdline += " --ignore-derived-pipelines";
 
+	if (Global::base_replayer_options.shader_locality_order)
+		cmdline += " --shader-locality-order";
+
+	if (Global::base_replayer_options.cost_order)
+		cmdline += " --cost-order";
+
+	if (Global::base_replayer_options.cache_probe_only)
+		cmdline += " --cache-probe-only";
+	else if (Global::base_replayer_options.cache_probe)
+		cmdline += " --cache-probe";
+
+	if (!Global::base_replayer_options.journal_path.empty())
+	{
+		cmdline += " --journal \"";
+		cmdline += Global::base_replayer_options.journal_path;
+		cmdline += "\"";
+	}
+
+	if (!Global::base_replayer_options.module_store_path.empty())
+	{
+		cmdline += " --module-store \"";
+		cmdline += Global::base_replayer_options.module_store_path;
+		cmdline += "\"";
+	}
+
+	if (Global::base_replayer_options.full_replay)
+		cmdline += " --full";
+
+	if (Global::base_replayer_options.streaming_start)
+		cmdline += " --streaming";
+
+	if (Global::base_replayer_options.shard_count > 1)
+	{
+		cmdline += " --shard ";
+		cmdline += std::to_string(Global::base_replayer_options.shard_index);
+		cmdline += "/";
+		cmdline += std::to_string(Global::base_replayer_options.shard_count);
+	}
+
+	if (Global::base_replayer_options.frequency_order)
+		cmdline += " --priority frequency";
+
+	if (Global::base_replayer_options.shader_cache_two_queue)
+		cmdline += " --shader-cache-policy 2q";
+
+	if (!Global::base_replayer_options.worker_cpu_list.empty())
+	{
+		cmdline += " --worker-cpus ";
+		cmdline += Global::base_replayer_options.worker_cpu_list;
+	}
+
+	if (Global::base_replayer_options.worker_core_type != CoreType::Any)
+	{
+		cmdline += " --core-type ";
+		cmdline += get_core_type_name(Global::base_replayer_options.worker_core_type);
+	}
+
+	if (Global::base_replayer_options.background_priority)
+		cmdline += " --background-priority";
+
+	if (time_budget > 0.0)
+	{
+		cmdline += " --time-budget ";
+		cmdline += std::to_string(time_budget);
+	}
+
+	if (Global::base_replayer_options.pipeline_batch_size > 1)
+	{
+		cmdline += " --pipeline-batch-size ";
+		cmdline += std::to_string(Global::base_replayer_options.pipeline_batch_size);
+	}
+
+	// Every child reads the same stats so they agree on the pipeline order, the parent merges what they record.
+	if (!Global::base_replayer_options.pipeline_stats_path.empty())
+	{
+		cmdline += " --pipeline-stats \"";
+		cmdline += Global::base_replayer_options.pipeline_stats_path;
+		cmdline += "\"";
+	}
+
+	if (!Global::base_replayer_options.pipeline_stats_output_path.empty())
+	{
+		cmdline += " --pipeline-stats-output \"";
+		cmdline += Global::base_replayer_options.pipeline_stats_output_path;
+		cmdline += ".";
+		cmdline += std::to_string(index);
+		cmdline += "\"";
+	}
+
+	if (!Global::base_replayer_options.trace_path.empty())
+	{
+		cmdline += " --trace \"";
+		cmdline += Global::base_replayer_options.trace_path;
+		cmdline += ".";
+		cmdline += std::to_string(index);
+		cmdline += "\"";
+	}
+
 	// Create custom named pipes which can be inherited by our child processes.
 	SECURITY_ATTRIBUTES attrs = {};
 	attrs.bInheritHandle = TRUE;
@@ -494,16 +607,26 @@ bool ProcessProgress::start_child_process()
 
 	crash_file_handle = master_stdout_read;
 	Global::active_processes++;
+	if (Global::control_block)
+		Global::control_block->active_workers.store(Global::active_processes, std::memory_order_relaxed);
 
-	pipe_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
-	if (!pipe_event)
+	if (!CreateIoCompletionPort(crash_file_handle, Global::completion_port, get_completion_key(COMPLETION_PIPE), 0))
 	{
-		LOGE("Failed to create event.\n");
+		LOGE("Failed to associate pipe with completion port.\n");
+		return false;
+	}
+
+	// The thread pool posts to the completion port once the process exits.
+	if (!RegisterWaitForSingleObject(&exit_wait, process, on_child_process_exit,
+	                                 reinterpret_cast<void *>(get_completion_key(COMPLETION_EXIT)),
+	                                 INFINITE, WT_EXECUTEONLYONCE))
+	{
+		LOGE("Failed to register wait for child process.\n");
 		return false;
 	}
 
 	// Kick an asynchronous read from the pipe here.
-	// The pipe_event will signal once something happens.
+	// It completes to the completion port once something happens.
 	if (!kick_overlapped_io())
 	{
 		LOGE("Failed to start overlapped I/O.\n");
@@ -547,9 +670,10 @@ static bool open_shm(const char *shm_path, const char *shm_mutex_path)
 	const auto is_pot = [](size_t size) { return (size & (size - 1)) == 0; };
 	// Detect some obvious shenanigans.
 	Global::control_block = static_cast<SharedControlBlock *>(mapped);
-	if (Global::control_block->version_cookie != ControlBlockMagic ||
+	if ((Global::control_block->version_cookie != ControlBlockMagic &&
+	     Global::control_block->version_cookie != ControlBlockLegacyMagic) ||
 	    Global::control_block->ring_buffer_offset < sizeof(SharedControlBlock) ||
-	    Global::control_block->ring_buffer_size == 0 ||
+	    Global::control_block->ring_buffer_size < ControlBlockMessageSize ||
 	    !is_pot(Global::control_block->ring_buffer_size))
 	{
 		LOGE("Control block is corrupt.\n");
@@ -562,9 +686,20 @@ static bool open_shm(const char *shm_path, const char *shm_mutex_path)
 	if (!Global::shared_mutex)
 		return false;
 
+	// Older ExternalReplayers do not create this, which is fine.
+	std::string progress_event_name = shm_mutex_path;
+	progress_event_name += "-progress";
+	Global::progress_event = OpenEventA(EVENT_MODIFY_STATE, FALSE, progress_event_name.c_str());
+
 	return true;
 }
 
+static void notify_control_block_progress()
+{
+	if (Global::control_block && shared_control_block_bump_progress(Global::control_block) && Global::progress_event)
+		SetEvent(Global::progress_event);
+}
+
 static int run_master_process(const VulkanDevice::Options &opts,
                               const ThreadedReplayer::Options &replayer_opts,
                               const vector<const char *> &databases,
@@ -573,15 +708,27 @@ static int run_master_process(const VulkanDevice::Options &opts,
 	Global::quiet_slave = quiet_slave;
 	Global::device_options = opts;
 	Global::base_replayer_options = replayer_opts;
+	Global::start_time = chrono::steady_clock::now();
 	Global::databases = databases;
 	unsigned processes = replayer_opts.num_threads;
 	Global::shm_name = shm_name;
 	Global::shm_mutex_name = shm_mutex_name;
 
+	if (!parse_device_index_list(replayer_opts.device_index_list, Global::device_indices))
+		return EXIT_FAILURE;
+	if (processes < Global::device_indices.size())
+		processes = unsigned(Global::device_indices.size());
+	if (!Global::device_indices.empty())
+		LOGI("Replaying with %u processes across %u devices.\n", processes, unsigned(Global::device_indices.size()));
+
 	// Split shader cache overhead across all processes.
-	Global::base_replayer_options.shader_cache_size_mb /= max(Global::base_replayer_options.num_threads, 1u);
+	Global::base_replayer_options.shader_cache_size_mb /= max(processes, 1u);
 	Global::base_replayer_options.num_threads = 1;
 
+	// Children append to their trace fragment every time they are restarted.
+	if (!Global::base_replayer_options.trace_path.empty())
+		remove_trace_fragments(Global::base_replayer_options.trace_path.c_str(), processes);
+
 	Global::job_handle = CreateJobObjectA(nullptr, nullptr);
 	if (!Global::job_handle)
 	{
@@ -618,14 +765,14 @@ static int run_master_process(const VulkanDevice::Options &opts,
 			return EXIT_FAILURE;
 		}
 
-		if (!db->get_hash_list_for_resource_tag(RESOURCE_GRAPHICS_PIPELINE, &num_graphics_pipelines, nullptr))
+		if (!get_shard_pipeline_count(*db, replayer_opts, RESOURCE_GRAPHICS_PIPELINE, &num_graphics_pipelines))
 		{
 			for (auto &path : databases)
 				LOGE("Failed to parse database %s.\n", path);
 			return EXIT_FAILURE;
 		}
 
-		if (!db->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &num_compute_pipelines, nullptr))
+		if (!get_shard_pipeline_count(*db, replayer_opts, RESOURCE_COMPUTE_PIPELINE, &num_compute_pipelines))
 		{
 			for (auto &path : databases)
 				LOGE("Failed to parse database %s.\n", path);
@@ -635,10 +782,17 @@ static int run_master_process(const VulkanDevice::Options &opts,
 
 	if (Global::control_block)
 		Global::control_block->progress_started.store(1, std::memory_order_release);
+	notify_control_block_progress();
+
+	Global::completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+	if (!Global::completion_port)
+	{
+		LOGE("Failed to create completion port.\n");
+		return EXIT_FAILURE;
+	}
 
 	Global::active_processes = 0;
 	vector<ProcessProgress> child_processes(processes);
-	vector<HANDLE> wait_handles;
 
 	// CreateProcess for our children.
 	for (unsigned i = 0; i < processes; i++)
@@ -656,94 +810,116 @@ static int run_master_process(const VulkanDevice::Options &opts,
 		}
 	}
 
-	wait_handles.reserve(3 * processes);
-
 	while (Global::active_processes != 0)
 	{
-		wait_handles.clear();
-
-		// Per process, three events can trigger:
-		// - Process HANDLE is signalled, the child process completed.
-		// - pipe_event is signalled, an asynchronous read operation on the pipe completed.
-		// - Timer event is signalled. This marks a timeout on the process which is trying to crash gracefully.
+		// The only thing we wait for without a completion is a crashing child which does not exit in time.
+		auto current_time = chrono::steady_clock::now();
+		DWORD timeout = INFINITE;
 		for (auto &process : child_processes)
 		{
-			// Prioritize that any file I/O events are signalled before process end.
-			// WaitForMultipleObjects must return the first object which is signalled.
-			if (process.pipe_event)
-				wait_handles.push_back(process.pipe_event);
-			if (process.process)
-				wait_handles.push_back(process.process);
-			if (process.timer_handle)
-				wait_handles.push_back(process.timer_handle);
+			if (!process.process || !process.has_crash_deadline)
+				continue;
+
+			auto remaining = chrono::duration_cast<chrono::milliseconds>(process.crash_deadline - current_time).count();
+			DWORD remaining_ms = remaining > 0 ? DWORD(remaining) : 0;
+			if (remaining_ms < timeout)
+				timeout = remaining_ms;
 		}
 
-		// Basically like poll(), except we had to a lot of work to get here ...
-		DWORD ret = WaitForMultipleObjects(wait_handles.size(), wait_handles.data(), FALSE, INFINITE);
-		if (ret == WAIT_FAILED)
+		// Basically like epoll_wait().
+		DWORD did_read = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED *overlapped = nullptr;
+		BOOL success = GetQueuedCompletionStatus(Global::completion_port, &did_read, &key, &overlapped, timeout);
+
+		if (!success && !overlapped && GetLastError() != WAIT_TIMEOUT)
 		{
-			LOGE("WaitForMultipleObjects failed.\n");
+			LOGE("GetQueuedCompletionStatus failed.\n");
 			log_and_die();
 			return EXIT_FAILURE;
 		}
-		else if (ret == WAIT_TIMEOUT)
-			continue;
-		else if (ret >= WAIT_ABANDONED_0)
-			continue;
-		else if (ret >= WAIT_OBJECT_0 && ret < WAIT_OBJECT_0 + wait_handles.size())
-		{
-			// Handle the event accordingly.
-			HANDLE handle = wait_handles[ret - WAIT_OBJECT_0];
-			auto process_itr = find_if(begin(child_processes), end(child_processes), [&](const ProcessProgress &prog) {
-				return prog.process == handle;
-			});
-
-			auto event_itr = find_if(begin(child_processes), end(child_processes), [&](const ProcessProgress &prog) {
-				return prog.pipe_event == handle;
-			});
 
-			auto timer_itr = find_if(begin(child_processes), end(child_processes), [&](const ProcessProgress &prog) {
-				return prog.timer_handle == handle;
-			});
+		if (success || overlapped)
+		{
+			unsigned type = unsigned(key & 3);
+			unsigned index = unsigned((key >> 2) & 0x3fffu);
+			unsigned generation = unsigned((key >> 16) & 0xffffu);
 
-			if (process_itr != end(child_processes))
+			// Completions for a process which has already been replaced are stale.
+			if (index < child_processes.size() && (child_processes[index].generation & 0xffffu) == generation &&
+			    child_processes[index].process)
 			{
-				// The process finished.
-				if (process_itr->process_shutdown() && !process_itr->start_child_process())
+				auto &proc = child_processes[index];
+				if (type == COMPLETION_PIPE)
+				{
+					if (!proc.process_once(success != FALSE, did_read))
+					{
+						if (proc.crash_file_handle != INVALID_HANDLE_VALUE)
+							CloseHandle(proc.crash_file_handle);
+						proc.crash_file_handle = INVALID_HANDLE_VALUE;
+						proc.pipe_closed = true;
+					}
+				}
+				else if (type == COMPLETION_EXIT)
+					proc.exited = true;
+
+				if (proc.exited && proc.pipe_closed && proc.process_shutdown() && !proc.start_child_process())
 				{
 					LOGE("Failed to start child process.\n");
 					return EXIT_FAILURE;
 				}
 			}
-			else if (event_itr != end(child_processes))
-			{
-				// Read a command, and queue up a new async read.
-				event_itr->process_once();
-			}
-			else if (timer_itr != end(child_processes))
+		}
+
+		current_time = chrono::steady_clock::now();
+		for (auto &process : child_processes)
+		{
+			if (process.process && process.has_crash_deadline && current_time >= process.crash_deadline)
 			{
+				// The exit completes to the port like any other, and the child is restarted from there.
 				LOGE("Terminating process due to timeout ...\n");
-				if (!TerminateProcess(timer_itr->process, 3))
+				process.has_crash_deadline = false;
+				if (!TerminateProcess(process.process, 3))
 				{
 					LOGE("Failed to terminate child process.\n");
 					return EXIT_FAILURE;
 				}
-
-				// Process should terminate immediately, so clean up here.
-				if (timer_itr->process_shutdown() && !timer_itr->start_child_process())
-				{
-					LOGE("Failed to start child process.\n");
-					return EXIT_FAILURE;
-				}
 			}
 		}
+
+		// Children report every pipeline they start on, so this keeps up with their progress counters.
+		notify_control_block_progress();
 	}
 
+	CloseHandle(Global::completion_port);
+	Global::completion_port = nullptr;
+
 	if (Global::job_handle)
 		CloseHandle(Global::job_handle);
 
+	if (!Global::base_replayer_options.pipeline_stats_output_path.empty())
+		merge_pipeline_stats_shards(Global::base_replayer_options.pipeline_stats_output_path.c_str(), processes);
+	if (!Global::base_replayer_options.trace_path.empty())
+		merge_trace_fragments(Global::base_replayer_options.trace_path.c_str(), processes);
+	if (!Global::base_replayer_options.on_disk_pipeline_cache_path.empty())
+	{
+		merge_pipeline_cache_shards(Global::device_options, Global::base_replayer_options.on_disk_pipeline_cache_path,
+		                            Global::device_indices, processes);
+	}
+
+	if (Global::control_block && !shared_control_block_is_legacy(Global::control_block))
+	{
+		uint32_t dropped = Global::control_block->messages_dropped.load(std::memory_order_relaxed);
+		if (dropped)
+		{
+			LOGE("Dropped %u of %u messages to the control block.\n", dropped,
+			     dropped + Global::control_block->messages_written.load(std::memory_order_relaxed));
+		}
+	}
+
 	if (Global::control_block)
 		Global::control_block->progress_complete.store(1, std::memory_order_release);
+	notify_control_block_progress();
 
 	return EXIT_SUCCESS;
 }
@@ -769,6 +945,13 @@ static void validation_error_cb(ThreadedReplayer *replayer)
 	}
 }
 
+static void slow_object_cb(ControlBlockLatencyType type, Hash hash, uint64_t duration_ns)
+{
+	char buffer[ControlBlockMessageSize];
+	control_block_format_slow_object(buffer, type, hash, duration_ns / 1000000);
+	write_all(crash_handle, buffer);
+}
+
 static LONG WINAPI crash_handler(_EXCEPTION_POINTERS *)
 {
 	// stderr is reserved for generic logging.
@@ -833,6 +1016,8 @@ static int run_slave_process(const VulkanDevice::Options &opts,
 	auto tmp_opts = replayer_opts;
 	tmp_opts.control_block = Global::control_block;
 	tmp_opts.on_validation_error_callback = validation_error_cb;
+	tmp_opts.on_slow_object_callback = slow_object_cb;
+	tmp_opts.trace_fragment = true;
 	ThreadedReplayer replayer(opts, tmp_opts);
 	replayer.robustness = true;
 
@@ -887,15 +1072,7 @@ static int run_slave_process(const VulkanDevice::Options &opts,
 
 #if 0
 	if (Global::control_block)
-	{
-		if (WaitForSingleObject(Global::shared_mutex, INFINITE) == WAIT_OBJECT_0)
-		{
-			char msg[ControlBlockMessageSize] = {};
-			sprintf(msg, "SLAVE_FINISHED\n");
-			shared_control_block_write(Global::control_block, msg, sizeof(msg));
-			ReleaseMutex(Global::shared_mutex);
-		}
-	}
+		forward_control_block_message("SLAVE_FINISHED\n");
 #endif
 
 	return code;
@@ -0,0 +1,105 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "latency_stats.hpp"
+#include "logging.hpp"
+#include <inttypes.h>
+
+namespace Fossilize
+{
+bool LatencyHistogram::insert_slowest(Hash hash, uint64_t duration_ns)
+{
+	if (num_slowest == SlowestCount && duration_ns <= slowest[SlowestCount - 1].duration_ns)
+		return false;
+
+	unsigned index = num_slowest < SlowestCount ? num_slowest++ : (SlowestCount - 1);
+	while (index && slowest[index - 1].duration_ns < duration_ns)
+	{
+		slowest[index] = slowest[index - 1];
+		index--;
+	}
+	slowest[index] = { hash, duration_ns };
+	return true;
+}
+
+bool LatencyHistogram::record(Hash hash, uint64_t duration_ns)
+{
+	buckets[control_block_latency_bucket(duration_ns / 1000)]++;
+	count++;
+	if (duration_ns > max_ns)
+		max_ns = duration_ns;
+	return insert_slowest(hash, duration_ns);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+	for (unsigned i = 0; i < ControlBlockLatencyBuckets; i++)
+		buckets[i] += other.buckets[i];
+	count += other.count;
+	if (other.max_ns > max_ns)
+		max_ns = other.max_ns;
+	for (unsigned i = 0; i < other.num_slowest; i++)
+		insert_slowest(other.slowest[i].hash, other.slowest[i].duration_ns);
+}
+
+uint32_t LatencyHistogram::get_count() const
+{
+	return count;
+}
+
+uint64_t LatencyHistogram::get_max_ns() const
+{
+	return max_ns;
+}
+
+uint64_t LatencyHistogram::get_percentile_ns(double percentile) const
+{
+	// The middle of a bucket can be past the slowest object in it.
+	uint64_t ns = control_block_latency_percentile_us(buckets, percentile) * 1000;
+	return ns < max_ns ? ns : max_ns;
+}
+
+unsigned LatencyHistogram::get_slowest(const LatencySlowObject **objects) const
+{
+	*objects = slowest;
+	return num_slowest;
+}
+
+void log_latency_histogram(const char *name, const LatencyHistogram &histogram)
+{
+	if (!histogram.get_count())
+		return;
+
+	LOGI("%s latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms (%u samples)\n", name,
+	     histogram.get_percentile_ns(0.5) * 1e-6,
+	     histogram.get_percentile_ns(0.9) * 1e-6,
+	     histogram.get_percentile_ns(0.99) * 1e-6,
+	     histogram.get_max_ns() * 1e-6,
+	     histogram.get_count());
+
+	const LatencySlowObject *slowest = nullptr;
+	unsigned count = histogram.get_slowest(&slowest);
+	for (unsigned i = 0; i < count; i++)
+		LOGI("  %016" PRIx64 ": %.3f ms\n", slowest[i].hash, slowest[i].duration_ns * 1e-6);
+}
+}
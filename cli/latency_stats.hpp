@@ -0,0 +1,68 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "fossilize_types.hpp"
+#include "fossilize_external_replayer_control_block.hpp"
+#include <stdint.h>
+
+namespace Fossilize
+{
+struct LatencySlowObject
+{
+	Hash hash;
+	uint64_t duration_ns;
+};
+
+// Distribution of how long one kind of object took to create, along with the slowest objects.
+// Not thread-safe. Every thread records into its own histogram, and they are merged once the threads are done.
+class LatencyHistogram
+{
+public:
+	enum { SlowestCount = 8 };
+
+	// Returns true if the object is one of the SlowestCount slowest recorded so far.
+	bool record(Hash hash, uint64_t duration_ns);
+	void merge(const LatencyHistogram &other);
+
+	uint32_t get_count() const;
+	uint64_t get_max_ns() const;
+	// percentile is in [0, 1]. Accurate to the width of a histogram bucket.
+	uint64_t get_percentile_ns(double percentile) const;
+
+	// Slowest first.
+	unsigned get_slowest(const LatencySlowObject **objects) const;
+
+private:
+	uint32_t buckets[ControlBlockLatencyBuckets] = {};
+	uint32_t count = 0;
+	uint64_t max_ns = 0;
+	LatencySlowObject slowest[SlowestCount] = {};
+	unsigned num_slowest = 0;
+
+	bool insert_slowest(Hash hash, uint64_t duration_ns);
+};
+
+void log_latency_histogram(const char *name, const LatencyHistogram &histogram);
+}
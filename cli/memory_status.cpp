@@ -0,0 +1,133 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "memory_status.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
+
+namespace Fossilize
+{
+#ifdef _WIN32
+bool query_memory_status(MemoryStatus &status)
+{
+	MEMORYSTATUSEX mem = {};
+	mem.dwLength = sizeof(mem);
+	if (!GlobalMemoryStatusEx(&mem))
+		return false;
+
+	PROCESS_MEMORY_COUNTERS counters = {};
+	counters.cb = sizeof(counters);
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return false;
+
+	status.available_bytes = mem.ullAvailPhys;
+	status.resident_bytes = counters.WorkingSetSize;
+	return true;
+}
+#elif defined(__linux__)
+bool query_memory_status(MemoryStatus &status)
+{
+	FILE *file = fopen("/proc/meminfo", "r");
+	if (!file)
+		return false;
+
+	bool found_available = false;
+	char line[256];
+	while (fgets(line, sizeof(line), file))
+	{
+		unsigned long long kib = 0;
+		if (sscanf(line, "MemAvailable: %llu kB", &kib) == 1)
+		{
+			status.available_bytes = uint64_t(kib) * 1024;
+			found_available = true;
+			break;
+		}
+	}
+	fclose(file);
+
+	// Kernels older than 3.14 do not report MemAvailable, and free memory alone is far too pessimistic.
+	if (!found_available)
+		return false;
+
+	file = fopen("/proc/self/statm", "r");
+	if (!file)
+		return false;
+
+	unsigned long long total_pages = 0, resident_pages = 0;
+	bool found_resident = fscanf(file, "%llu %llu", &total_pages, &resident_pages) == 2;
+	fclose(file);
+	if (!found_resident)
+		return false;
+
+	status.resident_bytes = uint64_t(resident_pages) * uint64_t(sysconf(_SC_PAGESIZE));
+	return true;
+}
+#else
+bool query_memory_status(MemoryStatus &)
+{
+	return false;
+}
+#endif
+
+// Gives memory which was just freed a chance to show up before we try again.
+static const unsigned GrowCooldownUpdates = 8;
+
+WorkerThrottle::WorkerThrottle(unsigned min_workers_, unsigned max_workers_, uint64_t headroom_bytes_)
+	: min_workers(min_workers_ ? min_workers_ : 1), max_workers(max_workers_),
+	  headroom_bytes(headroom_bytes_), updates_since_shrink(GrowCooldownUpdates)
+{
+	if (max_workers < min_workers)
+		max_workers = min_workers;
+	active_workers = min_workers;
+}
+
+unsigned WorkerThrottle::update(uint64_t available_bytes, uint64_t worker_bytes)
+{
+	if (available_bytes < headroom_bytes)
+	{
+		if (active_workers > min_workers)
+			active_workers--;
+		updates_since_shrink = 0;
+		return active_workers;
+	}
+
+	if (updates_since_shrink < GrowCooldownUpdates)
+	{
+		updates_since_shrink++;
+		return active_workers;
+	}
+
+	uint64_t per_worker_bytes = worker_bytes / active_workers;
+	if (active_workers < max_workers && available_bytes - headroom_bytes > per_worker_bytes)
+		active_workers++;
+	return active_workers;
+}
+}
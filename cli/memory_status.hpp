@@ -0,0 +1,67 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+namespace Fossilize
+{
+struct MemoryStatus
+{
+	// Physical memory which can be handed out without swapping, including reclaimable caches.
+	uint64_t available_bytes;
+	// Physical memory currently used by this process.
+	uint64_t resident_bytes;
+};
+
+// Returns false if the platform has no way of telling us.
+bool query_memory_status(MemoryStatus &status);
+
+// Decides how many workers can run at the same time without running out of memory.
+// Starts out with the minimum and adds one worker at a time as long as there is room for it.
+// Whenever available memory drops below the headroom, one worker is taken away,
+// and no workers are added back for a while.
+class WorkerThrottle
+{
+public:
+	WorkerThrottle(unsigned min_workers, unsigned max_workers, uint64_t headroom_bytes);
+
+	// Called periodically. worker_bytes is the memory used by all active workers together,
+	// which gives us an estimate of what one more worker will cost.
+	// Returns the number of workers which should be active.
+	unsigned update(uint64_t available_bytes, uint64_t worker_bytes);
+
+	unsigned get_active_workers() const
+	{
+		return active_workers;
+	}
+
+private:
+	unsigned min_workers;
+	unsigned max_workers;
+	unsigned active_workers;
+	uint64_t headroom_bytes;
+	unsigned updates_since_shrink;
+};
+}
@@ -0,0 +1,222 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pipeline_order.hpp"
+#include "fossilize.hpp"
+#include "layer/utils.hpp"
+#include "util/entry_payload.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <queue>
+#include <inttypes.h>
+
+using namespace std;
+
+namespace Fossilize
+{
+bool sort_pipelines_by_shader_locality(DatabaseInterface &db, ResourceTag tag, vector<Hash> &hashes,
+                                       vector<Hash> *module_order)
+{
+	StateReplayer scanner;
+	EntryPayload payload;
+	vector<vector<Hash>> pipeline_modules(hashes.size());
+	unordered_map<Hash, vector<unsigned>> module_users;
+
+	for (size_t i = 0; i < hashes.size(); i++)
+	{
+		if (!payload.read(db, tag, hashes[i], PAYLOAD_READ_NO_FLAGS))
+		{
+			LOGE("Failed to load blob from cache.\n");
+			return false;
+		}
+
+		const StateReference *refs = nullptr;
+		size_t ref_count = 0;
+		if (!scanner.scan_references(payload.data(), payload.size(), &refs, &ref_count))
+		{
+			// Leave the pipeline where it is, the replay itself will report the error.
+			LOGE("Failed to scan pipeline %016" PRIx64 " for shader modules.\n", hashes[i]);
+			continue;
+		}
+
+		auto &modules = pipeline_modules[i];
+		for (size_t j = 0; j < ref_count; j++)
+			if (refs[j].tag == RESOURCE_SHADER_MODULE)
+				modules.push_back(refs[j].hash);
+
+		sort(begin(modules), end(modules));
+		modules.erase(unique(begin(modules), end(modules)), end(modules));
+		for (auto module : modules)
+			module_users[module].push_back(unsigned(i));
+	}
+
+	for (auto &modules : pipeline_modules)
+	{
+		sort(begin(modules), end(modules), [&](Hash a, Hash b) -> bool {
+			size_t a_users = module_users[a].size();
+			size_t b_users = module_users[b].size();
+			if (a_users != b_users)
+				return a_users < b_users;
+			return a < b;
+		});
+	}
+
+	vector<Hash> sorted_hashes;
+	sorted_hashes.reserve(hashes.size());
+	vector<bool> visited_pipelines(hashes.size());
+	unordered_set<Hash> visited_modules;
+	std::queue<unsigned> pending;
+
+	for (size_t root = 0; root < hashes.size(); root++)
+	{
+		if (visited_pipelines[root])
+			continue;
+
+		visited_pipelines[root] = true;
+		pending.push(unsigned(root));
+
+		while (!pending.empty())
+		{
+			unsigned index = pending.front();
+			pending.pop();
+			sorted_hashes.push_back(hashes[index]);
+
+			for (auto module : pipeline_modules[index])
+			{
+				if (!visited_modules.insert(module).second)
+					continue;
+				if (module_order)
+					module_order->push_back(module);
+
+				for (auto user : module_users[module])
+				{
+					if (!visited_pipelines[user])
+					{
+						visited_pipelines[user] = true;
+						pending.push(user);
+					}
+				}
+			}
+		}
+	}
+
+	hashes = move(sorted_hashes);
+	return true;
+}
+
+bool load_usage_summaries(DatabaseInterface &db, unordered_map<Hash, UsageSummary> (&summaries)[RESOURCE_COUNT])
+{
+	for (auto &tag_summaries : summaries)
+		tag_summaries.clear();
+	size_t count = 0;
+	if (!db.get_hash_list_for_resource_tag(RESOURCE_USAGE_METADATA, &count, nullptr))
+		return false;
+	vector<Hash> chunks(count);
+	if (!db.get_hash_list_for_resource_tag(RESOURCE_USAGE_METADATA, &count, chunks.data()))
+		return false;
+
+	vector<uint8_t> buffer;
+	vector<UsageMetadataRecord> records;
+	for (auto chunk : chunks)
+	{
+		size_t size = 0;
+		if (!db.read_entry(RESOURCE_USAGE_METADATA, chunk, &size, nullptr, 0))
+		{
+			LOGE("Failed to load usage metadata %016" PRIx64 ".\n", chunk);
+			return false;
+		}
+		buffer.resize(size);
+		if (!db.read_entry(RESOURCE_USAGE_METADATA, chunk, &size, buffer.data(), 0))
+		{
+			LOGE("Failed to load usage metadata %016" PRIx64 ".\n", chunk);
+			return false;
+		}
+
+		size_t record_count = 0;
+		if (!parse_usage_metadata(buffer.data(), size, nullptr, nullptr, &record_count))
+			return false;
+		records.resize(record_count);
+		if (!parse_usage_metadata(buffer.data(), size, nullptr, records.data(), &record_count))
+			return false;
+
+		// A session records every object at most once, so every record is another session.
+		for (auto &record : records)
+		{
+			auto &tag_summaries = summaries[record.tag];
+			auto itr = tag_summaries.find(record.hash);
+			if (itr == end(tag_summaries))
+			{
+				tag_summaries[record.hash] = { 1, (record.flags & USAGE_METADATA_LOADING_BIT) ? 1u : 0u, record.first_use_ms };
+			}
+			else
+			{
+				auto &summary = itr->second;
+				summary.session_count++;
+				if (record.flags & USAGE_METADATA_LOADING_BIT)
+					summary.loading_count++;
+				summary.first_use_ms = std::min(summary.first_use_ms, record.first_use_ms);
+			}
+		}
+	}
+
+	return true;
+}
+
+bool sort_pipelines_by_usage(DatabaseInterface &db, ResourceTag tag, vector<Hash> &hashes, bool *has_metadata)
+{
+	unordered_map<Hash, UsageSummary> all_summaries[RESOURCE_COUNT];
+	if (!load_usage_summaries(db, all_summaries))
+		return false;
+
+	auto &summaries = all_summaries[tag];
+	*has_metadata = !summaries.empty();
+	if (summaries.empty())
+		return true;
+
+	const UsageSummary unused = { 0, 0, UINT32_MAX };
+	vector<UsageSummary> keys;
+	keys.reserve(hashes.size());
+	for (auto hash : hashes)
+	{
+		auto itr = summaries.find(hash);
+		keys.push_back(itr != end(summaries) ? itr->second : unused);
+	}
+
+	vector<unsigned> order(hashes.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = unsigned(i);
+
+	stable_sort(begin(order), end(order), [&](unsigned a, unsigned b) -> bool {
+		if (keys[a].session_count != keys[b].session_count)
+			return keys[a].session_count > keys[b].session_count;
+		return keys[a].first_use_ms < keys[b].first_use_ms;
+	});
+
+	vector<Hash> sorted;
+	sorted.reserve(hashes.size());
+	for (auto index : order)
+		sorted.push_back(hashes[index]);
+	hashes = move(sorted);
+	return true;
+}
+}
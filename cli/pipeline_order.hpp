@@ -0,0 +1,57 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize_db.hpp"
+#include <vector>
+#include <unordered_map>
+
+namespace Fossilize
+{
+// Reorders pipelines so that pipelines which share shader modules are replayed back to back.
+// Starting from the first unvisited pipeline in database order, we walk the pipeline <-> module graph
+// breadth first and visit the rarest modules first. Modules used by nearly every pipeline would otherwise
+// pull in the whole database at once and destroy whatever locality the rarer modules give us.
+// The result only depends on the database, so child processes in a robust replay agree on pipeline indices.
+// If module_order is set, every referenced shader module is appended to it once, in the order the sorted pipelines
+// first use them.
+bool sort_pipelines_by_shader_locality(DatabaseInterface &db, ResourceTag tag, std::vector<Hash> &hashes,
+                                       std::vector<Hash> *module_order = nullptr);
+
+// What the RESOURCE_USAGE_METADATA entries of an archive say about one object, summed over every recorded session.
+struct UsageSummary
+{
+	uint32_t session_count;
+	// Sessions where the object was first used behind a loading screen.
+	uint32_t loading_count;
+	// Earliest first use in any session.
+	uint32_t first_use_ms;
+};
+
+// Collects the usage metadata for every object, by type. Leaves summaries empty if the archive has none.
+bool load_usage_summaries(DatabaseInterface &db, std::unordered_map<Hash, UsageSummary> (&summaries)[RESOURCE_COUNT]);
+
+// Puts the pipelines which were used by the most sessions first, and the earliest used first among those.
+// Pipelines without usage metadata go last and keep their order. Returns false in *has_metadata if there was nothing to sort by.
+bool sort_pipelines_by_usage(DatabaseInterface &db, ResourceTag tag, std::vector<Hash> &hashes, bool *has_metadata);
+}
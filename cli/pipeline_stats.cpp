@@ -0,0 +1,257 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "pipeline_stats.hpp"
+#include "logging.hpp"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+namespace Fossilize
+{
+static const char *tag_names[2] = { "graphics", "compute" };
+
+bool PipelineStats::get_tag_index(ResourceTag tag, unsigned *index)
+{
+	if (tag == RESOURCE_GRAPHICS_PIPELINE)
+		*index = 0;
+	else if (tag == RESOURCE_COMPUTE_PIPELINE)
+		*index = 1;
+	else
+		return false;
+	return true;
+}
+
+PipelineStats::Device *PipelineStats::find_device(const Device &key)
+{
+	for (auto &device : devices)
+	{
+		if (device.vendor_id == key.vendor_id && device.device_id == key.device_id &&
+		    device.driver_version == key.driver_version && device.pipeline_cache_uuid == key.pipeline_cache_uuid)
+			return &device;
+	}
+	return nullptr;
+}
+
+bool PipelineStats::load(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return true;
+
+	Device *device = nullptr;
+	char line[256];
+	unsigned line_index = 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		line_index++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		char name[16];
+		char uuid[2 * VK_UUID_SIZE + 1];
+		uint32_t vendor_id, device_id, driver_version;
+		uint64_t hash, cost_ns;
+
+		if (sscanf(line, "device %" SCNx32 " %" SCNx32 " %" SCNx32 " %32s",
+		           &vendor_id, &device_id, &driver_version, uuid) == 4)
+		{
+			Device key;
+			key.vendor_id = vendor_id;
+			key.device_id = device_id;
+			key.driver_version = driver_version;
+			key.pipeline_cache_uuid = uuid;
+			device = find_device(key);
+			if (!device)
+			{
+				devices.push_back(std::move(key));
+				device = &devices.back();
+			}
+		}
+		else if (sscanf(line, "%15s %" SCNx64 " %" SCNu64, name, &hash, &cost_ns) == 3 && device)
+		{
+			for (unsigned i = 0; i < 2; i++)
+				if (strcmp(name, tag_names[i]) == 0)
+					device->costs[i][hash] = cost_ns;
+		}
+		else
+		{
+			LOGE("Malformed line %u in pipeline stats file %s.\n", line_index, path);
+			fclose(file);
+			return false;
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+bool PipelineStats::save(const char *path) const
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+	{
+		LOGE("Failed to open pipeline stats file %s for writing.\n", path);
+		return false;
+	}
+
+	fprintf(file, "# Fossilize pipeline compile times in nanoseconds.\n");
+
+	// Keep the output stable so the file diffs nicely between runs.
+	std::vector<std::pair<Hash, uint64_t>> sorted;
+	for (auto &device : devices)
+	{
+		fprintf(file, "device %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %s\n",
+		        device.vendor_id, device.device_id, device.driver_version, device.pipeline_cache_uuid.c_str());
+
+		for (unsigned i = 0; i < 2; i++)
+		{
+			sorted.assign(device.costs[i].begin(), device.costs[i].end());
+			std::sort(sorted.begin(), sorted.end());
+			for (auto &cost : sorted)
+				fprintf(file, "%s %016" PRIx64 " %" PRIu64 "\n", tag_names[i], cost.first, cost.second);
+		}
+	}
+
+	bool ret = ferror(file) == 0;
+	if (fclose(file) != 0)
+		ret = false;
+	if (!ret)
+		LOGE("Failed to write pipeline stats file %s.\n", path);
+	return ret;
+}
+
+void PipelineStats::merge(const PipelineStats &other)
+{
+	for (auto &other_device : other.devices)
+	{
+		Device *device = find_device(other_device);
+		if (!device)
+		{
+			devices.push_back(other_device);
+			continue;
+		}
+
+		for (unsigned i = 0; i < 2; i++)
+			for (auto &cost : other_device.costs[i])
+				device->costs[i][cost.first] = cost.second;
+	}
+}
+
+void PipelineStats::set_device(const VkPhysicalDeviceProperties &props)
+{
+	current = {};
+	current.vendor_id = props.vendorID;
+	current.device_id = props.deviceID;
+	current.driver_version = props.driverVersion;
+
+	char uuid[2 * VK_UUID_SIZE + 1];
+	for (unsigned i = 0; i < VK_UUID_SIZE; i++)
+		sprintf(uuid + 2 * i, "%02x", props.pipelineCacheUUID[i]);
+	current.pipeline_cache_uuid = uuid;
+
+	if (!find_device(current))
+		devices.push_back(current);
+}
+
+bool PipelineStats::find_cost(ResourceTag tag, Hash hash, uint64_t *cost_ns) const
+{
+	unsigned index;
+	if (!get_tag_index(tag, &index))
+		return false;
+
+	// Prefer the exact driver, then the most recently recorded driver for the same GPU.
+	const Device *fallback = nullptr;
+	for (auto &device : devices)
+	{
+		if (device.vendor_id != current.vendor_id || device.device_id != current.device_id)
+			continue;
+
+		auto itr = device.costs[index].find(hash);
+		if (itr == device.costs[index].end())
+			continue;
+
+		if (device.driver_version == current.driver_version &&
+		    device.pipeline_cache_uuid == current.pipeline_cache_uuid)
+		{
+			*cost_ns = itr->second;
+			return true;
+		}
+
+		if (!fallback || device.driver_version > fallback->driver_version)
+			fallback = &device;
+	}
+
+	if (fallback)
+	{
+		*cost_ns = fallback->costs[index].find(hash)->second;
+		return true;
+	}
+	else
+		return false;
+}
+
+void PipelineStats::record_cost(ResourceTag tag, Hash hash, uint64_t cost_ns)
+{
+	unsigned index;
+	if (!get_tag_index(tag, &index))
+		return;
+
+	auto *device = find_device(current);
+	if (!device)
+	{
+		devices.push_back(current);
+		device = &devices.back();
+	}
+	device->costs[index][hash] = cost_ns;
+}
+
+bool merge_pipeline_stats_shards(const char *path, unsigned count)
+{
+	PipelineStats stats;
+	if (!stats.load(path))
+		return false;
+
+	bool found_shard = false;
+	for (unsigned i = 0; i < count; i++)
+	{
+		std::string shard_path = std::string(path) + "." + std::to_string(i);
+		FILE *file = fopen(shard_path.c_str(), "r");
+		if (!file)
+			continue;
+		fclose(file);
+
+		PipelineStats shard;
+		if (!shard.load(shard_path.c_str()))
+			continue;
+		stats.merge(shard);
+		remove(shard_path.c_str());
+		found_shard = true;
+	}
+
+	if (!found_shard)
+		return true;
+	return stats.save(path);
+}
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "vulkan.h"
+#include "fossilize_types.hpp"
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace Fossilize
+{
+// Compile times of individual pipelines, as measured by earlier replays.
+// Costs are recorded per device and driver version. Looking up a cost falls back to
+// older driver versions of the same GPU, which is what we want when warming caches after a driver update.
+// The file is plain text so it can be inspected and merged by hand.
+class PipelineStats
+{
+public:
+	// A missing file is not an error, it just means there is nothing recorded yet.
+	bool load(const char *path);
+	bool save(const char *path) const;
+
+	// Adds everything in other, entries in other take precedence.
+	void merge(const PipelineStats &other);
+
+	// Selects which device costs are looked up and recorded for.
+	void set_device(const VkPhysicalDeviceProperties &props);
+
+	bool find_cost(ResourceTag tag, Hash hash, uint64_t *cost_ns) const;
+	void record_cost(ResourceTag tag, Hash hash, uint64_t cost_ns);
+
+private:
+	struct Device
+	{
+		uint32_t vendor_id = 0;
+		uint32_t device_id = 0;
+		uint32_t driver_version = 0;
+		std::string pipeline_cache_uuid;
+		// Graphics and compute.
+		std::unordered_map<Hash, uint64_t> costs[2];
+	};
+	std::vector<Device> devices;
+	// Only the key is used, the costs live in devices.
+	Device current;
+
+	Device *find_device(const Device &key);
+	static bool get_tag_index(ResourceTag tag, unsigned *index);
+};
+
+// fossilize-replay child processes record into <path>.<index>, and the parent folds them back into path.
+bool merge_pipeline_stats_shards(const char *path, unsigned count);
+}
@@ -0,0 +1,456 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "reference_graph.hpp"
+#include "fossilize.hpp"
+#include "file.hpp"
+#include "xxhash64.hpp"
+#include "layer/utils.hpp"
+#include <algorithm>
+#include <inttypes.h>
+#include <string.h>
+
+namespace Fossilize
+{
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+struct ReferenceGraphBuilder : StateCreatorInterface
+{
+	explicit ReferenceGraphBuilder(ReferenceGraph &graph_)
+		: graph(graph_)
+	{
+	}
+
+	void set_current_application_info(Hash hash) override
+	{
+		current_application = hash;
+		has_current_application = true;
+	}
+
+	void notify_application_info_link(Hash link_hash, Hash app_hash, ResourceTag tag, Hash hash) override
+	{
+		graph.links.push_back({ link_hash, app_hash, tag, hash });
+	}
+
+	// Objects pulled in through the resolver are added too, but only once.
+	ReferenceGraph::Node *begin_node(ResourceTag tag, Hash hash)
+	{
+		auto &nodes = graph.nodes[tag];
+		if (nodes.count(hash))
+			return nullptr;
+
+		auto &node = nodes[hash];
+		node.application = current_application;
+		node.has_application = has_current_application;
+		node.first_reference = uint32_t(graph.references.size());
+		return &node;
+	}
+
+	void add_reference(ReferenceGraph::Node *node, ResourceTag tag, uint64_t handle)
+	{
+		if (!node)
+			return;
+		graph.references.push_back({ tag, Hash(handle) });
+		node->reference_count++;
+	}
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		begin_node(RESOURCE_SAMPLER, hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *create_info,
+	                                          VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		auto *node = begin_node(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash);
+		for (uint32_t binding = 0; binding < create_info->bindingCount; binding++)
+		{
+			auto &bind = create_info->pBindings[binding];
+			if (bind.pImmutableSamplers)
+				for (uint32_t i = 0; i < bind.descriptorCount; i++)
+					if (bind.pImmutableSamplers[i] != VK_NULL_HANDLE)
+						add_reference(node, RESOURCE_SAMPLER, (uint64_t)bind.pImmutableSamplers[i]);
+		}
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *create_info,
+	                                    VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		auto *node = begin_node(RESOURCE_PIPELINE_LAYOUT, hash);
+		for (uint32_t i = 0; i < create_info->setLayoutCount; i++)
+			add_reference(node, RESOURCE_DESCRIPTOR_SET_LAYOUT, (uint64_t)create_info->pSetLayouts[i]);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		begin_node(RESOURCE_RENDER_PASS, hash);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info,
+	                                     VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		auto *node = begin_node(RESOURCE_COMPUTE_PIPELINE, hash);
+		add_reference(node, RESOURCE_PIPELINE_LAYOUT, (uint64_t)create_info->layout);
+		add_reference(node, RESOURCE_SHADER_MODULE, (uint64_t)create_info->stage.module);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info,
+	                                      VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		auto *node = begin_node(RESOURCE_GRAPHICS_PIPELINE, hash);
+		add_reference(node, RESOURCE_PIPELINE_LAYOUT, (uint64_t)create_info->layout);
+		add_reference(node, RESOURCE_RENDER_PASS, (uint64_t)create_info->renderPass);
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+			add_reference(node, RESOURCE_SHADER_MODULE, (uint64_t)create_info->pStages[i].module);
+		return true;
+	}
+
+	ReferenceGraph &graph;
+	Hash current_application = 0;
+	bool has_current_application = false;
+};
+
+static bool get_hash_list(DatabaseInterface &db, ResourceTag tag, std::vector<Hash> &hashes)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	hashes.resize(hash_count);
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		return false;
+	std::sort(hashes.begin(), hashes.end());
+	return true;
+}
+
+bool ReferenceGraph::build(DatabaseInterface &db)
+{
+	static const ResourceTag playback_order[] = {
+		RESOURCE_APPLICATION_INFO,
+		RESOURCE_APPLICATION_BLOB_LINK,
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+		RESOURCE_GRAPHICS_PIPELINE,
+		RESOURCE_COMPUTE_PIPELINE,
+	};
+
+	reset();
+
+	StateReplayer replayer;
+	replayer.set_resolve_shader_module_handles(false);
+	ReferenceGraphBuilder builder(*this);
+
+	std::vector<Hash> hashes;
+	std::vector<DatabaseEntryRead> batch;
+	std::vector<uint8_t> batch_data;
+
+	for (auto tag : playback_order)
+	{
+		if (!get_hash_list(db, tag, hashes))
+			return false;
+
+		if (tag == RESOURCE_APPLICATION_INFO)
+		{
+			application_infos = hashes;
+			continue;
+		}
+
+		// Read blobs in batches so the database can order the reads for us.
+		const size_t batch_size = 256;
+		for (size_t i = 0; i < hashes.size(); i += batch_size)
+		{
+			size_t count = std::min(batch_size, hashes.size() - i);
+			batch.resize(count);
+			for (size_t j = 0; j < count; j++)
+				batch[j] = { tag, hashes[i + j], 0, nullptr };
+
+			if (!db.read_entries(batch.data(), batch.size(), 0))
+				return false;
+
+			size_t total_size = 0;
+			for (auto &read : batch)
+				total_size += read.size;
+			batch_data.resize(total_size);
+
+			size_t offset = 0;
+			for (auto &read : batch)
+			{
+				read.buffer = batch_data.data() + offset;
+				offset += read.size;
+			}
+
+			if (!db.read_entries(batch.data(), batch.size(), 0))
+				return false;
+
+			for (auto &read : batch)
+			{
+				builder.has_current_application = false;
+				if (!replayer.parse(builder, &db, read.buffer, read.size))
+					LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, read.hash);
+			}
+		}
+	}
+
+	return true;
+}
+
+void ReferenceGraph::reset()
+{
+	application_infos.clear();
+	links.clear();
+	references.clear();
+	for (auto &tag_nodes : nodes)
+		tag_nodes.clear();
+}
+
+const ReferenceGraph::Node *ReferenceGraph::find_node(ResourceTag tag, Hash hash) const
+{
+	auto itr = nodes[tag].find(hash);
+	return itr != nodes[tag].end() ? &itr->second : nullptr;
+}
+
+const ReferenceGraph::Reference *ReferenceGraph::get_references(const Node &node) const
+{
+	return references.data() + node.first_reference;
+}
+
+// The graph is only valid for the exact set of entries it was built from.
+bool ReferenceGraph::compute_fingerprint(DatabaseInterface &db, uint64_t *fingerprint) const
+{
+	uint64_t h = 0;
+	std::vector<Hash> hashes;
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		if (!get_hash_list(db, static_cast<ResourceTag>(i), hashes))
+			return false;
+		uint64_t count = hashes.size();
+		h = xxhash64(&count, sizeof(count), h);
+		h = xxhash64(hashes.data(), hashes.size() * sizeof(Hash), h);
+	}
+	*fingerprint = h;
+	return true;
+}
+
+static const char reference_graph_magic[8] = { 'F', 'O', 'S', 'S', 'R', 'E', 'F', 'G' };
+enum { ReferenceGraphVersion = 1 };
+
+namespace
+{
+struct GraphWriter
+{
+	template <typename T>
+	void write(const T &value)
+	{
+		size_t offset = data.size();
+		data.resize(offset + sizeof(T));
+		memcpy(data.data() + offset, &value, sizeof(T));
+	}
+
+	std::vector<uint8_t> data;
+};
+
+struct GraphReader
+{
+	template <typename T>
+	T read()
+	{
+		T value = {};
+		if (size - offset < sizeof(T))
+			failed = true;
+		else
+		{
+			memcpy(&value, data + offset, sizeof(T));
+			offset += sizeof(T);
+		}
+		return value;
+	}
+
+	// Counts are validated against the bytes left so a corrupt file cannot request huge allocations.
+	bool check_count(uint32_t count, size_t element_size)
+	{
+		if (failed || count > (size - offset) / element_size)
+			failed = true;
+		return !failed;
+	}
+
+	const uint8_t *data;
+	size_t size;
+	size_t offset = 0;
+	bool failed = false;
+};
+}
+
+bool ReferenceGraph::save(DatabaseInterface &db, const char *path) const
+{
+	uint64_t fingerprint = 0;
+	if (!compute_fingerprint(db, &fingerprint))
+		return false;
+
+	GraphWriter writer;
+	for (auto c : reference_graph_magic)
+		writer.write(c);
+	writer.write(uint32_t(ReferenceGraphVersion));
+	writer.write(fingerprint);
+
+	writer.write(uint32_t(application_infos.size()));
+	for (auto hash : application_infos)
+		writer.write(hash);
+
+	writer.write(uint32_t(links.size()));
+	for (auto &link : links)
+	{
+		writer.write(link.link_hash);
+		writer.write(link.application);
+		writer.write(uint32_t(link.tag));
+		writer.write(link.hash);
+	}
+
+	for (auto &tag_nodes : nodes)
+	{
+		// Sort for a stable file.
+		std::vector<Hash> hashes;
+		hashes.reserve(tag_nodes.size());
+		for (auto &node : tag_nodes)
+			hashes.push_back(node.first);
+		std::sort(hashes.begin(), hashes.end());
+
+		writer.write(uint32_t(hashes.size()));
+		for (auto hash : hashes)
+		{
+			auto &node = tag_nodes.find(hash)->second;
+			writer.write(hash);
+			writer.write(uint8_t(node.has_application));
+			writer.write(node.application);
+			writer.write(node.reference_count);
+			for (uint32_t i = 0; i < node.reference_count; i++)
+			{
+				auto &ref = references[node.first_reference + i];
+				writer.write(uint32_t(ref.tag));
+				writer.write(ref.hash);
+			}
+		}
+	}
+
+	return write_buffer_to_file(path, writer.data.data(), writer.data.size());
+}
+
+bool ReferenceGraph::load(DatabaseInterface &db, const char *path)
+{
+	auto buffer = load_buffer_from_file(path);
+	if (buffer.empty())
+		return false;
+
+	GraphReader reader{ buffer.data(), buffer.size() };
+	for (auto c : reference_graph_magic)
+		if (reader.read<char>() != c)
+			return false;
+	if (reader.read<uint32_t>() != ReferenceGraphVersion)
+		return false;
+
+	uint64_t fingerprint = 0;
+	if (!compute_fingerprint(db, &fingerprint))
+		return false;
+	if (reader.read<uint64_t>() != fingerprint)
+	{
+		LOGI("Reference graph %s is out of date.\n", path);
+		return false;
+	}
+
+	reset();
+
+	uint32_t count = reader.read<uint32_t>();
+	if (!reader.check_count(count, sizeof(Hash)))
+		return false;
+	application_infos.resize(count);
+	for (auto &hash : application_infos)
+		hash = reader.read<Hash>();
+
+	count = reader.read<uint32_t>();
+	if (!reader.check_count(count, 3 * sizeof(Hash) + sizeof(uint32_t)))
+		return false;
+	links.resize(count);
+	for (auto &link : links)
+	{
+		link.link_hash = reader.read<Hash>();
+		link.application = reader.read<Hash>();
+		uint32_t tag = reader.read<uint32_t>();
+		link.hash = reader.read<Hash>();
+		if (tag >= RESOURCE_COUNT)
+			return false;
+		link.tag = static_cast<ResourceTag>(tag);
+	}
+
+	for (auto &tag_nodes : nodes)
+	{
+		count = reader.read<uint32_t>();
+		if (!reader.check_count(count, 2 * sizeof(Hash) + sizeof(uint8_t) + sizeof(uint32_t)))
+			return false;
+		tag_nodes.reserve(count);
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			Hash hash = reader.read<Hash>();
+			Node node;
+			node.has_application = reader.read<uint8_t>() != 0;
+			node.application = reader.read<Hash>();
+			node.reference_count = reader.read<uint32_t>();
+			node.first_reference = uint32_t(references.size());
+			if (!reader.check_count(node.reference_count, sizeof(uint32_t) + sizeof(Hash)))
+				return false;
+
+			for (uint32_t j = 0; j < node.reference_count; j++)
+			{
+				uint32_t tag = reader.read<uint32_t>();
+				Hash ref = reader.read<Hash>();
+				if (tag >= RESOURCE_COUNT)
+					return false;
+				references.push_back({ static_cast<ResourceTag>(tag), ref });
+			}
+			tag_nodes[hash] = node;
+		}
+	}
+
+	return !reader.failed && reader.offset == reader.size;
+}
+}
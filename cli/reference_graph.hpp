@@ -0,0 +1,79 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize_db.hpp"
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+namespace Fossilize
+{
+// Which objects every object in a database refers to, so reachability queries need no JSON parsing.
+// Shader modules are leaves and do not get nodes.
+class ReferenceGraph
+{
+public:
+	struct Reference
+	{
+		ResourceTag tag;
+		Hash hash;
+	};
+
+	struct Node
+	{
+		// Only set for blobs keyed on an application info hash, see set_current_application_info().
+		Hash application = 0;
+		bool has_application = false;
+		uint32_t first_reference = 0;
+		uint32_t reference_count = 0;
+	};
+
+	struct Link
+	{
+		Hash link_hash;
+		Hash application;
+		ResourceTag tag;
+		Hash hash;
+	};
+
+	// Parses every sampler, layout, render pass, pipeline and application blob link in db.
+	bool build(DatabaseInterface &db);
+
+	// Loads a graph saved with save(). Fails if the graph was built from a different set of entries.
+	bool load(DatabaseInterface &db, const char *path);
+	bool save(DatabaseInterface &db, const char *path) const;
+
+	const Node *find_node(ResourceTag tag, Hash hash) const;
+	const Reference *get_references(const Node &node) const;
+
+	std::vector<Hash> application_infos;
+	std::vector<Link> links;
+	std::unordered_map<Hash, Node> nodes[RESOURCE_COUNT];
+	std::vector<Reference> references;
+
+private:
+	void reset();
+	bool compute_fingerprint(DatabaseInterface &db, uint64_t *fingerprint) const;
+};
+}
@@ -0,0 +1,574 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "replay_daemon.hpp"
+#include "logging.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+namespace Fossilize
+{
+const char *get_replay_daemon_job_state_name(ReplayDaemonJobState state)
+{
+	switch (state)
+	{
+	case ReplayDaemonJobState::Queued:
+		return "queued";
+	case ReplayDaemonJobState::Running:
+		return "running";
+	case ReplayDaemonJobState::Done:
+		return "done";
+	case ReplayDaemonJobState::Failed:
+		return "failed";
+	case ReplayDaemonJobState::Cancelled:
+		return "cancelled";
+	}
+	return "unknown";
+}
+
+static bool job_is_finished(const ReplayDaemonJob &job)
+{
+	return job.state == ReplayDaemonJobState::Done ||
+	       job.state == ReplayDaemonJobState::Failed ||
+	       job.state == ReplayDaemonJobState::Cancelled;
+}
+
+static vector<string> split_fields(const string &line)
+{
+	vector<string> fields;
+	size_t start = 0;
+	for (;;)
+	{
+		size_t end = line.find('\t', start);
+		fields.push_back(line.substr(start, end == string::npos ? string::npos : end - start));
+		if (end == string::npos)
+			break;
+		start = end + 1;
+	}
+	return fields;
+}
+
+static bool parse_uint(const string &str, unsigned &value)
+{
+	if (str.empty())
+		return false;
+	char *end = nullptr;
+	unsigned long v = strtoul(str.c_str(), &end, 0);
+	if (*end != '\0' || v > 0xffffffffu)
+		return false;
+	value = unsigned(v);
+	return true;
+}
+
+struct ReplayDaemon::Impl
+{
+	Impl(ReplayDaemonRunner &runner_, unsigned slice_size_)
+		: runner(runner_), slice_size(max(slice_size_, 1u))
+	{
+	}
+
+	ReplayDaemonRunner &runner;
+	unsigned slice_size;
+
+	mutex lock;
+	condition_variable cond;
+	vector<unique_ptr<ReplayDaemonJob>> jobs;
+	unsigned next_job_id = 1;
+	uint64_t virtual_time = 0;
+	bool shutting_down = false;
+
+	int listen_fd = -1;
+	string socket_path;
+	thread accept_thread;
+
+	// Priorities are clamped, so the stride never reaches 0.
+	static uint64_t get_stride(unsigned priority)
+	{
+		return (uint64_t(1) << 20) / priority;
+	}
+
+	ReplayDaemonJob *find_job(unsigned id)
+	{
+		for (auto &job : jobs)
+			if (job->id == id)
+				return job.get();
+		return nullptr;
+	}
+
+	// Cancelled jobs are picked first, so they are wrapped up without waiting for their turn.
+	ReplayDaemonJob *pick_job()
+	{
+		ReplayDaemonJob *best = nullptr;
+		for (auto &job : jobs)
+		{
+			if (job_is_finished(*job))
+				continue;
+			if (job->cancel_requested)
+				return job.get();
+			if (!best || job->pass < best->pass)
+				best = job.get();
+		}
+		return best;
+	}
+
+	bool next_slice(const ReplayDaemonJob &job, ReplayDaemonSlice &slice) const
+	{
+		slice = {};
+		if (job.graphics_done < job.graphics_total)
+		{
+			slice.graphics_start = job.graphics_done;
+			slice.graphics_end = job.graphics_done + min(slice_size, job.graphics_total - job.graphics_done);
+			return true;
+		}
+		else if (job.compute_done < job.compute_total)
+		{
+			slice.compute_start = job.compute_done;
+			slice.compute_end = job.compute_done + min(slice_size, job.compute_total - job.compute_done);
+			return true;
+		}
+		else
+			return false;
+	}
+
+	void finish_job(ReplayDaemonJob &job, ReplayDaemonJobState state)
+	{
+		job.state = state;
+		LOGI("Replay daemon: job %u %s, %u of %u graphics and %u of %u compute pipelines replayed.\n",
+		     job.id, get_replay_daemon_job_state_name(state),
+		     job.graphics_done, job.graphics_total, job.compute_done, job.compute_total);
+	}
+
+	string format_job(const ReplayDaemonJob &job) const
+	{
+		char line[256];
+		snprintf(line, sizeof(line), "job %u priority %u %s: graphics %u/%u, compute %u/%u, %u failed slices",
+		         job.id, job.priority, get_replay_daemon_job_state_name(job.state),
+		         job.graphics_done, job.graphics_total, job.compute_done, job.compute_total, job.failed_slices);
+		string str = line;
+		for (auto &database : job.databases)
+		{
+			str += ", ";
+			str += database;
+		}
+		return str;
+	}
+
+	string handle_command(const string &line, bool &shutdown)
+	{
+		auto fields = split_fields(line);
+		auto &command = fields.front();
+		lock_guard<mutex> holder{lock};
+
+		if (command == "submit")
+		{
+			unsigned priority = 0;
+			if (fields.size() < 3 || !parse_uint(fields[1], priority))
+				return "error usage: submit <priority> <database>...";
+			if (shutting_down)
+				return "error shutting down";
+
+			unique_ptr<ReplayDaemonJob> job(new ReplayDaemonJob);
+			job->id = next_job_id++;
+			job->priority = max<unsigned>(REPLAY_DAEMON_MIN_PRIORITY, min<unsigned>(priority, REPLAY_DAEMON_MAX_PRIORITY));
+			job->databases.assign(fields.begin() + 2, fields.end());
+			// Starting out at the current virtual time, so a new job cannot monopolize the replayer to catch up.
+			job->pass = virtual_time;
+			LOGI("Replay daemon: queued job %u with priority %u.\n", job->id, job->priority);
+			string reply = "ok " + to_string(job->id);
+			jobs.push_back(move(job));
+			cond.notify_one();
+			return reply;
+		}
+		else if (command == "status")
+		{
+			unsigned id = 0;
+			if (fields.size() > 2 || (fields.size() == 2 && !parse_uint(fields[1], id)))
+				return "error usage: status [<job id>]";
+
+			string reply;
+			for (auto &job : jobs)
+			{
+				if (id && job->id != id)
+					continue;
+				if (!reply.empty())
+					reply += '\n';
+				reply += format_job(*job);
+			}
+
+			if (id && reply.empty())
+				return "error unknown job";
+			return reply;
+		}
+		else if (command == "cancel")
+		{
+			unsigned id = 0;
+			if (fields.size() != 2 || !parse_uint(fields[1], id))
+				return "error usage: cancel <job id>";
+			auto *job = find_job(id);
+			if (!job)
+				return "error unknown job";
+			if (job_is_finished(*job))
+				return "error job is finished";
+			job->cancel_requested = true;
+			cond.notify_one();
+			return "ok";
+		}
+		else if (command == "shutdown")
+		{
+			shutting_down = true;
+			shutdown = true;
+			cond.notify_one();
+			return "ok";
+		}
+		else
+			return "error unknown command";
+	}
+
+#ifndef _WIN32
+	void handle_connection(int fd, bool &shutdown)
+	{
+		string line;
+		char buffer[4096];
+		for (;;)
+		{
+			ssize_t ret = recv(fd, buffer, sizeof(buffer), 0);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+
+			line.append(buffer, size_t(ret));
+			if (line.find('\n') != string::npos || line.size() > 64 * 1024)
+				break;
+		}
+
+		auto newline = line.find('\n');
+		if (newline == string::npos)
+			return;
+		line.resize(newline);
+
+		string reply = handle_command(line, shutdown);
+		reply += '\n';
+
+		size_t offset = 0;
+		while (offset < reply.size())
+		{
+			ssize_t ret = send(fd, reply.data() + offset, reply.size() - offset, MSG_NOSIGNAL);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			offset += size_t(ret);
+		}
+	}
+
+	void accept_loop()
+	{
+		bool shutdown = false;
+		while (!shutdown)
+		{
+			int fd = accept(listen_fd, nullptr, nullptr);
+			if (fd < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				lock_guard<mutex> holder{lock};
+				if (!shutting_down)
+				{
+					LOGE("Replay daemon: failed to accept connection, shutting down.\n");
+					shutting_down = true;
+					cond.notify_one();
+				}
+				break;
+			}
+
+			handle_connection(fd, shutdown);
+			close(fd);
+		}
+	}
+#endif
+
+	void run()
+	{
+		unique_lock<mutex> holder{lock};
+		for (;;)
+		{
+			cond.wait(holder, [&]() { return shutting_down || pick_job() != nullptr; });
+			if (shutting_down)
+				break;
+
+			auto *job = pick_job();
+			// The work is done on a copy, so commands can look at the job meanwhile.
+			ReplayDaemonJob current = *job;
+
+			if (job->cancel_requested)
+			{
+				finish_job(*job, ReplayDaemonJobState::Cancelled);
+				holder.unlock();
+				if (current.opened)
+					runner.close_job(current);
+				holder.lock();
+				continue;
+			}
+
+			if (!job->opened)
+			{
+				holder.unlock();
+				bool ret = runner.open_job(current);
+				holder.lock();
+
+				job->opened = true;
+				job->graphics_total = current.graphics_total;
+				job->compute_total = current.compute_total;
+				if (!ret)
+				{
+					LOGE("Replay daemon: failed to open archives of job %u.\n", job->id);
+					finish_job(*job, ReplayDaemonJobState::Failed);
+					holder.unlock();
+					runner.close_job(current);
+					holder.lock();
+					continue;
+				}
+				current = *job;
+			}
+
+			ReplayDaemonSlice slice;
+			if (next_slice(current, slice))
+			{
+				job->state = ReplayDaemonJobState::Running;
+				virtual_time = job->pass;
+				current.state = job->state;
+
+				holder.unlock();
+				bool ret = runner.replay_slice(current, slice);
+				holder.lock();
+
+				// The job is never removed, so the pointer is still valid.
+				job->graphics_done = slice.graphics_end > slice.graphics_start ? slice.graphics_end : job->graphics_done;
+				job->compute_done = slice.compute_end > slice.compute_start ? slice.compute_end : job->compute_done;
+				if (!ret)
+				{
+					LOGE("Replay daemon: slice of job %u failed.\n", job->id);
+					job->failed_slices++;
+				}
+				job->pass += get_stride(job->priority);
+				current = *job;
+			}
+
+			if (!next_slice(current, slice))
+			{
+				finish_job(*job, ReplayDaemonJobState::Done);
+				holder.unlock();
+				runner.close_job(current);
+				holder.lock();
+			}
+		}
+
+		// Whatever was not finished is dropped.
+		vector<ReplayDaemonJob> unfinished;
+		for (auto &job : jobs)
+		{
+			if (job_is_finished(*job))
+				continue;
+			finish_job(*job, ReplayDaemonJobState::Cancelled);
+			if (job->opened)
+				unfinished.push_back(*job);
+		}
+		holder.unlock();
+
+		for (auto &job : unfinished)
+			runner.close_job(job);
+	}
+};
+
+ReplayDaemon::ReplayDaemon(ReplayDaemonRunner &runner, unsigned slice_size)
+	: impl(new Impl(runner, slice_size))
+{
+}
+
+ReplayDaemon::~ReplayDaemon()
+{
+#ifndef _WIN32
+	if (impl->listen_fd >= 0)
+	{
+		// Wakes up the accept thread if it is still waiting.
+		::shutdown(impl->listen_fd, SHUT_RDWR);
+		if (impl->accept_thread.joinable())
+			impl->accept_thread.join();
+		close(impl->listen_fd);
+		unlink(impl->socket_path.c_str());
+	}
+#endif
+}
+
+void ReplayDaemon::run()
+{
+	impl->run();
+}
+
+#ifdef _WIN32
+bool ReplayDaemon::listen(const char *)
+{
+	LOGE("The replay daemon is not supported on Windows.\n");
+	return false;
+}
+
+bool send_replay_daemon_command(const char *, const string &, string &)
+{
+	LOGE("The replay daemon is not supported on Windows.\n");
+	return false;
+}
+#else
+static bool fill_socket_address(const char *socket_path, sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		LOGE("Socket path %s is too long.\n", socket_path);
+		return false;
+	}
+	strcpy(addr.sun_path, socket_path);
+	return true;
+}
+
+bool ReplayDaemon::listen(const char *socket_path)
+{
+	sockaddr_un addr;
+	if (!fill_socket_address(socket_path, addr))
+		return false;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		LOGE("Failed to create socket.\n");
+		return false;
+	}
+
+	// A daemon which is still alive answers, so only a stale socket is removed.
+	if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0)
+	{
+		LOGE("A replay daemon is already listening on %s.\n", socket_path);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	unlink(socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		LOGE("Failed to create socket.\n");
+		return false;
+	}
+
+	if (bind(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(fd, 16) < 0)
+	{
+		LOGE("Failed to listen on %s: %s.\n", socket_path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	impl->listen_fd = fd;
+	impl->socket_path = socket_path;
+	impl->accept_thread = thread(&Impl::accept_loop, impl.get());
+	LOGI("Replay daemon listening on %s.\n", socket_path);
+	return true;
+}
+
+bool send_replay_daemon_command(const char *socket_path, const string &command, string &reply)
+{
+	sockaddr_un addr;
+	if (!fill_socket_address(socket_path, addr))
+		return false;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		LOGE("Failed to create socket.\n");
+		return false;
+	}
+
+	if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0)
+	{
+		LOGE("Failed to connect to replay daemon on %s: %s.\n", socket_path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	string line = command + '\n';
+	size_t offset = 0;
+	while (offset < line.size())
+	{
+		ssize_t ret = send(fd, line.data() + offset, line.size() - offset, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			LOGE("Failed to send command to replay daemon.\n");
+			close(fd);
+			return false;
+		}
+		offset += size_t(ret);
+	}
+
+	// The daemon closes the connection once the reply is written.
+	reply.clear();
+	char buffer[4096];
+	for (;;)
+	{
+		ssize_t ret = recv(fd, buffer, sizeof(buffer), 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+		{
+			LOGE("Failed to read reply from replay daemon.\n");
+			close(fd);
+			return false;
+		}
+		if (ret == 0)
+			break;
+		reply.append(buffer, size_t(ret));
+	}
+
+	close(fd);
+	while (!reply.empty() && reply.back() == '\n')
+		reply.pop_back();
+	return true;
+}
+#endif
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace Fossilize
+{
+enum class ReplayDaemonJobState
+{
+	Queued,
+	Running,
+	Done,
+	Failed,
+	Cancelled
+};
+
+const char *get_replay_daemon_job_state_name(ReplayDaemonJobState state);
+
+struct ReplayDaemonJob
+{
+	unsigned id = 0;
+	unsigned priority = 0;
+	std::vector<std::string> databases;
+	ReplayDaemonJobState state = ReplayDaemonJobState::Queued;
+
+	// Totals are filled in once the job's archives are opened.
+	unsigned graphics_total = 0;
+	unsigned compute_total = 0;
+	unsigned graphics_done = 0;
+	unsigned compute_done = 0;
+	unsigned failed_slices = 0;
+
+	// Stride scheduling, the runnable job with the lowest pass gets the next slice.
+	uint64_t pass = 0;
+	bool opened = false;
+	bool cancel_requested = false;
+};
+
+// Pipelines [start, end) of the job's graphics and compute pipelines, in replay order.
+struct ReplayDaemonSlice
+{
+	unsigned graphics_start = 0;
+	unsigned graphics_end = 0;
+	unsigned compute_start = 0;
+	unsigned compute_end = 0;
+};
+
+// Slices are replayed one at a time from the daemon's main thread, so the runner does not have to be thread-safe.
+class ReplayDaemonRunner
+{
+public:
+	virtual ~ReplayDaemonRunner() = default;
+
+	// Opens the archives of the job and fills in graphics_total and compute_total.
+	virtual bool open_job(ReplayDaemonJob &job) = 0;
+	virtual bool replay_slice(const ReplayDaemonJob &job, const ReplayDaemonSlice &slice) = 0;
+	// Called once the job is finished, failed or cancelled, even if open_job failed.
+	virtual void close_job(const ReplayDaemonJob &job) = 0;
+};
+
+// A long-lived replayer which accepts jobs over a Unix socket.
+// Jobs are replayed a slice of pipelines at a time, and the next slice always goes to the job which is furthest behind
+// relative to its priority. A job with twice the priority gets twice as many slices, and no job starves.
+//
+// The protocol is one command per connection, a single line with tab separated fields:
+//   submit <priority> <database>...   replies "ok <job id>"
+//   status [<job id>]                 replies one line per job
+//   cancel <job id>                   replies "ok"
+//   shutdown                          replies "ok", the current slice is finished first
+// Errors are replied as "error <message>".
+class ReplayDaemon
+{
+public:
+	ReplayDaemon(ReplayDaemonRunner &runner, unsigned slice_size);
+	~ReplayDaemon();
+
+	bool listen(const char *socket_path);
+
+	// Replays jobs until a shutdown command is received.
+	void run();
+
+	ReplayDaemon(const ReplayDaemon &) = delete;
+	void operator=(const ReplayDaemon &) = delete;
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> impl;
+};
+
+enum { REPLAY_DAEMON_MIN_PRIORITY = 1, REPLAY_DAEMON_DEFAULT_PRIORITY = 10, REPLAY_DAEMON_MAX_PRIORITY = 100 };
+
+// Sends a single command and reads back the reply. command must not contain newlines.
+bool send_replay_daemon_command(const char *socket_path, const std::string &command, std::string &reply);
+}
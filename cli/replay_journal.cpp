@@ -0,0 +1,203 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "replay_journal.hpp"
+#include "logging.hpp"
+#include "xxhash64.hpp"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+
+namespace Fossilize
+{
+static const char *tag_names[2] = { "graphics", "compute" };
+
+static bool get_tag_index(ResourceTag tag, unsigned *index)
+{
+	if (tag == RESOURCE_GRAPHICS_PIPELINE)
+		*index = 0;
+	else if (tag == RESOURCE_COMPUTE_PIPELINE)
+		*index = 1;
+	else
+		return false;
+	return true;
+}
+
+ReplayJournal::~ReplayJournal()
+{
+	if (file)
+		fclose(file);
+}
+
+bool ReplayJournal::open(const char *path, const VkPhysicalDeviceProperties &props)
+{
+	struct
+	{
+		uint32_t vendor_id;
+		uint32_t device_id;
+		uint32_t driver_version;
+		uint32_t format_version;
+		uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+	} key = {};
+
+	key.vendor_id = props.vendorID;
+	key.device_id = props.deviceID;
+	key.driver_version = props.driverVersion;
+	key.format_version = FOSSILIZE_FORMAT_VERSION;
+	memcpy(key.pipeline_cache_uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+	device_key = xxhash64(&key, sizeof(key), 0);
+
+	if (FILE *existing = fopen(path, "r"))
+	{
+		char line[128];
+		while (fgets(line, sizeof(line), existing))
+		{
+			char name[16];
+			uint64_t hash, line_key;
+
+			// Lines from other devices or drivers, and a line cut short by a crash, are just ignored.
+			if (sscanf(line, "%15s %" SCNx64 " %" SCNx64, name, &hash, &line_key) != 3 || line_key != device_key)
+				continue;
+
+			for (unsigned i = 0; i < 2; i++)
+				if (strcmp(name, tag_names[i]) == 0)
+					journaled[i].insert(hash);
+		}
+		fclose(existing);
+	}
+
+	file = fopen(path, "a");
+	if (!file)
+	{
+		LOGE("Failed to open replay journal %s for writing.\n", path);
+		return false;
+	}
+	return true;
+}
+
+bool ReplayJournal::contains(ResourceTag tag, Hash hash) const
+{
+	unsigned index;
+	if (!get_tag_index(tag, &index))
+		return false;
+	std::lock_guard<std::mutex> holder(lock);
+	return journaled[index].count(hash) != 0;
+}
+
+void ReplayJournal::record(ResourceTag tag, Hash hash)
+{
+	unsigned index;
+	if (!get_tag_index(tag, &index))
+		return;
+
+	std::lock_guard<std::mutex> holder(lock);
+	if (!file || !journaled[index].insert(hash).second)
+		return;
+
+	// One write per line, so lines from concurrent processes don't interleave.
+	char line[64];
+	int len = snprintf(line, sizeof(line), "%s %016" PRIx64 " %016" PRIx64 "\n", tag_names[index], hash, device_key);
+	if (len > 0)
+	{
+		fwrite(line, 1, size_t(len), file);
+		fflush(file);
+	}
+}
+
+// Reads every complete line of a journal, regardless of device, written out the same way record() does.
+static bool read_journal_lines(const char *path, std::unordered_set<std::string> &lines, bool must_exist)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+	{
+		if (must_exist)
+			LOGE("Failed to open replay journal %s.\n", path);
+		return !must_exist;
+	}
+
+	char line[128];
+	while (fgets(line, sizeof(line), file))
+	{
+		char name[16];
+		uint64_t hash, line_key;
+		if (sscanf(line, "%15s %" SCNx64 " %" SCNx64, name, &hash, &line_key) != 3)
+			continue;
+
+		for (auto *tag_name : tag_names)
+		{
+			if (strcmp(name, tag_name) == 0)
+			{
+				char canonical[64];
+				snprintf(canonical, sizeof(canonical), "%s %016" PRIx64 " %016" PRIx64 "\n", tag_name, hash, line_key);
+				lines.insert(canonical);
+			}
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+bool merge_replay_journals(const char *path, const char * const *paths, size_t count)
+{
+	std::unordered_set<std::string> lines;
+	if (!read_journal_lines(path, lines, false))
+		return false;
+
+	FILE *file = fopen(path, "a");
+	if (!file)
+	{
+		LOGE("Failed to open replay journal %s for writing.\n", path);
+		return false;
+	}
+
+	size_t merged = 0;
+	bool ret = true;
+	for (size_t i = 0; i < count && ret; i++)
+	{
+		std::unordered_set<std::string> input_lines;
+		if (!read_journal_lines(paths[i], input_lines, true))
+		{
+			ret = false;
+			break;
+		}
+
+		for (auto &line : input_lines)
+		{
+			if (lines.insert(line).second)
+			{
+				fwrite(line.data(), 1, line.size(), file);
+				merged++;
+			}
+		}
+	}
+
+	ret = ferror(file) == 0 && ret;
+	ret = fclose(file) == 0 && ret;
+	if (!ret)
+		LOGE("Failed to merge replay journals into %s.\n", path);
+	else
+		LOGI("Merged %u journal entries into %s.\n", unsigned(merged), path);
+	return ret;
+}
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "vulkan.h"
+#include "fossilize_types.hpp"
+#include <stdio.h>
+#include <mutex>
+#include <unordered_set>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Remembers which pipelines have been compiled successfully, so they can be skipped when the same
+// archive is replayed again, e.g. after new pipelines have been appended to it.
+// Every entry is keyed by the device, driver and Fossilize format version it was compiled with,
+// so a driver update invalidates the journal.
+// The journal is an append-only text file with one self-contained line per pipeline,
+// so several processes can append to it at once, and a crash loses at most the line being written.
+class ReplayJournal
+{
+public:
+	ReplayJournal() = default;
+	~ReplayJournal();
+	ReplayJournal(const ReplayJournal &) = delete;
+	void operator=(const ReplayJournal &) = delete;
+
+	// Reads what was journaled for this device and opens the journal for appending.
+	bool open(const char *path, const VkPhysicalDeviceProperties &props);
+
+	// Thread-safe.
+	bool contains(ResourceTag tag, Hash hash) const;
+	void record(ResourceTag tag, Hash hash);
+
+	size_t get_journaled_count() const
+	{
+		return journaled[0].size() + journaled[1].size();
+	}
+
+private:
+	FILE *file = nullptr;
+	uint64_t device_key = 0;
+	// Graphics and compute.
+	std::unordered_set<Hash> journaled[2];
+	mutable std::mutex lock;
+};
+
+// Appends the lines of the journals in paths which are not in the journal at path yet, for every device.
+// Used to combine the journals of a replay which was sharded across machines.
+bool merge_replay_journals(const char *path, const char * const *paths, size_t count);
+}
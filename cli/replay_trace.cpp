@@ -0,0 +1,213 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "replay_trace.hpp"
+#include "logging.hpp"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Fossilize
+{
+static unsigned get_process_id()
+{
+#ifdef _WIN32
+	return unsigned(GetCurrentProcessId());
+#else
+	return unsigned(getpid());
+#endif
+}
+
+static std::string escape_json(const char *str)
+{
+	std::string escaped;
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			escaped += '\\';
+		if (uint8_t(*str) >= 0x20)
+			escaped += *str;
+	}
+	return escaped;
+}
+
+ReplayTrace::ReplayTrace(unsigned num_threads)
+	: thread_events(num_threads)
+{
+}
+
+void ReplayTrace::set_device(const VkPhysicalDeviceProperties &props)
+{
+	char buffer[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE + 64];
+	snprintf(buffer, sizeof(buffer), "%s (%04x:%04x, driver 0x%08x)",
+	         props.deviceName, props.vendorID, props.deviceID, props.driverVersion);
+	device_description = escape_json(buffer);
+}
+
+void ReplayTrace::record(unsigned thread_index, const char *category, const char *name, Hash hash,
+                         std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end,
+                         unsigned count, uint64_t bytes)
+{
+	if (thread_index >= thread_events.size())
+		return;
+
+	Event event;
+	event.category = category;
+	event.name = name;
+	event.hash = hash;
+	event.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count();
+	event.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	event.count = count;
+	event.bytes = bytes;
+	thread_events[thread_index].push_back(event);
+}
+
+bool ReplayTrace::write(const char *path, bool fragment) const
+{
+	FILE *file = fopen(path, fragment ? "a" : "w");
+	if (!file)
+	{
+		LOGE("Failed to open trace %s for writing.\n", path);
+		return false;
+	}
+
+	if (!fragment)
+		fprintf(file, "{\"traceEvents\":[\n");
+
+	// Chrome trace uses microseconds.
+	unsigned pid = get_process_id();
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"fossilize-replay %s\"}}",
+	        pid, device_description.c_str());
+
+	for (size_t tid = 0; tid < thread_events.size(); tid++)
+	{
+		if (tid == 0)
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"main\"}}", pid);
+		else
+		{
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"worker %u\"}}",
+			        pid, unsigned(tid), unsigned(tid));
+		}
+
+		for (auto &event : thread_events[tid])
+		{
+			fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+			        event.name, event.category, pid, unsigned(tid),
+			        double(event.start_ns) * 1e-3, double(event.duration_ns) * 1e-3);
+
+			if (event.hash || event.count > 1 || event.bytes)
+			{
+				const char *separator = "";
+				fprintf(file, ",\"args\":{");
+				if (event.hash)
+				{
+					fprintf(file, "\"hash\":\"%016" PRIx64 "\"", event.hash);
+					separator = ",";
+				}
+				if (event.count > 1)
+				{
+					fprintf(file, "%s\"count\":%u", separator, event.count);
+					separator = ",";
+				}
+				if (event.bytes)
+					fprintf(file, "%s\"bytes\":%" PRIu64, separator, event.bytes);
+				fprintf(file, "}}");
+			}
+			else
+				fprintf(file, "}");
+		}
+	}
+
+	if (fragment)
+		fprintf(file, ",\n");
+	else
+		fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	bool ret = ferror(file) == 0;
+	ret = fclose(file) == 0 && ret;
+	if (!ret)
+		LOGE("Failed to write trace %s.\n", path);
+	return ret;
+}
+
+void remove_trace_fragments(const char *path, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+		remove((std::string(path) + "." + std::to_string(i)).c_str());
+}
+
+bool merge_trace_fragments(const char *path, unsigned count)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+	{
+		LOGE("Failed to open trace %s for writing.\n", path);
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+
+	bool first = true;
+	for (unsigned i = 0; i < count; i++)
+	{
+		std::string fragment_path = std::string(path) + "." + std::to_string(i);
+		FILE *fragment = fopen(fragment_path.c_str(), "rb");
+		if (!fragment)
+			continue;
+
+		std::string events;
+		char buffer[64 * 1024];
+		size_t read_size;
+		while ((read_size = fread(buffer, 1, sizeof(buffer), fragment)) != 0)
+			events.append(buffer, read_size);
+		fclose(fragment);
+		remove(fragment_path.c_str());
+
+		// Fragments end with a separator, so restarted processes can append to them.
+		while (!events.empty() && (events.back() == '\n' || events.back() == ','))
+			events.pop_back();
+		if (events.empty())
+			continue;
+
+		if (!first)
+			fprintf(file, ",\n");
+		fwrite(events.data(), 1, events.size(), file);
+		first = false;
+	}
+
+	fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	bool ret = ferror(file) == 0;
+	ret = fclose(file) == 0 && ret;
+	if (!ret)
+		LOGE("Failed to write trace %s.\n", path);
+	return ret;
+}
+}
@@ -0,0 +1,76 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "vulkan.h"
+#include "fossilize_types.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace Fossilize
+{
+// Timeline of what every replayer thread was doing, in the Chrome trace event format.
+// Open the file in chrome://tracing or https://ui.perfetto.dev.
+// Timestamps come from the monotonic clock, so traces written by several processes line up.
+class ReplayTrace
+{
+public:
+	// Thread 0 is the main thread, the rest are worker threads.
+	explicit ReplayTrace(unsigned num_threads);
+
+	// Shows up as the process name, so traces from different drivers can be told apart.
+	void set_device(const VkPhysicalDeviceProperties &props);
+
+	// Threads may record concurrently, as long as every thread only records with its own index.
+	// name and category must be string literals. A hash of 0, a count of 1 and 0 bytes are not written out.
+	void record(unsigned thread_index, const char *category, const char *name, Hash hash,
+	            std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end,
+	            unsigned count = 1, uint64_t bytes = 0);
+
+	// A fragment is appended to, and only holds the events themselves.
+	// merge_trace_fragments() turns fragments written by several processes into one trace.
+	bool write(const char *path, bool fragment) const;
+
+private:
+	struct Event
+	{
+		const char *category;
+		const char *name;
+		Hash hash;
+		int64_t start_ns;
+		int64_t duration_ns;
+		unsigned count;
+		uint64_t bytes;
+	};
+	std::vector<std::vector<Event>> thread_events;
+	std::string device_description;
+};
+
+// Removes fragments left behind by an earlier run which did not get to merge them.
+void remove_trace_fragments(const char *path, unsigned count);
+
+// Merges path.0 to path.(count - 1) into path and removes them.
+bool merge_trace_fragments(const char *path, unsigned count);
+}
@@ -0,0 +1,303 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "worker_scheduling.hpp"
+#include "logging.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+namespace Fossilize
+{
+static const char *core_type_names[] = { "any", "performance", "efficiency" };
+
+bool parse_core_type(const char *name, CoreType &type)
+{
+	for (unsigned i = 0; i < sizeof(core_type_names) / sizeof(core_type_names[0]); i++)
+	{
+		if (strcmp(name, core_type_names[i]) == 0)
+		{
+			type = CoreType(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *get_core_type_name(CoreType type)
+{
+	return core_type_names[unsigned(type)];
+}
+
+bool parse_cpu_list(const char *list, std::vector<unsigned> &cpus)
+{
+	cpus.clear();
+	while (*list != '\0' && *list != '\n')
+	{
+		char *end = nullptr;
+		unsigned long first = strtoul(list, &end, 10);
+		if (end == list)
+			return false;
+
+		unsigned long last = first;
+		list = end;
+		if (*list == '-')
+		{
+			last = strtoul(list + 1, &end, 10);
+			if (end == list + 1 || last < first)
+				return false;
+			list = end;
+		}
+
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			cpus.push_back(unsigned(cpu));
+
+		if (*list == ',')
+			list++;
+		else if (*list != '\0' && *list != '\n')
+			return false;
+	}
+
+	return !cpus.empty();
+}
+
+#ifdef _WIN32
+bool get_cpus_for_core_type(CoreType type, std::vector<unsigned> &cpus)
+{
+	cpus.clear();
+	if (type == CoreType::Any)
+		return false;
+
+	// Windows 10 and up.
+	using GetSystemCpuSetInformationFn = BOOL (WINAPI *)(PSYSTEM_CPU_SET_INFORMATION, ULONG, PULONG, HANDLE, ULONG);
+	auto get_info = reinterpret_cast<GetSystemCpuSetInformationFn>(
+			GetProcAddress(GetModuleHandleA("kernel32.dll"), "GetSystemCpuSetInformation"));
+	if (!get_info)
+		return false;
+
+	ULONG size = 0;
+	get_info(nullptr, 0, &size, GetCurrentProcess(), 0);
+	std::vector<uint8_t> buffer(size);
+	if (!size || !get_info(reinterpret_cast<PSYSTEM_CPU_SET_INFORMATION>(buffer.data()), size, &size, GetCurrentProcess(), 0))
+		return false;
+
+	// Higher efficiency classes are the faster cores.
+	struct Entry { unsigned cpu; unsigned efficiency_class; };
+	std::vector<Entry> entries;
+	for (ULONG offset = 0; offset < size; )
+	{
+		auto *info = reinterpret_cast<const SYSTEM_CPU_SET_INFORMATION *>(buffer.data() + offset);
+		if (info->Type == CpuSetInformation && info->CpuSet.Group == 0)
+			entries.push_back({ info->CpuSet.LogicalProcessorIndex, info->CpuSet.EfficiencyClass });
+		offset += info->Size;
+	}
+
+	if (entries.empty())
+		return false;
+
+	unsigned max_class = 0;
+	for (auto &entry : entries)
+		max_class = std::max(max_class, entry.efficiency_class);
+	for (auto &entry : entries)
+		if ((entry.efficiency_class == max_class) == (type == CoreType::Performance))
+			cpus.push_back(entry.cpu);
+
+	return !cpus.empty() && cpus.size() != entries.size();
+}
+
+bool set_current_thread_affinity(const std::vector<unsigned> &cpus)
+{
+	DWORD_PTR mask = 0;
+	for (auto cpu : cpus)
+		if (cpu < sizeof(mask) * 8)
+			mask |= DWORD_PTR(1) << cpu;
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+bool set_current_thread_background_priority()
+{
+	// Also lowers I/O and memory priority.
+	return SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != 0;
+}
+
+bool join_resource_group(const char *name)
+{
+	HANDLE job = OpenJobObjectA(JOB_OBJECT_ASSIGN_PROCESS, FALSE, name);
+	if (!job)
+	{
+		LOGE("Failed to open job object %s.\n", name);
+		return false;
+	}
+
+	bool ret = AssignProcessToJobObject(job, GetCurrentProcess()) != 0;
+	if (!ret)
+		LOGE("Failed to assign process to job object %s.\n", name);
+	CloseHandle(job);
+	return ret;
+}
+#elif defined(__linux__)
+static bool read_sysfs_line(const char *path, char *buffer, size_t size)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+	bool ret = fgets(buffer, int(size), file) != nullptr;
+	fclose(file);
+	return ret;
+}
+
+static bool read_sysfs_uint(const char *path, unsigned long long &value)
+{
+	char buffer[64];
+	if (!read_sysfs_line(path, buffer, sizeof(buffer)))
+		return false;
+	char *end = nullptr;
+	value = strtoull(buffer, &end, 10);
+	return end != buffer;
+}
+
+// Splits online CPUs by a per-CPU sysfs value, where the highest value marks the performance cores.
+static bool get_cpus_by_rank(CoreType type, const char *path_format, std::vector<unsigned> &cpus)
+{
+	char buffer[256];
+	std::vector<unsigned> online;
+	if (!read_sysfs_line("/sys/devices/system/cpu/online", buffer, sizeof(buffer)) || !parse_cpu_list(buffer, online))
+		return false;
+
+	std::vector<unsigned long long> values;
+	unsigned long long max_value = 0;
+	for (auto cpu : online)
+	{
+		char path[128];
+		snprintf(path, sizeof(path), path_format, cpu);
+		unsigned long long value = 0;
+		if (!read_sysfs_uint(path, value))
+			return false;
+		values.push_back(value);
+		max_value = std::max(max_value, value);
+	}
+
+	cpus.clear();
+	for (size_t i = 0; i < online.size(); i++)
+		if ((values[i] == max_value) == (type == CoreType::Performance))
+			cpus.push_back(online[i]);
+
+	return !cpus.empty() && cpus.size() != online.size();
+}
+
+bool get_cpus_for_core_type(CoreType type, std::vector<unsigned> &cpus)
+{
+	cpus.clear();
+	if (type == CoreType::Any)
+		return false;
+
+	// Intel hybrid CPUs expose a PMU per core type.
+	char buffer[256];
+	if (read_sysfs_line(type == CoreType::Performance ? "/sys/devices/cpu_core/cpus" : "/sys/devices/cpu_atom/cpus",
+	                    buffer, sizeof(buffer)) &&
+	    parse_cpu_list(buffer, cpus))
+	{
+		return true;
+	}
+
+	// Arm big.LITTLE exposes relative capacity, otherwise maximum clocks are the next best thing.
+	if (get_cpus_by_rank(type, "/sys/devices/system/cpu/cpu%u/cpu_capacity", cpus))
+		return true;
+	return get_cpus_by_rank(type, "/sys/devices/system/cpu/cpu%u/cpufreq/cpuinfo_max_freq", cpus);
+}
+
+bool set_current_thread_affinity(const std::vector<unsigned> &cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	bool any = false;
+	for (auto cpu : cpus)
+	{
+		if (cpu < CPU_SETSIZE)
+		{
+			CPU_SET(cpu, &set);
+			any = true;
+		}
+	}
+	return any && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool set_current_thread_background_priority()
+{
+	// On Linux, this only affects the calling thread. Threads the driver spawns from here inherit it.
+	sched_param param = {};
+	return sched_setscheduler(0, SCHED_IDLE, &param) == 0;
+}
+
+bool join_resource_group(const char *name)
+{
+	std::string path = std::string(name) + "/cgroup.procs";
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open %s.\n", path.c_str());
+		return false;
+	}
+
+	bool ret = fprintf(file, "%d\n", int(getpid())) > 0;
+	ret = fclose(file) == 0 && ret;
+	if (!ret)
+		LOGE("Failed to move process into cgroup %s.\n", name);
+	return ret;
+}
+#else
+bool get_cpus_for_core_type(CoreType, std::vector<unsigned> &cpus)
+{
+	cpus.clear();
+	return false;
+}
+
+bool set_current_thread_affinity(const std::vector<unsigned> &)
+{
+	return false;
+}
+
+bool set_current_thread_background_priority()
+{
+	return false;
+}
+
+bool join_resource_group(const char *name)
+{
+	LOGE("Cannot join resource group %s on this platform.\n", name);
+	return false;
+}
+#endif
+}
@@ -0,0 +1,57 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <vector>
+
+namespace Fossilize
+{
+enum class CoreType
+{
+	Any,
+	// The fastest cores, e.g. P-cores or big cores.
+	Performance,
+	// Everything else, e.g. E-cores or LITTLE cores.
+	Efficiency
+};
+
+// Names are any, performance and efficiency.
+bool parse_core_type(const char *name, CoreType &type);
+const char *get_core_type_name(CoreType type);
+
+// Parses lists like "0-3,8,10-11".
+bool parse_cpu_list(const char *list, std::vector<unsigned> &cpus);
+
+// Returns false if the system does not expose core types, or all cores are the same.
+bool get_cpus_for_core_type(CoreType type, std::vector<unsigned> &cpus);
+
+bool set_current_thread_affinity(const std::vector<unsigned> &cpus);
+
+// Lets the calling thread only run when nothing else wants the CPU, e.g. a game in the foreground.
+bool set_current_thread_background_priority();
+
+// Moves the calling process into a cgroup directory on Linux, or an existing named job object on Windows.
+// Child processes which are started afterwards stay in it.
+bool join_resource_group(const char *name);
+}
@@ -0,0 +1,191 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crc32c.hpp"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define FOSSILIZE_CRC32C_X86
+#define FOSSILIZE_CRC32C_TARGET __attribute__((target("sse4.2")))
+#include <nmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define FOSSILIZE_CRC32C_X86
+#define FOSSILIZE_CRC32C_TARGET
+#include <intrin.h>
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+// The instructions are only used if the compiler targets ARMv8 with CRC extensions to begin with.
+#define FOSSILIZE_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+namespace Fossilize
+{
+namespace
+{
+struct CRC32CTables
+{
+	CRC32CTables()
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t crc = i;
+			for (unsigned j = 0; j < 8; j++)
+				crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78u : 0u);
+			table[0][i] = crc;
+		}
+
+		for (uint32_t i = 0; i < 256; i++)
+			for (unsigned j = 1; j < 8; j++)
+				table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xffu];
+	}
+
+	uint32_t table[8][256];
+};
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size)
+{
+	static const CRC32CTables tables;
+	auto &t = tables.table;
+
+	auto *ptr = static_cast<const uint8_t *>(data);
+	crc = ~crc;
+
+	// Slicing-by-8.
+	while (size >= 8)
+	{
+		uint32_t lo = crc ^ (uint32_t(ptr[0]) | (uint32_t(ptr[1]) << 8) | (uint32_t(ptr[2]) << 16) | (uint32_t(ptr[3]) << 24));
+		uint32_t hi = uint32_t(ptr[4]) | (uint32_t(ptr[5]) << 8) | (uint32_t(ptr[6]) << 16) | (uint32_t(ptr[7]) << 24);
+		crc = t[7][lo & 0xffu] ^ t[6][(lo >> 8) & 0xffu] ^ t[5][(lo >> 16) & 0xffu] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xffu] ^ t[2][(hi >> 8) & 0xffu] ^ t[1][(hi >> 16) & 0xffu] ^ t[0][hi >> 24];
+		ptr += 8;
+		size -= 8;
+	}
+
+	while (size--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *ptr++) & 0xffu];
+
+	return ~crc;
+}
+
+#if defined(FOSSILIZE_CRC32C_X86)
+FOSSILIZE_CRC32C_TARGET static uint32_t crc32c_hardware(uint32_t crc, const void *data, size_t size)
+{
+	auto *ptr = static_cast<const uint8_t *>(data);
+	crc = ~crc;
+
+#if defined(__x86_64__) || defined(_M_X64)
+	uint64_t crc64 = crc;
+	while (size >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, ptr, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		ptr += 8;
+		size -= 8;
+	}
+	crc = uint32_t(crc64);
+#endif
+
+	while (size >= 4)
+	{
+		uint32_t v;
+		memcpy(&v, ptr, sizeof(v));
+		crc = _mm_crc32_u32(crc, v);
+		ptr += 4;
+		size -= 4;
+	}
+
+	while (size--)
+		crc = _mm_crc32_u8(crc, *ptr++);
+
+	return ~crc;
+}
+
+static bool detect_hardware_support()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+#elif defined(FOSSILIZE_CRC32C_ARM)
+static uint32_t crc32c_hardware(uint32_t crc, const void *data, size_t size)
+{
+	auto *ptr = static_cast<const uint8_t *>(data);
+	crc = ~crc;
+
+#ifdef __aarch64__
+	while (size >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, ptr, sizeof(v));
+		crc = __crc32cd(crc, v);
+		ptr += 8;
+		size -= 8;
+	}
+#endif
+
+	while (size >= 4)
+	{
+		uint32_t v;
+		memcpy(&v, ptr, sizeof(v));
+		crc = __crc32cw(crc, v);
+		ptr += 4;
+		size -= 4;
+	}
+
+	while (size--)
+		crc = __crc32cb(crc, *ptr++);
+
+	return ~crc;
+}
+
+static bool detect_hardware_support()
+{
+	return true;
+}
+#endif
+
+bool crc32c_is_hardware_accelerated()
+{
+#if defined(FOSSILIZE_CRC32C_X86) || defined(FOSSILIZE_CRC32C_ARM)
+	static const bool supported = detect_hardware_support();
+	return supported;
+#else
+	return false;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+#if defined(FOSSILIZE_CRC32C_X86) || defined(FOSSILIZE_CRC32C_ARM)
+	if (crc32c_is_hardware_accelerated())
+		return crc32c_hardware(crc, data, size);
+#endif
+	return crc32c_portable(crc, data, size);
+}
+}
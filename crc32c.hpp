@@ -0,0 +1,39 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Fossilize
+{
+// CRC32C (Castagnoli polynomial). Like zlib's crc32(), pass in 0 to start a new checksum,
+// or the previous result to continue one.
+// Uses the SSE 4.2 or ARMv8 CRC32 instructions if the CPU supports them, which is an order of magnitude faster than
+// a table driven CRC32.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+// Always uses the portable table driven implementation.
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size);
+
+bool crc32c_is_hardware_accelerated();
+}
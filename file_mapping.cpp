@@ -0,0 +1,349 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "file_mapping.hpp"
+#include <vector>
+
+namespace Fossilize
+{
+FileMapping::~FileMapping()
+{
+	unmap();
+}
+
+PositionalFile::~PositionalFile()
+{
+	close();
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size)
+{
+	while (size)
+	{
+#ifdef _WIN32
+		unsigned to_write = size > 0x40000000u ? 0x40000000u : unsigned(size);
+		int ret = _write(fd, data, to_write);
+#else
+		ssize_t ret = write(fd, data, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+#endif
+		if (ret <= 0)
+			return false;
+		data += ret;
+		size -= size_t(ret);
+	}
+
+	return true;
+}
+
+// Fallback for when the copy cannot be offloaded to the kernel.
+static bool copy_through_buffer(const PositionalFile &file, uint64_t offset, uint64_t size, int output_fd)
+{
+	std::vector<uint8_t> buffer(size < (1u << 20) ? size_t(size) : size_t(1u << 20));
+	while (size)
+	{
+		size_t to_copy = size < buffer.size() ? size_t(size) : buffer.size();
+		if (!file.read(offset, buffer.data(), to_copy))
+			return false;
+		if (!write_all(output_fd, buffer.data(), to_copy))
+			return false;
+		offset += to_copy;
+		size -= to_copy;
+	}
+
+	return true;
+}
+
+#ifdef _WIN32
+bool FileMapping::map(const char *path)
+{
+	unmap();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+	                          nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || uint64_t(size.QuadPart) > uint64_t(SIZE_MAX))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	file_handle = file;
+	mapping_handle = mapping;
+	mapped = static_cast<const uint8_t *>(ptr);
+	mapped_size = size_t(size.QuadPart);
+	return true;
+}
+
+void FileMapping::unmap()
+{
+	if (mapped)
+		UnmapViewOfFile(mapped);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+
+	mapped = nullptr;
+	mapped_size = 0;
+	mapping_handle = nullptr;
+	file_handle = nullptr;
+}
+
+bool PositionalFile::open(const char *path)
+{
+	close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+	                          nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	handle = file;
+	file_size = uint64_t(size.QuadPart);
+	return true;
+}
+
+void PositionalFile::close()
+{
+	if (handle)
+		CloseHandle(handle);
+	handle = nullptr;
+	file_size = 0;
+}
+
+bool PositionalFile::read(uint64_t offset, void *data, size_t size) const
+{
+	auto *ptr = static_cast<uint8_t *>(data);
+	while (size)
+	{
+		// With a synchronous handle, passing an OVERLAPPED only serves to specify the offset.
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset & 0xffffffffu);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+
+		DWORD to_read = size > 0x40000000u ? DWORD(0x40000000u) : DWORD(size);
+		DWORD did_read = 0;
+		if (!ReadFile(handle, ptr, to_read, &did_read, &overlapped) || did_read == 0)
+			return false;
+
+		ptr += did_read;
+		offset += did_read;
+		size -= did_read;
+	}
+
+	return true;
+}
+
+bool PositionalFile::copy_to_fd(uint64_t offset, uint64_t size, int output_fd) const
+{
+	return copy_through_buffer(*this, offset, size, output_fd);
+}
+
+// PrefetchVirtualMemory() needs Windows 8, and there is no readahead hint for plain reads,
+// so these are left to the OS's own readahead for now.
+void FileMapping::prefetch(size_t, size_t) const
+{
+}
+
+void PositionalFile::prefetch(uint64_t, uint64_t) const
+{
+}
+#else
+bool FileMapping::map(const char *path)
+{
+	unmap();
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat s;
+	if (fstat(fd, &s) < 0 || s.st_size <= 0 || uint64_t(s.st_size) > uint64_t(SIZE_MAX))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *ptr = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps its own reference to the file.
+	close(fd);
+
+	if (ptr == MAP_FAILED)
+		return false;
+
+	mapped = static_cast<const uint8_t *>(ptr);
+	mapped_size = size_t(s.st_size);
+	return true;
+}
+
+void FileMapping::unmap()
+{
+	if (mapped)
+		munmap(const_cast<uint8_t *>(mapped), mapped_size);
+	mapped = nullptr;
+	mapped_size = 0;
+}
+
+bool PositionalFile::open(const char *path)
+{
+	close();
+
+	fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat s;
+	if (fstat(fd, &s) < 0)
+	{
+		close();
+		return false;
+	}
+
+	file_size = uint64_t(s.st_size);
+	return true;
+}
+
+void PositionalFile::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	file_size = 0;
+}
+
+bool PositionalFile::read(uint64_t offset, void *data, size_t size) const
+{
+	auto *ptr = static_cast<uint8_t *>(data);
+	while (size)
+	{
+		ssize_t ret = pread(fd, ptr, size, off_t(offset));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		ptr += ret;
+		offset += uint64_t(ret);
+		size -= size_t(ret);
+	}
+
+	return true;
+}
+
+bool PositionalFile::copy_to_fd(uint64_t offset, uint64_t size, int output_fd) const
+{
+#if defined(__linux__) && defined(SYS_copy_file_range)
+	// Go through syscall() since older C libraries do not have a wrapper.
+	while (size)
+	{
+		int64_t input_offset = int64_t(offset);
+		size_t to_copy = size > 0x40000000u ? size_t(0x40000000u) : size_t(size);
+		long ret = syscall(SYS_copy_file_range, fd, &input_offset, output_fd, nullptr, to_copy, 0u);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		// Not supported by the kernel or across these file systems.
+		if (ret < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF))
+			break;
+
+		if (ret <= 0)
+			return false;
+
+		offset += uint64_t(ret);
+		size -= uint64_t(ret);
+	}
+#endif
+
+	return copy_through_buffer(*this, offset, size, output_fd);
+}
+
+void FileMapping::prefetch(size_t offset, size_t size) const
+{
+	if (!mapped || offset >= mapped_size)
+		return;
+	if (size > mapped_size - offset)
+		size = mapped_size - offset;
+
+	// madvise() needs a page aligned address.
+	auto page_size = size_t(sysconf(_SC_PAGESIZE));
+	size_t aligned_offset = offset & ~(page_size - 1);
+	madvise(const_cast<uint8_t *>(mapped) + aligned_offset, size + (offset - aligned_offset), MADV_WILLNEED);
+}
+
+void PositionalFile::prefetch(uint64_t offset, uint64_t size) const
+{
+	if (fd < 0)
+		return;
+
+#ifdef __APPLE__
+	radvisory advisory = {};
+	advisory.ra_offset = off_t(offset);
+	advisory.ra_count = size > 0x7fffffffu ? 0x7fffffff : int(size);
+	fcntl(fd, F_RDADVISE, &advisory);
+#else
+	posix_fadvise(fd, off_t(offset), off_t(size), POSIX_FADV_WILLNEED);
+#endif
+}
+#endif
+}
@@ -0,0 +1,117 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Fossilize
+{
+// Read-only mapping of an entire file into the address space.
+// Once mapped, the data can be accessed concurrently from any thread without locking.
+class FileMapping
+{
+public:
+	FileMapping() = default;
+	~FileMapping();
+
+	// Returns false if the file does not exist, is empty, or cannot be mapped (e.g. address space exhaustion on 32-bit).
+	bool map(const char *path);
+	void unmap();
+
+	const uint8_t *data() const
+	{
+		return mapped;
+	}
+
+	size_t size() const
+	{
+		return mapped_size;
+	}
+
+	bool is_mapped() const
+	{
+		return mapped != nullptr;
+	}
+
+	// Hints that a range of the mapping will be accessed soon, so the OS can start paging it in.
+	void prefetch(size_t offset, size_t size) const;
+
+	FileMapping(const FileMapping &) = delete;
+	void operator=(const FileMapping &) = delete;
+
+private:
+	const uint8_t *mapped = nullptr;
+	size_t mapped_size = 0;
+#ifdef _WIN32
+	void *file_handle = nullptr;
+	void *mapping_handle = nullptr;
+#endif
+};
+
+// Read-only file which is always read at explicit offsets, pread() on POSIX and ReadFile() with an offset on Windows.
+// There is no shared file position like with FILE, so reads can be issued concurrently from any thread without locking.
+class PositionalFile
+{
+public:
+	PositionalFile() = default;
+	~PositionalFile();
+
+	bool open(const char *path);
+	void close();
+
+	bool read(uint64_t offset, void *data, size_t size) const;
+
+	// Copies a range of the file to the current position of a file descriptor, as returned by fileno().
+	// On Linux, this uses copy_file_range(), which lets the kernel (or file system) copy the data without a round trip through user space.
+	bool copy_to_fd(uint64_t offset, uint64_t size, int output_fd) const;
+
+	// Hints that a range of the file will be read soon, so the OS can start reading it into the page cache.
+	void prefetch(uint64_t offset, uint64_t size) const;
+
+	uint64_t size() const
+	{
+		return file_size;
+	}
+
+	bool is_open() const
+	{
+#ifdef _WIN32
+		return handle != nullptr;
+#else
+		return fd >= 0;
+#endif
+	}
+
+	PositionalFile(const PositionalFile &) = delete;
+	void operator=(const PositionalFile &) = delete;
+
+private:
+#ifdef _WIN32
+	void *handle = nullptr;
+#else
+	int fd = -1;
+#endif
+	uint64_t file_size = 0;
+};
+}
@@ -21,23 +21,41 @@
  */
 
 #include <atomic>
+#include <chrono>
 #include <mutex>
-#include <condition_variable>
 #include <thread>
 #include <stddef.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include "fossilize.hpp"
 #include <algorithm>
-#include <unordered_map>
-#include <queue>
+#include <deque>
+#include <memory>
 #include <string.h>
 #include "varint.hpp"
+#include "xxhash64.hpp"
+#include "base64.hpp"
+#include "fossilize_profiling.hpp"
 #include "path.hpp"
 #include "fossilize_db.hpp"
 #include "layer/utils.hpp"
+#include "util/concurrent_hash_set.hpp"
+#include "util/mpsc_queue.hpp"
+#include "util/flat_hash_map.hpp"
+#include "util/entry_payload.hpp"
 #include "fossilize_errors.hpp"
 #include "fossilize_application_filter.hpp"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
 #define RAPIDJSON_HAS_STDSTRING 1
 #include "rapidjson/document.h"
 #include "rapidjson/prettywriter.h"
@@ -55,6 +73,9 @@ using namespace std;
 
 namespace Fossilize
 {
+// First format version which hashes bulk data with XXH64.
+enum { FOSSILIZE_FORMAT_VERSION_XXHASH64 = 7 };
+
 class Hasher
 {
 public:
@@ -65,12 +86,27 @@ public:
 
 	Hasher() = default;
 
+	// Bulk data such as SPIR-V is hashed with XXH64, seeded with the running hash.
+	// Up to format version 6, this was one multiply-xor per element, a serial dependency chain over the entire blob.
+	// The old scheme is kept for recording into archives of those versions,
+	// since everything which refers to a shader module would be recorded again under a new hash otherwise.
+	// fossilize-rehash can migrate older archives.
+	void set_format_version(unsigned version)
+	{
+		legacy_data = version < FOSSILIZE_FORMAT_VERSION_XXHASH64;
+	}
+
 	template <typename T>
 	inline void data(const T *data_, size_t size)
 	{
-		size /= sizeof(*data_);
-		for (size_t i = 0; i < size; i++)
-			h = (h * 0x100000001b3ull) ^ data_[i];
+		if (legacy_data)
+		{
+			size /= sizeof(*data_);
+			for (size_t i = 0; i < size; i++)
+				h = (h * 0x100000001b3ull) ^ data_[i];
+		}
+		else
+			h = xxhash64(data_, size, h);
 	}
 
 	inline void u32(uint32_t value)
@@ -128,6 +164,7 @@ public:
 
 private:
 	Hash h = 0xcbf29ce484222325ull;
+	bool legacy_data = false;
 };
 
 template <typename T>
@@ -145,25 +182,173 @@ static Value uint64_string(uint64_t value, Allocator &alloc)
 	return Value(str, alloc);
 }
 
+// reinterpret_cast does not work reliably on MSVC 2013 for Vulkan objects.
+template <typename T, typename U>
+static inline T api_object_cast(U obj)
+{
+	static_assert(sizeof(T) == sizeof(U), "Objects are not of same size.");
+	return (T)obj;
+}
+
+// Maps object hashes to the handles replayed for them.
+// enqueue_create_*() may write the handle back long after it returns, so handles live in a deque, which never moves
+// its elements, and the open-addressing index only points into it.
+// Entries can be frozen into an immutable layer which other tables share, so per-thread replayers inherit the
+// references of the main replayer without copying them. Local entries shadow shared ones.
+template <typename Handle>
+class HandleTable
+{
+public:
+	const Handle *find(Hash hash) const
+	{
+		auto *value = local.index.find(hash);
+		for (auto *layer = shared.get(); !value && layer; layer = layer->parent.get())
+			value = layer->index.find(hash);
+		return value ? *value : nullptr;
+	}
+
+	size_t count(Hash hash) const
+	{
+		return find(hash) ? 1 : 0;
+	}
+
+	Handle &operator[](Hash hash)
+	{
+		auto *value = local.index.find(hash);
+		if (value)
+			return **value;
+
+		local.storage.emplace_back();
+		local.index.emplace(hash, &local.storage.back());
+		return local.storage.back();
+	}
+
+	// Logically const: the entries stay the same, they only move into a layer which can be shared.
+	// Concurrent calls on the same table must be serialized by the caller.
+	void share_with(HandleTable &other) const
+	{
+		if (!local.index.empty())
+		{
+			auto layer = std::make_shared<Layer>();
+			layer->index = std::move(local.index);
+			layer->storage = std::move(local.storage);
+			layer->parent = std::move(shared);
+			local.index.clear();
+			local.storage.clear();
+			shared = std::move(layer);
+		}
+
+		other.local.index.clear();
+		other.local.storage.clear();
+		other.shared = shared;
+	}
+
+	// Copies the entries which were added to other itself, not the ones it shares with other tables.
+	void merge_local(const HandleTable &other)
+	{
+		for (auto &entry : other.local.index)
+			(*this)[entry.first] = *entry.second;
+	}
+
+	void clear()
+	{
+		local.index.clear();
+		local.storage.clear();
+		shared.reset();
+	}
+
+private:
+	struct Layer
+	{
+		FlatHashMap<Handle *> index;
+		std::deque<Handle> storage;
+		std::shared_ptr<const Layer> parent;
+	};
+	mutable Layer local;
+	mutable std::shared_ptr<const Layer> shared;
+};
+
+// Maps Vulkan handles back to the hash of the object they were created from.
+// Drivers recycle the handles of destroyed objects, so a later assignment replaces the hash.
+template <typename Handle>
+class HandleHashMap
+{
+public:
+	const Hash *find(Handle handle) const
+	{
+		return map.find(api_object_cast<uint64_t>(handle));
+	}
+
+	Hash &operator[](Handle handle)
+	{
+		return map[api_object_cast<uint64_t>(handle)];
+	}
+
+	void erase(Handle handle)
+	{
+		map.erase(api_object_cast<uint64_t>(handle));
+	}
+
+private:
+	FlatHashMap<Hash> map;
+};
+
+struct BinaryReader;
+struct BinaryStateSink;
+
 struct StateReplayer::Impl
 {
 	bool parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t size) FOSSILIZE_WARN_UNUSED;
 	ScratchAllocator allocator;
 
-	std::unordered_map<Hash, VkSampler> replayed_samplers;
-	std::unordered_map<Hash, VkDescriptorSetLayout> replayed_descriptor_set_layouts;
-	std::unordered_map<Hash, VkPipelineLayout> replayed_pipeline_layouts;
-	std::unordered_map<Hash, VkShaderModule> replayed_shader_modules;
-	std::unordered_map<Hash, VkRenderPass> replayed_render_passes;
-	std::unordered_map<Hash, VkPipeline> replayed_compute_pipelines;
-	std::unordered_map<Hash, VkPipeline> replayed_graphics_pipelines;
+	// JSON is parsed in-situ, out of a pool which is kept between blobs, so replaying many small blobs
+	// does not allocate and free a DOM for every one of them. Parsing recurses when dependencies are
+	// pulled in from the resolver, so the pool is only cleared once the outermost document is done with.
+	enum { JsonPoolSize = 64 * 1024 };
+	std::unique_ptr<char[]> json_pool_buffer{new char[JsonPoolSize]};
+	MemoryPoolAllocator<> json_allocator{json_pool_buffer.get(), JsonPoolSize};
+	unsigned json_parse_depth = 0;
+
+	struct JsonPoolScope
+	{
+		explicit JsonPoolScope(Impl &impl_)
+			: impl(impl_)
+		{
+			impl.json_parse_depth++;
+		}
+
+		~JsonPoolScope()
+		{
+			if (--impl.json_parse_depth == 0)
+				impl.json_allocator.Clear();
+		}
+
+		Impl &impl;
+	};
+	bool parse_json_document(const uint8_t *buffer, size_t json_size, Document &doc) FOSSILIZE_WARN_UNUSED;
+
+	HandleTable<VkSampler> replayed_samplers;
+	HandleTable<VkDescriptorSetLayout> replayed_descriptor_set_layouts;
+	HandleTable<VkPipelineLayout> replayed_pipeline_layouts;
+	HandleTable<VkShaderModule> replayed_shader_modules;
+	HandleTable<VkRenderPass> replayed_render_passes;
+	HandleTable<VkPipeline> replayed_compute_pipelines;
+	HandleTable<VkPipeline> replayed_graphics_pipelines;
+	mutable std::mutex handle_reference_lock;
+
+	// Graphics pipeline sub-states which were stored as entries of their own are decoded once and kept until
+	// forget_handle_references(). They are allocated separately, so resetting the allocator between pipelines
+	// does not pull them out from under the cache.
+	ScratchAllocator pipeline_state_allocator;
+	FlatHashMap<const void *> replayed_pipeline_states;
 
 	void copy_handle_references(const Impl &impl);
+	void merge_handle_references(const Impl &impl);
 	void forget_handle_references();
 	bool parse_samplers(StateCreatorInterface &iface, const Value &samplers) FOSSILIZE_WARN_UNUSED;
 	bool parse_descriptor_set_layouts(StateCreatorInterface &iface, const Value &layouts) FOSSILIZE_WARN_UNUSED;
 	bool parse_pipeline_layouts(StateCreatorInterface &iface, const Value &layouts) FOSSILIZE_WARN_UNUSED;
-	bool parse_shader_modules(StateCreatorInterface &iface, const Value &modules, const uint8_t *varint, size_t varint_size) FOSSILIZE_WARN_UNUSED;
+	bool parse_shader_modules(StateCreatorInterface &iface, const Value &modules, const uint8_t *varint, size_t varint_size, unsigned version) FOSSILIZE_WARN_UNUSED;
 	bool parse_render_passes(StateCreatorInterface &iface, const Value &passes) FOSSILIZE_WARN_UNUSED;
 	bool parse_compute_pipelines(StateCreatorInterface &iface, DatabaseInterface *resolver, const Value &pipelines) FOSSILIZE_WARN_UNUSED;
 	bool parse_graphics_pipelines(StateCreatorInterface &iface, DatabaseInterface *resolver, const Value &pipelines) FOSSILIZE_WARN_UNUSED;
@@ -205,18 +390,171 @@ struct StateReplayer::Impl
 	bool parse_rasterization_stream_state(const Value &state, VkPipelineRasterizationStateStreamCreateInfoEXT **out_info) FOSSILIZE_WARN_UNUSED;
 	bool parse_uints(const Value &attachments, const uint32_t **out_uints) FOSSILIZE_WARN_UNUSED;
 	const char *duplicate_string(const char *str, size_t len);
+
+	// While scanning, handles are not resolved. The hashes they refer to are collected instead.
+	bool scanning = false;
+	std::vector<StateReference> scanned_references;
+	bool scan_references(const void *buffer, size_t size);
+	bool scan_binary(const uint8_t *buffer, size_t size);
+	void add_reference(ResourceTag tag, Hash hash);
+
+	template <typename Handle>
+	bool resolve_replayed_handle(const HandleTable<Handle> &replayed, ResourceTag tag, const char *type, Hash hash,
+	                             Handle *out_handle) FOSSILIZE_WARN_UNUSED;
+	bool resolve_shader_module(StateCreatorInterface &iface, DatabaseInterface *resolver, Hash hash, VkShaderModule *out_module) FOSSILIZE_WARN_UNUSED;
+	bool resolve_external_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver, ResourceTag tag, Hash hash,
+	                               const HandleTable<VkPipeline> &replayed, VkPipeline *out_pipeline) FOSSILIZE_WARN_UNUSED;
+	bool resolve_base_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver, ResourceTag tag, Hash hash,
+	                           const HandleTable<VkPipeline> &replayed, VkPipeline *out_pipeline) FOSSILIZE_WARN_UNUSED;
+
+	bool parse_binary(StateCreatorInterface &iface, DatabaseInterface *resolver, const uint8_t *buffer, size_t size) FOSSILIZE_WARN_UNUSED;
+	bool read_application_info(StateCreatorInterface &iface, BinaryReader &reader) FOSSILIZE_WARN_UNUSED;
+	bool read_sampler(BinaryReader &reader, VkSamplerCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_descriptor_set_layout(BinaryReader &reader, VkDescriptorSetLayoutCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_pipeline_layout(BinaryReader &reader, VkPipelineLayoutCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_shader_module(BinaryReader &reader, unsigned version, VkShaderModuleCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_render_pass(BinaryReader &reader, VkRenderPassCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_attachment_references(BinaryReader &reader, const VkAttachmentReference **out_references, uint32_t *out_count) FOSSILIZE_WARN_UNUSED;
+	bool read_shader_stage(StateCreatorInterface &iface, DatabaseInterface *resolver, BinaryReader &reader, VkPipelineShaderStageCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_pnext_chain(BinaryReader &reader, ScratchAllocator &alloc, const void **out_pnext) FOSSILIZE_WARN_UNUSED;
+	bool read_compute_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver, BinaryReader &reader, VkComputePipelineCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_graphics_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver, BinaryReader &reader, VkGraphicsPipelineCreateInfo *info) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineVertexInputStateCreateInfo *vi) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineInputAssemblyStateCreateInfo *ia) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineTessellationStateCreateInfo *tess) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineViewportStateCreateInfo *vp) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineRasterizationStateCreateInfo *rs) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineMultisampleStateCreateInfo *ms) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineDepthStencilStateCreateInfo *ds) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineColorBlendStateCreateInfo *cb) FOSSILIZE_WARN_UNUSED;
+	bool read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineDynamicStateCreateInfo *dyn) FOSSILIZE_WARN_UNUSED;
+	template <typename State>
+	bool read_pipeline_state(DatabaseInterface *resolver, BinaryReader &reader, const State **out_state) FOSSILIZE_WARN_UNUSED;
+	template <typename State>
+	const void *decode_pipeline_state(BinaryReader &reader);
+	bool read_pipeline_state_entry(BinaryReader &reader, Hash hash, const void **out_state) FOSSILIZE_WARN_UNUSED;
+	bool resolve_pipeline_state(DatabaseInterface *resolver, Hash hash, const void **out_state) FOSSILIZE_WARN_UNUSED;
+
 	bool resolve_derivative_pipelines = true;
 	bool resolve_shader_modules = true;
+	DatabaseInterface *module_store = nullptr;
 
 	template <typename T>
 	T *copy(const T *src, size_t count);
 };
 
+// Application threads deep copy create infos into an arena of their own, so copying does not need a lock.
+// Every work item which points into an arena holds a reference to it, and so does the thread copying into it.
+// Once the recording thread has consumed the last item of an arena the owning thread has moved on from,
+// the arena is reset and recycled.
+struct RecordArena
+{
+	ScratchAllocator allocator;
+	std::atomic<uint32_t> references;
+	// Memory of the arena which is accounted for in RecordArenaPool::live_bytes.
+	// Only the owning thread adds to it, and it is returned once the last reference is gone.
+	size_t accounted_bytes = 0;
+};
+
+// Threads may hold on to an arena after the StateRecorder is gone,
+// so the pool is shared between the recorder and the threads which use it.
+struct RecordArenaPool
+{
+	RecordArena *acquire();
+	void release(RecordArena *arena);
+	void free_unused_arenas();
+
+	void account(RecordArena *arena);
+
+	std::mutex lock;
+	std::vector<std::unique_ptr<RecordArena>> arenas;
+	std::vector<RecordArena *> free_arenas;
+
+	// Memory held by arenas which are in use, which is what the record queue limit applies to.
+	std::atomic<uint64_t> live_bytes{0};
+	std::atomic<uint64_t> max_live_bytes{0};
+};
+
+struct ThreadRecordArena
+{
+	~ThreadRecordArena();
+	std::shared_ptr<RecordArenaPool> pool;
+	RecordArena *arena = nullptr;
+};
+
+static thread_local ThreadRecordArena thread_record_arena;
+
+// Backs StateRecorderStatistics. Updated with relaxed atomics, since the counters are only ever sampled.
+struct RecorderCounters
+{
+	std::atomic<uint64_t> record_count{0};
+	std::atomic<uint64_t> record_time_ns{0};
+	std::atomic<uint64_t> queue_depth{0};
+	std::atomic<uint64_t> max_queue_depth{0};
+	std::atomic<uint64_t> entries_written{0};
+	std::atomic<uint64_t> bytes_written{0};
+	std::atomic<uint64_t> thread_busy_time_ns{0};
+	std::atomic<uint64_t> blocked_count{0};
+	std::atomic<uint64_t> blocked_time_ns{0};
+	std::atomic<uint64_t> dropped_count{0};
+
+	static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start)
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count());
+	}
+
+	void queued_item()
+	{
+		uint64_t depth = queue_depth.fetch_add(1, std::memory_order_relaxed) + 1;
+		uint64_t max_depth = max_queue_depth.load(std::memory_order_relaxed);
+		while (depth > max_depth &&
+		       !max_queue_depth.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void wrote_entry(size_t size)
+	{
+		entries_written.fetch_add(1, std::memory_order_relaxed);
+		bytes_written.fetch_add(size, std::memory_order_relaxed);
+	}
+};
+
+// Accounts for the time spent in a record_*() call on the calling thread.
+struct RecordStatisticsScope
+{
+	explicit RecordStatisticsScope(RecorderCounters &counters_)
+		: counters(counters_), start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~RecordStatisticsScope()
+	{
+		counters.record_count.fetch_add(1, std::memory_order_relaxed);
+		counters.record_time_ns.fetch_add(RecorderCounters::elapsed_ns(start), std::memory_order_relaxed);
+	}
+
+	RecorderCounters &counters;
+	std::chrono::steady_clock::time_point start;
+};
+
 struct WorkItem
 {
 	uint64_t handle;
 	void *create_info;
 	Hash custom_hash;
+	// Set if the object was deduplicated before it was copied. create_info is nullptr and custom_hash holds the hash,
+	// only the handle to hash mapping needs to be recorded.
+	VkStructureType deduplicated_type;
+	// The arena create_info was copied into.
+	RecordArena *arena;
+	// Set if the object was destroyed. deduplicated_type holds the type of the object, and its handle is forgotten.
+	bool forget;
+	// When the application created the object, for usage metadata.
+	uint32_t usage_time_ms;
+	uint32_t usage_frame;
+	uint32_t usage_flags;
 };
 
 struct StateRecorder::Impl
@@ -226,25 +564,26 @@ struct StateRecorder::Impl
 	void record_end();
 
 	ScratchAllocator allocator;
-	ScratchAllocator temp_allocator;
 	DatabaseInterface *database_iface = nullptr;
 	ApplicationInfoFilter *application_info_filter = nullptr;
-
-	std::unordered_map<Hash, VkDescriptorSetLayoutCreateInfo *> descriptor_sets;
-	std::unordered_map<Hash, VkPipelineLayoutCreateInfo *> pipeline_layouts;
-	std::unordered_map<Hash, VkShaderModuleCreateInfo *> shader_modules;
-	std::unordered_map<Hash, VkGraphicsPipelineCreateInfo *> graphics_pipelines;
-	std::unordered_map<Hash, VkComputePipelineCreateInfo *> compute_pipelines;
-	std::unordered_map<Hash, VkRenderPassCreateInfo *> render_passes;
-	std::unordered_map<Hash, VkSamplerCreateInfo *> samplers;
-
-	std::unordered_map<VkDescriptorSetLayout, Hash> descriptor_set_layout_to_hash;
-	std::unordered_map<VkPipelineLayout, Hash> pipeline_layout_to_hash;
-	std::unordered_map<VkShaderModule, Hash> shader_module_to_hash;
-	std::unordered_map<VkPipeline, Hash> graphics_pipeline_to_hash;
-	std::unordered_map<VkPipeline, Hash> compute_pipeline_to_hash;
-	std::unordered_map<VkRenderPass, Hash> render_pass_to_hash;
-	std::unordered_map<VkSampler, Hash> sampler_to_hash;
+	// Matches the archives in the database, so objects which are already there are deduplicated.
+	unsigned hash_format_version = FOSSILIZE_FORMAT_VERSION;
+
+	FlatHashMap<VkDescriptorSetLayoutCreateInfo *> descriptor_sets;
+	FlatHashMap<VkPipelineLayoutCreateInfo *> pipeline_layouts;
+	FlatHashMap<VkShaderModuleCreateInfo *> shader_modules;
+	FlatHashMap<VkGraphicsPipelineCreateInfo *> graphics_pipelines;
+	FlatHashMap<VkComputePipelineCreateInfo *> compute_pipelines;
+	FlatHashMap<VkRenderPassCreateInfo *> render_passes;
+	FlatHashMap<VkSamplerCreateInfo *> samplers;
+
+	HandleHashMap<VkDescriptorSetLayout> descriptor_set_layout_to_hash;
+	HandleHashMap<VkPipelineLayout> pipeline_layout_to_hash;
+	HandleHashMap<VkShaderModule> shader_module_to_hash;
+	HandleHashMap<VkPipeline> graphics_pipeline_to_hash;
+	HandleHashMap<VkPipeline> compute_pipeline_to_hash;
+	HandleHashMap<VkRenderPass> render_pass_to_hash;
+	HandleHashMap<VkSampler> sampler_to_hash;
 
 	VkApplicationInfo *application_info = nullptr;
 	VkPhysicalDeviceFeatures2 *physical_device_features = nullptr;
@@ -297,37 +636,274 @@ struct StateRecorder::Impl
 	bool serialize_application_blob_link(Hash hash, ResourceTag tag, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	Hash get_application_link_hash(ResourceTag tag, Hash hash) const;
 	bool register_application_link_hash(ResourceTag tag, Hash hash, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
+	bool test_pipeline_hash(Hash hash) const;
 	bool serialize_sampler(Hash hash, const VkSamplerCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_render_pass(Hash hash, const VkRenderPassCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_shader_module(Hash hash, const VkShaderModuleCreateInfo &create_info, std::vector<uint8_t> &blob, ScratchAllocator &allocator) const FOSSILIZE_WARN_UNUSED;
-	bool serialize_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
+	bool serialize_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info, std::vector<uint8_t> &blob,
+	                                 BinaryStateSink *state_sink = nullptr) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 
+	// Once an arena has grown past its first block, the thread moves on to a fresh one,
+	// so memory is recycled while the application is still creating objects.
+	enum { RecordQueueCapacityLog2 = 12, RecordBatchSize = 64, RecordArenaRetireSize = 64 * 1024 };
 	std::mutex record_lock;
-	std::condition_variable record_cv;
-	std::queue<WorkItem> record_queue;
+	MPSCQueue<WorkItem> record_queue{RecordQueueCapacityLog2};
+	std::shared_ptr<RecordArenaPool> arena_pool = std::make_shared<RecordArenaPool>();
 	std::thread worker_thread;
 
+	RecordArena *get_record_arena();
+	void push_record_item(RecordArena *arena, uint64_t handle, void *create_info, Hash custom_hash);
+
 	bool compression = false;
 	bool checksum = false;
+	bool fast_compression = false;
+	bool binary_format = false;
+
+	mutable RecorderCounters counters;
+
+	size_t record_queue_limit = 0;
+	RecordQueueLimitPolicy record_queue_policy = RECORD_QUEUE_LIMIT_POLICY_BLOCK;
+	unsigned record_queue_timeout_ms = 0;
+	bool check_record_queue_limit();
+	void write_database_entry(ResourceTag tag, Hash hash, const std::vector<uint8_t> &blob,
+	                          PayloadWriteFlags flags) const;
+
+	// Objects whose hash does not depend on other handles can be deduplicated on the calling thread,
+	// before they are copied. These hold the hashes which have been queued up so far.
+	std::unique_ptr<ConcurrentHashSet> recorded_samplers;
+	std::unique_ptr<ConcurrentHashSet> recorded_shader_modules;
+	std::unique_ptr<ConcurrentHashSet> recorded_render_passes;
+	enum { RecordedHashSetCapacityLog2 = 16 };
+
+	template <typename Handle>
+	bool enqueue_deduplicated(ConcurrentHashSet *recorded, Handle handle, Hash hash, VkStructureType type);
+
+	// Deferred recording holds on to work items until the application has been quiet for long enough.
+	struct DeferredWorkItem
+	{
+		WorkItem item;
+		std::chrono::steady_clock::time_point time;
+	};
+	enum { DeferredThreadNice = 19 };
+	unsigned defer_delay_ms = 0;
+	unsigned defer_idle_ms = 0;
+	std::deque<DeferredWorkItem> deferred_items;
+	std::chrono::steady_clock::time_point last_record_time;
+	bool deferred_end = false;
+	size_t pop_deferred_batch(WorkItem *batch, bool need_flush);
+
+	// Usage metadata is collected on the recording thread and written out in chunks of records,
+	// each chunk keyed by the session and its index within the session.
+	// A gap in presented frames is taken to mean a loading screen.
+	enum { UsageMetadataChunkRecords = 4096, UsageMetadataLoadingGapMs = 250 };
+	bool usage_metadata = false;
+	Hash usage_session = 0;
+	std::chrono::steady_clock::time_point usage_start_time;
+	std::atomic<uint32_t> presented_frames{0};
+	std::atomic<uint32_t> last_present_ms{0};
+	std::vector<UsageMetadataRecord> usage_records;
+	FlatHashMap<bool> usage_seen[RESOURCE_COUNT];
+	uint32_t usage_chunk_index = 0;
+	uint32_t get_usage_time_ms() const;
+	void stamp_usage(WorkItem &item) const;
+	void record_usage(ResourceTag tag, Hash hash, const WorkItem &item);
+	void flush_usage_metadata(PayloadWriteFlags flags, std::vector<uint8_t> &blob);
 
 	void record_task(StateRecorder *recorder, bool looping);
+	void enqueue_forget(StateRecorder *recorder, uint64_t handle, VkStructureType type);
+	void forget_handle(VkStructureType type, uint64_t handle);
 
 	template <typename T>
 	T *copy(const T *src, size_t count, ScratchAllocator &alloc);
 	bool copy_pnext_chain(const void *pNext, ScratchAllocator &alloc, const void **out_pnext) FOSSILIZE_WARN_UNUSED;
 };
 
-// reinterpret_cast does not work reliably on MSVC 2013 for Vulkan objects.
-template <typename T, typename U>
-static inline T api_object_cast(U obj)
+// Compact binary alternative to the JSON representation of a single object.
+// The blob starts with a magic which can never start a JSON document, followed by the format version,
+// the resource tag and the hash of the object. Fields follow in Vulkan struct order, at fixed width and in native byte order.
+// Handles are stored as the 64-bit hash of the object they refer to, optional pointers are preceded by a presence flag,
+// arrays by their element count, and pNext chains by the number of sType tagged records which follow.
+static const uint8_t binary_format_magic[4] = { 0xff, 'F', 'Z', 'B' };
+
+static bool is_binary_format(const void *buffer, size_t size)
 {
-	static_assert(sizeof(T) == sizeof(U), "Objects are not of same size.");
-	return (T)obj;
+	return size >= sizeof(binary_format_magic) &&
+	       memcmp(buffer, binary_format_magic, sizeof(binary_format_magic)) == 0;
 }
 
+// Magic, version, tag and hash.
+static const size_t binary_header_size = sizeof(binary_format_magic) + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+// How an optional graphics pipeline state is stored. A reference is followed by the hash
+// of a RESOURCE_GRAPHICS_PIPELINE_STATE entry holding the state.
+enum BinaryStateMode
+{
+	BINARY_STATE_ABSENT = 0,
+	BINARY_STATE_INLINE = 1,
+	BINARY_STATE_REFERENCE = 2
+};
+
+struct BinaryWriter
+{
+	BinaryWriter(vector<uint8_t> &blob_, ResourceTag tag, Hash hash)
+		: blob(blob_)
+	{
+		blob.clear();
+		bytes(binary_format_magic, sizeof(binary_format_magic));
+		u32(FOSSILIZE_FORMAT_VERSION);
+		u32(tag);
+		u64(hash);
+	}
+
+	void bytes(const void *data, size_t size)
+	{
+		if (!size)
+			return;
+		size_t offset = blob.size();
+		blob.resize(offset + size);
+		memcpy(blob.data() + offset, data, size);
+	}
+
+	void u32(uint32_t value)
+	{
+		bytes(&value, sizeof(value));
+	}
+
+	void s32(int32_t value)
+	{
+		bytes(&value, sizeof(value));
+	}
+
+	void u64(uint64_t value)
+	{
+		bytes(&value, sizeof(value));
+	}
+
+	void f32(float value)
+	{
+		bytes(&value, sizeof(value));
+	}
+
+	template <typename T>
+	void handle(T value)
+	{
+		u64(api_object_cast<uint64_t>(value));
+	}
+
+	// Returns whether the pointer is present, so the caller can go on to write what it points to.
+	bool present(const void *ptr)
+	{
+		u32(ptr != nullptr);
+		return ptr != nullptr;
+	}
+
+	void string(const char *str)
+	{
+		if (!str)
+		{
+			u32(~0u);
+			return;
+		}
+
+		auto len = uint32_t(strlen(str));
+		u32(len);
+		bytes(str, len);
+	}
+
+	vector<uint8_t> &blob;
+};
+
+// Reads are bounds checked against the blob. Once a read fails, every following read returns zero,
+// so decoders only need to check for failure once they are done.
+// Graphics pipelines tend to share most of their fixed function state. When a sink is given, these sub-states are
+// written as entries of their own, keyed by the hash of their encoding, and the pipeline only refers to them.
+struct BinaryStateSink
+{
+	DatabaseInterface *database;
+	PayloadWriteFlags payload_flags;
+	vector<uint8_t> blob;
+	RecorderCounters *counters;
+};
+
+struct BinaryReader
+{
+	BinaryReader(const uint8_t *data_, size_t size_)
+		: data(data_), size(size_)
+	{
+	}
+
+	const uint8_t *bytes(size_t count)
+	{
+		if (failed || count > size - offset)
+		{
+			failed = true;
+			return nullptr;
+		}
+
+		const uint8_t *ret = data + offset;
+		offset += count;
+		return ret;
+	}
+
+	template <typename T>
+	T value()
+	{
+		T ret = {};
+		auto *src = bytes(sizeof(T));
+		if (src)
+			memcpy(&ret, src, sizeof(T));
+		return ret;
+	}
+
+	uint32_t u32()
+	{
+		return value<uint32_t>();
+	}
+
+	int32_t s32()
+	{
+		return value<int32_t>();
+	}
+
+	uint64_t u64()
+	{
+		return value<uint64_t>();
+	}
+
+	float f32()
+	{
+		return value<float>();
+	}
+
+	bool present()
+	{
+		return u32() != 0;
+	}
+
+	// An array cannot hold more elements than there are bytes left to encode them,
+	// so a corrupt count fails here instead of turning into a huge allocation.
+	bool fits(uint64_t count, size_t encoded_element_size)
+	{
+		if (failed || count > (size - offset) / encoded_element_size)
+			failed = true;
+		return !failed;
+	}
+
+	uint32_t count(size_t encoded_element_size)
+	{
+		uint32_t ret = u32();
+		return fits(ret, encoded_element_size) ? ret : 0;
+	}
+
+	const uint8_t *data;
+	size_t size;
+	size_t offset = 0;
+	bool failed = false;
+};
+
 namespace Hashing
 {
 static Hash compute_hash_application_info(const VkApplicationInfo &info)
@@ -490,8 +1066,14 @@ bool compute_hash_pipeline_layout(const StateRecorder &recorder, const VkPipelin
 }
 
 Hash compute_hash_shader_module(const VkShaderModuleCreateInfo &create_info)
+{
+	return compute_hash_shader_module(create_info, FOSSILIZE_FORMAT_VERSION);
+}
+
+Hash compute_hash_shader_module(const VkShaderModuleCreateInfo &create_info, unsigned format_version)
 {
 	Hasher h;
+	h.set_format_version(format_version);
 	h.data(create_info.pCode, create_info.codeSize);
 	h.u32(create_info.flags);
 	return h.get();
@@ -586,6 +1168,7 @@ static bool hash_pnext_chain(const StateRecorder &recorder, Hasher &h, const voi
 bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraphicsPipelineCreateInfo &create_info, Hash *out_hash)
 {
 	Hasher h;
+	h.set_format_version(recorder.get_hash_format_version());
 	Hash hash;
 
 	h.u32(create_info.flags);
@@ -931,6 +1514,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 bool compute_hash_compute_pipeline(const StateRecorder &recorder, const VkComputePipelineCreateInfo &create_info, Hash *out_hash)
 {
 	Hasher h;
+	h.set_format_version(recorder.get_hash_format_version());
 	Hash hash;
 
 	if (!recorder.get_hash_for_pipeline_layout(create_info.layout, &hash))
@@ -1065,66 +1649,7 @@ Hash compute_hash_render_pass(const VkRenderPassCreateInfo &create_info)
 static uint8_t *decode_base64(ScratchAllocator &allocator, const char *data, size_t length)
 {
 	auto *buf = static_cast<uint8_t *>(allocator.allocate_raw(length, 16));
-	auto *ptr = buf;
-
-	const auto base64_index = [](char c) -> uint32_t {
-		if (c >= 'A' && c <= 'Z')
-			return uint32_t(c - 'A');
-		else if (c >= 'a' && c <= 'z')
-			return uint32_t(c - 'a') + 26;
-		else if (c >= '0' && c <= '9')
-			return uint32_t(c - '0') + 52;
-		else if (c == '+')
-			return 62;
-		else if (c == '/')
-			return 63;
-		else
-			return 0;
-	};
-
-	for (uint64_t i = 0; i < length; )
-	{
-		char c0 = *data++;
-		if (c0 == '\0')
-			break;
-		char c1 = *data++;
-		if (c1 == '\0')
-			break;
-		char c2 = *data++;
-		if (c2 == '\0')
-			break;
-		char c3 = *data++;
-		if (c3 == '\0')
-			break;
-
-		uint32_t values =
-				(base64_index(c0) << 18) |
-				(base64_index(c1) << 12) |
-				(base64_index(c2) << 6) |
-				(base64_index(c3) << 0);
-
-		unsigned outbytes = 3;
-		if (c2 == '=' && c3 == '=')
-		{
-			outbytes = 1;
-			*ptr++ = uint8_t(values >> 16);
-		}
-		else if (c3 == '=')
-		{
-			outbytes = 2;
-			*ptr++ = uint8_t(values >> 16);
-			*ptr++ = uint8_t(values >> 8);
-		}
-		else
-		{
-			*ptr++ = uint8_t(values >> 16);
-			*ptr++ = uint8_t(values >> 8);
-			*ptr++ = uint8_t(values >> 0);
-		}
-
-		i += outbytes;
-	}
-
+	Fossilize::decode_base64(buf, length, data);
 	return buf;
 }
 
@@ -1150,14 +1675,14 @@ bool StateReplayer::Impl::parse_immutable_samplers(const Value &samplers, const
 		auto index = string_to_uint64(itr->GetString());
 		if (index > 0)
 		{
-			auto sampler_itr = replayed_samplers.find(index);
-			if (sampler_itr == end(replayed_samplers))
+			auto *sampler_itr = replayed_samplers.find(index);
+			if (!sampler_itr)
 			{
 				log_missing_resource("Immutable sampler", index);
 				return false;
 			}
 			else
-				*samps = sampler_itr->second;
+				*samps = *sampler_itr;
 		}
 	}
 
@@ -1177,6 +1702,16 @@ void StateRecorder::Impl::sync_thread()
 StateRecorder::Impl::~Impl()
 {
 	sync_thread();
+
+	// Other threads keep their arena alive until they record something else, the rest can go now.
+	auto &tls = thread_record_arena;
+	if (tls.pool == arena_pool)
+	{
+		arena_pool->release(tls.arena);
+		tls.arena = nullptr;
+		tls.pool.reset();
+	}
+	arena_pool->free_unused_arenas();
 }
 
 bool StateReplayer::Impl::parse_descriptor_set_bindings(const Value &bindings,
@@ -1227,14 +1762,14 @@ bool StateReplayer::Impl::parse_set_layouts(const Value &layouts, const VkDescri
 		auto index = string_to_uint64(itr->GetString());
 		if (index > 0)
 		{
-			auto set_itr = replayed_descriptor_set_layouts.find(index);
-			if (set_itr == end(replayed_descriptor_set_layouts))
+			auto *set_itr = replayed_descriptor_set_layouts.find(index);
+			if (!set_itr)
 			{
 				log_missing_resource("Descriptor set layout", index);
 				return false;
 			}
 			else
-				*infos = set_itr->second;
+				*infos = *set_itr;
 		}
 	}
 
@@ -1242,8 +1777,18 @@ bool StateReplayer::Impl::parse_set_layouts(const Value &layouts, const VkDescri
 	return true;
 }
 
+// Since version 8, SPIR-V is packed with Stream VByte, which decodes four words at a time.
+// Older blobs use plain varint.
+static bool decode_spirv(uint32_t *words, size_t word_count, const uint8_t *buffer, size_t buffer_size, unsigned version)
+{
+	if (version >= 8)
+		return decode_stream_vbyte(words, word_count, buffer, buffer_size);
+	else
+		return decode_varint(words, word_count, buffer, buffer_size);
+}
+
 bool StateReplayer::Impl::parse_shader_modules(StateCreatorInterface &iface, const Value &modules,
-                                               const uint8_t *varint, size_t varint_size)
+                                               const uint8_t *varint, size_t varint_size, unsigned version)
 {
 	auto *infos = allocator.allocate_n_cleared<VkShaderModuleCreateInfo>(modules.MemberCount());
 
@@ -1271,7 +1816,7 @@ bool StateReplayer::Impl::parse_shader_modules(StateCreatorInterface &iface, con
 				return false;
 			}
 
-			if (!decode_varint(decoded, info.codeSize / 4, varint + offset, size))
+			if (!decode_spirv(decoded, info.codeSize / 4, varint + offset, size, version))
 			{
 				LOGE("Invalid varint format.\n");
 				return false;
@@ -1673,68 +2218,113 @@ bool StateReplayer::Impl::parse_specialization_info(const Value &spec_info, cons
 	return true;
 }
 
-bool StateReplayer::Impl::parse_compute_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver,
-                                                 const Value &pipelines, const Value &member)
+bool StateReplayer::Impl::resolve_shader_module(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                                Hash hash, VkShaderModule *out_module)
 {
-	Hash hash = string_to_uint64(member.GetString());
-	if (replayed_compute_pipelines.count(hash))
+	if (hash == 0 || !resolve_shader_modules || scanning)
+	{
+		if (scanning)
+			add_reference(RESOURCE_SHADER_MODULE, hash);
+		*out_module = api_object_cast<VkShaderModule>(hash);
 		return true;
+	}
 
-	auto *info_allocated = allocator.allocate_cleared<VkComputePipelineCreateInfo>();
-	auto &obj = pipelines[member];
-	auto &info = *info_allocated;
-	info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-	info.flags = obj["flags"].GetUint();
-	info.basePipelineIndex = obj["basePipelineIndex"].GetInt();
-
-	auto pipeline = string_to_uint64(obj["basePipelineHandle"].GetString());
-	if (pipeline > 0 && resolve_derivative_pipelines)
+	auto *module_iter = replayed_shader_modules.find(hash);
+	if (!module_iter)
 	{
-		// This is pretty bad for multithreaded replay, but this should be very rare.
-		iface.sync_threads();
-		auto pipeline_iter = replayed_compute_pipelines.find(pipeline);
-
-		// If we don't have the pipeline, we might have it later in the array of graphics pipelines, queue up out of order.
-		if (pipeline_iter == replayed_compute_pipelines.end() && pipelines.HasMember(obj["basePipelineHandle"].GetString()))
+		EntryPayload external_state;
+		if (!resolver || !external_state.read(*resolver, RESOURCE_SHADER_MODULE, hash, PAYLOAD_READ_NO_FLAGS))
 		{
-			if (!parse_compute_pipeline(iface, resolver, pipelines, obj["basePipelineHandle"]))
+			if (!module_store || !external_state.read(*module_store, RESOURCE_SHADER_MODULE, hash, PAYLOAD_READ_NO_FLAGS))
+			{
+				log_missing_resource("Shader module", hash);
 				return false;
-			iface.sync_threads();
-			pipeline_iter = replayed_compute_pipelines.find(pipeline);
+			}
 		}
 
-		// Still don't have it? Look into database.
-		if (pipeline_iter == replayed_compute_pipelines.end())
+		if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+			return false;
+
+		iface.sync_shader_modules();
+		module_iter = replayed_shader_modules.find(hash);
+		if (!module_iter)
 		{
-			size_t external_state_size = 0;
-			if (!resolver || !resolver->read_entry(RESOURCE_COMPUTE_PIPELINE, pipeline, &external_state_size, nullptr,
-			                                       PAYLOAD_READ_NO_FLAGS))
-			{
-				log_missing_resource("Base pipeline", pipeline);
-				return false;
-			}
+			log_missing_resource("Shader module", hash);
+			return false;
+		}
+	}
+	else
+		iface.sync_shader_modules();
 
-			vector<uint8_t> external_state(external_state_size);
+	*out_module = *module_iter;
+	return true;
+}
 
-			if (!resolver->read_entry(RESOURCE_COMPUTE_PIPELINE, pipeline, &external_state_size, external_state.data(),
-			                          PAYLOAD_READ_NO_FLAGS))
-			{
-				log_missing_resource("Base pipeline", pipeline);
-				return false;
-			}
+bool StateReplayer::Impl::resolve_external_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                                    ResourceTag tag, Hash hash,
+                                                    const HandleTable<VkPipeline> &replayed,
+                                                    VkPipeline *out_pipeline)
+{
+	EntryPayload external_state;
+	if (!resolver || !external_state.read(*resolver, tag, hash, PAYLOAD_READ_NO_FLAGS))
+	{
+		log_missing_resource("Base pipeline", hash);
+		return false;
+	}
+
+	if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+		return false;
+
+	iface.sync_threads();
+	auto *pipeline_iter = replayed.find(hash);
+	if (!pipeline_iter)
+	{
+		log_missing_resource("Base pipeline", hash);
+		return false;
+	}
+
+	*out_pipeline = *pipeline_iter;
+	return true;
+}
+
+bool StateReplayer::Impl::parse_compute_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                                 const Value &pipelines, const Value &member)
+{
+	Hash hash = string_to_uint64(member.GetString());
+	if (replayed_compute_pipelines.count(hash))
+		return true;
+
+	auto *info_allocated = allocator.allocate_cleared<VkComputePipelineCreateInfo>();
+	auto &obj = pipelines[member];
+	auto &info = *info_allocated;
+	info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	info.flags = obj["flags"].GetUint();
+	info.basePipelineIndex = obj["basePipelineIndex"].GetInt();
 
-			if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+	auto pipeline = string_to_uint64(obj["basePipelineHandle"].GetString());
+	if (pipeline > 0 && resolve_derivative_pipelines)
+	{
+		// This is pretty bad for multithreaded replay, but this should be very rare.
+		iface.sync_threads();
+		auto *pipeline_iter = replayed_compute_pipelines.find(pipeline);
+
+		// If we don't have the pipeline, we might have it later in the array of graphics pipelines, queue up out of order.
+		if (!pipeline_iter && pipelines.HasMember(obj["basePipelineHandle"].GetString()))
+		{
+			if (!parse_compute_pipeline(iface, resolver, pipelines, obj["basePipelineHandle"]))
 				return false;
 			iface.sync_threads();
-
 			pipeline_iter = replayed_compute_pipelines.find(pipeline);
-			if (pipeline_iter == replayed_compute_pipelines.end())
-			{
-				log_missing_resource("Base pipeline", pipeline);
+		}
+
+		// Still don't have it? Look into database.
+		if (!pipeline_iter)
+		{
+			if (!resolve_external_pipeline(iface, resolver, RESOURCE_COMPUTE_PIPELINE, pipeline, replayed_compute_pipelines, &info.basePipelineHandle))
 				return false;
-			}
 		}
-		info.basePipelineHandle = pipeline_iter->second;
+		else
+			info.basePipelineHandle = *pipeline_iter;
 	}
 	else
 		info.basePipelineHandle = api_object_cast<VkPipeline>(pipeline);
@@ -1742,14 +2332,14 @@ bool StateReplayer::Impl::parse_compute_pipeline(StateCreatorInterface &iface, D
 	auto layout = string_to_uint64(obj["layout"].GetString());
 	if (layout > 0)
 	{
-		auto layout_itr = replayed_pipeline_layouts.find(layout);
-		if (layout_itr == end(replayed_pipeline_layouts))
+		auto *layout_itr = replayed_pipeline_layouts.find(layout);
+		if (!layout_itr)
 		{
 			log_missing_resource("Pipeline layout", layout);
 			return false;
 		}
 		else
-			info.layout = layout_itr->second;
+			info.layout = *layout_itr;
 	}
 
 	auto &stage = obj["stage"];
@@ -1757,45 +2347,8 @@ bool StateReplayer::Impl::parse_compute_pipeline(StateCreatorInterface &iface, D
 	info.stage.stage = static_cast<VkShaderStageFlagBits>(stage["stage"].GetUint());
 
 	auto module = string_to_uint64(stage["module"].GetString());
-	if (module > 0 && resolve_shader_modules)
-	{
-		auto module_iter = replayed_shader_modules.find(module);
-		if (module_iter == replayed_shader_modules.end())
-		{
-			size_t external_state_size = 0;
-			if (!resolver || !resolver->read_entry(RESOURCE_SHADER_MODULE, module, &external_state_size, nullptr,
-			                                       PAYLOAD_READ_NO_FLAGS))
-			{
-				log_missing_resource("Shader module", module);
-				return false;
-			}
-
-			vector<uint8_t> external_state(external_state_size);
-
-			if (!resolver->read_entry(RESOURCE_SHADER_MODULE, module, &external_state_size, external_state.data(),
-			                          PAYLOAD_READ_NO_FLAGS))
-			{
-				log_missing_resource("Shader module", module);
-				return false;
-			}
-
-			if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
-				return false;
-
-			iface.sync_shader_modules();
-			module_iter = replayed_shader_modules.find(module);
-			if (module_iter == replayed_shader_modules.end())
-			{
-				log_missing_resource("Shader module", module);
-				return false;
-			}
-		}
-		else
-			iface.sync_shader_modules();
-		info.stage.module = module_iter->second;
-	}
-	else
-		info.stage.module = api_object_cast<VkShaderModule>(module);
+	if (!resolve_shader_module(iface, resolver, module, &info.stage.module))
+		return false;
 
 	info.stage.pName = duplicate_string(stage["name"].GetString(), stage["name"].GetStringLength());
 	if (stage.HasMember("specializationInfo"))
@@ -2129,46 +2682,8 @@ bool StateReplayer::Impl::parse_stages(StateCreatorInterface &iface, DatabaseInt
 				return false;
 
 		auto module = string_to_uint64(obj["module"].GetString());
-		if (module > 0 && resolve_shader_modules)
-		{
-			auto module_iter = replayed_shader_modules.find(module);
-			if (module_iter == replayed_shader_modules.end())
-			{
-				size_t external_state_size = 0;
-				if (!resolver || !resolver->read_entry(RESOURCE_SHADER_MODULE, module, &external_state_size, nullptr,
-				                                       PAYLOAD_READ_NO_FLAGS))
-				{
-					log_missing_resource("Shader module", module);
-					return false;
-				}
-
-				vector<uint8_t> external_state(external_state_size);
-
-				if (!resolver->read_entry(RESOURCE_SHADER_MODULE, module, &external_state_size, external_state.data(),
-				                          PAYLOAD_READ_NO_FLAGS))
-				{
-					log_missing_resource("Shader module", module);
-					return false;
-				}
-
-				if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
-					return false;
-
-				iface.sync_shader_modules();
-				module_iter = replayed_shader_modules.find(module);
-				if (module_iter == replayed_shader_modules.end())
-				{
-					log_missing_resource("Shader module", module);
-					return false;
-				}
-			}
-			else
-				iface.sync_shader_modules();
-
-			state->module = module_iter->second;
-		}
-		else
-			state->module = api_object_cast<VkShaderModule>(module);
+		if (!resolve_shader_module(iface, resolver, module, &state->module))
+			return false;
 	}
 
 	*out_info = ret;
@@ -2193,10 +2708,10 @@ bool StateReplayer::Impl::parse_graphics_pipeline(StateCreatorInterface &iface,
 	{
 		// This is pretty bad for multithreaded replay, but this should be very rare.
 		iface.sync_threads();
-		auto pipeline_iter = replayed_graphics_pipelines.find(pipeline);
+		auto *pipeline_iter = replayed_graphics_pipelines.find(pipeline);
 
 		// If we don't have the pipeline, we might have it later in the array of graphics pipelines, queue up out of order.
-		if (pipeline_iter == replayed_graphics_pipelines.end() && pipelines.HasMember(obj["basePipelineHandle"].GetString()))
+		if (!pipeline_iter && pipelines.HasMember(obj["basePipelineHandle"].GetString()))
 		{
 			if (!parse_graphics_pipeline(iface, resolver, pipelines, obj["basePipelineHandle"]))
 				return false;
@@ -2205,37 +2720,13 @@ bool StateReplayer::Impl::parse_graphics_pipeline(StateCreatorInterface &iface,
 		}
 
 		// Still don't have it? Look into database.
-		if (pipeline_iter == replayed_graphics_pipelines.end())
+		if (!pipeline_iter)
 		{
-			size_t external_state_size = 0;
-			if (!resolver || !resolver->read_entry(RESOURCE_GRAPHICS_PIPELINE, pipeline, &external_state_size, nullptr,
-			                                       PAYLOAD_READ_NO_FLAGS))
-			{
-				log_missing_resource("Base pipeline", pipeline);
-				return false;
-			}
-
-			vector<uint8_t> external_state(external_state_size);
-
-			if (!resolver->read_entry(RESOURCE_GRAPHICS_PIPELINE, pipeline, &external_state_size, external_state.data(),
-			                          PAYLOAD_READ_NO_FLAGS))
-			{
-				log_missing_resource("Base pipeline", pipeline);
-				return false;
-			}
-
-			if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
-				return false;
-
-			iface.sync_threads();
-			pipeline_iter = replayed_graphics_pipelines.find(pipeline);
-			if (pipeline_iter == replayed_graphics_pipelines.end())
-			{
-				log_missing_resource("Base pipeline", pipeline);
+			if (!resolve_external_pipeline(iface, resolver, RESOURCE_GRAPHICS_PIPELINE, pipeline, replayed_graphics_pipelines, &info.basePipelineHandle))
 				return false;
-			}
 		}
-		info.basePipelineHandle = pipeline_iter->second;
+		else
+			info.basePipelineHandle = *pipeline_iter;
 	}
 	else
 		info.basePipelineHandle = api_object_cast<VkPipeline>(pipeline);
@@ -2243,27 +2734,27 @@ bool StateReplayer::Impl::parse_graphics_pipeline(StateCreatorInterface &iface,
 	auto layout = string_to_uint64(obj["layout"].GetString());
 	if (layout > 0)
 	{
-		auto layout_itr = replayed_pipeline_layouts.find(layout);
-		if (layout_itr == end(replayed_pipeline_layouts))
+		auto *layout_itr = replayed_pipeline_layouts.find(layout);
+		if (!layout_itr)
 		{
 			log_missing_resource("Pipeline layout", layout);
 			return false;
 		}
 		else
-			info.layout = layout_itr->second;
+			info.layout = *layout_itr;
 	}
 
 	auto render_pass = string_to_uint64(obj["renderPass"].GetString());
 	if (render_pass > 0)
 	{
-		auto rp_itr = replayed_render_passes.find(render_pass);
-		if (rp_itr == end(replayed_render_passes))
+		auto *rp_itr = replayed_render_passes.find(render_pass);
+		if (!rp_itr)
 		{
 			log_missing_resource("Render pass", render_pass);
 			return false;
 		}
 		else
-			info.renderPass = rp_itr->second;
+			info.renderPass = *rp_itr;
 	}
 
 	info.subpass = obj["subpass"].GetUint();
@@ -2455,153 +2946,1387 @@ bool StateReplayer::Impl::parse_pnext_chain(const Value &pnext, const void **out
 	return true;
 }
 
-StateReplayer::StateReplayer()
+template <typename Handle>
+bool StateReplayer::Impl::resolve_replayed_handle(const HandleTable<Handle> &replayed, ResourceTag tag, const char *type,
+                                                  Hash hash, Handle *out_handle)
 {
-	impl = new Impl;
+	if (hash == 0)
+	{
+		*out_handle = VK_NULL_HANDLE;
+		return true;
+	}
+
+	if (scanning)
+	{
+		add_reference(tag, hash);
+		*out_handle = api_object_cast<Handle>(hash);
+		return true;
+	}
+
+	auto *itr = replayed.find(hash);
+	if (!itr)
+	{
+		log_missing_resource(type, hash);
+		return false;
+	}
+
+	*out_handle = *itr;
+	return true;
 }
 
-StateReplayer::~StateReplayer()
+static const char *read_binary_string(ScratchAllocator &allocator, BinaryReader &reader)
 {
-	delete impl;
+	uint32_t len = reader.u32();
+	if (len == ~0u)
+		return nullptr;
+
+	auto *str = reader.bytes(len);
+	if (!str)
+		return nullptr;
+
+	auto *ret = allocator.allocate_n<char>(len + 1);
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	return ret;
 }
 
-ScratchAllocator &StateReplayer::get_allocator()
+// The sType a referenced graphics pipeline state entry must have to be used as the given state.
+static VkStructureType binary_state_type(const VkPipelineVertexInputStateCreateInfo *)
 {
-	return impl->allocator;
+	return VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 }
 
-bool StateReplayer::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t size)
+static VkStructureType binary_state_type(const VkPipelineInputAssemblyStateCreateInfo *)
 {
-	return impl->parse(iface, resolver, buffer, size);
+	return VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
 }
 
-void StateReplayer::set_resolve_derivative_pipeline_handles(bool enable)
+static VkStructureType binary_state_type(const VkPipelineTessellationStateCreateInfo *)
 {
-	impl->resolve_derivative_pipelines = enable;
+	return VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO;
 }
 
-void StateReplayer::set_resolve_shader_module_handles(bool enable)
+static VkStructureType binary_state_type(const VkPipelineViewportStateCreateInfo *)
 {
-	impl->resolve_shader_modules = enable;
+	return VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 }
 
-void StateReplayer::copy_handle_references(const StateReplayer &replayer)
+static VkStructureType binary_state_type(const VkPipelineRasterizationStateCreateInfo *)
 {
-	impl->copy_handle_references(*replayer.impl);
+	return VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
 }
 
-void StateReplayer::forget_handle_references()
+static VkStructureType binary_state_type(const VkPipelineMultisampleStateCreateInfo *)
 {
-	impl->forget_handle_references();
+	return VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
 }
 
-void StateReplayer::Impl::copy_handle_references(const StateReplayer::Impl &other)
+static VkStructureType binary_state_type(const VkPipelineDepthStencilStateCreateInfo *)
 {
-	replayed_samplers = other.replayed_samplers;
-	replayed_descriptor_set_layouts = other.replayed_descriptor_set_layouts;
-	replayed_pipeline_layouts = other.replayed_pipeline_layouts;
-	replayed_shader_modules = other.replayed_shader_modules;
-	replayed_render_passes = other.replayed_render_passes;
-	replayed_compute_pipelines = other.replayed_compute_pipelines;
-	replayed_graphics_pipelines = other.replayed_graphics_pipelines;
+	return VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 }
 
-void StateReplayer::Impl::forget_handle_references()
+static VkStructureType binary_state_type(const VkPipelineColorBlendStateCreateInfo *)
 {
-	replayed_samplers.clear();
-	replayed_descriptor_set_layouts.clear();
-	replayed_pipeline_layouts.clear();
-	replayed_shader_modules.clear();
-	replayed_render_passes.clear();
-	replayed_compute_pipelines.clear();
-	replayed_graphics_pipelines.clear();
+	return VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 }
 
-bool StateReplayer::Impl::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer_, size_t total_size)
+static VkStructureType binary_state_type(const VkPipelineDynamicStateCreateInfo *)
 {
-	// All data after a string terminating '\0' is considered binary payload
-	// which can be read for various purposes (SPIR-V varint for example).
-	const uint8_t *buffer = static_cast<const uint8_t *>(buffer_);
-	auto itr = find(buffer, buffer + total_size, '\0');
-	const uint8_t *varint_buffer = nullptr;
-	size_t varint_size = 0;
-	size_t json_size = itr - buffer;
+	return VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+}
 
-	if (itr < buffer + total_size)
+static bool log_binary_read_failure(const BinaryReader &reader, ResourceTag tag, Hash hash)
+{
+	// Missing resources have already been logged.
+	if (reader.failed)
+		LOGE("Binary blob is truncated or corrupt (tag: %d, hash: %016" PRIx64 ").\n", int(tag), hash);
+	return false;
+}
+
+bool StateReplayer::Impl::resolve_base_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                                ResourceTag tag, Hash hash,
+                                                const HandleTable<VkPipeline> &replayed,
+                                                VkPipeline *out_pipeline)
+{
+	if (hash == 0 || !resolve_derivative_pipelines || scanning)
 	{
-		varint_buffer = itr + 1;
-		varint_size = (buffer + total_size) - varint_buffer;
+		if (scanning)
+			add_reference(tag, hash);
+		*out_pipeline = api_object_cast<VkPipeline>(hash);
+		return true;
 	}
 
-	Document doc;
-	doc.Parse(reinterpret_cast<const char *>(buffer), json_size);
+	// This is pretty bad for multithreaded replay, but this should be very rare.
+	iface.sync_threads();
+	auto *pipeline_iter = replayed.find(hash);
+	if (!pipeline_iter)
+		return resolve_external_pipeline(iface, resolver, tag, hash, replayed, out_pipeline);
 
-	if (doc.HasParseError())
+	*out_pipeline = *pipeline_iter;
+	return true;
+}
+
+bool StateReplayer::Impl::read_application_info(StateCreatorInterface &iface, BinaryReader &reader)
+{
+	VkApplicationInfo *app = nullptr;
+	VkPhysicalDeviceFeatures2 *pdf = nullptr;
+
+	if (reader.present())
 	{
-		auto error = doc.GetParseError();
-		LOGE("Got parse error: %d\n", int(error));
-		return false;
+		app = allocator.allocate_cleared<VkApplicationInfo>();
+		app->sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+		app->apiVersion = reader.u32();
+		app->applicationVersion = reader.u32();
+		app->engineVersion = reader.u32();
+		app->pApplicationName = read_binary_string(allocator, reader);
+		app->pEngineName = read_binary_string(allocator, reader);
 	}
 
-	int version = doc["version"].GetInt();
-	if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+	if (reader.present())
 	{
-		LOGE("JSON version mismatches.");
+		pdf = allocator.allocate_cleared<VkPhysicalDeviceFeatures2>();
+		pdf->sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		pdf->features.robustBufferAccess = reader.u32();
+	}
+
+	if (reader.failed)
 		return false;
+
+	// Same as the JSON form, the application info is only used if both parts are present.
+	if (!app || !pdf)
+	{
+		app = nullptr;
+		pdf = nullptr;
 	}
 
-	if (doc.HasMember("applicationInfo") && doc.HasMember("physicalDeviceFeatures"))
-		if (!parse_application_info(iface, doc["applicationInfo"], doc["physicalDeviceFeatures"]))
-			return false;
+	auto hash =
+			Hashing::compute_combined_application_feature_hash(
+					Hashing::compute_application_feature_hash(app, pdf));
+	iface.set_application_info(hash, app, pdf);
+	return true;
+}
 
-	if (doc.HasMember("application"))
-		iface.set_current_application_info(string_to_uint64(doc["application"].GetString()));
+bool StateReplayer::Impl::read_sampler(BinaryReader &reader, VkSamplerCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	info->flags = reader.u32();
+	info->magFilter = static_cast<VkFilter>(reader.u32());
+	info->minFilter = static_cast<VkFilter>(reader.u32());
+	info->mipmapMode = static_cast<VkSamplerMipmapMode>(reader.u32());
+	info->addressModeU = static_cast<VkSamplerAddressMode>(reader.u32());
+	info->addressModeV = static_cast<VkSamplerAddressMode>(reader.u32());
+	info->addressModeW = static_cast<VkSamplerAddressMode>(reader.u32());
+	info->mipLodBias = reader.f32();
+	info->anisotropyEnable = reader.u32();
+	info->maxAnisotropy = reader.f32();
+	info->compareEnable = reader.u32();
+	info->compareOp = static_cast<VkCompareOp>(reader.u32());
+	info->minLod = reader.f32();
+	info->maxLod = reader.f32();
+	info->borderColor = static_cast<VkBorderColor>(reader.u32());
+	info->unnormalizedCoordinates = reader.u32();
+	return !reader.failed;
+}
 
-	if (doc.HasMember("link"))
-		if (!parse_application_info_link(iface, doc["link"]))
-			return false;
+bool StateReplayer::Impl::read_descriptor_set_layout(BinaryReader &reader, VkDescriptorSetLayoutCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	info->flags = reader.u32();
+	info->bindingCount = reader.count(5 * sizeof(uint32_t));
 
-	if (doc.HasMember("shaderModules"))
-		if (!parse_shader_modules(iface, doc["shaderModules"], varint_buffer, varint_size))
-			return false;
+	auto *bindings = allocator.allocate_n_cleared<VkDescriptorSetLayoutBinding>(info->bindingCount);
+	info->pBindings = bindings;
 
-	if (doc.HasMember("samplers"))
-		if (!parse_samplers(iface, doc["samplers"]))
-			return false;
+	for (uint32_t i = 0; i < info->bindingCount; i++)
+	{
+		auto &b = bindings[i];
+		b.binding = reader.u32();
+		b.descriptorType = static_cast<VkDescriptorType>(reader.u32());
+		b.descriptorCount = reader.u32();
+		b.stageFlags = reader.u32();
 
-	if (doc.HasMember("setLayouts"))
-		if (!parse_descriptor_set_layouts(iface, doc["setLayouts"]))
-			return false;
+		if (reader.present() && reader.fits(b.descriptorCount, sizeof(uint64_t)))
+		{
+			auto *samplers = allocator.allocate_n_cleared<VkSampler>(b.descriptorCount);
+			for (uint32_t j = 0; j < b.descriptorCount; j++)
+				if (!resolve_replayed_handle(replayed_samplers, RESOURCE_SAMPLER, "Immutable sampler", reader.u64(), &samplers[j]))
+					return false;
+			b.pImmutableSamplers = samplers;
+		}
+	}
 
-	if (doc.HasMember("pipelineLayouts"))
-		if (!parse_pipeline_layouts(iface, doc["pipelineLayouts"]))
-			return false;
+	return !reader.failed;
+}
 
-	if (doc.HasMember("renderPasses"))
-		if (!parse_render_passes(iface, doc["renderPasses"]))
-			return false;
+bool StateReplayer::Impl::read_pipeline_layout(BinaryReader &reader, VkPipelineLayoutCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	info->flags = reader.u32();
 
-	if (doc.HasMember("computePipelines"))
-		if (!parse_compute_pipelines(iface, resolver, doc["computePipelines"]))
+	info->setLayoutCount = reader.count(sizeof(uint64_t));
+	auto *set_layouts = allocator.allocate_n_cleared<VkDescriptorSetLayout>(info->setLayoutCount);
+	for (uint32_t i = 0; i < info->setLayoutCount; i++)
+		if (!resolve_replayed_handle(replayed_descriptor_set_layouts, RESOURCE_DESCRIPTOR_SET_LAYOUT, "Descriptor set layout", reader.u64(), &set_layouts[i]))
 			return false;
+	info->pSetLayouts = set_layouts;
 
-	if (doc.HasMember("graphicsPipelines"))
-		if (!parse_graphics_pipelines(iface, resolver, doc["graphicsPipelines"]))
-			return false;
+	info->pushConstantRangeCount = reader.count(3 * sizeof(uint32_t));
+	auto *ranges = allocator.allocate_n_cleared<VkPushConstantRange>(info->pushConstantRangeCount);
+	for (uint32_t i = 0; i < info->pushConstantRangeCount; i++)
+	{
+		ranges[i].stageFlags = reader.u32();
+		ranges[i].offset = reader.u32();
+		ranges[i].size = reader.u32();
+	}
+	info->pPushConstantRanges = ranges;
 
-	return true;
+	return !reader.failed;
 }
 
-template <typename T>
-T *StateRecorder::Impl::copy(const T *src, size_t count, ScratchAllocator &alloc)
+bool StateReplayer::Impl::read_shader_module(BinaryReader &reader, unsigned version, VkShaderModuleCreateInfo *info)
 {
-	if (!count)
-		return nullptr;
+	info->sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	info->flags = reader.u32();
+	info->codeSize = reader.u64();
+	uint64_t varint_size = reader.u64();
 
-	auto *new_data = alloc.allocate_n<T>(count);
-	if (new_data)
-		std::copy(src, src + count, new_data);
-	return new_data;
+	// Every SPIR-V word takes at least one byte in either packed form.
+	if (!reader.fits(varint_size, 1) || info->codeSize / 4 > varint_size)
+	{
+		reader.failed = true;
+		return false;
+	}
+
+	auto *varint = reader.bytes(varint_size);
+	uint32_t *decoded = static_cast<uint32_t *>(allocator.allocate_raw(info->codeSize, 64));
+	if (!varint || !decode_spirv(decoded, info->codeSize / 4, varint, varint_size, version))
+	{
+		LOGE("Invalid varint format.\n");
+		return false;
+	}
+
+	info->pCode = decoded;
+	return true;
+}
+
+bool StateReplayer::Impl::read_attachment_references(BinaryReader &reader, const VkAttachmentReference **out_references,
+                                                     uint32_t *out_count)
+{
+	if (!reader.present())
+		return !reader.failed;
+
+	uint32_t count = reader.count(2 * sizeof(uint32_t));
+	auto *refs = allocator.allocate_n_cleared<VkAttachmentReference>(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		refs[i].attachment = reader.u32();
+		refs[i].layout = static_cast<VkImageLayout>(reader.u32());
+	}
+
+	*out_references = refs;
+	if (out_count)
+		*out_count = count;
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_render_pass(BinaryReader &reader, VkRenderPassCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	info->flags = reader.u32();
+
+	if (reader.present())
+	{
+		info->attachmentCount = reader.count(9 * sizeof(uint32_t));
+		auto *attachments = allocator.allocate_n_cleared<VkAttachmentDescription>(info->attachmentCount);
+		for (uint32_t i = 0; i < info->attachmentCount; i++)
+		{
+			auto &a = attachments[i];
+			a.flags = reader.u32();
+			a.format = static_cast<VkFormat>(reader.u32());
+			a.samples = static_cast<VkSampleCountFlagBits>(reader.u32());
+			a.loadOp = static_cast<VkAttachmentLoadOp>(reader.u32());
+			a.storeOp = static_cast<VkAttachmentStoreOp>(reader.u32());
+			a.stencilLoadOp = static_cast<VkAttachmentLoadOp>(reader.u32());
+			a.stencilStoreOp = static_cast<VkAttachmentStoreOp>(reader.u32());
+			a.initialLayout = static_cast<VkImageLayout>(reader.u32());
+			a.finalLayout = static_cast<VkImageLayout>(reader.u32());
+		}
+		info->pAttachments = attachments;
+	}
+
+	// Flags, bind point and the presence flags of the five attachment arrays.
+	info->subpassCount = reader.count(7 * sizeof(uint32_t));
+	auto *subpasses = allocator.allocate_n_cleared<VkSubpassDescription>(info->subpassCount);
+	for (uint32_t i = 0; i < info->subpassCount; i++)
+	{
+		auto &sub = subpasses[i];
+		sub.flags = reader.u32();
+		sub.pipelineBindPoint = static_cast<VkPipelineBindPoint>(reader.u32());
+		if (!read_attachment_references(reader, &sub.pInputAttachments, &sub.inputAttachmentCount) ||
+		    !read_attachment_references(reader, &sub.pColorAttachments, &sub.colorAttachmentCount) ||
+		    !read_attachment_references(reader, &sub.pResolveAttachments, nullptr) ||
+		    !read_attachment_references(reader, &sub.pDepthStencilAttachment, nullptr))
+		{
+			return false;
+		}
+
+		if (reader.present())
+		{
+			sub.preserveAttachmentCount = reader.count(sizeof(uint32_t));
+			auto *preserves = allocator.allocate_n_cleared<uint32_t>(sub.preserveAttachmentCount);
+			for (uint32_t j = 0; j < sub.preserveAttachmentCount; j++)
+				preserves[j] = reader.u32();
+			sub.pPreserveAttachments = preserves;
+		}
+	}
+	info->pSubpasses = subpasses;
+
+	if (reader.present())
+	{
+		info->dependencyCount = reader.count(7 * sizeof(uint32_t));
+		auto *deps = allocator.allocate_n_cleared<VkSubpassDependency>(info->dependencyCount);
+		for (uint32_t i = 0; i < info->dependencyCount; i++)
+		{
+			auto &d = deps[i];
+			d.srcSubpass = reader.u32();
+			d.dstSubpass = reader.u32();
+			d.srcStageMask = reader.u32();
+			d.dstStageMask = reader.u32();
+			d.srcAccessMask = reader.u32();
+			d.dstAccessMask = reader.u32();
+			d.dependencyFlags = reader.u32();
+		}
+		info->pDependencies = deps;
+	}
+
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_shader_stage(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                            BinaryReader &reader, VkPipelineShaderStageCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	info->flags = reader.u32();
+	info->stage = static_cast<VkShaderStageFlagBits>(reader.u32());
+	Hash module = reader.u64();
+	info->pName = read_binary_string(allocator, reader);
+
+	if (reader.present())
+	{
+		auto *spec = allocator.allocate_cleared<VkSpecializationInfo>();
+		spec->mapEntryCount = reader.count(2 * sizeof(uint32_t) + sizeof(uint64_t));
+		auto *entries = allocator.allocate_n_cleared<VkSpecializationMapEntry>(spec->mapEntryCount);
+		for (uint32_t i = 0; i < spec->mapEntryCount; i++)
+		{
+			entries[i].constantID = reader.u32();
+			entries[i].offset = reader.u32();
+			entries[i].size = reader.u64();
+		}
+		spec->pMapEntries = entries;
+
+		spec->dataSize = reader.u64();
+		auto *data = reader.bytes(spec->dataSize);
+		if (data)
+		{
+			auto *copied = allocator.allocate_raw(spec->dataSize, 16);
+			memcpy(copied, data, spec->dataSize);
+			spec->pData = copied;
+		}
+		info->pSpecializationInfo = spec;
+	}
+
+	if (reader.failed)
+		return false;
+
+	return resolve_shader_module(iface, resolver, module, &info->module);
+}
+
+bool StateReplayer::Impl::read_pnext_chain(BinaryReader &reader, ScratchAllocator &alloc, const void **out_pnext)
+{
+	VkBaseInStructure *ret = nullptr;
+	VkBaseInStructure *chain = nullptr;
+
+	uint32_t count = reader.count(sizeof(uint32_t));
+	for (uint32_t i = 0; i < count; i++)
+	{
+		auto sType = static_cast<VkStructureType>(reader.u32());
+		VkBaseInStructure *new_struct = nullptr;
+
+		switch (sType)
+		{
+		case VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_DOMAIN_ORIGIN_STATE_CREATE_INFO:
+		{
+			auto *info = alloc.allocate_cleared<VkPipelineTessellationDomainOriginStateCreateInfo>();
+			info->domainOrigin = static_cast<VkTessellationDomainOrigin>(reader.u32());
+			new_struct = reinterpret_cast<VkBaseInStructure *>(info);
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_DIVISOR_STATE_CREATE_INFO_EXT:
+		{
+			auto *info = alloc.allocate_cleared<VkPipelineVertexInputDivisorStateCreateInfoEXT>();
+			info->vertexBindingDivisorCount = reader.u32();
+			if (reader.present() && reader.fits(info->vertexBindingDivisorCount, 2 * sizeof(uint32_t)))
+			{
+				auto *divisors = alloc.allocate_n_cleared<VkVertexInputBindingDivisorDescriptionEXT>(info->vertexBindingDivisorCount);
+				for (uint32_t j = 0; j < info->vertexBindingDivisorCount; j++)
+				{
+					divisors[j].binding = reader.u32();
+					divisors[j].divisor = reader.u32();
+				}
+				info->pVertexBindingDivisors = divisors;
+			}
+			new_struct = reinterpret_cast<VkBaseInStructure *>(info);
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_DEPTH_CLIP_STATE_CREATE_INFO_EXT:
+		{
+			auto *info = alloc.allocate_cleared<VkPipelineRasterizationDepthClipStateCreateInfoEXT>();
+			info->flags = reader.u32();
+			info->depthClipEnable = reader.u32();
+			new_struct = reinterpret_cast<VkBaseInStructure *>(info);
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_STREAM_CREATE_INFO_EXT:
+		{
+			auto *info = alloc.allocate_cleared<VkPipelineRasterizationStateStreamCreateInfoEXT>();
+			info->flags = reader.u32();
+			info->rasterizationStream = reader.u32();
+			new_struct = reinterpret_cast<VkBaseInStructure *>(info);
+			break;
+		}
+
+		default:
+			LOGE("Failed to parse pNext chain for sType: %d\n", int(sType));
+			return false;
+		}
+
+		new_struct->sType = sType;
+		new_struct->pNext = nullptr;
+
+		if (!chain)
+		{
+			chain = new_struct;
+			ret = chain;
+		}
+		else
+		{
+			chain->pNext = new_struct;
+			chain = new_struct;
+		}
+	}
+
+	*out_pnext = ret;
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_compute_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                                BinaryReader &reader, VkComputePipelineCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	info->flags = reader.u32();
+	if (!read_shader_stage(iface, resolver, reader, &info->stage))
+		return false;
+
+	Hash layout = reader.u64();
+	Hash pipeline = reader.u64();
+	info->basePipelineIndex = reader.s32();
+	if (reader.failed)
+		return false;
+
+	if (!resolve_replayed_handle(replayed_pipeline_layouts, RESOURCE_PIPELINE_LAYOUT, "Pipeline layout", layout, &info->layout))
+		return false;
+
+	return resolve_base_pipeline(iface, resolver, RESOURCE_COMPUTE_PIPELINE, pipeline, replayed_compute_pipelines,
+	                             &info->basePipelineHandle);
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineVertexInputStateCreateInfo *vi)
+{
+	vi->sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vi->flags = reader.u32();
+
+	vi->vertexBindingDescriptionCount = reader.count(3 * sizeof(uint32_t));
+	auto *bindings = alloc.allocate_n_cleared<VkVertexInputBindingDescription>(vi->vertexBindingDescriptionCount);
+	for (uint32_t i = 0; i < vi->vertexBindingDescriptionCount; i++)
+	{
+		bindings[i].binding = reader.u32();
+		bindings[i].stride = reader.u32();
+		bindings[i].inputRate = static_cast<VkVertexInputRate>(reader.u32());
+	}
+	vi->pVertexBindingDescriptions = bindings;
+
+	vi->vertexAttributeDescriptionCount = reader.count(4 * sizeof(uint32_t));
+	auto *attribs = alloc.allocate_n_cleared<VkVertexInputAttributeDescription>(vi->vertexAttributeDescriptionCount);
+	for (uint32_t i = 0; i < vi->vertexAttributeDescriptionCount; i++)
+	{
+		attribs[i].location = reader.u32();
+		attribs[i].binding = reader.u32();
+		attribs[i].format = static_cast<VkFormat>(reader.u32());
+		attribs[i].offset = reader.u32();
+	}
+	vi->pVertexAttributeDescriptions = attribs;
+
+	return read_pnext_chain(reader, alloc, &vi->pNext);
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &, VkPipelineInputAssemblyStateCreateInfo *ia)
+{
+	ia->sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	ia->flags = reader.u32();
+	ia->topology = static_cast<VkPrimitiveTopology>(reader.u32());
+	ia->primitiveRestartEnable = reader.u32();
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineTessellationStateCreateInfo *tess)
+{
+	tess->sType = VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO;
+	tess->flags = reader.u32();
+	tess->patchControlPoints = reader.u32();
+	return read_pnext_chain(reader, alloc, &tess->pNext);
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineViewportStateCreateInfo *vp)
+{
+	vp->sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	vp->flags = reader.u32();
+	vp->viewportCount = reader.u32();
+	if (reader.present() && reader.fits(vp->viewportCount, 6 * sizeof(float)))
+	{
+		auto *viewports = alloc.allocate_n_cleared<VkViewport>(vp->viewportCount);
+		for (uint32_t i = 0; i < vp->viewportCount; i++)
+		{
+			viewports[i].x = reader.f32();
+			viewports[i].y = reader.f32();
+			viewports[i].width = reader.f32();
+			viewports[i].height = reader.f32();
+			viewports[i].minDepth = reader.f32();
+			viewports[i].maxDepth = reader.f32();
+		}
+		vp->pViewports = viewports;
+	}
+
+	vp->scissorCount = reader.u32();
+	if (reader.present() && reader.fits(vp->scissorCount, 4 * sizeof(uint32_t)))
+	{
+		auto *scissors = alloc.allocate_n_cleared<VkRect2D>(vp->scissorCount);
+		for (uint32_t i = 0; i < vp->scissorCount; i++)
+		{
+			scissors[i].offset.x = reader.s32();
+			scissors[i].offset.y = reader.s32();
+			scissors[i].extent.width = reader.u32();
+			scissors[i].extent.height = reader.u32();
+		}
+		vp->pScissors = scissors;
+	}
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineRasterizationStateCreateInfo *rs)
+{
+	rs->sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rs->flags = reader.u32();
+	rs->depthClampEnable = reader.u32();
+	rs->rasterizerDiscardEnable = reader.u32();
+	rs->polygonMode = static_cast<VkPolygonMode>(reader.u32());
+	rs->cullMode = reader.u32();
+	rs->frontFace = static_cast<VkFrontFace>(reader.u32());
+	rs->depthBiasEnable = reader.u32();
+	rs->depthBiasConstantFactor = reader.f32();
+	rs->depthBiasClamp = reader.f32();
+	rs->depthBiasSlopeFactor = reader.f32();
+	rs->lineWidth = reader.f32();
+	return read_pnext_chain(reader, alloc, &rs->pNext);
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineMultisampleStateCreateInfo *ms)
+{
+	ms->sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	ms->flags = reader.u32();
+	ms->rasterizationSamples = static_cast<VkSampleCountFlagBits>(reader.u32());
+	ms->sampleShadingEnable = reader.u32();
+	ms->minSampleShading = reader.f32();
+	if (reader.present())
+	{
+		uint32_t entries = reader.count(sizeof(uint32_t));
+		auto *sample_mask = alloc.allocate_n_cleared<VkSampleMask>(entries);
+		for (uint32_t i = 0; i < entries; i++)
+			sample_mask[i] = reader.u32();
+		ms->pSampleMask = sample_mask;
+	}
+	ms->alphaToCoverageEnable = reader.u32();
+	ms->alphaToOneEnable = reader.u32();
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &, VkPipelineDepthStencilStateCreateInfo *ds)
+{
+	ds->sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	ds->flags = reader.u32();
+	ds->depthTestEnable = reader.u32();
+	ds->depthWriteEnable = reader.u32();
+	ds->depthCompareOp = static_cast<VkCompareOp>(reader.u32());
+	ds->depthBoundsTestEnable = reader.u32();
+	ds->stencilTestEnable = reader.u32();
+	for (auto *op : { &ds->front, &ds->back })
+	{
+		op->failOp = static_cast<VkStencilOp>(reader.u32());
+		op->passOp = static_cast<VkStencilOp>(reader.u32());
+		op->depthFailOp = static_cast<VkStencilOp>(reader.u32());
+		op->compareOp = static_cast<VkCompareOp>(reader.u32());
+		op->compareMask = reader.u32();
+		op->writeMask = reader.u32();
+		op->reference = reader.u32();
+	}
+	ds->minDepthBounds = reader.f32();
+	ds->maxDepthBounds = reader.f32();
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineColorBlendStateCreateInfo *cb)
+{
+	cb->sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	cb->flags = reader.u32();
+	cb->logicOpEnable = reader.u32();
+	cb->logicOp = static_cast<VkLogicOp>(reader.u32());
+	cb->attachmentCount = reader.count(8 * sizeof(uint32_t));
+	auto *attachments = alloc.allocate_n_cleared<VkPipelineColorBlendAttachmentState>(cb->attachmentCount);
+	for (uint32_t i = 0; i < cb->attachmentCount; i++)
+	{
+		auto &a = attachments[i];
+		a.blendEnable = reader.u32();
+		a.srcColorBlendFactor = static_cast<VkBlendFactor>(reader.u32());
+		a.dstColorBlendFactor = static_cast<VkBlendFactor>(reader.u32());
+		a.colorBlendOp = static_cast<VkBlendOp>(reader.u32());
+		a.srcAlphaBlendFactor = static_cast<VkBlendFactor>(reader.u32());
+		a.dstAlphaBlendFactor = static_cast<VkBlendFactor>(reader.u32());
+		a.alphaBlendOp = static_cast<VkBlendOp>(reader.u32());
+		a.colorWriteMask = reader.u32();
+	}
+	cb->pAttachments = attachments;
+	for (auto &c : cb->blendConstants)
+		c = reader.f32();
+	return !reader.failed;
+}
+
+bool StateReplayer::Impl::read_state(BinaryReader &reader, ScratchAllocator &alloc, VkPipelineDynamicStateCreateInfo *dyn)
+{
+	dyn->sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dyn->flags = reader.u32();
+	dyn->dynamicStateCount = reader.count(sizeof(uint32_t));
+	auto *states = alloc.allocate_n_cleared<VkDynamicState>(dyn->dynamicStateCount);
+	for (uint32_t i = 0; i < dyn->dynamicStateCount; i++)
+		states[i] = static_cast<VkDynamicState>(reader.u32());
+	dyn->pDynamicStates = states;
+	return !reader.failed;
+}
+
+template <typename State>
+const void *StateReplayer::Impl::decode_pipeline_state(BinaryReader &reader)
+{
+	auto *state = pipeline_state_allocator.allocate_cleared<State>();
+	if (!read_state(reader, pipeline_state_allocator, state))
+		return nullptr;
+	return state;
+}
+
+bool StateReplayer::Impl::read_pipeline_state_entry(BinaryReader &reader, Hash hash, const void **out_state)
+{
+	auto sType = static_cast<VkStructureType>(reader.u32());
+	const void *state = nullptr;
+
+	switch (sType)
+	{
+	case VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineVertexInputStateCreateInfo>(reader);
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineViewportStateCreateInfo>(reader);
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineRasterizationStateCreateInfo>(reader);
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineMultisampleStateCreateInfo>(reader);
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineDepthStencilStateCreateInfo>(reader);
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineColorBlendStateCreateInfo>(reader);
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO:
+		state = decode_pipeline_state<VkPipelineDynamicStateCreateInfo>(reader);
+		break;
+
+	default:
+		if (!reader.failed)
+			LOGE("Unknown graphics pipeline state sType: %d\n", int(sType));
+		break;
+	}
+
+	if (!state)
+		return log_binary_read_failure(reader, RESOURCE_GRAPHICS_PIPELINE_STATE, hash);
+
+	replayed_pipeline_states[hash] = state;
+	*out_state = state;
+	return true;
+}
+
+bool StateReplayer::Impl::resolve_pipeline_state(DatabaseInterface *resolver, Hash hash, const void **out_state)
+{
+	auto *itr = replayed_pipeline_states.find(hash);
+	if (itr)
+	{
+		*out_state = *itr;
+		return true;
+	}
+
+	EntryPayload blob;
+	if (!resolver || !blob.read(*resolver, RESOURCE_GRAPHICS_PIPELINE_STATE, hash, PAYLOAD_READ_NO_FLAGS))
+	{
+		log_missing_resource("Graphics pipeline state", hash);
+		return false;
+	}
+
+	if (!is_binary_format(blob.data(), blob.size()))
+	{
+		LOGE("Graphics pipeline state %016" PRIx64 " is not in binary format.\n", hash);
+		return false;
+	}
+
+	BinaryReader reader(blob.data() + sizeof(binary_format_magic), blob.size() - sizeof(binary_format_magic));
+	uint32_t version = reader.u32();
+	auto tag = static_cast<ResourceTag>(reader.u32());
+	Hash stored_hash = reader.u64();
+	if (reader.failed || version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION ||
+	    tag != RESOURCE_GRAPHICS_PIPELINE_STATE || stored_hash != hash)
+	{
+		LOGE("Graphics pipeline state %016" PRIx64 " has an invalid header.\n", hash);
+		return false;
+	}
+
+	return read_pipeline_state_entry(reader, hash, out_state);
+}
+
+template <typename State>
+bool StateReplayer::Impl::read_pipeline_state(DatabaseInterface *resolver, BinaryReader &reader, const State **out_state)
+{
+	switch (reader.u32())
+	{
+	case BINARY_STATE_ABSENT:
+		return !reader.failed;
+
+	case BINARY_STATE_INLINE:
+	{
+		auto *state = allocator.allocate_cleared<State>();
+		if (!read_state(reader, allocator, state))
+			return false;
+		*out_state = state;
+		return true;
+	}
+
+	case BINARY_STATE_REFERENCE:
+	{
+		Hash hash = reader.u64();
+		if (scanning)
+		{
+			add_reference(RESOURCE_GRAPHICS_PIPELINE_STATE, hash);
+			return !reader.failed;
+		}
+
+		const void *state = nullptr;
+		if (reader.failed || !resolve_pipeline_state(resolver, hash, &state))
+			return false;
+
+		if (static_cast<const VkBaseInStructure *>(state)->sType != binary_state_type(static_cast<const State *>(nullptr)))
+		{
+			LOGE("Graphics pipeline state %016" PRIx64 " is of the wrong type.\n", hash);
+			return false;
+		}
+
+		*out_state = static_cast<const State *>(state);
+		return true;
+	}
+
+	default:
+		reader.failed = true;
+		return false;
+	}
+}
+
+bool StateReplayer::Impl::read_graphics_pipeline(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                                 BinaryReader &reader, VkGraphicsPipelineCreateInfo *info)
+{
+	info->sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	info->flags = reader.u32();
+
+	// Flags, stage, module, name length and the specialization info presence flag.
+	info->stageCount = reader.count(5 * sizeof(uint32_t) + sizeof(uint64_t));
+	auto *stages = allocator.allocate_n_cleared<VkPipelineShaderStageCreateInfo>(info->stageCount);
+	for (uint32_t i = 0; i < info->stageCount; i++)
+		if (!read_shader_stage(iface, resolver, reader, &stages[i]))
+			return false;
+	info->pStages = stages;
+
+	if (!read_pipeline_state(resolver, reader, &info->pVertexInputState) ||
+	    !read_pipeline_state(resolver, reader, &info->pInputAssemblyState) ||
+	    !read_pipeline_state(resolver, reader, &info->pTessellationState) ||
+	    !read_pipeline_state(resolver, reader, &info->pViewportState) ||
+	    !read_pipeline_state(resolver, reader, &info->pRasterizationState) ||
+	    !read_pipeline_state(resolver, reader, &info->pMultisampleState) ||
+	    !read_pipeline_state(resolver, reader, &info->pDepthStencilState) ||
+	    !read_pipeline_state(resolver, reader, &info->pColorBlendState) ||
+	    !read_pipeline_state(resolver, reader, &info->pDynamicState))
+	{
+		return false;
+	}
+
+	Hash layout = reader.u64();
+	Hash render_pass = reader.u64();
+	info->subpass = reader.u32();
+	Hash pipeline = reader.u64();
+	info->basePipelineIndex = reader.s32();
+	if (reader.failed)
+		return false;
+
+	if (!resolve_replayed_handle(replayed_pipeline_layouts, RESOURCE_PIPELINE_LAYOUT, "Pipeline layout", layout, &info->layout))
+		return false;
+	if (!resolve_replayed_handle(replayed_render_passes, RESOURCE_RENDER_PASS, "Render pass", render_pass, &info->renderPass))
+		return false;
+
+	return resolve_base_pipeline(iface, resolver, RESOURCE_GRAPHICS_PIPELINE, pipeline, replayed_graphics_pipelines,
+	                             &info->basePipelineHandle);
+}
+
+bool StateReplayer::Impl::parse_binary(StateCreatorInterface &iface, DatabaseInterface *resolver,
+                                       const uint8_t *buffer, size_t size)
+{
+	BinaryReader reader(buffer + sizeof(binary_format_magic), size - sizeof(binary_format_magic));
+	uint32_t version = reader.u32();
+	auto tag = static_cast<ResourceTag>(reader.u32());
+	Hash hash = reader.u64();
+
+	if (reader.failed)
+	{
+		LOGE("Binary blob is truncated.\n");
+		return false;
+	}
+
+	if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+	{
+		LOGE("Binary blob version mismatches.\n");
+		return false;
+	}
+
+	switch (tag)
+	{
+	case RESOURCE_APPLICATION_INFO:
+		if (!read_application_info(iface, reader))
+			return log_binary_read_failure(reader, tag, hash);
+		return true;
+
+	case RESOURCE_APPLICATION_BLOB_LINK:
+	{
+		Hash application_hash = reader.u64();
+		auto link_tag = static_cast<ResourceTag>(reader.u32());
+		Hash link_hash = reader.u64();
+		if (reader.failed)
+			return log_binary_read_failure(reader, tag, hash);
+		iface.notify_application_info_link(Hashing::compute_hash_application_info_link(application_hash, link_tag, link_hash),
+		                                   application_hash, link_tag, link_hash);
+		return true;
+	}
+
+	case RESOURCE_SAMPLER:
+	{
+		if (replayed_samplers.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkSamplerCreateInfo>();
+		if (!read_sampler(reader, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_sampler(hash, info, &replayed_samplers[hash]))
+		{
+			LOGE("Failed to create sampler.\n");
+			return false;
+		}
+		break;
+	}
+
+	case RESOURCE_DESCRIPTOR_SET_LAYOUT:
+	{
+		if (replayed_descriptor_set_layouts.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkDescriptorSetLayoutCreateInfo>();
+		if (!read_descriptor_set_layout(reader, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_descriptor_set_layout(hash, info, &replayed_descriptor_set_layouts[hash]))
+		{
+			LOGE("Failed to create descriptor set layout.\n");
+			return false;
+		}
+		break;
+	}
+
+	case RESOURCE_PIPELINE_LAYOUT:
+	{
+		if (replayed_pipeline_layouts.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkPipelineLayoutCreateInfo>();
+		if (!read_pipeline_layout(reader, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_pipeline_layout(hash, info, &replayed_pipeline_layouts[hash]))
+		{
+			LOGE("Failed to create pipeline layout.\n");
+			return false;
+		}
+		break;
+	}
+
+	case RESOURCE_SHADER_MODULE:
+	{
+		if (replayed_shader_modules.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkShaderModuleCreateInfo>();
+		if (!read_shader_module(reader, version, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_shader_module(hash, info, &replayed_shader_modules[hash]))
+		{
+			LOGE("Failed to create shader module.\n");
+			return false;
+		}
+		break;
+	}
+
+	case RESOURCE_RENDER_PASS:
+	{
+		if (replayed_render_passes.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkRenderPassCreateInfo>();
+		if (!read_render_pass(reader, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_render_pass(hash, info, &replayed_render_passes[hash]))
+		{
+			LOGE("Failed to create render pass.\n");
+			return false;
+		}
+		break;
+	}
+
+	case RESOURCE_COMPUTE_PIPELINE:
+	{
+		if (replayed_compute_pipelines.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkComputePipelineCreateInfo>();
+		if (!read_compute_pipeline(iface, resolver, reader, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_compute_pipeline(hash, info, &replayed_compute_pipelines[hash]))
+		{
+			LOGE("Failed to create compute pipeline.\n");
+			return false;
+		}
+		break;
+	}
+
+	case RESOURCE_GRAPHICS_PIPELINE_STATE:
+	{
+		// Only ever referenced by graphics pipelines, so there is nothing to create.
+		const void *state = nullptr;
+		if (replayed_pipeline_states.count(hash))
+			return true;
+		return read_pipeline_state_entry(reader, hash, &state);
+	}
+
+	case RESOURCE_GRAPHICS_PIPELINE:
+	{
+		if (replayed_graphics_pipelines.count(hash))
+			return true;
+		auto *info = allocator.allocate_cleared<VkGraphicsPipelineCreateInfo>();
+		if (!read_graphics_pipeline(iface, resolver, reader, info))
+			return log_binary_read_failure(reader, tag, hash);
+		if (!iface.enqueue_create_graphics_pipeline(hash, info, &replayed_graphics_pipelines[hash]))
+		{
+			LOGE("Failed to create graphics pipeline.\n");
+			return false;
+		}
+		break;
+	}
+
+	default:
+		LOGE("Unknown resource tag %d in binary blob.\n", int(tag));
+		return false;
+	}
+
+	iface.notify_replayed_resources_for_type();
+	return true;
+}
+
+StateReplayer::StateReplayer()
+{
+	impl = new Impl;
+}
+
+StateReplayer::~StateReplayer()
+{
+	delete impl;
+}
+
+ScratchAllocator &StateReplayer::get_allocator()
+{
+	return impl->allocator;
+}
+
+bool StateReplayer::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t size)
+{
+	FOSSILIZE_PROFILE_ZONE("StateReplayer::parse");
+	return impl->parse(iface, resolver, buffer, size);
+}
+
+bool StateReplayer::scan_references(const void *buffer, size_t size, const StateReference **references, size_t *count)
+{
+	if (!impl->scan_references(buffer, size))
+		return false;
+	*references = impl->scanned_references.data();
+	*count = impl->scanned_references.size();
+	return true;
+}
+
+void StateReplayer::set_resolve_derivative_pipeline_handles(bool enable)
+{
+	impl->resolve_derivative_pipelines = enable;
+}
+
+void StateReplayer::set_resolve_shader_module_handles(bool enable)
+{
+	impl->resolve_shader_modules = enable;
+}
+
+void StateReplayer::set_module_store(DatabaseInterface *store)
+{
+	impl->module_store = store;
+}
+
+void StateReplayer::copy_handle_references(const StateReplayer &replayer)
+{
+	impl->copy_handle_references(*replayer.impl);
+}
+
+void StateReplayer::merge_handle_references(const StateReplayer &replayer)
+{
+	impl->merge_handle_references(*replayer.impl);
+}
+
+void StateReplayer::forget_handle_references()
+{
+	impl->forget_handle_references();
+}
+
+void StateReplayer::Impl::copy_handle_references(const StateReplayer::Impl &other)
+{
+	// Worker threads inherit from the same replayer concurrently.
+	// The first one freezes its references, the rest just take another reference to the same layers.
+	lock_guard<mutex> holder(other.handle_reference_lock);
+	other.replayed_samplers.share_with(replayed_samplers);
+	other.replayed_descriptor_set_layouts.share_with(replayed_descriptor_set_layouts);
+	other.replayed_pipeline_layouts.share_with(replayed_pipeline_layouts);
+	other.replayed_shader_modules.share_with(replayed_shader_modules);
+	other.replayed_render_passes.share_with(replayed_render_passes);
+	other.replayed_compute_pipelines.share_with(replayed_compute_pipelines);
+	other.replayed_graphics_pipelines.share_with(replayed_graphics_pipelines);
+	// Pipeline states live in the allocator of the other replayer, which may be reset independently of this one.
+	// They are cheap to decode again.
+}
+
+void StateReplayer::Impl::merge_handle_references(const StateReplayer::Impl &other)
+{
+	replayed_samplers.merge_local(other.replayed_samplers);
+	replayed_descriptor_set_layouts.merge_local(other.replayed_descriptor_set_layouts);
+	replayed_pipeline_layouts.merge_local(other.replayed_pipeline_layouts);
+	replayed_shader_modules.merge_local(other.replayed_shader_modules);
+	replayed_render_passes.merge_local(other.replayed_render_passes);
+	replayed_compute_pipelines.merge_local(other.replayed_compute_pipelines);
+	replayed_graphics_pipelines.merge_local(other.replayed_graphics_pipelines);
+}
+
+void StateReplayer::Impl::forget_handle_references()
+{
+	replayed_samplers.clear();
+	replayed_descriptor_set_layouts.clear();
+	replayed_pipeline_layouts.clear();
+	replayed_shader_modules.clear();
+	replayed_render_passes.clear();
+	replayed_compute_pipelines.clear();
+	replayed_graphics_pipelines.clear();
+	replayed_pipeline_states.clear();
+	pipeline_state_allocator.reset();
+}
+
+bool StateReplayer::Impl::parse_json_document(const uint8_t *buffer, size_t json_size, Document &doc)
+{
+	// In-situ parsing needs a mutable, terminated copy of the document.
+	// Strings in the DOM then point into this copy instead of being allocated one by one.
+	auto *json = static_cast<char *>(json_allocator.Malloc(json_size + 1));
+	memcpy(json, buffer, json_size);
+	json[json_size] = '\0';
+
+	doc.ParseInsitu(json);
+
+	if (doc.HasParseError())
+	{
+		auto error = doc.GetParseError();
+		LOGE("Got parse error: %d\n", int(error));
+		return false;
+	}
+
+	return true;
+}
+
+bool StateReplayer::Impl::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer_, size_t total_size)
+{
+	const uint8_t *buffer = static_cast<const uint8_t *>(buffer_);
+	if (is_binary_format(buffer, total_size))
+		return parse_binary(iface, resolver, buffer, total_size);
+
+	// All data after a string terminating '\0' is considered binary payload
+	// which can be read for various purposes (SPIR-V varint for example).
+	auto itr = find(buffer, buffer + total_size, '\0');
+	const uint8_t *varint_buffer = nullptr;
+	size_t varint_size = 0;
+	size_t json_size = itr - buffer;
+
+	if (itr < buffer + total_size)
+	{
+		varint_buffer = itr + 1;
+		varint_size = (buffer + total_size) - varint_buffer;
+	}
+
+	JsonPoolScope pool_scope(*this);
+	Document doc(&json_allocator);
+	if (!parse_json_document(buffer, json_size, doc))
+		return false;
+
+	int version = doc["version"].GetInt();
+	if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+	{
+		LOGE("JSON version mismatches.");
+		return false;
+	}
+
+	if (doc.HasMember("applicationInfo") && doc.HasMember("physicalDeviceFeatures"))
+		if (!parse_application_info(iface, doc["applicationInfo"], doc["physicalDeviceFeatures"]))
+			return false;
+
+	if (doc.HasMember("application"))
+		iface.set_current_application_info(string_to_uint64(doc["application"].GetString()));
+
+	if (doc.HasMember("link"))
+		if (!parse_application_info_link(iface, doc["link"]))
+			return false;
+
+	if (doc.HasMember("shaderModules"))
+		if (!parse_shader_modules(iface, doc["shaderModules"], varint_buffer, varint_size, unsigned(version)))
+			return false;
+
+	if (doc.HasMember("samplers"))
+		if (!parse_samplers(iface, doc["samplers"]))
+			return false;
+
+	if (doc.HasMember("setLayouts"))
+		if (!parse_descriptor_set_layouts(iface, doc["setLayouts"]))
+			return false;
+
+	if (doc.HasMember("pipelineLayouts"))
+		if (!parse_pipeline_layouts(iface, doc["pipelineLayouts"]))
+			return false;
+
+	if (doc.HasMember("renderPasses"))
+		if (!parse_render_passes(iface, doc["renderPasses"]))
+			return false;
+
+	if (doc.HasMember("computePipelines"))
+		if (!parse_compute_pipelines(iface, resolver, doc["computePipelines"]))
+			return false;
+
+	if (doc.HasMember("graphicsPipelines"))
+		if (!parse_graphics_pipelines(iface, resolver, doc["graphicsPipelines"]))
+			return false;
+
+	return true;
+}
+
+void StateReplayer::Impl::add_reference(ResourceTag tag, Hash hash)
+{
+	if (hash != 0)
+		scanned_references.push_back({ tag, hash });
+}
+
+// Stands in for the creator interface while scanning, where nothing is created.
+struct ScanStateCreator : StateCreatorInterface
+{
+	bool enqueue_create_sampler(Hash, const VkSamplerCreateInfo *, VkSampler *) override { return false; }
+	bool enqueue_create_descriptor_set_layout(Hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *) override { return false; }
+	bool enqueue_create_pipeline_layout(Hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *) override { return false; }
+	bool enqueue_create_shader_module(Hash, const VkShaderModuleCreateInfo *, VkShaderModule *) override { return false; }
+	bool enqueue_create_render_pass(Hash, const VkRenderPassCreateInfo *, VkRenderPass *) override { return false; }
+	bool enqueue_create_compute_pipeline(Hash, const VkComputePipelineCreateInfo *, VkPipeline *) override { return false; }
+	bool enqueue_create_graphics_pipeline(Hash, const VkGraphicsPipelineCreateInfo *, VkPipeline *) override { return false; }
+};
+
+bool StateReplayer::Impl::scan_binary(const uint8_t *buffer, size_t size)
+{
+	BinaryReader reader(buffer + sizeof(binary_format_magic), size - sizeof(binary_format_magic));
+	uint32_t version = reader.u32();
+	auto tag = static_cast<ResourceTag>(reader.u32());
+	Hash hash = reader.u64();
+
+	if (reader.failed)
+	{
+		LOGE("Binary blob is truncated.\n");
+		return false;
+	}
+
+	if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+	{
+		LOGE("Binary blob version mismatches.\n");
+		return false;
+	}
+
+	// The fields have to be decoded to get to the handles, but nothing is resolved or created.
+	ScanStateCreator iface;
+	bool ret = true;
+	scanning = true;
+
+	switch (tag)
+	{
+	case RESOURCE_DESCRIPTOR_SET_LAYOUT:
+		ret = read_descriptor_set_layout(reader, allocator.allocate_cleared<VkDescriptorSetLayoutCreateInfo>());
+		break;
+
+	case RESOURCE_PIPELINE_LAYOUT:
+		ret = read_pipeline_layout(reader, allocator.allocate_cleared<VkPipelineLayoutCreateInfo>());
+		break;
+
+	case RESOURCE_COMPUTE_PIPELINE:
+		ret = read_compute_pipeline(iface, nullptr, reader, allocator.allocate_cleared<VkComputePipelineCreateInfo>());
+		break;
+
+	case RESOURCE_GRAPHICS_PIPELINE:
+		ret = read_graphics_pipeline(iface, nullptr, reader, allocator.allocate_cleared<VkGraphicsPipelineCreateInfo>());
+		break;
+
+	default:
+		// Nothing else refers to other objects.
+		break;
+	}
+
+	scanning = false;
+	if (!ret)
+		return log_binary_read_failure(reader, tag, hash);
+	return true;
+}
+
+bool StateReplayer::Impl::scan_references(const void *buffer_, size_t total_size)
+{
+	scanned_references.clear();
+
+	const uint8_t *buffer = static_cast<const uint8_t *>(buffer_);
+	if (is_binary_format(buffer, total_size))
+		return scan_binary(buffer, total_size);
+
+	// The varint payload of shader modules does not refer to anything.
+	size_t json_size = find(buffer, buffer + total_size, '\0') - buffer;
+
+	JsonPoolScope pool_scope(*this);
+	Document doc(&json_allocator);
+	if (!parse_json_document(buffer, json_size, doc))
+		return false;
+
+	int version = doc["version"].GetInt();
+	if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+	{
+		LOGE("JSON version mismatches.");
+		return false;
+	}
+
+	if (doc.HasMember("setLayouts"))
+	{
+		auto &layouts = doc["setLayouts"];
+		for (auto itr = layouts.MemberBegin(); itr != layouts.MemberEnd(); ++itr)
+		{
+			if (!itr->value.HasMember("bindings"))
+				continue;
+			auto &bindings = itr->value["bindings"];
+			for (auto binding = bindings.Begin(); binding != bindings.End(); ++binding)
+			{
+				if (!binding->HasMember("immutableSamplers"))
+					continue;
+				auto &samplers = (*binding)["immutableSamplers"];
+				for (auto sampler = samplers.Begin(); sampler != samplers.End(); ++sampler)
+					add_reference(RESOURCE_SAMPLER, string_to_uint64(sampler->GetString()));
+			}
+		}
+	}
+
+	if (doc.HasMember("pipelineLayouts"))
+	{
+		auto &layouts = doc["pipelineLayouts"];
+		for (auto itr = layouts.MemberBegin(); itr != layouts.MemberEnd(); ++itr)
+		{
+			if (!itr->value.HasMember("setLayouts"))
+				continue;
+			auto &set_layouts = itr->value["setLayouts"];
+			for (auto set_layout = set_layouts.Begin(); set_layout != set_layouts.End(); ++set_layout)
+				add_reference(RESOURCE_DESCRIPTOR_SET_LAYOUT, string_to_uint64(set_layout->GetString()));
+		}
+	}
+
+	if (doc.HasMember("computePipelines"))
+	{
+		auto &pipelines = doc["computePipelines"];
+		for (auto itr = pipelines.MemberBegin(); itr != pipelines.MemberEnd(); ++itr)
+		{
+			auto &obj = itr->value;
+			add_reference(RESOURCE_SHADER_MODULE, string_to_uint64(obj["stage"]["module"].GetString()));
+			add_reference(RESOURCE_PIPELINE_LAYOUT, string_to_uint64(obj["layout"].GetString()));
+			add_reference(RESOURCE_COMPUTE_PIPELINE, string_to_uint64(obj["basePipelineHandle"].GetString()));
+		}
+	}
+
+	if (doc.HasMember("graphicsPipelines"))
+	{
+		auto &pipelines = doc["graphicsPipelines"];
+		for (auto itr = pipelines.MemberBegin(); itr != pipelines.MemberEnd(); ++itr)
+		{
+			auto &obj = itr->value;
+			if (obj.HasMember("stages"))
+			{
+				auto &stages = obj["stages"];
+				for (auto stage = stages.Begin(); stage != stages.End(); ++stage)
+					add_reference(RESOURCE_SHADER_MODULE, string_to_uint64((*stage)["module"].GetString()));
+			}
+			add_reference(RESOURCE_PIPELINE_LAYOUT, string_to_uint64(obj["layout"].GetString()));
+			add_reference(RESOURCE_RENDER_PASS, string_to_uint64(obj["renderPass"].GetString()));
+			add_reference(RESOURCE_GRAPHICS_PIPELINE, string_to_uint64(obj["basePipelineHandle"].GetString()));
+		}
+	}
+
+	return true;
+}
+
+template <typename T>
+T *StateRecorder::Impl::copy(const T *src, size_t count, ScratchAllocator &alloc)
+{
+	if (!count)
+		return nullptr;
+
+	auto *new_data = alloc.allocate_n<T>(count);
+	if (new_data)
+		std::copy(src, src + count, new_data);
+	return new_data;
 }
 
 void *StateRecorder::Impl::copy_pnext_struct(
@@ -2626,179 +4351,624 @@ void *StateRecorder::Impl::copy_pnext_struct(
 	return info;
 }
 
-void *StateRecorder::Impl::copy_pnext_struct(
-		const VkPipelineRasterizationDepthClipStateCreateInfoEXT *create_info,
-		ScratchAllocator &alloc)
+void *StateRecorder::Impl::copy_pnext_struct(
+		const VkPipelineRasterizationDepthClipStateCreateInfoEXT *create_info,
+		ScratchAllocator &alloc)
+{
+	return copy(create_info, 1, alloc);
+}
+
+void *StateRecorder::Impl::copy_pnext_struct(
+		const VkPipelineRasterizationStateStreamCreateInfoEXT *create_info,
+		ScratchAllocator &alloc)
+{
+	return copy(create_info, 1, alloc);
+}
+
+bool StateRecorder::Impl::copy_pnext_chain(const void *pNext, ScratchAllocator &alloc, const void **out_pnext)
+{
+	VkBaseInStructure new_pnext = {};
+	const VkBaseInStructure **ppNext = &new_pnext.pNext;
+
+	while (pNext != nullptr)
+	{
+		auto *pin = static_cast<const VkBaseInStructure *>(pNext);
+
+		switch (pin->sType)
+		{
+		case VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_DOMAIN_ORIGIN_STATE_CREATE_INFO:
+		{
+			auto ci = static_cast<const VkPipelineTessellationDomainOriginStateCreateInfo *>(pNext);
+			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_DIVISOR_STATE_CREATE_INFO_EXT:
+		{
+			auto *ci = static_cast<const VkPipelineVertexInputDivisorStateCreateInfoEXT *>(pNext);
+			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_DEPTH_CLIP_STATE_CREATE_INFO_EXT:
+		{
+			auto *ci = static_cast<const VkPipelineRasterizationDepthClipStateCreateInfoEXT *>(pNext);
+			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_STREAM_CREATE_INFO_EXT:
+		{
+			auto *ci = static_cast<const VkPipelineRasterizationStateStreamCreateInfoEXT *>(pNext);
+			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
+			break;
+		}
+
+		default:
+			LOGE("Cannot copy unknown pNext sType: %d.\n", int(pin->sType));
+			return false;
+		}
+
+		pNext = pin->pNext;
+		ppNext = const_cast<const VkBaseInStructure **>(&(*ppNext)->pNext);
+		*ppNext = nullptr;
+	}
+
+	*out_pnext = new_pnext.pNext;
+	return true;
+}
+
+struct ScratchAllocator::Impl
+{
+	struct Block
+	{
+		uint8_t *data;
+		size_t size;
+		size_t offset;
+		bool mapped;
+	};
+	std::vector<Block> blocks;
+	std::vector<Block> free_blocks;
+
+	bool recycle_blocks = false;
+	bool huge_pages = false;
+
+	size_t bytes_in_use = 0;
+	size_t bytes_reserved = 0;
+	size_t peak_bytes_in_use = 0;
+	size_t peak_bytes_reserved = 0;
+	size_t system_allocations = 0;
+
+	~Impl();
+	bool add_block(size_t minimum_size);
+	bool allocate_block(size_t size, Block *block);
+	void free_block(const Block &block);
+};
+
+ScratchAllocator::ScratchAllocator()
+{
+	impl = new Impl;
+}
+
+ScratchAllocator::~ScratchAllocator()
+{
+	delete impl;
+}
+
+ScratchAllocator::Impl::~Impl()
+{
+	for (auto &block : blocks)
+		free_block(block);
+	for (auto &block : free_blocks)
+		free_block(block);
+}
+
+bool ScratchAllocator::Impl::allocate_block(size_t size, Block *block)
+{
+#ifdef __linux__
+	if (huge_pages)
+	{
+		// Huge pages are only used for 2 MiB aligned ranges, so over-allocate and trim the mapping.
+		const size_t huge_page_size = 2 * 1024 * 1024;
+		size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+		void *mapping = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping != MAP_FAILED)
+		{
+			auto *base = static_cast<uint8_t *>(mapping);
+			auto *aligned = reinterpret_cast<uint8_t *>(
+					(reinterpret_cast<uintptr_t>(base) + huge_page_size - 1) & ~uintptr_t(huge_page_size - 1));
+			if (aligned != base)
+				munmap(base, size_t(aligned - base));
+			if (aligned + size != base + size + huge_page_size)
+				munmap(aligned + size, size_t(base + size + huge_page_size - (aligned + size)));
+#ifdef MADV_HUGEPAGE
+			// Only a hint, the block works either way.
+			madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+			*block = { aligned, size, 0, true };
+			return true;
+		}
+	}
+#endif
+
+	auto *data = static_cast<uint8_t *>(malloc(size));
+	if (!data)
+		return false;
+	*block = { data, size, 0, false };
+	return true;
+}
+
+void ScratchAllocator::Impl::free_block(const Block &block)
+{
+#ifdef __linux__
+	if (block.mapped)
+	{
+		munmap(block.data, block.size);
+		return;
+	}
+#endif
+	free(block.data);
+}
+
+bool ScratchAllocator::Impl::add_block(size_t minimum_size)
+{
+	if (minimum_size < 64 * 1024)
+		minimum_size = 64 * 1024;
+
+	// Blocks kept by reset() come back in the order they were handed out, so the first one usually fits.
+	for (auto itr = free_blocks.begin(); itr != free_blocks.end(); ++itr)
+	{
+		if (itr->size >= minimum_size)
+		{
+			blocks.push_back(*itr);
+			blocks.back().offset = 0;
+			free_blocks.erase(itr);
+			return true;
+		}
+	}
+
+	Block block = {};
+	if (!allocate_block(minimum_size, &block))
+		return false;
+
+	blocks.push_back(block);
+	system_allocations++;
+	bytes_reserved += block.size;
+	if (bytes_reserved > peak_bytes_reserved)
+		peak_bytes_reserved = bytes_reserved;
+	return true;
+}
+
+void *ScratchAllocator::allocate_raw_cleared(size_t size, size_t alignment)
+{
+	void *ret = allocate_raw(size, alignment);
+	if (ret)
+		memset(ret, 0, size);
+	return ret;
+}
+
+void *ScratchAllocator::allocate_raw(size_t size, size_t alignment)
+{
+	if (impl->blocks.empty())
+		if (!impl->add_block(size + alignment))
+			return nullptr;
+
+	auto &block = impl->blocks.back();
+
+	// Align the address rather than the offset, malloc only guarantees 16 bytes.
+	uintptr_t address = reinterpret_cast<uintptr_t>(block.data) + block.offset;
+	size_t offset = block.offset + (((address + alignment - 1) & ~uintptr_t(alignment - 1)) - address);
+	size_t required_size = offset + size;
+	if (required_size <= block.size)
+	{
+		void *ret = block.data + offset;
+		impl->bytes_in_use += required_size - block.offset;
+		block.offset = required_size;
+		return ret;
+	}
+
+	if (!impl->add_block(size + alignment))
+		return nullptr;
+	return allocate_raw(size, alignment);
+}
+
+void ScratchAllocator::reset()
+{
+	if (impl->bytes_in_use > impl->peak_bytes_in_use)
+		impl->peak_bytes_in_use = impl->bytes_in_use;
+	impl->bytes_in_use = 0;
+
+	if (impl->blocks.size() > 0)
+	{
+		// Keep the first block, and either keep or free the rest.
+		for (size_t i = 1; i < impl->blocks.size(); i++)
+		{
+			if (impl->recycle_blocks)
+				impl->free_blocks.push_back(impl->blocks[i]);
+			else
+			{
+				impl->bytes_reserved -= impl->blocks[i].size;
+				impl->free_block(impl->blocks[i]);
+			}
+		}
+		impl->blocks.resize(1);
+		impl->blocks[0].offset = 0;
+	}
+}
+
+void ScratchAllocator::set_block_recycling(bool enable)
+{
+	impl->recycle_blocks = enable;
+	if (!enable)
+	{
+		for (auto &block : impl->free_blocks)
+		{
+			impl->bytes_reserved -= block.size;
+			impl->free_block(block);
+		}
+		impl->free_blocks.clear();
+	}
+}
+
+void ScratchAllocator::set_huge_pages(bool enable)
+{
+	impl->huge_pages = enable;
+}
+
+void ScratchAllocator::get_statistics(Statistics *stats) const
+{
+	stats->block_count = impl->blocks.size();
+	stats->free_block_count = impl->free_blocks.size();
+	stats->bytes_in_use = impl->bytes_in_use;
+	stats->bytes_reserved = impl->bytes_reserved;
+	stats->peak_bytes_in_use = std::max(impl->peak_bytes_in_use, impl->bytes_in_use);
+	stats->peak_bytes_reserved = impl->peak_bytes_reserved;
+	stats->system_allocations = impl->system_allocations;
+}
+
+size_t ScratchAllocator::get_current_memory_consumption() const
+{
+	return impl->bytes_reserved;
+}
+
+size_t ScratchAllocator::get_peak_memory_consumption() const
+{
+	return impl->peak_bytes_reserved;
+}
+
+ScratchAllocator &StateRecorder::get_allocator()
+{
+	return impl->allocator;
+}
+
+void StateRecorder::set_database_enable_checksum(bool enable)
+{
+	impl->checksum = enable;
+}
+
+void StateRecorder::set_database_enable_compression(bool enable)
+{
+	impl->compression = enable;
+}
+
+void StateRecorder::set_database_enable_fast_compression(bool enable)
+{
+	impl->fast_compression = enable;
+}
+
+void StateRecorder::set_database_enable_binary_format(bool enable)
+{
+	impl->binary_format = enable;
+}
+
+void StateRecorder::set_enable_early_deduplication(bool enable)
+{
+	if (enable)
+	{
+		impl->recorded_samplers.reset(new ConcurrentHashSet(Impl::RecordedHashSetCapacityLog2));
+		impl->recorded_shader_modules.reset(new ConcurrentHashSet(Impl::RecordedHashSetCapacityLog2));
+		impl->recorded_render_passes.reset(new ConcurrentHashSet(Impl::RecordedHashSetCapacityLog2));
+	}
+	else
+	{
+		impl->recorded_samplers.reset();
+		impl->recorded_shader_modules.reset();
+		impl->recorded_render_passes.reset();
+	}
+}
+
+template <typename Handle>
+bool StateRecorder::Impl::enqueue_deduplicated(ConcurrentHashSet *recorded, Handle handle, Hash hash, VkStructureType type)
+{
+	if (!recorded || !recorded->contains(hash))
+		return false;
+
+	// Nothing is copied, so there is no need for an arena.
+	counters.queued_item();
+	record_queue.push({api_object_cast<uint64_t>(handle), nullptr, hash, type});
+	return true;
+}
+
+RecordArena *RecordArenaPool::acquire()
+{
+	std::lock_guard<std::mutex> holder(lock);
+	RecordArena *arena;
+	if (free_arenas.empty())
+	{
+		arenas.emplace_back(new RecordArena);
+		arena = arenas.back().get();
+	}
+	else
+	{
+		arena = free_arenas.back();
+		free_arenas.pop_back();
+	}
+
+	// The owning thread holds the first reference.
+	arena->references.store(1, std::memory_order_relaxed);
+	return arena;
+}
+
+void RecordArenaPool::account(RecordArena *arena)
+{
+	size_t reserved = arena->allocator.get_current_memory_consumption();
+	if (reserved <= arena->accounted_bytes)
+		return;
+
+	uint64_t bytes = live_bytes.fetch_add(reserved - arena->accounted_bytes, std::memory_order_relaxed) +
+	                 (reserved - arena->accounted_bytes);
+	arena->accounted_bytes = reserved;
+
+	uint64_t max_bytes = max_live_bytes.load(std::memory_order_relaxed);
+	while (bytes > max_bytes &&
+	       !max_live_bytes.compare_exchange_weak(max_bytes, bytes, std::memory_order_relaxed))
+	{
+	}
+}
+
+void RecordArenaPool::release(RecordArena *arena)
 {
-	return copy(create_info, 1, alloc);
+	if (arena->references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	live_bytes.fetch_sub(arena->accounted_bytes, std::memory_order_relaxed);
+	arena->accounted_bytes = 0;
+	arena->allocator.reset();
+	std::lock_guard<std::mutex> holder(lock);
+	free_arenas.push_back(arena);
 }
 
-void *StateRecorder::Impl::copy_pnext_struct(
-		const VkPipelineRasterizationStateStreamCreateInfoEXT *create_info,
-		ScratchAllocator &alloc)
+void RecordArenaPool::free_unused_arenas()
 {
-	return copy(create_info, 1, alloc);
+	std::lock_guard<std::mutex> holder(lock);
+	auto itr = std::remove_if(arenas.begin(), arenas.end(), [this](const std::unique_ptr<RecordArena> &arena) {
+		return std::find(free_arenas.begin(), free_arenas.end(), arena.get()) != free_arenas.end();
+	});
+	arenas.erase(itr, arenas.end());
+	free_arenas.clear();
 }
 
-bool StateRecorder::Impl::copy_pnext_chain(const void *pNext, ScratchAllocator &alloc, const void **out_pnext)
+ThreadRecordArena::~ThreadRecordArena()
 {
-	VkBaseInStructure new_pnext = {};
-	const VkBaseInStructure **ppNext = &new_pnext.pNext;
+	if (arena)
+		pool->release(arena);
+}
 
-	while (pNext != nullptr)
+RecordArena *StateRecorder::Impl::get_record_arena()
+{
+	auto &tls = thread_record_arena;
+	if (tls.pool != arena_pool)
 	{
-		auto *pin = static_cast<const VkBaseInStructure *>(pNext);
+		// Last thing this thread recorded went to another StateRecorder.
+		if (tls.arena)
+			tls.pool->release(tls.arena);
+		tls.pool = arena_pool;
+		tls.arena = arena_pool->acquire();
+	}
+	return tls.arena;
+}
 
-		switch (pin->sType)
-		{
-		case VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_DOMAIN_ORIGIN_STATE_CREATE_INFO:
-		{
-			auto ci = static_cast<const VkPipelineTessellationDomainOriginStateCreateInfo *>(pNext);
-			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
-			break;
-		}
+void StateRecorder::Impl::push_record_item(RecordArena *arena, uint64_t handle, void *create_info, Hash custom_hash)
+{
+	arena->references.fetch_add(1, std::memory_order_relaxed);
+	arena_pool->account(arena);
+	counters.queued_item();
+	WorkItem item = { handle, create_info, custom_hash, VkStructureType(0), arena };
+	if (usage_metadata)
+		stamp_usage(item);
+	record_queue.push(item);
 
-		case VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_DIVISOR_STATE_CREATE_INFO_EXT:
-		{
-			auto *ci = static_cast<const VkPipelineVertexInputDivisorStateCreateInfoEXT *>(pNext);
-			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
-			break;
-		}
+	if (arena->allocator.get_current_memory_consumption() > RecordArenaRetireSize)
+	{
+		thread_record_arena.arena = arena_pool->acquire();
+		arena_pool->release(arena);
+	}
+}
 
-		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_DEPTH_CLIP_STATE_CREATE_INFO_EXT:
-		{
-			auto *ci = static_cast<const VkPipelineRasterizationDepthClipStateCreateInfoEXT *>(pNext);
-			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
-			break;
-		}
+bool StateRecorder::Impl::check_record_queue_limit()
+{
+	// Without a recording thread, every object is processed before record_*() returns.
+	if (!record_queue_limit || !worker_thread.joinable())
+		return true;
 
-		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_STREAM_CREATE_INFO_EXT:
-		{
-			auto *ci = static_cast<const VkPipelineRasterizationStateStreamCreateInfoEXT *>(pNext);
-			*ppNext = static_cast<VkBaseInStructure *>(copy_pnext_struct(ci, alloc));
-			break;
-		}
+	if (arena_pool->live_bytes.load(std::memory_order_relaxed) <= record_queue_limit)
+		return true;
 
-		default:
-			LOGE("Cannot copy unknown pNext sType: %d.\n", int(pin->sType));
-			return false;
-		}
+	// A deferring recording thread may be asleep until its next deadline, holding the very copies which
+	// keep us over the limit. Wake it up so it notices the pressure and releases them right away.
+	record_queue.wake();
 
-		pNext = pin->pNext;
-		ppNext = const_cast<const VkBaseInStructure **>(&(*ppNext)->pNext);
-		*ppNext = nullptr;
+	if (record_queue_policy == RECORD_QUEUE_LIMIT_POLICY_DROP)
+	{
+		counters.dropped_count.fetch_add(1, std::memory_order_relaxed);
+		return false;
 	}
 
-	*out_pnext = new_pnext.pNext;
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + std::chrono::milliseconds(record_queue_timeout_ms);
+	while (arena_pool->live_bytes.load(std::memory_order_relaxed) > record_queue_limit &&
+	       std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	counters.blocked_count.fetch_add(1, std::memory_order_relaxed);
+	counters.blocked_time_ns.fetch_add(RecorderCounters::elapsed_ns(start), std::memory_order_relaxed);
 	return true;
 }
 
-struct ScratchAllocator::Impl
+void StateRecorder::set_deferred_recording(unsigned delay_ms, unsigned idle_ms)
 {
-	struct Block
-	{
-		Block(size_t size);
-		size_t offset = 0;
-		std::vector<uint8_t> blob;
-	};
-	std::vector<Block> blocks;
+	impl->defer_delay_ms = delay_ms;
+	impl->defer_idle_ms = idle_ms;
+}
 
-	void add_block(size_t minimum_size);
-	size_t peak_history_size = 0;
-};
+// Usage metadata blobs are a magic, the format version and the session, followed by fixed size records in native byte order.
+static const uint8_t usage_metadata_magic[4] = { 0xff, 'F', 'Z', 'U' };
+enum { UsageMetadataVersion = 1 };
+static const size_t usage_metadata_header_size = sizeof(usage_metadata_magic) + sizeof(uint32_t) + sizeof(uint64_t);
+static const size_t usage_metadata_record_size = sizeof(uint64_t) + 4 * sizeof(uint32_t);
 
-ScratchAllocator::ScratchAllocator()
+void StateRecorder::set_enable_usage_metadata(bool enable)
 {
-	impl = new Impl;
+	impl->usage_metadata = enable;
+	if (!enable)
+		return;
+
+	// Sessions only need to be told apart, so anything which differs between runs will do.
+	impl->usage_start_time = std::chrono::steady_clock::now();
+	Hasher h;
+	h.u64(uint64_t(std::chrono::system_clock::now().time_since_epoch().count()));
+	h.pointer(this);
+	impl->usage_session = h.get();
 }
 
-ScratchAllocator::~ScratchAllocator()
+void StateRecorder::notify_frame_presented()
 {
-	delete impl;
+	impl->last_present_ms.store(impl->get_usage_time_ms(), std::memory_order_relaxed);
+	impl->presented_frames.fetch_add(1, std::memory_order_relaxed);
 }
 
-ScratchAllocator::Impl::Block::Block(size_t size)
+uint32_t StateRecorder::Impl::get_usage_time_ms() const
 {
-	blob.resize(size);
+	return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - usage_start_time).count());
 }
 
-void ScratchAllocator::Impl::add_block(size_t minimum_size)
+void StateRecorder::Impl::stamp_usage(WorkItem &item) const
 {
-	if (minimum_size < 64 * 1024)
-		minimum_size = 64 * 1024;
-	blocks.emplace_back(minimum_size);
+	item.usage_time_ms = get_usage_time_ms();
+	item.usage_frame = presented_frames.load(std::memory_order_relaxed);
+	uint32_t last_present = last_present_ms.load(std::memory_order_relaxed);
+	if (!item.usage_frame || item.usage_time_ms > last_present + UsageMetadataLoadingGapMs)
+		item.usage_flags = USAGE_METADATA_LOADING_BIT;
 }
 
-void *ScratchAllocator::allocate_raw_cleared(size_t size, size_t alignment)
+void StateRecorder::Impl::record_usage(ResourceTag tag, Hash hash, const WorkItem &item)
 {
-	void *ret = allocate_raw(size, alignment);
-	if (ret)
-		memset(ret, 0, size);
-	return ret;
+	if (!usage_metadata || !usage_seen[tag].emplace(hash, true))
+		return;
+	usage_records.push_back({ hash, tag, item.usage_time_ms, item.usage_frame, item.usage_flags });
 }
 
-void *ScratchAllocator::allocate_raw(size_t size, size_t alignment)
+void StateRecorder::Impl::flush_usage_metadata(PayloadWriteFlags flags, vector<uint8_t> &blob)
 {
-	if (impl->blocks.empty())
-		impl->add_block(size + alignment);
+	if (usage_records.empty())
+		return;
 
-	auto &block = impl->blocks.back();
+	blob.resize(usage_metadata_header_size + usage_records.size() * usage_metadata_record_size);
+	uint8_t *ptr = blob.data();
+	const auto write = [&](const void *data, size_t size) {
+		memcpy(ptr, data, size);
+		ptr += size;
+	};
 
-	size_t offset = (block.offset + alignment - 1) & ~(alignment - 1);
-	size_t required_size = offset + size;
-	if (required_size <= block.blob.size())
+	uint32_t version = UsageMetadataVersion;
+	write(usage_metadata_magic, sizeof(usage_metadata_magic));
+	write(&version, sizeof(version));
+	write(&usage_session, sizeof(usage_session));
+	for (auto &record : usage_records)
 	{
-		void *ret = block.blob.data() + offset;
-		block.offset = required_size;
-		return ret;
+		uint32_t tag = record.tag;
+		write(&record.hash, sizeof(record.hash));
+		write(&tag, sizeof(tag));
+		write(&record.first_use_ms, sizeof(record.first_use_ms));
+		write(&record.first_use_frame, sizeof(record.first_use_frame));
+		write(&record.flags, sizeof(record.flags));
 	}
 
-	impl->add_block(size + alignment);
-	return allocate_raw(size, alignment);
+	Hasher h(usage_session);
+	h.u32(usage_chunk_index++);
+	write_database_entry(RESOURCE_USAGE_METADATA, h.get(), blob, flags);
+	usage_records.clear();
 }
 
-void ScratchAllocator::reset()
+bool parse_usage_metadata(const void *blob, size_t size, Hash *session, UsageMetadataRecord *records, size_t *record_count)
 {
-	// Keep track of how large the buffer can grow.
-	size_t peak = get_peak_memory_consumption();
-	if (peak > impl->peak_history_size)
-		impl->peak_history_size = peak;
+	auto *data = static_cast<const uint8_t *>(blob);
+	uint32_t version;
+	if (size < usage_metadata_header_size ||
+	    memcmp(data, usage_metadata_magic, sizeof(usage_metadata_magic)) != 0)
+	{
+		LOGE("Blob is not usage metadata.\n");
+		return false;
+	}
 
-	if (impl->blocks.size() > 0)
+	memcpy(&version, data + sizeof(usage_metadata_magic), sizeof(version));
+	if (version != UsageMetadataVersion)
 	{
-		// free all but first block
-		if (impl->blocks.size() > 1)
-			impl->blocks.erase(impl->blocks.begin() + 1, impl->blocks.end());
-		// reset offset on first block
-		impl->blocks[0].offset = 0;
+		LOGE("Unsupported usage metadata version %u.\n", version);
+		return false;
 	}
-}
 
-size_t ScratchAllocator::get_peak_memory_consumption() const
-{
-	size_t current_size = 0;
-	for (auto &block : impl->blocks)
-		current_size += block.blob.size();
+	if ((size - usage_metadata_header_size) % usage_metadata_record_size != 0)
+	{
+		LOGE("Usage metadata is truncated.\n");
+		return false;
+	}
 
-	if (impl->peak_history_size > current_size)
-		return impl->peak_history_size;
-	else
-		return current_size;
-}
+	if (session)
+		memcpy(session, data + sizeof(usage_metadata_magic) + sizeof(version), sizeof(*session));
 
-ScratchAllocator &StateRecorder::get_allocator()
-{
-	return impl->allocator;
-}
+	size_t count = (size - usage_metadata_header_size) / usage_metadata_record_size;
+	if (records)
+	{
+		if (*record_count != count)
+			return false;
 
-void StateRecorder::set_database_enable_checksum(bool enable)
-{
-	impl->checksum = enable;
+		const uint8_t *ptr = data + usage_metadata_header_size;
+		const auto read = [&](void *out, size_t out_size) {
+			memcpy(out, ptr, out_size);
+			ptr += out_size;
+		};
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t tag;
+			read(&records[i].hash, sizeof(records[i].hash));
+			read(&tag, sizeof(tag));
+			read(&records[i].first_use_ms, sizeof(records[i].first_use_ms));
+			read(&records[i].first_use_frame, sizeof(records[i].first_use_frame));
+			read(&records[i].flags, sizeof(records[i].flags));
+			if (tag >= RESOURCE_COUNT)
+			{
+				LOGE("Invalid resource tag %u in usage metadata.\n", tag);
+				return false;
+			}
+			records[i].tag = static_cast<ResourceTag>(tag);
+		}
+	}
+	else
+		*record_count = count;
+
+	return true;
 }
 
-void StateRecorder::set_database_enable_compression(bool enable)
+void StateRecorder::set_record_queue_limit(size_t max_bytes, RecordQueueLimitPolicy policy, unsigned timeout_ms)
 {
-	impl->compression = enable;
+	impl->record_queue_limit = max_bytes;
+	impl->record_queue_policy = policy;
+	impl->record_queue_timeout_ms = timeout_ms;
 }
 
 bool StateRecorder::record_application_info(const VkApplicationInfo &info)
@@ -2846,19 +5016,36 @@ bool StateRecorder::record_physical_device_features(const VkPhysicalDeviceFeatur
 bool StateRecorder::record_sampler(VkSampler sampler, const VkSamplerCreateInfo &create_info, Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkSamplerCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
-		VkSamplerCreateInfo *new_info = nullptr;
-		if (!impl->copy_sampler(&create_info, impl->temp_allocator, &new_info))
-			return false;
+		Hash hash = custom_hash;
+		if (impl->recorded_samplers && hash == 0)
+			hash = Hashing::compute_hash_sampler(create_info);
+
+		if (!impl->enqueue_deduplicated(impl->recorded_samplers.get(), sampler, hash,
+		                                VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO))
+		{
+			// Dropping an object is not an error, but it must not be marked as recorded.
+			if (!impl->check_record_queue_limit())
+				return true;
+
+			auto *arena = impl->get_record_arena();
+			VkSamplerCreateInfo *new_info = nullptr;
+			if (!impl->copy_sampler(&create_info, arena->allocator, &new_info))
+				return false;
+
+			impl->push_record_item(arena, api_object_cast<uint64_t>(sampler), new_info, hash);
+		}
 
-		impl->record_queue.push({api_object_cast<uint64_t>(sampler), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		// Only mark as recorded once the full copy is queued, so anything deduplicated against it is queued after it.
+		if (impl->recorded_samplers)
+			impl->recorded_samplers->insert(hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -2872,19 +5059,24 @@ bool StateRecorder::record_descriptor_set_layout(VkDescriptorSetLayout set_layou
                                                  Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkDescriptorSetLayoutCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
+		// Dropping an object is not an error.
+		if (!impl->check_record_queue_limit())
+			return true;
+
+		auto *arena = impl->get_record_arena();
 		VkDescriptorSetLayoutCreateInfo *new_info = nullptr;
-		if (!impl->copy_descriptor_set_layout(&create_info, impl->temp_allocator, &new_info))
+		if (!impl->copy_descriptor_set_layout(&create_info, arena->allocator, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(set_layout), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		impl->push_record_item(arena, api_object_cast<uint64_t>(set_layout), new_info, custom_hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -2898,19 +5090,24 @@ bool StateRecorder::record_pipeline_layout(VkPipelineLayout pipeline_layout, con
                                            Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkPipelineLayoutCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
+		// Dropping an object is not an error.
+		if (!impl->check_record_queue_limit())
+			return true;
+
+		auto *arena = impl->get_record_arena();
 		VkPipelineLayoutCreateInfo *new_info = nullptr;
-		if (!impl->copy_pipeline_layout(&create_info, impl->temp_allocator, &new_info))
+		if (!impl->copy_pipeline_layout(&create_info, arena->allocator, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(pipeline_layout), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		impl->push_record_item(arena, api_object_cast<uint64_t>(pipeline_layout), new_info, custom_hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -2925,19 +5122,24 @@ bool StateRecorder::record_graphics_pipeline(VkPipeline pipeline, const VkGraphi
                                              Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkGraphicsPipelineCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
+		// Dropping an object is not an error.
+		if (!impl->check_record_queue_limit())
+			return true;
+
+		auto *arena = impl->get_record_arena();
 		VkGraphicsPipelineCreateInfo *new_info = nullptr;
-		if (!impl->copy_graphics_pipeline(&create_info, impl->temp_allocator, base_pipelines, base_pipeline_count, &new_info))
+		if (!impl->copy_graphics_pipeline(&create_info, arena->allocator, base_pipelines, base_pipeline_count, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(pipeline), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		impl->push_record_item(arena, api_object_cast<uint64_t>(pipeline), new_info, custom_hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -2952,19 +5154,24 @@ bool StateRecorder::record_compute_pipeline(VkPipeline pipeline, const VkCompute
                                             Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkComputePipelineCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
+		// Dropping an object is not an error.
+		if (!impl->check_record_queue_limit())
+			return true;
+
+		auto *arena = impl->get_record_arena();
 		VkComputePipelineCreateInfo *new_info = nullptr;
-		if (!impl->copy_compute_pipeline(&create_info, impl->temp_allocator, base_pipelines, base_pipeline_count, &new_info))
+		if (!impl->copy_compute_pipeline(&create_info, arena->allocator, base_pipelines, base_pipeline_count, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(pipeline), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		impl->push_record_item(arena, api_object_cast<uint64_t>(pipeline), new_info, custom_hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -2978,19 +5185,35 @@ bool StateRecorder::record_render_pass(VkRenderPass render_pass, const VkRenderP
                                        Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkRenderPassCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
-		VkRenderPassCreateInfo *new_info = nullptr;
-		if (!impl->copy_render_pass(&create_info, impl->temp_allocator, &new_info))
-			return false;
+		Hash hash = custom_hash;
+		if (impl->recorded_render_passes && hash == 0)
+			hash = Hashing::compute_hash_render_pass(create_info);
+
+		if (!impl->enqueue_deduplicated(impl->recorded_render_passes.get(), render_pass, hash,
+		                                VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO))
+		{
+			// Dropping an object is not an error, but it must not be marked as recorded.
+			if (!impl->check_record_queue_limit())
+				return true;
+
+			auto *arena = impl->get_record_arena();
+			VkRenderPassCreateInfo *new_info = nullptr;
+			if (!impl->copy_render_pass(&create_info, arena->allocator, &new_info))
+				return false;
+
+			impl->push_record_item(arena, api_object_cast<uint64_t>(render_pass), new_info, hash);
+		}
 
-		impl->record_queue.push({api_object_cast<uint64_t>(render_pass), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		if (impl->recorded_render_passes)
+			impl->recorded_render_passes->insert(hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -3004,19 +5227,35 @@ bool StateRecorder::record_shader_module(VkShaderModule module, const VkShaderMo
                                          Hash custom_hash)
 {
 	{
+		RecordStatisticsScope statistics(impl->counters);
+
 		if (create_info.pNext)
 		{
 			log_error_pnext_chain("pNext in VkShaderModuleCreateInfo not supported.", create_info.pNext);
 			return false;
 		}
-		std::lock_guard<std::mutex> lock(impl->record_lock);
 
-		VkShaderModuleCreateInfo *new_info = nullptr;
-		if (!impl->copy_shader_module(&create_info, impl->temp_allocator, &new_info))
-			return false;
+		Hash hash = custom_hash;
+		if (impl->recorded_shader_modules && hash == 0)
+			hash = Hashing::compute_hash_shader_module(create_info, impl->hash_format_version);
+
+		if (!impl->enqueue_deduplicated(impl->recorded_shader_modules.get(), module, hash,
+		                                VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO))
+		{
+			// Dropping an object is not an error, but it must not be marked as recorded.
+			if (!impl->check_record_queue_limit())
+				return true;
+
+			auto *arena = impl->get_record_arena();
+			VkShaderModuleCreateInfo *new_info = nullptr;
+			if (!impl->copy_shader_module(&create_info, arena->allocator, &new_info))
+				return false;
+
+			impl->push_record_item(arena, api_object_cast<uint64_t>(module), new_info, hash);
+		}
 
-		impl->record_queue.push({api_object_cast<uint64_t>(module), new_info, custom_hash});
-		impl->record_cv.notify_one();
+		if (impl->recorded_shader_modules)
+			impl->recorded_shader_modules->insert(hash);
 	}
 
 	// Thread is not running, drain the queue ourselves.
@@ -3026,115 +5265,218 @@ bool StateRecorder::record_shader_module(VkShaderModule module, const VkShaderMo
 	return true;
 }
 
+void StateRecorder::Impl::write_database_entry(ResourceTag tag, Hash hash, const vector<uint8_t> &blob,
+                                               PayloadWriteFlags flags) const
+{
+	database_iface->write_entry(tag, hash, blob.data(), blob.size(), flags);
+	counters.wrote_entry(blob.size());
+}
+
+void StateRecorder::get_statistics(StateRecorderStatistics *stats) const
+{
+	auto &counters = impl->counters;
+	stats->record_count = counters.record_count.load(std::memory_order_relaxed);
+	stats->record_time_ns = counters.record_time_ns.load(std::memory_order_relaxed);
+	stats->queue_depth = counters.queue_depth.load(std::memory_order_relaxed);
+	stats->max_queue_depth = counters.max_queue_depth.load(std::memory_order_relaxed);
+	stats->entries_written = counters.entries_written.load(std::memory_order_relaxed);
+	stats->bytes_written = counters.bytes_written.load(std::memory_order_relaxed);
+	stats->thread_busy_time_ns = counters.thread_busy_time_ns.load(std::memory_order_relaxed);
+	stats->queued_bytes = impl->arena_pool->live_bytes.load(std::memory_order_relaxed);
+	stats->max_queued_bytes = impl->arena_pool->max_live_bytes.load(std::memory_order_relaxed);
+	stats->blocked_count = counters.blocked_count.load(std::memory_order_relaxed);
+	stats->blocked_time_ns = counters.blocked_time_ns.load(std::memory_order_relaxed);
+	stats->dropped_count = counters.dropped_count.load(std::memory_order_relaxed);
+}
+
+void StateRecorder::Impl::enqueue_forget(StateRecorder *recorder, uint64_t handle, VkStructureType type)
+{
+	if (!handle)
+		return;
+
+	// Handles are only ever looked up on the recording thread, so forgetting has to go through the queue as well.
+	// The application may recreate an object with the same handle as soon as it has been destroyed,
+	// and the queue keeps this ahead of the object which replaces it.
+	counters.queued_item();
+	record_queue.push({ handle, nullptr, 0, type, nullptr, true });
+
+	// Thread is not running, drain the queue ourselves.
+	if (!worker_thread.joinable())
+		record_task(recorder, false);
+}
+
+void StateRecorder::Impl::forget_handle(VkStructureType type, uint64_t handle)
+{
+	switch (type)
+	{
+	case VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO:
+		descriptor_set_layout_to_hash.erase(api_object_cast<VkDescriptorSetLayout>(handle));
+		break;
+	case VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO:
+		pipeline_layout_to_hash.erase(api_object_cast<VkPipelineLayout>(handle));
+		break;
+	case VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO:
+		shader_module_to_hash.erase(api_object_cast<VkShaderModule>(handle));
+		break;
+	case VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO:
+	case VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO:
+		// vkDestroyPipeline does not say which kind of pipeline it was.
+		graphics_pipeline_to_hash.erase(api_object_cast<VkPipeline>(handle));
+		compute_pipeline_to_hash.erase(api_object_cast<VkPipeline>(handle));
+		break;
+	case VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO:
+		render_pass_to_hash.erase(api_object_cast<VkRenderPass>(handle));
+		break;
+	case VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO:
+		sampler_to_hash.erase(api_object_cast<VkSampler>(handle));
+		break;
+	default:
+		break;
+	}
+}
+
+void StateRecorder::forget_descriptor_set_layout(VkDescriptorSetLayout set_layout)
+{
+	impl->enqueue_forget(this, api_object_cast<uint64_t>(set_layout), VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO);
+}
+
+void StateRecorder::forget_pipeline_layout(VkPipelineLayout pipeline_layout)
+{
+	impl->enqueue_forget(this, api_object_cast<uint64_t>(pipeline_layout), VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO);
+}
+
+void StateRecorder::forget_shader_module(VkShaderModule module)
+{
+	impl->enqueue_forget(this, api_object_cast<uint64_t>(module), VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO);
+}
+
+void StateRecorder::forget_pipeline(VkPipeline pipeline)
+{
+	impl->enqueue_forget(this, api_object_cast<uint64_t>(pipeline), VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO);
+}
+
+void StateRecorder::forget_render_pass(VkRenderPass render_pass)
+{
+	impl->enqueue_forget(this, api_object_cast<uint64_t>(render_pass), VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO);
+}
+
+void StateRecorder::forget_sampler(VkSampler sampler)
+{
+	impl->enqueue_forget(this, api_object_cast<uint64_t>(sampler), VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO);
+}
+
 void StateRecorder::Impl::record_end()
 {
 	// Signal end of recording with empty work item
-	std::lock_guard<std::mutex> lock(record_lock);
 	record_queue.push({ 0, nullptr, 0 });
-	record_cv.notify_one();
 }
 
 bool StateRecorder::get_hash_for_compute_pipeline_handle(VkPipeline pipeline, Hash *hash) const
 {
-	auto itr = impl->compute_pipeline_to_hash.find(pipeline);
-	if (itr == end(impl->compute_pipeline_to_hash))
+	auto *itr = impl->compute_pipeline_to_hash.find(pipeline);
+	if (!itr)
 	{
 		log_failed_hash("Compute pipeline", pipeline);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
 
 bool StateRecorder::get_hash_for_graphics_pipeline_handle(VkPipeline pipeline, Hash *hash) const
 {
-	auto itr = impl->graphics_pipeline_to_hash.find(pipeline);
-	if (itr == end(impl->graphics_pipeline_to_hash))
+	auto *itr = impl->graphics_pipeline_to_hash.find(pipeline);
+	if (!itr)
 	{
 		log_failed_hash("Graphics pipeline", pipeline);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
 
+unsigned StateRecorder::get_hash_format_version() const
+{
+	return impl->hash_format_version;
+}
+
 bool StateRecorder::get_hash_for_sampler(VkSampler sampler, Hash *hash) const
 {
-	auto itr = impl->sampler_to_hash.find(sampler);
-	if (itr == end(impl->sampler_to_hash))
+	auto *itr = impl->sampler_to_hash.find(sampler);
+	if (!itr)
 	{
 		log_failed_hash("Sampler", sampler);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
 
 bool StateRecorder::get_hash_for_shader_module(VkShaderModule module, Hash *hash) const
 {
-	auto itr = impl->shader_module_to_hash.find(module);
-	if (itr == end(impl->shader_module_to_hash))
+	auto *itr = impl->shader_module_to_hash.find(module);
+	if (!itr)
 	{
 		log_failed_hash("Shader module", module);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
 
 bool StateRecorder::get_hash_for_pipeline_layout(VkPipelineLayout layout, Hash *hash) const
 {
-	auto itr = impl->pipeline_layout_to_hash.find(layout);
-	if (itr == end(impl->pipeline_layout_to_hash))
+	auto *itr = impl->pipeline_layout_to_hash.find(layout);
+	if (!itr)
 	{
 		log_failed_hash("Pipeline layout", layout);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
 
 bool StateRecorder::get_hash_for_descriptor_set_layout(VkDescriptorSetLayout layout, Hash *hash) const
 {
-	auto itr = impl->descriptor_set_layout_to_hash.find(layout);
-	if (itr == end(impl->descriptor_set_layout_to_hash))
+	auto *itr = impl->descriptor_set_layout_to_hash.find(layout);
+	if (!itr)
 	{
 		log_failed_hash("Descriptor set layout", layout);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
 
 bool StateRecorder::get_hash_for_render_pass(VkRenderPass render_pass, Hash *hash) const
 {
-	auto itr = impl->render_pass_to_hash.find(render_pass);
-	if (itr == end(impl->render_pass_to_hash))
+	auto *itr = impl->render_pass_to_hash.find(render_pass);
+	if (!itr)
 	{
 		log_failed_hash("Render pass", render_pass);
 		return false;
 	}
 	else
 	{
-		*hash = itr->second;
+		*hash = *itr;
 		return true;
 	}
 }
@@ -3486,15 +5828,15 @@ bool StateRecorder::Impl::copy_render_pass(const VkRenderPassCreateInfo *create_
 
 bool StateRecorder::Impl::remap_sampler_handle(VkSampler sampler, VkSampler *out_sampler) const
 {
-	auto itr = sampler_to_hash.find(sampler);
-	if (itr == end(sampler_to_hash))
+	auto *itr = sampler_to_hash.find(sampler);
+	if (!itr)
 	{
 		LOGE("Cannot find sampler in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_sampler = api_object_cast<VkSampler>(uint64_t(itr->second));
+		*out_sampler = api_object_cast<VkSampler>(uint64_t(*itr));
 		return true;
 	}
 }
@@ -3502,90 +5844,90 @@ bool StateRecorder::Impl::remap_sampler_handle(VkSampler sampler, VkSampler *out
 bool StateRecorder::Impl::remap_descriptor_set_layout_handle(VkDescriptorSetLayout layout,
                                                              VkDescriptorSetLayout *out_layout) const
 {
-	auto itr = descriptor_set_layout_to_hash.find(layout);
-	if (itr == end(descriptor_set_layout_to_hash))
+	auto *itr = descriptor_set_layout_to_hash.find(layout);
+	if (!itr)
 	{
 		LOGE("Cannot find descriptor set layout in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_layout = api_object_cast<VkDescriptorSetLayout>(uint64_t(itr->second));
+		*out_layout = api_object_cast<VkDescriptorSetLayout>(uint64_t(*itr));
 		return true;
 	}
 }
 
 bool StateRecorder::Impl::remap_pipeline_layout_handle(VkPipelineLayout layout, VkPipelineLayout *out_layout) const
 {
-	auto itr = pipeline_layout_to_hash.find(layout);
-	if (itr == end(pipeline_layout_to_hash))
+	auto *itr = pipeline_layout_to_hash.find(layout);
+	if (!itr)
 	{
 		LOGE("Cannot find pipeline layout in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_layout = api_object_cast<VkPipelineLayout>(uint64_t(itr->second));
+		*out_layout = api_object_cast<VkPipelineLayout>(uint64_t(*itr));
 		return true;
 	}
 }
 
 bool StateRecorder::Impl::remap_shader_module_handle(VkShaderModule module, VkShaderModule *out_module) const
 {
-	auto itr = shader_module_to_hash.find(module);
-	if (itr == end(shader_module_to_hash))
+	auto *itr = shader_module_to_hash.find(module);
+	if (!itr)
 	{
 		LOGE("Cannot find shader module in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_module = api_object_cast<VkShaderModule>(uint64_t(itr->second));
+		*out_module = api_object_cast<VkShaderModule>(uint64_t(*itr));
 		return true;
 	}
 }
 
 bool StateRecorder::Impl::remap_render_pass_handle(VkRenderPass render_pass, VkRenderPass *out_render_pass) const
 {
-	auto itr = render_pass_to_hash.find(render_pass);
-	if (itr == end(render_pass_to_hash))
+	auto *itr = render_pass_to_hash.find(render_pass);
+	if (!itr)
 	{
 		LOGE("Cannot find render pass in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_render_pass = api_object_cast<VkRenderPass>(uint64_t(itr->second));
+		*out_render_pass = api_object_cast<VkRenderPass>(uint64_t(*itr));
 		return true;
 	}
 }
 
 bool StateRecorder::Impl::remap_graphics_pipeline_handle(VkPipeline pipeline, VkPipeline *out_pipeline) const
 {
-	auto itr = graphics_pipeline_to_hash.find(pipeline);
-	if (itr == end(graphics_pipeline_to_hash))
+	auto *itr = graphics_pipeline_to_hash.find(pipeline);
+	if (!itr)
 	{
 		LOGE("Cannot find graphics pipeline in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_pipeline = api_object_cast<VkPipeline>(uint64_t(itr->second));
+		*out_pipeline = api_object_cast<VkPipeline>(uint64_t(*itr));
 		return true;
 	}
 }
 
 bool StateRecorder::Impl::remap_compute_pipeline_handle(VkPipeline pipeline, VkPipeline *out_pipeline) const
 {
-	auto itr = compute_pipeline_to_hash.find(pipeline);
-	if (itr == end(compute_pipeline_to_hash))
+	auto *itr = compute_pipeline_to_hash.find(pipeline);
+	if (!itr)
 	{
 		LOGE("Cannot find compute pipeline in hashmap.\n");
 		return false;
 	}
 	else
 	{
-		*out_pipeline = api_object_cast<VkPipeline>(uint64_t(itr->second));
+		*out_pipeline = api_object_cast<VkPipeline>(uint64_t(*itr));
 		return true;
 	}
 }
@@ -3672,55 +6014,147 @@ bool StateRecorder::Impl::remap_render_pass_ci(VkRenderPassCreateInfo *)
 	return true;
 }
 
+// Takes everything off the record queue, so the application never waits on a full queue,
+// and hands out the held items which are due. Returns 0 if nothing was due for a second while need_flush is set.
+size_t StateRecorder::Impl::pop_deferred_batch(WorkItem *batch, bool need_flush)
+{
+	auto flush_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	WorkItem items[RecordBatchSize];
+
+	for (;;)
+	{
+		auto now = std::chrono::steady_clock::now();
+		size_t count;
+		while (!deferred_end && (count = record_queue.pop_batch(items, RecordBatchSize)) != 0)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				deferred_items.push_back({ items[i], now });
+				if (!items[i].create_info && !items[i].deduplicated_type)
+					deferred_end = true;
+			}
+			last_record_time = now;
+		}
+
+		// On shutdown, and once the held copies exceed the record queue limit, everything goes.
+		bool release_all = deferred_end ||
+		                   (defer_idle_ms && now - last_record_time >= std::chrono::milliseconds(defer_idle_ms)) ||
+		                   (record_queue_limit && arena_pool->live_bytes.load(std::memory_order_relaxed) > record_queue_limit);
+
+		size_t released = 0;
+		while (released < RecordBatchSize && !deferred_items.empty() &&
+		       (release_all ||
+		        (defer_delay_ms && now - deferred_items.front().time >= std::chrono::milliseconds(defer_delay_ms))))
+		{
+			batch[released++] = deferred_items.front().item;
+			deferred_items.pop_front();
+		}
+
+		if (released)
+			return released;
+
+		// Sleep until something is recorded, until one of the triggers releases what is held,
+		// or until a producer over the record queue limit wakes us up.
+		auto wake_time = std::chrono::steady_clock::time_point::max();
+		if (!deferred_items.empty())
+		{
+			if (defer_idle_ms)
+				wake_time = std::min(wake_time, last_record_time + std::chrono::milliseconds(defer_idle_ms));
+			if (defer_delay_ms)
+				wake_time = std::min(wake_time, deferred_items.front().time + std::chrono::milliseconds(defer_delay_ms));
+		}
+		if (need_flush)
+			wake_time = std::min(wake_time, flush_deadline);
+
+		if (wake_time == std::chrono::steady_clock::time_point::max())
+			record_queue.wait();
+		else if (!record_queue.wait_for(wake_time - now) && need_flush && std::chrono::steady_clock::now() >= flush_deadline)
+			return 0;
+	}
+}
+
 void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 {
 	PayloadWriteFlags payload_flags = 0;
 	if (compression)
 		payload_flags |= PAYLOAD_WRITE_COMPRESS_BIT;
+	if (fast_compression)
+		payload_flags |= PAYLOAD_WRITE_COMPRESS_LZ4_BIT;
 	if (checksum)
 		payload_flags |= PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
 
-	bool write_database_entries = true;
-
-	// Start by preparing in the thread since we need to parse an archive potentially, and that might block a little bit.
-	if (database_iface)
-	{
-		assert(looping);
-		if (!database_iface->prepare())
-		{
-			LOGE("Failed to prepare database, will not dump data to database.\n");
-			database_iface = nullptr;
-		}
+	if (looping)
+		FOSSILIZE_PROFILE_THREAD_NAME("Fossilize recorder");
 
-		// Check here in the worker thread if we should write database entries for this application info.
-		if (application_info_filter)
-			write_database_entries = application_info_filter->test_application_info(application_info);
-	}
+	bool write_database_entries = true;
+	BinaryStateSink state_sink = { database_iface, payload_flags, {}, &counters };
 
 	// Keep a single, pre-allocated buffer.
 	vector<uint8_t> blob;
 	blob.reserve(64 * 1024);
 
-	if (database_iface && write_database_entries)
+	bool deferred = looping && (defer_delay_ms || defer_idle_ms);
+	if (deferred)
 	{
-		assert(looping);
-		Hasher h;
-		Hashing::hash_application_feature_info(h, application_feature_hash);
-		if (serialize_application_info(blob))
-			database_iface->write_entry(RESOURCE_APPLICATION_INFO, h.get(), blob.data(), blob.size(), payload_flags);
-		else
-			LOGE("Failed to serialize application info.\n");
+#ifdef _WIN32
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+#elif defined(__linux__)
+		// The nice value is per thread on Linux. Failing to lower it is harmless.
+		(void)setpriority(PRIO_PROCESS, 0, DeferredThreadNice);
+#endif
 	}
 
+	// Start by preparing in the thread since we need to parse an archive potentially, and that might block a little bit.
+	// Deferred recording does not touch the database until the first object is released.
+	bool prepared_database = false;
+	const auto prepare_database = [&]() {
+		prepared_database = true;
+		if (database_iface)
+		{
+			assert(looping);
+			if (!database_iface->prepare())
+			{
+				LOGE("Failed to prepare database, will not dump data to database.\n");
+				database_iface = nullptr;
+			}
+
+			// Check here in the worker thread if we should write database entries for this application info.
+			if (application_info_filter)
+				write_database_entries = application_info_filter->test_application_info(application_info);
+		}
+
+		if (database_iface && write_database_entries)
+		{
+			assert(looping);
+			Hasher h;
+			Hashing::hash_application_feature_info(h, application_feature_hash);
+			if (serialize_application_info(blob))
+				write_database_entry(RESOURCE_APPLICATION_INFO, h.get(), blob, payload_flags);
+			else
+				LOGE("Failed to serialize application info.\n");
+		}
+	};
+
+	if (!deferred)
+		prepare_database();
+
 	bool need_flush = false;
 
+	// Drain the queue in batches, so a burst of pipelines from many threads is handled without going back to sleep.
+	WorkItem batch[RecordBatchSize];
+	size_t batch_count = 0;
+	size_t batch_index = 0;
+	auto batch_start = std::chrono::steady_clock::now();
+
 	for (;;)
 	{
-		WorkItem record_item = {};
+		if (batch_index == batch_count)
 		{
-			std::unique_lock<std::mutex> lock(record_lock);
-			if (record_queue.empty())
-				temp_allocator.reset();
+			if (batch_count)
+				counters.thread_busy_time_ns.fetch_add(RecorderCounters::elapsed_ns(batch_start), std::memory_order_relaxed);
+
+			batch_index = 0;
+			batch_count = 0;
 
 			// Having this check here allows us to call record_task from a single threaded variant.
 			// This is mostly used for testing purposes.
@@ -3731,40 +6165,59 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 			// necessary. Do not flush after every single write, as that might bog down the file system.
 			// Once no new writes have occured for a second, we flush, and go to deep sleep.
 			bool has_data;
-			if (need_flush)
+			if (deferred)
 			{
-				has_data = record_cv.wait_for(lock, std::chrono::seconds(1),
-				                              [&]()
-				                              {
-					                              return !record_queue.empty();
-				                              });
+				batch_count = pop_deferred_batch(batch, need_flush);
+				has_data = batch_count != 0;
+			}
+			else if (need_flush)
+			{
+				has_data = record_queue.wait_for(std::chrono::seconds(1));
 			}
 			else
 			{
-				record_cv.wait(lock, [&]()
-				{
-					return !record_queue.empty();
-				});
+				record_queue.wait();
 				has_data = true;
 			}
 
 			if (database_iface && !has_data && need_flush)
 			{
+				flush_usage_metadata(payload_flags, blob);
 				database_iface->flush();
 				need_flush = false;
 				continue;
 			}
-			else
-			{
-				record_item = record_queue.front();
-				record_queue.pop();
-			}
+
+			if (!deferred)
+				batch_count = record_queue.pop_batch(batch, RecordBatchSize);
+			if (!batch_count)
+				continue;
+			batch_start = std::chrono::steady_clock::now();
+
+			if (!prepared_database)
+				prepare_database();
 		}
 
-		if (!record_item.create_info)
+		WorkItem record_item = batch[batch_index++];
+
+		if (!record_item.create_info && !record_item.deduplicated_type)
 			break;
 
-		switch (reinterpret_cast<VkBaseInStructure *>(record_item.create_info)->sType)
+		counters.queue_depth.fetch_sub(1, std::memory_order_relaxed);
+
+		// Anything recorded before the object was destroyed has been processed by now, so nothing needs the mapping anymore.
+		if (record_item.forget)
+		{
+			forget_handle(record_item.deduplicated_type, record_item.handle);
+			continue;
+		}
+
+		auto type = record_item.create_info ?
+		            reinterpret_cast<VkBaseInStructure *>(record_item.create_info)->sType :
+		            record_item.deduplicated_type;
+
+		FOSSILIZE_PROFILE_ZONE_HASH("record", record_item.custom_hash);
+		switch (type)
 		{
 		case VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO:
 		{
@@ -3774,19 +6227,23 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 				hash = Hashing::compute_hash_sampler(*create_info);
 			sampler_to_hash[api_object_cast<VkSampler>(record_item.handle)] = hash;
 
+			// An earlier work item recorded the object itself.
+			if (!create_info)
+				break;
+
 			if (database_iface)
 			{
 				if (write_database_entries)
 				{
 					if (register_application_link_hash(RESOURCE_SAMPLER, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_SAMPLER, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_SAMPLER, hash))
 					{
 						if (serialize_sampler(hash, *create_info, blob))
 						{
-							database_iface->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_SAMPLER, hash, blob, payload_flags);
 							need_flush = true;
 						}
 					}
@@ -3813,19 +6270,23 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 				hash = Hashing::compute_hash_render_pass(*create_info);
 			render_pass_to_hash[api_object_cast<VkRenderPass>(record_item.handle)] = hash;
 
+			// An earlier work item recorded the object itself.
+			if (!create_info)
+				break;
+
 			if (database_iface)
 			{
 				if (write_database_entries)
 				{
 					if (register_application_link_hash(RESOURCE_RENDER_PASS, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_RENDER_PASS, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_RENDER_PASS, hash))
 					{
 						if (serialize_render_pass(hash, *create_info, blob))
 						{
-							database_iface->write_entry(RESOURCE_RENDER_PASS, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_RENDER_PASS, hash, blob, payload_flags);
 							need_flush = true;
 						}
 					}
@@ -3849,22 +6310,26 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 			auto *create_info = reinterpret_cast<VkShaderModuleCreateInfo *>(record_item.create_info);
 			auto hash = record_item.custom_hash;
 			if (hash == 0)
-				hash = Hashing::compute_hash_shader_module(*create_info);
+				hash = Hashing::compute_hash_shader_module(*create_info, hash_format_version);
 			shader_module_to_hash[api_object_cast<VkShaderModule>(record_item.handle)] = hash;
 
+			// An earlier work item recorded the object itself.
+			if (!create_info)
+				break;
+
 			if (database_iface)
 			{
 				if (write_database_entries)
 				{
 					if (register_application_link_hash(RESOURCE_SHADER_MODULE, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_SHADER_MODULE, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_SHADER_MODULE, hash))
 					{
 						if (serialize_shader_module(hash, *create_info, blob, allocator))
 						{
-							database_iface->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_SHADER_MODULE, hash, blob, payload_flags);
 							need_flush = true;
 						}
 						allocator.reset();
@@ -3906,13 +6371,13 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 				{
 					if (register_application_link_hash(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash))
 					{
 						if (serialize_descriptor_set_layout(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash, blob, payload_flags);
 							need_flush = true;
 						}
 					}
@@ -3953,13 +6418,13 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 				{
 					if (register_application_link_hash(RESOURCE_PIPELINE_LAYOUT, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_PIPELINE_LAYOUT, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_PIPELINE_LAYOUT, hash))
 					{
 						if (serialize_pipeline_layout(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(RESOURCE_PIPELINE_LAYOUT, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_PIPELINE_LAYOUT, hash, blob, payload_flags);
 							need_flush = true;
 						}
 					}
@@ -3995,17 +6460,17 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 
 			if (database_iface)
 			{
-				if (write_database_entries)
+				if (write_database_entries && test_pipeline_hash(hash))
 				{
 					if (register_application_link_hash(RESOURCE_GRAPHICS_PIPELINE, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_GRAPHICS_PIPELINE, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_GRAPHICS_PIPELINE, hash))
 					{
-						if (serialize_graphics_pipeline(hash, *create_info_copy, blob))
+						if (serialize_graphics_pipeline(hash, *create_info_copy, blob, binary_format ? &state_sink : nullptr))
 						{
-							database_iface->write_entry(RESOURCE_GRAPHICS_PIPELINE, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_GRAPHICS_PIPELINE, hash, blob, payload_flags);
 							need_flush = true;
 						}
 					}
@@ -4041,17 +6506,17 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 
 			if (database_iface)
 			{
-				if (write_database_entries)
+				if (write_database_entries && test_pipeline_hash(hash))
 				{
 					if (register_application_link_hash(RESOURCE_COMPUTE_PIPELINE, hash, blob))
 						need_flush = true;
+					record_usage(RESOURCE_COMPUTE_PIPELINE, hash, record_item);
 
 					if (!database_iface->has_entry(RESOURCE_COMPUTE_PIPELINE, hash))
 					{
 						if (serialize_compute_pipeline(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(RESOURCE_COMPUTE_PIPELINE, hash, blob.data(), blob.size(),
-							                            payload_flags);
+							write_database_entry(RESOURCE_COMPUTE_PIPELINE, hash, blob, payload_flags);
 							need_flush = true;
 						}
 					}
@@ -4071,10 +6536,26 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 		default:
 			break;
 		}
+
+		// Anything worth keeping has been copied out of the arena by now.
+		if (record_item.arena)
+			arena_pool->release(record_item.arena);
+
+		if (usage_records.size() >= UsageMetadataChunkRecords)
+		{
+			flush_usage_metadata(payload_flags, blob);
+			need_flush = true;
+		}
 	}
 
+	if (batch_count)
+		counters.thread_busy_time_ns.fetch_add(RecorderCounters::elapsed_ns(batch_start), std::memory_order_relaxed);
+
 	if (database_iface)
+	{
+		flush_usage_metadata(payload_flags, blob);
 		database_iface->flush();
+	}
 
 	// We no longer need a reference to this.
 	// This should allow us to call init_recording_thread again if we want,
@@ -4082,55 +6563,10 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 	database_iface = nullptr;
 }
 
-static char base64(uint32_t v)
-{
-	if (v == 63)
-		return '/';
-	else if (v == 62)
-		return '+';
-	else if (v >= 52)
-		return char('0' + (v - 52));
-	else if (v >= 26)
-		return char('a' + (v - 26));
-	else
-		return char('A' + v);
-}
-
-static std::string encode_base64(const void *data_, size_t size)
+static std::string encode_base64(const void *data, size_t size)
 {
-	auto *data = static_cast<const uint8_t *>(data_);
-	size_t num_chars = 4 * ((size + 2) / 3);
-	std::string ret;
-	ret.reserve(num_chars);
-
-	for (size_t i = 0; i < size; i += 3)
-	{
-		uint32_t code = data[i] << 16;
-		if (i + 1 < size)
-			code |= data[i + 1] << 8;
-		if (i + 2 < size)
-			code |= data[i + 2] << 0;
-
-		auto c0 = base64((code >> 18) & 63);
-		auto c1 = base64((code >> 12) & 63);
-		auto c2 = base64((code >>  6) & 63);
-		auto c3 = base64((code >>  0) & 63);
-
-		auto outbytes = std::min(size - i, size_t(3));
-		if (outbytes == 1)
-		{
-			c2 = '=';
-			c3 = '=';
-		}
-		else if (outbytes == 2)
-			c3 = '=';
-
-		ret.push_back(c0);
-		ret.push_back(c1);
-		ret.push_back(c2);
-		ret.push_back(c3);
-	}
-
+	std::string ret(compute_size_base64(size), '\0');
+	Fossilize::encode_base64(&ret[0], data, size);
 	return ret;
 }
 
@@ -4658,110 +7094,562 @@ static bool json_value(const VkGraphicsPipelineCreateInfo& pipe, Allocator& allo
 		p.AddMember("colorBlendState", cb, alloc);
 	}
 
-	if (pipe.pViewportState)
+	if (pipe.pViewportState)
+	{
+		Value vp(kObjectType);
+		vp.AddMember("flags", pipe.pViewportState->flags, alloc);
+		vp.AddMember("viewportCount", pipe.pViewportState->viewportCount, alloc);
+		vp.AddMember("scissorCount", pipe.pViewportState->scissorCount, alloc);
+		if (pipe.pViewportState->pViewports)
+		{
+			Value viewports(kArrayType);
+			for (uint32_t i = 0; i < pipe.pViewportState->viewportCount; i++)
+			{
+				Value viewport(kObjectType);
+				viewport.AddMember("x", pipe.pViewportState->pViewports[i].x, alloc);
+				viewport.AddMember("y", pipe.pViewportState->pViewports[i].y, alloc);
+				viewport.AddMember("width", pipe.pViewportState->pViewports[i].width, alloc);
+				viewport.AddMember("height", pipe.pViewportState->pViewports[i].height, alloc);
+				viewport.AddMember("minDepth", pipe.pViewportState->pViewports[i].minDepth, alloc);
+				viewport.AddMember("maxDepth", pipe.pViewportState->pViewports[i].maxDepth, alloc);
+				viewports.PushBack(viewport, alloc);
+			}
+			vp.AddMember("viewports", viewports, alloc);
+		}
+
+		if (pipe.pViewportState->pScissors)
+		{
+			Value scissors(kArrayType);
+			for (uint32_t i = 0; i < pipe.pViewportState->scissorCount; i++)
+			{
+				Value scissor(kObjectType);
+				scissor.AddMember("x", pipe.pViewportState->pScissors[i].offset.x, alloc);
+				scissor.AddMember("y", pipe.pViewportState->pScissors[i].offset.y, alloc);
+				scissor.AddMember("width", pipe.pViewportState->pScissors[i].extent.width, alloc);
+				scissor.AddMember("height", pipe.pViewportState->pScissors[i].extent.height, alloc);
+				scissors.PushBack(scissor, alloc);
+			}
+			vp.AddMember("scissors", scissors, alloc);
+		}
+		p.AddMember("viewportState", vp, alloc);
+	}
+
+	if (pipe.pDepthStencilState)
+	{
+		Value ds(kObjectType);
+		ds.AddMember("flags", pipe.pDepthStencilState->flags, alloc);
+		ds.AddMember("stencilTestEnable", pipe.pDepthStencilState->stencilTestEnable, alloc);
+		ds.AddMember("maxDepthBounds", pipe.pDepthStencilState->maxDepthBounds, alloc);
+		ds.AddMember("minDepthBounds", pipe.pDepthStencilState->minDepthBounds, alloc);
+		ds.AddMember("depthBoundsTestEnable", pipe.pDepthStencilState->depthBoundsTestEnable, alloc);
+		ds.AddMember("depthWriteEnable", pipe.pDepthStencilState->depthWriteEnable, alloc);
+		ds.AddMember("depthTestEnable", pipe.pDepthStencilState->depthTestEnable, alloc);
+		ds.AddMember("depthCompareOp", pipe.pDepthStencilState->depthCompareOp, alloc);
+
+		const auto serialize_stencil = [&](Value &v, const VkStencilOpState &state) {
+			v.AddMember("compareOp", state.compareOp, alloc);
+			v.AddMember("writeMask", state.writeMask, alloc);
+			v.AddMember("reference", state.reference, alloc);
+			v.AddMember("compareMask", state.compareMask, alloc);
+			v.AddMember("passOp", state.passOp, alloc);
+			v.AddMember("failOp", state.failOp, alloc);
+			v.AddMember("depthFailOp", state.depthFailOp, alloc);
+		};
+		Value front(kObjectType);
+		Value back(kObjectType);
+		serialize_stencil(front, pipe.pDepthStencilState->front);
+		serialize_stencil(back, pipe.pDepthStencilState->back);
+		ds.AddMember("front", front, alloc);
+		ds.AddMember("back", back, alloc);
+		p.AddMember("depthStencilState", ds, alloc);
+	}
+
+	Value stages(kArrayType);
+	for (uint32_t i = 0; i < pipe.stageCount; i++)
+	{
+		auto &s = pipe.pStages[i];
+		Value stage(kObjectType);
+		stage.AddMember("flags", s.flags, alloc);
+		stage.AddMember("name", StringRef(s.pName), alloc);
+		stage.AddMember("module", uint64_string(api_object_cast<uint64_t>(s.module), alloc), alloc);
+		stage.AddMember("stage", s.stage, alloc);
+		if (s.pSpecializationInfo)
+		{
+			Value spec(kObjectType);
+			spec.AddMember("dataSize", uint64_t(s.pSpecializationInfo->dataSize), alloc);
+			spec.AddMember("data",
+						   encode_base64(s.pSpecializationInfo->pData,
+										 s.pSpecializationInfo->dataSize), alloc);
+			Value map_entries(kArrayType);
+			for (uint32_t j = 0; j < s.pSpecializationInfo->mapEntryCount; j++)
+			{
+				auto &e = s.pSpecializationInfo->pMapEntries[j];
+				Value map_entry(kObjectType);
+				map_entry.AddMember("offset", e.offset, alloc);
+				map_entry.AddMember("size", uint64_t(e.size), alloc);
+				map_entry.AddMember("constantID", e.constantID, alloc);
+				map_entries.PushBack(map_entry, alloc);
+			}
+			spec.AddMember("mapEntries", map_entries, alloc);
+			stage.AddMember("specializationInfo", spec, alloc);
+		}
+		stages.PushBack(stage, alloc);
+	}
+	p.AddMember("stages", stages, alloc);
+
+	*out_value = p;
+	return true;
+}
+
+static void binary_value(BinaryWriter &w, const VkSamplerCreateInfo &sampler)
+{
+	w.u32(sampler.flags);
+	w.u32(sampler.magFilter);
+	w.u32(sampler.minFilter);
+	w.u32(sampler.mipmapMode);
+	w.u32(sampler.addressModeU);
+	w.u32(sampler.addressModeV);
+	w.u32(sampler.addressModeW);
+	w.f32(sampler.mipLodBias);
+	w.u32(sampler.anisotropyEnable);
+	w.f32(sampler.maxAnisotropy);
+	w.u32(sampler.compareEnable);
+	w.u32(sampler.compareOp);
+	w.f32(sampler.minLod);
+	w.f32(sampler.maxLod);
+	w.u32(sampler.borderColor);
+	w.u32(sampler.unnormalizedCoordinates);
+}
+
+static void binary_value(BinaryWriter &w, const VkDescriptorSetLayoutCreateInfo &layout)
+{
+	w.u32(layout.flags);
+	w.u32(layout.bindingCount);
+	for (uint32_t i = 0; i < layout.bindingCount; i++)
+	{
+		auto &b = layout.pBindings[i];
+		w.u32(b.binding);
+		w.u32(b.descriptorType);
+		w.u32(b.descriptorCount);
+		w.u32(b.stageFlags);
+		if (w.present(b.pImmutableSamplers))
+			for (uint32_t j = 0; j < b.descriptorCount; j++)
+				w.handle(b.pImmutableSamplers[j]);
+	}
+}
+
+static void binary_value(BinaryWriter &w, const VkPipelineLayoutCreateInfo &layout)
+{
+	w.u32(layout.flags);
+	w.u32(layout.setLayoutCount);
+	for (uint32_t i = 0; i < layout.setLayoutCount; i++)
+		w.handle(layout.pSetLayouts[i]);
+
+	w.u32(layout.pushConstantRangeCount);
+	for (uint32_t i = 0; i < layout.pushConstantRangeCount; i++)
+	{
+		w.u32(layout.pPushConstantRanges[i].stageFlags);
+		w.u32(layout.pPushConstantRanges[i].offset);
+		w.u32(layout.pPushConstantRanges[i].size);
+	}
+}
+
+static void binary_value(BinaryWriter &w, const VkShaderModuleCreateInfo &module)
+{
+	w.u32(module.flags);
+	w.u64(module.codeSize);
+
+	// SPIR-V is packed the same way as the binary payload of JSON blobs.
+	size_t size = compute_size_stream_vbyte(module.pCode, module.codeSize / 4);
+	w.u64(size);
+	size_t offset = w.blob.size();
+	w.blob.resize(offset + size);
+	encode_stream_vbyte(w.blob.data() + offset, module.pCode, module.codeSize / 4);
+}
+
+static void binary_attachment_references(BinaryWriter &w, const VkAttachmentReference *refs, uint32_t count)
+{
+	if (w.present(refs))
+	{
+		w.u32(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			w.u32(refs[i].attachment);
+			w.u32(refs[i].layout);
+		}
+	}
+}
+
+static void binary_value(BinaryWriter &w, const VkRenderPassCreateInfo &pass)
+{
+	w.u32(pass.flags);
+
+	if (w.present(pass.pAttachments))
+	{
+		w.u32(pass.attachmentCount);
+		for (uint32_t i = 0; i < pass.attachmentCount; i++)
+		{
+			auto &a = pass.pAttachments[i];
+			w.u32(a.flags);
+			w.u32(a.format);
+			w.u32(a.samples);
+			w.u32(a.loadOp);
+			w.u32(a.storeOp);
+			w.u32(a.stencilLoadOp);
+			w.u32(a.stencilStoreOp);
+			w.u32(a.initialLayout);
+			w.u32(a.finalLayout);
+		}
+	}
+
+	w.u32(pass.subpassCount);
+	for (uint32_t i = 0; i < pass.subpassCount; i++)
+	{
+		auto &sub = pass.pSubpasses[i];
+		w.u32(sub.flags);
+		w.u32(sub.pipelineBindPoint);
+		binary_attachment_references(w, sub.pInputAttachments, sub.inputAttachmentCount);
+		binary_attachment_references(w, sub.pColorAttachments, sub.colorAttachmentCount);
+		binary_attachment_references(w, sub.pResolveAttachments, sub.colorAttachmentCount);
+		binary_attachment_references(w, sub.pDepthStencilAttachment, sub.pDepthStencilAttachment ? 1 : 0);
+
+		if (w.present(sub.pPreserveAttachments))
+		{
+			w.u32(sub.preserveAttachmentCount);
+			for (uint32_t j = 0; j < sub.preserveAttachmentCount; j++)
+				w.u32(sub.pPreserveAttachments[j]);
+		}
+	}
+
+	if (w.present(pass.pDependencies))
+	{
+		w.u32(pass.dependencyCount);
+		for (uint32_t i = 0; i < pass.dependencyCount; i++)
+		{
+			auto &d = pass.pDependencies[i];
+			w.u32(d.srcSubpass);
+			w.u32(d.dstSubpass);
+			w.u32(d.srcStageMask);
+			w.u32(d.dstStageMask);
+			w.u32(d.srcAccessMask);
+			w.u32(d.dstAccessMask);
+			w.u32(d.dependencyFlags);
+		}
+	}
+}
+
+static void binary_value(BinaryWriter &w, const VkPipelineShaderStageCreateInfo &stage)
+{
+	w.u32(stage.flags);
+	w.u32(stage.stage);
+	w.handle(stage.module);
+	w.string(stage.pName);
+
+	if (w.present(stage.pSpecializationInfo))
+	{
+		auto &spec = *stage.pSpecializationInfo;
+		w.u32(spec.mapEntryCount);
+		for (uint32_t i = 0; i < spec.mapEntryCount; i++)
+		{
+			w.u32(spec.pMapEntries[i].constantID);
+			w.u32(spec.pMapEntries[i].offset);
+			w.u64(spec.pMapEntries[i].size);
+		}
+		w.u64(spec.dataSize);
+		w.bytes(spec.pData, spec.dataSize);
+	}
+}
+
+static void binary_value(BinaryWriter &w, const VkComputePipelineCreateInfo &pipe)
+{
+	w.u32(pipe.flags);
+	binary_value(w, pipe.stage);
+	w.handle(pipe.layout);
+	w.handle(pipe.basePipelineHandle);
+	w.s32(pipe.basePipelineIndex);
+}
+
+static bool binary_pnext_chain(BinaryWriter &w, const void *pNext)
+{
+	uint32_t count = 0;
+	for (auto *pin = static_cast<const VkBaseInStructure *>(pNext); pin; pin = pin->pNext)
+		count++;
+	w.u32(count);
+
+	while (pNext != nullptr)
+	{
+		auto *pin = static_cast<const VkBaseInStructure *>(pNext);
+		w.u32(pin->sType);
+
+		switch (pin->sType)
+		{
+		case VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_DOMAIN_ORIGIN_STATE_CREATE_INFO:
+		{
+			auto *info = static_cast<const VkPipelineTessellationDomainOriginStateCreateInfo *>(pNext);
+			w.u32(info->domainOrigin);
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_DIVISOR_STATE_CREATE_INFO_EXT:
+		{
+			auto *info = static_cast<const VkPipelineVertexInputDivisorStateCreateInfoEXT *>(pNext);
+			w.u32(info->vertexBindingDivisorCount);
+			if (w.present(info->pVertexBindingDivisors))
+			{
+				for (uint32_t i = 0; i < info->vertexBindingDivisorCount; i++)
+				{
+					w.u32(info->pVertexBindingDivisors[i].binding);
+					w.u32(info->pVertexBindingDivisors[i].divisor);
+				}
+			}
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_DEPTH_CLIP_STATE_CREATE_INFO_EXT:
+		{
+			auto *info = static_cast<const VkPipelineRasterizationDepthClipStateCreateInfoEXT *>(pNext);
+			w.u32(info->flags);
+			w.u32(info->depthClipEnable);
+			break;
+		}
+
+		case VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_STREAM_CREATE_INFO_EXT:
+		{
+			auto *info = static_cast<const VkPipelineRasterizationStateStreamCreateInfoEXT *>(pNext);
+			w.u32(info->flags);
+			w.u32(info->rasterizationStream);
+			break;
+		}
+
+		default:
+			log_error_pnext_chain("Unsupported pNext found, cannot serialize sType.", pNext);
+			return false;
+		}
+
+		pNext = pin->pNext;
+	}
+
+	return true;
+}
+
+static bool binary_value(BinaryWriter &w, const VkPipelineVertexInputStateCreateInfo &vi)
+{
+	w.u32(vi.flags);
+	w.u32(vi.vertexBindingDescriptionCount);
+	for (uint32_t i = 0; i < vi.vertexBindingDescriptionCount; i++)
+	{
+		w.u32(vi.pVertexBindingDescriptions[i].binding);
+		w.u32(vi.pVertexBindingDescriptions[i].stride);
+		w.u32(vi.pVertexBindingDescriptions[i].inputRate);
+	}
+	w.u32(vi.vertexAttributeDescriptionCount);
+	for (uint32_t i = 0; i < vi.vertexAttributeDescriptionCount; i++)
+	{
+		w.u32(vi.pVertexAttributeDescriptions[i].location);
+		w.u32(vi.pVertexAttributeDescriptions[i].binding);
+		w.u32(vi.pVertexAttributeDescriptions[i].format);
+		w.u32(vi.pVertexAttributeDescriptions[i].offset);
+	}
+	return binary_pnext_chain(w, vi.pNext);
+}
+
+static bool binary_value(BinaryWriter &w, const VkPipelineInputAssemblyStateCreateInfo &ia)
+{
+	w.u32(ia.flags);
+	w.u32(ia.topology);
+	w.u32(ia.primitiveRestartEnable);
+	return true;
+}
+
+static bool binary_value(BinaryWriter &w, const VkPipelineTessellationStateCreateInfo &tess)
+{
+	w.u32(tess.flags);
+	w.u32(tess.patchControlPoints);
+	return binary_pnext_chain(w, tess.pNext);
+}
+
+static bool binary_value(BinaryWriter &w, const VkPipelineViewportStateCreateInfo &vp)
+{
+	w.u32(vp.flags);
+	w.u32(vp.viewportCount);
+	if (w.present(vp.pViewports))
 	{
-		Value vp(kObjectType);
-		vp.AddMember("flags", pipe.pViewportState->flags, alloc);
-		vp.AddMember("viewportCount", pipe.pViewportState->viewportCount, alloc);
-		vp.AddMember("scissorCount", pipe.pViewportState->scissorCount, alloc);
-		if (pipe.pViewportState->pViewports)
+		for (uint32_t i = 0; i < vp.viewportCount; i++)
 		{
-			Value viewports(kArrayType);
-			for (uint32_t i = 0; i < pipe.pViewportState->viewportCount; i++)
-			{
-				Value viewport(kObjectType);
-				viewport.AddMember("x", pipe.pViewportState->pViewports[i].x, alloc);
-				viewport.AddMember("y", pipe.pViewportState->pViewports[i].y, alloc);
-				viewport.AddMember("width", pipe.pViewportState->pViewports[i].width, alloc);
-				viewport.AddMember("height", pipe.pViewportState->pViewports[i].height, alloc);
-				viewport.AddMember("minDepth", pipe.pViewportState->pViewports[i].minDepth, alloc);
-				viewport.AddMember("maxDepth", pipe.pViewportState->pViewports[i].maxDepth, alloc);
-				viewports.PushBack(viewport, alloc);
-			}
-			vp.AddMember("viewports", viewports, alloc);
+			w.f32(vp.pViewports[i].x);
+			w.f32(vp.pViewports[i].y);
+			w.f32(vp.pViewports[i].width);
+			w.f32(vp.pViewports[i].height);
+			w.f32(vp.pViewports[i].minDepth);
+			w.f32(vp.pViewports[i].maxDepth);
 		}
-
-		if (pipe.pViewportState->pScissors)
+	}
+	w.u32(vp.scissorCount);
+	if (w.present(vp.pScissors))
+	{
+		for (uint32_t i = 0; i < vp.scissorCount; i++)
 		{
-			Value scissors(kArrayType);
-			for (uint32_t i = 0; i < pipe.pViewportState->scissorCount; i++)
-			{
-				Value scissor(kObjectType);
-				scissor.AddMember("x", pipe.pViewportState->pScissors[i].offset.x, alloc);
-				scissor.AddMember("y", pipe.pViewportState->pScissors[i].offset.y, alloc);
-				scissor.AddMember("width", pipe.pViewportState->pScissors[i].extent.width, alloc);
-				scissor.AddMember("height", pipe.pViewportState->pScissors[i].extent.height, alloc);
-				scissors.PushBack(scissor, alloc);
-			}
-			vp.AddMember("scissors", scissors, alloc);
+			w.s32(vp.pScissors[i].offset.x);
+			w.s32(vp.pScissors[i].offset.y);
+			w.u32(vp.pScissors[i].extent.width);
+			w.u32(vp.pScissors[i].extent.height);
 		}
-		p.AddMember("viewportState", vp, alloc);
 	}
+	return true;
+}
 
-	if (pipe.pDepthStencilState)
+static bool binary_value(BinaryWriter &w, const VkPipelineRasterizationStateCreateInfo &rs)
+{
+	w.u32(rs.flags);
+	w.u32(rs.depthClampEnable);
+	w.u32(rs.rasterizerDiscardEnable);
+	w.u32(rs.polygonMode);
+	w.u32(rs.cullMode);
+	w.u32(rs.frontFace);
+	w.u32(rs.depthBiasEnable);
+	w.f32(rs.depthBiasConstantFactor);
+	w.f32(rs.depthBiasClamp);
+	w.f32(rs.depthBiasSlopeFactor);
+	w.f32(rs.lineWidth);
+	return binary_pnext_chain(w, rs.pNext);
+}
+
+static bool binary_value(BinaryWriter &w, const VkPipelineMultisampleStateCreateInfo &ms)
+{
+	w.u32(ms.flags);
+	w.u32(ms.rasterizationSamples);
+	w.u32(ms.sampleShadingEnable);
+	w.f32(ms.minSampleShading);
+	if (w.present(ms.pSampleMask))
 	{
-		Value ds(kObjectType);
-		ds.AddMember("flags", pipe.pDepthStencilState->flags, alloc);
-		ds.AddMember("stencilTestEnable", pipe.pDepthStencilState->stencilTestEnable, alloc);
-		ds.AddMember("maxDepthBounds", pipe.pDepthStencilState->maxDepthBounds, alloc);
-		ds.AddMember("minDepthBounds", pipe.pDepthStencilState->minDepthBounds, alloc);
-		ds.AddMember("depthBoundsTestEnable", pipe.pDepthStencilState->depthBoundsTestEnable, alloc);
-		ds.AddMember("depthWriteEnable", pipe.pDepthStencilState->depthWriteEnable, alloc);
-		ds.AddMember("depthTestEnable", pipe.pDepthStencilState->depthTestEnable, alloc);
-		ds.AddMember("depthCompareOp", pipe.pDepthStencilState->depthCompareOp, alloc);
+		auto entries = uint32_t(ms.rasterizationSamples + 31) / 32;
+		w.u32(entries);
+		for (uint32_t i = 0; i < entries; i++)
+			w.u32(ms.pSampleMask[i]);
+	}
+	w.u32(ms.alphaToCoverageEnable);
+	w.u32(ms.alphaToOneEnable);
+	return true;
+}
 
-		const auto serialize_stencil = [&](Value &v, const VkStencilOpState &state) {
-			v.AddMember("compareOp", state.compareOp, alloc);
-			v.AddMember("writeMask", state.writeMask, alloc);
-			v.AddMember("reference", state.reference, alloc);
-			v.AddMember("compareMask", state.compareMask, alloc);
-			v.AddMember("passOp", state.passOp, alloc);
-			v.AddMember("failOp", state.failOp, alloc);
-			v.AddMember("depthFailOp", state.depthFailOp, alloc);
-		};
-		Value front(kObjectType);
-		Value back(kObjectType);
-		serialize_stencil(front, pipe.pDepthStencilState->front);
-		serialize_stencil(back, pipe.pDepthStencilState->back);
-		ds.AddMember("front", front, alloc);
-		ds.AddMember("back", back, alloc);
-		p.AddMember("depthStencilState", ds, alloc);
+static bool binary_value(BinaryWriter &w, const VkPipelineDepthStencilStateCreateInfo &ds)
+{
+	w.u32(ds.flags);
+	w.u32(ds.depthTestEnable);
+	w.u32(ds.depthWriteEnable);
+	w.u32(ds.depthCompareOp);
+	w.u32(ds.depthBoundsTestEnable);
+	w.u32(ds.stencilTestEnable);
+	for (auto *op : { &ds.front, &ds.back })
+	{
+		w.u32(op->failOp);
+		w.u32(op->passOp);
+		w.u32(op->depthFailOp);
+		w.u32(op->compareOp);
+		w.u32(op->compareMask);
+		w.u32(op->writeMask);
+		w.u32(op->reference);
 	}
+	w.f32(ds.minDepthBounds);
+	w.f32(ds.maxDepthBounds);
+	return true;
+}
 
-	Value stages(kArrayType);
+static bool binary_value(BinaryWriter &w, const VkPipelineColorBlendStateCreateInfo &cb)
+{
+	w.u32(cb.flags);
+	w.u32(cb.logicOpEnable);
+	w.u32(cb.logicOp);
+	w.u32(cb.attachmentCount);
+	for (uint32_t i = 0; i < cb.attachmentCount; i++)
+	{
+		auto &a = cb.pAttachments[i];
+		w.u32(a.blendEnable);
+		w.u32(a.srcColorBlendFactor);
+		w.u32(a.dstColorBlendFactor);
+		w.u32(a.colorBlendOp);
+		w.u32(a.srcAlphaBlendFactor);
+		w.u32(a.dstAlphaBlendFactor);
+		w.u32(a.alphaBlendOp);
+		w.u32(a.colorWriteMask);
+	}
+	for (auto &c : cb.blendConstants)
+		w.f32(c);
+	return true;
+}
+
+static bool binary_value(BinaryWriter &w, const VkPipelineDynamicStateCreateInfo &dyn)
+{
+	w.u32(dyn.flags);
+	w.u32(dyn.dynamicStateCount);
+	for (uint32_t i = 0; i < dyn.dynamicStateCount; i++)
+		w.u32(dyn.pDynamicStates[i]);
+	return true;
+}
+
+template <typename State>
+static bool binary_pipeline_state(BinaryWriter &w, const State *state, BinaryStateSink *sink)
+{
+	if (!state)
+	{
+		w.u32(BINARY_STATE_ABSENT);
+		return true;
+	}
+
+	if (!sink)
+	{
+		w.u32(BINARY_STATE_INLINE);
+		return binary_value(w, *state);
+	}
+
+	BinaryWriter state_writer(sink->blob, RESOURCE_GRAPHICS_PIPELINE_STATE, 0);
+	state_writer.u32(state->sType);
+	if (!binary_value(state_writer, *state))
+		return false;
+
+	Hasher h;
+	h.data(sink->blob.data() + binary_header_size, sink->blob.size() - binary_header_size);
+	Hash hash = h.get();
+	memcpy(sink->blob.data() + binary_header_size - sizeof(hash), &hash, sizeof(hash));
+
+	if (!sink->database->has_entry(RESOURCE_GRAPHICS_PIPELINE_STATE, hash))
+	{
+		sink->database->write_entry(RESOURCE_GRAPHICS_PIPELINE_STATE, hash, sink->blob.data(), sink->blob.size(),
+		                            sink->payload_flags);
+		sink->counters->wrote_entry(sink->blob.size());
+	}
+
+	w.u32(BINARY_STATE_REFERENCE);
+	w.u64(hash);
+	return true;
+}
+
+static bool binary_value(BinaryWriter &w, const VkGraphicsPipelineCreateInfo &pipe, BinaryStateSink *sink)
+{
+	w.u32(pipe.flags);
+	w.u32(pipe.stageCount);
 	for (uint32_t i = 0; i < pipe.stageCount; i++)
+		binary_value(w, pipe.pStages[i]);
+
+	// Input assembly and tessellation state are smaller than a reference.
+	if (!binary_pipeline_state(w, pipe.pVertexInputState, sink) ||
+	    !binary_pipeline_state(w, pipe.pInputAssemblyState, static_cast<BinaryStateSink *>(nullptr)) ||
+	    !binary_pipeline_state(w, pipe.pTessellationState, static_cast<BinaryStateSink *>(nullptr)) ||
+	    !binary_pipeline_state(w, pipe.pViewportState, sink) ||
+	    !binary_pipeline_state(w, pipe.pRasterizationState, sink) ||
+	    !binary_pipeline_state(w, pipe.pMultisampleState, sink) ||
+	    !binary_pipeline_state(w, pipe.pDepthStencilState, sink) ||
+	    !binary_pipeline_state(w, pipe.pColorBlendState, sink) ||
+	    !binary_pipeline_state(w, pipe.pDynamicState, sink))
 	{
-		auto &s = pipe.pStages[i];
-		Value stage(kObjectType);
-		stage.AddMember("flags", s.flags, alloc);
-		stage.AddMember("name", StringRef(s.pName), alloc);
-		stage.AddMember("module", uint64_string(api_object_cast<uint64_t>(s.module), alloc), alloc);
-		stage.AddMember("stage", s.stage, alloc);
-		if (s.pSpecializationInfo)
-		{
-			Value spec(kObjectType);
-			spec.AddMember("dataSize", uint64_t(s.pSpecializationInfo->dataSize), alloc);
-			spec.AddMember("data",
-						   encode_base64(s.pSpecializationInfo->pData,
-										 s.pSpecializationInfo->dataSize), alloc);
-			Value map_entries(kArrayType);
-			for (uint32_t j = 0; j < s.pSpecializationInfo->mapEntryCount; j++)
-			{
-				auto &e = s.pSpecializationInfo->pMapEntries[j];
-				Value map_entry(kObjectType);
-				map_entry.AddMember("offset", e.offset, alloc);
-				map_entry.AddMember("size", uint64_t(e.size), alloc);
-				map_entry.AddMember("constantID", e.constantID, alloc);
-				map_entries.PushBack(map_entry, alloc);
-			}
-			spec.AddMember("mapEntries", map_entries, alloc);
-			stage.AddMember("specializationInfo", spec, alloc);
-		}
-		stages.PushBack(stage, alloc);
+		return false;
 	}
-	p.AddMember("stages", stages, alloc);
 
-	*out_value = p;
+	w.handle(pipe.layout);
+	w.handle(pipe.renderPass);
+	w.u32(pipe.subpass);
+	w.handle(pipe.basePipelineHandle);
+	w.s32(pipe.basePipelineIndex);
 	return true;
 }
 
@@ -4787,6 +7675,24 @@ static void serialize_physical_device_features_inline(Value &value, const VkPhys
 
 bool StateRecorder::Impl::serialize_application_info(vector<uint8_t> &blob) const
 {
+	if (binary_format)
+	{
+		Hasher h;
+		Hashing::hash_application_feature_info(h, application_feature_hash);
+		BinaryWriter writer(blob, RESOURCE_APPLICATION_INFO, h.get());
+		if (writer.present(application_info))
+		{
+			writer.u32(application_info->apiVersion);
+			writer.u32(application_info->applicationVersion);
+			writer.u32(application_info->engineVersion);
+			writer.string(application_info->pApplicationName);
+			writer.string(application_info->pEngineName);
+		}
+		if (writer.present(physical_device_features))
+			writer.u32(physical_device_features->features.robustBufferAccess);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4816,6 +7722,11 @@ Hash StateRecorder::Impl::get_application_link_hash(ResourceTag tag, Hash hash)
 	return Hashing::compute_hash_application_info_link(application_feature_hash, tag, hash);
 }
 
+bool StateRecorder::Impl::test_pipeline_hash(Hash hash) const
+{
+	return !application_info_filter || application_info_filter->test_pipeline_hash(hash);
+}
+
 bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash hash, vector<uint8_t> &blob) const
 {
 	PayloadWriteFlags payload_flags = 0;
@@ -4827,7 +7738,7 @@ bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash h
 	{
 		if (!serialize_application_blob_link(hash, tag, blob))
 			return false;
-		database_iface->write_entry(RESOURCE_APPLICATION_BLOB_LINK, link_hash, blob.data(), blob.size(), payload_flags);
+		write_database_entry(RESOURCE_APPLICATION_BLOB_LINK, link_hash, blob, payload_flags);
 		return true;
 	}
 	else
@@ -4836,6 +7747,18 @@ bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash h
 
 bool StateRecorder::Impl::serialize_application_blob_link(Hash hash, ResourceTag tag, vector<uint8_t> &blob) const
 {
+	Hasher h;
+	Hashing::hash_application_feature_info(h, application_feature_hash);
+
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_APPLICATION_BLOB_LINK, get_application_link_hash(tag, hash));
+		writer.u64(h.get());
+		writer.u32(tag);
+		writer.u64(hash);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4844,9 +7767,6 @@ bool StateRecorder::Impl::serialize_application_blob_link(Hash hash, ResourceTag
 
 	Value links(kArrayType);
 	Value link(kObjectType);
-
-	Hasher h;
-	Hashing::hash_application_feature_info(h, application_feature_hash);
 	link.AddMember("application", uint64_string(h.get(), alloc), alloc);
 	link.AddMember("tag", uint32_t(tag), alloc);
 	link.AddMember("hash", uint64_string(hash, alloc), alloc);
@@ -4863,6 +7783,13 @@ bool StateRecorder::Impl::serialize_application_blob_link(Hash hash, ResourceTag
 
 bool StateRecorder::Impl::serialize_sampler(Hash hash, const VkSamplerCreateInfo &create_info, vector<uint8_t> &blob) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_SAMPLER, hash);
+		binary_value(writer, create_info);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4889,6 +7816,13 @@ bool StateRecorder::Impl::serialize_sampler(Hash hash, const VkSamplerCreateInfo
 bool StateRecorder::Impl::serialize_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo &create_info,
                                                           vector<uint8_t> &blob) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_DESCRIPTOR_SET_LAYOUT, hash);
+		binary_value(writer, create_info);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4915,6 +7849,13 @@ bool StateRecorder::Impl::serialize_descriptor_set_layout(Hash hash, const VkDes
 bool StateRecorder::Impl::serialize_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo &create_info,
                                                     vector<uint8_t> &blob) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_PIPELINE_LAYOUT, hash);
+		binary_value(writer, create_info);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4940,6 +7881,13 @@ bool StateRecorder::Impl::serialize_pipeline_layout(Hash hash, const VkPipelineL
 
 bool StateRecorder::Impl::serialize_render_pass(Hash hash, const VkRenderPassCreateInfo &create_info, vector<uint8_t> &blob) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_RENDER_PASS, hash);
+		binary_value(writer, create_info);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4963,8 +7911,15 @@ bool StateRecorder::Impl::serialize_render_pass(Hash hash, const VkRenderPassCre
 	return true;
 }
 
-bool StateRecorder::Impl::serialize_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info, vector<uint8_t> &blob) const
+bool StateRecorder::Impl::serialize_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info, vector<uint8_t> &blob,
+                                                      BinaryStateSink *state_sink) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_GRAPHICS_PIPELINE, hash);
+		return binary_value(writer, create_info, state_sink);
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -4990,6 +7945,13 @@ bool StateRecorder::Impl::serialize_graphics_pipeline(Hash hash, const VkGraphic
 
 bool StateRecorder::Impl::serialize_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo &create_info, vector<uint8_t> &blob) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_COMPUTE_PIPELINE, hash);
+		binary_value(writer, create_info);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
@@ -5016,23 +7978,31 @@ bool StateRecorder::Impl::serialize_compute_pipeline(Hash hash, const VkComputeP
 bool StateRecorder::Impl::serialize_shader_module(Hash hash, const VkShaderModuleCreateInfo &create_info,
                                                   vector<uint8_t> &blob, ScratchAllocator &blob_allocator) const
 {
+	if (binary_format)
+	{
+		BinaryWriter writer(blob, RESOURCE_SHADER_MODULE, hash);
+		binary_value(writer, create_info);
+		return true;
+	}
+
 	Document doc;
 	doc.SetObject();
 	auto &alloc = doc.GetAllocator();
 
 	Value serialized_shader_modules(kObjectType);
 
-	size_t size = compute_size_varint(create_info.pCode, create_info.codeSize / 4);
+	size_t size = compute_size_stream_vbyte(create_info.pCode, create_info.codeSize / 4);
 	uint8_t *encoded = static_cast<uint8_t *>(blob_allocator.allocate_raw(size, 64));
-	encode_varint(encoded, create_info.pCode, create_info.codeSize / 4);
+	encode_stream_vbyte(encoded, create_info.pCode, create_info.codeSize / 4);
 
+	// The member names predate Stream VByte, the blob version tells which packing is used.
 	Value varint(kObjectType);
 	varint.AddMember("varintOffset", 0, alloc);
 	varint.AddMember("varintSize", uint64_t(size), alloc);
 	varint.AddMember("codeSize", uint64_t(create_info.codeSize), alloc);
 	varint.AddMember("flags", 0, alloc);
 
-	// Varint binary form, starts at offset 0 after the delim '\0' character.
+	// Packed binary form, starts at offset 0 after the delim '\0' character.
 	serialized_shader_modules.AddMember(uint64_string(hash, alloc), varint, alloc);
 
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
@@ -5049,103 +8019,138 @@ bool StateRecorder::Impl::serialize_shader_module(Hash hash, const VkShaderModul
 	return true;
 }
 
-bool StateRecorder::serialize(uint8_t **serialized_data, size_t *serialized_size)
+namespace
 {
-	if (impl->database_iface)
-		return false;
-
-	impl->sync_thread();
-
-	Document doc;
-	doc.SetObject();
-	auto &alloc = doc.GetAllocator();
-
-	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
-
-	Value app_info(kObjectType);
-	Value pdf_info(kObjectType);
-	Value value;
-
-	if (impl->application_info)
-		serialize_application_info_inline(app_info, *impl->application_info, alloc);
-	if (impl->physical_device_features)
-		serialize_physical_device_features_inline(pdf_info, *impl->physical_device_features, alloc);
-
-	doc.AddMember("applicationInfo", app_info, alloc);
-	doc.AddMember("physicalDeviceFeatures", pdf_info, alloc);
+// rapidjson output stream which hands full buffers to a SerializedOutputStream.
+struct SerializeOutputBuffer
+{
+	typedef char Ch;
 
-	Value samplers(kObjectType);
-	for (auto &sampler : impl->samplers)
+	explicit SerializeOutputBuffer(SerializedOutputStream &stream_)
+		: stream(stream_)
 	{
-		if (!json_value(*sampler.second, alloc, &value))
-			return false;
-		samplers.AddMember(uint64_string(sampler.first, alloc), value, alloc);
 	}
-	doc.AddMember("samplers", samplers, alloc);
 
-	Value set_layouts(kObjectType);
-	for (auto &layout : impl->descriptor_sets)
+	void Put(char c)
 	{
-		if (!json_value(*layout.second, alloc, &value))
-			return false;
-		set_layouts.AddMember(uint64_string(layout.first, alloc), value, alloc);
+		if (size == BufferSize)
+			Flush();
+		buffer[size++] = c;
 	}
-	doc.AddMember("setLayouts", set_layouts, alloc);
 
-	Value pipeline_layouts(kObjectType);
-	for (auto &layout : impl->pipeline_layouts)
+	void Flush()
 	{
-		if (!json_value(*layout.second, alloc, &value))
-			return false;
-		pipeline_layouts.AddMember(uint64_string(layout.first, alloc), value, alloc);
+		if (size && !failed)
+			failed = !stream.write(buffer, size);
+		size = 0;
 	}
-	doc.AddMember("pipelineLayouts", pipeline_layouts, alloc);
 
-	Value shader_modules(kObjectType);
-	for (auto &module : impl->shader_modules)
-	{
-		if (!json_value(*module.second, alloc, &value))
-			return false;
-		shader_modules.AddMember(uint64_string(module.first, alloc), value, alloc);
-	}
-	doc.AddMember("shaderModules", shader_modules, alloc);
+	enum { BufferSize = 64 * 1024 };
+	SerializedOutputStream &stream;
+	char buffer[BufferSize];
+	size_t size = 0;
+	bool failed = false;
+};
 
-	Value render_passes(kObjectType);
-	for (auto &pass : impl->render_passes)
+struct SerializeVectorStream : SerializedOutputStream
+{
+	bool write(const void *data, size_t size) override
 	{
-		if (!json_value(*pass.second, alloc, &value))
-			return false;
-		render_passes.AddMember(uint64_string(pass.first, alloc), value, alloc);
+		auto *bytes = static_cast<const uint8_t *>(data);
+		output.insert(output.end(), bytes, bytes + size);
+		return true;
 	}
-	doc.AddMember("renderPasses", render_passes, alloc);
 
-	Value compute_pipelines(kObjectType);
-	for (auto &pipe : impl->compute_pipelines)
+	std::vector<uint8_t> output;
+};
+}
+
+bool StateRecorder::serialize(SerializedOutputStream &stream)
+{
+	if (impl->database_iface)
+		return false;
+
+	impl->sync_thread();
+
+	// The output buffer is too large for the stack of application threads.
+	std::unique_ptr<SerializeOutputBuffer> buffer(new SerializeOutputBuffer(stream));
+	PrettyWriter<SerializeOutputBuffer> writer(*buffer);
+
+	// Each object is built in a small DOM of its own, which is thrown away once it has been written.
+	enum { JsonPoolSize = 64 * 1024 };
+	std::unique_ptr<char[]> json_pool_buffer(new char[JsonPoolSize]);
+	MemoryPoolAllocator<> alloc(json_pool_buffer.get(), JsonPoolSize);
+
+	writer.StartObject();
+	writer.Key("version");
+	writer.Int(FOSSILIZE_FORMAT_VERSION);
+
 	{
-		if (!json_value(*pipe.second, alloc, &value))
-			return false;
-		compute_pipelines.AddMember(uint64_string(pipe.first, alloc), value, alloc);
+		Value app_info(kObjectType);
+		Value pdf_info(kObjectType);
+		if (impl->application_info)
+			serialize_application_info_inline(app_info, *impl->application_info, alloc);
+		if (impl->physical_device_features)
+			serialize_physical_device_features_inline(pdf_info, *impl->physical_device_features, alloc);
+
+		writer.Key("applicationInfo");
+		app_info.Accept(writer);
+		writer.Key("physicalDeviceFeatures");
+		pdf_info.Accept(writer);
 	}
-	doc.AddMember("computePipelines", compute_pipelines, alloc);
+	alloc.Clear();
+
+	const auto write_objects = [&](const char *key, const auto &objects) -> bool {
+		writer.Key(key);
+		writer.StartObject();
+		for (auto &object : objects)
+		{
+			{
+				Value value;
+				if (!json_value(*object.second, alloc, &value))
+					return false;
 
-	Value graphics_pipelines(kObjectType);
-	for (auto &pipe : impl->graphics_pipelines)
+				char str[17]; // 16 digits + null
+				sprintf(str, "%016" PRIx64, object.first);
+				writer.Key(str);
+				value.Accept(writer);
+			}
+			alloc.Clear();
+
+			if (buffer->failed)
+				return false;
+		}
+		writer.EndObject();
+		return true;
+	};
+
+	if (!write_objects("samplers", impl->samplers) ||
+	    !write_objects("setLayouts", impl->descriptor_sets) ||
+	    !write_objects("pipelineLayouts", impl->pipeline_layouts) ||
+	    !write_objects("shaderModules", impl->shader_modules) ||
+	    !write_objects("renderPasses", impl->render_passes) ||
+	    !write_objects("computePipelines", impl->compute_pipelines) ||
+	    !write_objects("graphicsPipelines", impl->graphics_pipelines))
 	{
-		if (!json_value(*pipe.second, alloc, &value))
-			return false;
-		graphics_pipelines.AddMember(uint64_string(pipe.first, alloc), value, alloc);
+		return false;
 	}
-	doc.AddMember("graphicsPipelines", graphics_pipelines, alloc);
 
-	StringBuffer buffer;
-	PrettyWriter<StringBuffer> writer(buffer);
-	doc.Accept(writer);
+	writer.EndObject();
+	buffer->Flush();
+	return !buffer->failed;
+}
+
+bool StateRecorder::serialize(uint8_t **serialized_data, size_t *serialized_size)
+{
+	SerializeVectorStream stream;
+	if (!serialize(stream))
+		return false;
 
-	*serialized_size = buffer.GetSize();
-	*serialized_data = new uint8_t[buffer.GetSize()];
+	*serialized_size = stream.output.size();
+	*serialized_data = new uint8_t[stream.output.size()];
 	if (*serialized_data)
 	{
-		memcpy(*serialized_data, buffer.GetString(), buffer.GetSize());
+		memcpy(*serialized_data, stream.output.data(), stream.output.size());
 		return true;
 	}
 	else
@@ -5160,6 +8165,9 @@ void StateRecorder::free_serialized(uint8_t *serialized)
 void StateRecorder::init_recording_thread(DatabaseInterface *iface)
 {
 	impl->database_iface = iface;
+	// Shader modules can be hashed on the calling thread, so this cannot wait for the recording thread to prepare().
+	if (iface)
+		impl->hash_format_version = iface->get_format_version();
 	impl->worker_thread = std::thread(&StateRecorder::Impl::record_task, impl, this, true);
 }
 
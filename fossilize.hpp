@@ -78,6 +78,27 @@ public:
 
 	void reset();
 	size_t get_peak_memory_consumption() const;
+	size_t get_current_memory_consumption() const;
+
+	// Keeps the blocks released by reset() around for later allocations, so resetting
+	// between batches does not go back to the system allocator. Disabling frees the kept blocks.
+	void set_block_recycling(bool enable);
+
+	// Backs blocks allocated from now on with transparent huge pages where the platform supports it.
+	// Blocks are rounded up to 2 MiB.
+	void set_huge_pages(bool enable);
+
+	struct Statistics
+	{
+		size_t block_count; // Blocks which allocations are made from.
+		size_t free_block_count; // Blocks kept for reuse by reset().
+		size_t bytes_in_use; // Bytes handed out since the last reset(), including alignment padding.
+		size_t bytes_reserved; // Total size of all blocks, in use or free.
+		size_t peak_bytes_in_use;
+		size_t peak_bytes_reserved;
+		size_t system_allocations; // Blocks which had to be allocated from the system.
+	};
+	void get_statistics(Statistics *stats) const;
 
 	// Disable copies (and moves).
 	ScratchAllocator(const ScratchAllocator &) = delete;
@@ -135,6 +156,12 @@ public:
 	virtual void notify_replayed_resources_for_type() {}
 };
 
+struct StateReference
+{
+	ResourceTag tag;
+	Hash hash;
+};
+
 class StateReplayer
 {
 public:
@@ -142,6 +169,13 @@ public:
 	~StateReplayer();
 	bool parse(StateCreatorInterface &iface, DatabaseInterface *database, const void *buffer, size_t size) FOSSILIZE_WARN_UNUSED;
 
+	// Lists the objects which the objects in a blob refer to, without creating or resolving anything:
+	// immutable samplers, set layouts, shader modules, pipeline layouts, render passes, base pipelines
+	// and shared graphics pipeline state. References are listed in the order they appear, duplicates included.
+	// Null handles are skipped. The array is owned by the replayer and is valid until the next call.
+	// Scratch memory comes from get_allocator(), like parse().
+	bool scan_references(const void *buffer, size_t size, const StateReference **references, size_t *count) FOSSILIZE_WARN_UNUSED;
+
 	// Default is true. If true, the replayer will make sure the derivative pipeline handles provided to
 	// the API is a correct VkPipeline. If false, pipelines with VK_PIPELINE_CREATE_DERIVATIVE_BIT will have its basePipelineHandle
 	// set to the hash of the pipeline. It is up to the caller to resolve this hash to a real pipeline later.
@@ -153,9 +187,19 @@ public:
 	// It is up to the application to overwrite the correct VkShaderModule later.
 	void set_resolve_shader_module_handles(bool enable);
 
-	// Lets other StateReplayers have the same references to objects.
+	// Shader modules which the database passed to parse() does not have are read from store instead,
+	// e.g. a store from create_module_store_database(). The store is not owned. nullptr disables this, which is the default.
+	void set_module_store(DatabaseInterface *store);
+
+	// Lets this StateReplayer refer to the objects replayed by another one.
+	// The references are shared rather than copied, and objects either replayer parses afterwards are not visible to the other.
 	void copy_handle_references(const StateReplayer &replayer);
 
+	// Adds the objects which another replayer has parsed itself, but not the ones it refers to through copy_handle_references().
+	// Lets independent objects be parsed on several replayers at once, and then be referred to by this one.
+	// The other replayer must not be parsing concurrently, and its handles must be written out by then.
+	void merge_handle_references(const StateReplayer &replayer);
+
 	void forget_handle_references();
 
 	ScratchAllocator &get_allocator();
@@ -175,6 +219,76 @@ struct StateRecorderApplicationFeatureHash
 	Hash physical_device_features_hash = 0;
 };
 
+// Counters which StateRecorder keeps up to date at all times. All times are in nanoseconds.
+struct StateRecorderStatistics
+{
+	// Calls to record_*() and the time they spent on the calling threads, copying create info and queueing it up.
+	uint64_t record_count;
+	uint64_t record_time_ns;
+
+	// Work items queued up for the recording thread which it has not processed yet, and the most there has been at once.
+	uint64_t queue_depth;
+	uint64_t max_queue_depth;
+
+	// Entries and payload bytes handed to DatabaseInterface::write_entry().
+	uint64_t entries_written;
+	uint64_t bytes_written;
+
+	// Time the recording thread spent processing work items, rather than waiting for them.
+	uint64_t thread_busy_time_ns;
+
+	// Memory held by copies of create info which the recording thread is not done with, and the most there has been at once.
+	uint64_t queued_bytes;
+	uint64_t max_queued_bytes;
+
+	// record_*() calls which hit the record queue limit, how long they waited in total, and how many objects were dropped.
+	uint64_t blocked_count;
+	uint64_t blocked_time_ns;
+	uint64_t dropped_count;
+};
+
+// What record_*() does once the record queue limit is exceeded.
+enum RecordQueueLimitPolicy
+{
+	// Wait for the recording thread to catch up, but record anyway once the timeout expires.
+	RECORD_QUEUE_LIMIT_POLICY_BLOCK = 0,
+	// Do not record the object at all. Objects which depend on it cannot be recorded either.
+	RECORD_QUEUE_LIMIT_POLICY_DROP = 1
+};
+
+// One object as seen by one recording session, see StateRecorder::set_enable_usage_metadata().
+struct UsageMetadataRecord
+{
+	Hash hash;
+	ResourceTag tag;
+	// Milliseconds since usage metadata was enabled, which is roughly when the application started.
+	uint32_t first_use_ms;
+	// Number of frames presented before the object was first used.
+	uint32_t first_use_frame;
+	// UsageMetadataFlagBits.
+	uint32_t flags;
+};
+
+enum UsageMetadataFlagBits
+{
+	// No frame had been presented for a while when the object was first used,
+	// i.e. the object was most likely created behind a loading screen rather than during gameplay.
+	USAGE_METADATA_LOADING_BIT = 1 << 0
+};
+
+// Decodes a RESOURCE_USAGE_METADATA blob. Like Vulkan, call once with records == nullptr to query the count.
+// Every record in a blob comes from the same session. session may be nullptr.
+bool parse_usage_metadata(const void *blob, size_t size, Hash *session, UsageMetadataRecord *records, size_t *record_count) FOSSILIZE_WARN_UNUSED;
+
+// Receives the output of StateRecorder::serialize() in consecutive chunks.
+class SerializedOutputStream
+{
+public:
+	virtual ~SerializedOutputStream() = default;
+	// Return false to abort serialization.
+	virtual bool write(const void *data, size_t size) = 0;
+};
+
 class StateRecorder
 {
 public:
@@ -185,6 +299,35 @@ public:
 	// Call before init_recording_thread.
 	void set_database_enable_compression(bool enable);
 	void set_database_enable_checksum(bool enable);
+	// If compression is enabled, prefer LZ4 over deflate when the database supports it.
+	void set_database_enable_fast_compression(bool enable);
+	// Write database entries in a compact binary form instead of JSON.
+	// Binary entries are faster to write and replay, but cannot be inspected with a text editor.
+	// StateReplayer accepts both forms.
+	void set_database_enable_binary_format(bool enable);
+	// Hashes samplers, shader modules and render passes on the calling thread, and if an identical object
+	// has already been recorded, only records the handle instead of copying the create info again.
+	// This trades some hashing on the calling thread for not copying SPIR-V and other state of duplicate objects.
+	void set_enable_early_deduplication(bool enable);
+	// Bounds the memory held by copies of create info which the recording thread has not caught up with yet.
+	// The limit is soft, it is checked before an object is copied, and the arena each recording thread copies into
+	// counts towards it, so leave room for at least 64 KiB per thread. max_bytes of 0 disables the limit, which is the default.
+	void set_record_queue_limit(size_t max_bytes, RecordQueueLimitPolicy policy, unsigned timeout_ms);
+	// Keeps the recording thread from hashing, serializing, compressing and writing while the application is busy
+	// creating objects, e.g. behind a loading screen. record_*() still copies create info, but the recording thread
+	// holds on to the copies until they are delay_ms old, or until nothing has been recorded for idle_ms.
+	// The database is not prepared before the first object is released, and the recording thread runs at idle priority.
+	// Exceeding the record queue limit releases everything early. 0 disables either trigger,
+	// and with both at 0, the default, objects are recorded right away. Call before init_recording_thread.
+	void set_deferred_recording(unsigned delay_ms, unsigned idle_ms);
+	// Writes RESOURCE_USAGE_METADATA entries which record when every object was first used in this session,
+	// including objects which are already in the database. Each session writes its own entries,
+	// so after merging archives recorded in several sessions, the number of records for an object is the number of sessions
+	// which used it. Records are written in batches, and whatever is left when the recording thread is torn down.
+	// This is a noop without a database. Call before init_recording_thread.
+	void set_enable_usage_metadata(bool enable);
+	// Call once for every presented frame, to let usage metadata tell loading from gameplay. Can be called from any thread.
+	void notify_frame_presented();
 
 	// These methods should only be called at the very beginning of the application lifetime.
 	// It will affect the hash of all create info structures.
@@ -199,6 +342,9 @@ public:
 
 	const StateRecorderApplicationFeatureHash &get_application_feature_hash() const;
 
+	// Safe to call from any thread at any time. Counters are sampled individually, not as one snapshot.
+	void get_statistics(StateRecorderStatistics *stats) const;
+
 	bool record_descriptor_set_layout(VkDescriptorSetLayout set_layout, const VkDescriptorSetLayoutCreateInfo &layout_info,
 	                                  Hash custom_hash = 0) FOSSILIZE_WARN_UNUSED;
 	bool record_pipeline_layout(VkPipelineLayout pipeline_layout, const VkPipelineLayoutCreateInfo &layout_info,
@@ -216,6 +362,16 @@ public:
 	bool record_sampler(VkSampler sampler, const VkSamplerCreateInfo &create_info,
 	                    Hash custom_hash = 0) FOSSILIZE_WARN_UNUSED;
 
+	// Call these as the application destroys objects, before the handles are destroyed further down,
+	// so the recorder does not hold on to handles forever.
+	// Objects which were recorded earlier and refer to a forgotten handle still resolve it.
+	void forget_descriptor_set_layout(VkDescriptorSetLayout set_layout);
+	void forget_pipeline_layout(VkPipelineLayout pipeline_layout);
+	void forget_shader_module(VkShaderModule module);
+	void forget_pipeline(VkPipeline pipeline);
+	void forget_render_pass(VkRenderPass render_pass);
+	void forget_sampler(VkSampler sampler);
+
 	// Used by hashing functions in Hashing namespace. Should be considered an implementation detail.
 	bool get_hash_for_descriptor_set_layout(VkDescriptorSetLayout layout, Hash *hash) const FOSSILIZE_WARN_UNUSED;
 	bool get_hash_for_pipeline_layout(VkPipelineLayout layout, Hash *hash) const FOSSILIZE_WARN_UNUSED;
@@ -224,6 +380,8 @@ public:
 	bool get_hash_for_compute_pipeline_handle(VkPipeline pipeline, Hash *hash) const FOSSILIZE_WARN_UNUSED;
 	bool get_hash_for_render_pass(VkRenderPass render_pass, Hash *hash) const FOSSILIZE_WARN_UNUSED;
 	bool get_hash_for_sampler(VkSampler sampler, Hash *hash) const FOSSILIZE_WARN_UNUSED;
+	// The FOSSILIZE_FORMAT_VERSION objects are hashed as of, see DatabaseInterface::get_format_version().
+	unsigned get_hash_format_version() const;
 
 	// If database is non-null, serialize cannot not be called later, as the implementation will not retain
 	// memory for the create info structs, but rather rely on the database interface to make objects persist.
@@ -244,6 +402,10 @@ public:
 	bool serialize(uint8_t **serialized, size_t *serialized_size) FOSSILIZE_WARN_UNUSED;
 	static void free_serialized(uint8_t *serialized);
 
+	// Same document as serialize(), but objects are written as they are visited, through a fixed-size buffer
+	// which is handed to stream in chunks. Only one object is held in memory as JSON at a time.
+	bool serialize(SerializedOutputStream &stream) FOSSILIZE_WARN_UNUSED;
+
 	// Stops the recording thread and joins with it.
 	// Should only be used in emergency situations, e.g. for FOSSILIZE_DUMP_SIGSEGV=1.
 	void tear_down_recording_thread();
@@ -268,6 +430,8 @@ Hash compute_combined_application_feature_hash(const StateRecorderApplicationFea
 
 // Shader modules, samplers and render passes are standalone modules, so they can be hashed in isolation.
 Hash compute_hash_shader_module(const VkShaderModuleCreateInfo &create_info);
+// Hashes as of an older FOSSILIZE_FORMAT_VERSION, to match archives which were recorded with it.
+Hash compute_hash_shader_module(const VkShaderModuleCreateInfo &create_info, unsigned format_version);
 Hash compute_hash_sampler(const VkSamplerCreateInfo &create_info);
 Hash compute_hash_render_pass(const VkRenderPassCreateInfo &create_info);
 
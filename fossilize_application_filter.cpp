@@ -21,15 +21,17 @@
  */
 
 #include "fossilize_application_filter.hpp"
+#include "file_mapping.hpp"
+#include "xxhash64.hpp"
 #include "layer/utils.hpp"
 #include "vulkan.h"
-#include <mutex>
-#include <condition_variable>
 #include <future>
 #include <vector>
-#include <unordered_set>
-#include <unordered_map>
+#include <string>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define RAPIDJSON_HAS_STDSTRING 1
 #include "rapidjson/document.h"
@@ -41,19 +43,168 @@ namespace Fossilize
 {
 enum { FOSSILIZE_APPLICATION_INFO_FILTER_VERSION = 1 };
 
-struct AppInfo
+// A precompiled filter is laid out as follows. All multi-byte entities are little-endian.
+// 8 byte magic
+// 4 byte version
+// 4 byte record count N
+// 4 byte bloom filter word count W
+// 4 byte bloom filter probe count K
+// 4 byte skipped pipeline hash count S
+// 4 byte reserved, 0
+// N records, sorted by name hash:
+//   8 byte name hash, xxhash64 of the name, seeded with the record kind
+//   4 byte flags, FILTER_RECORD_*
+//   4 byte minimum apiVersion
+//   4 byte minimum applicationVersion or engineVersion, depending on the kind
+//   4 byte reserved, 0
+// W 8 byte bloom filter words over the skipped pipeline hashes.
+// S 8 byte skipped pipeline hashes, sorted and unique. Bloom filter hits are confirmed against these,
+// so a pipeline which is not listed is never skipped.
+// JSON filters are compiled into the same layout in memory, so both are queried the same way.
+static const uint8_t compiled_filter_magic[8] = { 'F', 'O', 'S', 'S', 'A', 'P', 'P', 'F' };
+enum { FOSSILIZE_COMPILED_FILTER_VERSION = 2 };
+enum { CompiledHeaderSize = 32, CompiledRecordSize = 24 };
+enum { BloomBitsPerHash = 10, BloomProbeCount = 7 };
+
+enum FilterRecordKind
 {
-	uint32_t minimum_api_version = VK_MAKE_VERSION(1, 0, 0);
-	uint32_t minimum_application_version = 0;
-	uint32_t minimum_engine_version = 0;
+	FILTER_RECORD_APPLICATION = 0,
+	FILTER_RECORD_ENGINE = 1
 };
 
+enum FilterRecordFlagBits
+{
+	FILTER_RECORD_ENGINE_BIT = 1 << 0,
+	FILTER_RECORD_BLACKLISTED_BIT = 1 << 1
+};
+
+struct FilterRecord
+{
+	uint64_t name_hash;
+	uint32_t flags;
+	uint32_t minimum_api_version;
+	uint32_t minimum_version;
+};
+
+static uint64_t hash_name(const char *name, FilterRecordKind kind)
+{
+	return xxhash64(name, strlen(name), uint64_t(kind));
+}
+
+static uint32_t read_le32(const uint8_t *data)
+{
+	return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+}
+
+static uint64_t read_le64(const uint8_t *data)
+{
+	return uint64_t(read_le32(data)) | (uint64_t(read_le32(data + 4)) << 32);
+}
+
+static void write_le32(std::vector<uint8_t> &output, uint32_t value)
+{
+	for (unsigned i = 0; i < 4; i++)
+		output.push_back(uint8_t(value >> (8 * i)));
+}
+
+static void write_le64(std::vector<uint8_t> &output, uint64_t value)
+{
+	write_le32(output, uint32_t(value));
+	write_le32(output, uint32_t(value >> 32));
+}
+
+// splitmix64 finalizer. Pipeline hashes are usually well distributed, but nothing guarantees it.
+static uint64_t mix_hash(uint64_t value)
+{
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+	return value ^ (value >> 31);
+}
+
+// Probes are derived with double hashing.
+template <typename Func>
+static void for_each_bloom_bit(uint64_t hash, uint32_t num_words, uint32_t num_probes, const Func &func)
+{
+	uint64_t num_bits = uint64_t(num_words) * 64;
+	uint64_t base = mix_hash(hash);
+	uint64_t step = mix_hash(base) | 1;
+	for (uint32_t i = 0; i < num_probes; i++)
+		func((base + i * step) % num_bits);
+}
+
+static std::vector<uint8_t> build_compiled_filter(std::vector<FilterRecord> records, std::vector<uint64_t> skipped_hashes)
+{
+	std::sort(skipped_hashes.begin(), skipped_hashes.end());
+	skipped_hashes.erase(std::unique(skipped_hashes.begin(), skipped_hashes.end()), skipped_hashes.end());
+
+	// A name may be blacklisted and have version limits at the same time.
+	std::sort(records.begin(), records.end(), [](const FilterRecord &a, const FilterRecord &b) {
+		return a.name_hash < b.name_hash;
+	});
+
+	std::vector<FilterRecord> merged;
+	for (auto &record : records)
+	{
+		if (!merged.empty() && merged.back().name_hash == record.name_hash)
+		{
+			auto &prev = merged.back();
+			prev.flags |= record.flags;
+			prev.minimum_api_version = std::max(prev.minimum_api_version, record.minimum_api_version);
+			prev.minimum_version = std::max(prev.minimum_version, record.minimum_version);
+		}
+		else
+			merged.push_back(record);
+	}
+
+	uint32_t num_words = 0;
+	if (!skipped_hashes.empty())
+		num_words = uint32_t((skipped_hashes.size() * BloomBitsPerHash + 63) / 64);
+	std::vector<uint64_t> bloom(num_words);
+	for (auto hash : skipped_hashes)
+		for_each_bloom_bit(hash, num_words, BloomProbeCount, [&](uint64_t bit) {
+			bloom[bit >> 6] |= uint64_t(1) << (bit & 63);
+		});
+
+	std::vector<uint8_t> output;
+	output.reserve(CompiledHeaderSize + merged.size() * CompiledRecordSize + (bloom.size() + skipped_hashes.size()) * 8);
+	output.insert(output.end(), std::begin(compiled_filter_magic), std::end(compiled_filter_magic));
+	write_le32(output, FOSSILIZE_COMPILED_FILTER_VERSION);
+	write_le32(output, uint32_t(merged.size()));
+	write_le32(output, num_words);
+	write_le32(output, BloomProbeCount);
+	write_le32(output, uint32_t(skipped_hashes.size()));
+	write_le32(output, 0);
+
+	for (auto &record : merged)
+	{
+		write_le64(output, record.name_hash);
+		write_le32(output, record.flags);
+		write_le32(output, record.minimum_api_version);
+		write_le32(output, record.minimum_version);
+		write_le32(output, 0);
+	}
+
+	for (auto word : bloom)
+		write_le64(output, word);
+	for (auto hash : skipped_hashes)
+		write_le64(output, hash);
+
+	return output;
+}
+
 struct ApplicationInfoFilter::Impl
 {
-	std::unordered_set<std::string> blacklisted_application_names;
-	std::unordered_set<std::string> blacklisted_engine_names;
-	std::unordered_map<std::string, AppInfo> application_infos;
-	std::unordered_map<std::string, AppInfo> engine_infos;
+	// Either points into compiled or into mapping.
+	const uint8_t *records = nullptr;
+	uint32_t num_records = 0;
+	const uint8_t *bloom = nullptr;
+	uint32_t num_bloom_words = 0;
+	uint32_t num_bloom_probes = 0;
+	const uint8_t *skipped_hashes = nullptr;
+	uint32_t num_skipped_hashes = 0;
+
+	std::vector<uint8_t> compiled;
+	FileMapping mapping;
 
 	bool parsing_done = false;
 	bool parsing_success = false;
@@ -61,10 +212,109 @@ struct ApplicationInfoFilter::Impl
 
 	void parse_async(const char *path);
 	bool test_application_info(const VkApplicationInfo *info);
-	bool parse(const std::string &path);
+	bool test_pipeline_hash(uint64_t hash);
 	bool check_success();
+
+	static bool parse(const std::string &path, std::vector<uint8_t> &output);
+	bool attach(const uint8_t *data, size_t size);
+	const uint8_t *find_record(const char *name, FilterRecordKind kind) const;
+	bool is_blacklisted(const char *name, FilterRecordKind kind) const;
+	bool is_skipped_pipeline_hash(uint64_t hash) const;
+	bool test_versions(const VkApplicationInfo &info, const char *name, FilterRecordKind kind) const;
 };
 
+bool ApplicationInfoFilter::Impl::attach(const uint8_t *data, size_t size)
+{
+	if (size < CompiledHeaderSize || memcmp(data, compiled_filter_magic, sizeof(compiled_filter_magic)) != 0)
+		return false;
+	if (read_le32(data + 8) != FOSSILIZE_COMPILED_FILTER_VERSION)
+		return false;
+
+	uint32_t record_count = read_le32(data + 12);
+	uint32_t word_count = read_le32(data + 16);
+	uint32_t skipped_count = read_le32(data + 24);
+	uint64_t expected_size = CompiledHeaderSize + uint64_t(record_count) * CompiledRecordSize +
+	                         (uint64_t(word_count) + skipped_count) * 8;
+	if (expected_size != size)
+		return false;
+
+	// Every listed hash must be covered by the bloom filter.
+	if (skipped_count != 0 && word_count == 0)
+		return false;
+
+	records = data + CompiledHeaderSize;
+	num_records = record_count;
+	bloom = records + size_t(record_count) * CompiledRecordSize;
+	num_bloom_words = word_count;
+	num_bloom_probes = read_le32(data + 20);
+	skipped_hashes = bloom + size_t(word_count) * 8;
+	num_skipped_hashes = skipped_count;
+	return true;
+}
+
+const uint8_t *ApplicationInfoFilter::Impl::find_record(const char *name, FilterRecordKind kind) const
+{
+	uint64_t name_hash = hash_name(name, kind);
+
+	uint32_t lo = 0;
+	uint32_t hi = num_records;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (read_le64(records + size_t(mid) * CompiledRecordSize) < name_hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == num_records)
+		return nullptr;
+
+	const uint8_t *record = records + size_t(lo) * CompiledRecordSize;
+	if (read_le64(record) != name_hash)
+		return nullptr;
+
+	bool is_engine = (read_le32(record + 8) & FILTER_RECORD_ENGINE_BIT) != 0;
+	if (is_engine != (kind == FILTER_RECORD_ENGINE))
+		return nullptr;
+	return record;
+}
+
+bool ApplicationInfoFilter::Impl::is_blacklisted(const char *name, FilterRecordKind kind) const
+{
+	const uint8_t *record = find_record(name, kind);
+	if (!record || (read_le32(record + 8) & FILTER_RECORD_BLACKLISTED_BIT) == 0)
+		return false;
+
+	LOGI("%s %s is blacklisted for recording. Skipping.\n",
+	     kind == FILTER_RECORD_ENGINE ? "pEngineName" : "pApplicationName", name);
+	return true;
+}
+
+bool ApplicationInfoFilter::Impl::test_versions(const VkApplicationInfo &info, const char *name, FilterRecordKind kind) const
+{
+	const char *type = kind == FILTER_RECORD_ENGINE ? "pEngineName" : "pApplicationName";
+	const uint8_t *record = find_record(name, kind);
+	if (!record)
+		return true;
+
+	uint32_t version = kind == FILTER_RECORD_ENGINE ? info.engineVersion : info.applicationVersion;
+	if (version < read_le32(record + 16))
+	{
+		LOGI("%s %u is too low for %s %s. Skipping.\n",
+		     kind == FILTER_RECORD_ENGINE ? "engineVersion" : "applicationVersion", version, type, name);
+		return false;
+	}
+
+	if (info.apiVersion < read_le32(record + 12))
+	{
+		LOGI("apiVersion %u is too low for %s %s. Skipping.\n", info.apiVersion, type, name);
+		return false;
+	}
+
+	return true;
+}
+
 bool ApplicationInfoFilter::Impl::check_success()
 {
 	if (task.valid())
@@ -88,64 +338,54 @@ bool ApplicationInfoFilter::Impl::test_application_info(const VkApplicationInfo
 	}
 
 	// First, check for blacklists.
-	if (info->pApplicationName && blacklisted_application_names.count(info->pApplicationName))
-	{
-		LOGI("pApplicationName %s is blacklisted for recording. Skipping.\n", info->pApplicationName);
+	if (info->pApplicationName && is_blacklisted(info->pApplicationName, FILTER_RECORD_APPLICATION))
+		return false;
+	if (info->pEngineName && is_blacklisted(info->pEngineName, FILTER_RECORD_ENGINE))
 		return false;
-	}
 
-	if (info->pEngineName && blacklisted_engine_names.count(info->pEngineName))
-	{
-		LOGI("pEngineName %s is blacklisted for recording. Skipping.\n", info->pEngineName);
+	// Check versioning for applicationName and engineName.
+	if (info->pApplicationName && !test_versions(*info, info->pApplicationName, FILTER_RECORD_APPLICATION))
+		return false;
+	if (info->pEngineName && !test_versions(*info, info->pEngineName, FILTER_RECORD_ENGINE))
 		return false;
-	}
 
-	// Check versioning for applicationName.
-	if (info->pApplicationName)
-	{
-		auto itr = application_infos.find(info->pApplicationName);
-		if (itr != application_infos.end())
-		{
-			if (info->applicationVersion < itr->second.minimum_application_version)
-			{
-				LOGI("applicationVersion %u is too low for pApplicationName %s. Skipping.\n",
-				     info->applicationVersion, info->pApplicationName);
-				return false;
-			}
-
-			if (info->apiVersion < itr->second.minimum_api_version)
-			{
-				LOGI("apiVersion %u is too low for pApplicationName %s. Skipping.\n",
-				     info->apiVersion, info->pApplicationName);
-				return false;
-			}
-		}
-	}
+	// We didn't fail any filter, so we should record.
+	return true;
+}
+
+bool ApplicationInfoFilter::Impl::test_pipeline_hash(uint64_t hash)
+{
+	if (task.valid())
+		task.wait();
+
+	if (!parsing_success || num_bloom_words == 0)
+		return true;
+
+	// The bloom filter rejects almost every pipeline which is not listed without touching the hash list.
+	bool present = true;
+	for_each_bloom_bit(hash, num_bloom_words, num_bloom_probes, [&](uint64_t bit) {
+		if ((read_le64(bloom + (bit >> 6) * 8) & (uint64_t(1) << (bit & 63))) == 0)
+			present = false;
+	});
+	return !present || !is_skipped_pipeline_hash(hash);
+}
 
-	// Check versioning for engineName.
-	if (info->pEngineName)
+bool ApplicationInfoFilter::Impl::is_skipped_pipeline_hash(uint64_t hash) const
+{
+	uint32_t lo = 0;
+	uint32_t hi = num_skipped_hashes;
+	while (lo < hi)
 	{
-		auto itr = engine_infos.find(info->pEngineName);
-		if (itr != engine_infos.end())
-		{
-			if (info->engineVersion < itr->second.minimum_engine_version)
-			{
-				LOGI("engineVersion %u is too low for pEngineName %s. Skipping.\n",
-				     info->engineVersion, info->pEngineName);
-				return false;
-			}
-
-			if (info->apiVersion < itr->second.minimum_api_version)
-			{
-				LOGI("apiVersion %u is too low for pEngineName %s. Skipping.\n",
-				     info->apiVersion, info->pEngineName);
-				return false;
-			}
-		}
+		uint32_t mid = lo + (hi - lo) / 2;
+		uint64_t mid_hash = read_le64(skipped_hashes + size_t(mid) * 8);
+		if (mid_hash == hash)
+			return true;
+		else if (mid_hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	// We didn't fail any filter, so we should record.
-	return true;
+	return false;
 }
 
 static std::vector<char> read_file(const char *path)
@@ -237,7 +477,7 @@ static unsigned default_get_member_uint(const Value &value, const char *member,
 	return memb->GetUint();
 }
 
-static bool add_blacklists(std::unordered_set<std::string> &output, const Value *blacklist)
+static bool add_blacklists(std::vector<FilterRecord> &output, const Value *blacklist, FilterRecordKind kind)
 {
 	if (!blacklist->IsArray())
 	{
@@ -253,14 +493,17 @@ static bool add_blacklists(std::unordered_set<std::string> &output, const Value
 			return false;
 		}
 
-		const char *str = itr->GetString();
-		output.insert(std::string(str, str + itr->GetStringLength()));
+		std::string name(itr->GetString(), itr->GetStringLength());
+		uint32_t flags = FILTER_RECORD_BLACKLISTED_BIT;
+		if (kind == FILTER_RECORD_ENGINE)
+			flags |= FILTER_RECORD_ENGINE_BIT;
+		output.push_back({ hash_name(name.c_str(), kind), flags, 0, 0 });
 	}
 
 	return true;
 }
 
-static bool add_application_filters(std::unordered_map<std::string, AppInfo> &output, const Value *filters)
+static bool add_application_filters(std::vector<FilterRecord> &output, const Value *filters, FilterRecordKind kind)
 {
 	if (!filters->IsObject())
 	{
@@ -276,19 +519,49 @@ static bool add_application_filters(std::unordered_map<std::string, AppInfo> &ou
 			return false;
 		}
 
-		AppInfo info;
-
+		// Only the version which matches the kind of filter is checked.
 		auto &value = itr->value;
-		info.minimum_api_version = default_get_member_uint(value, "minimumApiVersion");
-		info.minimum_engine_version = default_get_member_uint(value, "minimumEngineVersion");
-		info.minimum_application_version = default_get_member_uint(value, "minimumApplicationVersion");
-		output[itr->name.GetString()] = info;
+		FilterRecord record = {};
+		record.name_hash = hash_name(itr->name.GetString(), kind);
+		record.flags = kind == FILTER_RECORD_ENGINE ? FILTER_RECORD_ENGINE_BIT : 0;
+		record.minimum_api_version = default_get_member_uint(value, "minimumApiVersion");
+		record.minimum_version = default_get_member_uint(value, kind == FILTER_RECORD_ENGINE ?
+		                                                        "minimumEngineVersion" : "minimumApplicationVersion");
+		output.push_back(record);
 	}
 
 	return true;
 }
 
-bool ApplicationInfoFilter::Impl::parse(const std::string &path)
+static bool add_skipped_pipeline_hashes(std::vector<uint64_t> &output, const Value *hashes)
+{
+	if (!hashes->IsArray())
+	{
+		LOGE("Not an array.\n");
+		return false;
+	}
+
+	for (auto itr = hashes->Begin(); itr != hashes->End(); ++itr)
+	{
+		if (!itr->IsString())
+		{
+			LOGE("Not a string.\n");
+			return false;
+		}
+
+		char *end = nullptr;
+		output.push_back(strtoull(itr->GetString(), &end, 16));
+		if (!end || *end != '\0')
+		{
+			LOGE("Not a pipeline hash.\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ApplicationInfoFilter::Impl::parse(const std::string &path, std::vector<uint8_t> &output)
 {
 	auto buffer = read_file(path.c_str());
 
@@ -305,32 +578,64 @@ bool ApplicationInfoFilter::Impl::parse(const std::string &path)
 	if (!get_safe_member_int(doc, "version", json_int) || json_int != FOSSILIZE_APPLICATION_INFO_FILTER_VERSION)
 		return false;
 
+	std::vector<FilterRecord> records;
+	std::vector<uint64_t> skipped_hashes;
+
 	auto *blacklist = maybe_get_member(doc, "blacklistedApplicationNames");
 	if (blacklist)
-		if (!add_blacklists(blacklisted_application_names, blacklist))
+		if (!add_blacklists(records, blacklist, FILTER_RECORD_APPLICATION))
 			return false;
 	blacklist = maybe_get_member(doc, "blacklistedEngineNames");
 	if (blacklist)
-		if (!add_blacklists(blacklisted_engine_names, blacklist))
+		if (!add_blacklists(records, blacklist, FILTER_RECORD_ENGINE))
 			return false;
 
 	auto *filters = maybe_get_member(doc, "applicationFilters");
 	if (filters)
-		if (!add_application_filters(application_infos, filters))
+		if (!add_application_filters(records, filters, FILTER_RECORD_APPLICATION))
 			return false;
 	filters = maybe_get_member(doc, "engineFilters");
 	if (filters)
-		if (!add_application_filters(engine_infos, filters))
+		if (!add_application_filters(records, filters, FILTER_RECORD_ENGINE))
+			return false;
+
+	auto *hashes = maybe_get_member(doc, "skippedPipelineHashes");
+	if (hashes)
+		if (!add_skipped_pipeline_hashes(skipped_hashes, hashes))
 			return false;
 
+	output = build_compiled_filter(std::move(records), std::move(skipped_hashes));
 	return true;
 }
 
+static bool is_compiled_filter(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	uint8_t magic[sizeof(compiled_filter_magic)];
+	bool ret = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+	           memcmp(magic, compiled_filter_magic, sizeof(magic)) == 0;
+	fclose(file);
+	return ret;
+}
+
 void ApplicationInfoFilter::Impl::parse_async(const char *path_)
 {
+	// Mapping a precompiled filter is cheap, so there is nothing to wait for later.
+	if (is_compiled_filter(path_))
+	{
+		parsing_success = mapping.map(path_) && attach(mapping.data(), mapping.size());
+		if (!parsing_success)
+			LOGE("Invalid precompiled application info filter %s.\n", path_);
+		parsing_done = true;
+		return;
+	}
+
 	std::string path = path_;
 	task = std::async(std::launch::async, [this, path]() {
-		bool ret = parse(path);
+		bool ret = parse(path, compiled) && attach(compiled.data(), compiled.size());
 		parsing_success = ret;
 		parsing_done = true;
 	});
@@ -346,11 +651,38 @@ void ApplicationInfoFilter::parse_async(const char *path)
 	impl->parse_async(path);
 }
 
+bool ApplicationInfoFilter::compile(const char *json_path, const char *compiled_path)
+{
+	std::vector<uint8_t> compiled;
+	if (!Impl::parse(json_path, compiled))
+	{
+		LOGE("Failed to parse application info filter %s.\n", json_path);
+		return false;
+	}
+
+	FILE *file = fopen(compiled_path, "wb");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", compiled_path);
+		return false;
+	}
+
+	bool ret = fwrite(compiled.data(), 1, compiled.size(), file) == compiled.size();
+	if (fclose(file) != 0)
+		ret = false;
+	return ret;
+}
+
 bool ApplicationInfoFilter::test_application_info(const VkApplicationInfo *info)
 {
 	return impl->test_application_info(info);
 }
 
+bool ApplicationInfoFilter::test_pipeline_hash(uint64_t hash)
+{
+	return impl->test_pipeline_hash(hash);
+}
+
 bool ApplicationInfoFilter::check_success()
 {
 	return impl->check_success();
@@ -22,6 +22,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 struct VkApplicationInfo;
 
 // Allows us to blacklist which applications and which app/engine-versions we don't want to capture.
@@ -38,8 +40,13 @@ public:
 	// Path to a JSON file. This is done async to avoid stalling main thread.
 	// Any further query will block.
 	// Called by layer when an instance is created.
+	// If the file is a filter precompiled with compile(), it is memory mapped right away instead,
+	// and queries neither block nor allocate.
 	void parse_async(const char *path);
 
+	// Compiles a JSON filter into the precompiled format, which holds hashed names and version limits.
+	static bool compile(const char *json_path, const char *compiled_path);
+
 	// Checks if we were successful in parsing the JSON file.
 	bool check_success();
 
@@ -47,6 +54,12 @@ public:
 	// Blocks until parsing is complete. Called by recording thread when preparing for recording.
 	bool test_application_info(const VkApplicationInfo *info);
 
+	// Tests if a graphics or compute pipeline should be recorded.
+	// Pipelines listed in skippedPipelineHashes are checked against a bloom filter first,
+	// and hits are confirmed against the sorted list of hashes, so only listed pipelines are skipped.
+	// Blocks until parsing is complete like test_application_info(), which the recording thread calls first anyway.
+	bool test_pipeline_hash(uint64_t hash);
+
 private:
 	struct Impl;
 	Impl *impl;
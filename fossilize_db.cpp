@@ -25,19 +25,47 @@
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
+#else
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
 #endif
 
 #include "fossilize_db.hpp"
 #include "path.hpp"
+#include "file_mapping.hpp"
+#include "crc32c.hpp"
+#include "fossilize_profiling.hpp"
+#include "util/flat_hash_map.hpp"
+#include "util/sorted_hash_set.hpp"
 #include "layer/utils.hpp"
 #include "miniz.h"
+#ifdef FOSSILIZE_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef FOSSILIZE_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <dirent.h>
 #include <inttypes.h>
+#include <ctype.h>
+#include <string.h>
 
 using namespace std;
 
@@ -50,27 +78,12 @@ static_assert(FOSSILIZE_BLOB_HASH_LENGTH >= 32, "Blob hash length must be at lea
 
 namespace Fossilize
 {
-class ConditionalLockGuard
-{
-public:
-	ConditionalLockGuard(std::mutex &lock_, bool enable_)
-		: lock(lock_), enable(enable_)
-	{
-		if (enable)
-			lock.lock();
-	}
-
-	~ConditionalLockGuard()
-	{
-		if (enable)
-			lock.unlock();
-	}
-
-private:
-	std::mutex &lock;
-	bool enable;
-};
-
+// Blobs are stored as <base>/<aa>/<bb>/<tag>.<hash>.json, where aa and bb are the two upper bytes of the hash,
+// so no single directory grows huge. Directories written by older versions store blobs flat in <base>,
+// and those can still be read.
+// The set of blobs is cached in a manifest file of fixed-size "<tag>.<hash>\n" records, so prepare() only reads
+// one file rather than walking every directory. Writers append to the manifest.
+// If the manifest is missing or malformed, the directory is scanned instead. Delete the manifest to force a rescan.
 struct DumbDirectoryDatabase : DatabaseInterface
 {
 	DumbDirectoryDatabase(const string &base, DatabaseMode mode_)
@@ -78,39 +91,61 @@ struct DumbDirectoryDatabase : DatabaseInterface
 	{
 		if (mode == DatabaseMode::ExclusiveOverWrite)
 			mode = DatabaseMode::OverWrite;
+		else if (mode == DatabaseMode::ReadOnlyMemoryMap)
+			mode = DatabaseMode::ReadOnly;
+	}
+
+	~DumbDirectoryDatabase()
+	{
+		flush_manifest();
+		if (manifest)
+			fclose(manifest);
 	}
 
 	void flush() override
 	{
+		flush_manifest();
 	}
 
 	bool prepare() override
 	{
-		if (mode == DatabaseMode::OverWrite)
-			return true;
+		FOSSILIZE_PROFILE_ZONE("DumbDirectoryDatabase::prepare");
+		if (mode != DatabaseMode::ReadOnly)
+			make_directory(base_directory);
 
-		DIR *dp = opendir(base_directory.c_str());
-		if (!dp)
-			return false;
+		// OverWrite does not consider existing blobs, but we still need to know them to seed a manifest.
+		unordered_set<Hash> existing_blobs[RESOURCE_COUNT];
+		auto *blobs = mode == DatabaseMode::OverWrite ? existing_blobs : seen_blobs;
 
-		while (auto *pEntry = readdir(dp))
+		bool has_manifest = load_manifest(blobs);
+		if (!has_manifest)
 		{
-			if (pEntry->d_type != DT_REG)
-				continue;
-
-			unsigned tag;
-			uint64_t value;
-			if (sscanf(pEntry->d_name, "%x.%" SCNx64 ".json", &tag, &value) != 2)
-				continue;
+			for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+				blobs[tag].clear();
+			if (!scan_directory(base_directory, 0, blobs))
+				return false;
+		}
 
-			if (tag >= RESOURCE_COUNT)
-				continue;
+		if (mode == DatabaseMode::ReadOnly)
+			return true;
 
-			seen_blobs[tag].insert(value);
+		auto path = manifest_path();
+		manifest = fopen(path.c_str(), "ab");
+		if (!manifest)
+		{
+			LOGE("Failed to open manifest: %s\n", path.c_str());
+			return false;
 		}
 
-		closedir(dp);
-		return true;
+		// Unbuffered, so every flush of pending records is a single append, even with concurrent writers.
+		setvbuf(manifest, nullptr, _IONBF, 0);
+
+		if (!has_manifest)
+			for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+				for (auto hash : blobs[tag])
+					add_manifest_record(ResourceTag(tag), hash);
+
+		return flush_manifest();
 	}
 
 	bool has_entry(ResourceTag tag, Hash hash) override
@@ -120,6 +155,7 @@ struct DumbDirectoryDatabase : DatabaseInterface
 
 	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
 	{
+		FOSSILIZE_PROFILE_ZONE_HASH("DumbDirectoryDatabase::read_entry", hash);
 		if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
 			return false;
 
@@ -132,11 +168,15 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		if (!blob_size)
 			return false;
 
-		char filename[25]; // 2 digits + "." + 16 digits + ".json" + null
-		sprintf(filename, "%02x.%016" PRIx64 ".json", static_cast<unsigned>(tag), hash);
-		auto path = Path::join(base_directory, filename);
-
+		auto path = Path::join(base_directory, sharded_filename(tag, hash));
 		FILE *file = fopen(path.c_str(), "rb");
+		if (!file)
+		{
+			// Fall back to the flat layout.
+			path = Path::join(base_directory, flat_filename(tag, hash));
+			file = fopen(path.c_str(), "rb");
+		}
+
 		if (!file)
 		{
 			LOGE("Failed to open file: %s\n", path.c_str());
@@ -179,6 +219,7 @@ struct DumbDirectoryDatabase : DatabaseInterface
 
 	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
 	{
+		FOSSILIZE_PROFILE_ZONE_HASH("DumbDirectoryDatabase::write_entry", hash);
 		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
 			return false;
 
@@ -188,10 +229,13 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		if (has_entry(tag, hash))
 			return true;
 
-		char filename[25]; // 2 digits + "." + 16 digits + ".json" + null
-		sprintf(filename, "%02x.%016" PRIx64 ".json", static_cast<unsigned>(tag), hash);
-		auto path = Path::join(base_directory, filename);
+		if (!make_shard_directories(hash))
+		{
+			LOGE("Failed to create shard directories in %s.\n", base_directory.c_str());
+			return false;
+		}
 
+		auto path = Path::join(base_directory, sharded_filename(tag, hash));
 		FILE *file = fopen(path.c_str(), "wb");
 		if (!file)
 		{
@@ -207,6 +251,10 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		}
 
 		fclose(file);
+
+		add_manifest_record(tag, hash);
+		if (pending_manifest.size() >= ManifestFlushSize)
+			flush_manifest();
 		return true;
 	}
 
@@ -233,9 +281,162 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		return true;
 	}
 
+	// "<tag>.<hash>\n"
+	enum { ManifestRecordSize = 2 + 1 + 16 + 1 };
+	enum { ManifestFlushSize = 64 * 1024 };
+
+	string manifest_path() const
+	{
+		return Path::join(base_directory, "fossilize_manifest.txt");
+	}
+
+	static string flat_filename(ResourceTag tag, Hash hash)
+	{
+		char filename[25]; // 2 digits + "." + 16 digits + ".json" + null
+		sprintf(filename, "%02x.%016" PRIx64 ".json", static_cast<unsigned>(tag), hash);
+		return filename;
+	}
+
+	static string sharded_filename(ResourceTag tag, Hash hash)
+	{
+		char filename[31]; // 2 digits + "/" + 2 digits + "/" + 2 digits + "." + 16 digits + ".json" + null
+		sprintf(filename, "%02x/%02x/%02x.%016" PRIx64 ".json",
+		        unsigned(hash >> 56), unsigned((hash >> 48) & 0xff),
+		        static_cast<unsigned>(tag), hash);
+		return filename;
+	}
+
+	static bool make_directory(const string &path)
+	{
+#ifdef _WIN32
+		return CreateDirectoryA(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+		return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+	}
+
+	bool make_shard_directories(Hash hash)
+	{
+		unsigned shard = unsigned(hash >> 48);
+		if (created_shards.count(shard))
+			return true;
+
+		char name[3];
+		sprintf(name, "%02x", shard >> 8);
+		auto outer = Path::join(base_directory, name);
+		sprintf(name, "%02x", shard & 0xff);
+		if (!make_directory(outer) || !make_directory(Path::join(outer, name)))
+			return false;
+
+		created_shards.insert(shard);
+		return true;
+	}
+
+	void add_manifest_record(ResourceTag tag, Hash hash)
+	{
+		char record[ManifestRecordSize + 1];
+		sprintf(record, "%02x.%016" PRIx64 "\n", static_cast<unsigned>(tag), hash);
+		pending_manifest.insert(pending_manifest.end(), record, record + ManifestRecordSize);
+	}
+
+	bool flush_manifest()
+	{
+		if (!manifest || pending_manifest.empty())
+			return true;
+
+		bool ret = fwrite(pending_manifest.data(), 1, pending_manifest.size(), manifest) == pending_manifest.size();
+		if (!ret)
+			LOGE("Failed to append to manifest in %s.\n", base_directory.c_str());
+		pending_manifest.clear();
+		return ret;
+	}
+
+	bool load_manifest(unordered_set<Hash> *blobs)
+	{
+		auto path = manifest_path();
+		FILE *file = fopen(path.c_str(), "rb");
+		if (!file)
+			return false;
+
+		vector<char> contents;
+		if (fseek(file, 0, SEEK_END) == 0)
+		{
+			long file_size = ftell(file);
+			rewind(file);
+			if (file_size > 0)
+			{
+				contents.resize(size_t(file_size));
+				if (fread(contents.data(), 1, contents.size(), file) != contents.size())
+					contents.clear();
+			}
+		}
+		fclose(file);
+
+		// A torn record at the end is from an interrupted writer, its blob might not be complete either.
+		size_t record_count = contents.size() / ManifestRecordSize;
+		for (size_t i = 0; i < record_count; i++)
+		{
+			char record[ManifestRecordSize + 1];
+			memcpy(record, contents.data() + i * ManifestRecordSize, ManifestRecordSize);
+			record[ManifestRecordSize] = '\0';
+
+			unsigned tag;
+			uint64_t value;
+			if (record[2] != '.' || record[ManifestRecordSize - 1] != '\n' ||
+			    sscanf(record, "%02x.%016" SCNx64, &tag, &value) != 2 || tag >= RESOURCE_COUNT)
+			{
+				LOGE("Manifest in %s is malformed, scanning directory instead.\n", base_directory.c_str());
+				return false;
+			}
+
+			blobs[tag].insert(value);
+		}
+
+		return true;
+	}
+
+	bool scan_directory(const string &directory, unsigned depth, unordered_set<Hash> *blobs)
+	{
+		DIR *dp = opendir(directory.c_str());
+		if (!dp)
+			return false;
+
+		while (auto *pEntry = readdir(dp))
+		{
+			unsigned tag;
+			uint64_t value;
+
+			if (pEntry->d_type == DT_DIR)
+			{
+				// Shard directories are two hex digits.
+				if (depth < 2 && strlen(pEntry->d_name) == 2 &&
+				    isxdigit(uint8_t(pEntry->d_name[0])) && isxdigit(uint8_t(pEntry->d_name[1])))
+					scan_directory(Path::join(directory, pEntry->d_name), depth + 1, blobs);
+				continue;
+			}
+
+			if (pEntry->d_type != DT_REG)
+				continue;
+
+			if (sscanf(pEntry->d_name, "%x.%" SCNx64 ".json", &tag, &value) != 2)
+				continue;
+
+			if (tag >= RESOURCE_COUNT)
+				continue;
+
+			blobs[tag].insert(value);
+		}
+
+		closedir(dp);
+		return true;
+	}
+
 	string base_directory;
 	DatabaseMode mode;
 	unordered_set<Hash> seen_blobs[RESOURCE_COUNT];
+	unordered_set<unsigned> created_shards;
+	vector<char> pending_manifest;
+	FILE *manifest = nullptr;
 };
 
 DatabaseInterface *create_dumb_folder_database(const char *directory_path, DatabaseMode mode)
@@ -246,11 +447,27 @@ DatabaseInterface *create_dumb_folder_database(const char *directory_path, Datab
 
 struct ZipDatabase : DatabaseInterface
 {
+	struct Entry
+	{
+		unsigned index;
+		size_t size;
+		uint64_t local_header_offset;
+		uint64_t compressed_size;
+		uint32_t checksum;
+		uint16_t method;
+		bool direct;
+	};
+
 	ZipDatabase(const string &path_, DatabaseMode mode_)
 		: path(path_), mode(mode_)
 	{
 		if (mode == DatabaseMode::ExclusiveOverWrite)
 			mode = DatabaseMode::OverWrite;
+		else if (mode == DatabaseMode::ReadOnlyMemoryMap)
+		{
+			mode = DatabaseMode::ReadOnly;
+			use_memory_map = true;
+		}
 		mz_zip_zero_struct(&mz);
 	}
 
@@ -286,6 +503,7 @@ struct ZipDatabase : DatabaseInterface
 
 	bool prepare() override
 	{
+		FOSSILIZE_PROFILE_ZONE("ZipDatabase::prepare");
 		if (mode != DatabaseMode::OverWrite && mz_zip_reader_init_file(&mz, path.c_str(), 0))
 		{
 			// We have an existing archive.
@@ -309,6 +527,11 @@ struct ZipDatabase : DatabaseInterface
 				if (!mz_zip_reader_file_stat(&mz, i, &s))
 					continue;
 
+				// Plain stored or deflated entries can be decoded straight from the local entry, without miniz state.
+				bool direct = !s.m_is_encrypted && s.m_is_supported &&
+				              (s.m_method == 0 || s.m_method == MZ_DEFLATED) &&
+				              (s.m_method != 0 || s.m_comp_size == s.m_uncomp_size);
+
 				char tag_str[16 + 1] = {};
 				char value_str[16 + 1] = {};
 				memcpy(tag_str, filename + FOSSILIZE_BLOB_HASH_LENGTH - 32, 16);
@@ -318,7 +541,27 @@ struct ZipDatabase : DatabaseInterface
 				if (tag >= RESOURCE_COUNT)
 					continue;
 				uint64_t value = strtoull(value_str, nullptr, 16);
-				seen_blobs[tag].emplace(value, Entry{i, size_t(s.m_uncomp_size)});
+				seen_blobs[tag].emplace(value, Entry{i, size_t(s.m_uncomp_size),
+				                                     s.m_local_header_ofs, s.m_comp_size,
+				                                     uint32_t(s.m_crc32), uint16_t(s.m_method), direct});
+			}
+
+			if (mode == DatabaseMode::ReadOnly)
+			{
+				// The central directory is all we need from miniz. Entries are read at explicit offsets,
+				// so any number of threads can read and inflate at the same time.
+				if (!use_memory_map || !mapping.map(path.c_str()))
+				{
+					if (!reader.open(path.c_str()))
+					{
+						LOGE("Failed to open ZIP archive for reading.\n");
+						mz_zip_end(&mz);
+						return false;
+					}
+				}
+
+				alive = true;
+				return true;
 			}
 
 			// In-place update the archive. Should we consider emitting a new archive instead?
@@ -350,6 +593,7 @@ struct ZipDatabase : DatabaseInterface
 
 	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
 	{
+		FOSSILIZE_PROFILE_ZONE_HASH("ZipDatabase::read_entry", hash);
 		if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
 			return false;
 
@@ -373,6 +617,11 @@ struct ZipDatabase : DatabaseInterface
 
 		if (blob)
 		{
+			if (itr->second.direct)
+				return read_local_entry(itr->second, blob, flags);
+
+			// Fallback for anything we cannot decode ourselves. The miniz archive state is not thread-safe.
+			std::lock_guard<std::mutex> holder{extract_lock};
 			if (!mz_zip_reader_extract_to_mem(&mz, itr->second.index, blob, itr->second.size, 0))
 			{
 				LOGE("Failed to extract blob.\n");
@@ -383,8 +632,143 @@ struct ZipDatabase : DatabaseInterface
 		return true;
 	}
 
+	bool map_entry(ResourceTag tag, Hash hash, const void **data, size_t *size, PayloadReadFlags flags) override
+	{
+		if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
+			return false;
+
+		if (!alive || mode != DatabaseMode::ReadOnly || !mapping.is_mapped() || !data || !size)
+			return false;
+
+		auto itr = seen_blobs[tag].find(hash);
+		if (itr == end(seen_blobs[tag]))
+			return false;
+
+		// Only stored entries can be borrowed from the mapping.
+		auto &entry = itr->second;
+		if (!entry.direct || entry.method != 0)
+			return false;
+
+		uint64_t offset;
+		if (!get_local_data_offset(entry, &offset))
+			return false;
+		if (offset > mapping.size() || entry.size > mapping.size() - offset)
+			return false;
+
+		const uint8_t *ptr = mapping.data() + offset;
+		if ((flags & PAYLOAD_READ_SKIP_CHECKSUM_BIT) == 0 && mz_crc32(MZ_CRC32_INIT, ptr, entry.size) != entry.checksum)
+		{
+			LOGE("CRC mismatch in ZIP archive.\n");
+			return false;
+		}
+
+		*data = ptr;
+		*size = entry.size;
+		return true;
+	}
+
+	// Reads from either the memory mapping or the positional reader. Both are safe to use from any thread.
+	bool read_at(uint64_t offset, void *data, size_t size) const
+	{
+		if (mapping.is_mapped())
+		{
+			if (offset > mapping.size() || size > mapping.size() - offset)
+				return false;
+			memcpy(data, mapping.data() + offset, size);
+			return true;
+		}
+		else
+			return reader.read(offset, data, size);
+	}
+
+	static uint8_t *get_thread_read_buffer(size_t size)
+	{
+		static thread_local vector<uint8_t> read_buffer;
+		if (read_buffer.size() < size)
+			read_buffer.resize(size);
+		return read_buffer.data();
+	}
+
+	// Finds where the data of a stored or deflated entry begins.
+	bool get_local_data_offset(const Entry &entry, uint64_t *data_offset) const
+	{
+		// The local header repeats the file name, and has an extra field which may differ from the central directory.
+		// Layout from the ZIP APPNOTE, miniz does not expose it.
+		enum
+		{
+			LocalHeaderSize = 30,
+			LocalHeaderSignature = 0x04034b50,
+			LocalHeaderFilenameLengthOffset = 26,
+			LocalHeaderExtraLengthOffset = 28
+		};
+
+		uint8_t local_header[LocalHeaderSize];
+		if (!read_at(entry.local_header_offset, local_header, sizeof(local_header)))
+			return false;
+
+		const auto read_le16 = [&](unsigned offset) -> uint32_t {
+			return uint32_t(local_header[offset]) | (uint32_t(local_header[offset + 1]) << 8);
+		};
+
+		if ((read_le16(0) | (read_le16(2) << 16)) != LocalHeaderSignature)
+		{
+			LOGE("Corrupt local header in ZIP archive.\n");
+			return false;
+		}
+
+		*data_offset = entry.local_header_offset + LocalHeaderSize +
+		               read_le16(LocalHeaderFilenameLengthOffset) + read_le16(LocalHeaderExtraLengthOffset);
+		return true;
+	}
+
+	bool read_local_entry(const Entry &entry, void *blob, PayloadReadFlags flags) const
+	{
+		uint64_t offset;
+		if (!get_local_data_offset(entry, &offset))
+			return false;
+
+		if (entry.method == 0)
+		{
+			if (!read_at(offset, blob, entry.size))
+				return false;
+		}
+		else
+		{
+			const uint8_t *compressed;
+			if (mapping.is_mapped())
+			{
+				if (offset > mapping.size() || entry.compressed_size > mapping.size() - offset)
+					return false;
+				compressed = mapping.data() + offset;
+			}
+			else
+			{
+				uint8_t *read_buffer = get_thread_read_buffer(entry.compressed_size);
+				if (!read_at(offset, read_buffer, entry.compressed_size))
+					return false;
+				compressed = read_buffer;
+			}
+
+			if (tinfl_decompress_mem_to_mem(blob, entry.size, compressed, entry.compressed_size, 0) != entry.size)
+			{
+				LOGE("Failed to inflate blob.\n");
+				return false;
+			}
+		}
+
+		if ((flags & PAYLOAD_READ_SKIP_CHECKSUM_BIT) == 0 &&
+		    mz_crc32(MZ_CRC32_INIT, static_cast<const uint8_t *>(blob), entry.size) != entry.checksum)
+		{
+			LOGE("CRC mismatch in ZIP archive.\n");
+			return false;
+		}
+
+		return true;
+	}
+
 	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
 	{
+		FOSSILIZE_PROFILE_ZONE_HASH("ZipDatabase::write_entry", hash);
 		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
 			return false;
 
@@ -417,7 +801,7 @@ struct ZipDatabase : DatabaseInterface
 		}
 
 		// The index is irrelevant, we're not going to read from this archive any time soon.
-		seen_blobs[tag].emplace(hash, Entry{~0u, size});
+		seen_blobs[tag].emplace(hash, Entry{~0u, size, 0, 0, 0, 0, false});
 		return true;
 	}
 
@@ -452,14 +836,12 @@ struct ZipDatabase : DatabaseInterface
 	string path;
 	mz_zip_archive mz;
 
-	struct Entry
-	{
-		unsigned index;
-		size_t size;
-	};
-
 	unordered_map<Hash, Entry> seen_blobs[RESOURCE_COUNT];
+	FileMapping mapping;
+	PositionalFile reader;
+	std::mutex extract_lock;
 	DatabaseMode mode;
+	bool use_memory_map = false;
 	bool alive = false;
 };
 
@@ -476,20 +858,73 @@ static const uint8_t stream_reference_magic_and_version[16] = {
 	0, 0, 0, FOSSILIZE_FORMAT_VERSION, // 4 bytes to use for versioning.
 };
 
+static const uint8_t stream_index_magic[4] = { 'F', 'Z', 'I', 'X' };
+static const uint8_t stream_commit_magic[4] = { 'F', 'Z', 'C', 'M' };
+
 struct StreamArchive : DatabaseInterface
 {
 	enum { MagicSize = sizeof(stream_reference_magic_and_version) };
-	enum { FOSSILIZE_COMPRESSION_NONE = 1, FOSSILIZE_COMPRESSION_DEFLATE = 2 };
+	enum
+	{
+		FOSSILIZE_COMPRESSION_NONE = 1,
+		FOSSILIZE_COMPRESSION_DEFLATE = 2,
+		FOSSILIZE_COMPRESSION_ZSTD = 3,
+		FOSSILIZE_COMPRESSION_LZ4 = 4,
+		// zstd frame which requires a dictionary. The dictionary ID is encoded in the frame header.
+		FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY = 5,
+		FOSSILIZE_COMPRESSION_MASK = 0xff,
+
+		// Set in the format if the checksum is CRC32C rather than CRC32.
+		FOSSILIZE_CHECKSUM_CRC32C_BIT = 0x100
+	};
 
 	// All multi-byte entities are little-endian.
 
 	// A payload contains:
 	// 4 byte payload size (after the header).
-	// 4 byte identifier (compression type)
-	// 4 byte checksum of raw (compressed) payload (CRC32, from zlib)
+	// 4 byte identifier (compression type in the lower 8 bits, FOSSILIZE_CHECKSUM_CRC32C_BIT for the checksum type)
+	// 4 byte checksum of raw (compressed) payload (CRC32 from zlib, or CRC32C), 0 if there is no checksum
 	// 4 byte uncompressed size
 	// raw payload uint8[payload size].
 
+	// When a writable archive is closed, an index entry is appended to the archive.
+	// It uses a tag which is outside the resource tag range, so readers which do not understand it
+	// will simply skip over it. The payload is uncompressed and always checksummed. It contains:
+	// N records, sorted by tag and hash:
+	//   4 byte tag
+	//   8 byte hash
+	//   8 byte offset of the entry payload in the archive
+	//   16 byte payload header (as stored in the archive)
+	// 8 byte offset of the index entry itself (its name) in the archive
+	// 4 byte record count N
+	// 4 byte index magic
+	// The index is only considered valid if its trailer lines up exactly with the end of the file.
+	// If anything was appended after it (or the write was sliced), we fall back to scanning the archive,
+	// in which case the stale index entry is skipped like any other unknown entry.
+	//
+	// Compression dictionaries are stored as uncompressed entries with DictionaryTag.
+	// The hash is the resource tag the dictionary was made for in the upper 32 bits,
+	// and the zstd dictionary ID in the lower 32 bits. Dictionaries are also part of the index.
+	// Payloads compressed with a dictionary cannot be decoded by readers which do not understand them.
+	//
+	// With group commit, commit markers are appended with CommitTag after syncing the archive to disk.
+	// They have the same layout as the index, except that the records only cover entries written since the previous
+	// commit marker, and the trailer is:
+	// 8 byte offset of the commit marker itself (its name) in the archive
+	// 8 byte offset of the previous commit marker or index entry, or 0 if the records cover the entire archive
+	// 4 byte record count N
+	// 4 byte commit magic
+	// If there is no valid index, the last commit marker is found by searching backwards from the end of the archive,
+	// and the chain of commit markers is followed back to its start. Anything after the last commit marker is dropped.
+	enum { IndexTag = 0x10000, DictionaryTag = 0x10001, CommitTag = 0x10002 };
+	enum { IndexRecordSize = 4 + 8 + 8 + 16, IndexTrailerSize = 8 + 4 + 4, CommitTrailerSize = 8 + 8 + 4 + 4 };
+	// If no commit marker is found this close to the end of the archive, we fall back to scanning it.
+	enum { CommitSearchRange = 16 * 1024 * 1024 };
+	enum { WriteBufferSize = 1024 * 1024 };
+	enum { MaxCompressionJobsPerThread = 4, CompressionThreadNice = 10 };
+	// Batched reads merge entries which are at most ReadClusterMaxGap apart into one read.
+	enum { ReadClusterMaxGap = 64 * 1024, ReadClusterMaxSize = 16 * 1024 * 1024 };
+
 	struct PayloadHeader
 	{
 		uint32_t payload_size;
@@ -503,30 +938,138 @@ struct StreamArchive : DatabaseInterface
 		uint8_t data[4 * 4];
 	};
 
-	StreamArchive(const string &path_, DatabaseMode mode_)
-		: path(path_), mode(mode_)
+	// Compression output, and the compression context. The thread which writes entries and each compression worker
+	// have their own.
+	struct CompressionScratch
 	{
-	}
+		CompressionScratch() = default;
+		CompressionScratch(const CompressionScratch &) = delete;
+		void operator=(const CompressionScratch &) = delete;
 
-	~StreamArchive()
-	{
-		free(zlib_buffer);
-		if (file)
-			fclose(file);
-	}
+		~CompressionScratch()
+		{
+			free(buffer);
+#ifdef FOSSILIZE_HAVE_ZSTD
+			ZSTD_freeCCtx(zstd_cctx);
+#endif
+		}
+
+		uint8_t *buffer = nullptr;
+		size_t buffer_size = 0;
+#ifdef FOSSILIZE_HAVE_ZSTD
+		ZSTD_CCtx *zstd_cctx = nullptr;
+#endif
+	};
+
+	struct Entry
+	{
+		uint64_t offset;
+		PayloadHeader header;
+	};
+
+	// A range of the archive which has already been read into memory.
+	struct ReadWindow
+	{
+		uint64_t offset;
+		const uint8_t *data;
+		size_t size;
+	};
+
+	// An entry as recorded in the index and commit markers. tag is a resource tag or DictionaryTag.
+	struct IndexRecord
+	{
+		unsigned tag;
+		Hash hash;
+		Entry entry;
+	};
+
+	StreamArchive(const string &path_, DatabaseMode mode_)
+		: path(path_), mode(mode_)
+	{
+		if (mode == DatabaseMode::ReadOnlyMemoryMap)
+		{
+			mode = DatabaseMode::ReadOnly;
+			use_memory_map = true;
+		}
+	}
+
+	~StreamArchive()
+	{
+		if (!stop_compression_threads())
+			LOGE("Failed to write compressed entries to %s.\n", path.c_str());
+
+		if (alive && file && mode != DatabaseMode::ReadOnly)
+		{
+			if (index_dirty && !write_index())
+				LOGE("Failed to write index to %s.\n", path.c_str());
+			if (flush_write_buffer() && group_commit_enabled() && !sync_file())
+				LOGE("Failed to sync %s to disk.\n", path.c_str());
+		}
+
+		if (file)
+			fclose(file);
+
+#ifdef FOSSILIZE_HAVE_ZSTD
+		for (auto &dict : decompression_dictionaries)
+			ZSTD_freeDDict(dict.second);
+		for (auto &dict : compression_dictionaries)
+			for (auto *cdict : dict.second.cdicts)
+				ZSTD_freeCDict(cdict);
+		ZSTD_freeDCtx(zstd_dctx);
+#endif
+	}
 
 	void flush() override
 	{
-		if (file && mode != DatabaseMode::ReadOnly)
-			fflush(file);
+		if (alive && file && mode != DatabaseMode::ReadOnly)
+		{
+			if (!retire_compression_jobs(0))
+				LOGE("Failed to write compressed entries to %s.\n", path.c_str());
+			flush_write_buffer();
+			commit_if_due();
+		}
+	}
+
+	bool set_group_commit(unsigned max_entries, unsigned max_interval_ms) override
+	{
+		if (mode == DatabaseMode::ReadOnly)
+			return false;
+
+		// Entries written so far were not tracked, so the first commit has to cover everything.
+		if (!group_commit_enabled() && index_dirty)
+			last_commit_offset = 0;
+
+		commit_max_entries = max_entries;
+		commit_max_interval_ms = max_interval_ms;
+		if (!group_commit_enabled())
+			uncommitted.clear();
+		return true;
+	}
+
+	bool set_compression_threads(unsigned count) override
+	{
+		if (mode == DatabaseMode::ReadOnly)
+			return false;
+
+		if (!stop_compression_threads())
+			return false;
+
+		compression_shutdown = false;
+		for (unsigned i = 0; i < count; i++)
+			compression_threads.emplace_back(&StreamArchive::compression_worker, this);
+		return true;
 	}
 
 	bool prepare() override
 	{
+		FOSSILIZE_PROFILE_ZONE("StreamArchive::prepare");
 		switch (mode)
 		{
+		case DatabaseMode::ReadOnlyMemoryMap: // Translated to ReadOnly + use_memory_map in constructor.
 		case DatabaseMode::ReadOnly:
-			file = fopen(path.c_str(), "rb");
+			// Empty or unmappable archives fall back to positional reads.
+			if (!use_memory_map || !mapping.map(path.c_str()))
+				reader.open(path.c_str());
 			break;
 
 		case DatabaseMode::Append:
@@ -554,20 +1097,40 @@ struct StreamArchive : DatabaseInterface
 		}
 		}
 
-		if (!file)
+		if (!file && !mapping.is_mapped() && !reader.is_open())
+			return false;
+
+#ifndef _WIN32
+		// Writers hold an exclusive lock for as long as the archive is open,
+		// so compaction can tell which archives are still being written to.
+		// On Windows, nobody can open the file exclusively while we have it open, which serves the same purpose.
+		if (file && flock(fileno(file), LOCK_EX | LOCK_NB) < 0)
+		{
+			LOGE("Archive %s is locked by another process.\n", path.c_str());
 			return false;
+		}
+#endif
 
 		if (mode != DatabaseMode::OverWrite && mode != DatabaseMode::ExclusiveOverWrite)
 		{
 			// Scan through the archive and get the list of files.
-			fseek(file, 0, SEEK_END);
-			size_t len = ftell(file);
-			rewind(file);
+			size_t len;
+			if (mapping.is_mapped())
+				len = mapping.size();
+			else if (reader.is_open())
+				len = size_t(reader.size());
+			else
+			{
+				fseek(file, 0, SEEK_END);
+				len = ftell(file);
+				rewind(file);
+			}
 
+			size_t file_size = len;
 			if (len != 0)
 			{
 				uint8_t magic[MagicSize];
-				if (fread(magic, 1, MagicSize, file) != MagicSize)
+				if (!read_at(0, magic, MagicSize))
 					return false;
 
 				if (memcmp(magic, stream_reference_magic_and_version, MagicSize - 1))
@@ -575,10 +1138,24 @@ struct StreamArchive : DatabaseInterface
 				int version = magic[MagicSize - 1];
 				if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
 					return false;
+				format_version = unsigned(version);
 
 				size_t offset = MagicSize;
 				size_t begin_append_offset = len;
 
+				// If we have a valid index, there is no need to scan through the archive.
+				// Otherwise, the archive might have been written with group commit and not closed cleanly.
+				uint64_t committed_len = 0;
+				if (load_index(len))
+					offset = len;
+				else if (load_commits(len, committed_len))
+				{
+					if (committed_len != len)
+						LOGE("Dropping %" PRIu64 " bytes after the last commit.\n", uint64_t(len - committed_len));
+					len = size_t(committed_len);
+					offset = len;
+				}
+
 				while (offset < len)
 				{
 					begin_append_offset = offset;
@@ -595,12 +1172,12 @@ struct StreamArchive : DatabaseInterface
 					}
 
 					// NAME
-					if (fread(blob_name, 1, sizeof(blob_name), file) != sizeof(blob_name))
+					if (!read_at(offset, blob_name, sizeof(blob_name)))
 						return false;
 					offset += sizeof(blob_name);
 
 					// HEADER
-					if (fread(&header_raw, 1, sizeof(header_raw), file) != sizeof(header_raw))
+					if (!read_at(offset, &header_raw, sizeof(header_raw)))
 						return false;
 					offset += sizeof(header_raw);
 
@@ -627,242 +1204,1824 @@ struct StreamArchive : DatabaseInterface
 						entry.offset = offset;
 						seen_blobs[tag].emplace(value, entry);
 					}
-
-					if (fseek(file, header.payload_size, SEEK_CUR) < 0)
-						return false;
+					else if (tag == DictionaryTag)
+					{
+						uint64_t value = strtoull(value_str, nullptr, 16);
+						dictionaries.emplace(value, Entry{ offset, header });
+					}
 
 					offset += header.payload_size;
 				}
 
-				if (mode == DatabaseMode::Append && offset != len)
+				if (mode == DatabaseMode::Append)
 				{
-					if (fseek(file, begin_append_offset, SEEK_SET) < 0)
+					// Either drop the sliced entry, or continue appending at the end of the file.
+					write_offset = offset != len ? begin_append_offset : len;
+					if (fseek(file, write_offset, SEEK_SET) < 0)
+						return false;
+
+					// Get rid of whatever we dropped, or an index we write later would not line up with the end of the file.
+					if (write_offset != file_size && !truncate_file(write_offset))
 						return false;
 				}
 			}
+			else if (mode == DatabaseMode::ReadOnly)
+			{
+				// An empty archive is not a valid archive.
+				return false;
+			}
 			else
 			{
 				// Appending to a fresh file. Make sure we have the magic.
-				if (fwrite(stream_reference_magic_and_version, 1,
-				           sizeof(stream_reference_magic_and_version), file) != sizeof(stream_reference_magic_and_version))
+				if (!write_magic())
 					return false;
+				write_offset = MagicSize;
 			}
 		}
 		else
 		{
-			if (fwrite(stream_reference_magic_and_version, 1, sizeof(stream_reference_magic_and_version), file) !=
-			    sizeof(stream_reference_magic_and_version))
-			{
+			if (!write_magic())
 				return false;
-			}
+			write_offset = MagicSize;
 		}
 
+		if (mode == DatabaseMode::ReadOnly && !load_decompression_dictionaries())
+			return false;
+
+		// From here on, all writes go through our own staging buffer straight to the file descriptor.
+		if (file && !begin_direct_writes())
+			return false;
+
 		alive = true;
 		return true;
 	}
 
-	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
+	bool load_decompression_dictionaries()
 	{
-		if (!alive || mode != DatabaseMode::ReadOnly)
+		for (auto &dict : dictionaries)
+			if (!load_decompression_dictionary(dict.first, dict.second, nullptr))
+				return false;
+		return true;
+	}
+
+	bool load_decompression_dictionary(Hash hash, const Entry &entry, const ReadWindow *window)
+	{
+		auto &header = entry.header;
+		if (compression_format(header) != FOSSILIZE_COMPRESSION_NONE || header.payload_size != header.uncompressed_size)
 			return false;
 
-		auto itr = seen_blobs[tag].find(hash);
-		if (itr == end(seen_blobs[tag]))
+		vector<uint8_t> data(header.payload_size);
+		if (!decode_payload_uncompressed(data.data(), data.size(), entry, PAYLOAD_READ_NO_FLAGS, window))
 			return false;
 
-		if (!blob_size)
+#ifdef FOSSILIZE_HAVE_ZSTD
+		auto dict_id = uint32_t(hash);
+		if (decompression_dictionaries.count(dict_id))
+			return true;
+
+		auto *ddict = ZSTD_createDDict(data.data(), data.size());
+		if (!ddict)
+			return false;
+		decompression_dictionaries[dict_id] = ddict;
+#else
+		(void)hash;
+#endif
+		return true;
+	}
+
+	bool set_compression_dictionary(ResourceTag tag, const void *dictionary, size_t size) override
+	{
+		if (!alive || mode == DatabaseMode::ReadOnly)
 			return false;
 
-		uint32_t out_size = (flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0 ?
-		                    (itr->second.header.payload_size + sizeof(PayloadHeaderRaw)) :
-		                    itr->second.header.uncompressed_size;
+		// Workers must not see the dictionary change under them.
+		if (!retire_compression_jobs(0))
+			return false;
 
-		if (blob)
+#ifdef FOSSILIZE_HAVE_ZSTD
+		unsigned dict_id = ZSTD_getDictID_fromDict(dictionary, size);
+		if (dict_id == 0)
 		{
-			if (*blob_size != out_size)
-				return false;
+			LOGE("Compression dictionary does not have a dictionary ID.\n");
+			return false;
 		}
-		else
-			*blob_size = out_size;
 
-		if (blob)
+		Hash hash = (Hash(tag) << 32) | dict_id;
+		if (!dictionaries.count(hash))
 		{
-			if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
-			{
-				// Include the header.
-				ConditionalLockGuard holder(read_lock, (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0);
-				if (fseek(file, itr->second.offset - sizeof(PayloadHeaderRaw), SEEK_SET) < 0)
-					return false;
+			PayloadHeader header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, 0, uint32_t(size) };
+			compute_checksum(header, dictionary, size);
+			PayloadHeaderRaw raw = {};
+			convert_to_le(raw, header);
 
-				size_t read_size = itr->second.header.payload_size + sizeof(PayloadHeaderRaw);
-				if (fread(blob, 1, read_size, file) != read_size)
-					return false;
-			}
-			else
-			{
-				if (!decode_payload(blob, out_size, itr->second, (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0))
-					return false;
-			}
-		}
+			if (!write_blob_name(DictionaryTag, hash))
+				return false;
+			if (!write_data(&raw, sizeof(raw)))
+				return false;
+			if (!write_data(dictionary, size))
+				return false;
 
-		return true;
-	}
+			write_offset += FOSSILIZE_BLOB_HASH_LENGTH + sizeof(raw);
+			add_written_entry(DictionaryTag, hash, Entry{ write_offset, header });
+			write_offset += size;
+		}
 
-	static void convert_from_le(uint32_t *output, const uint8_t *le_input, unsigned word_count)
-	{
-		for (unsigned i = 0; i < word_count; i++)
+		auto &dict = compression_dictionaries[tag];
+		for (auto *&cdict : dict.cdicts)
 		{
-			uint32_t v =
-					(uint32_t(le_input[0]) << 0) |
-					(uint32_t(le_input[1]) << 8) |
-					(uint32_t(le_input[2]) << 16) |
-					(uint32_t(le_input[3]) << 24);
-
-			*output++ = v;
-			le_input += 4;
+			ZSTD_freeCDict(cdict);
+			cdict = nullptr;
 		}
+		auto *data = static_cast<const uint8_t *>(dictionary);
+		dict.data.assign(data, data + size);
+		return true;
+#else
+		(void)tag;
+		(void)dictionary;
+		(void)size;
+		return false;
+#endif
 	}
 
-	static void convert_from_le(PayloadHeader &header, const PayloadHeaderRaw &raw)
+	bool write_magic()
 	{
-		convert_from_le(&header.payload_size, raw.data + 0, 1);
-		convert_from_le(&header.format, raw.data + 4, 1);
-		convert_from_le(&header.crc, raw.data + 8, 1);
-		convert_from_le(&header.uncompressed_size, raw.data + 12, 1);
+		uint8_t magic[MagicSize];
+		memcpy(magic, stream_reference_magic_and_version, MagicSize);
+		magic[MagicSize - 1] = uint8_t(format_version);
+		return fwrite(magic, 1, MagicSize, file) == MagicSize;
 	}
 
-	static void convert_to_le(uint8_t *le_output, const uint32_t *value_input, unsigned count)
+	unsigned get_format_version() override
 	{
-		for (unsigned i = 0; i < count; i++)
+		if (alive || mode == DatabaseMode::OverWrite || mode == DatabaseMode::ExclusiveOverWrite)
+			return format_version;
+
+		// Only the header is needed, so do not bother with prepare().
+		unsigned version = FOSSILIZE_FORMAT_VERSION;
+		FILE *header_file = fopen(path.c_str(), "rb");
+		if (header_file)
 		{
-			uint32_t v = value_input[i];
-			*le_output++ = uint8_t((v >> 0) & 0xffu);
-			*le_output++ = uint8_t((v >> 8) & 0xffu);
-			*le_output++ = uint8_t((v >> 16) & 0xffu);
-			*le_output++ = uint8_t((v >> 24) & 0xffu);
+			uint8_t magic[MagicSize];
+			if (fread(magic, 1, MagicSize, header_file) == MagicSize &&
+			    memcmp(magic, stream_reference_magic_and_version, MagicSize - 1) == 0 &&
+			    magic[MagicSize - 1] <= FOSSILIZE_FORMAT_VERSION &&
+			    magic[MagicSize - 1] >= FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+			{
+				version = magic[MagicSize - 1];
+			}
+			fclose(header_file);
 		}
+		return version;
 	}
 
-	static void convert_to_le(PayloadHeaderRaw &raw, const PayloadHeader &header)
+	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
 	{
-		uint8_t *le_output = raw.data;
-		convert_to_le(le_output + 0, &header.payload_size, 1);
-		convert_to_le(le_output + 4, &header.format, 1);
-		convert_to_le(le_output + 8, &header.crc, 1);
-		convert_to_le(le_output + 12, &header.uncompressed_size, 1);
+		FOSSILIZE_PROFILE_ZONE_HASH("StreamArchive::read_entry", hash);
+		if (!alive || mode != DatabaseMode::ReadOnly)
+			return false;
+
+		Entry entry;
+		if (!find_entry(tag, hash, entry))
+			return false;
+
+		return read_payload(entry, blob_size, blob, flags, nullptr);
 	}
 
-	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	bool map_entry(ResourceTag tag, Hash hash, const void **data, size_t *size, PayloadReadFlags flags) override
 	{
-		if (!alive || mode == DatabaseMode::ReadOnly)
+		if (!alive || mode != DatabaseMode::ReadOnly || !mapping.is_mapped() || !data || !size)
+			return false;
+		if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
 			return false;
 
-		auto itr = seen_blobs[tag].find(hash);
-		if (itr != end(seen_blobs[tag]))
-			return true;
+		Entry entry;
+		if (!find_entry(tag, hash, entry))
+			return false;
 
-		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
-		sprintf(str, "%0*x", FOSSILIZE_BLOB_HASH_LENGTH - 16, tag);
-		sprintf(str + FOSSILIZE_BLOB_HASH_LENGTH - 16, "%016" PRIx64, hash);
+		if ((entry.header.format & ~uint32_t(FOSSILIZE_COMPRESSION_MASK | FOSSILIZE_CHECKSUM_CRC32C_BIT)) != 0 ||
+		    compression_format(entry.header) != FOSSILIZE_COMPRESSION_NONE ||
+		    entry.header.payload_size != entry.header.uncompressed_size)
+			return false;
 
-		if (fwrite(str, 1, FOSSILIZE_BLOB_HASH_LENGTH, file) != FOSSILIZE_BLOB_HASH_LENGTH)
+		// The mapping lives as long as the archive, so there is nothing to release.
+		auto *ptr = direct_pointer(entry.offset, entry.header.payload_size, nullptr);
+		if (!ptr || !verify_checksum(entry.header, ptr, entry.header.payload_size, flags))
 			return false;
 
-		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
-		{
-			// The raw payload already contains the header, so just dump it straight to disk.
-			if (size < sizeof(PayloadHeaderRaw))
-				return false;
-			if (fwrite(blob, 1, size, file) != size)
-				return false;
-		}
-		else if ((flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
-		{
-			auto compressed_bound = mz_compressBound(size);
+		*data = ptr;
+		*size = entry.header.payload_size;
+		return true;
+	}
 
-			if (zlib_buffer_size < compressed_bound)
-			{
-				auto *new_zlib_buffer = static_cast<uint8_t *>(realloc(zlib_buffer, compressed_bound));
-				if (new_zlib_buffer)
-				{
-					zlib_buffer = new_zlib_buffer;
-					zlib_buffer_size = compressed_bound;
-				}
-				else
-				{
-					free(zlib_buffer);
-					zlib_buffer = nullptr;
-					zlib_buffer_size = 0;
-				}
-			}
+	bool read_entries(DatabaseEntryRead *reads, size_t count, PayloadReadFlags flags) override
+	{
+		if (!alive || mode != DatabaseMode::ReadOnly)
+			return false;
 
-			if (!zlib_buffer)
-				return false;
+		struct PendingRead
+		{
+			DatabaseEntryRead *read;
+			Entry entry;
+		};
 
-			PayloadHeader header = {};
-			PayloadHeaderRaw header_raw = {};
-			header.uncompressed_size = uint32_t(size);
-			header.format = FOSSILIZE_COMPRESSION_DEFLATE;
+		vector<PendingRead> pending;
+		pending.reserve(count);
 
-			mz_ulong zsize = zlib_buffer_size;
-			if (mz_compress2(zlib_buffer, &zsize, static_cast<const unsigned char *>(blob), size,
-			                 (flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0 ? MZ_BEST_COMPRESSION : MZ_BEST_SPEED) != MZ_OK)
+		for (size_t i = 0; i < count; i++)
+		{
+			Entry entry;
+			if (!find_entry(reads[i].tag, reads[i].hash, entry))
 				return false;
 
-			header.payload_size = uint32_t(zsize);
-			if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
-				header.crc = uint32_t(mz_crc32(MZ_CRC32_INIT, zlib_buffer, zsize));
+			// Size queries never touch the disk.
+			if (!reads[i].buffer)
+			{
+				if (!read_payload(entry, &reads[i].size, nullptr, flags, nullptr))
+					return false;
+			}
+			else
+				pending.push_back({ &reads[i], entry });
+		}
 
-			convert_to_le(header_raw, header);
-			if (fwrite(&header_raw, 1, sizeof(header_raw), file) != sizeof(header_raw))
-				return false;
+		sort(begin(pending), end(pending), [](const PendingRead &a, const PendingRead &b) {
+			return a.entry.offset < b.entry.offset;
+		});
 
-			if (fwrite(zlib_buffer, 1, header.payload_size, file) != header.payload_size)
-				return false;
+		// With a memory mapping, reading in file order is all we can do.
+		if (mapping.is_mapped())
+		{
+			for (auto &read : pending)
+				if (!read_payload(read.entry, &read.read->size, read.read->buffer, flags, nullptr))
+					return false;
+			return true;
 		}
-		else
+
+		// Entries which are close together on disk are fetched with one large read,
+		// and decoded from memory after that.
+		const uint64_t entry_header_size = FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		vector<uint8_t> window_buffer;
+
+		size_t cluster_begin = 0;
+		while (cluster_begin < pending.size())
 		{
-			uint32_t crc = 0;
-			if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
-				crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<const unsigned char *>(blob), size));
+			uint64_t range_begin = pending[cluster_begin].entry.offset - entry_header_size;
+			uint64_t range_end = pending[cluster_begin].entry.offset + pending[cluster_begin].entry.header.payload_size;
+			size_t cluster_end = cluster_begin + 1;
 
-			PayloadHeader header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, crc, uint32_t(size) };
-			PayloadHeaderRaw raw = {};
-			convert_to_le(raw, header);
+			while (cluster_end < pending.size())
+			{
+				auto &entry = pending[cluster_end].entry;
+				uint64_t next_begin = entry.offset - entry_header_size;
+				uint64_t next_end = entry.offset + entry.header.payload_size;
+				if (next_begin > range_end + ReadClusterMaxGap || next_end - range_begin > ReadClusterMaxSize)
+					break;
+				if (next_end > range_end)
+					range_end = next_end;
+				cluster_end++;
+			}
 
-			if (fwrite(&raw, 1, sizeof(raw), file) != sizeof(raw))
-				return false;
+			ReadWindow window = {};
+			if (cluster_end - cluster_begin > 1)
+			{
+				window_buffer.resize(size_t(range_end - range_begin));
+				if (!read_at(range_begin, window_buffer.data(), window_buffer.size()))
+					return false;
+				window = { range_begin, window_buffer.data(), window_buffer.size() };
+			}
 
-			if (fwrite(blob, 1, size, file) != size)
-				return false;
+			for (size_t i = cluster_begin; i < cluster_end; i++)
+			{
+				auto &read = pending[i];
+				if (!read_payload(read.entry, &read.read->size, read.read->buffer, flags, window.data ? &window : nullptr))
+					return false;
+			}
+
+			cluster_begin = cluster_end;
 		}
 
-		// The entry is irrelevant, we're not going to read from this archive any time soon.
-		seen_blobs[tag].emplace(hash, Entry{});
 		return true;
 	}
 
-	bool has_entry(ResourceTag tag, Hash hash) override
+	void prefetch_entries(ResourceTag tag, const Hash *hashes, size_t count) override
 	{
-		return seen_blobs[tag].count(hash) != 0;
-	}
+		if (!alive || mode != DatabaseMode::ReadOnly)
+			return;
 
-	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *hash_count, Hash *hashes) override
-	{
-		size_t size = seen_blobs[tag].size();
-		if (hashes)
+		struct Range
 		{
-			if (size != *hash_count)
-				return false;
-		}
-		else
-			*hash_count = size;
+			uint64_t begin;
+			uint64_t end;
+		};
+
+		vector<Range> ranges;
+		ranges.reserve(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			Entry entry;
+			if (find_entry(tag, hashes[i], entry))
+				ranges.push_back({ entry.offset, entry.offset + entry.header.payload_size });
+		}
+
+		sort(begin(ranges), end(ranges), [](const Range &a, const Range &b) {
+			return a.begin < b.begin;
+		});
+
+		// Issue as few hints as we can, it is fine if we pull in some entries we did not ask for.
+		size_t range_index = 0;
+		while (range_index < ranges.size())
+		{
+			Range range = ranges[range_index++];
+			while (range_index < ranges.size() && ranges[range_index].begin <= range.end + ReadClusterMaxGap)
+			{
+				if (ranges[range_index].end > range.end)
+					range.end = ranges[range_index].end;
+				range_index++;
+			}
+
+			if (mapping.is_mapped())
+				mapping.prefetch(size_t(range.begin), size_t(range.end - range.begin));
+			else
+				reader.prefetch(range.begin, range.end - range.begin);
+		}
+	}
+
+	bool for_each_entry(DatabaseEntryVisitor &visitor, PayloadReadFlags flags) override
+	{
+		if (mode != DatabaseMode::ReadOnly)
+			return false;
+
+		if (!alive)
+			return stream_entries(visitor, flags);
+
+		struct Record
+		{
+			ResourceTag tag;
+			Hash hash;
+			Entry entry;
+		};
+
+		vector<Record> records;
+		for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+		{
+			for_each_seen_blob(tag, [&](Hash hash, const Entry &entry) {
+				records.push_back({ static_cast<ResourceTag>(tag), hash, entry });
+			});
+		}
+
+		sort(begin(records), end(records), [](const Record &a, const Record &b) {
+			return a.entry.offset < b.entry.offset;
+		});
+
+		vector<uint8_t> blob;
+		for (auto &record : records)
+		{
+			size_t blob_size = 0;
+			if (!read_payload(record.entry, &blob_size, nullptr, flags, nullptr))
+				return false;
+			blob.resize(blob_size);
+			if (!read_payload(record.entry, &blob_size, blob.data(), flags, nullptr))
+				return false;
+			if (!visitor.visit_entry(record.tag, record.hash, blob.data(), blob.size()))
+				return false;
+		}
+
+		return true;
+	}
+
+	// Reads the archive front to back, only holding on to one entry at a time.
+	bool stream_entries(DatabaseEntryVisitor &visitor, PayloadReadFlags flags)
+	{
+		FILE *stream = fopen(path.c_str(), "rb");
+		if (!stream)
+			return false;
+
+		// A large stdio buffer keeps the reads sequential and big.
+		setvbuf(stream, nullptr, _IOFBF, ReadClusterMaxGap);
+
+		uint8_t magic[MagicSize];
+		if (fread(magic, 1, MagicSize, stream) != MagicSize ||
+		    memcmp(magic, stream_reference_magic_and_version, MagicSize - 1) != 0 ||
+		    magic[MagicSize - 1] > FOSSILIZE_FORMAT_VERSION ||
+		    magic[MagicSize - 1] < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+		{
+			fclose(stream);
+			return false;
+		}
+
+		// The window holds the payload header followed by the payload of the current entry.
+		vector<uint8_t> window_buffer;
+		vector<uint8_t> blob;
+		uint64_t offset = MagicSize;
+		bool success = true;
+
+		for (;;)
+		{
+			char blob_name[FOSSILIZE_BLOB_HASH_LENGTH];
+			PayloadHeaderRaw header_raw = {};
+			if (fread(blob_name, 1, sizeof(blob_name), stream) != sizeof(blob_name) ||
+			    fread(&header_raw, 1, sizeof(header_raw), stream) != sizeof(header_raw))
+			{
+				break;
+			}
+
+			PayloadHeader header = {};
+			convert_from_le(header, header_raw);
+
+			window_buffer.resize(sizeof(header_raw) + header.payload_size);
+			memcpy(window_buffer.data(), &header_raw, sizeof(header_raw));
+			if (fread(window_buffer.data() + sizeof(header_raw), 1, header.payload_size, stream) != header.payload_size)
+			{
+				LOGE("Detected sliced file. Dropping entries from here.\n");
+				break;
+			}
+
+			offset += sizeof(blob_name);
+			ReadWindow window = { offset, window_buffer.data(), window_buffer.size() };
+			offset += sizeof(header_raw);
+			Entry entry = { offset, header };
+			offset += header.payload_size;
+
+			char tag_str[16 + 1] = {};
+			char value_str[16 + 1] = {};
+			memcpy(tag_str, blob_name + FOSSILIZE_BLOB_HASH_LENGTH - 32, 16);
+			memcpy(value_str, blob_name + FOSSILIZE_BLOB_HASH_LENGTH - 16, 16);
+			auto tag = unsigned(strtoul(tag_str, nullptr, 16));
+			uint64_t value = strtoull(value_str, nullptr, 16);
+
+			// Dictionaries are always written before the payloads which use them.
+			if (tag == DictionaryTag && !load_decompression_dictionary(value, entry, &window))
+			{
+				success = false;
+				break;
+			}
+
+			if (tag >= RESOURCE_COUNT)
+				continue;
+
+			size_t blob_size = 0;
+			if (!read_payload(entry, &blob_size, nullptr, flags, &window))
+			{
+				success = false;
+				break;
+			}
+
+			const void *data;
+			if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0 &&
+			    compression_format(header) != FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY)
+			{
+				// Raw payloads can be passed on straight from the window.
+				data = window_buffer.data();
+			}
+			else
+			{
+				blob.resize(blob_size);
+				if (!read_payload(entry, &blob_size, blob.data(), flags, &window))
+				{
+					success = false;
+					break;
+				}
+				data = blob.data();
+			}
+
+			if (!visitor.visit_entry(static_cast<ResourceTag>(tag), value, data, blob_size))
+			{
+				success = false;
+				break;
+			}
+		}
+
+		fclose(stream);
+		return success;
+	}
+
+	bool read_payload(const Entry &entry, size_t *blob_size, void *blob, PayloadReadFlags flags,
+	                  const ReadWindow *window)
+	{
+		if (!blob_size)
+			return false;
+
+		// Payloads which depend on a dictionary cannot be transferred as-is to other archives,
+		// since the target archive would not have the dictionary.
+		// Decode them and pass them on as uncompressed payloads instead.
+		bool raw = (flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0;
+		bool decode_raw = raw && compression_format(entry.header) == FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY;
+		uint32_t out_size = raw ?
+		                    ((decode_raw ? entry.header.uncompressed_size : entry.header.payload_size) +
+		                     sizeof(PayloadHeaderRaw)) :
+		                    entry.header.uncompressed_size;
+
+		if (blob)
+		{
+			if (*blob_size != out_size)
+				return false;
+		}
+		else
+			*blob_size = out_size;
+
+		if (blob)
+		{
+			if (decode_raw)
+			{
+				auto *raw_header = static_cast<PayloadHeaderRaw *>(blob);
+				auto *payload = static_cast<uint8_t *>(blob) + sizeof(PayloadHeaderRaw);
+				size_t payload_size = entry.header.uncompressed_size;
+				if (!decode_payload(payload, payload_size, entry, flags, window))
+					return false;
+
+				PayloadHeader header = { uint32_t(payload_size), FOSSILIZE_COMPRESSION_NONE, 0, uint32_t(payload_size) };
+				compute_checksum(header, payload, payload_size);
+				convert_to_le(*raw_header, header);
+			}
+			else if (raw)
+			{
+				// Include the header.
+				size_t read_size = entry.header.payload_size + sizeof(PayloadHeaderRaw);
+				uint64_t read_offset = entry.offset - sizeof(PayloadHeaderRaw);
+				if (!read_at(read_offset, blob, read_size, window))
+					return false;
+			}
+			else
+			{
+				if (!decode_payload(blob, out_size, entry, flags, window))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	static void convert_from_le(uint32_t *output, const uint8_t *le_input, unsigned word_count)
+	{
+		for (unsigned i = 0; i < word_count; i++)
+		{
+			uint32_t v =
+					(uint32_t(le_input[0]) << 0) |
+					(uint32_t(le_input[1]) << 8) |
+					(uint32_t(le_input[2]) << 16) |
+					(uint32_t(le_input[3]) << 24);
+
+			*output++ = v;
+			le_input += 4;
+		}
+	}
+
+	static void convert_from_le(PayloadHeader &header, const PayloadHeaderRaw &raw)
+	{
+		convert_from_le(&header.payload_size, raw.data + 0, 1);
+		convert_from_le(&header.format, raw.data + 4, 1);
+		convert_from_le(&header.crc, raw.data + 8, 1);
+		convert_from_le(&header.uncompressed_size, raw.data + 12, 1);
+	}
+
+	static void convert_to_le(uint8_t *le_output, const uint32_t *value_input, unsigned count)
+	{
+		for (unsigned i = 0; i < count; i++)
+		{
+			uint32_t v = value_input[i];
+			*le_output++ = uint8_t((v >> 0) & 0xffu);
+			*le_output++ = uint8_t((v >> 8) & 0xffu);
+			*le_output++ = uint8_t((v >> 16) & 0xffu);
+			*le_output++ = uint8_t((v >> 24) & 0xffu);
+		}
+	}
+
+	static void convert_to_le(PayloadHeaderRaw &raw, const PayloadHeader &header)
+	{
+		uint8_t *le_output = raw.data;
+		convert_to_le(le_output + 0, &header.payload_size, 1);
+		convert_to_le(le_output + 4, &header.format, 1);
+		convert_to_le(le_output + 8, &header.crc, 1);
+		convert_to_le(le_output + 12, &header.uncompressed_size, 1);
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	{
+		FOSSILIZE_PROFILE_ZONE_HASH("StreamArchive::write_entry", hash);
+		if (!alive || mode == DatabaseMode::ReadOnly)
+			return false;
+
+		if (seen_blobs[tag].count(hash))
+			return true;
+
+		if (!compression_threads.empty() &&
+		    (flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) == 0 &&
+		    (flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
+		{
+			return queue_compression_job(tag, hash, blob, size, flags);
+		}
+
+		if (!write_blob_name(tag, hash))
+			return false;
+
+		PayloadHeader header = {};
+
+		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
+		{
+			// The raw payload already contains the header, so just dump it straight to disk.
+			if (size < sizeof(PayloadHeaderRaw))
+				return false;
+			convert_from_le(header, *static_cast<const PayloadHeaderRaw *>(blob));
+			if (header.payload_size != size - sizeof(PayloadHeaderRaw))
+				return false;
+			if (!write_data(blob, size))
+				return false;
+		}
+		else if ((flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
+		{
+			PayloadHeaderRaw header_raw = {};
+			if (!compress_payload(compression_scratch, tag, blob, size, flags, header))
+				return false;
+
+			convert_to_le(header_raw, header);
+			if (!write_data(&header_raw, sizeof(header_raw)))
+				return false;
+
+			if (!write_data(compression_scratch.buffer, header.payload_size))
+				return false;
+		}
+		else
+		{
+			header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, 0, uint32_t(size) };
+			if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
+				compute_checksum(header, blob, size);
+			PayloadHeaderRaw raw = {};
+			convert_to_le(raw, header);
+
+			if (!write_data(&raw, sizeof(raw)))
+				return false;
+
+			if (!write_data(blob, size))
+				return false;
+		}
+
+		// Keep track of where the entry was placed so we can write an index later.
+		write_offset += FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		add_written_entry(tag, hash, Entry{ write_offset, header });
+		write_offset += header.payload_size;
+		return commit_if_due();
+	}
+
+	// Compression jobs keep their own copy of the payload, since write_entry() returns before they are done.
+	// They are written out in the order they were queued, so the archive layout does not depend on scheduling.
+	struct CompressionJob
+	{
+		ResourceTag tag;
+		Hash hash;
+		PayloadWriteFlags flags;
+		vector<uint8_t> blob;
+		vector<uint8_t> payload;
+		PayloadHeader header;
+		bool done;
+		bool success;
+	};
+
+	bool queue_compression_job(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags)
+	{
+		if (pending_blobs[tag].count(hash))
+			return true;
+
+		// Write out whatever is done, and bound the amount of memory held by jobs in flight.
+		if (!retire_compression_jobs(MaxCompressionJobsPerThread * compression_threads.size()))
+			return false;
+
+#ifdef FOSSILIZE_HAVE_ZSTD
+		// Dictionaries are created lazily, which must not happen on the workers.
+		if (select_compression_format(flags) == FOSSILIZE_COMPRESSION_ZSTD)
+			get_compression_dictionary(tag, (flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0);
+#endif
+
+		auto *data = static_cast<const uint8_t *>(blob);
+		unique_ptr<CompressionJob> job(new CompressionJob{ tag, hash, flags, vector<uint8_t>(data, data + size), {}, {}, false, false });
+		pending_blobs[tag].emplace(hash, true);
+
+		{
+			lock_guard<mutex> holder{compression_lock};
+			compression_todo.push_back(job.get());
+			compression_jobs.push_back(move(job));
+		}
+		compression_cond.notify_one();
+		return true;
+	}
+
+	// Writes completed jobs in order, waiting for them until at most max_in_flight jobs remain.
+	bool retire_compression_jobs(size_t max_in_flight)
+	{
+		bool ret = true;
+		unique_lock<mutex> holder{compression_lock};
+		while (!compression_jobs.empty())
+		{
+			auto *job = compression_jobs.front().get();
+			if (!job->done)
+			{
+				if (compression_jobs.size() <= max_in_flight)
+					break;
+				compression_done_cond.wait(holder, [job]() { return job->done; });
+			}
+
+			unique_ptr<CompressionJob> done_job = move(compression_jobs.front());
+			compression_jobs.pop_front();
+			holder.unlock();
+
+			pending_blobs[done_job->tag].erase(done_job->hash);
+			if (!done_job->success)
+			{
+				LOGE("Failed to compress entry %016" PRIx64 ".\n", done_job->hash);
+				ret = false;
+			}
+			else if (ret && !write_compressed_entry(*done_job))
+				ret = false;
+
+			holder.lock();
+		}
+		return ret;
+	}
+
+	bool write_compressed_entry(const CompressionJob &job)
+	{
+		if (!alive)
+			return false;
+
+		PayloadHeaderRaw header_raw = {};
+		convert_to_le(header_raw, job.header);
+		if (!write_blob_name(job.tag, job.hash))
+			return false;
+		if (!write_data(&header_raw, sizeof(header_raw)))
+			return false;
+		if (!write_data(job.payload.data(), job.header.payload_size))
+			return false;
+
+		write_offset += FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		add_written_entry(job.tag, job.hash, Entry{ write_offset, job.header });
+		write_offset += job.header.payload_size;
+		return commit_if_due();
+	}
+
+	static void lower_compression_thread_priority()
+	{
+#ifdef _WIN32
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#elif defined(__linux__)
+		// The nice value is per thread on Linux, and 0 refers to the calling thread.
+		// Failing to lower it is harmless.
+		(void)setpriority(PRIO_PROCESS, 0, CompressionThreadNice);
+#endif
+	}
+
+	void compression_worker()
+	{
+		lower_compression_thread_priority();
+
+		CompressionScratch scratch;
+		unique_lock<mutex> holder{compression_lock};
+		for (;;)
+		{
+			compression_cond.wait(holder, [this]() { return compression_shutdown || !compression_todo.empty(); });
+			if (compression_todo.empty())
+				break;
+
+			auto *job = compression_todo.front();
+			compression_todo.pop_front();
+			holder.unlock();
+
+			bool success = compress_payload(scratch, job->tag, job->blob.data(), job->blob.size(), job->flags, job->header);
+			if (success)
+				job->payload.assign(scratch.buffer, scratch.buffer + job->header.payload_size);
+			job->blob.clear();
+			job->blob.shrink_to_fit();
+
+			holder.lock();
+			job->success = success;
+			job->done = true;
+			compression_done_cond.notify_one();
+		}
+	}
+
+	// Writes out all queued jobs and joins the workers.
+	bool stop_compression_threads()
+	{
+		if (compression_threads.empty())
+			return true;
+
+		bool ret = retire_compression_jobs(0);
+		{
+			lock_guard<mutex> holder{compression_lock};
+			compression_shutdown = true;
+		}
+		compression_cond.notify_all();
+		for (auto &thread : compression_threads)
+			thread.join();
+		compression_threads.clear();
+		return ret;
+	}
+
+	void add_written_entry(unsigned tag, Hash hash, const Entry &entry)
+	{
+		if (tag == DictionaryTag)
+			dictionaries.emplace(hash, entry);
+		else
+			seen_blobs[tag].emplace(hash, entry);
+		index_dirty = true;
+
+		if (group_commit_enabled())
+		{
+			if (uncommitted.empty())
+				oldest_uncommitted = chrono::steady_clock::now();
+			uncommitted.push_back({ tag, hash, entry });
+		}
+	}
+
+	bool group_commit_enabled() const
+	{
+		return commit_max_entries != 0 || commit_max_interval_ms != 0;
+	}
+
+	bool commit_if_due()
+	{
+		if (uncommitted.empty())
+			return true;
+
+		bool due = commit_max_entries != 0 && uncommitted.size() >= commit_max_entries;
+		if (!due && commit_max_interval_ms != 0)
+		{
+			auto elapsed = chrono::steady_clock::now() - oldest_uncommitted;
+			due = elapsed >= chrono::milliseconds(commit_max_interval_ms);
+		}
+
+		return !due || commit();
+	}
+
+	// Syncs everything written so far, then appends a commit marker which covers it. The marker is not synced,
+	// it becomes durable along with the next commit, or when the archive is closed.
+	// Since a marker is only written once the data it covers is on disk,
+	// any marker which survives a crash can be trusted.
+	bool commit()
+	{
+		if (!flush_write_buffer())
+			return false;
+
+		if (!sync_file())
+		{
+			LOGE("Failed to sync %s to disk.\n", path.c_str());
+			return false;
+		}
+
+		// Without a previous commit marker or index to chain to, this marker must cover the entire archive.
+		vector<IndexRecord> records;
+		if (last_commit_offset == 0)
+			records = get_index_records();
+		else
+			swap(records, uncommitted);
+
+		uint64_t commit_offset = write_offset;
+		uint8_t trailer[CommitTrailerSize];
+		uint32_t count = uint32_t(records.size());
+		write_le64(trailer, commit_offset);
+		write_le64(trailer + 8, last_commit_offset);
+		convert_to_le(trailer + 16, &count, 1);
+		memcpy(trailer + 20, stream_commit_magic, sizeof(stream_commit_magic));
+
+		if (!write_record_entry(CommitTag, records, trailer, sizeof(trailer)) || !flush_write_buffer())
+			return false;
+
+		last_commit_offset = commit_offset;
+		uncommitted.clear();
+		return true;
+	}
+
+	bool sync_file()
+	{
+#ifdef _WIN32
+		return _commit(write_fd) == 0;
+#elif defined(__APPLE__)
+		return fsync(write_fd) == 0;
+#else
+		return fdatasync(write_fd) == 0;
+#endif
+	}
+
+	bool truncate_file(uint64_t size)
+	{
+		if (fflush(file) != 0)
+			return false;
+#ifdef _WIN32
+		return _chsize_s(_fileno(file), int64_t(size)) == 0;
+#else
+		return ftruncate(fileno(file), off_t(size)) == 0;
+#endif
+	}
+
+	// Appends all entries of source which are not already present, without decoding them.
+	// Consecutive entries are copied as one byte range, file to file where the platform allows it.
+	bool copy_raw_entries_from(StreamArchive &source)
+	{
+		return copy_raw_entries_from(source, [](unsigned, Hash) { return true; });
+	}
+
+	// Only copies the entries for which filter(tag, hash) returns true.
+	template <typename Filter>
+	bool copy_raw_entries_from(StreamArchive &source, const Filter &filter)
+	{
+		if (!retire_compression_jobs(0))
+			return false;
+
+		if (!alive || mode == DatabaseMode::ReadOnly || !source.alive || source.mode != DatabaseMode::ReadOnly)
+			return false;
+
+		struct Record
+		{
+			unsigned tag;
+			Hash hash;
+			Entry entry;
+		};
+
+		vector<Record> candidates;
+		for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+		{
+			source.for_each_seen_blob(tag, [&](Hash hash, const Entry &entry) {
+				if (!seen_blobs[tag].count(hash) && filter(tag, hash))
+					candidates.push_back({ tag, hash, entry });
+			});
+		}
+
+		vector<Record> records;
+		for (auto &candidate : candidates)
+		{
+			if (compression_format(candidate.entry.header) == FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY)
+			{
+				// The dictionary does not come along, so these have to be decoded.
+				auto resource_tag = static_cast<ResourceTag>(candidate.tag);
+				size_t blob_size = 0;
+				if (!source.read_entry(resource_tag, candidate.hash, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+					return false;
+				vector<uint8_t> raw_blob(blob_size);
+				if (!source.read_entry(resource_tag, candidate.hash, &blob_size, raw_blob.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+					return false;
+				if (!write_entry(resource_tag, candidate.hash, raw_blob.data(), raw_blob.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+					return false;
+			}
+			else
+				records.push_back(candidate);
+		}
+
+		sort(begin(records), end(records), [](const Record &a, const Record &b) {
+			return a.entry.offset < b.entry.offset;
+		});
+
+		const uint64_t entry_header_size = FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+
+		size_t run_begin = 0;
+		while (run_begin < records.size())
+		{
+			// Entries are stored back to back, so find the longest run of entries we need.
+			uint64_t range_begin = records[run_begin].entry.offset - entry_header_size;
+			uint64_t range_end = records[run_begin].entry.offset + records[run_begin].entry.header.payload_size;
+			size_t run_end = run_begin + 1;
+			while (run_end < records.size() && records[run_end].entry.offset - entry_header_size == range_end)
+			{
+				range_end = records[run_end].entry.offset + records[run_end].entry.header.payload_size;
+				run_end++;
+			}
+
+			uint64_t range_size = range_end - range_begin;
+			if (source.mapping.is_mapped())
+			{
+				if (range_end > source.mapping.size())
+					return false;
+				if (!write_data(source.mapping.data() + range_begin, size_t(range_size)))
+					return false;
+			}
+			else
+			{
+				if (!flush_write_buffer())
+					return false;
+				if (!source.reader.copy_to_fd(range_begin, range_size, write_fd))
+				{
+					write_failed = true;
+					return false;
+				}
+			}
+
+			for (size_t i = run_begin; i < run_end; i++)
+			{
+				auto &record = records[i];
+				add_written_entry(record.tag, record.hash,
+				                  Entry{ write_offset + (record.entry.offset - range_begin), record.entry.header });
+			}
+
+			write_offset += range_size;
+			run_begin = run_end;
+		}
+
+		return commit_if_due();
+	}
+
+	static unsigned select_compression_format(PayloadWriteFlags flags)
+	{
+#ifdef FOSSILIZE_HAVE_ZSTD
+		if ((flags & PAYLOAD_WRITE_COMPRESS_ZSTD_BIT) != 0)
+			return FOSSILIZE_COMPRESSION_ZSTD;
+#endif
+#ifdef FOSSILIZE_HAVE_LZ4
+		if ((flags & PAYLOAD_WRITE_COMPRESS_LZ4_BIT) != 0)
+			return FOSSILIZE_COMPRESSION_LZ4;
+#endif
+		(void)flags;
+		return FOSSILIZE_COMPRESSION_DEFLATE;
+	}
+
+	static size_t compress_bound(unsigned format, size_t size)
+	{
+		switch (format)
+		{
+#ifdef FOSSILIZE_HAVE_ZSTD
+		case FOSSILIZE_COMPRESSION_ZSTD:
+			return ZSTD_compressBound(size);
+#endif
+#ifdef FOSSILIZE_HAVE_LZ4
+		case FOSSILIZE_COMPRESSION_LZ4:
+			return size <= LZ4_MAX_INPUT_SIZE ? size_t(LZ4_compressBound(int(size))) : 0;
+#endif
+		default:
+			return mz_compressBound(size);
+		}
+	}
+
+	// Compresses blob into scratch.buffer and fills in the payload header.
+	// Besides looking up compression dictionaries, this only touches scratch, so compression workers can call it.
+	bool compress_payload(CompressionScratch &scratch, ResourceTag tag, const void *blob, size_t size, PayloadWriteFlags flags, PayloadHeader &header)
+	{
+		unsigned format = select_compression_format(flags);
+		auto compressed_bound = compress_bound(format, size);
+		if (!compressed_bound)
+			return false;
+
+		if (scratch.buffer_size < compressed_bound)
+		{
+			auto *new_buffer = static_cast<uint8_t *>(realloc(scratch.buffer, compressed_bound));
+			if (new_buffer)
+			{
+				scratch.buffer = new_buffer;
+				scratch.buffer_size = compressed_bound;
+			}
+			else
+			{
+				free(scratch.buffer);
+				scratch.buffer = nullptr;
+				scratch.buffer_size = 0;
+			}
+		}
+
+		if (!scratch.buffer)
+			return false;
+
+		bool best = (flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0;
+		size_t zsize = 0;
+
+		switch (format)
+		{
+#ifdef FOSSILIZE_HAVE_ZSTD
+		case FOSSILIZE_COMPRESSION_ZSTD:
+		{
+			auto *cdict = get_compression_dictionary(tag, best);
+			if (cdict)
+			{
+				if (!scratch.zstd_cctx)
+					scratch.zstd_cctx = ZSTD_createCCtx();
+				if (!scratch.zstd_cctx)
+					return false;
+				zsize = ZSTD_compress_usingCDict(scratch.zstd_cctx, scratch.buffer, scratch.buffer_size, blob, size, cdict);
+				format = FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY;
+			}
+			else
+				zsize = ZSTD_compress(scratch.buffer, scratch.buffer_size, blob, size, best ? 19 : 3);
+
+			if (ZSTD_isError(zsize))
+				return false;
+			break;
+		}
+#endif
+
+#ifdef FOSSILIZE_HAVE_LZ4
+		case FOSSILIZE_COMPRESSION_LZ4:
+		{
+			int lz4_size;
+			if (best)
+			{
+				lz4_size = LZ4_compress_HC(static_cast<const char *>(blob), reinterpret_cast<char *>(scratch.buffer),
+				                           int(size), int(scratch.buffer_size), LZ4HC_CLEVEL_DEFAULT);
+			}
+			else
+			{
+				lz4_size = LZ4_compress_default(static_cast<const char *>(blob), reinterpret_cast<char *>(scratch.buffer),
+				                                int(size), int(scratch.buffer_size));
+			}
+
+			if (lz4_size <= 0)
+				return false;
+			zsize = size_t(lz4_size);
+			break;
+		}
+#endif
+
+		default:
+		{
+			mz_ulong mz_size = scratch.buffer_size;
+			if (mz_compress2(scratch.buffer, &mz_size, static_cast<const unsigned char *>(blob), size,
+			                 best ? MZ_BEST_COMPRESSION : MZ_BEST_SPEED) != MZ_OK)
+				return false;
+			zsize = mz_size;
+			break;
+		}
+		}
+
+		(void)tag;
+		header.payload_size = uint32_t(zsize);
+		header.format = format;
+		header.uncompressed_size = uint32_t(size);
+		header.crc = 0;
+		if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
+			compute_checksum(header, scratch.buffer, zsize);
+		return true;
+	}
+
+	static uint32_t compression_format(const PayloadHeader &header)
+	{
+		return header.format & FOSSILIZE_COMPRESSION_MASK;
+	}
+
+	// Prefer CRC32C when we can compute it in hardware, it is far cheaper than zlib's CRC32.
+	// Either way, readers support both.
+	static void compute_checksum(PayloadHeader &header, const void *data, size_t size)
+	{
+		if (crc32c_is_hardware_accelerated())
+		{
+			header.format |= FOSSILIZE_CHECKSUM_CRC32C_BIT;
+			header.crc = crc32c(0, data, size);
+		}
+		else
+		{
+			header.format &= ~uint32_t(FOSSILIZE_CHECKSUM_CRC32C_BIT);
+			header.crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<const unsigned char *>(data), size));
+		}
+	}
+
+	static bool verify_checksum(const PayloadHeader &header, const void *data, size_t size, PayloadReadFlags flags)
+	{
+		if (header.crc == 0 || (flags & PAYLOAD_READ_SKIP_CHECKSUM_BIT) != 0)
+			return true;
+
+		uint32_t disk_crc;
+		if ((header.format & FOSSILIZE_CHECKSUM_CRC32C_BIT) != 0)
+			disk_crc = crc32c(0, data, size);
+		else
+			disk_crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<const unsigned char *>(data), size));
+
+		if (disk_crc != header.crc)
+		{
+			LOGE("CRC mismatch!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+#ifdef FOSSILIZE_HAVE_ZSTD
+	ZSTD_CDict *get_compression_dictionary(ResourceTag tag, bool best)
+	{
+		auto itr = compression_dictionaries.find(tag);
+		if (itr == end(compression_dictionaries))
+			return nullptr;
+
+		auto &cdict = itr->second.cdicts[best ? 1 : 0];
+		if (!cdict)
+			cdict = ZSTD_createCDict(itr->second.data.data(), itr->second.data.size(), best ? 19 : 3);
+		return cdict;
+	}
+#endif
+
+	bool begin_direct_writes()
+	{
+		if (fflush(file) != 0)
+			return false;
+
+#ifdef _WIN32
+		write_fd = _fileno(file);
+		if (write_fd < 0 || _lseeki64(write_fd, int64_t(write_offset), SEEK_SET) < 0)
+			return false;
+#else
+		write_fd = fileno(file);
+		if (write_fd < 0 || lseek(write_fd, off_t(write_offset), SEEK_SET) < 0)
+			return false;
+#endif
+
+		write_buffer.reserve(WriteBufferSize);
+		return true;
+	}
+
+	// Writes a, followed by b. On POSIX, this is a single writev() where possible.
+	bool write_vectored(const void *a, size_t a_size, const void *b, size_t b_size)
+	{
+#ifdef _WIN32
+		const auto write_all = [this](const void *data, size_t size) -> bool {
+			auto *ptr = static_cast<const uint8_t *>(data);
+			while (size)
+			{
+				unsigned to_write = size > 0x40000000u ? 0x40000000u : unsigned(size);
+				int ret = _write(write_fd, ptr, to_write);
+				if (ret <= 0)
+					return false;
+				ptr += ret;
+				size -= size_t(ret);
+			}
+			return true;
+		};
+		return write_all(a, a_size) && write_all(b, b_size);
+#else
+		auto *a_ptr = static_cast<const uint8_t *>(a);
+		auto *b_ptr = static_cast<const uint8_t *>(b);
+
+		while (a_size || b_size)
+		{
+			iovec iov[2];
+			int count = 0;
+			if (a_size)
+				iov[count++] = { const_cast<uint8_t *>(a_ptr), a_size };
+			if (b_size)
+				iov[count++] = { const_cast<uint8_t *>(b_ptr), b_size };
+
+			ssize_t ret = writev(write_fd, iov, count);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return false;
+
+			auto written = size_t(ret);
+			size_t from_a = written < a_size ? written : a_size;
+			a_ptr += from_a;
+			a_size -= from_a;
+			written -= from_a;
+			b_ptr += written;
+			b_size -= written;
+		}
+
+		return true;
+#endif
+	}
+
+	// Entries are staged in write_buffer and only hit the file once the buffer fills up, or on flush().
+	// A process which dies in the middle will leave a sliced entry at the end, which prepare() drops.
+	bool write_data(const void *data, size_t size)
+	{
+		if (write_failed)
+			return false;
+
+		if (write_buffer.size() + size <= WriteBufferSize)
+		{
+			auto *ptr = static_cast<const uint8_t *>(data);
+			write_buffer.insert(end(write_buffer), ptr, ptr + size);
+			return true;
+		}
+
+		// Write out the staged data along with the new data, so large payloads are never copied.
+		bool ret = write_vectored(write_buffer.data(), write_buffer.size(), data, size);
+		write_buffer.clear();
+		if (!ret)
+			write_failed = true;
+		return ret;
+	}
+
+	bool flush_write_buffer()
+	{
+		if (write_failed)
+			return false;
+		if (write_buffer.empty())
+			return true;
+
+		bool ret = write_vectored(write_buffer.data(), write_buffer.size(), nullptr, 0);
+		write_buffer.clear();
+		if (!ret)
+			write_failed = true;
+		return ret;
+	}
+
+	bool write_blob_name(unsigned tag, Hash hash)
+	{
+		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
+		sprintf(str, "%0*x", FOSSILIZE_BLOB_HASH_LENGTH - 16, tag);
+		sprintf(str + FOSSILIZE_BLOB_HASH_LENGTH - 16, "%016" PRIx64, hash);
+		return write_data(str, FOSSILIZE_BLOB_HASH_LENGTH);
+	}
+
+	static void write_le64(uint8_t *le_output, uint64_t value)
+	{
+		for (unsigned i = 0; i < 8; i++)
+			le_output[i] = uint8_t((value >> (8 * i)) & 0xffu);
+	}
+
+	static uint64_t read_le64(const uint8_t *le_input)
+	{
+		uint64_t v = 0;
+		for (unsigned i = 0; i < 8; i++)
+			v |= uint64_t(le_input[i]) << (8 * i);
+		return v;
+	}
+
+	vector<IndexRecord> get_index_records() const
+	{
+		vector<IndexRecord> records;
+		for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+			for (auto &blob : seen_blobs[tag])
+				records.push_back({ tag, blob.first, blob.second });
+		for (auto &dict : dictionaries)
+			records.push_back({ DictionaryTag, dict.first, dict.second });
+		return records;
+	}
+
+	// Appends an index or commit marker entry, starting at write_offset.
+	bool write_record_entry(unsigned entry_tag, const vector<IndexRecord> &records, const uint8_t *trailer, size_t trailer_size)
+	{
+		// If any write failed along the way, we cannot trust the offsets we have tracked.
+		if (write_failed)
+			return false;
+
+		vector<uint8_t> payload(records.size() * IndexRecordSize + trailer_size);
+		uint8_t *ptr = payload.data();
+		for (auto &record : records)
+		{
+			uint32_t tag = record.tag;
+			convert_to_le(ptr, &tag, 1);
+			write_le64(ptr + 4, record.hash);
+			write_le64(ptr + 12, record.entry.offset);
+			PayloadHeaderRaw raw = {};
+			convert_to_le(raw, record.entry.header);
+			memcpy(ptr + 20, raw.data, sizeof(raw.data));
+			ptr += IndexRecordSize;
+		}
+		memcpy(ptr, trailer, trailer_size);
+
+		uint32_t payload_size = uint32_t(payload.size());
+		uint32_t crc = uint32_t(mz_crc32(MZ_CRC32_INIT, payload.data(), payload.size()));
+		PayloadHeader header = { payload_size, FOSSILIZE_COMPRESSION_NONE, crc, payload_size };
+		PayloadHeaderRaw raw = {};
+		convert_to_le(raw, header);
+
+		if (!write_blob_name(entry_tag, 0))
+			return false;
+		if (!write_data(&raw, sizeof(raw)))
+			return false;
+		if (!write_data(payload.data(), payload.size()))
+			return false;
+
+		write_offset += FOSSILIZE_BLOB_HASH_LENGTH + sizeof(raw) + payload.size();
+		return true;
+	}
+
+	bool write_index()
+	{
+		auto records = get_index_records();
+		sort(begin(records), end(records), [](const IndexRecord &a, const IndexRecord &b) {
+			if (a.tag != b.tag)
+				return a.tag < b.tag;
+			return a.hash < b.hash;
+		});
+
+		uint8_t trailer[IndexTrailerSize];
+		uint32_t count = uint32_t(records.size());
+		write_le64(trailer, write_offset);
+		convert_to_le(trailer + 8, &count, 1);
+		memcpy(trailer + 12, stream_index_magic, sizeof(stream_index_magic));
+
+		if (!write_record_entry(IndexTag, records, trailer, sizeof(trailer)))
+			return false;
+
+		index_dirty = false;
+		return true;
+	}
+
+	// Reads and validates an index or commit marker entry at entry_offset.
+	// On success, entry_tag is IndexTag or CommitTag, payload holds its records, followed by its trailer,
+	// and end_offset is the offset just past the entry.
+	bool read_record_entry(uint64_t entry_offset, unsigned &entry_tag, vector<uint8_t> &payload, uint32_t &count,
+	                       uint64_t &end_offset)
+	{
+		char blob_name[FOSSILIZE_BLOB_HASH_LENGTH];
+		PayloadHeaderRaw header_raw = {};
+		PayloadHeader header = {};
+		if (!read_at(entry_offset, blob_name, sizeof(blob_name)))
+			return false;
+		if (!read_at(entry_offset + sizeof(blob_name), &header_raw, sizeof(header_raw)))
+			return false;
+		convert_from_le(header, header_raw);
+
+		char tag_str[16 + 1] = {};
+		memcpy(tag_str, blob_name + FOSSILIZE_BLOB_HASH_LENGTH - 32, 16);
+		entry_tag = unsigned(strtoul(tag_str, nullptr, 16));
+
+		size_t trailer_size;
+		const uint8_t *magic;
+		if (entry_tag == IndexTag)
+		{
+			trailer_size = IndexTrailerSize;
+			magic = stream_index_magic;
+		}
+		else if (entry_tag == CommitTag)
+		{
+			trailer_size = CommitTrailerSize;
+			magic = stream_commit_magic;
+		}
+		else
+			return false;
+
+		if (header.format != FOSSILIZE_COMPRESSION_NONE || header.payload_size < trailer_size ||
+		    header.payload_size != header.uncompressed_size)
+			return false;
+
+		// Cheap sanity check of the entry size, before we read all of it.
+		if ((header.payload_size - trailer_size) % IndexRecordSize != 0)
+			return false;
+
+		uint64_t payload_offset = entry_offset + sizeof(blob_name) + sizeof(header_raw);
+		payload.resize(header.payload_size);
+		if (!read_at(payload_offset, payload.data(), payload.size()))
+			return false;
+
+		const uint8_t *trailer = payload.data() + payload.size() - trailer_size;
+		if (memcmp(trailer + trailer_size - 4, magic, 4) != 0 || read_le64(trailer) != entry_offset)
+			return false;
+
+		convert_from_le(&count, trailer + trailer_size - 8, 1);
+		if (uint64_t(count) * IndexRecordSize + trailer_size != payload.size())
+			return false;
+
+		if (uint32_t(mz_crc32(MZ_CRC32_INIT, payload.data(), payload.size())) != header.crc)
+		{
+			LOGE("CRC mismatch in archive index, scanning archive instead.\n");
+			return false;
+		}
+
+		end_offset = payload_offset + payload.size();
+		return true;
+	}
+
+	// Records must describe entries which are fully contained in the part of the archive which precedes limit_offset.
+	bool add_index_records(const uint8_t *ptr, uint32_t count, uint64_t limit_offset)
+	{
+		for (uint32_t i = 0; i < count; i++, ptr += IndexRecordSize)
+		{
+			uint32_t tag;
+			Hash hash;
+			Entry entry;
+			decode_index_record(ptr, tag, hash, entry);
+
+			bool valid = (tag < RESOURCE_COUNT || tag == DictionaryTag) &&
+			             entry.offset >= MagicSize + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw) &&
+			             entry.offset + entry.header.payload_size <= limit_offset;
+
+			if (!valid)
+			{
+				LOGE("Invalid record in archive index, scanning archive instead.\n");
+				return false;
+			}
+
+			if (tag == DictionaryTag)
+				dictionaries.emplace(hash, entry);
+			else
+				seen_blobs[tag].emplace(hash, entry);
+		}
+
+		return true;
+	}
+
+	void clear_entries()
+	{
+		for (auto &blobs : seen_blobs)
+			blobs.clear();
+		dictionaries.clear();
+		attached_index = nullptr;
+	}
+
+	static void decode_index_record(const uint8_t *ptr, uint32_t &tag, Hash &hash, Entry &entry)
+	{
+		convert_from_le(&tag, ptr, 1);
+		hash = read_le64(ptr + 4);
+		entry = {};
+		entry.offset = read_le64(ptr + 12);
+		PayloadHeaderRaw header_raw = {};
+		memcpy(header_raw.data, ptr + 20, sizeof(header_raw.data));
+		convert_from_le(entry.header, header_raw);
+	}
+
+	// Uses the index records in place. This requires them to be sorted by tag and hash,
+	// which is how write_index lays them out. Otherwise, we fall back to add_index_records.
+	bool attach_index_records(const uint8_t *ptr, uint32_t count, uint64_t limit_offset)
+	{
+		uint32_t ranges[RESOURCE_COUNT][2] = {};
+		uint32_t prev_tag = 0;
+		Hash prev_hash = 0;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t tag;
+			Hash hash;
+			Entry entry;
+			decode_index_record(ptr + size_t(i) * IndexRecordSize, tag, hash, entry);
+
+			bool valid = (tag < RESOURCE_COUNT || tag == DictionaryTag) &&
+			             entry.offset >= MagicSize + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw) &&
+			             entry.offset + entry.header.payload_size <= limit_offset;
+			bool sorted = i == 0 || tag > prev_tag || (tag == prev_tag && hash > prev_hash);
+
+			if (!valid || !sorted)
+			{
+				dictionaries.clear();
+				return false;
+			}
+
+			if (tag == DictionaryTag)
+				dictionaries.emplace(hash, entry);
+			else
+			{
+				if (i == 0 || tag != prev_tag)
+					ranges[tag][0] = i;
+				ranges[tag][1] = i + 1;
+			}
+
+			prev_tag = tag;
+			prev_hash = hash;
+		}
+
+		attached_index = ptr;
+		memcpy(attached_ranges, ranges, sizeof(ranges));
+		return true;
+	}
+
+	bool find_entry(unsigned tag, Hash hash, Entry &entry) const
+	{
+		if (!attached_index)
+		{
+			auto *found = seen_blobs[tag].find(hash);
+			if (!found)
+				return false;
+			entry = *found;
+			return true;
+		}
+
+		uint32_t lo = attached_ranges[tag][0];
+		uint32_t hi = attached_ranges[tag][1];
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (read_le64(attached_index + size_t(mid) * IndexRecordSize + 4) < hash)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == attached_ranges[tag][1])
+			return false;
+
+		uint32_t found_tag;
+		Hash found_hash;
+		decode_index_record(attached_index + size_t(lo) * IndexRecordSize, found_tag, found_hash, entry);
+		return found_hash == hash;
+	}
+
+	size_t entry_count(unsigned tag) const
+	{
+		if (attached_index)
+			return attached_ranges[tag][1] - attached_ranges[tag][0];
+		else
+			return seen_blobs[tag].size();
+	}
+
+	template <typename Func>
+	void for_each_seen_blob(unsigned tag, const Func &func) const
+	{
+		if (attached_index)
+		{
+			for (uint32_t i = attached_ranges[tag][0]; i < attached_ranges[tag][1]; i++)
+			{
+				uint32_t record_tag;
+				Hash hash;
+				Entry entry;
+				decode_index_record(attached_index + size_t(i) * IndexRecordSize, record_tag, hash, entry);
+				func(hash, entry);
+			}
+		}
+		else
+		{
+			for (auto &blob : seen_blobs[tag])
+				func(blob.first, blob.second);
+		}
+	}
+
+	bool load_index(size_t len)
+	{
+		if (len < MagicSize + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw) + IndexTrailerSize)
+			return false;
+
+		uint8_t trailer[IndexTrailerSize];
+		if (!read_at(len - IndexTrailerSize, trailer, sizeof(trailer)))
+			return false;
+		if (memcmp(trailer + 12, stream_index_magic, sizeof(stream_index_magic)) != 0)
+			return false;
+
+		uint64_t index_offset = read_le64(trailer);
+		if (index_offset < MagicSize || index_offset >= len)
+			return false;
+
+		vector<uint8_t> payload;
+		unsigned entry_tag;
+		uint32_t count;
+		uint64_t end_offset;
+		if (!read_record_entry(index_offset, entry_tag, payload, count, end_offset) ||
+		    entry_tag != IndexTag || end_offset != len)
+			return false;
+
+		// A mapped archive can serve lookups straight from the index, so processes which open
+		// the same archive share its pages rather than each building their own tables.
+		if (mapping.is_mapped() && attach_index_records(mapping.data() + (end_offset - payload.size()), count, index_offset))
+		{
+			last_commit_offset = index_offset;
+			return true;
+		}
+
+		if (!add_index_records(payload.data(), count, index_offset))
+		{
+			clear_entries();
+			return false;
+		}
+
+		last_commit_offset = index_offset;
+		return true;
+	}
+
+	// Finds the last commit marker in the archive, and follows the chain of commit markers back to its start.
+	// On success, committed_len is the offset just past the last commit marker.
+	bool load_commits(size_t len, uint64_t &committed_len)
+	{
+		uint64_t commit_offset = 0;
+		if (!find_last_commit(len, commit_offset, committed_len))
+			return false;
+
+		uint64_t offset = commit_offset;
+		vector<uint8_t> payload;
+		for (;;)
+		{
+			unsigned entry_tag;
+			uint32_t count;
+			uint64_t end_offset;
+			if (!read_record_entry(offset, entry_tag, payload, count, end_offset) ||
+			    !add_index_records(payload.data(), count, offset))
+			{
+				clear_entries();
+				return false;
+			}
+
+			// An index covers the entire archive before it.
+			if (entry_tag == IndexTag)
+				break;
+
+			uint64_t prev_offset = read_le64(payload.data() + payload.size() - CommitTrailerSize + 8);
+			if (prev_offset == 0)
+				break;
+
+			// The chain must move backwards, or a corrupt marker could send us around in circles.
+			if (prev_offset < MagicSize || prev_offset >= offset)
+			{
+				clear_entries();
+				return false;
+			}
+			offset = prev_offset;
+		}
+
+		last_commit_offset = commit_offset;
+		return true;
+	}
+
+	// Searches backwards from the end of the archive for a commit marker trailer.
+	bool find_last_commit(size_t len, uint64_t &commit_offset, uint64_t &end_offset)
+	{
+		const uint64_t min_len = MagicSize + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw) + CommitTrailerSize;
+		if (len < min_len)
+			return false;
+
+		uint64_t search_begin = len - min_len > CommitSearchRange ? len - CommitSearchRange : min_len;
+
+		// Chunks overlap by the size of the magic, so we don't miss a magic which straddles two chunks.
+		const size_t chunk_size = 64 * 1024;
+		const size_t magic_size = sizeof(stream_commit_magic);
+		vector<uint8_t> chunk(chunk_size + magic_size);
+
+		uint64_t chunk_end = len;
+		while (chunk_end > search_begin)
+		{
+			uint64_t chunk_begin = chunk_end - search_begin > chunk_size ? chunk_end - chunk_size : search_begin;
+			uint64_t read_end = chunk_end + magic_size <= len ? chunk_end + magic_size : len;
+			size_t read_size = size_t(read_end - chunk_begin);
+			if (!read_at(chunk_begin, chunk.data(), read_size))
+				return false;
+
+			// The trailer ends with the magic, and the trailer ends the commit marker.
+			for (size_t i = read_size - magic_size + 1; i-- > 0; )
+			{
+				if (memcmp(chunk.data() + i, stream_commit_magic, magic_size) != 0)
+					continue;
+
+				uint64_t trailer_end = chunk_begin + i + magic_size;
+				if (trailer_end > len || trailer_end < min_len)
+					continue;
+
+				uint8_t offset_le[8];
+				if (!read_at(trailer_end - CommitTrailerSize, offset_le, sizeof(offset_le)))
+					return false;
+
+				vector<uint8_t> payload;
+				unsigned entry_tag;
+				uint32_t count;
+				uint64_t entry_end;
+				uint64_t candidate = read_le64(offset_le);
+				if (candidate >= MagicSize && candidate < trailer_end &&
+				    read_record_entry(candidate, entry_tag, payload, count, entry_end) &&
+				    entry_tag == CommitTag && entry_end == trailer_end)
+				{
+					commit_offset = candidate;
+					end_offset = entry_end;
+					return true;
+				}
+			}
+
+			chunk_end = chunk_begin;
+		}
+
+		return false;
+	}
+
+	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		if (pending_blobs[tag].count(hash))
+			return true;
+		Entry entry;
+		return find_entry(tag, hash, entry);
+	}
+
+	bool get_entry_info(ResourceTag tag, Hash hash, DatabaseEntryInfo *info) override
+	{
+		if (mode != DatabaseMode::ReadOnly || !info)
+			return false;
+
+		Entry entry;
+		if (!find_entry(tag, hash, entry))
+			return false;
+
+		info->stored_size = entry.header.payload_size;
+		info->uncompressed_size = entry.header.uncompressed_size;
+		info->has_checksum = entry.header.crc != 0;
+
+		switch (compression_format(entry.header))
+		{
+		case FOSSILIZE_COMPRESSION_NONE:
+			info->compression = DATABASE_COMPRESSION_NONE;
+			break;
+		case FOSSILIZE_COMPRESSION_DEFLATE:
+			info->compression = DATABASE_COMPRESSION_DEFLATE;
+			break;
+		case FOSSILIZE_COMPRESSION_ZSTD:
+			info->compression = DATABASE_COMPRESSION_ZSTD;
+			break;
+		case FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY:
+			info->compression = DATABASE_COMPRESSION_ZSTD_DICTIONARY;
+			break;
+		case FOSSILIZE_COMPRESSION_LZ4:
+			info->compression = DATABASE_COMPRESSION_LZ4;
+			break;
+		default:
+			info->compression = DATABASE_COMPRESSION_UNKNOWN;
+			break;
+		}
+		return true;
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *hash_count, Hash *hashes) override
+	{
+		if (!retire_compression_jobs(0))
+			return false;
+
+		size_t size = entry_count(tag);
+		if (hashes)
+		{
+			if (size != *hash_count)
+				return false;
+		}
+		else
+			*hash_count = size;
 
 		if (hashes)
 		{
 			Hash *iter = hashes;
-			for (auto &blob : seen_blobs[tag])
-				*iter++ = blob.first;
+			for_each_seen_blob(tag, [&](Hash hash, const Entry &) {
+				*iter++ = hash;
+			});
 
 			// Make replay more deterministic.
 			sort(hashes, hashes + size);
@@ -870,129 +3029,302 @@ struct StreamArchive : DatabaseInterface
 		return true;
 	}
 
-	struct Entry
+	bool decode_payload_uncompressed(void *blob, size_t blob_size, const Entry &entry, PayloadReadFlags flags,
+	                                 const ReadWindow *window)
 	{
-		uint64_t offset;
-		PayloadHeader header;
-	};
+		if (entry.header.uncompressed_size != blob_size || entry.header.payload_size != blob_size)
+			return false;
+
+		if (!read_at(entry.offset, blob, entry.header.payload_size, window))
+			return false;
 
-	bool decode_payload_uncompressed(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+		return verify_checksum(entry.header, blob, blob_size, flags);
+	}
+
+	bool decode_payload_compressed(void *blob, size_t blob_size, const Entry &entry, PayloadReadFlags flags,
+	                               const ReadWindow *window)
 	{
-		if (entry.header.uncompressed_size != blob_size || entry.header.payload_size != blob_size)
+		if (entry.header.uncompressed_size != blob_size)
 			return false;
 
-		{
-			ConditionalLockGuard holder(read_lock, concurrent);
-			if (fseek(file, entry.offset, SEEK_SET) < 0)
-				return false;
+		// Decompress straight from memory if we can, no need to copy anything.
+		const uint8_t *dst_zlib_buffer = direct_pointer(entry.offset, entry.header.payload_size, window);
 
-			size_t read_size = entry.header.payload_size;
-			if (fread(blob, 1, read_size, file) != read_size)
+		if (mapping.is_mapped())
+		{
+			if (!dst_zlib_buffer)
 				return false;
 		}
-
-		if (entry.header.crc != 0) // Verify checksum.
+		else if (!dst_zlib_buffer)
 		{
-			auto disk_crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<unsigned char *>(blob), blob_size));
-			if (disk_crc != entry.header.crc)
-			{
-				LOGE("CRC mismatch!\n");
+			uint8_t *read_buffer = get_thread_read_buffer(entry.header.payload_size);
+			if (!read_at(entry.offset, read_buffer, entry.header.payload_size))
 				return false;
-			}
+			dst_zlib_buffer = read_buffer;
 		}
 
-		return true;
+		if (!verify_checksum(entry.header, dst_zlib_buffer, entry.header.payload_size, flags))
+			return false;
+
+		return decompress_payload(blob, blob_size, dst_zlib_buffer, entry.header,
+		                          (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0);
 	}
 
-	bool decode_payload_deflate(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	bool decompress_payload(void *blob, size_t blob_size, const uint8_t *compressed, const PayloadHeader &header,
+	                        bool concurrent)
 	{
-		if (entry.header.uncompressed_size != blob_size)
-			return false;
+		switch (compression_format(header))
+		{
+		case FOSSILIZE_COMPRESSION_DEFLATE:
+		{
+			mz_ulong zsize = blob_size;
+			if (mz_uncompress(static_cast<unsigned char *>(blob), &zsize, compressed, header.payload_size) != MZ_OK)
+				return false;
+			return zsize == blob_size;
+		}
 
-		uint8_t *dst_zlib_buffer = nullptr;
-		std::unique_ptr<uint8_t[]> zlib_buffer_holder;
+		case FOSSILIZE_COMPRESSION_ZSTD:
+		{
+#ifdef FOSSILIZE_HAVE_ZSTD
+			size_t zsize = ZSTD_decompress(blob, blob_size, compressed, header.payload_size);
+			if (ZSTD_isError(zsize))
+				return false;
+			return zsize == blob_size;
+#else
+			LOGE("Payload is compressed with zstd, but Fossilize was built without zstd support.\n");
+			return false;
+#endif
+		}
 
+		case FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY:
 		{
-			ConditionalLockGuard holder(read_lock, concurrent);
-			if (concurrent)
+#ifdef FOSSILIZE_HAVE_ZSTD
+			auto itr = decompression_dictionaries.find(ZSTD_getDictID_fromFrame(compressed, header.payload_size));
+			if (itr == end(decompression_dictionaries))
 			{
-				dst_zlib_buffer = new uint8_t[entry.header.payload_size];
-				zlib_buffer_holder.reset(dst_zlib_buffer);
+				LOGE("Could not find compression dictionary for payload.\n");
+				return false;
 			}
-			else if (zlib_buffer_size < entry.header.payload_size)
-			{
-				auto *new_zlib_buffer = static_cast<uint8_t *>(realloc(zlib_buffer, entry.header.payload_size));
-				if (new_zlib_buffer)
-				{
-					zlib_buffer = new_zlib_buffer;
-					zlib_buffer_size = entry.header.payload_size;
-				}
-				else
-				{
-					free(zlib_buffer);
-					zlib_buffer = nullptr;
-					zlib_buffer_size = 0;
-				}
 
-				if (!zlib_buffer)
-					return false;
-
-				dst_zlib_buffer = zlib_buffer;
-			}
+			// The shared context cannot be used when decoding concurrently.
+			ZSTD_DCtx *dctx;
+			if (concurrent)
+				dctx = ZSTD_createDCtx();
 			else
-				dst_zlib_buffer = zlib_buffer;
+			{
+				if (!zstd_dctx)
+					zstd_dctx = ZSTD_createDCtx();
+				dctx = zstd_dctx;
+			}
 
-			if (fseek(file, entry.offset, SEEK_SET) < 0)
+			if (!dctx)
 				return false;
-			if (fread(dst_zlib_buffer, 1, entry.header.payload_size, file) != entry.header.payload_size)
+
+			size_t zsize = ZSTD_decompress_usingDDict(dctx, blob, blob_size, compressed, header.payload_size, itr->second);
+			if (concurrent)
+				ZSTD_freeDCtx(dctx);
+			if (ZSTD_isError(zsize))
 				return false;
+			return zsize == blob_size;
+#else
+			(void)concurrent;
+			LOGE("Payload is compressed with zstd, but Fossilize was built without zstd support.\n");
+			return false;
+#endif
 		}
 
-		if (entry.header.crc != 0) // Verify checksum.
+		case FOSSILIZE_COMPRESSION_LZ4:
 		{
-			auto disk_crc = uint32_t(mz_crc32(MZ_CRC32_INIT, dst_zlib_buffer, entry.header.payload_size));
-			if (disk_crc != entry.header.crc)
-			{
-				LOGE("CRC mismatch!\n");
-				return false;
-			}
+#ifdef FOSSILIZE_HAVE_LZ4
+			int zsize = LZ4_decompress_safe(reinterpret_cast<const char *>(compressed), static_cast<char *>(blob),
+			                                int(header.payload_size), int(blob_size));
+			return zsize >= 0 && size_t(zsize) == blob_size;
+#else
+			LOGE("Payload is compressed with LZ4, but Fossilize was built without LZ4 support.\n");
+			return false;
+#endif
 		}
 
-		mz_ulong zsize = blob_size;
-		if (mz_uncompress(static_cast<unsigned char *>(blob), &zsize, dst_zlib_buffer, entry.header.payload_size) != MZ_OK)
+		default:
 			return false;
-		if (zsize != blob_size)
+		}
+	}
+
+	// Compressed payloads which are not memory mapped are staged here before decompression.
+	// Buffers are per-thread, so concurrent readers never have to allocate or lock.
+	static uint8_t *get_thread_read_buffer(size_t size)
+	{
+		static thread_local vector<uint8_t> read_buffer;
+		if (read_buffer.size() < size)
+			read_buffer.resize(size);
+		return read_buffer.data();
+	}
+
+	// Reads from either the memory mapping, the positional reader or the FILE.
+	// Only the FILE path is stateful, but that is only used in Append mode, which cannot read entries.
+	bool read_at(uint64_t offset, void *data, size_t size, const ReadWindow *window = nullptr)
+	{
+		if (auto *ptr = direct_pointer(offset, size, window))
+		{
+			memcpy(data, ptr, size);
+			return true;
+		}
+		else if (mapping.is_mapped())
 			return false;
+		else if (reader.is_open())
+			return reader.read(offset, data, size);
+		else
+		{
+			if (fseek(file, offset, SEEK_SET) < 0)
+				return false;
+			return fread(data, 1, size, file) == size;
+		}
+	}
 
-		return true;
+	// Returns a pointer to a range of the archive if it is already in memory, either from the mapping, or the window.
+	const uint8_t *direct_pointer(uint64_t offset, size_t size, const ReadWindow *window) const
+	{
+		if (mapping.is_mapped())
+			return offset + size <= mapping.size() ? mapping.data() + offset : nullptr;
+		else if (window && offset >= window->offset && offset + size <= window->offset + window->size)
+			return window->data + (offset - window->offset);
+		else
+			return nullptr;
 	}
 
-	bool decode_payload(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	bool decode_payload(void *blob, size_t blob_size, const Entry &entry, PayloadReadFlags flags, const ReadWindow *window)
 	{
-		if (entry.header.format == FOSSILIZE_COMPRESSION_NONE)
-			return decode_payload_uncompressed(blob, blob_size, entry, concurrent);
-		else if (entry.header.format == FOSSILIZE_COMPRESSION_DEFLATE)
-			return decode_payload_deflate(blob, blob_size, entry, concurrent);
+		// Unknown checksum types must not be mistaken for CRC32.
+		if ((entry.header.format & ~uint32_t(FOSSILIZE_COMPRESSION_MASK | FOSSILIZE_CHECKSUM_CRC32C_BIT)) != 0)
+			return false;
+
+		auto format = compression_format(entry.header);
+		if (format == FOSSILIZE_COMPRESSION_NONE)
+			return decode_payload_uncompressed(blob, blob_size, entry, flags, window);
+		else if (format == FOSSILIZE_COMPRESSION_DEFLATE ||
+		         format == FOSSILIZE_COMPRESSION_ZSTD ||
+		         format == FOSSILIZE_COMPRESSION_ZSTD_DICTIONARY ||
+		         format == FOSSILIZE_COMPRESSION_LZ4)
+			return decode_payload_compressed(blob, blob_size, entry, flags, window);
 		else
 			return false;
 	}
 
 	FILE *file = nullptr;
+	FileMapping mapping;
+	PositionalFile reader;
 	string path;
-	unordered_map<Hash, Entry> seen_blobs[RESOURCE_COUNT];
+	FlatHashMap<Entry> seen_blobs[RESOURCE_COUNT];
+	FlatHashMap<Entry> dictionaries;
+	// With an attached index, read-only lookups go to the index records in the mapping instead of seen_blobs.
+	// attached_ranges holds the [begin, end) range of records for each resource tag.
+	const uint8_t *attached_index = nullptr;
+	uint32_t attached_ranges[RESOURCE_COUNT][2] = {};
 	DatabaseMode mode;
-	uint8_t *zlib_buffer = nullptr;
-	size_t zlib_buffer_size = 0;
+	// Read from the header of an existing archive, or written to the header of a new one.
+	unsigned format_version = FOSSILIZE_FORMAT_VERSION;
+	uint64_t write_offset = 0;
+	vector<uint8_t> write_buffer;
+	int write_fd = -1;
+	bool write_failed = false;
 	bool alive = false;
-	std::mutex read_lock;
+	bool use_memory_map = false;
+	bool index_dirty = false;
+
+	// Group commit state. last_commit_offset is the last commit marker or index entry in the archive, 0 if none.
+	unsigned commit_max_entries = 0;
+	unsigned commit_max_interval_ms = 0;
+	vector<IndexRecord> uncommitted;
+	chrono::steady_clock::time_point oldest_uncommitted;
+	uint64_t last_commit_offset = 0;
+
+#ifdef FOSSILIZE_HAVE_ZSTD
+	struct CompressionDictionary
+	{
+		vector<uint8_t> data;
+		// Fast and best compression levels.
+		ZSTD_CDict *cdicts[2] = {};
+	};
+	unordered_map<unsigned, CompressionDictionary> compression_dictionaries;
+	unordered_map<unsigned, ZSTD_DDict *> decompression_dictionaries;
+	ZSTD_DCtx *zstd_dctx = nullptr;
+#endif
+
+	CompressionScratch compression_scratch;
+
+	// Compression workers. compression_jobs holds all queued jobs in write order, compression_todo the ones
+	// no worker has picked up yet. Both, and the done flags of the jobs, are guarded by compression_lock.
+	// pending_blobs is only used by the thread which writes entries.
+	vector<thread> compression_threads;
+	deque<unique_ptr<CompressionJob>> compression_jobs;
+	deque<CompressionJob *> compression_todo;
+	FlatHashMap<bool> pending_blobs[RESOURCE_COUNT];
+	mutex compression_lock;
+	condition_variable compression_cond;
+	condition_variable compression_done_cond;
+	bool compression_shutdown = false;
 };
 
+bool DatabaseInterface::for_each_entry(DatabaseEntryVisitor &visitor, PayloadReadFlags flags)
+{
+	vector<uint8_t> blob;
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+
+		size_t hash_count = 0;
+		if (!get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		vector<Hash> hashes(hash_count);
+		if (!get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		for (auto &hash : hashes)
+		{
+			size_t blob_size = 0;
+			if (!read_entry(tag, hash, &blob_size, nullptr, flags))
+				return false;
+			blob.resize(blob_size);
+			if (!read_entry(tag, hash, &blob_size, blob.data(), flags))
+				return false;
+			if (!visitor.visit_entry(tag, hash, blob.data(), blob.size()))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 DatabaseInterface *create_stream_archive_database(const char *path, DatabaseMode mode)
 {
 	auto *db = new StreamArchive(path, mode);
 	return db;
 }
 
+bool train_compression_dictionary(const void *samples, const size_t *sample_sizes, unsigned num_samples,
+                                  void *dictionary, size_t *dictionary_size)
+{
+#ifdef FOSSILIZE_HAVE_ZSTD
+	size_t size = ZDICT_trainFromBuffer(dictionary, *dictionary_size, samples, sample_sizes, num_samples);
+	if (ZDICT_isError(size))
+	{
+		LOGE("Failed to train compression dictionary: %s\n", ZDICT_getErrorName(size));
+		return false;
+	}
+
+	*dictionary_size = size;
+	return true;
+#else
+	(void)samples;
+	(void)sample_sizes;
+	(void)num_samples;
+	(void)dictionary;
+	(void)dictionary_size;
+	LOGE("Fossilize was built without zstd support, cannot train compression dictionary.\n");
+	return false;
+#endif
+}
+
 DatabaseInterface *create_database(const char *path, DatabaseMode mode)
 {
 	auto ext = Path::ext(path);
@@ -1004,71 +3336,337 @@ DatabaseInterface *create_database(const char *path, DatabaseMode mode)
 		return create_dumb_folder_database(path, mode);
 }
 
+// Runs func(0) to func(count - 1), spread over as many threads as are useful.
+template <typename Func>
+static void run_in_parallel(size_t count, const Func &func)
+{
+	unsigned num_threads = std::thread::hardware_concurrency();
+	if (num_threads == 0)
+		num_threads = 1;
+	if (num_threads > count)
+		num_threads = unsigned(count);
+
+	std::atomic<size_t> next_index(0);
+	auto worker = [&]() {
+		size_t index;
+		while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < count)
+			func(index);
+	};
+
+	if (num_threads <= 1)
+	{
+		worker();
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads - 1);
+	for (unsigned i = 1; i < num_threads; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &thread : threads)
+		thread.join();
+}
+
 struct ConcurrentDatabase : DatabaseInterface
 {
 	explicit ConcurrentDatabase(const char *base_path_, DatabaseMode mode_,
 	                            const char * const *extra_paths, size_t num_extra_paths)
 		: base_path(base_path_ ? base_path_ : ""), mode(mode_)
 	{
+		// Read-only archives are only kept around after prepare() in ReadOnly mode,
+		// so only bother to memory map in that case.
+		DatabaseMode readonly_mode = DatabaseMode::ReadOnly;
+		if (mode == DatabaseMode::ReadOnlyMemoryMap)
+		{
+			mode = DatabaseMode::ReadOnly;
+			readonly_mode = DatabaseMode::ReadOnlyMemoryMap;
+		}
+
 		if (!base_path.empty())
 		{
 			std::string readonly_path = base_path + ".foz";
-			readonly_interface.reset(create_stream_archive_database(readonly_path.c_str(), DatabaseMode::ReadOnly));
+			readonly_interface.reset(create_stream_archive_database(readonly_path.c_str(), readonly_mode));
 		}
 
 		for (size_t i = 0; i < num_extra_paths; i++)
-			extra_readonly.emplace_back(create_stream_archive_database(extra_paths[i], DatabaseMode::ReadOnly));
+			extra_readonly.emplace_back(create_stream_archive_database(extra_paths[i], readonly_mode));
 	}
 
+	// Writes which are not in the read-only databases go to a write-only archive of their own, which is created lazily.
+	// The database itself writes through one of these, and get_write_shard() hands out more of them.
+	struct WriteShard : DatabaseInterface
+	{
+		explicit WriteShard(ConcurrentDatabase &parent_)
+			: parent(parent_)
+		{
+		}
+
+		bool prepare() override
+		{
+			return parent.mode == DatabaseMode::Append && parent.has_prepared_readonly;
+		}
+
+		bool read_entry(ResourceTag, Hash, size_t *, void *, PayloadReadFlags) override
+		{
+			return false;
+		}
+
+		bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+		{
+			if (parent.mode != DatabaseMode::Append)
+				return false;
+
+			if (has_entry(tag, hash))
+				return true;
+
+			if (tag == RESOURCE_SHADER_MODULE && parent.module_store)
+				return parent.module_store->write_entry(tag, hash, blob, blob_size, flags);
+
+			if (need_archive)
+			{
+				archive.reset(parent.create_write_archive());
+				need_archive = false;
+			}
+
+			if (archive)
+				return archive->write_entry(tag, hash, blob, blob_size, flags);
+			else
+				return false;
+		}
+
+		bool has_entry(ResourceTag tag, Hash hash) override
+		{
+			return parent.is_primed(tag, hash) || (archive && archive->has_entry(tag, hash)) ||
+			       parent.is_in_module_store(tag, hash);
+		}
+
+		bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+		{
+			return parent.get_hash_list_with_archive(archive.get(), tag, num_hashes, hashes);
+		}
+
+		void flush() override
+		{
+			if (archive)
+				archive->flush();
+		}
+
+		ConcurrentDatabase &parent;
+		std::unique_ptr<DatabaseInterface> archive;
+		bool need_archive = true;
+	};
+
 	void flush() override
 	{
-		if (writeonly_interface)
-			writeonly_interface->flush();
+		main_shard.flush();
+		if (module_store)
+			module_store->flush();
+	}
+
+	// Write-only archives are created lazily, so remember the settings until then.
+	// The settings are applied to every write shard, so they must not be changed while shards are written to.
+	bool set_group_commit(unsigned max_entries, unsigned max_interval_ms) override
+	{
+		if (mode != DatabaseMode::Append)
+			return false;
+
+		commit_max_entries = max_entries;
+		commit_max_interval_ms = max_interval_ms;
+		return for_each_write_archive([&](DatabaseInterface &archive) {
+			return archive.set_group_commit(max_entries, max_interval_ms);
+		});
+	}
+
+	bool set_compression_threads(unsigned count) override
+	{
+		if (mode != DatabaseMode::Append)
+			return false;
+
+		compression_threads = count;
+		return for_each_write_archive([&](DatabaseInterface &archive) {
+			return archive.set_compression_threads(count);
+		});
+	}
+
+	bool set_module_store(DatabaseInterface *store) override
+	{
+		if (has_prepared_readonly)
+			return false;
+
+		module_store = store;
+		return true;
+	}
+
+	DatabaseInterface *get_write_shard(unsigned index) override
+	{
+		if (mode != DatabaseMode::Append)
+			return nullptr;
+
+		std::lock_guard<std::mutex> holder{write_shards_lock};
+		if (index >= write_shards.size())
+			write_shards.resize(index + 1);
+		if (!write_shards[index])
+			write_shards[index].reset(new WriteShard(*this));
+		return write_shards[index].get();
+	}
+
+	template <typename Func>
+	bool for_each_write_archive(const Func &func)
+	{
+		bool ret = true;
+		if (main_shard.archive && !func(*main_shard.archive))
+			ret = false;
+
+		std::lock_guard<std::mutex> holder{write_shards_lock};
+		for (auto &shard : write_shards)
+			if (shard && shard->archive && !func(*shard->archive))
+				ret = false;
+		return ret;
+	}
+
+	// Open the database file exclusively to work concurrently with other processes, and with other write shards.
+	// Don't try forever.
+	DatabaseInterface *create_write_archive() const
+	{
+		std::unique_ptr<StreamArchive> archive;
+		for (unsigned index = 1; index < 256 && !archive; index++)
+		{
+			std::string write_path = base_path + "." + std::to_string(index) + ".foz";
+			archive.reset(new StreamArchive(write_path, DatabaseMode::ExclusiveOverWrite));
+			// Objects are deduplicated against the read-only archives, so they must keep being hashed the same way
+			// once the new archive is merged with them.
+			archive->format_version = existing_format_version;
+			if (!archive->prepare())
+				archive.reset();
+			else
+			{
+				if (commit_max_entries || commit_max_interval_ms)
+					archive->set_group_commit(commit_max_entries, commit_max_interval_ms);
+				if (compression_threads)
+					archive->set_compression_threads(compression_threads);
+			}
+		}
+		return archive.release();
 	}
 
-	void prime_read_only_hashes(DatabaseInterface &interface)
+	struct PreparedDatabase
+	{
+		bool prepared = false;
+		std::vector<Hash> hashes[RESOURCE_COUNT];
+	};
+
+	static void prepare_database(DatabaseInterface *database, PreparedDatabase &prepared)
 	{
+		if (!database || !database->prepare())
+			return;
+
 		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
 		{
 			auto tag = static_cast<ResourceTag>(i);
 			size_t num_hashes;
-			if (!interface.get_hash_list_for_resource_tag(tag, &num_hashes, nullptr))
+			if (!database->get_hash_list_for_resource_tag(tag, &num_hashes, nullptr))
 				return;
-			std::vector<Hash> hashes(num_hashes);
-			if (!interface.get_hash_list_for_resource_tag(tag, &num_hashes, hashes.data()))
+			prepared.hashes[i].resize(num_hashes);
+			if (!database->get_hash_list_for_resource_tag(tag, &num_hashes, prepared.hashes[i].data()))
 				return;
-
-			for (auto &hash : hashes)
-				primed_hashes[i].insert(hash);
 		}
+
+		prepared.prepared = true;
 	}
 
-	bool prepare() override
+	// Parsing an archive is mostly I/O bound, so all read-only archives are prepared in parallel.
+	// The hash list of every tag is then indexed on its own thread.
+	// In ReadOnly mode, every hash also records the database which will serve reads for it.
+	// If a hash exists in multiple databases, the first database wins.
+	void prime_read_only_hashes(const std::vector<DatabaseInterface *> &databases)
 	{
-		if (mode != DatabaseMode::Append && mode != DatabaseMode::ReadOnly)
-			return false;
+		std::vector<PreparedDatabase> prepared(databases.size());
+		run_in_parallel(databases.size(), [&](size_t index) {
+			prepare_database(databases[index], prepared[index]);
+		});
 
-		if (!has_prepared_readonly)
-		{
-			// It's okay if the database doesn't exist.
-			if (readonly_interface && readonly_interface->prepare())
-				prime_read_only_hashes(*readonly_interface);
+		if (mode == DatabaseMode::ReadOnly)
+			primed_databases = databases;
+
+		run_in_parallel(RESOURCE_COUNT, [&](size_t tag) {
+			size_t total_hashes = 0;
+			for (auto &database : prepared)
+				if (database.prepared)
+					total_hashes += database.hashes[tag].size();
 
+			std::vector<Hash> hashes;
 			if (mode != DatabaseMode::ReadOnly)
 			{
-				// We only need the database for priming purposes.
-				readonly_interface.reset();
+				hashes.reserve(total_hashes);
+				for (auto &database : prepared)
+				{
+					if (!database.prepared)
+						continue;
+					hashes.insert(hashes.end(), database.hashes[tag].begin(), database.hashes[tag].end());
+					// Free as we go, so we don't hold two copies of every hash list at once.
+					std::vector<Hash>().swap(database.hashes[tag]);
+				}
+
+				std::sort(hashes.begin(), hashes.end());
+				hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+				primed_hashes[tag].assign(std::move(hashes));
+				return;
 			}
 
-			for (auto &extra : extra_readonly)
+			// Sorting by database index after the hash makes the first database come first among duplicates.
+			std::vector<std::pair<Hash, uint32_t>> entries;
+			entries.reserve(total_hashes);
+			for (size_t i = 0; i < prepared.size(); i++)
+			{
+				if (!prepared[i].prepared)
+					continue;
+				for (auto &hash : prepared[i].hashes[tag])
+					entries.emplace_back(hash, uint32_t(i));
+				std::vector<Hash>().swap(prepared[i].hashes[tag]);
+			}
+
+			std::sort(entries.begin(), entries.end());
+			entries.erase(std::unique(entries.begin(), entries.end(),
+			                          [](const std::pair<Hash, uint32_t> &a, const std::pair<Hash, uint32_t> &b) {
+				                          return a.first == b.first;
+			                          }), entries.end());
+
+			hashes.reserve(entries.size());
+			auto &owners = primed_owners[tag];
+			owners.reserve(entries.size());
+			for (auto &entry : entries)
 			{
-				if (extra && extra->prepare())
-					prime_read_only_hashes(*extra);
+				hashes.push_back(entry.first);
+				owners.push_back(entry.second);
 			}
+			primed_hashes[tag].assign(std::move(hashes));
+		});
+	}
+
+	bool prepare() override
+	{
+		FOSSILIZE_PROFILE_ZONE("ConcurrentDatabase::prepare");
+		if (mode != DatabaseMode::Append && mode != DatabaseMode::ReadOnly)
+			return false;
+
+		if (!has_prepared_readonly)
+		{
+			std::vector<DatabaseInterface *> databases;
+			databases.reserve(extra_readonly.size() + 1);
+			databases.push_back(readonly_interface.get());
+			for (auto &extra : extra_readonly)
+				databases.push_back(extra.get());
+
+			// It's okay if any database doesn't exist.
+			// The main read-only database takes precedence, followed by the extra paths in order.
+			prime_read_only_hashes(databases);
+			existing_format_version = get_format_version();
 
 			if (mode != DatabaseMode::ReadOnly)
 			{
-				// We only need the database for priming purposes.
+				// We only need the databases for priming purposes.
+				readonly_interface.reset();
 				extra_readonly.clear();
 			}
 		}
@@ -1077,80 +3675,164 @@ struct ConcurrentDatabase : DatabaseInterface
 		return true;
 	}
 
+	unsigned get_format_version() override
+	{
+		// In Append mode, the read-only databases are gone after prepare().
+		if (has_prepared_readonly && mode != DatabaseMode::ReadOnly)
+			return existing_format_version;
+
+		unsigned version = FOSSILIZE_FORMAT_VERSION;
+		if (readonly_interface)
+			version = std::min(version, readonly_interface->get_format_version());
+		for (auto &extra : extra_readonly)
+			version = std::min(version, extra->get_format_version());
+		if (module_store)
+			version = std::min(version, module_store->get_format_version());
+		return version;
+	}
+
 	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
+	{
+		FOSSILIZE_PROFILE_ZONE_HASH("ConcurrentDatabase::read_entry", hash);
+		if (mode != DatabaseMode::ReadOnly)
+			return false;
+
+		// One lookup finds the database which holds the entry, no matter how many databases there are.
+		auto *database = find_read_only_database(tag, hash);
+		if (!database)
+			return false;
+
+		return database->read_entry(tag, hash, blob_size, blob, flags);
+	}
+
+	bool map_entry(ResourceTag tag, Hash hash, const void **data, size_t *size, PayloadReadFlags flags) override
 	{
 		if (mode != DatabaseMode::ReadOnly)
 			return false;
 
-		if (readonly_interface && readonly_interface->read_entry(tag, hash, blob_size, blob, flags))
-			return true;
+		auto *database = find_read_only_database(tag, hash);
+		if (!database)
+			return false;
 
-		// There shouldn't be that many read-only databases to the point where we need to use hashmaps
-		// to map hash/tag to the readonly database.
-		for (auto &extra : extra_readonly)
-			if (extra && extra->read_entry(tag, hash, blob_size, blob, flags))
-				return true;
+		return database->map_entry(tag, hash, data, size, flags);
+	}
 
-		return false;
+	void release_entry(const void *data) override
+	{
+		// Databases ignore pointers they did not hand out, so there is no need to remember where data came from.
+		for (auto *database : primed_databases)
+			database->release_entry(data);
+		if (module_store)
+			module_store->release_entry(data);
 	}
 
-	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+	bool get_entry_info(ResourceTag tag, Hash hash, DatabaseEntryInfo *info) override
 	{
-		if (mode != DatabaseMode::Append)
+		if (mode != DatabaseMode::ReadOnly)
 			return false;
 
-		if (primed_hashes[tag].count(hash))
-			return true;
+		auto *database = find_read_only_database(tag, hash);
+		if (!database)
+			return false;
 
-		// All threads must have called prepare and synchronized readonly_interface from that,
-		// and from here on out readonly_interface is purely read-only, no need to lock just to check.
-		if (readonly_interface && readonly_interface->has_entry(tag, hash))
-			return true;
+		return database->get_entry_info(tag, hash, info);
+	}
 
-		if (writeonly_interface && writeonly_interface->has_entry(tag, hash))
-			return true;
+	void prefetch_entries(ResourceTag tag, const Hash *hashes, size_t count) override
+	{
+		if (mode != DatabaseMode::ReadOnly)
+			return;
 
-		if (need_writeonly_database)
+		unordered_map<DatabaseInterface *, vector<Hash>> batches;
+		for (size_t i = 0; i < count; i++)
 		{
-			// Lazily create a new database. Open the database file exclusively to work concurrently with other processes.
-			// Don't try forever.
-			for (unsigned index = 1; index < 256 && !writeonly_interface; index++)
-			{
-				std::string write_path = base_path + "." + std::to_string(index) + ".foz";
-				writeonly_interface.reset(create_stream_archive_database(write_path.c_str(), DatabaseMode::ExclusiveOverWrite));
-				if (!writeonly_interface->prepare())
-					writeonly_interface.reset();
-			}
-
-			need_writeonly_database = false;
+			auto *database = find_read_only_database(tag, hashes[i]);
+			if (database)
+				batches[database].push_back(hashes[i]);
 		}
 
-		if (writeonly_interface)
-			return writeonly_interface->write_entry(tag, hash, blob, blob_size, flags);
-		else
+		for (auto &batch : batches)
+			batch.first->prefetch_entries(tag, batch.second.data(), batch.second.size());
+	}
+
+	bool read_entries(DatabaseEntryRead *reads, size_t count, PayloadReadFlags flags) override
+	{
+		if (mode != DatabaseMode::ReadOnly)
 			return false;
+
+		// Split the batch up per database, so every database can order its own reads.
+		unordered_map<DatabaseInterface *, vector<DatabaseEntryRead>> batches;
+		vector<DatabaseInterface *> owners(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			owners[i] = find_read_only_database(reads[i].tag, reads[i].hash);
+			if (!owners[i])
+				return false;
+			batches[owners[i]].push_back(reads[i]);
+		}
+
+		for (auto &batch : batches)
+			if (!batch.first->read_entries(batch.second.data(), batch.second.size(), flags))
+				return false;
+
+		// Sizes are written to the copies, so pass them back.
+		unordered_map<DatabaseInterface *, size_t> batch_offsets;
+		for (size_t i = 0; i < count; i++)
+			reads[i].size = batches[owners[i]][batch_offsets[owners[i]]++].size;
+
+		return true;
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+	{
+		FOSSILIZE_PROFILE_ZONE_HASH("ConcurrentDatabase::write_entry", hash);
+		return main_shard.write_entry(tag, hash, blob, blob_size, flags);
 	}
 
 	// Checks if entry already exists in database, i.e. no need to serialize.
 	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		return main_shard.has_entry(tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+	{
+		return main_shard.get_hash_list_for_resource_tag(tag, num_hashes, hashes);
+	}
+
+	bool is_primed(ResourceTag tag, Hash hash) const
 	{
 		if (primed_hashes[tag].count(hash))
 			return true;
 
 		// All threads must have called prepare and synchronized readonly_interface from that,
 		// and from here on out readonly_interface is purely read-only, no need to lock just to check.
-		if (readonly_interface && readonly_interface->has_entry(tag, hash))
-			return true;
+		return readonly_interface && readonly_interface->has_entry(tag, hash);
+	}
+
+	// Embedded shader modules take precedence over the module store.
+	DatabaseInterface *find_read_only_database(ResourceTag tag, Hash hash) const
+	{
+		size_t index = primed_hashes[tag].find(hash);
+		if (index != primed_hashes[tag].size())
+			return primed_databases.empty() ? nullptr : primed_databases[primed_owners[tag][index]];
+		else if (is_in_module_store(tag, hash))
+			return module_store;
+		else
+			return nullptr;
+	}
 
-		return writeonly_interface && writeonly_interface->has_entry(tag, hash);
+	bool is_in_module_store(ResourceTag tag, Hash hash) const
+	{
+		return tag == RESOURCE_SHADER_MODULE && module_store && module_store->has_entry(tag, hash);
 	}
 
-	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+	bool get_hash_list_with_archive(DatabaseInterface *writeonly, ResourceTag tag, size_t *num_hashes, Hash *hashes) const
 	{
 		size_t readonly_size = primed_hashes[tag].size();
 
 		size_t writeonly_size = 0;
-		if (!writeonly_interface || !writeonly_interface->get_hash_list_for_resource_tag(tag, &writeonly_size, nullptr))
+		if (!writeonly || !writeonly->get_hash_list_for_resource_tag(tag, &writeonly_size, nullptr))
 			writeonly_size = 0;
 
 		size_t total_size = readonly_size + writeonly_size;
@@ -1165,11 +3847,9 @@ struct ConcurrentDatabase : DatabaseInterface
 
 		if (hashes)
 		{
-			Hash *iter = hashes;
-			for (auto &blob : primed_hashes[tag])
-				*iter++ = blob;
+			Hash *iter = std::copy(primed_hashes[tag].begin(), primed_hashes[tag].end(), hashes);
 
-			if (writeonly_size != 0 && !writeonly_interface->get_hash_list_for_resource_tag(tag, &writeonly_size, iter))
+			if (writeonly_size != 0 && !writeonly->get_hash_list_for_resource_tag(tag, &writeonly_size, iter))
 				return false;
 
 			// Make replay more deterministic.
@@ -1182,11 +3862,22 @@ struct ConcurrentDatabase : DatabaseInterface
 	std::string base_path;
 	DatabaseMode mode;
 	std::unique_ptr<DatabaseInterface> readonly_interface;
-	std::unique_ptr<DatabaseInterface> writeonly_interface;
 	std::vector<std::unique_ptr<DatabaseInterface>> extra_readonly;
-	std::unordered_set<Hash> primed_hashes[RESOURCE_COUNT];
+	// Hashes in the read-only databases. In ReadOnly mode, primed_owners holds the index into primed_databases
+	// of the database which contains each hash. In Append mode, the read-only databases are released after priming,
+	// and only the hashes are kept.
+	SortedHashSet primed_hashes[RESOURCE_COUNT];
+	std::vector<uint32_t> primed_owners[RESOURCE_COUNT];
+	std::vector<DatabaseInterface *> primed_databases;
+	DatabaseInterface *module_store = nullptr;
+	unsigned existing_format_version = FOSSILIZE_FORMAT_VERSION;
 	bool has_prepared_readonly = false;
-	bool need_writeonly_database = true;
+	unsigned commit_max_entries = 0;
+	unsigned commit_max_interval_ms = 0;
+	unsigned compression_threads = 0;
+	WriteShard main_shard{*this};
+	std::vector<std::unique_ptr<WriteShard>> write_shards;
+	std::mutex write_shards_lock;
 };
 
 DatabaseInterface *create_concurrent_database(const char *base_path, DatabaseMode mode,
@@ -1216,43 +3907,440 @@ DatabaseInterface *create_concurrent_database_with_encoded_extra_paths(const cha
 	return create_concurrent_database(base_path, mode, char_paths.data(), char_paths.size());
 }
 
+// Serializes writers in Append mode, since the store is shared by every database in the process.
+// In ReadOnly mode, the concurrent database is safe to read from any thread once it has been prepared.
+struct ModuleStoreDatabase : DatabaseInterface
+{
+	ModuleStoreDatabase(const char *base_path, DatabaseMode mode_)
+		: mode(mode_)
+	{
+		// Unlike an application database, every process adds to the store, so modules written by earlier runs
+		// have to be visible before the store is compacted. Must match the range of indices create_write_archive() uses.
+		std::vector<std::string> fragment_paths;
+		for (unsigned index = 1; index < 256; index++)
+		{
+			std::string path = std::string(base_path) + "." + std::to_string(index) + ".foz";
+			FILE *file = fopen(path.c_str(), "rb");
+			if (file)
+			{
+				fclose(file);
+				fragment_paths.push_back(std::move(path));
+			}
+		}
+
+		std::vector<const char *> paths;
+		paths.reserve(fragment_paths.size());
+		for (auto &path : fragment_paths)
+			paths.push_back(path.c_str());
+		database.reset(new ConcurrentDatabase(base_path, mode, paths.data(), paths.size()));
+	}
+
+	bool prepare() override
+	{
+		return database->prepare();
+	}
+
+	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
+	{
+		if (tag != RESOURCE_SHADER_MODULE || mode == DatabaseMode::Append)
+			return false;
+		return database->read_entry(tag, hash, blob_size, blob, flags);
+	}
+
+	bool map_entry(ResourceTag tag, Hash hash, const void **data, size_t *size, PayloadReadFlags flags) override
+	{
+		if (tag != RESOURCE_SHADER_MODULE || mode == DatabaseMode::Append)
+			return false;
+		return database->map_entry(tag, hash, data, size, flags);
+	}
+
+	void release_entry(const void *data) override
+	{
+		database->release_entry(data);
+	}
+
+	unsigned get_format_version() override
+	{
+		return database->get_format_version();
+	}
+
+	bool read_entries(DatabaseEntryRead *reads, size_t count, PayloadReadFlags flags) override
+	{
+		if (mode == DatabaseMode::Append)
+			return false;
+		for (size_t i = 0; i < count; i++)
+			if (reads[i].tag != RESOURCE_SHADER_MODULE)
+				return false;
+		return database->read_entries(reads, count, flags);
+	}
+
+	void prefetch_entries(ResourceTag tag, const Hash *hashes, size_t count) override
+	{
+		if (tag == RESOURCE_SHADER_MODULE && mode != DatabaseMode::Append)
+			database->prefetch_entries(tag, hashes, count);
+	}
+
+	bool get_entry_info(ResourceTag tag, Hash hash, DatabaseEntryInfo *info) override
+	{
+		if (tag != RESOURCE_SHADER_MODULE || mode == DatabaseMode::Append)
+			return false;
+		return database->get_entry_info(tag, hash, info);
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+	{
+		if (tag != RESOURCE_SHADER_MODULE)
+			return false;
+		std::lock_guard<std::mutex> holder{lock};
+		return database->write_entry(tag, hash, blob, blob_size, flags);
+	}
+
+	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		if (tag != RESOURCE_SHADER_MODULE)
+			return false;
+
+		if (mode == DatabaseMode::Append)
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			return database->has_entry(tag, hash);
+		}
+		else
+			return database->has_entry(tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+	{
+		if (tag != RESOURCE_SHADER_MODULE)
+		{
+			*num_hashes = 0;
+			return true;
+		}
+
+		std::lock_guard<std::mutex> holder{lock};
+		return database->get_hash_list_for_resource_tag(tag, num_hashes, hashes);
+	}
+
+	void flush() override
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		database->flush();
+	}
+
+	std::unique_ptr<ConcurrentDatabase> database;
+	DatabaseMode mode;
+	std::mutex lock;
+};
+
+DatabaseInterface *create_module_store_database(const char *base_path, DatabaseMode mode)
+{
+	return new ModuleStoreDatabase(base_path, mode);
+}
+
 bool merge_concurrent_databases(const char *append_archive, const char * const *source_paths, size_t num_source_paths)
 {
-	auto append_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(append_archive, DatabaseMode::Append));
+	auto append_db = std::unique_ptr<StreamArchive>(new StreamArchive(append_archive, DatabaseMode::Append));
 	if (!append_db->prepare())
 		return false;
 
 	for (size_t source = 0; source < num_source_paths; source++)
 	{
 		const char *path = source_paths[source];
-		auto source_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		auto source_db = std::unique_ptr<StreamArchive>(new StreamArchive(path, DatabaseMode::ReadOnly));
 		if (!source_db->prepare())
 			return false;
 
-		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		if (!append_db->copy_raw_entries_from(*source_db))
+			return false;
+	}
+
+	return true;
+}
+
+// Inputs are parsed twice, once to index them and once to copy from them, rather than all being held open at once,
+// since there can be more of them than there are file descriptors.
+bool bulk_merge_databases(const char *output_base_path, unsigned num_shards,
+                          const char * const *source_paths, size_t num_source_paths)
+{
+	// Must match the range of indices create_concurrent_database() uses.
+	if (num_shards == 0 || num_shards > 255)
+	{
+		LOGE("Invalid shard count %u.\n", num_shards);
+		return false;
+	}
+
+	struct SourceIndex
+	{
+		bool prepared = false;
+		// Sorted, so that they can be merged.
+		std::vector<Hash> hashes[RESOURCE_COUNT];
+		// The entries this source is the first to have, sorted.
+		std::vector<Hash> claimed[RESOURCE_COUNT];
+	};
+	std::vector<SourceIndex> sources(num_source_paths);
+
+	run_in_parallel(num_source_paths, [&](size_t index) {
+		auto &source = sources[index];
+		StreamArchive db(source_paths[index], DatabaseMode::ReadOnly);
+		if (!db.prepare())
 		{
-			auto tag = static_cast<ResourceTag>(i);
+			LOGE("Failed to prepare %s, skipping it.\n", source_paths[index]);
+			return;
+		}
 
-			size_t hash_count = 0;
-			if (!source_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-				return false;
-			std::vector<Hash> hashes(hash_count);
-			if (!source_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-				return false;
+		for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+		{
+			auto &hashes = source.hashes[tag];
+			size_t count = 0;
+			if (!db.get_hash_list_for_resource_tag(ResourceTag(tag), &count, nullptr))
+				return;
+			hashes.resize(count);
+			if (!db.get_hash_list_for_resource_tag(ResourceTag(tag), &count, hashes.data()))
+				return;
+			std::sort(hashes.begin(), hashes.end());
+		}
+		source.prepared = true;
+	});
+
+	// A k-way merge over the sorted tables of every source. Equal hashes pop in source order, so the first source wins.
+	run_in_parallel(RESOURCE_COUNT, [&](size_t tag) {
+		struct Cursor
+		{
+			Hash hash;
+			uint32_t source;
+			uint32_t index;
+		};
+
+		const auto later = [](const Cursor &a, const Cursor &b) {
+			return a.hash != b.hash ? a.hash > b.hash : a.source > b.source;
+		};
+
+		std::vector<Cursor> heap;
+		for (size_t i = 0; i < sources.size(); i++)
+			if (sources[i].prepared && !sources[i].hashes[tag].empty())
+				heap.push_back({ sources[i].hashes[tag].front(), uint32_t(i), 0 });
+		std::make_heap(heap.begin(), heap.end(), later);
+
+		bool has_last = false;
+		Hash last = 0;
+		while (!heap.empty())
+		{
+			std::pop_heap(heap.begin(), heap.end(), later);
+			auto &cursor = heap.back();
+			auto &source = sources[cursor.source];
+
+			if (!has_last || cursor.hash != last)
+				source.claimed[tag].push_back(cursor.hash);
+			has_last = true;
+			last = cursor.hash;
 
-			for (auto &hash : hashes)
+			if (++cursor.index < source.hashes[tag].size())
 			{
-				size_t blob_size = 0;
-				if (!source_db->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-					return false;
-				std::vector<uint8_t> blob(blob_size);
-				if (!source_db->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-					return false;
+				cursor.hash = source.hashes[tag][cursor.index];
+				std::push_heap(heap.begin(), heap.end(), later);
+			}
+			else
+			{
+				heap.pop_back();
+				std::vector<Hash>().swap(source.hashes[tag]);
+			}
+		}
+	});
+
+	// Sources are dealt out to shards round-robin, and every shard is written by one thread.
+	// Claims are disjoint, so no entry ends up in more than one shard.
+	std::atomic<bool> success(true);
+	run_in_parallel(num_shards, [&](size_t shard) {
+		std::string path = std::string(output_base_path) + "." + std::to_string(shard + 1) + ".foz";
+		StreamArchive output(path.c_str(), DatabaseMode::OverWrite);
+		if (!output.prepare())
+		{
+			LOGE("Failed to open %s for writing.\n", path.c_str());
+			success = false;
+			return;
+		}
+
+		for (size_t index = shard; index < sources.size(); index += num_shards)
+		{
+			auto &source = sources[index];
+			bool has_claims = false;
+			for (auto &claimed : source.claimed)
+				has_claims = has_claims || !claimed.empty();
+			if (!has_claims)
+				continue;
+
+			StreamArchive db(source_paths[index], DatabaseMode::ReadOnly);
+			bool copied = db.prepare() && output.copy_raw_entries_from(db, [&](unsigned tag, Hash hash) {
+				return std::binary_search(source.claimed[tag].begin(), source.claimed[tag].end(), hash);
+			});
+
+			if (!copied)
+			{
+				LOGE("Failed to copy entries from %s.\n", source_paths[index]);
+				success = false;
+				return;
+			}
+
+			for (auto &claimed : source.claimed)
+				std::vector<Hash>().swap(claimed);
+		}
+	});
+
+	return success;
+}
+
+// Exclusive, non-blocking lock on a file. Released on destruction.
+class ExclusiveFileLock
+{
+public:
+	ExclusiveFileLock() = default;
+	ExclusiveFileLock(ExclusiveFileLock &&other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	ExclusiveFileLock &operator=(ExclusiveFileLock &&other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			handle = other.handle;
+#ifdef _WIN32
+			other.handle = INVALID_HANDLE_VALUE;
+#else
+			other.handle = -1;
+#endif
+		}
+		return *this;
+	}
+
+	~ExclusiveFileLock()
+	{
+		release();
+	}
+
+	// Returns false if the file does not exist (and create is false), or if someone else holds it.
+	bool try_lock(const char *path, bool create)
+	{
+		release();
+#ifdef _WIN32
+		// Without any sharing, opening fails if anyone else has the file open.
+		handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+		                     create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		return handle != INVALID_HANDLE_VALUE;
+#else
+		handle = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+		if (handle < 0)
+			return false;
+		if (flock(handle, LOCK_EX | LOCK_NB) < 0)
+		{
+			release();
+			return false;
+		}
+		return true;
+#endif
+	}
+
+	void release()
+	{
+#ifdef _WIN32
+		if (handle != INVALID_HANDLE_VALUE)
+			CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+#else
+		if (handle >= 0)
+			close(handle);
+		handle = -1;
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+	int handle = -1;
+#endif
+};
+
+bool compact_concurrent_database(const char *base_path)
+{
+	std::string base = base_path;
+	std::string lock_path = base + ".lock";
+
+	ExclusiveFileLock compaction_lock;
+	if (!compaction_lock.try_lock(lock_path.c_str(), true))
+	{
+		LOGE("Failed to lock %s, compaction might already be in progress.\n", lock_path.c_str());
+		return false;
+	}
+
+	struct Fragment
+	{
+		std::string path;
+		ExclusiveFileLock lock;
+	};
+	std::vector<Fragment> fragments;
+
+	// Must match the range of indices create_concurrent_database() uses.
+	for (unsigned index = 1; index < 256; index++)
+	{
+		Fragment fragment;
+		fragment.path = base + "." + std::to_string(index) + ".foz";
+
+		// Fragments which are still being written to are left for a later compaction.
+		// Writers open fragments exclusively, so once a fragment is no longer in use, it can never change again.
+		if (!fragment.lock.try_lock(fragment.path.c_str(), false))
+			continue;
+
+#ifdef _WIN32
+		// We cannot read the archive while holding an exclusive handle to it.
+		fragment.lock.release();
+#endif
+
+		fragments.push_back(std::move(fragment));
+	}
+
+	if (fragments.empty())
+		return true;
+
+	std::string archive_path = base + ".foz";
+	std::vector<Fragment *> merged;
+
+	{
+		auto append_db = std::unique_ptr<StreamArchive>(new StreamArchive(archive_path.c_str(), DatabaseMode::Append));
+		if (!append_db->prepare())
+		{
+			LOGE("Failed to open %s for compaction.\n", archive_path.c_str());
+			return false;
+		}
 
-				if (!append_db->write_entry(tag, hash, blob.data(), blob.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+		for (auto &fragment : fragments)
+		{
+			auto source_db = std::unique_ptr<StreamArchive>(new StreamArchive(fragment.path.c_str(), DatabaseMode::ReadOnly));
+
+			if (source_db->prepare())
+			{
+				if (!append_db->copy_raw_entries_from(*source_db))
+				{
+					LOGE("Failed to merge %s into %s.\n", fragment.path.c_str(), archive_path.c_str());
 					return false;
+				}
+				merged.push_back(&fragment);
+			}
+			else
+			{
+				// An empty fragment is most likely a writer which has created the file, but not locked it yet.
+				LOGE("Failed to parse %s, leaving it alone.\n", fragment.path.c_str());
 			}
 		}
+
+		// Closing the archive makes sure everything is written before we remove anything.
+	}
+
+	for (auto *fragment : merged)
+	{
+		if (remove(fragment->path.c_str()) != 0)
+			LOGE("Failed to remove %s after compaction.\n", fragment->path.c_str());
 	}
 
 	return true;
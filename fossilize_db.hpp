@@ -44,8 +44,23 @@ enum PayloadWriteFlagBits
 	PAYLOAD_WRITE_BEST_COMPRESSION_BIT = 1 << 2,
 
 	// Compute checksum of payload for more robustness.
+	// In the stream archive database, this is CRC32C if the CPU has instructions for it, and CRC32 otherwise.
+	// Payloads with CRC32C checksums cannot be read by versions of Fossilize which predate them.
 	PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT = 1 << 3,
 
+	// If WRITE_COMPRESS_BIT is set, use Zstandard rather than deflate.
+	// WRITE_BEST_COMPRESSION_BIT selects a high compression level.
+	// Only supported by the stream archive database when Fossilize is built with FOSSILIZE_ZSTD,
+	// otherwise, this falls back to deflate.
+	PAYLOAD_WRITE_COMPRESS_ZSTD_BIT = 1 << 4,
+
+	// If WRITE_COMPRESS_BIT is set, use LZ4 rather than deflate. Intended for cases where
+	// compression speed matters more than ratio, e.g. while recording.
+	// WRITE_BEST_COMPRESSION_BIT selects LZ4HC. ZSTD_BIT takes precedence if both are set.
+	// Only supported by the stream archive database when Fossilize is built with FOSSILIZE_LZ4,
+	// otherwise, this falls back to deflate.
+	PAYLOAD_WRITE_COMPRESS_LZ4_BIT = 1 << 5,
+
 	PAYLOAD_WRITE_MAX_ENUM = 0x7fffffff
 };
 
@@ -61,14 +76,62 @@ enum PayloadReadFlagBits
 	// Allows read_entry to be called concurrently from multiple threads.
 	// Might cause locking when reading from database depending on implementation.
 	// Decompression if needed is always lock-free.
-	// *NOTE*: Only tested with the Fossilize database format.
+	// Supported by the Fossilize database format and the ZIP archive backend.
 	PAYLOAD_READ_CONCURRENT_BIT = 1 << 1,
 
+	// Skips checksum verification of the payload, if it has a checksum.
+	// Intended for callers which verify checksums out of band, e.g. in a background pass with for_each_entry(),
+	// or which validate the payload themselves anyway.
+	PAYLOAD_READ_SKIP_CHECKSUM_BIT = 1 << 2,
+
 	PAYLOAD_READ_MAX_ENUM = 0x7fffffff
 };
 using PayloadWriteFlags = uint32_t;
 using PayloadReadFlags = uint32_t;
 
+// One entry in a batched read, see DatabaseInterface::read_entries().
+struct DatabaseEntryRead
+{
+	ResourceTag tag;
+	Hash hash;
+	// Size of the blob. Written when querying, must match the queried size when reading into buffer.
+	size_t size;
+	// nullptr to query the size.
+	void *buffer;
+};
+
+enum DatabaseCompression
+{
+	DATABASE_COMPRESSION_NONE = 0,
+	DATABASE_COMPRESSION_DEFLATE = 1,
+	DATABASE_COMPRESSION_ZSTD = 2,
+	DATABASE_COMPRESSION_ZSTD_DICTIONARY = 3,
+	DATABASE_COMPRESSION_LZ4 = 4,
+	DATABASE_COMPRESSION_UNKNOWN = 5,
+	DATABASE_COMPRESSION_COUNT = 6
+};
+
+// What is known about an entry without reading its payload, see DatabaseInterface::get_entry_info().
+struct DatabaseEntryInfo
+{
+	// Size of the payload as stored, and the size read_entry() returns.
+	size_t stored_size;
+	size_t uncompressed_size;
+	DatabaseCompression compression;
+	bool has_checksum;
+};
+
+// Receives entries from DatabaseInterface::for_each_entry().
+class DatabaseEntryVisitor
+{
+public:
+	virtual ~DatabaseEntryVisitor() = default;
+
+	// blob is only valid for the duration of the call.
+	// Returning false stops the iteration, and for_each_entry() fails.
+	virtual bool visit_entry(ResourceTag tag, Hash hash, const void *blob, size_t size) = 0;
+};
+
 // This is an interface to interact with an external database for blob modules.
 // It is is a simple database with key + blob.
 // NOTE: The database is NOT thread-safe.
@@ -87,6 +150,77 @@ public:
 	// The same flags must be passed when just querying size and reading data into buffer.
 	virtual bool read_entry(ResourceTag tag, Hash hash, size_t *size, void *buffer, PayloadReadFlags flags) = 0;
 
+	// Reads a batch of blob entries, with the same semantics as calling read_entry() for each of them.
+	// Like read_entry(), call this twice, first with buffer == nullptr to query sizes, then with allocated buffers.
+	// Implementations may reorder reads to match the layout on disk,
+	// which is a lot faster than reading entries one at a time when the database is not in the page cache.
+	// Fails if any of the reads fail.
+	virtual bool read_entries(DatabaseEntryRead *reads, size_t count, PayloadReadFlags flags)
+	{
+		for (size_t i = 0; i < count; i++)
+			if (!read_entry(reads[i].tag, reads[i].hash, &reads[i].size, reads[i].buffer, flags))
+				return false;
+		return true;
+	}
+
+	// Borrows the payload of an entry in place, without allocating or copying anything.
+	// This only works if the payload is already in memory exactly as read_entry() would return it,
+	// i.e. it is stored uncompressed and the database is memory mapped.
+	// Otherwise this fails, and the entry must be read with read_entry() instead.
+	// flags are interpreted as in read_entry(), except that PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT is not supported.
+	// Every successful call must be paired with release_entry(). *data stays valid until then.
+	virtual bool map_entry(ResourceTag tag, Hash hash, const void **data, size_t *size, PayloadReadFlags flags)
+	{
+		(void)tag;
+		(void)hash;
+		(void)data;
+		(void)size;
+		(void)flags;
+		return false;
+	}
+
+	// Ends a borrow from map_entry(). Pointers which were not returned by map_entry() of this database are ignored.
+	virtual void release_entry(const void *data)
+	{
+		(void)data;
+	}
+
+	// Visits every entry in the database once, in the order they are stored if the database has such an order.
+	// flags are interpreted as in read_entry().
+	// The stream archive database does not have to be prepared for this. If it is not, the archive is streamed from disk
+	// front to back without building any lookup tables, so memory use is constant no matter how large the archive is.
+	virtual bool for_each_entry(DatabaseEntryVisitor &visitor, PayloadReadFlags flags);
+
+	// Hints that the entries will be read soon, so the database can start reading them from disk ahead of time.
+	// The hint is only useful if issued far enough ahead of the actual reads, but not so far ahead that the data
+	// is evicted again before it is read. This might be a noop depending on the implementation.
+	virtual void prefetch_entries(ResourceTag tag, const Hash *hashes, size_t count)
+	{
+		(void)tag;
+		(void)hashes;
+		(void)count;
+	}
+
+	// Describes an entry from the index or payload header alone, without reading the payload.
+	// Only supported by the stream archive backend, and the concurrent database in ReadOnly mode.
+	virtual bool get_entry_info(ResourceTag tag, Hash hash, DatabaseEntryInfo *info)
+	{
+		(void)tag;
+		(void)hash;
+		(void)info;
+		return false;
+	}
+
+	// Returns the oldest FOSSILIZE_FORMAT_VERSION of the archives the database reads, appends to or deduplicates against,
+	// or FOSSILIZE_FORMAT_VERSION if there are none. Objects are hashed as of the version they were recorded with,
+	// so StateRecorder hashes new objects as of this version to deduplicate them against the existing ones.
+	// Only reads archive headers, so this can be called before prepare().
+	// Supported by the stream archive database, the concurrent database and the module store database.
+	virtual unsigned get_format_version()
+	{
+		return FOSSILIZE_FORMAT_VERSION;
+	}
+
 	// Writes an entry to database.
 	virtual bool write_entry(ResourceTag tag, Hash hash, const void *buffer, size_t size, PayloadWriteFlags flags) = 0;
 
@@ -98,6 +232,70 @@ public:
 
 	// Ensures all file writes are flushed, ala fflush(). Might be noop depending on the implementation.
 	virtual void flush() = 0;
+
+	// Sets a dictionary which is used when compressing payloads of a resource tag with PAYLOAD_WRITE_COMPRESS_ZSTD_BIT.
+	// The dictionary is stored in the database itself so that payloads can be decoded later.
+	// The dictionary must have a dictionary ID, e.g. as created by train_compression_dictionary().
+	// Only supported by the stream archive database when Fossilize is built with FOSSILIZE_ZSTD.
+	virtual bool set_compression_dictionary(ResourceTag tag, const void *dictionary, size_t size)
+	{
+		(void)tag;
+		(void)dictionary;
+		(void)size;
+		return false;
+	}
+
+	// Enables group commit. Once max_entries entries have been written, or max_interval_ms milliseconds have passed
+	// since the oldest write which has not been committed yet, written data is synced to disk and a small commit marker
+	// is appended. A database which is not closed cleanly is then recovered from the last commit marker which made it
+	// to disk, without scanning through it, and anything written after that marker is dropped.
+	// Either limit may be 0 to disable it, and passing 0 for both disables group commit, which is the default.
+	// The time limit is only checked when writing entries or on flush(), there is no background timer.
+	// Syncing happens on the thread which writes or flushes, which in the Fossilize layer is the recording thread.
+	// Only supported by the stream archive database, and by the concurrent database, which applies it to its
+	// write-only archive.
+	virtual bool set_group_commit(unsigned max_entries, unsigned max_interval_ms)
+	{
+		(void)max_entries;
+		(void)max_interval_ms;
+		return false;
+	}
+
+	// Compresses entries written with PAYLOAD_WRITE_COMPRESS_BIT on count worker threads, which run at a lowered
+	// priority. write_entry() then only copies the payload and hands it off. The thread which writes entries
+	// appends them to the database in the order they were written once they have been compressed,
+	// either on a later write_entry() or on flush() at the latest.
+	// 0 compresses on the thread which writes, which is the default.
+	// Only supported by the stream archive database, and by the concurrent database, which applies it to its
+	// write-only archive.
+	virtual bool set_compression_threads(unsigned count)
+	{
+		(void)count;
+		return false;
+	}
+
+	// Returns write shard index, which writes to a write-only archive of its own, with its own buffers.
+	// Each shard deduplicates against the read-only databases and against its own writes, but not against other shards,
+	// so different shards can be written to concurrently from different threads. The archives can be merged later.
+	// The same shard is returned for the same index. Shards are owned by the database, and must not be used after it
+	// has been destroyed. Only supported by the concurrent database in Append mode, and returns nullptr otherwise.
+	virtual DatabaseInterface *get_write_shard(unsigned index)
+	{
+		(void)index;
+		return nullptr;
+	}
+
+	// Shader modules which are not in this database are read from store instead, see create_module_store_database().
+	// In Append mode, shader modules which are already in the store are not written again,
+	// and new shader modules are written to the store rather than to this database.
+	// Shader modules in the store are not listed by get_hash_list_for_resource_tag().
+	// The store is not owned, it must be prepared, and it must outlive this database.
+	// Only supported by the concurrent database. Call before prepare().
+	virtual bool set_module_store(DatabaseInterface *store)
+	{
+		(void)store;
+		return false;
+	}
 };
 
 enum class DatabaseMode
@@ -107,7 +305,12 @@ enum class DatabaseMode
 	OverWrite,
 	// In the stream database backend, this will ensure that the database is exclusively created.
 	// For other backends, this is an alias for OverWrite
-	ExclusiveOverWrite
+	ExclusiveOverWrite,
+	// In the stream database backend, the entire archive is memory mapped,
+	// and read_entry() will decode straight from the mapping without taking any locks.
+	// If the archive cannot be mapped, this silently falls back to ReadOnly.
+	// For other backends, this is an alias for ReadOnly.
+	ReadOnlyMemoryMap
 };
 
 DatabaseInterface *create_dumb_folder_database(const char *directory_path, DatabaseMode mode);
@@ -123,8 +326,11 @@ DatabaseInterface *create_database(const char *path, DatabaseMode mode);
 // Exclusive file open mechanisms are used to ensure correctness when multiple processes are present.
 //
 // The Fossilize layer will make sure access to a single instance of DatabaseInterface is serialized to one thread.
+// To write from several threads at once, give each thread its own shard from get_write_shard(). Every shard which
+// is written to gets its own base_path.%d.foz.
 //
-// Mode can only be ReadOnly or Append. Any other mode will fail.
+// Mode can only be ReadOnly, ReadOnlyMemoryMap or Append. Any other mode will fail.
+// In ReadOnlyMemoryMap mode, all read-only databases are opened with ReadOnlyMemoryMap.
 //
 // It is possible to specify some extra database paths which are treated as read-only.
 // In ReadOnly mode, all entries in these databases are assumed to be part of the read-only database base_path.foz,
@@ -144,6 +350,36 @@ DatabaseInterface *create_concurrent_database(const char *base_path, DatabaseMod
 DatabaseInterface *create_concurrent_database_with_encoded_extra_paths(const char *base_path, DatabaseMode mode,
                                                                        const char *encoded_read_only_database_paths);
 
+// A content-addressed store of shader modules which many databases can share through set_module_store(),
+// so SPIR-V which is shipped by many applications, e.g. by middleware, is only stored once.
+// Shader module hashes only depend on the contents of the module, so the same module always ends up in the same entry.
+// The store is laid out like a concurrent database at base_path, so several processes can add to it at once,
+// and compact_concurrent_database() works on it as well.
+// Mode can only be ReadOnly, ReadOnlyMemoryMap or Append. Only shader modules can be read from or written to the store.
+// Unlike other databases, the store may be used from any number of threads once it has been prepared.
+DatabaseInterface *create_module_store_database(const char *base_path, DatabaseMode mode);
+
+// Trains a compression dictionary suitable for set_compression_dictionary().
+// samples is all sample payloads laid out back to back, with the size of each one in sample_sizes.
+// On input, *dictionary_size is the capacity of dictionary. On output, it holds the size of the trained dictionary.
+// Returns false if training fails, or if Fossilize is built without FOSSILIZE_ZSTD.
+bool train_compression_dictionary(const void *samples, const size_t *sample_sizes, unsigned num_samples,
+                                  void *dictionary, size_t *dictionary_size);
+
 // Merges stream archives found in source_paths into append_database_path.
 bool merge_concurrent_databases(const char *append_database_path, const char * const *source_paths, size_t num_source_paths);
+
+// Merges many stream archives at once into output_base_path.1.foz to output_base_path.<num_shards>.foz,
+// which are overwritten. Sources are indexed in parallel, every entry is taken from the first source which has it,
+// and payloads are copied as-is, with every shard written by its own thread.
+// The shards are named like the archives of a concurrent database, so compact_concurrent_database() can fold them
+// into output_base_path.foz. num_shards must be between 1 and 255. Sources which fail to prepare are skipped.
+bool bulk_merge_databases(const char *output_base_path, unsigned num_shards,
+                          const char * const *source_paths, size_t num_source_paths);
+
+// Folds the base_path.%d.foz archives written by a concurrent database back into base_path.foz.
+// Payloads are copied as-is without recompression, and archives which were merged are removed.
+// Archives which are still open for writing by another process are left alone for a later compaction.
+// Only one compaction can run for a given base_path at a time, which is enforced with a lock on base_path.lock.
+bool compact_concurrent_database(const char *base_path);
 }
@@ -67,6 +67,11 @@ ExternalReplayer::PollResult ExternalReplayer::poll_progress(Progress &progress)
 	return impl->poll_progress(progress);
 }
 
+bool ExternalReplayer::wait_progress(unsigned timeout_ms)
+{
+	return impl->wait_progress(timeout_ms);
+}
+
 bool ExternalReplayer::is_process_complete(int *return_status)
 {
 	return impl->is_process_complete(return_status);
@@ -86,4 +91,14 @@ bool ExternalReplayer::get_compute_failed_validation(size_t *num_hashes, Hash *h
 {
 	return impl->get_compute_failed_validation(num_hashes, hashes);
 }
+
+bool ExternalReplayer::get_latency_stats(LatencyType type, LatencyStats *stats) const
+{
+	return impl->get_latency_stats(type, stats);
+}
+
+bool ExternalReplayer::get_slowest_objects(LatencyType type, size_t *count, SlowObject *objects) const
+{
+	return impl->get_slowest_objects(type, count, objects);
+}
 }
@@ -48,8 +48,30 @@ public:
 		// Maps to --num-threads. If 0, no argument for --num-threads is passed.
 		unsigned num_threads;
 
+		// Maps to --memory-headroom and --min-threads. If memory_headroom_mb is non-zero,
+		// num_threads replayer processes are only run at once while this much system memory stays available.
+		unsigned memory_headroom_mb;
+		unsigned min_threads;
+
+		// Maps to --worker-cpus and --core-type. May be null.
+		const char *worker_cpus;
+		const char *core_type;
+
+		// Maps to --background-priority.
+		bool background_priority;
+
+		// Maps to --resource-group. The replayer moves itself into this cgroup directory on Linux,
+		// or this existing job object on Windows. May be null.
+		const char *resource_group;
+
+		// Maps to --trace. The replayer writes a Chrome trace of every process and thread here. May be null.
+		const char *trace_path;
+
 		// Maps to --device-index.
 		unsigned device_index;
+		// Maps to --device-indices, e.g. "0-1,3". Replayer processes are spread across these devices,
+		// and device_index is ignored. Every device gets its own on-disk pipeline cache. May be null.
+		const char *device_indices;
 
 		// Maps to --pipeline-cache
 		bool pipeline_cache;
@@ -76,6 +98,55 @@ public:
 
 		// Creates a dummy device, useful for benchmarking time and/or memory consumption in isolation.
 		bool null_device;
+
+		// Replays pipelines which share shader modules back to back, so fewer shader modules are evicted
+		// when the shader module cache is small. Pipeline indices refer to this order.
+		bool shader_locality_order;
+
+		// Compile times recorded by earlier replays are read from and merged into this file. May be null.
+		const char *pipeline_stats_path;
+
+		// Replays the pipelines with the longest recorded compile times first.
+		bool cost_order;
+
+		// Checks every pipeline against the driver caches with VK_EXT_pipeline_creation_cache_control first,
+		// and only compiles the pipelines which are not cached. With cache_probe_only, those are skipped as well.
+		bool cache_probe;
+		bool cache_probe_only;
+
+		// If larger than 1, worker threads create up to this many pipelines in one vkCreate*Pipelines call.
+		unsigned pipeline_batch_size;
+
+		// Implies pipeline_cache. Every worker thread compiles into its own pipeline cache,
+		// which are merged together at sync points and before the cache is written to disk.
+		bool pipeline_cache_per_thread;
+
+		// Pipelines which were replayed successfully before are recorded in this journal and skipped. May be null.
+		const char *journal_path;
+
+		// Replays everything, even pipelines which are in the journal.
+		bool full_replay;
+
+		// Replays pipelines which show up in the most databases first.
+		bool frequency_order;
+
+		// Uses a 2Q policy for the shader module cache rather than plain LRU.
+		bool shader_cache_two_queue;
+
+		// If positive, the replayer stops after this many seconds and flushes the pipeline cache,
+		// rather than being killed like with a timeout. Use an ordering option to decide what gets replayed first.
+		double time_budget_seconds;
+
+		// Shader modules which are not in the databases are read from this module store. May be null.
+		const char *module_store_path;
+
+		// Starts compiling pipelines before all static objects have been created.
+		bool streaming;
+
+		// If shard_count is larger than 1, only replays the pipelines whose hash modulo shard_count is shard_index.
+		// Used to split an archive across machines, see fossilize-replay --shard. Implies streaming.
+		unsigned shard_index;
+		unsigned shard_count;
 	};
 
 	ExternalReplayer();
@@ -114,6 +185,36 @@ public:
 	bool get_graphics_failed_validation(size_t *num_hashes, Hash *hashes) const;
 	bool get_compute_failed_validation(size_t *num_hashes, Hash *hashes) const;
 
+	enum class LatencyType : unsigned
+	{
+		ShaderModule,
+		GraphicsPipeline,
+		ComputePipeline,
+		Parse
+	};
+
+	// How long objects took to create so far, across all replayer processes.
+	// Percentiles are accurate to within 12.5%, the maximum is exact.
+	struct LatencyStats
+	{
+		uint32_t count;
+		uint32_t p50_us;
+		uint32_t p90_us;
+		uint32_t p99_us;
+		uint32_t max_us;
+	};
+	bool get_latency_stats(LatencyType type, LatencyStats *stats) const;
+
+	struct SlowObject
+	{
+		Hash hash;
+		uint32_t duration_ms;
+	};
+
+	// The slowest objects seen so far, slowest first. Works like get_faulty_spirv_modules().
+	// Only objects which were among the slowest in their own replayer process are reported.
+	bool get_slowest_objects(LatencyType type, size_t *count, SlowObject *objects) const;
+
 	enum class PollResult : unsigned
 	{
 		Running,
@@ -142,10 +243,19 @@ public:
 
 		uint32_t clean_crashes;
 		uint32_t dirty_crashes;
+
+		// How many replayer processes are currently compiling.
+		uint32_t active_workers;
 	};
 
 	PollResult poll_progress(Progress &progress);
 
+	// Blocks until the replayer reports progress, or timeout_ms passes, so callers do not have to poll on a timer.
+	// Returns true if there was progress since the last call, in which case poll_progress() will see something new.
+	// Returns true right away once the replayer has completed.
+	// If the replayer dies without completing, this only times out, so callers should check is_process_complete().
+	bool wait_progress(unsigned timeout_ms);
+
 private:
 	struct Impl;
 	Impl *impl;
@@ -23,16 +23,39 @@
 #pragma once
 
 #include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <atomic>
 static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Atomic size mismatch. This type likely requires a lock to work.");
 
 // A simple cross-process FIFO-like mechanism.
-// We're not going to bother too much if messages are dropped, since they are mostly informative.
+// Messages are dropped if the ring is full, but the replayer counts them, so they do not go missing silently.
 
 namespace Fossilize
 {
-enum { ControlBlockMessageSize = 32 };
-enum { ControlBlockMagic = 0x19bcde15 };
+enum { ControlBlockMessageSize = 64 };
+enum { ControlBlockMagic = 0x19bcde16 };
+
+// Older control blocks use 32 byte messages, and the ring buffer is protected by futex_lock
+// (or a named mutex on Windows). Replayers still accept these, and lock around their writes.
+enum { ControlBlockLegacyMessageSize = 32 };
+enum { ControlBlockLegacyMagic = 0x19bcde15 };
+
+// Latencies are counted in log-scale buckets of microseconds, with four buckets per power of two,
+// so a bucket is at most 25% wider than its lower bound. The last bucket holds everything from ~4.5 minutes up.
+enum { ControlBlockLatencyBuckets = 112 };
+
+enum ControlBlockLatencyType
+{
+	CONTROL_BLOCK_LATENCY_SHADER_MODULE = 0,
+	CONTROL_BLOCK_LATENCY_GRAPHICS_PIPELINE = 1,
+	CONTROL_BLOCK_LATENCY_COMPUTE_PIPELINE = 2,
+	CONTROL_BLOCK_LATENCY_PARSE = 3,
+	CONTROL_BLOCK_LATENCY_COUNT
+};
 
 struct SharedControlBlock
 {
@@ -59,30 +82,152 @@ struct SharedControlBlock
 	std::atomic<uint32_t> progress_started;
 	std::atomic<uint32_t> progress_complete;
 
-	// Ring buffer. Needs lock.
-	uint32_t write_count;
-	uint32_t read_count;
+	// Ring buffer. Only the replayer process writes to it, and only the ExternalReplayer reads from it,
+	// so the counts are all the synchronization we need. read_offset and write_offset belong to either side.
+	std::atomic<uint32_t> write_count;
+	std::atomic<uint32_t> read_count;
 	uint32_t read_offset;
 	uint32_t write_offset;
 	uint32_t ring_buffer_offset;
 	uint32_t ring_buffer_size;
+
+	// Everything above is laid out as in legacy control blocks, new members must go below.
+	// Legacy blocks still have room for these in front of the ring buffer, but their ExternalReplayer ignores them.
+	std::atomic<uint32_t> active_workers;
+
+	// Every replayer process adds to these as it goes.
+	std::atomic<uint32_t> latency_histogram[CONTROL_BLOCK_LATENCY_COUNT][ControlBlockLatencyBuckets];
+	std::atomic<uint32_t> latency_max_us[CONTROL_BLOCK_LATENCY_COUNT];
+
+	// Written by the replayer. Not present in legacy control blocks.
+	std::atomic<uint32_t> messages_written;
+	std::atomic<uint32_t> messages_dropped;
+
+	// The replayer bumps progress_sequence whenever it has made progress.
+	// ExternalReplayer registers in progress_waiters before it blocks, so the replayer only wakes it up when needed.
+	// On Linux, progress_sequence is used as a futex, on Windows, there is a named event for this.
+	std::atomic<uint32_t> progress_sequence;
+	std::atomic<uint32_t> progress_waiters;
 };
 
-// These are not thread-safe. Need to lock them by external means.
+// The ring buffer is placed 4 KiB into the shared block.
+static_assert(sizeof(SharedControlBlock) <= 4 * 1024, "Shared control block does not fit in front of the ring buffer.");
+static_assert(offsetof(SharedControlBlock, ring_buffer_size) == 23 * sizeof(uint32_t),
+              "Ring buffer members must stay where legacy control blocks have them.");
+
+static inline unsigned control_block_latency_bucket(uint64_t us)
+{
+	if (us < 4)
+		return unsigned(us);
+
+	unsigned msb = 2;
+	while (msb < 63 && (us >> (msb + 1)) != 0)
+		msb++;
+
+	unsigned bucket = 4 * (msb - 1) + unsigned((us >> (msb - 2)) & 3);
+	return bucket < ControlBlockLatencyBuckets ? bucket : (ControlBlockLatencyBuckets - 1);
+}
+
+// The middle of the range a bucket covers.
+static inline uint64_t control_block_latency_bucket_value_us(unsigned bucket)
+{
+	if (bucket < 8)
+		return bucket;
+
+	unsigned msb = bucket / 4 + 1;
+	uint64_t lower = uint64_t(4 + (bucket & 3)) << (msb - 2);
+	uint64_t width = uint64_t(1) << (msb - 2);
+	return lower + width / 2;
+}
+
+// percentile is in [0, 1].
+static inline uint64_t control_block_latency_percentile_us(const uint32_t *buckets, double percentile)
+{
+	uint64_t total = 0;
+	for (unsigned i = 0; i < ControlBlockLatencyBuckets; i++)
+		total += buckets[i];
+	if (!total)
+		return 0;
+
+	uint64_t rank = uint64_t(percentile * double(total) + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t accumulated = 0;
+	for (unsigned i = 0; i < ControlBlockLatencyBuckets; i++)
+	{
+		accumulated += buckets[i];
+		if (accumulated >= rank)
+			return control_block_latency_bucket_value_us(i);
+	}
+	return control_block_latency_bucket_value_us(ControlBlockLatencyBuckets - 1);
+}
+
+static inline void control_block_record_latency(SharedControlBlock *control_block, ControlBlockLatencyType type, uint64_t us)
+{
+	control_block->latency_histogram[type][control_block_latency_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+
+	uint32_t clamped_us = us < UINT32_MAX ? uint32_t(us) : UINT32_MAX;
+	uint32_t current = control_block->latency_max_us[type].load(std::memory_order_relaxed);
+	while (current < clamped_us &&
+	       !control_block->latency_max_us[type].compare_exchange_weak(current, clamped_us, std::memory_order_relaxed))
+	{
+	}
+}
+
+// Replayer processes report the objects which were slowest to create as "SLOW<type> <hash> <milliseconds>".
+static inline void control_block_format_slow_object(char *buffer, ControlBlockLatencyType type, uint64_t hash, uint64_t ms)
+{
+	// Leave room for the newline and terminator.
+	if (ms > 9999999)
+		ms = 9999999;
+	snprintf(buffer, ControlBlockMessageSize, "SLOW%u %016" PRIx64 " %u\n", unsigned(type), hash, unsigned(ms));
+}
+
+static inline bool control_block_parse_slow_object(const char *msg, ControlBlockLatencyType *type, uint64_t *hash, uint32_t *ms)
+{
+	if (strncmp(msg, "SLOW", 4) != 0)
+		return false;
+
+	char *end = nullptr;
+	unsigned long t = strtoul(msg + 4, &end, 10);
+	if (t >= CONTROL_BLOCK_LATENCY_COUNT)
+		return false;
+
+	*type = ControlBlockLatencyType(t);
+	*hash = strtoull(end, &end, 16);
+	*ms = uint32_t(strtoul(end, nullptr, 10));
+	return true;
+}
+
+static inline bool shared_control_block_is_legacy(const SharedControlBlock *control_block)
+{
+	return control_block->version_cookie == ControlBlockLegacyMagic;
+}
+
+static inline uint32_t shared_control_block_message_size(const SharedControlBlock *control_block)
+{
+	return shared_control_block_is_legacy(control_block) ? uint32_t(ControlBlockLegacyMessageSize) : uint32_t(ControlBlockMessageSize);
+}
+
+// These are safe to call with one reader and one writer at a time.
 static inline uint32_t shared_control_block_read_avail(SharedControlBlock *control_block)
 {
-	uint32_t ret = control_block->write_count - control_block->read_count;
+	uint32_t ret = control_block->write_count.load(std::memory_order_acquire) -
+	               control_block->read_count.load(std::memory_order_relaxed);
 	return ret;
 }
 
 static inline uint32_t shared_control_block_write_avail(SharedControlBlock *control_block)
 {
 	uint32_t ret = 0;
-	uint32_t max_capacity_write_count = control_block->read_count + control_block->ring_buffer_size;
-	if (control_block->write_count >= max_capacity_write_count)
+	uint32_t write_count = control_block->write_count.load(std::memory_order_relaxed);
+	uint32_t max_capacity_write_count = control_block->read_count.load(std::memory_order_acquire) +
+	                                    control_block->ring_buffer_size;
+	if (write_count >= max_capacity_write_count)
 		ret = 0;
 	else
-		ret = max_capacity_write_count - control_block->write_count;
+		ret = max_capacity_write_count - write_count;
 	return ret;
 }
 
@@ -95,7 +240,8 @@ static inline bool shared_control_block_read(SharedControlBlock *control_block,
 	if (size > control_block->ring_buffer_size)
 		return false;
 
-	if (size > (control_block->write_count - control_block->read_count))
+	uint32_t read_count = control_block->read_count.load(std::memory_order_relaxed);
+	if (size > control_block->write_count.load(std::memory_order_acquire) - read_count)
 		return false;
 
 	uint32_t read_first = control_block->ring_buffer_size - control_block->read_offset;
@@ -109,7 +255,7 @@ static inline bool shared_control_block_read(SharedControlBlock *control_block,
 		memcpy(data + read_first, ring, read_second);
 
 	control_block->read_offset = (control_block->read_offset + size) & (control_block->ring_buffer_size - 1);
-	control_block->read_count += size;
+	control_block->read_count.store(read_count + size, std::memory_order_release);
 	return true;
 }
 
@@ -122,8 +268,10 @@ static inline bool shared_control_block_write(SharedControlBlock *control_block,
 	if (size > control_block->ring_buffer_size)
 		return false;
 
-	uint32_t max_capacity_write_count = control_block->read_count + control_block->ring_buffer_size;
-	if (control_block->write_count + size > max_capacity_write_count)
+	uint32_t write_count = control_block->write_count.load(std::memory_order_relaxed);
+	uint32_t max_capacity_write_count = control_block->read_count.load(std::memory_order_acquire) +
+	                                    control_block->ring_buffer_size;
+	if (write_count + size > max_capacity_write_count)
 		return false;
 
 	uint32_t write_first = control_block->ring_buffer_size - control_block->write_offset;
@@ -137,8 +285,38 @@ static inline bool shared_control_block_write(SharedControlBlock *control_block,
 		memcpy(ring, data + write_first, write_second);
 
 	control_block->write_offset = (control_block->write_offset + size) & (control_block->ring_buffer_size - 1);
-	control_block->write_count += size;
+	control_block->write_count.store(write_count + size, std::memory_order_release);
 
 	return true;
 }
+
+// Returns true if a waiter has to be woken up.
+static inline bool shared_control_block_bump_progress(SharedControlBlock *control_block)
+{
+	if (shared_control_block_is_legacy(control_block))
+		return false;
+
+	// Pairs with the waiter, which registers itself before checking progress_sequence.
+	control_block->progress_sequence.fetch_add(1, std::memory_order_seq_cst);
+	return control_block->progress_waiters.load(std::memory_order_seq_cst) != 0;
+}
+
+// Writes one message, truncated to the message size of the control block.
+// Legacy control blocks must be locked by external means.
+static inline bool shared_control_block_write_message(SharedControlBlock *control_block, const char *msg)
+{
+	char buffer[ControlBlockMessageSize] = {};
+	uint32_t size = shared_control_block_message_size(control_block);
+	snprintf(buffer, size, "%s", msg);
+
+	bool ret = shared_control_block_write(control_block, buffer, size);
+	if (!shared_control_block_is_legacy(control_block))
+	{
+		if (ret)
+			control_block->messages_written.fetch_add(1, std::memory_order_relaxed);
+		else
+			control_block->messages_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	return ret;
+}
 }
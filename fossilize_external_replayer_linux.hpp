@@ -35,6 +35,7 @@
 #include <atomic>
 #include <vector>
 #include <unordered_set>
+#include <algorithm>
 #include <string>
 #include <signal.h>
 #include <limits.h>
@@ -60,12 +61,15 @@ struct ExternalReplayer::Impl
 	SharedControlBlock *shm_block = nullptr;
 	size_t shm_block_size = 0;
 	int wstatus = 0;
+	uint32_t last_progress_sequence = 0;
 	std::unordered_set<Hash> faulty_spirv_modules;
 	std::unordered_set<Hash> graphics_failed_validation;
 	std::unordered_set<Hash> compute_failed_validation;
+	std::vector<ExternalReplayer::SlowObject> slowest_objects[CONTROL_BLOCK_LATENCY_COUNT];
 
 	bool start(const ExternalReplayer::Options &options);
 	ExternalReplayer::PollResult poll_progress(Progress &progress);
+	bool wait_progress(unsigned timeout_ms);
 	uintptr_t get_process_handle() const;
 	int wait();
 	bool is_process_complete(int *return_status);
@@ -76,6 +80,9 @@ struct ExternalReplayer::Impl
 	bool get_graphics_failed_validation(size_t *count, Hash *hashes) const;
 	bool get_compute_failed_validation(size_t *count, Hash *hashes) const;
 	bool get_failed(const std::unordered_set<Hash> &failed, size_t *count, Hash *hashes) const;
+	bool get_latency_stats(ExternalReplayer::LatencyType type, ExternalReplayer::LatencyStats *stats) const;
+	bool get_slowest_objects(ExternalReplayer::LatencyType type, size_t *count, ExternalReplayer::SlowObject *objects) const;
+	void record_slow_object(ControlBlockLatencyType type, Hash hash, uint32_t duration_ms);
 };
 
 ExternalReplayer::Impl::~Impl()
@@ -116,19 +123,51 @@ ExternalReplayer::PollResult ExternalReplayer::Impl::poll_progress(ExternalRepla
 	progress.module_validation_failures = shm_block->module_validation_failures.load(std::memory_order_relaxed);
 	progress.clean_crashes = shm_block->clean_process_deaths.load(std::memory_order_relaxed);
 	progress.dirty_crashes = shm_block->dirty_process_deaths.load(std::memory_order_relaxed);
+	progress.active_workers = shm_block->active_workers.load(std::memory_order_relaxed);
 
-	futex_wrapper_lock(&shm_block->futex_lock);
+	// We are the only reader, and the replayer is the only writer, so this needs no lock.
 	size_t read_avail = shared_control_block_read_avail(shm_block);
 	for (size_t i = ControlBlockMessageSize; i <= read_avail; i += ControlBlockMessageSize)
 	{
 		char buf[ControlBlockMessageSize] = {};
 		shared_control_block_read(shm_block, buf, sizeof(buf));
+		buf[ControlBlockMessageSize - 1] = '\0';
 		parse_message(buf);
 	}
-	futex_wrapper_unlock(&shm_block->futex_lock);
 	return complete ? ExternalReplayer::PollResult::Complete : ExternalReplayer::PollResult::Running;
 }
 
+bool ExternalReplayer::Impl::wait_progress(unsigned timeout_ms)
+{
+	if (!shm_block)
+		return false;
+	if (shm_block->progress_complete.load(std::memory_order_acquire) != 0)
+		return true;
+
+	uint32_t sequence = shm_block->progress_sequence.load(std::memory_order_acquire);
+	if (sequence == last_progress_sequence)
+	{
+		shm_block->progress_waiters.fetch_add(1, std::memory_order_seq_cst);
+		sequence = shm_block->progress_sequence.load(std::memory_order_seq_cst);
+		if (sequence == last_progress_sequence)
+		{
+#ifdef __linux__
+			futex_wrapper_wait(reinterpret_cast<uint32_t *>(&shm_block->progress_sequence), sequence, timeout_ms);
+#else
+			// No cross-process futex here, so fall back to polling at a fine granularity.
+			for (unsigned i = 0; i < timeout_ms && shm_block->progress_sequence.load(std::memory_order_acquire) == sequence; i++)
+				usleep(1000);
+#endif
+			sequence = shm_block->progress_sequence.load(std::memory_order_acquire);
+		}
+		shm_block->progress_waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	bool changed = sequence != last_progress_sequence;
+	last_progress_sequence = sequence;
+	return changed || shm_block->progress_complete.load(std::memory_order_acquire) != 0;
+}
+
 static int wstatus_to_return(int wstatus)
 {
 	if (WIFEXITED(wstatus))
@@ -156,6 +195,37 @@ void ExternalReplayer::Impl::parse_message(const char *msg)
 		auto hash = strtoull(msg + 12, nullptr, 16);
 		compute_failed_validation.insert(hash);
 	}
+	else
+	{
+		ControlBlockLatencyType type;
+		Hash hash;
+		uint32_t duration_ms;
+		if (control_block_parse_slow_object(msg, &type, &hash, &duration_ms))
+			record_slow_object(type, hash, duration_ms);
+	}
+}
+
+void ExternalReplayer::Impl::record_slow_object(ControlBlockLatencyType type, Hash hash, uint32_t duration_ms)
+{
+	// Every process reports its own slowest objects, keep the slowest of them all.
+	const size_t max_slowest = 16;
+	auto &slowest = slowest_objects[type];
+
+	auto itr = std::find_if(slowest.begin(), slowest.end(), [&](const ExternalReplayer::SlowObject &object) {
+		return object.hash == hash;
+	});
+
+	if (itr != slowest.end())
+		itr->duration_ms = std::max(itr->duration_ms, duration_ms);
+	else
+		slowest.push_back({ hash, duration_ms });
+
+	std::stable_sort(slowest.begin(), slowest.end(), [](const ExternalReplayer::SlowObject &a, const ExternalReplayer::SlowObject &b) {
+		return a.duration_ms > b.duration_ms;
+	});
+
+	if (slowest.size() > max_slowest)
+		slowest.resize(max_slowest);
 }
 
 bool ExternalReplayer::Impl::is_process_complete(int *return_status)
@@ -224,6 +294,59 @@ bool ExternalReplayer::Impl::get_failed(const std::unordered_set<Hash> &failed,
 	}
 }
 
+bool ExternalReplayer::Impl::get_latency_stats(ExternalReplayer::LatencyType type, ExternalReplayer::LatencyStats *stats) const
+{
+	unsigned index = unsigned(type);
+	if (!shm_block || index >= CONTROL_BLOCK_LATENCY_COUNT)
+		return false;
+
+	uint32_t buckets[ControlBlockLatencyBuckets];
+	uint32_t count = 0;
+	for (unsigned i = 0; i < ControlBlockLatencyBuckets; i++)
+	{
+		buckets[i] = shm_block->latency_histogram[index][i].load(std::memory_order_relaxed);
+		count += buckets[i];
+	}
+
+	// The middle of a bucket can be past the slowest object in it.
+	uint32_t max_us = shm_block->latency_max_us[index].load(std::memory_order_relaxed);
+	const auto percentile = [&](double p) -> uint32_t {
+		uint64_t us = control_block_latency_percentile_us(buckets, p);
+		return us < max_us ? uint32_t(us) : max_us;
+	};
+
+	stats->count = count;
+	stats->p50_us = percentile(0.5);
+	stats->p90_us = percentile(0.9);
+	stats->p99_us = percentile(0.99);
+	stats->max_us = max_us;
+	return true;
+}
+
+bool ExternalReplayer::Impl::get_slowest_objects(ExternalReplayer::LatencyType type, size_t *count,
+                                                 ExternalReplayer::SlowObject *objects) const
+{
+	unsigned index = unsigned(type);
+	if (index >= CONTROL_BLOCK_LATENCY_COUNT)
+		return false;
+
+	auto &slowest = slowest_objects[index];
+	if (objects)
+	{
+		if (*count != slowest.size())
+			return false;
+
+		for (auto &object : slowest)
+			*objects++ = object;
+		return true;
+	}
+	else
+	{
+		*count = slowest.size();
+		return true;
+	}
+}
+
 bool ExternalReplayer::Impl::get_faulty_spirv_modules(size_t *count, Hash *hashes) const
 {
 	return get_failed(faulty_spirv_modules, count, hashes);
@@ -250,8 +373,8 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 		return false;
 	}
 
-	// Reserve 4 kB for control data, and 64 kB for a cross-process SHMEM ring buffer.
-	shm_block_size = 64 * 1024 + 4 * 1024;
+	// Reserve 4 kB for control data, and 256 kB for a cross-process SHMEM ring buffer.
+	shm_block_size = 256 * 1024 + 4 * 1024;
 
 	if (ftruncate(fd, shm_block_size) < 0)
 		return false;
@@ -270,7 +393,7 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 	memset(static_cast<void *>(shm_block), 0, shm_block_size);
 	shm_block->version_cookie = ControlBlockMagic;
 
-	shm_block->ring_buffer_size = 64 * 1024;
+	shm_block->ring_buffer_size = 256 * 1024;
 	shm_block->ring_buffer_offset = 4 * 1024;
 
 	// We need to let our child inherit the shared FD.
@@ -338,6 +461,8 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 
 		if (options.pipeline_cache)
 			argv.push_back("--pipeline-cache");
+		if (options.pipeline_cache_per_thread)
+			argv.push_back("--pipeline-cache-per-thread");
 		if (options.spirv_validate)
 			argv.push_back("--spirv-val");
 
@@ -348,6 +473,45 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 			argv.push_back(num_thread_holder);
 		}
 
+		char memory_headroom_holder[16];
+		char min_threads_holder[16];
+		if (options.memory_headroom_mb)
+		{
+			argv.push_back("--memory-headroom");
+			sprintf(memory_headroom_holder, "%u", options.memory_headroom_mb);
+			argv.push_back(memory_headroom_holder);
+			argv.push_back("--min-threads");
+			sprintf(min_threads_holder, "%u", options.min_threads);
+			argv.push_back(min_threads_holder);
+		}
+
+		if (options.worker_cpus)
+		{
+			argv.push_back("--worker-cpus");
+			argv.push_back(options.worker_cpus);
+		}
+
+		if (options.core_type)
+		{
+			argv.push_back("--core-type");
+			argv.push_back(options.core_type);
+		}
+
+		if (options.background_priority)
+			argv.push_back("--background-priority");
+
+		if (options.resource_group)
+		{
+			argv.push_back("--resource-group");
+			argv.push_back(options.resource_group);
+		}
+
+		if (options.trace_path)
+		{
+			argv.push_back("--trace");
+			argv.push_back(options.trace_path);
+		}
+
 		if (options.on_disk_pipeline_cache)
 		{
 			argv.push_back("--on-disk-pipeline-cache");
@@ -363,11 +527,88 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 		if (options.null_device)
 			argv.push_back("--null-device");
 
+		if (options.shader_locality_order)
+			argv.push_back("--shader-locality-order");
+
+		if (options.pipeline_stats_path)
+		{
+			argv.push_back("--pipeline-stats");
+			argv.push_back(options.pipeline_stats_path);
+		}
+
+		if (options.cost_order)
+			argv.push_back("--cost-order");
+
+		if (options.cache_probe_only)
+			argv.push_back("--cache-probe-only");
+		else if (options.cache_probe)
+			argv.push_back("--cache-probe");
+
+		if (options.journal_path)
+		{
+			argv.push_back("--journal");
+			argv.push_back(options.journal_path);
+		}
+
+		if (options.module_store_path)
+		{
+			argv.push_back("--module-store");
+			argv.push_back(options.module_store_path);
+		}
+
+		if (options.full_replay)
+			argv.push_back("--full");
+
+		if (options.streaming)
+			argv.push_back("--streaming");
+
+		if (options.frequency_order)
+		{
+			argv.push_back("--priority");
+			argv.push_back("frequency");
+		}
+
+		if (options.shader_cache_two_queue)
+		{
+			argv.push_back("--shader-cache-policy");
+			argv.push_back("2q");
+		}
+
+		char time_budget_holder[32];
+		if (options.time_budget_seconds > 0.0)
+		{
+			argv.push_back("--time-budget");
+			sprintf(time_budget_holder, "%.3f", options.time_budget_seconds);
+			argv.push_back(time_budget_holder);
+		}
+
+		char shard_holder[32];
+		if (options.shard_count > 1)
+		{
+			argv.push_back("--shard");
+			sprintf(shard_holder, "%u/%u", options.shard_index, options.shard_count);
+			argv.push_back(shard_holder);
+		}
+
+		char batch_size_holder[16];
+		if (options.pipeline_batch_size > 1)
+		{
+			argv.push_back("--pipeline-batch-size");
+			sprintf(batch_size_holder, "%u", options.pipeline_batch_size);
+			argv.push_back(batch_size_holder);
+		}
+
 		argv.push_back("--device-index");
 		char index_name[16];
 		sprintf(index_name, "%u", options.device_index);
 		argv.push_back(index_name);
 
+		if (options.device_indices)
+		{
+			argv.push_back("--device-indices");
+			argv.push_back(options.device_indices);
+		}
+
 		argv.push_back(nullptr);
 
 		if (options.quiet)
@@ -28,6 +28,8 @@
 #include <string>
 #include <atomic>
 #include <unordered_set>
+#include <vector>
+#include <algorithm>
 #include "fossilize_external_replayer_control_block.hpp"
 #include "path.hpp"
 
@@ -42,16 +44,20 @@ struct ExternalReplayer::Impl
 	HANDLE process = nullptr;
 	HANDLE mapping_handle = nullptr;
 	HANDLE mutex = nullptr;
+	HANDLE progress_event = nullptr;
 	HANDLE job_handle = nullptr;
 	SharedControlBlock *shm_block = nullptr;
 	size_t shm_block_size = 0;
 	DWORD exit_code = 0;
+	uint32_t last_progress_sequence = 0;
 	std::unordered_set<Hash> faulty_spirv_modules;
 	std::unordered_set<Hash> graphics_failed_validation;
 	std::unordered_set<Hash> compute_failed_validation;
+	std::vector<ExternalReplayer::SlowObject> slowest_objects[CONTROL_BLOCK_LATENCY_COUNT];
 
 	bool start(const ExternalReplayer::Options &options);
 	ExternalReplayer::PollResult poll_progress(Progress &progress);
+	bool wait_progress(unsigned timeout_ms);
 	uintptr_t get_process_handle() const;
 	int wait();
 	bool is_process_complete(int *return_status);
@@ -62,6 +68,9 @@ struct ExternalReplayer::Impl
 	bool get_graphics_failed_validation(size_t *count, Hash *hashes) const;
 	bool get_compute_failed_validation(size_t *count, Hash *hashes) const;
 	bool get_failed(const std::unordered_set<Hash> &failed, size_t *count, Hash *hashes) const;
+	bool get_latency_stats(ExternalReplayer::LatencyType type, ExternalReplayer::LatencyStats *stats) const;
+	bool get_slowest_objects(ExternalReplayer::LatencyType type, size_t *count, ExternalReplayer::SlowObject *objects) const;
+	void record_slow_object(ControlBlockLatencyType type, Hash hash, uint32_t duration_ms);
 };
 
 ExternalReplayer::Impl::~Impl()
@@ -72,6 +81,8 @@ ExternalReplayer::Impl::~Impl()
 		CloseHandle(mapping_handle);
 	if (mutex)
 		CloseHandle(mutex);
+	if (progress_event)
+		CloseHandle(progress_event);
 	if (process)
 		CloseHandle(process);
 	if (job_handle)
@@ -107,19 +118,44 @@ ExternalReplayer::PollResult ExternalReplayer::Impl::poll_progress(ExternalRepla
 	progress.module_validation_failures = shm_block->module_validation_failures.load(std::memory_order_relaxed);
 	progress.clean_crashes = shm_block->clean_process_deaths.load(std::memory_order_relaxed);
 	progress.dirty_crashes = shm_block->dirty_process_deaths.load(std::memory_order_relaxed);
+	progress.active_workers = shm_block->active_workers.load(std::memory_order_relaxed);
 
-	if (WaitForSingleObject(mutex, INFINITE) == WAIT_OBJECT_0)
+	// We are the only reader, and the replayer is the only writer, so this needs no lock.
+	size_t read_avail = shared_control_block_read_avail(shm_block);
+	for (size_t i = ControlBlockMessageSize; i <= read_avail; i += ControlBlockMessageSize)
 	{
-		size_t read_avail = shared_control_block_read_avail(shm_block);
-		for (size_t i = ControlBlockMessageSize; i <= read_avail; i += ControlBlockMessageSize)
+		char buf[ControlBlockMessageSize] = {};
+		shared_control_block_read(shm_block, buf, sizeof(buf));
+		buf[ControlBlockMessageSize - 1] = '\0';
+		parse_message(buf);
+	}
+	return complete ? ExternalReplayer::PollResult::Complete : ExternalReplayer::PollResult::Running;
+}
+
+bool ExternalReplayer::Impl::wait_progress(unsigned timeout_ms)
+{
+	if (!shm_block || !progress_event)
+		return false;
+	if (shm_block->progress_complete.load(std::memory_order_acquire) != 0)
+		return true;
+
+	uint32_t sequence = shm_block->progress_sequence.load(std::memory_order_acquire);
+	if (sequence == last_progress_sequence)
+	{
+		shm_block->progress_waiters.fetch_add(1, std::memory_order_seq_cst);
+		sequence = shm_block->progress_sequence.load(std::memory_order_seq_cst);
+		// The event is auto-reset, so a stale signal only makes us wake up once for nothing.
+		if (sequence == last_progress_sequence)
 		{
-			char buf[ControlBlockMessageSize] = {};
-			shared_control_block_read(shm_block, buf, sizeof(buf));
-			parse_message(buf);
+			WaitForSingleObject(progress_event, timeout_ms);
+			sequence = shm_block->progress_sequence.load(std::memory_order_acquire);
 		}
-		ReleaseMutex(mutex);
+		shm_block->progress_waiters.fetch_sub(1, std::memory_order_relaxed);
 	}
-	return complete ? ExternalReplayer::PollResult::Complete : ExternalReplayer::PollResult::Running;
+
+	bool changed = sequence != last_progress_sequence;
+	last_progress_sequence = sequence;
+	return changed || shm_block->progress_complete.load(std::memory_order_acquire) != 0;
 }
 
 void ExternalReplayer::Impl::parse_message(const char *msg)
@@ -139,6 +175,37 @@ void ExternalReplayer::Impl::parse_message(const char *msg)
 		auto hash = strtoull(msg + 12, nullptr, 16);
 		compute_failed_validation.insert(hash);
 	}
+	else
+	{
+		ControlBlockLatencyType type;
+		Hash hash;
+		uint32_t duration_ms;
+		if (control_block_parse_slow_object(msg, &type, &hash, &duration_ms))
+			record_slow_object(type, hash, duration_ms);
+	}
+}
+
+void ExternalReplayer::Impl::record_slow_object(ControlBlockLatencyType type, Hash hash, uint32_t duration_ms)
+{
+	// Every process reports its own slowest objects, keep the slowest of them all.
+	const size_t max_slowest = 16;
+	auto &slowest = slowest_objects[type];
+
+	auto itr = std::find_if(slowest.begin(), slowest.end(), [&](const ExternalReplayer::SlowObject &object) {
+		return object.hash == hash;
+	});
+
+	if (itr != slowest.end())
+		itr->duration_ms = std::max(itr->duration_ms, duration_ms);
+	else
+		slowest.push_back({ hash, duration_ms });
+
+	std::stable_sort(slowest.begin(), slowest.end(), [](const ExternalReplayer::SlowObject &a, const ExternalReplayer::SlowObject &b) {
+		return a.duration_ms > b.duration_ms;
+	});
+
+	if (slowest.size() > max_slowest)
+		slowest.resize(max_slowest);
 }
 
 bool ExternalReplayer::Impl::is_process_complete(int *return_status)
@@ -215,6 +282,59 @@ bool ExternalReplayer::Impl::get_failed(const std::unordered_set<Hash> &failed,
 	}
 }
 
+bool ExternalReplayer::Impl::get_latency_stats(ExternalReplayer::LatencyType type, ExternalReplayer::LatencyStats *stats) const
+{
+	unsigned index = unsigned(type);
+	if (!shm_block || index >= CONTROL_BLOCK_LATENCY_COUNT)
+		return false;
+
+	uint32_t buckets[ControlBlockLatencyBuckets];
+	uint32_t count = 0;
+	for (unsigned i = 0; i < ControlBlockLatencyBuckets; i++)
+	{
+		buckets[i] = shm_block->latency_histogram[index][i].load(std::memory_order_relaxed);
+		count += buckets[i];
+	}
+
+	// The middle of a bucket can be past the slowest object in it.
+	uint32_t max_us = shm_block->latency_max_us[index].load(std::memory_order_relaxed);
+	const auto percentile = [&](double p) -> uint32_t {
+		uint64_t us = control_block_latency_percentile_us(buckets, p);
+		return us < max_us ? uint32_t(us) : max_us;
+	};
+
+	stats->count = count;
+	stats->p50_us = percentile(0.5);
+	stats->p90_us = percentile(0.9);
+	stats->p99_us = percentile(0.99);
+	stats->max_us = max_us;
+	return true;
+}
+
+bool ExternalReplayer::Impl::get_slowest_objects(ExternalReplayer::LatencyType type, size_t *count,
+                                                 ExternalReplayer::SlowObject *objects) const
+{
+	unsigned index = unsigned(type);
+	if (index >= CONTROL_BLOCK_LATENCY_COUNT)
+		return false;
+
+	auto &slowest = slowest_objects[index];
+	if (objects)
+	{
+		if (*count != slowest.size())
+			return false;
+
+		for (auto &object : slowest)
+			*objects++ = object;
+		return true;
+	}
+	else
+	{
+		*count = slowest.size();
+		return true;
+	}
+}
+
 bool ExternalReplayer::Impl::get_faulty_spirv_modules(size_t *count, Hash *hashes) const
 {
 	return get_failed(faulty_spirv_modules, count, hashes);
@@ -232,8 +352,8 @@ bool ExternalReplayer::Impl::get_compute_failed_validation(size_t *count, Hash *
 
 bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 {
-	// Reserve 4 kB for control data, and 64 kB for a cross-process SHMEM ring buffer.
-	shm_block_size = 64 * 1024 + 4 * 1024;
+	// Reserve 4 kB for control data, and 256 kB for a cross-process SHMEM ring buffer.
+	shm_block_size = 256 * 1024 + 4 * 1024;
 
 	char shm_name[256];
 	char shm_mutex_name[256];
@@ -260,7 +380,7 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 	// Cast to void explicitly to avoid warnings on GCC 8.
 	memset(static_cast<void *>(shm_block), 0, shm_block_size);
 	shm_block->version_cookie = ControlBlockMagic;
-	shm_block->ring_buffer_size = 64 * 1024;
+	shm_block->ring_buffer_size = 256 * 1024;
 	shm_block->ring_buffer_offset = 4 * 1024;
 
 	mutex = CreateMutexA(nullptr, FALSE, shm_mutex_name);
@@ -270,6 +390,16 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 		return false;
 	}
 
+	// The replayer derives the name of the progress event from the mutex name.
+	std::string progress_event_name = shm_mutex_name;
+	progress_event_name += "-progress";
+	progress_event = CreateEventA(nullptr, FALSE, FALSE, progress_event_name.c_str());
+	if (!progress_event)
+	{
+		LOGE("Failed to create named event.\n");
+		return false;
+	}
+
 	std::string cmdline;
 	cmdline += "\"";
 	if (options.external_replayer_path)
@@ -295,6 +425,8 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 
 	if (options.pipeline_cache)
 		cmdline += " --pipeline-cache";
+	if (options.pipeline_cache_per_thread)
+		cmdline += " --pipeline-cache-per-thread";
 	if (options.spirv_validate)
 		cmdline += " --spirv-val";
 
@@ -304,6 +436,43 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 		cmdline += std::to_string(options.num_threads);
 	}
 
+	if (options.memory_headroom_mb)
+	{
+		cmdline += " --memory-headroom ";
+		cmdline += std::to_string(options.memory_headroom_mb);
+		cmdline += " --min-threads ";
+		cmdline += std::to_string(options.min_threads);
+	}
+
+	if (options.worker_cpus)
+	{
+		cmdline += " --worker-cpus ";
+		cmdline += options.worker_cpus;
+	}
+
+	if (options.core_type)
+	{
+		cmdline += " --core-type ";
+		cmdline += options.core_type;
+	}
+
+	if (options.background_priority)
+		cmdline += " --background-priority";
+
+	if (options.resource_group)
+	{
+		cmdline += " --resource-group \"";
+		cmdline += options.resource_group;
+		cmdline += "\"";
+	}
+
+	if (options.trace_path)
+	{
+		cmdline += " --trace \"";
+		cmdline += options.trace_path;
+		cmdline += "\"";
+	}
+
 	if (options.on_disk_pipeline_cache)
 	{
 		cmdline += " --on-disk-pipeline-cache ";
@@ -315,6 +484,12 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 	cmdline += " --device-index ";
 	cmdline += std::to_string(options.device_index);
 
+	if (options.device_indices)
+	{
+		cmdline += " --device-indices ";
+		cmdline += options.device_indices;
+	}
+
 	if (options.enable_validation)
 		cmdline += " --enable-validation";
 
@@ -324,6 +499,73 @@ bool ExternalReplayer::Impl::start(const ExternalReplayer::Options &options)
 	if (options.null_device)
 		cmdline += " --null-device";
 
+	if (options.shader_locality_order)
+		cmdline += " --shader-locality-order";
+
+	if (options.pipeline_stats_path)
+	{
+		cmdline += " --pipeline-stats ";
+		cmdline += "\"";
+		cmdline += options.pipeline_stats_path;
+		cmdline += "\"";
+	}
+
+	if (options.cost_order)
+		cmdline += " --cost-order";
+
+	if (options.cache_probe_only)
+		cmdline += " --cache-probe-only";
+	else if (options.cache_probe)
+		cmdline += " --cache-probe";
+
+	if (options.journal_path)
+	{
+		cmdline += " --journal ";
+		cmdline += "\"";
+		cmdline += options.journal_path;
+		cmdline += "\"";
+	}
+
+	if (options.module_store_path)
+	{
+		cmdline += " --module-store ";
+		cmdline += "\"";
+		cmdline += options.module_store_path;
+		cmdline += "\"";
+	}
+
+	if (options.full_replay)
+		cmdline += " --full";
+
+	if (options.streaming)
+		cmdline += " --streaming";
+
+	if (options.frequency_order)
+		cmdline += " --priority frequency";
+
+	if (options.shader_cache_two_queue)
+		cmdline += " --shader-cache-policy 2q";
+
+	if (options.time_budget_seconds > 0.0)
+	{
+		cmdline += " --time-budget ";
+		cmdline += std::to_string(options.time_budget_seconds);
+	}
+
+	if (options.shard_count > 1)
+	{
+		cmdline += " --shard ";
+		cmdline += std::to_string(options.shard_index);
+		cmdline += "/";
+		cmdline += std::to_string(options.shard_count);
+	}
+
+	if (options.pipeline_batch_size > 1)
+	{
+		cmdline += " --pipeline-batch-size ";
+		cmdline += std::to_string(options.pipeline_batch_size);
+	}
+
 	STARTUPINFO si = {};
 	si.cb = sizeof(STARTUPINFO);
 	si.dwFlags = STARTF_USESTDHANDLES;
@@ -0,0 +1,234 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "fossilize_profiling.hpp"
+#include "layer/utils.hpp"
+#include <chrono>
+
+#ifdef FOSSILIZE_PROFILING
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#endif
+
+namespace Fossilize
+{
+namespace Profiling
+{
+int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef FOSSILIZE_PROFILING
+// Enough for a few seconds of a busy recorder thread.
+static const size_t EventsPerThread = 64 * 1024;
+
+struct Event
+{
+	const char *name;
+	uint64_t hash;
+	int64_t start_ns;
+	int64_t duration_ns;
+};
+
+// Only the owning thread records, the lock is only ever contended while a trace is written.
+struct ThreadBuffer
+{
+	std::mutex lock;
+	std::string name;
+	unsigned tid = 0;
+	std::vector<Event> events;
+	size_t next_event = 0;
+	bool wrapped = false;
+};
+
+struct Registry
+{
+	std::mutex lock;
+	std::vector<std::unique_ptr<ThreadBuffer>> threads;
+};
+
+// Never destroyed, threads may still record while the process exits.
+static Registry &get_registry()
+{
+	static Registry *registry = new Registry;
+	return *registry;
+}
+
+static thread_local ThreadBuffer *thread_buffer;
+
+static ThreadBuffer &get_thread_buffer()
+{
+	if (!thread_buffer)
+	{
+		auto &registry = get_registry();
+		std::lock_guard<std::mutex> holder{registry.lock};
+		registry.threads.emplace_back(new ThreadBuffer);
+		thread_buffer = registry.threads.back().get();
+		thread_buffer->tid = unsigned(registry.threads.size());
+		thread_buffer->events.resize(EventsPerThread);
+	}
+	return *thread_buffer;
+}
+
+void set_thread_name(const char *name)
+{
+	auto &buffer = get_thread_buffer();
+	std::lock_guard<std::mutex> holder{buffer.lock};
+	buffer.name = name;
+}
+
+void record_zone(const char *name, uint64_t hash, int64_t start_ns, int64_t end_ns)
+{
+	auto &buffer = get_thread_buffer();
+	std::lock_guard<std::mutex> holder{buffer.lock};
+	buffer.events[buffer.next_event] = { name, hash, start_ns, end_ns - start_ns };
+	if (++buffer.next_event == buffer.events.size())
+	{
+		buffer.next_event = 0;
+		buffer.wrapped = true;
+	}
+}
+
+static unsigned get_process_id()
+{
+#ifdef _WIN32
+	return unsigned(GetCurrentProcessId());
+#else
+	return unsigned(getpid());
+#endif
+}
+
+static void write_json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fputc('\\', file);
+		if (uint8_t(*str) >= 0x20)
+			fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+bool write_trace(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+	{
+		LOGE("Failed to open profiling trace %s for writing.\n", path);
+		return false;
+	}
+
+	// Chrome trace uses microseconds.
+	unsigned pid = get_process_id();
+	fprintf(file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"fossilize\"}}", pid);
+
+	auto &registry = get_registry();
+	std::lock_guard<std::mutex> registry_holder{registry.lock};
+	for (auto &thread : registry.threads)
+	{
+		std::lock_guard<std::mutex> holder{thread->lock};
+
+		fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", pid, thread->tid);
+		if (thread->name.empty())
+			fprintf(file, "\"thread %u\"}}", thread->tid);
+		else
+		{
+			write_json_string(file, thread->name.c_str());
+			fprintf(file, "}}");
+		}
+
+		// Oldest first.
+		size_t count = thread->wrapped ? thread->events.size() : thread->next_event;
+		size_t first = thread->wrapped ? thread->next_event : 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			auto &event = thread->events[(first + i) % thread->events.size()];
+			fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"fossilize\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+			        event.name, pid, thread->tid, double(event.start_ns) * 1e-3, double(event.duration_ns) * 1e-3);
+			if (event.hash)
+				fprintf(file, ",\"args\":{\"hash\":\"%016" PRIx64 "\"}}", event.hash);
+			else
+				fprintf(file, "}");
+		}
+	}
+
+	fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	bool ret = ferror(file) == 0;
+	ret = fclose(file) == 0 && ret;
+	if (!ret)
+		LOGE("Failed to write profiling trace %s.\n", path);
+	return ret;
+}
+
+// Games rarely exit cleanly enough to call into us, so the trace is written from a static destructor.
+struct ExitTraceWriter
+{
+	~ExitTraceWriter()
+	{
+		const char *path = getenv("FOSSILIZE_PROFILING_PATH");
+		if (!path || *path == '\0')
+			return;
+
+		std::string trace_path = path;
+		trace_path += '.';
+		trace_path += std::to_string(get_process_id());
+		trace_path += ".json";
+		if (write_trace(trace_path.c_str()))
+			LOGI("Wrote profiling trace to %s.\n", trace_path.c_str());
+	}
+};
+static ExitTraceWriter exit_trace_writer;
+#else
+void set_thread_name(const char *)
+{
+}
+
+void record_zone(const char *, uint64_t, int64_t, int64_t)
+{
+}
+
+bool write_trace(const char *)
+{
+	LOGE("Fossilize was built without FOSSILIZE_PROFILING, no profiling trace to write.\n");
+	return false;
+}
+#endif
+}
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+namespace Fossilize
+{
+// Scoped zones, enabled by building with FOSSILIZE_PROFILING.
+// Every thread records its zones into its own ring buffer, so profiling a long session keeps only the most recent zones.
+// The buffers are written as a Chrome trace, open it in chrome://tracing or https://ui.perfetto.dev.
+// If FOSSILIZE_PROFILING_PATH is set, every process writes $FOSSILIZE_PROFILING_PATH.<pid>.json on exit.
+// Without FOSSILIZE_PROFILING, the macros compile to nothing.
+namespace Profiling
+{
+// Names show up in the trace instead of the thread index. name is copied.
+void set_thread_name(const char *name);
+
+// Monotonic clock, so traces written by several processes line up.
+int64_t now_ns();
+
+// name must be a string literal. A hash of 0 is not written out.
+void record_zone(const char *name, uint64_t hash, int64_t start_ns, int64_t end_ns);
+
+// Returns false if Fossilize is built without FOSSILIZE_PROFILING.
+bool write_trace(const char *path);
+
+class Zone
+{
+public:
+	explicit Zone(const char *name_, uint64_t hash_ = 0)
+		: name(name_), hash(hash_), start_ns(now_ns())
+	{
+	}
+
+	~Zone()
+	{
+		record_zone(name, hash, start_ns, now_ns());
+	}
+
+	Zone(const Zone &) = delete;
+	void operator=(const Zone &) = delete;
+
+private:
+	const char *name;
+	uint64_t hash;
+	int64_t start_ns;
+};
+}
+}
+
+#ifdef FOSSILIZE_PROFILING
+#define FOSSILIZE_PROFILE_CONCAT_INNER(a, b) a##b
+#define FOSSILIZE_PROFILE_CONCAT(a, b) FOSSILIZE_PROFILE_CONCAT_INNER(a, b)
+#define FOSSILIZE_PROFILE_ZONE(name) \
+	::Fossilize::Profiling::Zone FOSSILIZE_PROFILE_CONCAT(fossilize_profile_zone_, __LINE__)(name)
+#define FOSSILIZE_PROFILE_ZONE_HASH(name, hash) \
+	::Fossilize::Profiling::Zone FOSSILIZE_PROFILE_CONCAT(fossilize_profile_zone_, __LINE__)(name, hash)
+#define FOSSILIZE_PROFILE_THREAD_NAME(name) ::Fossilize::Profiling::set_thread_name(name)
+#else
+#define FOSSILIZE_PROFILE_ZONE(name) ((void)0)
+#define FOSSILIZE_PROFILE_ZONE_HASH(name, hash) ((void)0)
+#define FOSSILIZE_PROFILE_THREAD_NAME(name) ((void)0)
+#endif
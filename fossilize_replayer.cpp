@@ -0,0 +1,744 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "fossilize_replayer.hpp"
+#include "fossilize.hpp"
+#include "fossilize_db.hpp"
+#include "layer/utils.hpp"
+#include "util/entry_payload.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace Fossilize
+{
+template <typename T, typename U>
+static inline T api_object_cast(U obj)
+{
+	static_assert(sizeof(T) == sizeof(U), "Objects are not of same size.");
+	return (T)obj;
+}
+
+static void set_current_thread_background_priority()
+{
+#ifdef _WIN32
+	// Also lowers I/O and memory priority.
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+	// Only affects the calling thread. Threads the driver spawns from here inherit it.
+	sched_param param = {};
+	sched_setscheduler(0, SCHED_IDLE, &param);
+#endif
+}
+
+// Static objects are created on the replay thread as they are parsed, and live until the replay is done.
+// Pipelines are parsed a batch at a time, and the shader modules of a batch are created before it is handed to the workers.
+// The modules are destroyed once the batch is compiled, so only one batch worth of modules is alive at any time.
+struct Replayer::Impl : StateCreatorInterface
+{
+	struct Task
+	{
+		ResourceTag tag;
+		Hash hash;
+		const void *info;
+	};
+
+	enum { PIPELINES_PER_WORKER = 32, MAX_PIPELINES_PER_BATCH = 1024 };
+
+	~Impl() override;
+
+	bool start(const Options &options);
+	void pause(bool enable);
+	void set_thread_budget(unsigned count);
+	void cancel();
+	bool wait();
+	ExternalReplayer::PollResult poll_progress(ExternalReplayer::Progress &progress);
+
+	bool init_device_functions();
+	bool run();
+	void worker_loop(unsigned index);
+	void wait_while_paused();
+	bool replay_static_objects(ResourceTag tag);
+	bool replay_pipelines(ResourceTag tag);
+	bool resolve_shader_module(VkShaderModule &module);
+	bool resolve_task(const Task &task);
+	void compile(const Task &task);
+	void run_batch();
+	void destroy_objects();
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override;
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *create_info,
+	                                          VkDescriptorSetLayout *layout) override;
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *create_info,
+	                                    VkPipelineLayout *layout) override;
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override;
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override;
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override;
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override;
+
+	Options options = {};
+	std::unique_ptr<DatabaseInterface> owned_database;
+	DatabaseInterface *database = nullptr;
+
+	PFN_vkCreateSampler vkCreateSampler = nullptr;
+	PFN_vkDestroySampler vkDestroySampler = nullptr;
+	PFN_vkCreateDescriptorSetLayout vkCreateDescriptorSetLayout = nullptr;
+	PFN_vkDestroyDescriptorSetLayout vkDestroyDescriptorSetLayout = nullptr;
+	PFN_vkCreatePipelineLayout vkCreatePipelineLayout = nullptr;
+	PFN_vkDestroyPipelineLayout vkDestroyPipelineLayout = nullptr;
+	PFN_vkCreateShaderModule vkCreateShaderModule = nullptr;
+	PFN_vkDestroyShaderModule vkDestroyShaderModule = nullptr;
+	PFN_vkCreateRenderPass vkCreateRenderPass = nullptr;
+	PFN_vkDestroyRenderPass vkDestroyRenderPass = nullptr;
+	PFN_vkCreateGraphicsPipelines vkCreateGraphicsPipelines = nullptr;
+	PFN_vkCreateComputePipelines vkCreateComputePipelines = nullptr;
+	PFN_vkDestroyPipeline vkDestroyPipeline = nullptr;
+
+	bool started = false;
+	std::thread replay_thread;
+	std::vector<std::thread> worker_threads;
+
+	// Protects everything below, up to the atomics.
+	std::mutex lock;
+	std::condition_variable work_cond;
+	std::condition_variable done_cond;
+	std::vector<Task> tasks;
+	size_t next_task = 0;
+	size_t pending_tasks = 0;
+	unsigned thread_budget = 1;
+	bool paused = false;
+	bool shutting_down = false;
+
+	// Only written with the lock held, but the replay thread checks it without.
+	std::atomic<bool> cancelled{false};
+
+	std::atomic<bool> complete{false};
+	std::atomic<bool> failed{false};
+	std::atomic<uint32_t> parsed[2];
+	std::atomic<uint32_t> completed[2];
+	std::atomic<uint32_t> skipped[2];
+	std::atomic<uint32_t> total[2];
+	std::atomic<uint32_t> completed_modules{0};
+	std::atomic<uint32_t> total_modules{0};
+
+	// Only touched by the replay thread.
+	StateReplayer replayer;
+	StateReplayer module_replayer;
+	std::vector<Task> batch;
+	std::unordered_map<Hash, VkShaderModule> batch_modules;
+	std::unordered_set<Hash> created_modules;
+	std::vector<VkSampler> samplers;
+	std::vector<VkDescriptorSetLayout> set_layouts;
+	std::vector<VkPipelineLayout> pipeline_layouts;
+	std::vector<VkRenderPass> render_passes;
+};
+
+static unsigned get_type_index(ResourceTag tag)
+{
+	return tag == RESOURCE_COMPUTE_PIPELINE ? 1 : 0;
+}
+
+Replayer::Impl::~Impl()
+{
+	cancel();
+}
+
+bool Replayer::Impl::init_device_functions()
+{
+#define FOSSILIZE_GET_DEVICE_PROC(name) \
+	name = reinterpret_cast<PFN_##name>(options.get_device_proc_addr(options.device, #name)); \
+	if (!name) \
+	{ \
+		LOGE("Device does not provide %s.\n", #name); \
+		return false; \
+	}
+
+	FOSSILIZE_GET_DEVICE_PROC(vkCreateSampler)
+	FOSSILIZE_GET_DEVICE_PROC(vkDestroySampler)
+	FOSSILIZE_GET_DEVICE_PROC(vkCreateDescriptorSetLayout)
+	FOSSILIZE_GET_DEVICE_PROC(vkDestroyDescriptorSetLayout)
+	FOSSILIZE_GET_DEVICE_PROC(vkCreatePipelineLayout)
+	FOSSILIZE_GET_DEVICE_PROC(vkDestroyPipelineLayout)
+	FOSSILIZE_GET_DEVICE_PROC(vkCreateShaderModule)
+	FOSSILIZE_GET_DEVICE_PROC(vkDestroyShaderModule)
+	FOSSILIZE_GET_DEVICE_PROC(vkCreateRenderPass)
+	FOSSILIZE_GET_DEVICE_PROC(vkDestroyRenderPass)
+	FOSSILIZE_GET_DEVICE_PROC(vkCreateGraphicsPipelines)
+	FOSSILIZE_GET_DEVICE_PROC(vkCreateComputePipelines)
+	FOSSILIZE_GET_DEVICE_PROC(vkDestroyPipeline)
+#undef FOSSILIZE_GET_DEVICE_PROC
+	return true;
+}
+
+bool Replayer::Impl::start(const Options &options_)
+{
+	if (started)
+	{
+		LOGE("Replayer was already started.\n");
+		return false;
+	}
+
+	options = options_;
+	if (options.device == VK_NULL_HANDLE || !options.get_device_proc_addr)
+	{
+		LOGE("Replayer needs a device and vkGetDeviceProcAddr.\n");
+		return false;
+	}
+
+	if (!init_device_functions())
+		return false;
+
+	database = options.database;
+	if (!database)
+	{
+		if (options.num_databases == 1)
+			owned_database.reset(create_database(options.databases[0], DatabaseMode::ReadOnlyMemoryMap));
+		else if (options.num_databases > 1)
+		{
+			owned_database.reset(create_concurrent_database(nullptr, DatabaseMode::ReadOnlyMemoryMap,
+			                                                options.databases, options.num_databases));
+		}
+
+		if (!owned_database || !owned_database->prepare())
+		{
+			LOGE("Failed to open databases for replay.\n");
+			return false;
+		}
+		database = owned_database.get();
+	}
+
+	static const ResourceTag pipeline_tags[2] = { RESOURCE_GRAPHICS_PIPELINE, RESOURCE_COMPUTE_PIPELINE };
+	for (unsigned i = 0; i < 2; i++)
+	{
+		size_t count = 0;
+		if (!database->get_hash_list_for_resource_tag(pipeline_tags[i], &count, nullptr))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return false;
+		}
+		parsed[i].store(0);
+		completed[i].store(0);
+		skipped[i].store(0);
+		total[i].store(uint32_t(count));
+	}
+
+	size_t module_count = 0;
+	if (!database->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &module_count, nullptr))
+	{
+		LOGE("Failed to get list of resource hashes.\n");
+		return false;
+	}
+	total_modules.store(uint32_t(module_count));
+	completed_modules.store(0);
+	complete.store(false);
+	failed.store(false);
+
+	// Workers resolve nothing themselves, shader modules are created before a batch is handed out.
+	replayer.set_resolve_shader_module_handles(false);
+	replayer.set_resolve_derivative_pipeline_handles(false);
+
+	unsigned num_threads = options.num_threads ? options.num_threads : 1;
+	options.num_threads = num_threads;
+	thread_budget = num_threads;
+	for (unsigned i = 0; i < num_threads; i++)
+		worker_threads.emplace_back(&Impl::worker_loop, this, i);
+
+	replay_thread = std::thread([this]() {
+		if (!run())
+			failed.store(true, std::memory_order_relaxed);
+
+		{
+			std::lock_guard<std::mutex> holder(lock);
+			shutting_down = true;
+			work_cond.notify_all();
+		}
+		for (auto &thread : worker_threads)
+			thread.join();
+		worker_threads.clear();
+
+		destroy_objects();
+		complete.store(true, std::memory_order_release);
+	});
+
+	started = true;
+	return true;
+}
+
+void Replayer::Impl::pause(bool enable)
+{
+	std::lock_guard<std::mutex> holder(lock);
+	paused = enable;
+	work_cond.notify_all();
+}
+
+void Replayer::Impl::set_thread_budget(unsigned count)
+{
+	std::lock_guard<std::mutex> holder(lock);
+	if (count < 1)
+		count = 1;
+	thread_budget = count;
+	work_cond.notify_all();
+}
+
+void Replayer::Impl::cancel()
+{
+	{
+		std::lock_guard<std::mutex> holder(lock);
+		cancelled.store(true, std::memory_order_relaxed);
+		paused = false;
+
+		// Pipelines which no worker has picked up yet are dropped.
+		pending_tasks -= tasks.size() - next_task;
+		next_task = tasks.size();
+		work_cond.notify_all();
+		done_cond.notify_all();
+	}
+
+	if (replay_thread.joinable())
+		replay_thread.join();
+}
+
+bool Replayer::Impl::wait()
+{
+	if (replay_thread.joinable())
+		replay_thread.join();
+	return !failed.load(std::memory_order_relaxed);
+}
+
+ExternalReplayer::PollResult Replayer::Impl::poll_progress(ExternalReplayer::Progress &progress)
+{
+	progress = {};
+	if (!started)
+		return ExternalReplayer::PollResult::Error;
+
+	ExternalReplayer::TypeProgress *types[2] = { &progress.graphics, &progress.compute };
+	for (unsigned i = 0; i < 2; i++)
+	{
+		types[i]->parsed = parsed[i].load(std::memory_order_relaxed);
+		types[i]->completed = completed[i].load(std::memory_order_relaxed);
+		types[i]->skipped = skipped[i].load(std::memory_order_relaxed);
+		types[i]->total = total[i].load(std::memory_order_relaxed);
+	}
+	progress.completed_modules = completed_modules.load(std::memory_order_relaxed);
+	progress.total_modules = total_modules.load(std::memory_order_relaxed);
+
+	bool is_complete = complete.load(std::memory_order_acquire);
+	{
+		std::lock_guard<std::mutex> holder(lock);
+		if (!paused && !is_complete)
+			progress.active_workers = thread_budget < options.num_threads ? thread_budget : options.num_threads;
+	}
+
+	if (!is_complete)
+		return ExternalReplayer::PollResult::Running;
+	return failed.load(std::memory_order_relaxed) ? ExternalReplayer::PollResult::Error : ExternalReplayer::PollResult::Complete;
+}
+
+void Replayer::Impl::wait_while_paused()
+{
+	std::unique_lock<std::mutex> holder(lock);
+	work_cond.wait(holder, [this]() { return !paused || cancelled; });
+}
+
+bool Replayer::Impl::replay_static_objects(ResourceTag tag)
+{
+	size_t count = 0;
+	if (!database->get_hash_list_for_resource_tag(tag, &count, nullptr))
+		return false;
+	std::vector<Hash> hashes(count);
+	if (!database->get_hash_list_for_resource_tag(tag, &count, hashes.data()))
+		return false;
+
+	EntryPayload blob;
+	for (auto hash : hashes)
+	{
+		wait_while_paused();
+		if (cancelled)
+			return true;
+
+		if (!blob.read(*database, tag, hash, PAYLOAD_READ_NO_FLAGS))
+		{
+			LOGE("Failed to load blob from cache.\n");
+			return false;
+		}
+
+		// Pipelines which refer to an object which failed to parse are skipped later.
+		if (!replayer.parse(*this, database, blob.data(), blob.size()))
+			LOGE("Failed to parse blob (tag: %d, hash: %016" PRIx64 ").\n", tag, hash);
+	}
+
+	replayer.get_allocator().reset();
+	return true;
+}
+
+bool Replayer::Impl::resolve_shader_module(VkShaderModule &module)
+{
+	Hash hash = api_object_cast<Hash>(module);
+	auto itr = batch_modules.find(hash);
+	if (itr == batch_modules.end())
+	{
+		EntryPayload blob;
+		if (!blob.read(*database, RESOURCE_SHADER_MODULE, hash, PAYLOAD_READ_NO_FLAGS) ||
+		    !module_replayer.parse(*this, database, blob.data(), blob.size()))
+		{
+			batch_modules[hash] = VK_NULL_HANDLE;
+			return false;
+		}
+
+		itr = batch_modules.find(hash);
+		if (itr == batch_modules.end())
+			return false;
+	}
+
+	module = itr->second;
+	return module != VK_NULL_HANDLE;
+}
+
+bool Replayer::Impl::resolve_task(const Task &task)
+{
+	// The replayer does not keep pipelines around, so derived pipelines are created as plain ones.
+	if (task.tag == RESOURCE_GRAPHICS_PIPELINE)
+	{
+		auto *info = const_cast<VkGraphicsPipelineCreateInfo *>(static_cast<const VkGraphicsPipelineCreateInfo *>(task.info));
+		info->flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+		info->basePipelineHandle = VK_NULL_HANDLE;
+		info->basePipelineIndex = -1;
+		for (uint32_t i = 0; i < info->stageCount; i++)
+			if (!resolve_shader_module(const_cast<VkPipelineShaderStageCreateInfo *>(info->pStages)[i].module))
+				return false;
+	}
+	else
+	{
+		auto *info = const_cast<VkComputePipelineCreateInfo *>(static_cast<const VkComputePipelineCreateInfo *>(task.info));
+		info->flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+		info->basePipelineHandle = VK_NULL_HANDLE;
+		info->basePipelineIndex = -1;
+		if (!resolve_shader_module(info->stage.module))
+			return false;
+	}
+
+	return true;
+}
+
+void Replayer::Impl::run_batch()
+{
+	std::vector<Task> resolved;
+	resolved.reserve(batch.size());
+	for (auto &task : batch)
+	{
+		if (resolve_task(task))
+			resolved.push_back(task);
+		else
+			skipped[get_type_index(task.tag)].fetch_add(1, std::memory_order_relaxed);
+	}
+	batch.clear();
+
+	{
+		std::unique_lock<std::mutex> holder(lock);
+		if (!cancelled)
+		{
+			tasks = std::move(resolved);
+			next_task = 0;
+			pending_tasks = tasks.size();
+			work_cond.notify_all();
+			done_cond.wait(holder, [this]() { return pending_tasks == 0; });
+		}
+		tasks.clear();
+		next_task = 0;
+	}
+
+	for (auto &module : batch_modules)
+		if (module.second != VK_NULL_HANDLE)
+			vkDestroyShaderModule(options.device, module.second, nullptr);
+	batch_modules.clear();
+	module_replayer.forget_handle_references();
+	module_replayer.get_allocator().reset();
+	replayer.get_allocator().reset();
+}
+
+bool Replayer::Impl::replay_pipelines(ResourceTag tag)
+{
+	size_t count = 0;
+	if (!database->get_hash_list_for_resource_tag(tag, &count, nullptr))
+		return false;
+	std::vector<Hash> hashes(count);
+	if (!database->get_hash_list_for_resource_tag(tag, &count, hashes.data()))
+		return false;
+
+	size_t batch_size = size_t(options.num_threads) * PIPELINES_PER_WORKER;
+	if (batch_size > MAX_PIPELINES_PER_BATCH)
+		batch_size = MAX_PIPELINES_PER_BATCH;
+
+	unsigned type_index = get_type_index(tag);
+	EntryPayload blob;
+	for (size_t offset = 0; offset < hashes.size() && !cancelled; offset += batch_size)
+	{
+		size_t end = offset + batch_size < hashes.size() ? offset + batch_size : hashes.size();
+		for (size_t i = offset; i < end; i++)
+		{
+			wait_while_paused();
+			if (cancelled)
+				break;
+
+			if (!blob.read(*database, tag, hashes[i], PAYLOAD_READ_NO_FLAGS))
+			{
+				LOGE("Failed to load blob from cache.\n");
+				run_batch();
+				return false;
+			}
+
+			if (replayer.parse(*this, database, blob.data(), blob.size()))
+				parsed[type_index].fetch_add(1, std::memory_order_relaxed);
+			else
+			{
+				LOGE("Failed to parse blob (tag: %d, hash: %016" PRIx64 ").\n", tag, hashes[i]);
+				skipped[type_index].fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		run_batch();
+	}
+
+	return true;
+}
+
+bool Replayer::Impl::run()
+{
+	static const ResourceTag static_order[] = {
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+	};
+
+	if (options.background_priority)
+		set_current_thread_background_priority();
+
+	for (auto tag : static_order)
+		if (!replay_static_objects(tag))
+			return false;
+
+	return replay_pipelines(RESOURCE_GRAPHICS_PIPELINE) && replay_pipelines(RESOURCE_COMPUTE_PIPELINE);
+}
+
+void Replayer::Impl::worker_loop(unsigned index)
+{
+	if (options.background_priority)
+		set_current_thread_background_priority();
+
+	for (;;)
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> holder(lock);
+			work_cond.wait(holder, [&]() -> bool {
+				return shutting_down || (!paused && index < thread_budget && next_task < tasks.size());
+			});
+			if (shutting_down)
+				return;
+			task = tasks[next_task++];
+		}
+
+		compile(task);
+
+		std::lock_guard<std::mutex> holder(lock);
+		if (--pending_tasks == 0)
+			done_cond.notify_all();
+	}
+}
+
+void Replayer::Impl::compile(const Task &task)
+{
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkResult result;
+	if (task.tag == RESOURCE_GRAPHICS_PIPELINE)
+	{
+		result = vkCreateGraphicsPipelines(options.device, options.pipeline_cache, 1,
+		                                   static_cast<const VkGraphicsPipelineCreateInfo *>(task.info), nullptr, &pipeline);
+	}
+	else
+	{
+		result = vkCreateComputePipelines(options.device, options.pipeline_cache, 1,
+		                                  static_cast<const VkComputePipelineCreateInfo *>(task.info), nullptr, &pipeline);
+	}
+
+	if (result != VK_SUCCESS)
+		LOGE("Failed to create pipeline for hash 0x%016" PRIx64 ".\n", task.hash);
+
+	// Only the driver cache is warmed, the pipeline itself is not needed.
+	if (pipeline != VK_NULL_HANDLE)
+		vkDestroyPipeline(options.device, pipeline, nullptr);
+	completed[get_type_index(task.tag)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Replayer::Impl::destroy_objects()
+{
+	for (auto render_pass : render_passes)
+		vkDestroyRenderPass(options.device, render_pass, nullptr);
+	for (auto layout : pipeline_layouts)
+		vkDestroyPipelineLayout(options.device, layout, nullptr);
+	for (auto layout : set_layouts)
+		vkDestroyDescriptorSetLayout(options.device, layout, nullptr);
+	for (auto sampler : samplers)
+		vkDestroySampler(options.device, sampler, nullptr);
+	render_passes.clear();
+	pipeline_layouts.clear();
+	set_layouts.clear();
+	samplers.clear();
+}
+
+bool Replayer::Impl::enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler)
+{
+	if (vkCreateSampler(options.device, create_info, nullptr, sampler) != VK_SUCCESS)
+	{
+		LOGE("Failed to create sampler %016" PRIx64 ".\n", hash);
+		return false;
+	}
+	samplers.push_back(*sampler);
+	return true;
+}
+
+bool Replayer::Impl::enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *create_info,
+                                                          VkDescriptorSetLayout *layout)
+{
+	if (vkCreateDescriptorSetLayout(options.device, create_info, nullptr, layout) != VK_SUCCESS)
+	{
+		LOGE("Failed to create descriptor set layout %016" PRIx64 ".\n", hash);
+		return false;
+	}
+	set_layouts.push_back(*layout);
+	return true;
+}
+
+bool Replayer::Impl::enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *create_info,
+                                                    VkPipelineLayout *layout)
+{
+	if (vkCreatePipelineLayout(options.device, create_info, nullptr, layout) != VK_SUCCESS)
+	{
+		LOGE("Failed to create pipeline layout %016" PRIx64 ".\n", hash);
+		return false;
+	}
+	pipeline_layouts.push_back(*layout);
+	return true;
+}
+
+bool Replayer::Impl::enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info,
+                                                  VkShaderModule *module)
+{
+	if (vkCreateShaderModule(options.device, create_info, nullptr, module) != VK_SUCCESS)
+	{
+		LOGE("Failed to create shader module %016" PRIx64 ".\n", hash);
+		*module = VK_NULL_HANDLE;
+	}
+
+	batch_modules[hash] = *module;
+	if (*module != VK_NULL_HANDLE && created_modules.insert(hash).second)
+		completed_modules.fetch_add(1, std::memory_order_relaxed);
+	return *module != VK_NULL_HANDLE;
+}
+
+bool Replayer::Impl::enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass)
+{
+	if (vkCreateRenderPass(options.device, create_info, nullptr, render_pass) != VK_SUCCESS)
+	{
+		LOGE("Failed to create render pass %016" PRIx64 ".\n", hash);
+		return false;
+	}
+	render_passes.push_back(*render_pass);
+	return true;
+}
+
+bool Replayer::Impl::enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info,
+                                                     VkPipeline *pipeline)
+{
+	batch.push_back({ RESOURCE_COMPUTE_PIPELINE, hash, create_info });
+	*pipeline = api_object_cast<VkPipeline>(uint64_t(hash));
+	return true;
+}
+
+bool Replayer::Impl::enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info,
+                                                      VkPipeline *pipeline)
+{
+	batch.push_back({ RESOURCE_GRAPHICS_PIPELINE, hash, create_info });
+	*pipeline = api_object_cast<VkPipeline>(uint64_t(hash));
+	return true;
+}
+
+Replayer::Replayer()
+{
+	impl = new Impl;
+}
+
+Replayer::~Replayer()
+{
+	delete impl;
+}
+
+bool Replayer::start(const Options &options)
+{
+	return impl->start(options);
+}
+
+void Replayer::pause()
+{
+	impl->pause(true);
+}
+
+void Replayer::resume()
+{
+	impl->pause(false);
+}
+
+void Replayer::set_thread_budget(unsigned count)
+{
+	impl->set_thread_budget(count);
+}
+
+void Replayer::cancel()
+{
+	impl->cancel();
+}
+
+bool Replayer::wait()
+{
+	return impl->wait();
+}
+
+ExternalReplayer::PollResult Replayer::poll_progress(ExternalReplayer::Progress &progress)
+{
+	return impl->poll_progress(progress);
+}
+}
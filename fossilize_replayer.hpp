@@ -0,0 +1,101 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "vulkan.h"
+#include "fossilize_types.hpp"
+#include "fossilize_external_replayer.hpp"
+#include <stddef.h>
+
+namespace Fossilize
+{
+class DatabaseInterface;
+
+// Replays the pipelines of a database in the calling process, on a device the caller provides,
+// so the driver cache can be warmed in the background where ExternalReplayer cannot fork a replayer process,
+// e.g. on Android or consoles.
+// Unlike fossilize-replay, there is no crash isolation. Only use this for databases captured on the same device.
+class Replayer
+{
+public:
+	struct Options
+	{
+		// Usually the application's own device, so the pipelines end up in its driver cache.
+		// The replayer only creates and destroys objects, it never submits any work.
+		VkDevice device;
+
+		// Every entry point is looked up through this, so the replayer does not need a Vulkan loader.
+		PFN_vkGetDeviceProcAddr get_device_proc_addr;
+
+		// If not VK_NULL_HANDLE, pipelines are created with this pipeline cache.
+		// It must not have been created with VK_PIPELINE_CACHE_CREATE_EXTERNALLY_SYNCHRONIZED_BIT.
+		VkPipelineCache pipeline_cache;
+
+		// A prepared database to replay from. It is not owned, and must outlive the replayer.
+		// If null, databases are opened like ExternalReplayer::Options::databases.
+		DatabaseInterface *database;
+		const char * const *databases;
+		unsigned num_databases;
+
+		// How many worker threads compile pipelines at most. If 0, one worker thread is used.
+		// set_thread_budget() can lower how many of them are active later on.
+		unsigned num_threads;
+
+		// Runs the worker threads with the lowest scheduling priority, so they only get the CPU time
+		// the application leaves over. Threads the driver spawns from them usually inherit it.
+		bool background_priority;
+	};
+
+	Replayer();
+	~Replayer();
+	void operator=(const Replayer &) = delete;
+	Replayer(const Replayer &) = delete;
+
+	// Returns immediately, the replay runs on threads owned by the replayer. This may only be called once.
+	bool start(const Options &options);
+
+	// Workers finish the pipeline they are compiling, then wait for resume().
+	void pause();
+	void resume();
+
+	// Between 1 and num_threads worker threads compile pipelines, the rest wait. E.g. lower it while a level is running.
+	void set_thread_budget(unsigned count);
+
+	// Stops the replay after the pipelines which are being compiled, and waits for the threads to exit.
+	// Also done by the destructor.
+	void cancel();
+
+	// Blocks until every pipeline has been replayed, or the replay was cancelled.
+	// Returns false if the replay could not read the database.
+	bool wait();
+
+	// Works like ExternalReplayer::poll_progress(). Crashes are never reported,
+	// and active_workers is the number of worker threads which are allowed to compile right now.
+	ExternalReplayer::PollResult poll_progress(ExternalReplayer::Progress &progress);
+
+private:
+	struct Impl;
+	Impl *impl;
+};
+}
@@ -37,12 +37,19 @@ enum ResourceTag
 	RESOURCE_GRAPHICS_PIPELINE = 6,
 	RESOURCE_COMPUTE_PIPELINE = 7,
 	RESOURCE_APPLICATION_BLOB_LINK = 8,
-	RESOURCE_COUNT = 9
+	// Fixed function state shared between graphics pipelines. Only written in the binary format.
+	RESOURCE_GRAPHICS_PIPELINE_STATE = 9,
+	// When and how often objects were used, see StateRecorder::set_enable_usage_metadata().
+	// Not Vulkan state, so StateReplayer does not parse these. Use parse_usage_metadata() instead.
+	RESOURCE_USAGE_METADATA = 10,
+	RESOURCE_COUNT = 11
 };
 
+// Version 7 changed how bulk data such as shader modules is hashed.
+// Version 8 packs SPIR-V with Stream VByte instead of varint.
 enum
 {
-	FOSSILIZE_FORMAT_VERSION = 6,
+	FOSSILIZE_FORMAT_VERSION = 8,
 	FOSSILIZE_FORMAT_MIN_COMPAT_VERSION = 5
 };
 
@@ -24,6 +24,8 @@
 #include "utils.hpp"
 #include "device.hpp"
 #include "instance.hpp"
+#include "statistics.hpp"
+#include "fossilize_profiling.hpp"
 #include <mutex>
 
 // VALVE: do exports without .def file, see vk_layer.h for definition on non-Windows platforms
@@ -44,25 +46,20 @@ namespace Fossilize
 {
 
 // Global data structures to remap VkInstance and VkDevice to internal data structures.
+// globalLock serializes creation and destruction only, lookups into instanceData and deviceData are lock-free.
 static mutex globalLock;
 static InstanceTable instanceDispatch;
 static DeviceTable deviceDispatch;
-static unordered_map<void *, unique_ptr<Instance>> instanceData;
-static unordered_map<void *, unique_ptr<Device>> deviceData;
+static LayerDataMap<Instance> instanceData;
+static LayerDataMap<Device> deviceData;
 
 static Device *get_device_layer(VkDevice device)
 {
-	// Need to hold a lock while querying the global hashmap, but not after it.
-	Device *layer = nullptr;
-	void *key = getDispatchKey(device);
-	lock_guard<mutex> holder{ globalLock };
-	layer = getLayerData(key, deviceData);
-	return layer;
+	return getLayerData(getDispatchKey(device), deviceData);
 }
 
 static Instance *get_instance_layer(VkPhysicalDevice gpu)
 {
-	lock_guard<mutex> holder{ globalLock };
 	return getLayerData(getDispatchKey(gpu), instanceData);
 }
 
@@ -140,7 +137,7 @@ static VKAPI_ATTR void VKAPI_CALL DestroyInstance(VkInstance instance, const VkA
 	destroyLayerData(key, instanceData);
 }
 
-static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesNormal(Device *layer,
+static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesNormal(Device *layer, LayerCallTimer &timer,
                                                                     VkDevice device, VkPipelineCache pipelineCache,
                                                                     uint32_t createInfoCount,
                                                                     const VkGraphicsPipelineCreateInfo *pCreateInfos,
@@ -148,7 +145,9 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesNormal(Device *laye
                                                                     VkPipeline *pPipelines)
 {
 	// Have to create all pipelines here, in case the application makes use of basePipelineIndex.
+	timer.beginDownstreamCall();
 	auto res = layer->getTable()->CreateGraphicsPipelines(device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+	timer.endDownstreamCall();
 	if (res != VK_SUCCESS)
 		return res;
 
@@ -162,7 +161,7 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesNormal(Device *laye
 }
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
-static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesParanoid(Device *layer,
+static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesParanoid(Device *layer, LayerCallTimer &timer,
                                                                       VkDevice device, VkPipelineCache pipelineCache,
                                                                       uint32_t createInfoCount,
                                                                       const VkGraphicsPipelineCreateInfo *pCreateInfos,
@@ -184,8 +183,10 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesParanoid(Device *la
 		// Have to create all pipelines here, in case the application makes use of basePipelineIndex.
 		// Write arguments in TLS in-case we crash here.
 		Instance::braceForGraphicsPipelineCrash(&layer->getRecorder(), &info);
+		timer.beginDownstreamCall();
 		auto res = layer->getTable()->CreateGraphicsPipelines(device, pipelineCache, 1, &info,
 		                                                      pAllocator, &pPipelines[i]);
+		timer.endDownstreamCall();
 		Instance::completedPipelineCompilation();
 
 		// Record failing pipelines for repro.
@@ -210,21 +211,23 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelines(VkDevice device, V
                                                               const VkAllocationCallbacks *pAllocator,
                                                               VkPipeline *pPipelines)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_GRAPHICS_PIPELINES);
+	FOSSILIZE_PROFILE_ZONE("vkCreateGraphicsPipelines");
 	auto *layer = get_device_layer(device);
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 	if (layer->getInstance()->capturesCrashes())
-		CreateGraphicsPipelinesParanoid(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+		CreateGraphicsPipelinesParanoid(layer, timer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 	else
-		CreateGraphicsPipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+		CreateGraphicsPipelinesNormal(layer, timer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 #else
-	CreateGraphicsPipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+	CreateGraphicsPipelinesNormal(layer, timer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 #endif
 
 	return VK_SUCCESS;
 }
 
-static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesNormal(Device *layer,
+static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesNormal(Device *layer, LayerCallTimer &timer,
                                                                    VkDevice device, VkPipelineCache pipelineCache,
                                                                    uint32_t createInfoCount,
                                                                    const VkComputePipelineCreateInfo *pCreateInfos,
@@ -232,7 +235,9 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesNormal(Device *layer
                                                                    VkPipeline *pPipelines)
 {
 	// Have to create all pipelines here, in case the application makes use of basePipelineIndex.
+	timer.beginDownstreamCall();
 	auto res = layer->getTable()->CreateComputePipelines(device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+	timer.endDownstreamCall();
 	if (res != VK_SUCCESS)
 		return res;
 
@@ -246,7 +251,7 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesNormal(Device *layer
 }
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
-static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesParanoid(Device *layer,
+static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesParanoid(Device *layer, LayerCallTimer &timer,
                                                                      VkDevice device, VkPipelineCache pipelineCache,
                                                                      uint32_t createInfoCount,
                                                                      const VkComputePipelineCreateInfo *pCreateInfos,
@@ -268,8 +273,10 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesParanoid(Device *lay
 		// Have to create all pipelines here, in case the application makes use of basePipelineIndex.
 		// Write arguments in TLS in-case we crash here.
 		Instance::braceForComputePipelineCrash(&layer->getRecorder(), &info);
+		timer.beginDownstreamCall();
 		auto res = layer->getTable()->CreateComputePipelines(device, pipelineCache, 1, &info,
 		                                                     pAllocator, &pPipelines[i]);
+		timer.endDownstreamCall();
 		Instance::completedPipelineCompilation();
 
 		// Record failing pipelines for repro.
@@ -294,15 +301,17 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelines(VkDevice device, Vk
                                                              const VkAllocationCallbacks *pAllocator,
                                                              VkPipeline *pPipelines)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_COMPUTE_PIPELINES);
+	FOSSILIZE_PROFILE_ZONE("vkCreateComputePipelines");
 	auto *layer = get_device_layer(device);
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 	if (layer->getInstance()->capturesCrashes())
-		CreateComputePipelinesParanoid(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+		CreateComputePipelinesParanoid(layer, timer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 	else
-		CreateComputePipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+		CreateComputePipelinesNormal(layer, timer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 #else
-	CreateComputePipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+	CreateComputePipelinesNormal(layer, timer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 #endif
 
 	return VK_SUCCESS;
@@ -313,9 +322,13 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreatePipelineLayout(VkDevice device,
                                                            const VkAllocationCallbacks *pAllocator,
                                                            VkPipelineLayout *pLayout)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_PIPELINE_LAYOUT);
+	FOSSILIZE_PROFILE_ZONE("vkCreatePipelineLayout");
 	auto *layer = get_device_layer(device);
 
+	timer.beginDownstreamCall();
 	VkResult result = layer->getTable()->CreatePipelineLayout(device, pCreateInfo, pAllocator, pLayout);
+	timer.endDownstreamCall();
 
 	if (result == VK_SUCCESS)
 	{
@@ -330,9 +343,13 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateDescriptorSetLayout(VkDevice device,
                                                                 const VkAllocationCallbacks *pAllocator,
                                                                 VkDescriptorSetLayout *pSetLayout)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_DESCRIPTOR_SET_LAYOUT);
+	FOSSILIZE_PROFILE_ZONE("vkCreateDescriptorSetLayout");
 	auto *layer = get_device_layer(device);
 
+	timer.beginDownstreamCall();
 	VkResult result = layer->getTable()->CreateDescriptorSetLayout(device, pCreateInfo, pAllocator, pSetLayout);
+	timer.endDownstreamCall();
 
 	if (result == VK_SUCCESS)
 	{
@@ -375,8 +392,13 @@ static VKAPI_ATTR void VKAPI_CALL DestroyDevice(VkDevice device, const VkAllocat
 static VKAPI_ATTR VkResult VKAPI_CALL CreateSampler(VkDevice device, const VkSamplerCreateInfo *pCreateInfo,
                                                     const VkAllocationCallbacks *pCallbacks, VkSampler *pSampler)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_SAMPLER);
+	FOSSILIZE_PROFILE_ZONE("vkCreateSampler");
 	auto *layer = get_device_layer(device);
+
+	timer.beginDownstreamCall();
 	auto res = layer->getTable()->CreateSampler(device, pCreateInfo, pCallbacks, pSampler);
+	timer.endDownstreamCall();
 
 	if (res == VK_SUCCESS)
 	{
@@ -391,11 +413,15 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateShaderModule(VkDevice device, const
                                                          const VkAllocationCallbacks *pCallbacks,
                                                          VkShaderModule *pShaderModule)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_SHADER_MODULE);
+	FOSSILIZE_PROFILE_ZONE("vkCreateShaderModule");
 	auto *layer = get_device_layer(device);
 
 	*pShaderModule = VK_NULL_HANDLE;
 
+	timer.beginDownstreamCall();
 	auto res = layer->getTable()->CreateShaderModule(device, pCreateInfo, pCallbacks, pShaderModule);
+	timer.endDownstreamCall();
 
 	if (res == VK_SUCCESS)
 	{
@@ -409,9 +435,13 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateShaderModule(VkDevice device, const
 static VKAPI_ATTR VkResult VKAPI_CALL CreateRenderPass(VkDevice device, const VkRenderPassCreateInfo *pCreateInfo,
                                                        const VkAllocationCallbacks *pCallbacks, VkRenderPass *pRenderPass)
 {
+	LayerCallTimer timer(LAYER_ENTRY_POINT_CREATE_RENDER_PASS);
+	FOSSILIZE_PROFILE_ZONE("vkCreateRenderPass");
 	auto *layer = get_device_layer(device);
 
+	timer.beginDownstreamCall();
 	auto res = layer->getTable()->CreateRenderPass(device, pCreateInfo, pCallbacks, pRenderPass);
+	timer.endDownstreamCall();
 
 	if (res == VK_SUCCESS)
 	{
@@ -421,6 +451,74 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateRenderPass(VkDevice device, const Vk
 	return res;
 }
 
+static VKAPI_ATTR void VKAPI_CALL DestroyShaderModule(VkDevice device, VkShaderModule shaderModule, const VkAllocationCallbacks *pAllocator)
+{
+	auto *layer = get_device_layer(device);
+
+	// Forget the handle before the driver can hand it out again.
+	if (shaderModule != VK_NULL_HANDLE)
+		layer->getRecorder().forget_shader_module(shaderModule);
+	layer->getTable()->DestroyShaderModule(device, shaderModule, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyPipeline(VkDevice device, VkPipeline pipeline, const VkAllocationCallbacks *pAllocator)
+{
+	auto *layer = get_device_layer(device);
+
+	// Forget the handle before the driver can hand it out again.
+	if (pipeline != VK_NULL_HANDLE)
+		layer->getRecorder().forget_pipeline(pipeline);
+	layer->getTable()->DestroyPipeline(device, pipeline, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroySampler(VkDevice device, VkSampler sampler, const VkAllocationCallbacks *pAllocator)
+{
+	auto *layer = get_device_layer(device);
+
+	// Forget the handle before the driver can hand it out again.
+	if (sampler != VK_NULL_HANDLE)
+		layer->getRecorder().forget_sampler(sampler);
+	layer->getTable()->DestroySampler(device, sampler, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyRenderPass(VkDevice device, VkRenderPass renderPass, const VkAllocationCallbacks *pAllocator)
+{
+	auto *layer = get_device_layer(device);
+
+	// Forget the handle before the driver can hand it out again.
+	if (renderPass != VK_NULL_HANDLE)
+		layer->getRecorder().forget_render_pass(renderPass);
+	layer->getTable()->DestroyRenderPass(device, renderPass, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyPipelineLayout(VkDevice device, VkPipelineLayout pipelineLayout, const VkAllocationCallbacks *pAllocator)
+{
+	auto *layer = get_device_layer(device);
+
+	// Forget the handle before the driver can hand it out again.
+	if (pipelineLayout != VK_NULL_HANDLE)
+		layer->getRecorder().forget_pipeline_layout(pipelineLayout);
+	layer->getTable()->DestroyPipelineLayout(device, pipelineLayout, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyDescriptorSetLayout(VkDevice device, VkDescriptorSetLayout descriptorSetLayout, const VkAllocationCallbacks *pAllocator)
+{
+	auto *layer = get_device_layer(device);
+
+	// Forget the handle before the driver can hand it out again.
+	if (descriptorSetLayout != VK_NULL_HANDLE)
+		layer->getRecorder().forget_descriptor_set_layout(descriptorSetLayout);
+	layer->getTable()->DestroyDescriptorSetLayout(device, descriptorSetLayout, pAllocator);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+{
+	// Queues share the dispatch key of their device.
+	auto *layer = getLayerData(getDispatchKey(queue), deviceData);
+	layer->getRecorder().notify_frame_presented();
+	return layer->getTable()->QueuePresentKHR(queue, pPresentInfo);
+}
+
 static PFN_vkVoidFunction interceptCoreDeviceCommand(const char *pName)
 {
 	static const struct
@@ -438,6 +536,15 @@ static PFN_vkVoidFunction interceptCoreDeviceCommand(const char *pName)
 		{ "vkCreateSampler", reinterpret_cast<PFN_vkVoidFunction>(CreateSampler) },
 		{ "vkCreateShaderModule", reinterpret_cast<PFN_vkVoidFunction>(CreateShaderModule) },
 		{ "vkCreateRenderPass", reinterpret_cast<PFN_vkVoidFunction>(CreateRenderPass) },
+
+		{ "vkDestroyDescriptorSetLayout", reinterpret_cast<PFN_vkVoidFunction>(DestroyDescriptorSetLayout) },
+		{ "vkDestroyPipelineLayout", reinterpret_cast<PFN_vkVoidFunction>(DestroyPipelineLayout) },
+		{ "vkDestroyPipeline", reinterpret_cast<PFN_vkVoidFunction>(DestroyPipeline) },
+		{ "vkDestroySampler", reinterpret_cast<PFN_vkVoidFunction>(DestroySampler) },
+		{ "vkDestroyShaderModule", reinterpret_cast<PFN_vkVoidFunction>(DestroyShaderModule) },
+		{ "vkDestroyRenderPass", reinterpret_cast<PFN_vkVoidFunction>(DestroyRenderPass) },
+
+		{ "vkQueuePresentKHR", reinterpret_cast<PFN_vkVoidFunction>(QueuePresentKHR) },
 	};
 
 	for (auto &cmd : coreDeviceCommands)
@@ -453,16 +560,16 @@ extern "C"
 {
 VK_LAYER_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL vkGetDeviceProcAddr(VkDevice device, const char *pName)
 {
+	Device *layer = getLayerData(getDispatchKey(device), deviceData);
+
+	// Without VK_KHR_swapchain, there is nothing to call down to.
+	if (strcmp(pName, "vkQueuePresentKHR") == 0 && !layer->getTable()->QueuePresentKHR)
+		return nullptr;
+
 	auto proc = interceptCoreDeviceCommand(pName);
 	if (proc)
 		return proc;
 
-	Device *layer = nullptr;
-	{
-		lock_guard<mutex> holder{globalLock};
-		layer = getLayerData(getDispatchKey(device), deviceData);
-	}
-
 	return layer->getTable()->GetDeviceProcAddr(device, pName);
 }
 
@@ -476,12 +583,7 @@ VK_LAYER_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL vkGetInstanceProcAddr(V
 	if (proc)
 		return proc;
 
-	Instance *layer = nullptr;
-	{
-		lock_guard<mutex> holder{globalLock};
-		layer = getLayerData(getDispatchKey(instance), instanceData);
-	}
-
+	Instance *layer = getLayerData(getDispatchKey(instance), instanceData);
 	return layer->getProcAddr(pName);
 }
 
@@ -30,6 +30,10 @@
 #include <string.h>
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "vk_layer.h"
 #include "vk_layer_dispatch_table.h"
 #include "vulkan.h"
@@ -100,6 +104,118 @@ static inline void destroyLayerData(void *key, std::unordered_map<void *, std::u
 	m.erase(itr);
 }
 
+// Maps dispatch keys to layer data, where lookups never take a lock.
+// Readers search an immutable sorted snapshot which writers replace wholesale.
+// Writers must be serialized externally. Instances and devices are created rarely,
+// so copying the snapshot on every create and destroy is cheap.
+// Replaced snapshots cannot be freed while a reader might still be searching them.
+// Readers are counted per epoch parity, and a writer waits out a grace period by flipping
+// the epoch twice and letting each old parity drain before it frees the old snapshot.
+// Lookups are a short binary search, so the wait is brief.
+template <typename T>
+class LayerDataMap
+{
+public:
+	LayerDataMap()
+	{
+		live.reset(new Snapshot);
+		current.store(live.get(), std::memory_order_relaxed);
+	}
+
+	T *find(void *key) const
+	{
+		// Sequentially consistent, so a writer either counts this reader or we see its new snapshot.
+		auto &readers = epoch_readers[epoch.load(std::memory_order_seq_cst) & 1];
+		readers.fetch_add(1, std::memory_order_seq_cst);
+		auto *snapshot = current.load(std::memory_order_seq_cst);
+		auto itr = std::lower_bound(snapshot->entries.begin(), snapshot->entries.end(), key,
+		                            [](const Entry &entry, void *k) { return entry.first < k; });
+		T *data = nullptr;
+		if (itr != snapshot->entries.end() && itr->first == key)
+			data = itr->second;
+		readers.fetch_sub(1, std::memory_order_release);
+		return data;
+	}
+
+	template <typename... TArgs>
+	T *create(void *key, TArgs &&... args)
+	{
+		auto *ptr = new T(std::forward<TArgs>(args)...);
+		owned[key] = std::unique_ptr<T>(ptr);
+		publish();
+		return ptr;
+	}
+
+	void destroy(void *key)
+	{
+		auto itr = owned.find(key);
+		if (itr == owned.end())
+			return;
+
+		// Unpublish the key before the data is freed.
+		std::unique_ptr<T> data = std::move(itr->second);
+		owned.erase(itr);
+		publish();
+	}
+
+private:
+	using Entry = std::pair<void *, T *>;
+	struct Snapshot
+	{
+		std::vector<Entry> entries;
+	};
+
+	std::unordered_map<void *, std::unique_ptr<T>> owned;
+	std::unique_ptr<Snapshot> live;
+	std::atomic<const Snapshot *> current;
+	std::atomic<uint32_t> epoch{0};
+	mutable std::atomic<uint32_t> epoch_readers[2] = {};
+
+	void publish()
+	{
+		std::unique_ptr<Snapshot> snapshot(new Snapshot);
+		snapshot->entries.reserve(owned.size());
+		for (auto &data : owned)
+			snapshot->entries.emplace_back(data.first, data.second.get());
+		std::sort(snapshot->entries.begin(), snapshot->entries.end());
+
+		current.store(snapshot.get(), std::memory_order_seq_cst);
+		wait_for_readers();
+		live = std::move(snapshot);
+	}
+
+	void wait_for_readers()
+	{
+		// A reader may have picked its parity before the previous flip,
+		// so both parities have to drain once after the new snapshot was stored.
+		// Readers entering the drained parity late always observe the new snapshot.
+		for (unsigned i = 0; i < 2; i++)
+		{
+			uint32_t old_epoch = epoch.fetch_add(1, std::memory_order_seq_cst);
+			while (epoch_readers[old_epoch & 1].load(std::memory_order_seq_cst) != 0)
+				std::this_thread::yield();
+		}
+	}
+};
+
+template <typename T>
+static inline T *getLayerData(void *key, const LayerDataMap<T> &m)
+{
+	return m.find(key);
+}
+
+template <typename T, typename... TArgs>
+static inline T *createLayerData(void *key, LayerDataMap<T> &m, TArgs &&... args)
+{
+	return m.create(key, std::forward<TArgs>(args)...);
+}
+
+template <typename T>
+static inline void destroyLayerData(void *key, LayerDataMap<T> &m)
+{
+	m.destroy(key);
+}
+
 static inline VkLayerInstanceDispatchTable *initInstanceTable(VkInstance instance, const PFN_vkGetInstanceProcAddr gpa,
                                                               InstanceTable &table)
 {
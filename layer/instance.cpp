@@ -21,6 +21,7 @@
  */
 
 #include "instance.hpp"
+#include "statistics.hpp"
 #include "utils.hpp"
 #include <mutex>
 #include <unordered_map>
@@ -71,6 +72,8 @@ void Instance::init(VkInstance instance_, const VkApplicationInfo *pApp, VkLayer
 // Make this global to the process so we can share pipeline recording across VkInstances as well in-case an application is using external memory sharing techniques, (VR?).
 // We only access this data structure on device creation, so performance is not a real concern.
 static std::mutex recorderLock;
+// Shared by all recorders. Declared first, so it is destroyed after them.
+static std::unique_ptr<DatabaseInterface> globalModuleStore;
 
 struct Recorder
 {
@@ -119,6 +122,62 @@ static std::string getSystemProperty(const char *key)
 #define FOSSILIZE_APPLICATION_INFO_FILTER_PATH_ENV "FOSSILIZE_APPLICATION_INFO_FILTER_PATH"
 #endif
 
+#ifndef FOSSILIZE_DUMP_FAST_COMPRESSION_ENV
+#define FOSSILIZE_DUMP_FAST_COMPRESSION_ENV "FOSSILIZE_DUMP_FAST_COMPRESSION"
+#endif
+
+#ifndef FOSSILIZE_DUMP_EARLY_DEDUPLICATION_ENV
+#define FOSSILIZE_DUMP_EARLY_DEDUPLICATION_ENV "FOSSILIZE_DUMP_EARLY_DEDUPLICATION"
+#endif
+
+#ifndef FOSSILIZE_DUMP_BINARY_FORMAT_ENV
+#define FOSSILIZE_DUMP_BINARY_FORMAT_ENV "FOSSILIZE_DUMP_BINARY_FORMAT"
+#endif
+
+#ifndef FOSSILIZE_DUMP_SYNC_ENTRIES_ENV
+#define FOSSILIZE_DUMP_SYNC_ENTRIES_ENV "FOSSILIZE_DUMP_SYNC_ENTRIES"
+#endif
+
+#ifndef FOSSILIZE_DUMP_SYNC_INTERVAL_MS_ENV
+#define FOSSILIZE_DUMP_SYNC_INTERVAL_MS_ENV "FOSSILIZE_DUMP_SYNC_INTERVAL_MS"
+#endif
+
+#ifndef FOSSILIZE_DUMP_QUEUE_LIMIT_MB_ENV
+#define FOSSILIZE_DUMP_QUEUE_LIMIT_MB_ENV "FOSSILIZE_DUMP_QUEUE_LIMIT_MB"
+#endif
+
+#ifndef FOSSILIZE_DUMP_QUEUE_LIMIT_POLICY_ENV
+#define FOSSILIZE_DUMP_QUEUE_LIMIT_POLICY_ENV "FOSSILIZE_DUMP_QUEUE_LIMIT_POLICY"
+#endif
+
+#ifndef FOSSILIZE_DUMP_COMPRESSION_THREADS_ENV
+#define FOSSILIZE_DUMP_COMPRESSION_THREADS_ENV "FOSSILIZE_DUMP_COMPRESSION_THREADS"
+#endif
+
+#ifndef FOSSILIZE_DUMP_DEFER_MS_ENV
+#define FOSSILIZE_DUMP_DEFER_MS_ENV "FOSSILIZE_DUMP_DEFER_MS"
+#endif
+
+#ifndef FOSSILIZE_DUMP_DEFER_IDLE_MS_ENV
+#define FOSSILIZE_DUMP_DEFER_IDLE_MS_ENV "FOSSILIZE_DUMP_DEFER_IDLE_MS"
+#endif
+
+#ifndef FOSSILIZE_DUMP_USAGE_METADATA_ENV
+#define FOSSILIZE_DUMP_USAGE_METADATA_ENV "FOSSILIZE_DUMP_USAGE_METADATA"
+#endif
+
+#ifndef FOSSILIZE_DUMP_MODULE_STORE_ENV
+#define FOSSILIZE_DUMP_MODULE_STORE_ENV "FOSSILIZE_DUMP_MODULE_STORE"
+#endif
+
+#ifndef FOSSILIZE_STATS_PATH_ENV
+#define FOSSILIZE_STATS_PATH_ENV "FOSSILIZE_STATS_PATH"
+#endif
+
+#ifndef FOSSILIZE_STATS_INTERVAL_MS_ENV
+#define FOSSILIZE_STATS_INTERVAL_MS_ENV "FOSSILIZE_STATS_INTERVAL_MS"
+#endif
+
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 static thread_local const VkComputePipelineCreateInfo *tls_compute_create_info = nullptr;
 static thread_local const VkGraphicsPipelineCreateInfo *tls_graphics_create_info = nullptr;
@@ -216,6 +275,24 @@ void Instance::completedPipelineCompilation()
 
 Instance::Instance()
 {
+	// By default, statistics are rewritten every 10 seconds.
+	unsigned statsIntervalMs = 10000;
+#ifdef ANDROID
+	auto statsPath = getSystemProperty("debug.fossilize.stats_path");
+	auto statsInterval = getSystemProperty("debug.fossilize.stats_interval_ms");
+	if (!statsInterval.empty())
+		statsIntervalMs = unsigned(strtoul(statsInterval.c_str(), nullptr, 0));
+	if (!statsPath.empty())
+		initLayerStatistics(statsPath.c_str(), statsIntervalMs);
+#else
+	const char *statsPath = getenv(FOSSILIZE_STATS_PATH_ENV);
+	const char *statsInterval = getenv(FOSSILIZE_STATS_INTERVAL_MS_ENV);
+	if (statsInterval)
+		statsIntervalMs = unsigned(strtoul(statsInterval, nullptr, 0));
+	if (statsPath)
+		initLayerStatistics(statsPath, statsIntervalMs);
+#endif
+
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 #ifdef ANDROID
 	auto sigsegv = getSystemProperty("debug.fossilize.dump_sigsegv");
@@ -258,6 +335,30 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 		LOGI("Overriding serialization path: \"%s\".\n", logPath.c_str());
 	}
 	const char *filterPath = nullptr;
+	auto fastCompression = getSystemProperty("debug.fossilize.dump_fast_compression");
+	bool enableFastCompression = !fastCompression.empty() && strtoul(fastCompression.c_str(), nullptr, 0) != 0;
+	auto earlyDeduplication = getSystemProperty("debug.fossilize.dump_early_deduplication");
+	bool enableEarlyDeduplication = !earlyDeduplication.empty() && strtoul(earlyDeduplication.c_str(), nullptr, 0) != 0;
+	auto binaryFormat = getSystemProperty("debug.fossilize.dump_binary_format");
+	bool enableBinaryFormat = !binaryFormat.empty() && strtoul(binaryFormat.c_str(), nullptr, 0) != 0;
+	auto syncEntries = getSystemProperty("debug.fossilize.dump_sync_entries");
+	auto syncInterval = getSystemProperty("debug.fossilize.dump_sync_interval_ms");
+	unsigned syncMaxEntries = syncEntries.empty() ? 0u : unsigned(strtoul(syncEntries.c_str(), nullptr, 0));
+	unsigned syncMaxIntervalMs = syncInterval.empty() ? 0u : unsigned(strtoul(syncInterval.c_str(), nullptr, 0));
+	auto queueLimit = getSystemProperty("debug.fossilize.dump_queue_limit_mb");
+	auto queuePolicy = getSystemProperty("debug.fossilize.dump_queue_limit_policy");
+	size_t queueLimitBytes = queueLimit.empty() ? 0 : size_t(strtoul(queueLimit.c_str(), nullptr, 0)) * 1024 * 1024;
+	bool dropOverQueueLimit = queuePolicy == "drop";
+	auto compressionThreads = getSystemProperty("debug.fossilize.dump_compression_threads");
+	unsigned numCompressionThreads = compressionThreads.empty() ? 1u : unsigned(strtoul(compressionThreads.c_str(), nullptr, 0));
+	auto deferDelay = getSystemProperty("debug.fossilize.dump_defer_ms");
+	auto deferIdle = getSystemProperty("debug.fossilize.dump_defer_idle_ms");
+	unsigned deferDelayMs = deferDelay.empty() ? 0u : unsigned(strtoul(deferDelay.c_str(), nullptr, 0));
+	unsigned deferIdleMs = deferIdle.empty() ? 0u : unsigned(strtoul(deferIdle.c_str(), nullptr, 0));
+	auto usageMetadata = getSystemProperty("debug.fossilize.dump_usage_metadata");
+	bool enableUsageMetadata = !usageMetadata.empty() && strtoul(usageMetadata.c_str(), nullptr, 0) != 0;
+	auto moduleStoreProperty = getSystemProperty("debug.fossilize.dump_module_store");
+	const char *moduleStorePath = moduleStoreProperty.empty() ? nullptr : moduleStoreProperty.c_str();
 #else
 	serializationPath = "fossilize";
 	const char *path = getenv(FOSSILIZE_DUMP_PATH_ENV);
@@ -268,6 +369,29 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 	}
 	extraPaths = getenv(FOSSILIZE_DUMP_PATH_READ_ONLY_ENV);
 	const char *filterPath = getenv(FOSSILIZE_APPLICATION_INFO_FILTER_PATH_ENV);
+	const char *fastCompression = getenv(FOSSILIZE_DUMP_FAST_COMPRESSION_ENV);
+	bool enableFastCompression = fastCompression && strtoul(fastCompression, nullptr, 0) != 0;
+	const char *earlyDeduplication = getenv(FOSSILIZE_DUMP_EARLY_DEDUPLICATION_ENV);
+	bool enableEarlyDeduplication = earlyDeduplication && strtoul(earlyDeduplication, nullptr, 0) != 0;
+	const char *binaryFormat = getenv(FOSSILIZE_DUMP_BINARY_FORMAT_ENV);
+	bool enableBinaryFormat = binaryFormat && strtoul(binaryFormat, nullptr, 0) != 0;
+	const char *syncEntries = getenv(FOSSILIZE_DUMP_SYNC_ENTRIES_ENV);
+	const char *syncInterval = getenv(FOSSILIZE_DUMP_SYNC_INTERVAL_MS_ENV);
+	unsigned syncMaxEntries = syncEntries ? unsigned(strtoul(syncEntries, nullptr, 0)) : 0u;
+	unsigned syncMaxIntervalMs = syncInterval ? unsigned(strtoul(syncInterval, nullptr, 0)) : 0u;
+	const char *queueLimit = getenv(FOSSILIZE_DUMP_QUEUE_LIMIT_MB_ENV);
+	const char *queuePolicy = getenv(FOSSILIZE_DUMP_QUEUE_LIMIT_POLICY_ENV);
+	size_t queueLimitBytes = queueLimit ? size_t(strtoul(queueLimit, nullptr, 0)) * 1024 * 1024 : 0;
+	bool dropOverQueueLimit = queuePolicy && strcmp(queuePolicy, "drop") == 0;
+	const char *compressionThreads = getenv(FOSSILIZE_DUMP_COMPRESSION_THREADS_ENV);
+	unsigned numCompressionThreads = compressionThreads ? unsigned(strtoul(compressionThreads, nullptr, 0)) : 1u;
+	const char *deferDelay = getenv(FOSSILIZE_DUMP_DEFER_MS_ENV);
+	const char *deferIdle = getenv(FOSSILIZE_DUMP_DEFER_IDLE_MS_ENV);
+	unsigned deferDelayMs = deferDelay ? unsigned(strtoul(deferDelay, nullptr, 0)) : 0u;
+	unsigned deferIdleMs = deferIdle ? unsigned(strtoul(deferIdle, nullptr, 0)) : 0u;
+	const char *usageMetadata = getenv(FOSSILIZE_DUMP_USAGE_METADATA_ENV);
+	bool enableUsageMetadata = usageMetadata && strtoul(usageMetadata, nullptr, 0) != 0;
+	const char *moduleStorePath = getenv(FOSSILIZE_DUMP_MODULE_STORE_ENV);
 #endif
 
 	if (filterPath)
@@ -284,12 +408,38 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 	entry.interface.reset(create_concurrent_database_with_encoded_extra_paths(serializationPath.c_str(),
 	                                                                          DatabaseMode::Append,
 	                                                                          extraPaths));
+	if (entry.interface && (syncMaxEntries || syncMaxIntervalMs))
+		entry.interface->set_group_commit(syncMaxEntries, syncMaxIntervalMs);
+	if (entry.interface && numCompressionThreads)
+		entry.interface->set_compression_threads(numCompressionThreads);
+
+	if (moduleStorePath && *moduleStorePath && !globalModuleStore)
+	{
+		globalModuleStore.reset(create_module_store_database(moduleStorePath, DatabaseMode::Append));
+		if (!globalModuleStore->prepare())
+		{
+			LOGE("Failed to prepare module store \"%s\", embedding shader modules.\n", moduleStorePath);
+			globalModuleStore.reset();
+		}
+	}
+
+	if (entry.interface && globalModuleStore)
+		entry.interface->set_module_store(globalModuleStore.get());
 
 	auto *recorder = new StateRecorder;
 	entry.recorder.reset(recorder);
 	recorder->set_database_enable_compression(true);
+	recorder->set_database_enable_fast_compression(enableFastCompression);
 	recorder->set_database_enable_checksum(true);
+	recorder->set_enable_early_deduplication(enableEarlyDeduplication);
+	recorder->set_database_enable_binary_format(enableBinaryFormat);
 	recorder->set_application_info_filter(entry.filter.get());
+	// When blocking, never stall the application for more than a frame or so per object.
+	recorder->set_record_queue_limit(queueLimitBytes,
+	                                 dropOverQueueLimit ? RECORD_QUEUE_LIMIT_POLICY_DROP : RECORD_QUEUE_LIMIT_POLICY_BLOCK,
+	                                 20);
+	recorder->set_deferred_recording(deferDelayMs, deferIdleMs);
+	recorder->set_enable_usage_metadata(enableUsageMetadata);
 	if (appInfo)
 		if (!recorder->record_application_info(*appInfo))
 			LOGE("Failed to record application info.\n");
@@ -301,4 +451,27 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 	return recorder;
 }
 
+void Instance::dumpRecorderStatistics(FILE *file)
+{
+	std::lock_guard<std::mutex> lock(recorderLock);
+	for (auto &entry : globalRecorders)
+	{
+		if (!entry.second.recorder)
+			continue;
+
+		StateRecorderStatistics stats;
+		entry.second.recorder->get_statistics(&stats);
+		fprintf(file, "recorder %016" PRIx64 " record_count=%" PRIu64 " record_ns=%" PRIu64
+		              " queue_depth=%" PRIu64 " max_queue_depth=%" PRIu64
+		              " entries_written=%" PRIu64 " bytes_written=%" PRIu64 " thread_busy_ns=%" PRIu64
+		              " queued_bytes=%" PRIu64 " max_queued_bytes=%" PRIu64
+		              " blocked_count=%" PRIu64 " blocked_ns=%" PRIu64 " dropped_count=%" PRIu64 "\n",
+		        entry.first, stats.record_count, stats.record_time_ns,
+		        stats.queue_depth, stats.max_queue_depth,
+		        stats.entries_written, stats.bytes_written, stats.thread_busy_time_ns,
+		        stats.queued_bytes, stats.max_queued_bytes,
+		        stats.blocked_count, stats.blocked_time_ns, stats.dropped_count);
+	}
+}
+
 }
@@ -56,6 +56,7 @@ public:
 	}
 
 	static StateRecorder *getStateRecorderForDevice(const VkApplicationInfo *appInfo, const VkPhysicalDeviceFeatures2 *features);
+	static void dumpRecorderStatistics(FILE *file);
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 	bool capturesCrashes() const
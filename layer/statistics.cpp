@@ -0,0 +1,146 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "statistics.hpp"
+#include "instance.hpp"
+#include "utils.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <stdlib.h>
+#include <inttypes.h>
+
+namespace Fossilize
+{
+struct EntryPointCounters
+{
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> layerTime;
+	std::atomic<uint64_t> downstreamTime;
+};
+
+static const char *entryPointNames[LAYER_ENTRY_POINT_COUNT] = {
+	"vkCreateDescriptorSetLayout",
+	"vkCreatePipelineLayout",
+	"vkCreateGraphicsPipelines",
+	"vkCreateComputePipelines",
+	"vkCreateSampler",
+	"vkCreateShaderModule",
+	"vkCreateRenderPass",
+};
+
+static EntryPointCounters entryPointCounters[LAYER_ENTRY_POINT_COUNT];
+static std::atomic<bool> statisticsEnabled;
+static std::atomic<uint64_t> nextDumpTime;
+static uint64_t dumpInterval;
+static std::string statisticsPath;
+static std::mutex statisticsLock;
+
+static uint64_t getTimeNs()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void initLayerStatistics(const char *path, unsigned intervalMs)
+{
+	std::lock_guard<std::mutex> holder{statisticsLock};
+	if (statisticsEnabled.load(std::memory_order_relaxed))
+		return;
+
+	statisticsPath = path;
+	dumpInterval = uint64_t(intervalMs) * 1000000ull;
+	nextDumpTime.store(getTimeNs() + dumpInterval, std::memory_order_relaxed);
+	statisticsEnabled.store(true, std::memory_order_release);
+	atexit(dumpLayerStatistics);
+	LOGI("Writing layer statistics to \"%s\".\n", path);
+}
+
+void dumpLayerStatistics()
+{
+	if (!statisticsEnabled.load(std::memory_order_acquire))
+		return;
+
+	std::lock_guard<std::mutex> holder{statisticsLock};
+	FILE *file = fopen(statisticsPath.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open statistics file \"%s\".\n", statisticsPath.c_str());
+		return;
+	}
+
+	// Layer time is spent inside the layer itself, downstream time in the layers and driver below it.
+	for (unsigned i = 0; i < LAYER_ENTRY_POINT_COUNT; i++)
+	{
+		auto &counters = entryPointCounters[i];
+		fprintf(file, "entry_point %s calls=%" PRIu64 " layer_ns=%" PRIu64 " downstream_ns=%" PRIu64 "\n",
+		        entryPointNames[i],
+		        counters.calls.load(std::memory_order_relaxed),
+		        counters.layerTime.load(std::memory_order_relaxed),
+		        counters.downstreamTime.load(std::memory_order_relaxed));
+	}
+
+	Instance::dumpRecorderStatistics(file);
+	fclose(file);
+}
+
+LayerCallTimer::LayerCallTimer(LayerEntryPoint entryPoint_)
+	: entryPoint(entryPoint_), enabled(statisticsEnabled.load(std::memory_order_acquire))
+{
+	if (enabled)
+		startTime = getTimeNs();
+}
+
+void LayerCallTimer::beginDownstreamCall()
+{
+	if (enabled)
+		downstreamStartTime = getTimeNs();
+}
+
+void LayerCallTimer::endDownstreamCall()
+{
+	if (enabled)
+		downstreamTime += getTimeNs() - downstreamStartTime;
+}
+
+LayerCallTimer::~LayerCallTimer()
+{
+	if (!enabled)
+		return;
+
+	uint64_t endTime = getTimeNs();
+	auto &counters = entryPointCounters[entryPoint];
+	counters.calls.fetch_add(1, std::memory_order_relaxed);
+	counters.layerTime.fetch_add(endTime - startTime - downstreamTime, std::memory_order_relaxed);
+	counters.downstreamTime.fetch_add(downstreamTime, std::memory_order_relaxed);
+
+	// Whichever thread first sees the deadline pass takes care of the periodic dump.
+	uint64_t deadline = nextDumpTime.load(std::memory_order_relaxed);
+	if (dumpInterval && endTime >= deadline &&
+	    nextDumpTime.compare_exchange_strong(deadline, endTime + dumpInterval, std::memory_order_relaxed))
+	{
+		dumpLayerStatistics();
+	}
+}
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace Fossilize
+{
+enum LayerEntryPoint
+{
+	LAYER_ENTRY_POINT_CREATE_DESCRIPTOR_SET_LAYOUT = 0,
+	LAYER_ENTRY_POINT_CREATE_PIPELINE_LAYOUT,
+	LAYER_ENTRY_POINT_CREATE_GRAPHICS_PIPELINES,
+	LAYER_ENTRY_POINT_CREATE_COMPUTE_PIPELINES,
+	LAYER_ENTRY_POINT_CREATE_SAMPLER,
+	LAYER_ENTRY_POINT_CREATE_SHADER_MODULE,
+	LAYER_ENTRY_POINT_CREATE_RENDER_PASS,
+	LAYER_ENTRY_POINT_COUNT
+};
+
+// Statistics are only collected once enabled, which happens when the first instance is created with FOSSILIZE_STATS_PATH set.
+// The statistics file is rewritten every intervalMs from within intercepted calls, and once more at exit.
+void initLayerStatistics(const char *path, unsigned intervalMs);
+void dumpLayerStatistics();
+
+// Accounts for the time spent in an intercepted entry point, minus the time spent further down the chain.
+class LayerCallTimer
+{
+public:
+	explicit LayerCallTimer(LayerEntryPoint entryPoint);
+	~LayerCallTimer();
+
+	void beginDownstreamCall();
+	void endDownstreamCall();
+
+	LayerCallTimer(const LayerCallTimer &) = delete;
+	void operator=(const LayerCallTimer &) = delete;
+
+private:
+	LayerEntryPoint entryPoint;
+	bool enabled;
+	uint64_t startTime = 0;
+	uint64_t downstreamStartTime = 0;
+	uint64_t downstreamTime = 0;
+};
+}
@@ -23,6 +23,9 @@
 #pragma once
 
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
 
@@ -71,4 +74,19 @@ static inline void futex_wrapper_unlock(int *lock)
 		syscall(SYS_futex, lock, FUTEX_WAKE, 1, 0, 0, 0);
 	}
 }
+
+// Plain notification on a 32-bit word in shared memory.
+// Returns early if *word no longer holds expected, or if we are woken up spuriously.
+static inline void futex_wrapper_wait(uint32_t *word, uint32_t expected, unsigned timeout_ms)
+{
+	struct timespec timeout = {};
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = long(timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, 0, 0);
+}
+
+static inline void futex_wrapper_wake_all(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
 }
\ No newline at end of file
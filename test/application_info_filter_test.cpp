@@ -25,6 +25,8 @@
 #include "vulkan.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <string>
 
 static bool write_string_to_file(const char *path, const char *str)
 {
@@ -37,110 +39,184 @@ static bool write_string_to_file(const char *path, const char *str)
 	return true;
 }
 
-int main()
-{
-	const char *test_json =
-R"delim(
+static bool test_filter(Fossilize::ApplicationInfoFilter &filter)
 {
-	"asset": "FossilizeApplicationInfoFilter",
-	"version" : 1,
-	"blacklistedApplicationNames" : [ "A",  "B", "C" ],
-	"blacklistedEngineNames" : [ "D", "E", "F" ],
-	"applicationFilters" : {
-		"test1" : { "minimumApplicationVersion" : 10 },
-		"test2" : { "minimumApplicationVersion" : 10, "minimumEngineVersion" : 1000 },
-		"test3" : { "minimumApiVersion" : 50 }
-	},
-	"engineFilters" : {
-		"test1" : { "minimumEngineVersion" : 10 },
-		"test2" : { "minimumEngineVersion" : 10, "minimumApplicationVersion" : 1000 },
-		"test3" : { "minimumApiVersion" : 50 }
-	}
-}
-)delim";
-
-	if (!write_string_to_file(".__test_appinfo.json", test_json))
-		return EXIT_FAILURE;
-
-	Fossilize::ApplicationInfoFilter filter;
-	filter.parse_async(".__test_appinfo.json");
-
 	if (!filter.check_success())
 	{
 		LOGE("Parsing did not complete successfully.\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
 	VkApplicationInfo appinfo = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
 
 	if (!filter.test_application_info(nullptr))
-		return EXIT_FAILURE;
+		return false;
 
 	// Test blacklists
 	appinfo.pApplicationName = "A";
 	appinfo.pEngineName = "G";
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pApplicationName = "D";
 	appinfo.pEngineName = "A";
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pApplicationName = "H";
 	appinfo.pEngineName = "E";
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Test application version filtering
 	appinfo.pApplicationName = "test1";
 	appinfo.pEngineName = nullptr;
 	appinfo.applicationVersion = 9;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 	appinfo.applicationVersion = 10;
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Engine version should be ignored for appinfo filters.
 	appinfo.pApplicationName = "test2";
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pApplicationName = "test3";
 	appinfo.applicationVersion = 0;
 	appinfo.apiVersion = 49;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.apiVersion = 50;
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Test engine version filtering
 	appinfo.pApplicationName = nullptr;
 	appinfo.pEngineName = "test1";
 	appinfo.engineVersion = 9;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 	appinfo.engineVersion = 10;
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Engine version should be ignored for appinfo filters.
 	appinfo.pEngineName = "test2";
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pEngineName = "test3";
 	appinfo.engineVersion = 0;
 	appinfo.apiVersion = 49;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.apiVersion = 50;
 	if (!filter.test_application_info(&appinfo))
+		return false;
+
+	if (filter.test_pipeline_hash(1) || filter.test_pipeline_hash(0xabcdef0123456789ull))
+		return false;
+	if (!filter.test_pipeline_hash(2))
+		return false;
+
+	return true;
+}
+
+// With enough listed hashes, about 1% of unlisted ones hit the bloom filter.
+// Those must still be recorded, only listed hashes are skipped.
+static bool test_bloom_false_positives(const char *path)
+{
+	const uint64_t listed_count = 2000;
+	std::string json = "{ \"asset\": \"FossilizeApplicationInfoFilter\", \"version\" : 1, \"skippedPipelineHashes\" : [";
+	for (uint64_t i = 1; i <= listed_count; i++)
+	{
+		char hash[32];
+		snprintf(hash, sizeof(hash), "%s\"%016" PRIx64 "\"", i > 1 ? ", " : " ", 2 * i);
+		json += hash;
+	}
+	json += " ] }";
+
+	if (!write_string_to_file(path, json.c_str()))
+		return false;
+
+	Fossilize::ApplicationInfoFilter filter;
+	filter.parse_async(path);
+	if (!filter.check_success())
+		return false;
+
+	for (uint64_t i = 1; i <= listed_count; i++)
+		if (filter.test_pipeline_hash(2 * i))
+			return false;
+
+	// Odd hashes are never listed, and among this many, plenty of them hit the bloom filter.
+	for (uint64_t hash = 1; hash < 400000; hash += 2)
+		if (!filter.test_pipeline_hash(hash))
+			return false;
+
+	return true;
+}
+
+int main()
+{
+	const char *test_json =
+R"delim(
+{
+	"asset": "FossilizeApplicationInfoFilter",
+	"version" : 1,
+	"blacklistedApplicationNames" : [ "A",  "B", "C" ],
+	"blacklistedEngineNames" : [ "D", "E", "F" ],
+	"applicationFilters" : {
+		"test1" : { "minimumApplicationVersion" : 10 },
+		"test2" : { "minimumApplicationVersion" : 10, "minimumEngineVersion" : 1000 },
+		"test3" : { "minimumApiVersion" : 50 }
+	},
+	"engineFilters" : {
+		"test1" : { "minimumEngineVersion" : 10 },
+		"test2" : { "minimumEngineVersion" : 10, "minimumApplicationVersion" : 1000 },
+		"test3" : { "minimumApiVersion" : 50 }
+	},
+	"skippedPipelineHashes" : [ "0000000000000001", "abcdef0123456789" ]
+}
+)delim";
+
+	if (!write_string_to_file(".__test_appinfo.json", test_json))
+		return EXIT_FAILURE;
+
+	{
+		Fossilize::ApplicationInfoFilter filter;
+		filter.parse_async(".__test_appinfo.json");
+		if (!test_filter(filter))
+			return EXIT_FAILURE;
+	}
+
+	// The precompiled filter must behave the same.
+	if (!Fossilize::ApplicationInfoFilter::compile(".__test_appinfo.json", ".__test_appinfo.bin"))
+		return EXIT_FAILURE;
+
+	{
+		Fossilize::ApplicationInfoFilter filter;
+		filter.parse_async(".__test_appinfo.bin");
+		if (!test_filter(filter))
+			return EXIT_FAILURE;
+	}
+
+	if (!test_bloom_false_positives(".__test_appinfo.json"))
+		return EXIT_FAILURE;
+
+	if (!Fossilize::ApplicationInfoFilter::compile(".__test_appinfo.json", ".__test_appinfo.bin"))
 		return EXIT_FAILURE;
 
+	{
+		Fossilize::ApplicationInfoFilter filter;
+		filter.parse_async(".__test_appinfo.bin");
+		if (!filter.check_success() || filter.test_pipeline_hash(2) || !filter.test_pipeline_hash(3))
+			return EXIT_FAILURE;
+	}
+
 	remove(".__test_appinfo.json");
+	remove(".__test_appinfo.bin");
 }
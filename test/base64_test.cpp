@@ -0,0 +1,77 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "base64.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace Fossilize;
+
+static std::string encode(const char *str)
+{
+	size_t size = strlen(str);
+	std::string ret(compute_size_base64(size), '\0');
+	if (encode_base64(&ret[0], str, size) != &ret[0] + ret.size())
+		abort();
+	return ret;
+}
+
+int main()
+{
+	// Reference values from RFC 4648.
+	if (encode("") != "" || encode("f") != "Zg==" || encode("fo") != "Zm8=" || encode("foo") != "Zm9v" ||
+	    encode("foob") != "Zm9vYg==" || encode("fooba") != "Zm9vYmE=" || encode("foobar") != "Zm9vYmFy")
+		return EXIT_FAILURE;
+
+	std::vector<uint8_t> data(256);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = uint8_t(i * 31 + 7);
+
+	for (size_t size = 0; size < data.size(); size++)
+	{
+		std::string encoded(compute_size_base64(size), '\0');
+		encode_base64(&encoded[0], data.data(), size);
+
+		std::vector<uint8_t> decoded(size + 3, 0xff);
+		if (decode_base64(decoded.data(), size, encoded.c_str()) != size)
+			return EXIT_FAILURE;
+		if (memcmp(decoded.data(), data.data(), size) != 0)
+			return EXIT_FAILURE;
+
+		// Nothing may be written past the end.
+		for (size_t i = size; i < decoded.size(); i++)
+			if (decoded[i] != 0xff)
+				return EXIT_FAILURE;
+	}
+
+	// Input without padding still stops at the requested size.
+	uint8_t bytes[4] = { 0, 0, 0, 0xff };
+	if (decode_base64(bytes, 2, "Zm9v") != 2 || bytes[2] != 0 || memcmp(bytes, "fo", 2) != 0)
+		return EXIT_FAILURE;
+
+	// Decoding stops at the terminator.
+	if (decode_base64(bytes, 3, "Zg") != 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/concurrent_hash_set.hpp"
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+using namespace Fossilize;
+
+int main()
+{
+	ConcurrentHashSet set(10);
+
+	if (set.contains(1) || set.insert(0) || set.contains(0))
+		return EXIT_FAILURE;
+	if (!set.insert(1) || !set.insert(1) || !set.contains(1) || set.size() != 1)
+		return EXIT_FAILURE;
+
+	// The set stops accepting new keys at 3/4 of its capacity, but keeps what it has.
+	for (uint64_t i = 2; i <= 1024; i++)
+		set.insert(i);
+	if (set.size() != 768)
+		return EXIT_FAILURE;
+	for (uint64_t i = 1; i <= 768; i++)
+		if (!set.contains(i))
+			return EXIT_FAILURE;
+	if (set.insert(1000) || set.contains(1000))
+		return EXIT_FAILURE;
+
+	// Threads insert overlapping key ranges.
+	ConcurrentHashSet concurrent_set(16);
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&concurrent_set, t]() {
+			for (uint64_t i = 1; i <= 20000; i++)
+				if (!concurrent_set.insert(i * 0x10001 + t % 2))
+					abort();
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+
+	if (concurrent_set.size() != 40000)
+		return EXIT_FAILURE;
+	for (uint64_t i = 1; i <= 20000; i++)
+		if (!concurrent_set.contains(i * 0x10001) || !concurrent_set.contains(i * 0x10001 + 1))
+			return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
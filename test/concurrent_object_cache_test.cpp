@@ -0,0 +1,101 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "util/concurrent_object_cache.hpp"
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace Fossilize;
+
+int main()
+{
+	ConcurrentObjectCache<int> cache;
+	cache.set_target_size(16 * 4);
+
+	if (!cache.insert_object(1, 1, 1) || cache.insert_object(1, 2, 1))
+		return EXIT_FAILURE;
+	if (cache.find_object(1).first != 1 || cache.find_object(2).second)
+		return EXIT_FAILURE;
+
+	int object = 0;
+	if (!cache.find_and_pin_object(1, object) || object != 1 || cache.find_and_pin_object(2, object))
+		return EXIT_FAILURE;
+
+	// The pinned object survives while everything else is pruned down to the budget.
+	for (Hash i = 2; i < 1000; i++)
+		cache.insert_object(i, int(i), 1);
+	cache.prune_cache([](Hash, int) {});
+	if (cache.get_current_total_size() > 16 * 4 + 1 || !cache.find_object(1).second)
+		return EXIT_FAILURE;
+	cache.unpin_object(1);
+	cache.delete_cache([](Hash, int) {});
+	if (cache.get_current_object_count() != 0)
+		return EXIT_FAILURE;
+
+	// Threads race to create overlapping objects while another thread prunes.
+	ConcurrentObjectCache<int> concurrent_cache;
+	concurrent_cache.set_target_size(1024);
+	std::atomic<unsigned> created;
+	std::atomic<unsigned> deleted;
+	created.store(0);
+	deleted.store(0);
+	std::atomic<bool> done;
+	done.store(false);
+
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&]() {
+			for (Hash i = 1; i <= 20000; i++)
+			{
+				int value = 0;
+				if (concurrent_cache.find_and_pin_object(i, value))
+				{
+					if (value != int(i))
+						abort();
+					concurrent_cache.unpin_object(i);
+				}
+				else if (concurrent_cache.insert_object(i, int(i), 1))
+					created.fetch_add(1);
+			}
+		});
+	}
+
+	std::thread pruner([&]() {
+		while (!done.load())
+			concurrent_cache.prune_cache([&](Hash, int) { deleted.fetch_add(1); });
+	});
+
+	for (auto &thread : threads)
+		thread.join();
+	done.store(true);
+	pruner.join();
+
+	concurrent_cache.delete_cache([&](Hash, int) { deleted.fetch_add(1); });
+	if (created.load() < 20000 || created.load() != deleted.load())
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include "fossilize_external_replayer_control_block.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace Fossilize;
+
+// The control block as older ExternalReplayers create it.
+struct LegacySharedControlBlock
+{
+	uint32_t version_cookie;
+	int futex_lock;
+	uint32_t progress[16];
+	uint32_t write_count;
+	uint32_t read_count;
+	uint32_t read_offset;
+	uint32_t write_offset;
+	uint32_t ring_buffer_offset;
+	uint32_t ring_buffer_size;
+};
+
+static SharedControlBlock *create_block(std::vector<uint64_t> &storage, uint32_t magic, uint32_t ring_size)
+{
+	storage.assign((4 * 1024 + ring_size) / sizeof(uint64_t), 0);
+	auto *block = reinterpret_cast<SharedControlBlock *>(storage.data());
+	block->version_cookie = magic;
+	block->ring_buffer_offset = 4 * 1024;
+	block->ring_buffer_size = ring_size;
+	return block;
+}
+
+int main()
+{
+	std::vector<uint64_t> storage;
+
+	// Full rings drop messages, and count them.
+	auto *block = create_block(storage, ControlBlockMagic, 4 * ControlBlockMessageSize);
+	for (unsigned i = 0; i < 6; i++)
+		shared_control_block_write_message(block, "MODULE 1234\n");
+	if (block->messages_written.load() != 4 || block->messages_dropped.load() != 2)
+		return EXIT_FAILURE;
+	if (shared_control_block_read_avail(block) != 4 * ControlBlockMessageSize)
+		return EXIT_FAILURE;
+
+	// Legacy blocks are set up with the old layout, and use the old message size.
+	{
+		const uint32_t legacy_ring_offset = 4 * 1024;
+		const uint32_t legacy_ring_size = 64 * 1024;
+		storage.assign((legacy_ring_offset + legacy_ring_size) / sizeof(uint64_t), 0);
+		auto *legacy_block = reinterpret_cast<LegacySharedControlBlock *>(storage.data());
+		legacy_block->version_cookie = ControlBlockLegacyMagic;
+		legacy_block->ring_buffer_offset = legacy_ring_offset;
+		legacy_block->ring_buffer_size = legacy_ring_size;
+
+		block = reinterpret_cast<SharedControlBlock *>(storage.data());
+		if (!shared_control_block_is_legacy(block) ||
+		    block->ring_buffer_offset != legacy_ring_offset || block->ring_buffer_size != legacy_ring_size)
+			return EXIT_FAILURE;
+
+		shared_control_block_write_message(block, "SLOW1 0123456789abcdef 12345678901234567890\n");
+		if (legacy_block->write_count != ControlBlockLegacyMessageSize || legacy_block->read_count != 0)
+			return EXIT_FAILURE;
+
+		// An old reader finds the message right at the start of its ring.
+		const char *legacy = reinterpret_cast<const char *>(storage.data()) + legacy_ring_offset;
+		if (strncmp(legacy, "SLOW1 ", 6) != 0 || legacy[ControlBlockLegacyMessageSize - 1] != '\0')
+			return EXIT_FAILURE;
+	}
+
+	// One writer and one reader without a lock. Nothing may be lost or reordered.
+	block = create_block(storage, ControlBlockMagic, 16 * ControlBlockMessageSize);
+	const unsigned count = 100000;
+
+	std::thread writer([block, count]() {
+		char msg[ControlBlockMessageSize];
+		for (unsigned i = 0; i < count; i++)
+		{
+			snprintf(msg, sizeof(msg), "GRAPHICS_VERR %016x\n", i);
+			while (!shared_control_block_write(block, msg, sizeof(msg)))
+				std::this_thread::yield();
+		}
+	});
+
+	bool ok = true;
+	for (unsigned i = 0; i < count && ok; )
+	{
+		if (shared_control_block_read_avail(block) < ControlBlockMessageSize)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		char msg[ControlBlockMessageSize];
+		if (!shared_control_block_read(block, msg, sizeof(msg)) ||
+		    strtoul(msg + 14, nullptr, 16) != i)
+			ok = false;
+		i++;
+	}
+
+	writer.join();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,61 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crc32c.hpp"
+#include <stdlib.h>
+#include <random>
+#include <vector>
+
+using namespace Fossilize;
+
+int main()
+{
+	// Standard check value.
+	static const char check[] = "123456789";
+	if (crc32c(0, check, 9) != 0xe3069283u || crc32c_portable(0, check, 9) != 0xe3069283u)
+		return EXIT_FAILURE;
+
+	std::mt19937 rnd;
+	std::vector<uint8_t> buffer(64 * 1024 + 13);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	// Every alignment and tail size, and incremental updates must match a single pass.
+	for (size_t offset = 0; offset < 16; offset++)
+	{
+		for (size_t size = 0; size < 70; size++)
+			if (crc32c(0, buffer.data() + offset, size) != crc32c_portable(0, buffer.data() + offset, size))
+				return EXIT_FAILURE;
+	}
+
+	uint32_t full = crc32c_portable(0, buffer.data(), buffer.size());
+	if (crc32c(0, buffer.data(), buffer.size()) != full)
+		return EXIT_FAILURE;
+
+	uint32_t partial = crc32c(0, buffer.data(), 1000);
+	partial = crc32c_portable(partial, buffer.data() + 1000, 3);
+	partial = crc32c(partial, buffer.data() + 1003, buffer.size() - 1003);
+	if (partial != full)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
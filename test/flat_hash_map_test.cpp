@@ -0,0 +1,115 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/flat_hash_map.hpp"
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+using namespace Fossilize;
+
+int main()
+{
+	FlatHashMap<unsigned> map;
+	if (map.find(0) || map.count(0) || !map.empty())
+		abort();
+
+	// Zero is a valid key, and the first value inserted for a key wins.
+	if (!map.emplace(0, 10))
+		abort();
+	if (map.emplace(0, 20))
+		abort();
+	if (!map.find(0) || *map.find(0) != 10)
+		abort();
+
+	// Force plenty of rehashes, with both sequential and spread out keys.
+	for (uint64_t i = 1; i < 100000; i++)
+		if (!map.emplace(i, unsigned(i + 10)) || !map.emplace(i << 40, unsigned(i)))
+			abort();
+
+	if (map.size() != 2 * 100000 - 1)
+		abort();
+
+	for (uint64_t i = 1; i < 100000; i++)
+	{
+		auto *value = map.find(i);
+		if (!value || *value != i + 10)
+			abort();
+		value = map.find(i << 40);
+		if (!value || *value != i)
+			abort();
+	}
+
+	if (map.count(100000) || map.count(uint64_t(100000) << 40))
+		abort();
+
+	// Every entry is visited exactly once.
+	std::vector<uint64_t> keys;
+	for (auto &slot : map)
+		keys.push_back(slot.first);
+	std::sort(keys.begin(), keys.end());
+	if (keys.size() != map.size() || std::unique(keys.begin(), keys.end()) != keys.end())
+		abort();
+
+	map.clear();
+	if (!map.empty() || map.count(1))
+		abort();
+
+	map.reserve(1000);
+	for (uint64_t i = 0; i < 1000; i++)
+		map.emplace(i * 7, unsigned(i));
+	if (map.size() != 1000 || *map.find(7 * 999) != 999)
+		abort();
+
+	// Unlike emplace(), operator[] can replace existing values, and inserts value-initialized ones.
+	map[7] = 100;
+	if (*map.find(7) != 100 || map.size() != 1000)
+		abort();
+	if (map[1] != 0 || map.size() != 1001)
+		abort();
+	for (uint64_t i = 0; i < 10000; i++)
+		map[i << 32] += 2;
+	if (*map.find(uint64_t(9999) << 32) != 2 || *map.find(0) != 2)
+		abort();
+
+	// Erasing keeps every other key reachable, including keys which probed past the erased ones.
+	FlatHashMap<unsigned> erase_map;
+	for (uint64_t i = 0; i < 20000; i++)
+		erase_map.emplace(i, unsigned(i));
+	if (erase_map.erase(20000))
+		abort();
+	for (uint64_t i = 0; i < 20000; i += 3)
+		if (!erase_map.erase(i))
+			abort();
+	for (uint64_t i = 0; i < 20000; i++)
+	{
+		auto *value = erase_map.find(i);
+		if ((i % 3 == 0) != (value == nullptr) || (value && *value != i))
+			abort();
+	}
+	if (erase_map.size() != 20000 - 6667 || erase_map.erase(0))
+		abort();
+
+	// Erased keys can be inserted again.
+	if (!erase_map.emplace(3, 30) || *erase_map.find(3) != 30)
+		abort();
+}
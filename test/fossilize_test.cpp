@@ -23,10 +23,16 @@
 #include "fossilize.hpp"
 #include "fossilize_db.hpp"
 #include "fossilize_external_replayer.hpp"
+#include "fossilize_replayer.hpp"
+#include "util/entry_payload.hpp"
 #include <string.h>
 #include <memory>
 #include <vector>
 #include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
 #include "layer/utils.hpp"
 
 using namespace Fossilize;
@@ -633,10 +639,12 @@ static bool test_database()
 		}
 	}
 
-	// Try playback multiple times.
-	for (unsigned iter = 0; iter < 2; iter++)
+	// Try playback multiple times, both with plain reads and with a memory mapped archive.
+	for (unsigned iter = 0; iter < 4; iter++)
 	{
-		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_tmp_copy.foz", DatabaseMode::ReadOnly));
+		auto mode = (iter & 1) ? DatabaseMode::ReadOnlyMemoryMap : DatabaseMode::ReadOnly;
+		PayloadReadFlags flags = (iter & 2) ? PAYLOAD_READ_CONCURRENT_BIT : 0;
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_tmp_copy.foz", mode));
 		if (!db->prepare())
 			return false;
 
@@ -655,29 +663,42 @@ static bool test_database()
 		if (db->has_entry(RESOURCE_GRAPHICS_PIPELINE, 3))
 			return false;
 
+		DatabaseEntryInfo info = {};
+		if (!db->get_entry_info(RESOURCE_SHADER_MODULE, 3, &info))
+			return false;
+		if (info.uncompressed_size != 6 || info.stored_size != 6 ||
+		    info.compression != DATABASE_COMPRESSION_NONE || !info.has_checksum)
+			return false;
+		if (!db->get_entry_info(RESOURCE_SAMPLER, 1, &info))
+			return false;
+		if (info.uncompressed_size != 3 || !info.has_checksum)
+			return false;
+		if (db->get_entry_info(RESOURCE_GRAPHICS_PIPELINE, 3, &info))
+			return false;
+
 		size_t blob_size;
 		std::vector<uint8_t> blob;
 
-		if (!db->read_entry(RESOURCE_SAMPLER, 1, &blob_size, nullptr, 0))
+		if (!db->read_entry(RESOURCE_SAMPLER, 1, &blob_size, nullptr, flags))
 			return false;
 		blob.resize(blob_size);
-		if (!db->read_entry(RESOURCE_SAMPLER, 1, &blob_size, blob.data(), 0))
+		if (!db->read_entry(RESOURCE_SAMPLER, 1, &blob_size, blob.data(), flags))
 			return false;
 		if (!compare(blob, { 1, 2, 3 }))
 			return false;
 
-		if (!db->read_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 2, &blob_size, nullptr, 0))
+		if (!db->read_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 2, &blob_size, nullptr, flags))
 			return false;
 		blob.resize(blob_size);
-		if (!db->read_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 2, &blob_size, blob.data(), 0))
+		if (!db->read_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 2, &blob_size, blob.data(), flags))
 			return false;
 		if (!compare(blob, { 10, 20, 30, 40, 50 }))
 			return false;
 
-		if (!db->read_entry(RESOURCE_SHADER_MODULE, 3, &blob_size, nullptr, 0))
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, 3, &blob_size, nullptr, flags))
 			return false;
 		blob.resize(blob_size);
-		if (!db->read_entry(RESOURCE_SHADER_MODULE, 3, &blob_size, blob.data(), 0))
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, 3, &blob_size, blob.data(), flags))
 			return false;
 		if (!compare(blob, { 1, 2, 3, 1, 2, 3 }))
 			return false;
@@ -686,197 +707,2656 @@ static bool test_database()
 	return true;
 }
 
-static bool file_exists(const char *path)
-{
-	FILE *file = fopen(path, "rb");
-	if (file)
-	{
-		fclose(file);
-		return true;
-	}
-	else
-		return false;
-}
-
-static bool test_concurrent_database_extra_paths()
+static bool test_database_index()
 {
-	// Test a normal flow. First time we don't have the read-only database.
-	// Next time we have one.
-	remove(".__test_concurrent.foz");
-	remove(".__test_concurrent.1.foz");
-	remove(".__test_concurrent.2.foz");
-	remove(".__test_concurrent.3.foz");
-	remove(".__test_concurrent.4.foz");
-
-	static const char *extra_paths = ".__test_concurrent.1.foz;.__test_concurrent.2.foz;.__test_concurrent.3.foz";
-	static const uint8_t blob[] = {1, 2, 3};
+	remove(".__test_index.foz");
 
-	{
-		auto db0 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
-		                                                                         DatabaseMode::Append, nullptr, 0));
-		if (!db0->prepare())
+	const auto verify = [](DatabaseMode mode, unsigned expected_count) -> bool {
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_index.foz", mode));
+		if (!db->prepare())
 			return false;
 
-		if (!db0->write_entry(RESOURCE_SAMPLER, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr))
 			return false;
-		if (!db0->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-			return false;
-
-		auto db1 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
-		                                                                         DatabaseMode::Append, nullptr, 0));
-		if (!db1->prepare())
+		if (hash_count != expected_count)
 			return false;
 
-		if (!db1->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-			return false;
-		if (!db1->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-			return false;
+		for (unsigned i = 0; i < expected_count; i++)
+		{
+			uint8_t blob[4] = {};
+			size_t blob_size = 0;
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, nullptr, 0))
+				return false;
+			if (blob_size != sizeof(blob))
+				return false;
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob, 0))
+				return false;
+			for (auto &b : blob)
+				if (b != i + 1)
+					return false;
+		}
 
-		auto db2 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
-		                                                                         DatabaseMode::Append, nullptr, 0));
-		if (!db2->prepare())
-			return false;
+		return true;
+	};
 
-		if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-			return false;
-		if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+	const auto write = [](DatabaseMode mode, unsigned first, unsigned count) -> bool {
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_index.foz", mode));
+		if (!db->prepare())
 			return false;
-	}
+		for (unsigned i = first; i < first + count; i++)
+		{
+			const uint8_t blob[4] = { uint8_t(i + 1), uint8_t(i + 1), uint8_t(i + 1), uint8_t(i + 1) };
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blob, sizeof(blob),
+			                     (i & 1) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_NO_FLAGS))
+				return false;
+		}
+		return true;
+	};
 
-	if (!file_exists(".__test_concurrent.1.foz"))
-		return false;
-	if (!file_exists(".__test_concurrent.2.foz"))
+	// Fresh archive gets an index on close.
+	if (!write(DatabaseMode::OverWrite, 0, 8))
 		return false;
-	if (!file_exists(".__test_concurrent.3.foz"))
+	if (!verify(DatabaseMode::ReadOnly, 8) || !verify(DatabaseMode::ReadOnlyMemoryMap, 8))
 		return false;
 
-	auto db = std::unique_ptr<DatabaseInterface>(
-			create_concurrent_database_with_encoded_extra_paths(nullptr, DatabaseMode::ReadOnly, extra_paths));
+	// Appending leaves a stale index in the middle of the archive, which must be skipped.
+	if (!write(DatabaseMode::Append, 8, 8))
+		return false;
+	if (!verify(DatabaseMode::ReadOnly, 16) || !verify(DatabaseMode::ReadOnlyMemoryMap, 16))
+		return false;
 
-	auto append_db = std::unique_ptr<DatabaseInterface>(
-			create_concurrent_database_with_encoded_extra_paths(".__test_concurrent",
-			                                                    DatabaseMode::Append, extra_paths));
-	if (!db->prepare())
+	// Trailing garbage invalidates the index, we must fall back to scanning.
+	FILE *file = fopen(".__test_index.foz", "ab");
+	if (!file)
 		return false;
-	if (!append_db->prepare())
+	fputs("garbage", file);
+	fclose(file);
+	if (!verify(DatabaseMode::ReadOnly, 16) || !verify(DatabaseMode::ReadOnlyMemoryMap, 16))
 		return false;
 
-	size_t num_samplers;
-	if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &num_samplers, nullptr))
+	// Appending to a sliced archive drops the garbage and writes a fresh index.
+	if (!write(DatabaseMode::Append, 16, 1))
 		return false;
-	if (num_samplers != 4)
+	if (!verify(DatabaseMode::ReadOnly, 17))
 		return false;
 
-	for (Hash i = 1; i <= 4; i++)
+	// Payloads which are larger than the write staging buffer, mixed with small ones.
 	{
-		size_t blob_size;
-		if (!db->read_entry(RESOURCE_SAMPLER, i, &blob_size, nullptr, 0))
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_index.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
 			return false;
-		if (blob_size != sizeof(blob))
+
+		for (unsigned i = 0; i < 3; i++)
+		{
+			std::vector<uint8_t> blob(i == 1 ? (3 * 1024 * 1024 + 17) : 100, uint8_t(i + 1));
+			if (!db->write_entry(RESOURCE_SAMPLER, i + 1, blob.data(), blob.size(), PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+				return false;
+		}
+	}
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_index.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare())
 			return false;
+
+		for (unsigned i = 0; i < 3; i++)
+		{
+			std::vector<uint8_t> reference(i == 1 ? (3 * 1024 * 1024 + 17) : 100, uint8_t(i + 1));
+			size_t blob_size = 0;
+			if (!db->read_entry(RESOURCE_SAMPLER, i + 1, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			std::vector<uint8_t> blob(blob_size);
+			if (!db->read_entry(RESOURCE_SAMPLER, i + 1, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob != reference)
+				return false;
+		}
 	}
 
-	if (!append_db->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), 0))
-		return false;
+	remove(".__test_index.foz");
+	return true;
+}
 
-	// This should not be written.
-	if (file_exists(".__test_concurrent.4.foz"))
-		return false;
+static bool test_database_compression()
+{
+	remove(".__test_compression.foz");
+
+	// Formats which are not compiled in fall back to deflate, so this must round-trip in any build.
+	static const PayloadWriteFlags flag_variants[] = {
+		PAYLOAD_WRITE_COMPRESS_BIT,
+		PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_BEST_COMPRESSION_BIT,
+		PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_ZSTD_BIT,
+		PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_ZSTD_BIT | PAYLOAD_WRITE_BEST_COMPRESSION_BIT,
+		PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_LZ4_BIT,
+		PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_LZ4_BIT | PAYLOAD_WRITE_BEST_COMPRESSION_BIT,
+	};
+	const unsigned num_variants = sizeof(flag_variants) / sizeof(flag_variants[0]);
 
-	if (!append_db->write_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 4, blob, sizeof(blob), 0))
-		return false;
+	const auto make_blob = [](unsigned index) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(4096 + index * 100);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i * 7 + index) % 13);
+		return blob;
+	};
 
-	// .. but now it should exist.
-	if (!file_exists(".__test_concurrent.4.foz"))
-		return false;
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_compression.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+
+		for (unsigned i = 0; i < num_variants; i++)
+		{
+			auto blob = make_blob(i);
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blob.data(), blob.size(),
+			                     flag_variants[i] | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+				return false;
+		}
+	}
+
+	for (auto mode : { DatabaseMode::ReadOnly, DatabaseMode::ReadOnlyMemoryMap })
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_compression.foz", mode));
+		if (!db->prepare())
+			return false;
+
+		for (unsigned i = 0; i < num_variants; i++)
+		{
+			auto reference = make_blob(i);
+			size_t blob_size = 0;
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob_size != reference.size())
+				return false;
+			std::vector<uint8_t> blob(blob_size);
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob != reference)
+				return false;
+		}
+
+		// Hammer the archive from multiple threads.
+		std::atomic<bool> success(true);
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < 4; t++)
+		{
+			threads.emplace_back([&]() {
+				for (unsigned iter = 0; iter < 64; iter++)
+				{
+					unsigned i = iter % num_variants;
+					auto reference = make_blob(i);
+					size_t blob_size = reference.size();
+					std::vector<uint8_t> blob(blob_size);
+					if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT) ||
+					    blob != reference)
+					{
+						success = false;
+					}
+				}
+			});
+		}
 
+		for (auto &thread : threads)
+			thread.join();
+		if (!success)
+			return false;
+	}
+
+	remove(".__test_compression.foz");
 	return true;
 }
 
-static bool test_concurrent_database()
+static bool test_database_read_entries()
 {
-	// Test a normal flow. First time we don't have the read-only database.
-	// Next time we have one.
-	for (unsigned iter = 0; iter < 2; iter++)
-	{
-		if (iter == 0)
-			remove(".__test_concurrent.foz");
-		remove(".__test_concurrent.1.foz");
-		remove(".__test_concurrent.2.foz");
-		remove(".__test_concurrent.3.foz");
+	remove(".__test_batch.foz");
 
-		static const uint8_t blob[] = {1, 2, 3};
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(hash == 20 ? (20 * 1024 * 1024) : (50 + hash * 10));
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i * 5 + hash) % 7);
+		return blob;
+	};
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_batch.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
 
+		for (Hash hash = 1; hash <= 40; hash++)
 		{
-			{
-				auto db0 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
-				                                                                         DatabaseMode::Append, nullptr, 0));
-				if (!db0->prepare())
-					return false;
+			auto blob = make_blob(hash);
+			PayloadWriteFlags flags = (hash % 3) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (!db->write_entry(hash & 1 ? RESOURCE_SAMPLER : RESOURCE_SHADER_MODULE, hash,
+			                     blob.data(), blob.size(), flags))
+				return false;
+		}
+	}
 
-				if (!db0->write_entry(RESOURCE_SAMPLER, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-					return false;
-				if (!db0->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-					return false;
-			}
+	const auto verify = [&](DatabaseInterface &db, PayloadReadFlags flags) -> bool {
+		// Prefetching is only a hint, and unknown hashes are ignored.
+		static const Hash prefetch_hashes[] = { 39, 1, 3, 1000 };
+		db.prefetch_entries(RESOURCE_SAMPLER, prefetch_hashes, 4);
 
-			{
-				auto db1 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
-				                                                                         DatabaseMode::Append, nullptr, 0));
-				if (!db1->prepare())
-					return false;
+		// Read in reverse, with a gap, to make sure the order on disk does not matter.
+		std::vector<DatabaseEntryRead> reads;
+		for (Hash hash = 40; hash >= 1; hash--)
+			if (hash != 13)
+				reads.push_back({ hash & 1 ? RESOURCE_SAMPLER : RESOURCE_SHADER_MODULE, hash, 0, nullptr });
 
-				if (!db1->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-					return false;
-				if (!db1->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
-					return false;
-			}
+		if (!db.read_entries(reads.data(), reads.size(), flags))
+			return false;
+
+		std::vector<std::vector<uint8_t>> blobs(reads.size());
+		for (size_t i = 0; i < reads.size(); i++)
+		{
+			blobs[i].resize(reads[i].size);
+			reads[i].buffer = blobs[i].data();
+		}
+
+		if (!db.read_entries(reads.data(), reads.size(), flags))
+			return false;
 
+		for (size_t i = 0; i < reads.size(); i++)
+		{
+			if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
 			{
-				auto db2 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
-				                                                                         DatabaseMode::Append, nullptr, 0));
-				if (!db2->prepare())
+				size_t raw_size = 0;
+				if (!db.read_entry(reads[i].tag, reads[i].hash, &raw_size, nullptr, flags))
 					return false;
-
-				if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+				std::vector<uint8_t> raw(raw_size);
+				if (!db.read_entry(reads[i].tag, reads[i].hash, &raw_size, raw.data(), flags))
 					return false;
-				if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+				if (raw != blobs[i])
 					return false;
 			}
+			else if (blobs[i] != make_blob(reads[i].hash))
+				return false;
 		}
 
-		bool expected_exist = iter == 0;
+		// Unknown entries fail the batch.
+		DatabaseEntryRead missing = { RESOURCE_SAMPLER, 1000, 0, nullptr };
+		return !db.read_entries(&missing, 1, flags);
+	};
 
-		if (expected_exist != file_exists(".__test_concurrent.1.foz"))
+	for (auto mode : { DatabaseMode::ReadOnly, DatabaseMode::ReadOnlyMemoryMap })
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_batch.foz", mode));
+		if (!db->prepare())
 			return false;
-		if (expected_exist != file_exists(".__test_concurrent.2.foz"))
+		if (!verify(*db, PAYLOAD_READ_NO_FLAGS) || !verify(*db, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
 			return false;
-		if (expected_exist != file_exists(".__test_concurrent.3.foz"))
+	}
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_batch", DatabaseMode::ReadOnly, nullptr, 0));
+		if (!db->prepare())
+			return false;
+		if (!verify(*db, PAYLOAD_READ_NO_FLAGS))
 			return false;
+	}
 
-		static const char *append_paths[] = {
-			".__test_concurrent.1.foz",
-			".__test_concurrent.2.foz",
-			".__test_concurrent.3.foz",
-		};
+	remove(".__test_batch.foz");
+	return true;
+}
 
-		if (iter == 0)
+static bool test_database_map_entry()
+{
+	remove(".__test_map.foz");
+	remove(".__test_map.zip");
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(30 + hash * 13);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i * 3 + hash) % 11);
+		return blob;
+	};
+
+	// Odd hashes are compressed, and can never be borrowed.
+	const auto write = [&](DatabaseInterface &db) -> bool {
+		if (!db.prepare())
+			return false;
+		for (Hash hash = 1; hash <= 16; hash++)
 		{
-			if (!merge_concurrent_databases(".__test_concurrent.foz", append_paths, 3))
+			auto blob = make_blob(hash);
+			PayloadWriteFlags flags = (hash & 1) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (!db.write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size(), flags))
+				return false;
+		}
+		return true;
+	};
+
+	const auto verify = [&](DatabaseInterface &db, bool mapped) -> bool {
+		EntryPayload payload;
+		for (Hash hash = 1; hash <= 16; hash++)
+		{
+			auto reference = make_blob(hash);
+			bool borrowable = mapped && (hash & 1) == 0;
+
+			const void *data = nullptr;
+			size_t size = 0;
+			if (db.map_entry(RESOURCE_SHADER_MODULE, hash, &data, &size, PAYLOAD_READ_NO_FLAGS) != borrowable)
+				return false;
+			if (borrowable)
+			{
+				if (size != reference.size() || memcmp(data, reference.data(), size) != 0)
+					return false;
+				db.release_entry(data);
+			}
+
+			// EntryPayload falls back to read_entry() for everything which cannot be borrowed.
+			if (!payload.read(db, RESOURCE_SHADER_MODULE, hash, PAYLOAD_READ_NO_FLAGS) ||
+			    payload.is_borrowed() != borrowable ||
+			    payload.size() != reference.size() || memcmp(payload.data(), reference.data(), payload.size()) != 0)
 				return false;
 		}
+
+		const void *data = nullptr;
+		size_t size = 0;
+		if (db.map_entry(RESOURCE_SHADER_MODULE, 1000, &data, &size, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		if (db.map_entry(RESOURCE_SHADER_MODULE, 2, &data, &size, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		return !payload.read(db, RESOURCE_SHADER_MODULE, 1000, PAYLOAD_READ_NO_FLAGS);
+	};
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_map.foz", DatabaseMode::OverWrite));
+		if (!write(*db))
+			return false;
 	}
 
-	return true;
-}
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_zip_archive_database(".__test_map.zip", DatabaseMode::OverWrite));
+		if (!write(*db))
+			return false;
+	}
 
-int main()
-{
-	if (!test_concurrent_database_extra_paths())
-		return EXIT_FAILURE;
-	if (!test_concurrent_database())
-		return EXIT_FAILURE;
-	if (!test_database())
+	for (auto mode : { DatabaseMode::ReadOnly, DatabaseMode::ReadOnlyMemoryMap })
+	{
+		bool mapped = mode == DatabaseMode::ReadOnlyMemoryMap;
+
+		auto stream_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_map.foz", mode));
+		if (!stream_db->prepare() || !verify(*stream_db, mapped))
+			return false;
+
+		auto zip_db = std::unique_ptr<DatabaseInterface>(create_zip_archive_database(".__test_map.zip", mode));
+		if (!zip_db->prepare() || !verify(*zip_db, mapped))
+			return false;
+
+		auto concurrent_db = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_map", mode, nullptr, 0));
+		if (!concurrent_db->prepare() || !verify(*concurrent_db, mapped))
+			return false;
+	}
+
+	// Append mode cannot read entries.
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_map.foz", DatabaseMode::Append));
+		const void *data = nullptr;
+		size_t size = 0;
+		if (!db->prepare() || db->map_entry(RESOURCE_SHADER_MODULE, 2, &data, &size, PAYLOAD_READ_NO_FLAGS))
+			return false;
+	}
+
+	remove(".__test_map.foz");
+	remove(".__test_map.zip");
+	return true;
+}
+
+static bool test_database_for_each_entry()
+{
+	remove(".__test_for_each.foz");
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(100 + hash * 3);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i * 11 + hash) % 5);
+		return blob;
+	};
+
+	// Write out of hash order, so we can tell file order from hash order.
+	static const Hash hashes[] = { 5, 3, 9, 1, 7 };
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_for_each.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+
+		for (auto hash : hashes)
+		{
+			auto blob = make_blob(hash);
+			PayloadWriteFlags flags = (hash & 2) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (!db->write_entry(hash > 4 ? RESOURCE_SAMPLER : RESOURCE_RENDER_PASS, hash, blob.data(), blob.size(), flags))
+				return false;
+		}
+	}
+
+	struct Visitor : DatabaseEntryVisitor
+	{
+		bool visit_entry(ResourceTag tag, Hash hash, const void *blob, size_t size) override
+		{
+			if (tag != (hash > 4 ? RESOURCE_SAMPLER : RESOURCE_RENDER_PASS))
+				return false;
+			visited.push_back(hash);
+			auto *data = static_cast<const uint8_t *>(blob);
+			blobs.emplace_back(data, data + size);
+			return visited.size() != stop_after;
+		}
+
+		std::vector<Hash> visited;
+		std::vector<std::vector<uint8_t>> blobs;
+		size_t stop_after = 0;
+	};
+
+	for (unsigned iter = 0; iter < 3; iter++)
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_for_each.foz",
+		                                                                        iter == 2 ? DatabaseMode::ReadOnlyMemoryMap : DatabaseMode::ReadOnly));
+		// The first iteration streams the archive without preparing it.
+		if (iter != 0 && !db->prepare())
+			return false;
+
+		Visitor visitor;
+		if (!db->for_each_entry(visitor, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		if (visitor.visited != std::vector<Hash>(std::begin(hashes), std::end(hashes)))
+			return false;
+		for (size_t i = 0; i < visitor.visited.size(); i++)
+			if (visitor.blobs[i] != make_blob(visitor.visited[i]))
+				return false;
+
+		Visitor raw_visitor;
+		if (!db->for_each_entry(raw_visitor, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		if (raw_visitor.visited != visitor.visited)
+			return false;
+
+		// Stopping early fails the iteration.
+		Visitor stop_visitor;
+		stop_visitor.stop_after = 2;
+		if (db->for_each_entry(stop_visitor, PAYLOAD_READ_NO_FLAGS) || stop_visitor.visited.size() != 2)
+			return false;
+
+		if (iter != 0)
+		{
+			for (size_t i = 0; i < raw_visitor.visited.size(); i++)
+			{
+				Hash hash = raw_visitor.visited[i];
+				ResourceTag tag = hash > 4 ? RESOURCE_SAMPLER : RESOURCE_RENDER_PASS;
+				size_t raw_size = 0;
+				if (!db->read_entry(tag, hash, &raw_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+					return false;
+				std::vector<uint8_t> raw(raw_size);
+				if (!db->read_entry(tag, hash, &raw_size, raw.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+					return false;
+				if (raw != raw_visitor.blobs[i])
+					return false;
+			}
+		}
+	}
+
+	remove(".__test_for_each.foz");
+	return true;
+}
+
+static bool test_database_checksum()
+{
+	remove(".__test_checksum.foz");
+
+	std::vector<uint8_t> blob(4096);
+	for (size_t i = 0; i < blob.size(); i++)
+		blob[i] = uint8_t(i * 7 + (i >> 8));
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_checksum.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+		if (!db->write_entry(RESOURCE_SAMPLER, 1, blob.data(), blob.size(), PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+			return false;
+	}
+
+	// Flip a bit in the middle of the stored payload.
+	{
+		FILE *file = fopen(".__test_checksum.foz", "rb+");
+		if (!file)
+			return false;
+		std::vector<uint8_t> contents;
+		int c;
+		while ((c = fgetc(file)) != EOF)
+			contents.push_back(uint8_t(c));
+
+		auto itr = std::search(contents.begin(), contents.end(), blob.begin(), blob.end());
+		if (itr == contents.end())
+		{
+			fclose(file);
+			return false;
+		}
+
+		long offset = long(itr - contents.begin()) + long(blob.size() / 2);
+		if (fseek(file, offset, SEEK_SET) != 0 || fputc(contents[offset] ^ 1, file) == EOF)
+		{
+			fclose(file);
+			return false;
+		}
+		fclose(file);
+	}
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_checksum.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		size_t size = 0;
+		if (!db->read_entry(RESOURCE_SAMPLER, 1, &size, nullptr, PAYLOAD_READ_NO_FLAGS) || size != blob.size())
+			return false;
+
+		std::vector<uint8_t> read_blob(size);
+		if (db->read_entry(RESOURCE_SAMPLER, 1, &size, read_blob.data(), PAYLOAD_READ_NO_FLAGS))
+			return false;
+
+		// Deferred verification reads the payload as-is.
+		if (!db->read_entry(RESOURCE_SAMPLER, 1, &size, read_blob.data(), PAYLOAD_READ_SKIP_CHECKSUM_BIT))
+			return false;
+		if (read_blob == blob || read_blob[blob.size() / 2] != (blob[blob.size() / 2] ^ 1))
+			return false;
+	}
+
+	remove(".__test_checksum.foz");
+	return true;
+}
+
+static bool test_folder_database()
+{
+	static const char folder[] = ".__test_folder";
+	static const Hash hash1 = 0x0102000000000001ull;
+	static const Hash hash2 = 0x0102000000000002ull;
+	static const Hash hash3 = 0xa0b0000000000003ull;
+	static const char *const files[] = {
+		".__test_folder/01/02/01.0102000000000001.json",
+		".__test_folder/01/02/04.0102000000000002.json",
+		".__test_folder/a0/b0/05.a0b0000000000003.json",
+		".__test_folder/05.0000000000000004.json",
+		".__test_folder/fossilize_manifest.txt",
+		".__test_folder/01/02",
+		".__test_folder/01",
+		".__test_folder/a0/b0",
+		".__test_folder/a0",
+		".__test_folder",
+	};
+
+	const auto cleanup = [&]() {
+		for (auto *file : files)
+			remove(file);
+	};
+	cleanup();
+
+	static const uint8_t entry1[] = { 1, 2, 3 };
+	static const uint8_t entry2[] = { 4, 5, 6, 7 };
+	static const uint8_t entry3[] = { 8, 9 };
+	static const uint8_t entry4[] = { 10 };
+
+	const auto check_entry = [](DatabaseInterface &db, ResourceTag tag, Hash hash,
+	                            const uint8_t *data, size_t size) -> bool {
+		size_t blob_size = 0;
+		if (!db.read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS) || blob_size != size)
+			return false;
+		std::vector<uint8_t> blob(blob_size);
+		if (!db.read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+			return false;
+		return memcmp(blob.data(), data, size) == 0;
+	};
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_dumb_folder_database(folder, DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+		if (!db->write_entry(RESOURCE_SAMPLER, hash1, entry1, sizeof(entry1), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, hash2, entry2, sizeof(entry2), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_dumb_folder_database(folder, DatabaseMode::Append));
+		if (!db->prepare())
+			return false;
+		if (!db->has_entry(RESOURCE_SAMPLER, hash1) || !db->has_entry(RESOURCE_SHADER_MODULE, hash2))
+			return false;
+		if (!db->write_entry(RESOURCE_RENDER_PASS, hash3, entry3, sizeof(entry3), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	// Blobs in the old flat layout written behind our back are only picked up by a rescan.
+	{
+		FILE *file = fopen(files[3], "wb");
+		if (!file)
+			return false;
+		if (fwrite(entry4, 1, sizeof(entry4), file) != sizeof(entry4))
+		{
+			fclose(file);
+			return false;
+		}
+		fclose(file);
+	}
+
+	for (unsigned iter = 0; iter < 2; iter++)
+	{
+		if (iter == 1)
+			remove(files[4]);
+
+		auto db = std::unique_ptr<DatabaseInterface>(create_dumb_folder_database(folder, DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		if (!check_entry(*db, RESOURCE_SAMPLER, hash1, entry1, sizeof(entry1)))
+			return false;
+		if (!check_entry(*db, RESOURCE_SHADER_MODULE, hash2, entry2, sizeof(entry2)))
+			return false;
+		if (!check_entry(*db, RESOURCE_RENDER_PASS, hash3, entry3, sizeof(entry3)))
+			return false;
+
+		bool has_flat = db->has_entry(RESOURCE_RENDER_PASS, 4);
+		if (has_flat != (iter == 1))
+			return false;
+		if (has_flat && !check_entry(*db, RESOURCE_RENDER_PASS, 4, entry4, sizeof(entry4)))
+			return false;
+	}
+
+	cleanup();
+	return true;
+}
+
+static bool test_zip_database()
+{
+	remove(".__test_archive.zip");
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(100 + hash * 17);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i / 7) ^ hash);
+		return blob;
+	};
+
+	static const unsigned num_blobs = 64;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_zip_archive_database(".__test_archive.zip", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+
+		// Mix stored and deflated entries.
+		for (Hash i = 1; i <= num_blobs; i++)
+		{
+			auto blob = make_blob(i);
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i, blob.data(), blob.size(),
+			                     (i & 1) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_NO_FLAGS))
+				return false;
+		}
+	}
+
+	for (auto mode : { DatabaseMode::ReadOnly, DatabaseMode::ReadOnlyMemoryMap })
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_zip_archive_database(".__test_archive.zip", mode));
+		if (!db->prepare())
+			return false;
+
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr) || hash_count != num_blobs)
+			return false;
+
+		// Several threads decode from the same archive at the same time.
+		std::atomic<bool> success(true);
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < 4; t++)
+		{
+			threads.emplace_back([&, t]() {
+				for (unsigned iter = 0; iter < 4 * num_blobs; iter++)
+				{
+					Hash hash = 1 + (iter + t * 13) % num_blobs;
+					auto reference = make_blob(hash);
+					size_t blob_size = 0;
+					if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT) ||
+					    blob_size != reference.size())
+					{
+						success = false;
+						continue;
+					}
+
+					std::vector<uint8_t> blob(blob_size);
+					if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT) ||
+					    blob != reference)
+					{
+						success = false;
+					}
+				}
+			});
+		}
+
+		for (auto &thread : threads)
+			thread.join();
+		if (!success)
+			return false;
+	}
+
+	remove(".__test_archive.zip");
+	return true;
+}
+
+static bool test_database_group_commit()
+{
+	remove(".__test_group_commit.foz");
+	remove(".__test_group_commit_crash.foz");
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(50 + hash * 5);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t(i ^ hash);
+		return blob;
+	};
+
+	// Copies the archive as it is on disk right now, as if the writer crashed at this point.
+	// A few garbage bytes are appended to emulate a sliced write.
+	const auto crash_copy = [](const char *src, const char *dst) -> bool {
+		FILE *in = fopen(src, "rb");
+		if (!in)
+			return false;
+		std::vector<uint8_t> contents;
+		int c;
+		while ((c = fgetc(in)) != EOF)
+			contents.push_back(uint8_t(c));
+		fclose(in);
+
+		static const uint8_t garbage[] = { 1, 2, 3, 4, 5 };
+		contents.insert(contents.end(), std::begin(garbage), std::end(garbage));
+
+		FILE *out = fopen(dst, "wb");
+		if (!out)
+			return false;
+		bool ret = fwrite(contents.data(), 1, contents.size(), out) == contents.size();
+		fclose(out);
+		return ret;
+	};
+
+	const auto check_entries = [&](const char *path, Hash begin_hash, Hash end_hash) -> bool {
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &hash_count, nullptr))
+			return false;
+		if (hash_count != end_hash - begin_hash)
+			return false;
+
+		for (Hash hash = begin_hash; hash < end_hash; hash++)
+		{
+			size_t size = 0;
+			if (!db->read_entry(RESOURCE_SAMPLER, hash, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			std::vector<uint8_t> blob(size);
+			if (!db->read_entry(RESOURCE_SAMPLER, hash, &size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob != make_blob(hash))
+				return false;
+		}
+		return true;
+	};
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_group_commit.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+		if (!db->set_group_commit(4, 0))
+			return false;
+
+		for (Hash hash = 1; hash <= 10; hash++)
+		{
+			auto blob = make_blob(hash);
+			PayloadWriteFlags flags = (hash & 1) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (!db->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(), flags))
+				return false;
+		}
+
+		// Entries 9 and 10 make it to the file, but are not committed.
+		db->flush();
+		if (!crash_copy(".__test_group_commit.foz", ".__test_group_commit_crash.foz"))
+			return false;
+	}
+
+	if (!check_entries(".__test_group_commit.foz", 1, 11))
+		return false;
+	if (!check_entries(".__test_group_commit_crash.foz", 1, 9))
+		return false;
+
+	// Appending to a recovered archive continues from the last commit, and the dropped tail is gone for good.
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_group_commit_crash.foz", DatabaseMode::Append));
+		if (!db->prepare())
+			return false;
+		if (db->has_entry(RESOURCE_SAMPLER, 9))
+			return false;
+
+		for (Hash hash = 9; hash <= 12; hash++)
+		{
+			auto blob = make_blob(hash);
+			if (!db->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(), PAYLOAD_WRITE_NO_FLAGS))
+				return false;
+		}
+	}
+
+	if (!check_entries(".__test_group_commit_crash.foz", 1, 13))
+		return false;
+
+	// Commits chain back to the index of the archive we append to.
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_group_commit.foz", DatabaseMode::Append));
+		if (!db->prepare() || !db->set_group_commit(1, 0))
+			return false;
+		for (Hash hash = 11; hash <= 12; hash++)
+		{
+			auto blob = make_blob(hash);
+			if (!db->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(), PAYLOAD_WRITE_NO_FLAGS))
+				return false;
+		}
+		if (!crash_copy(".__test_group_commit.foz", ".__test_group_commit_crash.foz"))
+			return false;
+	}
+
+	if (!check_entries(".__test_group_commit_crash.foz", 1, 13))
+		return false;
+	if (!check_entries(".__test_group_commit.foz", 1, 13))
+		return false;
+
+	remove(".__test_group_commit.foz");
+	remove(".__test_group_commit_crash.foz");
+	return true;
+}
+
+static bool test_database_compression_threads()
+{
+	remove(".__test_compression_threads_0.foz");
+	remove(".__test_compression_threads_2.foz");
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(100 + hash * 37);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i / 7) ^ hash);
+		return blob;
+	};
+
+	const auto read_file = [](const char *path) -> std::vector<uint8_t> {
+		std::vector<uint8_t> contents;
+		FILE *file = fopen(path, "rb");
+		if (!file)
+			return contents;
+		int c;
+		while ((c = fgetc(file)) != EOF)
+			contents.push_back(uint8_t(c));
+		fclose(file);
+		return contents;
+	};
+
+	const PayloadWriteFlags flags = PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+
+	for (unsigned threads : { 0u, 2u })
+	{
+		std::string path = ".__test_compression_threads_" + std::to_string(threads) + ".foz";
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path.c_str(), DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+		if (threads && !db->set_compression_threads(threads))
+			return false;
+
+		for (Hash hash = 1; hash <= 64; hash++)
+		{
+			auto blob = make_blob(hash);
+			if (!db->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(), flags))
+				return false;
+			// Entries which are still being compressed are deduplicated as well.
+			if (!db->has_entry(RESOURCE_SAMPLER, hash))
+				return false;
+			if (!db->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(), flags))
+				return false;
+		}
+
+		if (threads)
+		{
+			db->flush();
+			size_t hash_count = 0;
+			if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &hash_count, nullptr) || hash_count != 64)
+				return false;
+		}
+
+		for (Hash hash = 65; hash <= 96; hash++)
+		{
+			auto blob = make_blob(hash);
+			if (!db->write_entry(RESOURCE_SAMPLER, hash, blob.data(), blob.size(), flags))
+				return false;
+		}
+	}
+
+	// Entries are appended in the order they were written, so the archives are identical.
+	auto sync_contents = read_file(".__test_compression_threads_0.foz");
+	if (sync_contents.empty() || sync_contents != read_file(".__test_compression_threads_2.foz"))
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_compression_threads_2.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		for (Hash hash = 1; hash <= 96; hash++)
+		{
+			size_t size = 0;
+			if (!db->read_entry(RESOURCE_SAMPLER, hash, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			std::vector<uint8_t> blob(size);
+			if (!db->read_entry(RESOURCE_SAMPLER, hash, &size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob != make_blob(hash))
+				return false;
+		}
+	}
+
+	remove(".__test_compression_threads_0.foz");
+	remove(".__test_compression_threads_2.foz");
+	return true;
+}
+
+static bool test_database_compression_dictionary()
+{
+	remove(".__test_dictionary.foz");
+	remove(".__test_dictionary_copy.foz");
+
+	// Lots of similar looking modules.
+	const unsigned num_samples = 1000;
+	const auto make_blob = [](unsigned index) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(1024);
+		uint32_t state = index * 1664525u + 1013904223u;
+		for (size_t i = 0; i < blob.size(); i++)
+		{
+			if ((i & 63) < 48)
+				blob[i] = uint8_t(i * 31);
+			else
+			{
+				state = state * 1664525u + 1013904223u;
+				blob[i] = uint8_t(state >> 24);
+			}
+		}
+		return blob;
+	};
+
+	std::vector<uint8_t> samples;
+	std::vector<size_t> sample_sizes;
+	for (unsigned i = 0; i < num_samples; i++)
+	{
+		auto blob = make_blob(i);
+		samples.insert(samples.end(), blob.begin(), blob.end());
+		sample_sizes.push_back(blob.size());
+	}
+
+	std::vector<uint8_t> dictionary(4096);
+	size_t dictionary_size = dictionary.size();
+	if (!train_compression_dictionary(samples.data(), sample_sizes.data(), num_samples,
+	                                  dictionary.data(), &dictionary_size))
+	{
+		// Not supported in this build.
+		return true;
+	}
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_dictionary.foz", DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+		if (!db->set_compression_dictionary(RESOURCE_SHADER_MODULE, dictionary.data(), dictionary_size))
+			return false;
+
+		for (unsigned i = 0; i < num_samples; i++)
+		{
+			auto blob = make_blob(i);
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blob.data(), blob.size(),
+			                     PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPRESS_ZSTD_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+				return false;
+		}
+	}
+
+	// Raw copies must not depend on the dictionary.
+	{
+		auto db_source = std::unique_ptr<DatabaseInterface>(
+				create_stream_archive_database(".__test_dictionary.foz", DatabaseMode::ReadOnly));
+		auto db_target = std::unique_ptr<DatabaseInterface>(
+				create_stream_archive_database(".__test_dictionary_copy.foz", DatabaseMode::OverWrite));
+		if (!db_source->prepare() || !db_target->prepare())
+			return false;
+
+		for (unsigned i = 0; i < num_samples; i++)
+		{
+			size_t blob_size = 0;
+			if (!db_source->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+				return false;
+			std::vector<uint8_t> blob(blob_size);
+			if (!db_source->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+				return false;
+			if (!db_target->write_entry(RESOURCE_SHADER_MODULE, i + 1, blob.data(), blob.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+				return false;
+		}
+	}
+
+	for (auto *path : { ".__test_dictionary.foz", ".__test_dictionary_copy.foz" })
+	{
+		for (auto mode : { DatabaseMode::ReadOnly, DatabaseMode::ReadOnlyMemoryMap })
+		{
+			auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, mode));
+			if (!db->prepare())
+				return false;
+
+			for (unsigned i = 0; i < num_samples; i++)
+			{
+				auto reference = make_blob(i);
+				size_t blob_size = 0;
+				if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+					return false;
+				std::vector<uint8_t> blob(blob_size);
+				if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT))
+					return false;
+				if (blob != reference)
+					return false;
+			}
+		}
+	}
+
+	// Streaming picks up the dictionary on the way.
+	{
+		struct Visitor : DatabaseEntryVisitor
+		{
+			bool visit_entry(ResourceTag, Hash hash, const void *blob, size_t size) override
+			{
+				auto reference = make_blob(unsigned(hash - 1));
+				count++;
+				return size == reference.size() && memcmp(blob, reference.data(), size) == 0;
+			}
+
+			std::vector<uint8_t> (*make_blob)(unsigned) = nullptr;
+			unsigned count = 0;
+		};
+
+		Visitor visitor;
+		visitor.make_blob = make_blob;
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_dictionary.foz", DatabaseMode::ReadOnly));
+		if (!db->for_each_entry(visitor, PAYLOAD_READ_NO_FLAGS) || visitor.count != num_samples)
+			return false;
+	}
+
+	remove(".__test_dictionary.foz");
+	remove(".__test_dictionary_copy.foz");
+	return true;
+}
+
+static bool file_exists(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file)
+	{
+		fclose(file);
+		return true;
+	}
+	else
+		return false;
+}
+
+static bool test_concurrent_database_extra_paths()
+{
+	// Test a normal flow. First time we don't have the read-only database.
+	// Next time we have one.
+	remove(".__test_concurrent.foz");
+	remove(".__test_concurrent.1.foz");
+	remove(".__test_concurrent.2.foz");
+	remove(".__test_concurrent.3.foz");
+	remove(".__test_concurrent.4.foz");
+
+	static const char *extra_paths = ".__test_concurrent.1.foz;.__test_concurrent.2.foz;.__test_concurrent.3.foz";
+	static const uint8_t blob[] = {1, 2, 3};
+
+	{
+		auto db0 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
+		                                                                         DatabaseMode::Append, nullptr, 0));
+		if (!db0->prepare())
+			return false;
+
+		if (!db0->write_entry(RESOURCE_SAMPLER, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!db0->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+
+		auto db1 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
+		                                                                         DatabaseMode::Append, nullptr, 0));
+		if (!db1->prepare())
+			return false;
+
+		if (!db1->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!db1->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+
+		auto db2 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
+		                                                                         DatabaseMode::Append, nullptr, 0));
+		if (!db2->prepare())
+			return false;
+
+		if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	if (!file_exists(".__test_concurrent.1.foz"))
+		return false;
+	if (!file_exists(".__test_concurrent.2.foz"))
+		return false;
+	if (!file_exists(".__test_concurrent.3.foz"))
+		return false;
+
+	auto db = std::unique_ptr<DatabaseInterface>(
+			create_concurrent_database_with_encoded_extra_paths(nullptr, DatabaseMode::ReadOnly, extra_paths));
+
+	auto append_db = std::unique_ptr<DatabaseInterface>(
+			create_concurrent_database_with_encoded_extra_paths(".__test_concurrent",
+			                                                    DatabaseMode::Append, extra_paths));
+	if (!db->prepare())
+		return false;
+	if (!append_db->prepare())
+		return false;
+
+	size_t num_samplers;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &num_samplers, nullptr))
+		return false;
+	if (num_samplers != 4)
+		return false;
+
+	for (Hash i = 1; i <= 4; i++)
+	{
+		size_t blob_size;
+		if (!db->read_entry(RESOURCE_SAMPLER, i, &blob_size, nullptr, 0))
+			return false;
+		if (blob_size != sizeof(blob))
+			return false;
+	}
+
+	if (!append_db->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), 0))
+		return false;
+
+	// This should not be written.
+	if (file_exists(".__test_concurrent.4.foz"))
+		return false;
+
+	if (!append_db->write_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 4, blob, sizeof(blob), 0))
+		return false;
+
+	// .. but now it should exist.
+	if (!file_exists(".__test_concurrent.4.foz"))
+		return false;
+
+	return true;
+}
+
+static bool test_concurrent_database()
+{
+	// Test a normal flow. First time we don't have the read-only database.
+	// Next time we have one.
+	for (unsigned iter = 0; iter < 2; iter++)
+	{
+		if (iter == 0)
+			remove(".__test_concurrent.foz");
+		remove(".__test_concurrent.1.foz");
+		remove(".__test_concurrent.2.foz");
+		remove(".__test_concurrent.3.foz");
+
+		static const uint8_t blob[] = {1, 2, 3};
+
+		{
+			{
+				auto db0 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
+				                                                                         DatabaseMode::Append, nullptr, 0));
+				if (!db0->prepare())
+					return false;
+
+				if (!db0->write_entry(RESOURCE_SAMPLER, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					return false;
+				if (!db0->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					return false;
+			}
+
+			{
+				auto db1 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
+				                                                                         DatabaseMode::Append, nullptr, 0));
+				if (!db1->prepare())
+					return false;
+
+				if (!db1->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					return false;
+				if (!db1->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					return false;
+			}
+
+			{
+				auto db2 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_concurrent",
+				                                                                         DatabaseMode::Append, nullptr, 0));
+				if (!db2->prepare())
+					return false;
+
+				if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					return false;
+				if (!db2->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					return false;
+			}
+		}
+
+		bool expected_exist = iter == 0;
+
+		if (expected_exist != file_exists(".__test_concurrent.1.foz"))
+			return false;
+		if (expected_exist != file_exists(".__test_concurrent.2.foz"))
+			return false;
+		if (expected_exist != file_exists(".__test_concurrent.3.foz"))
+			return false;
+
+		static const char *append_paths[] = {
+			".__test_concurrent.1.foz",
+			".__test_concurrent.2.foz",
+			".__test_concurrent.3.foz",
+		};
+
+		if (iter == 0)
+		{
+			if (!merge_concurrent_databases(".__test_concurrent.foz", append_paths, 3))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool test_concurrent_database_write_shards()
+{
+	static const char *shard_paths[] = {
+		".__test_shards.1.foz",
+		".__test_shards.2.foz",
+		".__test_shards.3.foz",
+		".__test_shards.4.foz",
+	};
+
+	remove(".__test_shards.foz");
+	for (auto *path : shard_paths)
+		remove(path);
+	remove(".__test_shards.5.foz");
+
+	static const uint8_t blob[] = {1, 2, 3};
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_shards.foz", DatabaseMode::OverWrite));
+		if (!db->prepare() || !db->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_shards", DatabaseMode::Append, nullptr, 0));
+		if (!db->prepare())
+			return false;
+
+		DatabaseInterface *shards[4];
+		for (unsigned i = 0; i < 4; i++)
+			if (!(shards[i] = db->get_write_shard(i)))
+				return false;
+		if (db->get_write_shard(2) != shards[2])
+			return false;
+
+		// Every shard writes the same entries, and one of its own.
+		std::atomic<bool> success(true);
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < 4; i++)
+		{
+			threads.emplace_back([&, i]() {
+				for (Hash hash = 1; hash <= 64; hash++)
+					if (!shards[i]->write_entry(RESOURCE_SAMPLER, hash, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+						success = false;
+				if (!shards[i]->write_entry(RESOURCE_SAMPLER, 1000 + i, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+					success = false;
+				// The primed entry is never written, nor is anything written twice.
+				size_t hash_count = 0;
+				if (!shards[i]->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &hash_count, nullptr) || hash_count != 65)
+					success = false;
+			});
+		}
+		for (auto &thread : threads)
+			thread.join();
+		if (!success)
+			return false;
+	}
+
+	for (auto *path : shard_paths)
+		if (!file_exists(path))
+			return false;
+	if (file_exists(".__test_shards.5.foz"))
+		return false;
+
+	if (!merge_concurrent_databases(".__test_shards.foz", shard_paths, 4))
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_shards.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &hash_count, nullptr) || hash_count != 68)
+			return false;
+		if (db->get_write_shard(0))
+			return false;
+	}
+
+	remove(".__test_shards.foz");
+	for (auto *path : shard_paths)
+		remove(path);
+	return true;
+}
+
+static bool test_database_merge()
+{
+	remove(".__test_merge.foz");
+	remove(".__test_merge.1.foz");
+	remove(".__test_merge.2.foz");
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(hash == 5 ? (2 * 1024 * 1024 + 3) : (100 + hash));
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i * 3 + hash) % 11);
+		return blob;
+	};
+
+	const auto write = [&](const char *path, DatabaseMode mode, std::initializer_list<Hash> hashes) -> bool {
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, mode));
+		if (!db->prepare())
+			return false;
+
+		for (auto hash : hashes)
+		{
+			auto blob = make_blob(hash);
+			PayloadWriteFlags flags = (hash & 1) ? PAYLOAD_WRITE_COMPRESS_BIT : PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size(), flags))
+				return false;
+		}
+		return true;
+	};
+
+	if (!write(".__test_merge.foz", DatabaseMode::OverWrite, { 1 }))
+		return false;
+	if (!write(".__test_merge.1.foz", DatabaseMode::OverWrite, { 1, 2, 3, 4, 5, 6 }))
+		return false;
+	if (!write(".__test_merge.2.foz", DatabaseMode::OverWrite, { 6, 7, 8 }))
+		return false;
+
+	static const char *sources[] = { ".__test_merge.1.foz", ".__test_merge.2.foz" };
+	if (!merge_concurrent_databases(".__test_merge.foz", sources, 2))
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_merge.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr) || hash_count != 8)
+			return false;
+
+		for (Hash hash = 1; hash <= 8; hash++)
+		{
+			auto reference = make_blob(hash);
+			size_t blob_size = 0;
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			std::vector<uint8_t> blob(blob_size);
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob != reference)
+				return false;
+		}
+	}
+
+	remove(".__test_merge.foz");
+	remove(".__test_merge.1.foz");
+	remove(".__test_merge.2.foz");
+	return true;
+}
+
+static bool test_bulk_merge()
+{
+	const char *inputs[] = { ".__test_bulk_in0.foz", ".__test_bulk_in1.foz", ".__test_bulk_in2.foz", ".__test_bulk_missing.foz" };
+	const char *shards[] = { ".__test_bulk.1.foz", ".__test_bulk.2.foz" };
+	for (auto *path : inputs)
+		remove(path);
+	for (auto *path : shards)
+		remove(path);
+
+	const auto make_blob = [](Hash hash) -> std::vector<uint8_t> {
+		std::vector<uint8_t> blob(64 + hash);
+		for (size_t i = 0; i < blob.size(); i++)
+			blob[i] = uint8_t((i * 7 + hash) % 13);
+		return blob;
+	};
+
+	// Each input overlaps with the others, and one input does not exist at all.
+	const std::initializer_list<Hash> contents[] = { { 1, 2, 3, 4 }, { 3, 4, 5, 6 }, { 6, 7, 1 } };
+	for (unsigned i = 0; i < 3; i++)
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(inputs[i], DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+		for (auto hash : contents[i])
+		{
+			auto blob = make_blob(hash);
+			auto tag = (hash & 1) ? RESOURCE_SHADER_MODULE : RESOURCE_SAMPLER;
+			if (!db->write_entry(tag, hash, blob.data(), blob.size(), PAYLOAD_WRITE_COMPRESS_BIT))
+				return false;
+		}
+	}
+
+	if (!bulk_merge_databases(".__test_bulk", 2, inputs, 4))
+		return false;
+
+	// Every entry ends up in exactly one shard.
+	unsigned seen[8] = {};
+	for (auto *path : shards)
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		for (auto tag : { RESOURCE_SHADER_MODULE, RESOURCE_SAMPLER })
+		{
+			size_t hash_count = 0;
+			if (!db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+				return false;
+			std::vector<Hash> hashes(hash_count);
+			if (!db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+				return false;
+
+			for (auto hash : hashes)
+			{
+				size_t blob_size = 0;
+				if (hash >= 8 || !db->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+					return false;
+				std::vector<uint8_t> blob(blob_size);
+				if (!db->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS) || blob != make_blob(hash))
+					return false;
+				seen[hash]++;
+			}
+		}
+	}
+
+	for (Hash hash = 1; hash < 8; hash++)
+		if (seen[hash] != 1)
+			return false;
+
+	if (bulk_merge_databases(".__test_bulk", 0, inputs, 3))
+		return false;
+
+	for (auto *path : inputs)
+		remove(path);
+	for (auto *path : shards)
+		remove(path);
+	return true;
+}
+
+static bool test_concurrent_database_compaction()
+{
+	remove(".__test_compact.foz");
+	remove(".__test_compact.1.foz");
+	remove(".__test_compact.2.foz");
+
+	static const uint8_t blob[] = {1, 2, 3};
+
+	const auto verify = [](std::initializer_list<Hash> hashes) -> bool {
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_compact.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare())
+			return false;
+
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &hash_count, nullptr))
+			return false;
+		if (hash_count != hashes.size())
+			return false;
+
+		for (auto hash : hashes)
+			if (!db->has_entry(RESOURCE_SAMPLER, hash))
+				return false;
+		return true;
+	};
+
+	{
+		auto db0 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_compact",
+		                                                                         DatabaseMode::Append, nullptr, 0));
+		if (!db0->prepare())
+			return false;
+		if (!db0->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!db0->write_entry(RESOURCE_SAMPLER, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	{
+		// A fragment which is still being written to must be left alone.
+		auto db1 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_compact",
+		                                                                         DatabaseMode::Append, nullptr, 0));
+		if (!db1->prepare())
+			return false;
+		if (!db1->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		db1->flush();
+
+		if (!compact_concurrent_database(".__test_compact"))
+			return false;
+		if (file_exists(".__test_compact.1.foz") || !file_exists(".__test_compact.2.foz"))
+			return false;
+		if (!verify({ 1, 2 }))
+			return false;
+	}
+
+	if (!compact_concurrent_database(".__test_compact"))
+		return false;
+	if (file_exists(".__test_compact.2.foz"))
+		return false;
+	if (!verify({ 1, 2, 3 }))
+		return false;
+
+	// Nothing left to do.
+	if (!compact_concurrent_database(".__test_compact"))
+		return false;
+
+	remove(".__test_compact.foz");
+	remove(".__test_compact.lock");
+	return true;
+}
+
+static bool test_module_store()
+{
+	remove(".__test_store.1.foz");
+	remove(".__test_store_app0.1.foz");
+	remove(".__test_store_app1.1.foz");
+
+	static const uint8_t blob[] = {1, 2, 3};
+
+	{
+		auto store = std::unique_ptr<DatabaseInterface>(create_module_store_database(".__test_store", DatabaseMode::Append));
+		if (!store->prepare())
+			return false;
+
+		// Only shader modules go into the store.
+		auto app0 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_store_app0",
+		                                                                          DatabaseMode::Append, nullptr, 0));
+		auto app1 = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_store_app1",
+		                                                                          DatabaseMode::Append, nullptr, 0));
+		if (!app0->set_module_store(store.get()) || !app1->set_module_store(store.get()))
+			return false;
+		if (!app0->prepare() || !app1->prepare())
+			return false;
+		if (app0->set_module_store(store.get()))
+			return false;
+
+		if (!app0->write_entry(RESOURCE_SHADER_MODULE, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!app0->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+
+		// The second application finds the module in the store and does not write it again.
+		if (!app1->has_entry(RESOURCE_SHADER_MODULE, 1))
+			return false;
+		if (!app1->write_entry(RESOURCE_SHADER_MODULE, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+		if (!app1->write_entry(RESOURCE_SAMPLER, 2, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+
+		if (store->write_entry(RESOURCE_SAMPLER, 3, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	const auto count_entries = [](const char *path, ResourceTag tag) -> size_t {
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		size_t count = 0;
+		if (!db->prepare() || !db->get_hash_list_for_resource_tag(tag, &count, nullptr))
+			return size_t(-1);
+		return count;
+	};
+
+	if (count_entries(".__test_store.1.foz", RESOURCE_SHADER_MODULE) != 2)
+		return false;
+	if (count_entries(".__test_store_app0.1.foz", RESOURCE_SHADER_MODULE) != 0 ||
+	    count_entries(".__test_store_app0.1.foz", RESOURCE_SAMPLER) != 1)
+		return false;
+	if (count_entries(".__test_store_app1.1.foz", RESOURCE_SHADER_MODULE) != 0 ||
+	    count_entries(".__test_store_app1.1.foz", RESOURCE_SAMPLER) != 1)
+		return false;
+
+	{
+		auto store = std::unique_ptr<DatabaseInterface>(create_module_store_database(".__test_store", DatabaseMode::ReadOnly));
+		static const char *app_path = ".__test_store_app1.1.foz";
+		auto db = std::unique_ptr<DatabaseInterface>(create_concurrent_database(nullptr, DatabaseMode::ReadOnly,
+		                                                                        &app_path, 1));
+		if (!store->prepare() || !db->set_module_store(store.get()) || !db->prepare())
+			return false;
+
+		// Both modules resolve through the store, but only embedded entries are listed.
+		for (Hash hash = 1; hash <= 2; hash++)
+		{
+			size_t blob_size = 0;
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (blob_size != sizeof(blob))
+				return false;
+		}
+
+		size_t module_count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &module_count, nullptr) || module_count != 0)
+			return false;
+		if (db->read_entry(RESOURCE_SHADER_MODULE, 3, nullptr, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+	}
+
+	remove(".__test_store.1.foz");
+	remove(".__test_store_app0.1.foz");
+	remove(".__test_store_app1.1.foz");
+	return true;
+}
+
+static bool test_early_deduplication()
+{
+	StateRecorder recorder;
+	recorder.set_enable_early_deduplication(true);
+
+	VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+	static const uint32_t code[] = { 0xdeadbeef, 0xcafebabe };
+	info.pCode = code;
+	info.codeSize = sizeof(code);
+
+	// The second module is only recorded as an alias of the first, but must still resolve.
+	if (!recorder.record_shader_module(fake_handle<VkShaderModule>(5000), info))
+		return false;
+	if (!recorder.record_shader_module(fake_handle<VkShaderModule>(6000), info))
+		return false;
+
+	VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	sampler.maxLod = 10.0f;
+	if (!recorder.record_sampler(fake_handle<VkSampler>(100), sampler))
+		return false;
+	if (!recorder.record_sampler(fake_handle<VkSampler>(200), sampler))
+		return false;
+
+	Hash hash0 = 0, hash1 = 0;
+	if (!recorder.get_hash_for_shader_module(fake_handle<VkShaderModule>(5000), &hash0) ||
+	    !recorder.get_hash_for_shader_module(fake_handle<VkShaderModule>(6000), &hash1) ||
+	    hash0 != hash1 || hash0 != Hashing::compute_hash_shader_module(info))
+		return false;
+
+	if (!recorder.get_hash_for_sampler(fake_handle<VkSampler>(100), &hash0) ||
+	    !recorder.get_hash_for_sampler(fake_handle<VkSampler>(200), &hash1) ||
+	    hash0 != hash1)
+		return false;
+
+	VkPipelineLayoutCreateInfo layout = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	if (!recorder.record_pipeline_layout(fake_handle<VkPipelineLayout>(10000), layout))
+		return false;
+
+	VkComputePipelineCreateInfo pipe = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	pipe.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipe.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipe.stage.module = fake_handle<VkShaderModule>(6000);
+	pipe.layout = fake_handle<VkPipelineLayout>(10000);
+	pipe.stage.pName = "main";
+	if (!recorder.record_compute_pipeline(fake_handle<VkPipeline>(80000), pipe, nullptr, 0))
+		return false;
+
+	uint8_t *serialized;
+	size_t serialized_size;
+	if (!recorder.serialize(&serialized, &serialized_size))
+		return false;
+	StateRecorder::free_serialized(serialized);
+	return true;
+}
+
+// Archives older than version 7 hash bulk data differently. Appending to one must keep using that scheme,
+// or every shader module and pipeline which refers to one is recorded again under a new hash.
+static bool test_append_legacy_format_version()
+{
+	remove(".__test_legacy.foz");
+	remove(".__test_legacy.1.foz");
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_legacy.foz", DatabaseMode::OverWrite));
+		static const uint8_t blob[] = { 1, 2, 3 };
+		if (!db->prepare() || !db->write_entry(RESOURCE_SAMPLER, 1, blob, sizeof(blob), PAYLOAD_WRITE_NO_FLAGS))
+			return false;
+	}
+
+	// Turn it into a version 6 archive. The version is the last byte of the magic.
+	{
+		FILE *file = fopen(".__test_legacy.foz", "r+b");
+		if (!file)
+			return false;
+		const uint8_t version = 6;
+		bool ok = fseek(file, 15, SEEK_SET) == 0 && fwrite(&version, 1, 1, file) == 1;
+		fclose(file);
+		if (!ok)
+			return false;
+	}
+
+	static const uint32_t code[] = { 0x07230203, 0x10000, 0xdeadbeef, 0xcafebabe };
+	static const uint32_t spec_data[] = { 1, 2, 3 };
+
+	const auto record = [&]() -> bool {
+		auto db = std::unique_ptr<DatabaseInterface>(create_concurrent_database(".__test_legacy", DatabaseMode::Append, nullptr, 0));
+		if (db->get_format_version() != 6)
+			return false;
+
+		StateRecorder recorder;
+		recorder.init_recording_thread(db.get());
+		if (recorder.get_hash_format_version() != 6)
+			return false;
+
+		VkShaderModuleCreateInfo module = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		module.pCode = code;
+		module.codeSize = sizeof(code);
+		if (!recorder.record_shader_module(fake_handle<VkShaderModule>(5000), module))
+			return false;
+
+		VkPipelineLayoutCreateInfo layout = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+		if (!recorder.record_pipeline_layout(fake_handle<VkPipelineLayout>(10000), layout))
+			return false;
+
+		VkSpecializationMapEntry entry = { 0, 4, 4 };
+		VkSpecializationInfo spec = { 1, &entry, sizeof(spec_data), spec_data };
+		VkComputePipelineCreateInfo pipe = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+		pipe.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		pipe.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		pipe.stage.module = fake_handle<VkShaderModule>(5000);
+		pipe.stage.pName = "main";
+		pipe.stage.pSpecializationInfo = &spec;
+		pipe.layout = fake_handle<VkPipelineLayout>(10000);
+		return recorder.record_compute_pipeline(fake_handle<VkPipeline>(80000), pipe, nullptr, 0);
+	};
+
+	// The first session records everything into a new archive, which keeps the version of the archive it extends.
+	if (!record())
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_legacy.1.foz", DatabaseMode::ReadOnly));
+		if (!db->prepare() || db->get_format_version() != 6)
+			return false;
+
+		VkShaderModuleCreateInfo module = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		module.pCode = code;
+		module.codeSize = sizeof(code);
+		Hash legacy_hash = Hashing::compute_hash_shader_module(module, 6);
+		if (legacy_hash == Hashing::compute_hash_shader_module(module) ||
+		    !db->has_entry(RESOURCE_SHADER_MODULE, legacy_hash) ||
+		    db->has_entry(RESOURCE_SHADER_MODULE, Hashing::compute_hash_shader_module(module)))
+			return false;
+
+		size_t count = 0;
+		if (!db->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &count, nullptr) || count != 1)
+			return false;
+	}
+
+	static const char *append_paths[] = { ".__test_legacy.1.foz" };
+	if (!merge_concurrent_databases(".__test_legacy.foz", append_paths, 1))
+		return false;
+	remove(".__test_legacy.1.foz");
+
+	// Appending the same objects again must find all of them.
+	if (!record())
+		return false;
+	if (file_exists(".__test_legacy.1.foz"))
+		return false;
+
+	remove(".__test_legacy.foz");
+	return true;
+}
+
+static bool test_recorder_statistics()
+{
+	remove(".__test_statistics.foz");
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_statistics.foz", DatabaseMode::OverWrite));
+	StateRecorder recorder;
+	recorder.init_recording_thread(db.get());
+
+	record_samplers(recorder);
+	record_shader_modules(recorder);
+	recorder.tear_down_recording_thread();
+
+	StateRecorderStatistics stats;
+	recorder.get_statistics(&stats);
+	if (stats.record_count == 0 || stats.queue_depth != 0 || stats.max_queue_depth == 0)
+		return false;
+
+	if (stats.entries_written == 0 || stats.bytes_written == 0 || stats.thread_busy_time_ns == 0)
+		return false;
+	if (stats.max_queued_bytes == 0 || stats.blocked_count != 0 || stats.dropped_count != 0)
+		return false;
+
+	db.reset();
+	remove(".__test_statistics.foz");
+	return true;
+}
+
+static bool test_record_queue_limit()
+{
+	remove(".__test_queue_limit.foz");
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_queue_limit.foz", DatabaseMode::OverWrite));
+
+	// The arena of the recording thread alone exceeds the limit as soon as anything has been copied.
+	StateRecorder recorder;
+	recorder.set_record_queue_limit(1, RECORD_QUEUE_LIMIT_POLICY_DROP, 0);
+	recorder.init_recording_thread(db.get());
+
+	VkSamplerCreateInfo info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	for (unsigned i = 0; i < 16; i++)
+	{
+		info.maxLod = float(i);
+		if (!recorder.record_sampler(fake_handle<VkSampler>(1000 + i), info))
+			return false;
+	}
+	recorder.tear_down_recording_thread();
+
+	StateRecorderStatistics stats;
+	recorder.get_statistics(&stats);
+	if (stats.dropped_count == 0 || stats.dropped_count >= 16 || stats.blocked_count != 0)
+		return false;
+
+	// Dropped objects are not known to the recorder.
+	Hash hash;
+	if (recorder.get_hash_for_sampler(fake_handle<VkSampler>(1015), &hash))
+		return false;
+
+	db.reset();
+	remove(".__test_queue_limit.foz");
+	return true;
+}
+
+static bool test_deferred_recording()
+{
+	remove(".__test_deferred.foz");
+	remove(".__test_deferred_pressure.foz");
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_deferred.foz", DatabaseMode::OverWrite));
+
+	// Neither trigger can fire within the test, so everything is held until the recording thread is torn down.
+	StateRecorder recorder;
+	recorder.set_deferred_recording(60 * 1000, 60 * 1000);
+	recorder.init_recording_thread(db.get());
+
+	VkSamplerCreateInfo info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	for (unsigned i = 0; i < 16; i++)
+	{
+		info.maxLod = float(i);
+		if (!recorder.record_sampler(fake_handle<VkSampler>(1000 + i), info))
+			return false;
+	}
+
+	StateRecorderStatistics stats;
+	recorder.get_statistics(&stats);
+	if (stats.entries_written != 0 || stats.queue_depth != 16)
+		return false;
+
+	// Tearing down writes whatever is still held.
+	recorder.tear_down_recording_thread();
+	recorder.get_statistics(&stats);
+	if (stats.queue_depth != 0 || stats.entries_written == 0)
+		return false;
+
+	Hash hash;
+	for (unsigned i = 0; i < 16; i++)
+		if (!recorder.get_hash_for_sampler(fake_handle<VkSampler>(1000 + i), &hash) || !db->has_entry(RESOURCE_SAMPLER, hash))
+			return false;
+
+	// The arena alone exceeds the limit, so the recording thread releases what it holds long before either trigger.
+	auto pressure_db = std::unique_ptr<DatabaseInterface>(
+			create_stream_archive_database(".__test_deferred_pressure.foz", DatabaseMode::OverWrite));
+	StateRecorder pressure_recorder;
+	pressure_recorder.set_deferred_recording(60 * 1000, 60 * 1000);
+	pressure_recorder.set_record_queue_limit(1, RECORD_QUEUE_LIMIT_POLICY_DROP, 0);
+	pressure_recorder.init_recording_thread(pressure_db.get());
+
+	for (unsigned i = 0; i < 16; i++)
+	{
+		info.maxLod = float(i);
+		if (!pressure_recorder.record_sampler(fake_handle<VkSampler>(2000 + i), info))
+			return false;
+	}
+
+	pressure_recorder.get_statistics(&stats);
+	for (unsigned i = 0; i < 1000 && stats.queue_depth != 0; i++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		pressure_recorder.get_statistics(&stats);
+	}
+	if (stats.queue_depth != 0 || stats.entries_written == 0 || stats.dropped_count == 0)
+		return false;
+	uint64_t written = stats.entries_written;
+
+	pressure_recorder.tear_down_recording_thread();
+	pressure_recorder.get_statistics(&stats);
+	if (stats.entries_written != written)
+		return false;
+	if (!pressure_recorder.get_hash_for_sampler(fake_handle<VkSampler>(2000), &hash) ||
+	    !pressure_db->has_entry(RESOURCE_SAMPLER, hash))
+		return false;
+
+	db.reset();
+	pressure_db.reset();
+	remove(".__test_deferred.foz");
+	remove(".__test_deferred_pressure.foz");
+	return true;
+}
+
+static bool test_usage_metadata()
+{
+	remove(".__test_usage.foz");
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_usage.foz", DatabaseMode::OverWrite));
+	StateRecorder recorder;
+	recorder.set_enable_usage_metadata(true);
+	recorder.init_recording_thread(db.get());
+
+	// Nothing has been presented yet, so these are loading. The second sampler 1000 is only used once.
+	VkSamplerCreateInfo info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	for (unsigned i = 0; i < 16; i++)
+	{
+		info.maxLod = float(i);
+		if (!recorder.record_sampler(fake_handle<VkSampler>(1000 + i), info))
+			return false;
+	}
+	info.maxLod = 0.0f;
+	if (!recorder.record_sampler(fake_handle<VkSampler>(2000), info))
+		return false;
+
+	recorder.notify_frame_presented();
+	info.maxLod = 100.0f;
+	if (!recorder.record_sampler(fake_handle<VkSampler>(3000), info))
+		return false;
+	recorder.tear_down_recording_thread();
+
+	Hash first_hash = 0, late_hash = 0;
+	if (!recorder.get_hash_for_sampler(fake_handle<VkSampler>(1000), &first_hash) ||
+	    !recorder.get_hash_for_sampler(fake_handle<VkSampler>(3000), &late_hash))
+		return false;
+	db.reset();
+
+	db.reset(create_stream_archive_database(".__test_usage.foz", DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return false;
+
+	size_t chunk_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_USAGE_METADATA, &chunk_count, nullptr) || chunk_count != 1)
+		return false;
+	Hash chunk;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_USAGE_METADATA, &chunk_count, &chunk))
+		return false;
+
+	size_t size = 0;
+	if (!db->read_entry(RESOURCE_USAGE_METADATA, chunk, &size, nullptr, 0))
+		return false;
+	std::vector<uint8_t> blob(size);
+	if (!db->read_entry(RESOURCE_USAGE_METADATA, chunk, &size, blob.data(), 0))
+		return false;
+
+	Hash session = 0;
+	size_t record_count = 0;
+	if (!parse_usage_metadata(blob.data(), blob.size(), &session, nullptr, &record_count) || record_count != 17 || !session)
+		return false;
+	std::vector<UsageMetadataRecord> records(record_count);
+	if (!parse_usage_metadata(blob.data(), blob.size(), nullptr, records.data(), &record_count))
+		return false;
+
+	for (auto &record : records)
+	{
+		if (record.tag != RESOURCE_SAMPLER)
+			return false;
+		bool late = record.hash == late_hash;
+		if (late != (record.first_use_frame == 1) || late == ((record.flags & USAGE_METADATA_LOADING_BIT) != 0))
+			return false;
+	}
+	if (records.front().hash != first_hash)
+		return false;
+
+	// Not a usage metadata blob.
+	uint8_t junk[64] = {};
+	if (parse_usage_metadata(junk, sizeof(junk), nullptr, nullptr, &record_count))
+		return false;
+
+	db.reset();
+	remove(".__test_usage.foz");
+	return true;
+}
+
+static bool test_forget_handles()
+{
+	StateRecorder recorder;
+
+	VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	if (!recorder.record_sampler(fake_handle<VkSampler>(100), sampler))
+		return false;
+	VkDescriptorSetLayoutBinding binding = {};
+	binding.descriptorCount = 1;
+	binding.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+	VkSampler immutable_sampler = fake_handle<VkSampler>(100);
+	binding.pImmutableSamplers = &immutable_sampler;
+	VkDescriptorSetLayoutCreateInfo layout = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+	layout.bindingCount = 1;
+	layout.pBindings = &binding;
+	if (!recorder.record_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(200), layout))
+		return false;
+
+	// The set layout was recorded before the sampler was destroyed, so it has to resolve it.
+	recorder.forget_sampler(fake_handle<VkSampler>(100));
+	Hash hash;
+	if (recorder.get_hash_for_sampler(fake_handle<VkSampler>(100), &hash))
+		return false;
+	if (!recorder.get_hash_for_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(200), &hash))
+		return false;
+
+	// The driver may hand out the same handle for a new object.
+	sampler.maxLod = 4.0f;
+	if (!recorder.record_sampler(fake_handle<VkSampler>(100), sampler))
+		return false;
+	if (!recorder.get_hash_for_sampler(fake_handle<VkSampler>(100), &hash) ||
+	    hash != Hashing::compute_hash_sampler(sampler))
+		return false;
+
+	recorder.forget_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(200));
+	if (recorder.get_hash_for_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(200), &hash))
+		return false;
+
+	return true;
+}
+
+static bool test_streaming_serialize()
+{
+	StateRecorder recorder;
+
+	VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	for (unsigned i = 0; i < 64; i++)
+	{
+		sampler.maxLod = float(i);
+		if (!recorder.record_sampler(fake_handle<VkSampler>(100 + i), sampler))
+			return false;
+	}
+
+	static const uint32_t code[] = { 0x07230203, 1, 2, 3, 4, 5 };
+	VkShaderModuleCreateInfo module = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+	module.codeSize = sizeof(code);
+	module.pCode = code;
+	if (!recorder.record_shader_module(fake_handle<VkShaderModule>(5000), module))
+		return false;
+
+	// Collects the output, and fails once limit bytes have been written.
+	struct ChunkStream : SerializedOutputStream
+	{
+		bool write(const void *data, size_t size) override
+		{
+			auto *bytes = static_cast<const uint8_t *>(data);
+			output.insert(output.end(), bytes, bytes + size);
+			chunks++;
+			return output.size() <= limit;
+		}
+
+		std::vector<uint8_t> output;
+		size_t limit = SIZE_MAX;
+		unsigned chunks = 0;
+	};
+
+	ChunkStream stream;
+	if (!recorder.serialize(stream) || stream.chunks == 0)
+		return false;
+
+	uint8_t *serialized;
+	size_t serialized_size;
+	if (!recorder.serialize(&serialized, &serialized_size))
+		return false;
+	bool equal = serialized_size == stream.output.size() &&
+	             memcmp(serialized, stream.output.data(), serialized_size) == 0;
+	StateRecorder::free_serialized(serialized);
+	if (!equal)
+		return false;
+
+	ChunkStream failing_stream;
+	failing_stream.limit = 0;
+	if (recorder.serialize(failing_stream))
+		return false;
+
+	return true;
+}
+
+static bool test_binary_format()
+{
+	remove(".__test_binary.foz");
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_binary.foz", DatabaseMode::OverWrite));
+		StateRecorder recorder;
+		recorder.set_database_enable_binary_format(true);
+
+		VkApplicationInfo app_info = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+		app_info.pEngineName = "test";
+		app_info.pApplicationName = "testy";
+		app_info.apiVersion = VK_API_VERSION_1_1;
+		if (!recorder.record_application_info(app_info))
+			return false;
+		VkPhysicalDeviceFeatures2 features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+		if (!recorder.record_physical_device_features(features))
+			return false;
+
+		recorder.init_recording_thread(db.get());
+
+		record_samplers(recorder);
+		record_set_layouts(recorder);
+		record_pipeline_layouts(recorder);
+		record_shader_modules(recorder);
+		record_render_passes(recorder);
+		record_compute_pipelines(recorder);
+		record_graphics_pipelines(recorder);
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_binary.foz", DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	static const ResourceTag playback_order[] = {
+		RESOURCE_APPLICATION_INFO,
+		RESOURCE_APPLICATION_BLOB_LINK,
+		RESOURCE_SHADER_MODULE,
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+		RESOURCE_COMPUTE_PIPELINE,
+		RESOURCE_GRAPHICS_PIPELINE,
+	};
+
+	// The two graphics pipelines only differ in viewport state, everything else is stored once.
+	// Pipeline states are not replayed on their own, pipelines pull them in through the resolver.
+	size_t pipeline_state_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_GRAPHICS_PIPELINE_STATE, &pipeline_state_count, nullptr))
+		return false;
+	if (pipeline_state_count != 8)
+		return false;
+
+	// ReplayInterface verifies that every replayed object hashes to the same value as the recorded one.
+	// Graphics pipelines are replayed by a replayer which shares the references of the first one,
+	// like the per-thread replayers in fossilize-replay.
+	StateReplayer replayer;
+	StateReplayer pipeline_replayer;
+	ReplayInterface iface;
+	std::vector<uint8_t> blob;
+
+	for (auto tag : playback_order)
+	{
+		if (tag == RESOURCE_GRAPHICS_PIPELINE)
+			pipeline_replayer.copy_handle_references(replayer);
+		auto &tag_replayer = tag == RESOURCE_GRAPHICS_PIPELINE ? pipeline_replayer : replayer;
+
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr) || hash_count == 0)
+			return false;
+		std::vector<Hash> hashes(hash_count);
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		for (auto hash : hashes)
+		{
+			size_t size = 0;
+			if (!db->read_entry(tag, hash, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			blob.resize(size);
+			if (!db->read_entry(tag, hash, &size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+
+			if (blob.empty() || blob.front() == '{')
+				return false;
+			if (!tag_replayer.parse(iface, db.get(), blob.data(), blob.size()))
+				return false;
+
+			// A truncated blob must be rejected rather than replayed.
+			if (tag == RESOURCE_SAMPLER)
+			{
+				StateReplayer truncated_replayer;
+				if (truncated_replayer.parse(iface, nullptr, blob.data(), blob.size() - 1))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Runs after test_binary_format(), and compares against the archive it leaves behind.
+static bool test_scan_references()
+{
+	std::vector<std::pair<unsigned, Hash>> json_references;
+	{
+		StateRecorder recorder;
+		record_samplers(recorder);
+		record_set_layouts(recorder);
+		record_pipeline_layouts(recorder);
+		record_shader_modules(recorder);
+		record_render_passes(recorder);
+		record_compute_pipelines(recorder);
+		record_graphics_pipelines(recorder);
+
+		uint8_t *serialized;
+		size_t serialized_size;
+		if (!recorder.serialize(&serialized, &serialized_size))
+			return false;
+
+		StateReplayer replayer;
+		const StateReference *references = nullptr;
+		size_t count = 0;
+		bool ret = replayer.scan_references(serialized, serialized_size, &references, &count);
+		StateRecorder::free_serialized(serialized);
+		if (!ret || count == 0)
+			return false;
+
+		for (size_t i = 0; i < count; i++)
+			json_references.push_back({ unsigned(references[i].tag), references[i].hash });
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_binary.foz", DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	std::vector<std::pair<unsigned, Hash>> binary_references;
+	size_t pipeline_state_references = 0;
+	StateReplayer replayer;
+	std::vector<uint8_t> blob;
+
+	for (auto tag : { RESOURCE_SAMPLER, RESOURCE_DESCRIPTOR_SET_LAYOUT, RESOURCE_PIPELINE_LAYOUT, RESOURCE_SHADER_MODULE,
+	                  RESOURCE_RENDER_PASS, RESOURCE_COMPUTE_PIPELINE, RESOURCE_GRAPHICS_PIPELINE })
+	{
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		std::vector<Hash> hashes(hash_count);
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		for (auto hash : hashes)
+		{
+			size_t size = 0;
+			if (!db->read_entry(tag, hash, &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			blob.resize(size);
+			if (!db->read_entry(tag, hash, &size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+
+			const StateReference *references = nullptr;
+			size_t count = 0;
+			if (!replayer.scan_references(blob.data(), blob.size(), &references, &count))
+				return false;
+
+			for (size_t i = 0; i < count; i++)
+			{
+				// Everything which is referred to must be in the archive.
+				if (!db->has_entry(references[i].tag, references[i].hash))
+					return false;
+
+				// JSON has no shared pipeline state.
+				if (references[i].tag == RESOURCE_GRAPHICS_PIPELINE_STATE)
+					pipeline_state_references++;
+				else
+					binary_references.push_back({ unsigned(references[i].tag), references[i].hash });
+			}
+		}
+		replayer.get_allocator().reset();
+	}
+
+	if (pipeline_state_references == 0)
+		return false;
+
+	// Both forms list the same references.
+	std::sort(json_references.begin(), json_references.end());
+	std::sort(binary_references.begin(), binary_references.end());
+	return json_references == binary_references;
+}
+
+// Runs after test_binary_format(). Every type of static object is spread across two replayers,
+// and has to be visible to the first replayer for the next type to resolve its references.
+static bool test_merge_handle_references()
+{
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_binary.foz", DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	static const ResourceTag playback_order[] = {
+		RESOURCE_APPLICATION_INFO,
+		RESOURCE_APPLICATION_BLOB_LINK,
+		RESOURCE_SHADER_MODULE,
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+		RESOURCE_COMPUTE_PIPELINE,
+		RESOURCE_GRAPHICS_PIPELINE,
+	};
+
+	StateReplayer replayer;
+	ReplayInterface iface;
+	std::vector<uint8_t> blob;
+
+	for (auto tag : playback_order)
+	{
+		bool spread = tag == RESOURCE_SAMPLER || tag == RESOURCE_DESCRIPTOR_SET_LAYOUT || tag == RESOURCE_PIPELINE_LAYOUT;
+		StateReplayer tier_replayers[2];
+		for (auto &tier_replayer : tier_replayers)
+			tier_replayer.copy_handle_references(replayer);
+
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr) || hash_count == 0)
+			return false;
+		std::vector<Hash> hashes(hash_count);
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		for (size_t i = 0; i < hashes.size(); i++)
+		{
+			size_t size = 0;
+			if (!db->read_entry(tag, hashes[i], &size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			blob.resize(size);
+			if (!db->read_entry(tag, hashes[i], &size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+
+			auto &tag_replayer = spread ? tier_replayers[i & 1] : replayer;
+			if (!tag_replayer.parse(iface, db.get(), blob.data(), blob.size()))
+				return false;
+		}
+
+		if (spread)
+			for (auto &tier_replayer : tier_replayers)
+				replayer.merge_handle_references(tier_replayer);
+	}
+
+	return true;
+}
+
+// Stands in for a device, so the in-process replayer runs without a GPU.
+// Handles count up from 1, so they never collide with the object hashes the replayer resolves from.
+static std::atomic<uint64_t> fake_device_handles;
+static std::atomic<int> fake_device_live_objects;
+static std::atomic<unsigned> fake_device_pipelines;
+static std::atomic<bool> fake_device_bad_module;
+
+template <typename Info, typename Handle>
+static VKAPI_ATTR VkResult VKAPI_CALL fake_device_create(VkDevice, const Info *, const VkAllocationCallbacks *, Handle *handle)
+{
+	*handle = fake_handle<Handle>(++fake_device_handles);
+	fake_device_live_objects++;
+	return VK_SUCCESS;
+}
+
+template <typename Handle>
+static VKAPI_ATTR void VKAPI_CALL fake_device_destroy(VkDevice, Handle handle, const VkAllocationCallbacks *)
+{
+	if (handle != VK_NULL_HANDLE)
+		fake_device_live_objects--;
+}
+
+static void fake_device_check_module(VkShaderModule module)
+{
+	uint64_t value = (uint64_t)module;
+	if (value == 0 || value > fake_device_handles.load())
+		fake_device_bad_module = true;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL fake_device_create_graphics_pipelines(VkDevice device, VkPipelineCache, uint32_t count,
+                                                                           const VkGraphicsPipelineCreateInfo *infos,
+                                                                           const VkAllocationCallbacks *allocator,
+                                                                           VkPipeline *pipelines)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		for (uint32_t j = 0; j < infos[i].stageCount; j++)
+			fake_device_check_module(infos[i].pStages[j].module);
+		fake_device_create(device, &infos[i], allocator, &pipelines[i]);
+		fake_device_pipelines++;
+	}
+	return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL fake_device_create_compute_pipelines(VkDevice device, VkPipelineCache, uint32_t count,
+                                                                          const VkComputePipelineCreateInfo *infos,
+                                                                          const VkAllocationCallbacks *allocator,
+                                                                          VkPipeline *pipelines)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		fake_device_check_module(infos[i].stage.module);
+		fake_device_create(device, &infos[i], allocator, &pipelines[i]);
+		fake_device_pipelines++;
+	}
+	return VK_SUCCESS;
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL fake_device_get_proc_addr(VkDevice, const char *name)
+{
+	static const struct
+	{
+		const char *name;
+		PFN_vkVoidFunction func;
+	} functions[] = {
+		{ "vkCreateSampler", (PFN_vkVoidFunction)fake_device_create<VkSamplerCreateInfo, VkSampler> },
+		{ "vkDestroySampler", (PFN_vkVoidFunction)fake_device_destroy<VkSampler> },
+		{ "vkCreateDescriptorSetLayout", (PFN_vkVoidFunction)fake_device_create<VkDescriptorSetLayoutCreateInfo, VkDescriptorSetLayout> },
+		{ "vkDestroyDescriptorSetLayout", (PFN_vkVoidFunction)fake_device_destroy<VkDescriptorSetLayout> },
+		{ "vkCreatePipelineLayout", (PFN_vkVoidFunction)fake_device_create<VkPipelineLayoutCreateInfo, VkPipelineLayout> },
+		{ "vkDestroyPipelineLayout", (PFN_vkVoidFunction)fake_device_destroy<VkPipelineLayout> },
+		{ "vkCreateShaderModule", (PFN_vkVoidFunction)fake_device_create<VkShaderModuleCreateInfo, VkShaderModule> },
+		{ "vkDestroyShaderModule", (PFN_vkVoidFunction)fake_device_destroy<VkShaderModule> },
+		{ "vkCreateRenderPass", (PFN_vkVoidFunction)fake_device_create<VkRenderPassCreateInfo, VkRenderPass> },
+		{ "vkDestroyRenderPass", (PFN_vkVoidFunction)fake_device_destroy<VkRenderPass> },
+		{ "vkCreateGraphicsPipelines", (PFN_vkVoidFunction)fake_device_create_graphics_pipelines },
+		{ "vkCreateComputePipelines", (PFN_vkVoidFunction)fake_device_create_compute_pipelines },
+		{ "vkDestroyPipeline", (PFN_vkVoidFunction)fake_device_destroy<VkPipeline> },
+	};
+
+	for (auto &func : functions)
+		if (strcmp(func.name, name) == 0)
+			return func.func;
+	return nullptr;
+}
+
+static bool test_in_process_replayer()
+{
+	remove(".__test_replayer.foz");
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_replayer.foz", DatabaseMode::OverWrite));
+		StateRecorder recorder;
+		recorder.set_database_enable_binary_format(true);
+		recorder.init_recording_thread(db.get());
+
+		record_samplers(recorder);
+		record_set_layouts(recorder);
+		record_pipeline_layouts(recorder);
+		record_shader_modules(recorder);
+		record_render_passes(recorder);
+		record_compute_pipelines(recorder);
+		record_graphics_pipelines(recorder);
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(".__test_replayer.foz", DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	size_t graphics_count = 0;
+	size_t compute_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_GRAPHICS_PIPELINE, &graphics_count, nullptr) ||
+	    !db->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &compute_count, nullptr) ||
+	    graphics_count == 0 || compute_count == 0)
+		return false;
+
+	fake_device_handles = 0;
+	fake_device_live_objects = 0;
+	fake_device_pipelines = 0;
+	fake_device_bad_module = false;
+
+	Replayer::Options opts = {};
+	opts.device = fake_handle<VkDevice>(1);
+	opts.get_device_proc_addr = fake_device_get_proc_addr;
+	opts.database = db.get();
+	opts.num_threads = 2;
+	opts.background_priority = true;
+
+	Replayer replayer;
+	ExternalReplayer::Progress progress;
+	if (replayer.poll_progress(progress) != ExternalReplayer::PollResult::Error)
+		return false;
+
+	// Nothing is replayed while paused, not even static objects.
+	replayer.pause();
+	if (!replayer.start(opts))
+		return false;
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	if (replayer.poll_progress(progress) != ExternalReplayer::PollResult::Running)
+		return false;
+	if (progress.active_workers != 0 || progress.graphics.parsed != 0 || fake_device_handles.load() != 0)
+		return false;
+	if (progress.graphics.total != graphics_count || progress.compute.total != compute_count || progress.total_modules != 2)
+		return false;
+
+	replayer.set_thread_budget(1);
+	replayer.resume();
+	if (!replayer.wait())
+		return false;
+
+	if (replayer.poll_progress(progress) != ExternalReplayer::PollResult::Complete)
+		return false;
+	if (progress.graphics.completed != graphics_count || progress.compute.completed != compute_count ||
+	    progress.graphics.skipped != 0 || progress.compute.skipped != 0 || progress.completed_modules != 2)
+		return false;
+
+	// Every pipeline saw real shader modules, and everything was destroyed again.
+	if (fake_device_pipelines.load() != graphics_count + compute_count || fake_device_bad_module.load())
+		return false;
+	if (fake_device_live_objects.load() != 0)
+		return false;
+
+	db.reset();
+	remove(".__test_replayer.foz");
+	return true;
+}
+
+static bool test_scratch_allocator()
+{
+	for (unsigned huge_pages = 0; huge_pages < 2; huge_pages++)
+	{
+		ScratchAllocator allocator;
+		allocator.set_block_recycling(true);
+		allocator.set_huge_pages(huge_pages != 0);
+
+		ScratchAllocator::Statistics stats;
+		for (unsigned iteration = 0; iteration < 4; iteration++)
+		{
+			for (unsigned i = 0; i < 64; i++)
+			{
+				auto *data = static_cast<uint8_t *>(allocator.allocate_raw_cleared(48 * 1024, 64));
+				if (!data || (reinterpret_cast<uintptr_t>(data) & 63) != 0 || data[48 * 1024 - 1] != 0)
+					return false;
+				data[0] = 1;
+			}
+
+			allocator.get_statistics(&stats);
+			if (stats.bytes_in_use < 64 * 48 * 1024 || stats.free_block_count != 0)
+				return false;
+			allocator.reset();
+		}
+
+		// Every batch after the first was served entirely from recycled blocks.
+		size_t system_allocations = stats.system_allocations;
+		allocator.get_statistics(&stats);
+		if (stats.system_allocations != system_allocations || stats.bytes_in_use != 0 ||
+		    stats.block_count != 1 || stats.free_block_count == 0 ||
+		    stats.peak_bytes_in_use < 64 * 48 * 1024 ||
+		    stats.bytes_reserved != allocator.get_current_memory_consumption())
+			return false;
+
+		allocator.set_block_recycling(false);
+		allocator.get_statistics(&stats);
+		if (stats.free_block_count != 0 || stats.bytes_reserved >= stats.peak_bytes_reserved)
+			return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	if (!test_scratch_allocator())
+		return EXIT_FAILURE;
+	if (!test_concurrent_database_extra_paths())
+		return EXIT_FAILURE;
+	if (!test_concurrent_database())
+		return EXIT_FAILURE;
+	if (!test_concurrent_database_write_shards())
+		return EXIT_FAILURE;
+	if (!test_database_merge())
+		return EXIT_FAILURE;
+	if (!test_bulk_merge())
+		return EXIT_FAILURE;
+	if (!test_concurrent_database_compaction())
+		return EXIT_FAILURE;
+	if (!test_module_store())
+		return EXIT_FAILURE;
+	if (!test_database())
+		return EXIT_FAILURE;
+	if (!test_database_index())
+		return EXIT_FAILURE;
+	if (!test_database_compression())
+		return EXIT_FAILURE;
+	if (!test_database_compression_dictionary())
+		return EXIT_FAILURE;
+	if (!test_database_read_entries())
+		return EXIT_FAILURE;
+	if (!test_database_map_entry())
+		return EXIT_FAILURE;
+	if (!test_database_for_each_entry())
+		return EXIT_FAILURE;
+	if (!test_database_checksum())
+		return EXIT_FAILURE;
+	if (!test_folder_database())
+		return EXIT_FAILURE;
+	if (!test_zip_database())
+		return EXIT_FAILURE;
+	if (!test_database_group_commit())
+		return EXIT_FAILURE;
+	if (!test_database_compression_threads())
+		return EXIT_FAILURE;
+	if (!test_early_deduplication())
+		return EXIT_FAILURE;
+	if (!test_append_legacy_format_version())
+		return EXIT_FAILURE;
+	if (!test_recorder_statistics())
+		return EXIT_FAILURE;
+	if (!test_record_queue_limit())
+		return EXIT_FAILURE;
+	if (!test_usage_metadata())
+		return EXIT_FAILURE;
+	if (!test_deferred_recording())
+		return EXIT_FAILURE;
+	if (!test_forget_handles())
+		return EXIT_FAILURE;
+	if (!test_streaming_serialize())
+		return EXIT_FAILURE;
+	if (!test_binary_format())
+		return EXIT_FAILURE;
+	if (!test_scan_references())
+		return EXIT_FAILURE;
+	if (!test_merge_handle_references())
+		return EXIT_FAILURE;
+	if (!test_in_process_replayer())
 		return EXIT_FAILURE;
 
 	std::vector<uint8_t> res;
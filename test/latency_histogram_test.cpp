@@ -0,0 +1,73 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "fossilize_external_replayer_control_block.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+
+using namespace Fossilize;
+
+int main()
+{
+	// Buckets are monotonic, and the middle of a bucket maps back to it.
+	unsigned last_bucket = 0;
+	for (uint64_t us = 0; us < (uint64_t(1) << 32); us = us < 64 ? us + 1 : us + us / 7)
+	{
+		unsigned bucket = control_block_latency_bucket(us);
+		if (bucket < last_bucket || bucket >= ControlBlockLatencyBuckets)
+			return EXIT_FAILURE;
+		last_bucket = bucket;
+
+		uint64_t value = control_block_latency_bucket_value_us(bucket);
+		if (bucket != ControlBlockLatencyBuckets - 1 && control_block_latency_bucket(value) != bucket)
+			return EXIT_FAILURE;
+
+		// Within 12.5% of the real value.
+		if (bucket != ControlBlockLatencyBuckets - 1 && (value > us + us / 8 + 1 || value + us / 8 + 1 < us))
+			return EXIT_FAILURE;
+	}
+
+	uint32_t buckets[ControlBlockLatencyBuckets] = {};
+	// 98 fast compiles and two slow ones.
+	buckets[control_block_latency_bucket(5000)] = 98;
+	buckets[control_block_latency_bucket(30000000)] = 2;
+
+	uint64_t p50 = control_block_latency_percentile_us(buckets, 0.5);
+	uint64_t p99 = control_block_latency_percentile_us(buckets, 0.99);
+	if (control_block_latency_bucket(p50) != control_block_latency_bucket(5000))
+		return EXIT_FAILURE;
+	if (control_block_latency_bucket(p99) != control_block_latency_bucket(30000000))
+		return EXIT_FAILURE;
+
+	char msg[ControlBlockMessageSize];
+	control_block_format_slow_object(msg, CONTROL_BLOCK_LATENCY_COMPUTE_PIPELINE, 0xfedcba9876543210ull, ~0ull);
+	ControlBlockLatencyType type;
+	uint64_t hash;
+	uint32_t ms;
+	if (!control_block_parse_slow_object(msg, &type, &hash, &ms))
+		return EXIT_FAILURE;
+	if (type != CONTROL_BLOCK_LATENCY_COMPUTE_PIPELINE || hash != 0xfedcba9876543210ull || ms != 9999999)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "util/mpsc_queue.hpp"
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+using namespace Fossilize;
+
+int main()
+{
+	MPSCQueue<uint64_t> queue(2);
+	uint64_t values[8];
+
+	if (!queue.empty() || queue.pop_batch(values, 8) != 0)
+		return EXIT_FAILURE;
+	for (uint64_t i = 0; i < 4; i++)
+		if (!queue.try_push(i))
+			return EXIT_FAILURE;
+	if (queue.try_push(4) || queue.empty())
+		return EXIT_FAILURE;
+	if (!queue.wait_for(std::chrono::milliseconds(0)))
+		return EXIT_FAILURE;
+
+	if (queue.pop_batch(values, 3) != 3 || values[0] != 0 || values[1] != 1 || values[2] != 2)
+		return EXIT_FAILURE;
+	if (!queue.try_push(4) || !queue.try_push(5))
+		return EXIT_FAILURE;
+	if (queue.pop_batch(values, 8) != 3 || values[0] != 3 || values[1] != 4 || values[2] != 5)
+		return EXIT_FAILURE;
+	if (!queue.empty() || queue.wait_for(std::chrono::milliseconds(1)))
+		return EXIT_FAILURE;
+
+	// wake() ends a wait once without an item, whether it comes before or during the wait.
+	queue.wake();
+	if (!queue.wait_for(std::chrono::seconds(60)) || !queue.empty() || queue.wait_for(std::chrono::milliseconds(1)))
+		return EXIT_FAILURE;
+	std::thread waker([&queue]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		queue.wake();
+	});
+	bool woken = queue.wait_for(std::chrono::seconds(60));
+	waker.join();
+	if (!woken || !queue.empty())
+		return EXIT_FAILURE;
+
+	// Producers outrun a small queue, every item must arrive exactly once and in order per producer.
+	enum { ProducerCount = 4, ItemCount = 50000 };
+	MPSCQueue<uint64_t> concurrent_queue(4);
+	std::vector<std::thread> threads;
+	for (uint64_t t = 0; t < ProducerCount; t++)
+	{
+		threads.emplace_back([&concurrent_queue, t]() {
+			for (uint64_t i = 1; i <= ItemCount; i++)
+				concurrent_queue.push((t << 32) | i);
+		});
+	}
+
+	uint64_t last[ProducerCount] = {};
+	unsigned received = 0;
+	while (received < ProducerCount * ItemCount)
+	{
+		concurrent_queue.wait();
+		size_t count = concurrent_queue.pop_batch(values, 8);
+		for (size_t i = 0; i < count; i++)
+		{
+			uint64_t producer = values[i] >> 32;
+			uint64_t index = values[i] & 0xffffffffu;
+			if (producer >= ProducerCount || index != last[producer] + 1)
+				return EXIT_FAILURE;
+			last[producer] = index;
+		}
+		received += unsigned(count);
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	if (!concurrent_queue.empty())
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -80,4 +80,83 @@ int main()
 		abort();
 	if (cache.get_current_object_count() != 0)
 		abort();
+
+	// Pinned objects survive pruning, even when they are the least recently used.
+	cache.set_target_size(0);
+	cache.insert_object(1, 1000, 10);
+	cache.insert_object(2, 2000, 10);
+	if (!cache.pin_object(1) || cache.pin_object(3))
+		abort();
+	cache.prune_cache([](Hash hash, int) {
+		if (hash == 1)
+			abort();
+	});
+	if (cache.get_current_object_count() != 1 || cache.get_current_total_size() != 10)
+		abort();
+
+	// Sizes can be corrected after the fact.
+	cache.update_object_size(1, 30);
+	if (cache.get_current_total_size() != 30)
+		abort();
+
+	cache.unpin_object(1);
+	cache.prune_cache([](Hash, int) {});
+	if (cache.get_current_object_count() != 0 || cache.get_current_total_size() != 0)
+		abort();
+
+	// 2Q: objects which are used more than once survive a scan of objects which are used once.
+	ObjectCache<int> two_queue;
+	two_queue.set_policy(ObjectCachePolicy::TwoQueue);
+	two_queue.set_target_size(8);
+	for (unsigned i = 0; i < 4; i++)
+		two_queue.insert_object(i, int(i), 1);
+
+	// Uses right after insertion don't count.
+	two_queue.find_object(0);
+	two_queue.prune_cache([](Hash, int) {});
+	for (unsigned i = 0; i < 4; i++)
+		two_queue.find_object(i);
+
+	for (unsigned i = 100; i < 1000; i++)
+	{
+		two_queue.insert_object(i, int(i), 1);
+		two_queue.prune_cache([](Hash, int) {});
+	}
+
+	for (unsigned i = 0; i < 4; i++)
+		if (!two_queue.find_object(i).second)
+			abort();
+	if (two_queue.get_current_total_size() != 8)
+		abort();
+
+	// A plain LRU loses them.
+	ObjectCache<int> lru;
+	lru.set_target_size(8);
+	for (unsigned i = 0; i < 4; i++)
+	{
+		lru.insert_object(i, int(i), 1);
+		lru.find_object(i);
+	}
+
+	for (unsigned i = 100; i < 1000; i++)
+	{
+		lru.insert_object(i, int(i), 1);
+		lru.prune_cache([](Hash, int) {});
+	}
+
+	if (lru.find_object(0).second)
+		abort();
+
+	// Objects evicted from probation recently are let straight into the main queue when they come back.
+	two_queue.insert_object(990, 990, 1);
+	for (unsigned i = 1000; i < 1010; i++)
+	{
+		two_queue.insert_object(i, int(i), 1);
+		two_queue.prune_cache([](Hash, int) {});
+	}
+	if (!two_queue.find_object(990).second)
+		abort();
+
+	two_queue.delete_cache([](Hash, int) {});
+	lru.delete_cache([](Hash, int) {});
 }
@@ -0,0 +1,85 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "util/sorted_hash_set.hpp"
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+using namespace Fossilize;
+
+int main()
+{
+	SortedHashSet set;
+	if (set.count(0) || !set.empty() || set.find(0) != 0)
+		abort();
+
+	// Spread out hashes, like real ones, together with a cluster of small ones which all land in the first bucket.
+	std::vector<uint64_t> hashes;
+	uint64_t state = 1;
+	for (unsigned i = 0; i < 100000; i++)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		hashes.push_back(state | 1);
+	}
+	for (uint64_t i = 0; i < 1000; i++)
+		hashes.push_back(i * 2);
+	hashes.push_back(~uint64_t(0) - 1);
+
+	std::sort(hashes.begin(), hashes.end());
+	hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+	auto expected = hashes;
+	set.assign(std::move(hashes));
+
+	if (set.size() != expected.size() || !std::equal(set.begin(), set.end(), expected.begin()))
+		abort();
+
+	// Positions are the ones in the sorted array.
+	for (size_t i = 0; i < expected.size(); i++)
+		if (set.find(expected[i]) != i)
+			abort();
+
+	// Every real hash above is odd, so the even neighbours are not in the set, apart from the small ones.
+	for (auto hash : expected)
+	{
+		if (hash & 1)
+		{
+			if (set.count(hash - 1) || set.count(hash + 1))
+				abort();
+		}
+		else if (hash < 2000 && set.count(hash + 1))
+			abort();
+	}
+
+	if (set.count(~uint64_t(0)) || !set.count(~uint64_t(0) - 1))
+		abort();
+
+	// A single entry.
+	set.assign({ 5 });
+	if (set.size() != 1 || set.find(5) != 0 || set.count(4) || set.count(6))
+		abort();
+
+	set.clear();
+	if (!set.empty() || set.count(5))
+		abort();
+}
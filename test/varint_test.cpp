@@ -47,5 +47,41 @@ int main()
 	if (memcmp(buffer.data(), decode_buffer.data(), decode_buffer.size() * sizeof(uint32_t)))
 		return EXIT_FAILURE;
 
+	// Mix every encoded length, so all control byte values are exercised.
+	for (auto &w : buffer)
+		w >>= 8 * (rnd() & 3);
+
+	computed = compute_size_stream_vbyte(buffer.data(), buffer.size());
+	encode_buffer.resize(computed);
+	if (encode_stream_vbyte(encode_buffer.data(), buffer.data(), buffer.size()) != encode_buffer.data() + computed)
+		return EXIT_FAILURE;
+
+	if (!decode_stream_vbyte(decode_buffer.data(), decode_buffer.size(), encode_buffer.data(), encode_buffer.size()))
+		return EXIT_FAILURE;
+
+	if (memcmp(buffer.data(), decode_buffer.data(), decode_buffer.size() * sizeof(uint32_t)))
+		return EXIT_FAILURE;
+
+	// Word counts which do not fill the last group, and short inputs which never reach the vector path.
+	for (size_t count = 0; count < 67; count++)
+	{
+		computed = compute_size_stream_vbyte(buffer.data(), count);
+		encode_buffer.resize(computed);
+		encode_stream_vbyte(encode_buffer.data(), buffer.data(), count);
+
+		std::vector<uint32_t> decoded(count);
+		if (!decode_stream_vbyte(decoded.data(), count, encode_buffer.data(), encode_buffer.size()))
+			return EXIT_FAILURE;
+		if (count && memcmp(buffer.data(), decoded.data(), count * sizeof(uint32_t)))
+			return EXIT_FAILURE;
+
+		// Truncated or padded data must be rejected.
+		if (computed && decode_stream_vbyte(decoded.data(), count, encode_buffer.data(), encode_buffer.size() - 1))
+			return EXIT_FAILURE;
+		encode_buffer.push_back(0);
+		if (decode_stream_vbyte(decoded.data(), count, encode_buffer.data(), encode_buffer.size()))
+			return EXIT_FAILURE;
+	}
+
 	return EXIT_SUCCESS;
 }
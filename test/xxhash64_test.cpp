@@ -0,0 +1,63 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "xxhash64.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace Fossilize;
+
+int main()
+{
+	// Reference values from the xxHash project.
+	if (xxhash64("", 0, 0) != 0xef46db3751d8e999ull)
+		return EXIT_FAILURE;
+	if (xxhash64("abc", 3, 0) != 0x44bc2cf5ad770999ull)
+		return EXIT_FAILURE;
+	static const char long_str[] = "Nobody inspects the spammish repetition";
+	if (xxhash64(long_str, strlen(long_str), 0) != 0xfbcea83c8a378bf1ull)
+		return EXIT_FAILURE;
+
+	// The result must not depend on alignment.
+	std::vector<uint8_t> buffer(1024 + 8);
+	for (size_t i = 0; i < buffer.size(); i++)
+		buffer[i] = uint8_t(i * 31 + 7);
+
+	for (size_t size = 0; size < 100; size++)
+	{
+		std::vector<uint8_t> aligned(buffer.begin() + 3, buffer.begin() + 3 + size);
+		uint64_t expected = xxhash64(aligned.data(), aligned.size(), 1234);
+		for (size_t offset = 0; offset < 8; offset++)
+		{
+			memmove(buffer.data() + offset, aligned.data(), size);
+			if (xxhash64(buffer.data() + offset, size, 1234) != expected)
+				return EXIT_FAILURE;
+		}
+	}
+
+	// Seeds must matter.
+	if (xxhash64(long_str, strlen(long_str), 0) == xxhash64(long_str, strlen(long_str), 1))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Insert-only set of non-zero 64-bit keys, which any number of threads can query and insert into without locking.
+// The capacity is fixed at construction. Once the set is 3/4 full, insert() fails from then on,
+// which is fine for callers which only use the set to skip redundant work.
+// An insert which happens-before a successful contains() on another thread is visible to that thread, and
+// so is everything the inserting thread did before it inserted.
+class ConcurrentHashSet
+{
+public:
+	explicit ConcurrentHashSet(unsigned capacity_log2)
+		: slots(new std::atomic<uint64_t>[size_t(1) << capacity_log2]),
+		  mask((size_t(1) << capacity_log2) - 1),
+		  max_count(((size_t(1) << capacity_log2) / 4) * 3),
+		  shift(64 - capacity_log2)
+	{
+		for (size_t i = 0; i <= mask; i++)
+			slots[i].store(0, std::memory_order_relaxed);
+	}
+
+	bool contains(uint64_t key) const
+	{
+		if (key == 0)
+			return false;
+
+		for (size_t index = bucket(key), probes = 0; probes <= mask; index = (index + 1) & mask, probes++)
+		{
+			uint64_t value = slots[index].load(std::memory_order_acquire);
+			if (value == key)
+				return true;
+			else if (value == 0)
+				return false;
+		}
+		return false;
+	}
+
+	// Returns true if key is in the set after the call, whether or not it was already there.
+	bool insert(uint64_t key)
+	{
+		if (key == 0)
+			return false;
+
+		if (contains(key))
+			return true;
+
+		// Reserve room up front, so probe sequences always find an empty slot.
+		if (count.fetch_add(1, std::memory_order_relaxed) >= max_count)
+		{
+			count.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		for (size_t index = bucket(key);; index = (index + 1) & mask)
+		{
+			uint64_t value = slots[index].load(std::memory_order_acquire);
+			if (value == 0 &&
+			    slots[index].compare_exchange_strong(value, key, std::memory_order_release, std::memory_order_acquire))
+				return true;
+
+			if (value == key)
+			{
+				// Another thread beat us to it.
+				count.fetch_sub(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+	}
+
+	size_t size() const
+	{
+		return count.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]> slots;
+	size_t mask;
+	size_t max_count;
+	unsigned shift;
+	std::atomic<size_t> count{0};
+
+	size_t bucket(uint64_t key) const
+	{
+		return size_t((key * 0x9e3779b97f4a7c15ull) >> shift);
+	}
+};
+}
@@ -0,0 +1,167 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "object_cache.hpp"
+#include <mutex>
+#include <utility>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// ObjectCache which any number of threads can use at the same time.
+// Objects are spread over shards by hash, and each shard has its own lock and an even share of the size budget.
+// Deleters passed to prune_cache() and delete_cache() are called with the shard lock held,
+// so they must not call back into the cache.
+template <typename T>
+class ConcurrentObjectCache
+{
+public:
+	ConcurrentObjectCache() = default;
+	ConcurrentObjectCache(const ConcurrentObjectCache &) = delete;
+	void operator=(const ConcurrentObjectCache &) = delete;
+
+	void set_target_size(size_t size)
+	{
+		for (auto &shard : shards)
+		{
+			std::lock_guard<std::mutex> holder(shard.lock);
+			shard.cache.set_target_size(size / NumShards);
+		}
+	}
+
+	void set_policy(ObjectCachePolicy policy)
+	{
+		for (auto &shard : shards)
+		{
+			std::lock_guard<std::mutex> holder(shard.lock);
+			shard.cache.set_policy(policy);
+		}
+	}
+
+	std::pair<T, bool> find_object(Hash hash)
+	{
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder(shard.lock);
+		return shard.cache.find_object(hash);
+	}
+
+	bool has_object(Hash hash)
+	{
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder(shard.lock);
+		return shard.cache.has_object(hash);
+	}
+
+	// Looks up and pins an object in one go, so it cannot be evicted between the two.
+	bool find_and_pin_object(Hash hash, T &object)
+	{
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder(shard.lock);
+		auto result = shard.cache.find_object(hash);
+		if (!result.second)
+			return false;
+		shard.cache.pin_object(hash);
+		object = result.first;
+		return true;
+	}
+
+	void unpin_object(Hash hash)
+	{
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder(shard.lock);
+		shard.cache.unpin_object(hash);
+	}
+
+	// Two threads might create the same object at the same time. Only the first insert wins,
+	// and false is returned to the others, which still own their object and have to destroy it.
+	bool insert_object(Hash hash, T object, size_t object_size)
+	{
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder(shard.lock);
+		if (shard.cache.has_object(hash))
+			return false;
+		shard.cache.insert_object(hash, object, object_size);
+		return true;
+	}
+
+	template <typename Deleter>
+	void prune_cache(const Deleter &deleter)
+	{
+		for (auto &shard : shards)
+		{
+			std::lock_guard<std::mutex> holder(shard.lock);
+			shard.cache.prune_cache(deleter);
+		}
+	}
+
+	template <typename Deleter>
+	void delete_cache(const Deleter &deleter)
+	{
+		for (auto &shard : shards)
+		{
+			std::lock_guard<std::mutex> holder(shard.lock);
+			shard.cache.delete_cache(deleter);
+		}
+	}
+
+	size_t get_current_total_size()
+	{
+		size_t total = 0;
+		for (auto &shard : shards)
+		{
+			std::lock_guard<std::mutex> holder(shard.lock);
+			total += shard.cache.get_current_total_size();
+		}
+		return total;
+	}
+
+	size_t get_current_object_count()
+	{
+		size_t count = 0;
+		for (auto &shard : shards)
+		{
+			std::lock_guard<std::mutex> holder(shard.lock);
+			count += shard.cache.get_current_object_count();
+		}
+		return count;
+	}
+
+private:
+	enum { NumShards = 16 };
+
+	struct Shard
+	{
+		std::mutex lock;
+		ObjectCache<T> cache;
+	};
+	Shard shards[NumShards];
+
+	Shard &get_shard(Hash hash)
+	{
+		// Hashes are well distributed, but mix in the upper bits in case the low bits are not.
+		return shards[(hash ^ (hash >> 32)) % NumShards];
+	}
+};
+}
@@ -0,0 +1,101 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "fossilize_db.hpp"
+
+namespace Fossilize
+{
+// Payload of one database entry. The payload is borrowed from the database with map_entry() when possible,
+// and only read into a buffer of its own when it cannot be borrowed.
+// The buffer is kept across reads, so reusing one EntryPayload does not allocate once it is large enough.
+class EntryPayload
+{
+public:
+	EntryPayload() = default;
+	EntryPayload(const EntryPayload &) = delete;
+	void operator=(const EntryPayload &) = delete;
+
+	~EntryPayload()
+	{
+		release();
+	}
+
+	bool read(DatabaseInterface &db, ResourceTag tag, Hash hash, PayloadReadFlags flags)
+	{
+		release();
+
+		if (db.map_entry(tag, hash, &payload, &payload_size, flags))
+		{
+			mapped_db = &db;
+			return true;
+		}
+
+		size_t size = 0;
+		if (!db.read_entry(tag, hash, &size, nullptr, flags))
+			return false;
+		buffer.resize(size);
+		if (!db.read_entry(tag, hash, &size, buffer.data(), flags))
+			return false;
+
+		payload = buffer.data();
+		payload_size = size;
+		return true;
+	}
+
+	// Ends a borrow early. Also called by read() and on destruction.
+	void release()
+	{
+		if (mapped_db)
+			mapped_db->release_entry(payload);
+		mapped_db = nullptr;
+		payload = nullptr;
+		payload_size = 0;
+	}
+
+	const uint8_t *data() const
+	{
+		return static_cast<const uint8_t *>(payload);
+	}
+
+	size_t size() const
+	{
+		return payload_size;
+	}
+
+	bool is_borrowed() const
+	{
+		return mapped_db != nullptr;
+	}
+
+private:
+	std::vector<uint8_t> buffer;
+	DatabaseInterface *mapped_db = nullptr;
+	const void *payload = nullptr;
+	size_t payload_size = 0;
+};
+}
@@ -0,0 +1,268 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Open-addressing hash map from 64-bit keys to trivially copyable values.
+// All entries live in one flat array, so there is no per-entry allocation,
+// and lookups are a linear probe through contiguous memory.
+// erase() uses backward shift deletion, compacting the probe sequence instead of leaving tombstones,
+// so lookups never slow down after many erasures. Since it may move later entries into the hole,
+// it invalidates iterators, and pointers or references to the entries which moved.
+// Iteration order is unspecified.
+template <typename T>
+class FlatHashMap
+{
+public:
+	struct Slot
+	{
+		uint64_t first;
+		T second;
+	};
+
+	class Iterator
+	{
+	public:
+		Iterator(const FlatHashMap *map_, size_t index_)
+			: map(map_), index(index_)
+		{
+			skip_empty();
+		}
+
+		const Slot &operator*() const
+		{
+			return map->slots[index];
+		}
+
+		const Slot *operator->() const
+		{
+			return &map->slots[index];
+		}
+
+		Iterator &operator++()
+		{
+			index++;
+			skip_empty();
+			return *this;
+		}
+
+		bool operator==(const Iterator &other) const
+		{
+			return index == other.index;
+		}
+
+		bool operator!=(const Iterator &other) const
+		{
+			return index != other.index;
+		}
+
+	private:
+		void skip_empty()
+		{
+			while (index < map->occupied.size() && !map->occupied[index])
+				index++;
+		}
+
+		const FlatHashMap *map;
+		size_t index;
+	};
+
+	Iterator begin() const
+	{
+		return Iterator(this, 0);
+	}
+
+	Iterator end() const
+	{
+		return Iterator(this, occupied.size());
+	}
+
+	size_t size() const
+	{
+		return entry_count;
+	}
+
+	bool empty() const
+	{
+		return entry_count == 0;
+	}
+
+	void clear()
+	{
+		slots.clear();
+		occupied.clear();
+		entry_count = 0;
+	}
+
+	// Avoids rehashing while inserting up to new_count entries.
+	void reserve(size_t new_count)
+	{
+		size_t capacity = occupied.size();
+		if (capacity == 0)
+			capacity = MinCapacity;
+		while (!fits(new_count, capacity))
+			capacity *= 2;
+
+		if (capacity != occupied.size())
+			rehash(capacity);
+	}
+
+	const T *find(uint64_t key) const
+	{
+		if (entry_count == 0)
+			return nullptr;
+
+		size_t mask = occupied.size() - 1;
+		for (size_t index = bucket(key); occupied[index]; index = (index + 1) & mask)
+			if (slots[index].first == key)
+				return &slots[index].second;
+		return nullptr;
+	}
+
+	size_t count(uint64_t key) const
+	{
+		return find(key) ? 1 : 0;
+	}
+
+	// Like std::unordered_map, the first value inserted for a key wins.
+	// Returns true if the value was inserted.
+	bool emplace(uint64_t key, const T &value)
+	{
+		if (!fits(entry_count + 1, occupied.size()))
+			rehash(occupied.empty() ? size_t(MinCapacity) : occupied.size() * 2);
+
+		size_t mask = occupied.size() - 1;
+		size_t index = bucket(key);
+		for (; occupied[index]; index = (index + 1) & mask)
+			if (slots[index].first == key)
+				return false;
+
+		slots[index] = { key, value };
+		occupied[index] = 1;
+		entry_count++;
+		return true;
+	}
+
+	// Returns true if the key was present.
+	// Invalidates iterators and references, since entries after the erased one may move.
+	bool erase(uint64_t key)
+	{
+		if (entry_count == 0)
+			return false;
+
+		size_t mask = occupied.size() - 1;
+		size_t index = bucket(key);
+		while (occupied[index] && slots[index].first != key)
+			index = (index + 1) & mask;
+		if (!occupied[index])
+			return false;
+
+		// Backward shift deletion. Entries after the hole which may live in it move up,
+		// so every probe sequence stays unbroken without tombstones.
+		size_t hole = index;
+		for (size_t next = (hole + 1) & mask; occupied[next]; next = (next + 1) & mask)
+		{
+			size_t home = bucket(slots[next].first);
+			if (((next - home) & mask) >= ((next - hole) & mask))
+			{
+				slots[hole] = slots[next];
+				hole = next;
+			}
+		}
+
+		occupied[hole] = 0;
+		entry_count--;
+		return true;
+	}
+
+	// Returns the value for key, inserting a value-initialized one if there is none.
+	// The reference is only valid until the next insertion.
+	T &operator[](uint64_t key)
+	{
+		if (!fits(entry_count + 1, occupied.size()))
+			rehash(occupied.empty() ? size_t(MinCapacity) : occupied.size() * 2);
+
+		size_t mask = occupied.size() - 1;
+		size_t index = bucket(key);
+		for (; occupied[index]; index = (index + 1) & mask)
+			if (slots[index].first == key)
+				return slots[index].second;
+
+		slots[index] = { key, T() };
+		occupied[index] = 1;
+		entry_count++;
+		return slots[index].second;
+	}
+
+private:
+	enum { MinCapacity = 16 };
+
+	std::vector<Slot> slots;
+	std::vector<uint8_t> occupied;
+	size_t entry_count = 0;
+	unsigned shift = 64;
+
+	// Keep the load factor at or below 3/4 so probe sequences stay short.
+	static bool fits(size_t new_count, size_t capacity)
+	{
+		return new_count * 4 <= capacity * 3;
+	}
+
+	// Fibonacci hashing. Keys are usually well distributed already, but this keeps sequential keys from clustering.
+	size_t bucket(uint64_t key) const
+	{
+		return size_t((key * 0x9e3779b97f4a7c15ull) >> shift);
+	}
+
+	void rehash(size_t capacity)
+	{
+		std::vector<Slot> old_slots(capacity);
+		std::vector<uint8_t> old_occupied(capacity);
+		std::swap(old_slots, slots);
+		std::swap(old_occupied, occupied);
+
+		shift = 64;
+		for (size_t i = capacity; i > 1; i >>= 1)
+			shift--;
+
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < old_occupied.size(); i++)
+		{
+			if (!old_occupied[i])
+				continue;
+
+			size_t index = bucket(old_slots[i].first);
+			while (occupied[index])
+				index = (index + 1) & mask;
+			slots[index] = old_slots[i];
+			occupied[index] = 1;
+		}
+	}
+};
+}
@@ -0,0 +1,176 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Bounded multi-producer, single-consumer queue.
+// Producers claim a slot with a single compare-and-swap and never take a lock unless the consumer is asleep,
+// so a burst of pushes from many threads costs at most one wakeup.
+// push() spins if the queue is full, so capacity should be large enough that the consumer keeps up.
+// Only a single thread may call the consumer side: empty(), pop_batch(), wait() and wait_for().
+// Any thread may call wake() to end the consumer's wait without pushing, e.g. when it has to reconsider held items.
+template <typename T>
+class MPSCQueue
+{
+public:
+	explicit MPSCQueue(unsigned capacity_log2)
+		: cells(new Cell[size_t(1) << capacity_log2]),
+		  mask((size_t(1) << capacity_log2) - 1)
+	{
+		for (size_t i = 0; i <= mask; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	bool try_push(const T &value)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		Cell *cell;
+		for (;;)
+		{
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0)
+			{
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = tail.load(std::memory_order_relaxed);
+		}
+
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		wake_consumer();
+		return true;
+	}
+
+	void push(const T &value)
+	{
+		while (!try_push(value))
+			std::this_thread::yield();
+	}
+
+	// The next or current wait() or wait_for() returns even if the queue is empty.
+	void wake()
+	{
+		woken.store(true, std::memory_order_relaxed);
+		wake_consumer();
+	}
+
+	bool empty() const
+	{
+		return cells[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+	}
+
+	// Pops up to count items in FIFO order, returns the number of items popped.
+	size_t pop_batch(T *values, size_t count)
+	{
+		size_t popped = 0;
+		while (popped < count)
+		{
+			Cell &cell = cells[head & mask];
+			if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+				break;
+
+			values[popped++] = cell.value;
+			cell.sequence.store(head + mask + 1, std::memory_order_release);
+			head++;
+		}
+		return popped;
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(wait_lock);
+		begin_wait();
+		wait_cond.wait(lock, [this]() { return !empty() || consume_wake(); });
+		consumer_waiting.store(false, std::memory_order_relaxed);
+	}
+
+	// Returns false if the queue is still empty after the timeout, and wake() was not called.
+	template <typename Rep, typename Period>
+	bool wait_for(const std::chrono::duration<Rep, Period> &timeout)
+	{
+		std::unique_lock<std::mutex> lock(wait_lock);
+		begin_wait();
+		bool ret = wait_cond.wait_for(lock, timeout, [this]() { return !empty() || consume_wake(); });
+		consumer_waiting.store(false, std::memory_order_relaxed);
+		return ret;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	std::atomic<size_t> tail{0};
+	size_t head = 0;
+
+	std::mutex wait_lock;
+	std::condition_variable wait_cond;
+	std::atomic<bool> consumer_waiting{false};
+	std::atomic<bool> woken{false};
+
+	bool consume_wake()
+	{
+		return woken.exchange(false, std::memory_order_relaxed);
+	}
+
+	// The fences order the producer's publish against its check of consumer_waiting, and the consumer's
+	// announcement against its check for data, so either the consumer sees the item or the producer sees the consumer.
+	// The same holds for the woken flag.
+	void begin_wait()
+	{
+		consumer_waiting.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void wake_consumer()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (consumer_waiting.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(wait_lock);
+			wait_cond.notify_one();
+		}
+	}
+};
+}
@@ -23,6 +23,8 @@
 #pragma once
 
 #include <unordered_map>
+#include <deque>
+#include <utility>
 #include "fossilize_types.hpp"
 #include "object_pool.hpp"
 #include "intrusive_list.hpp"
@@ -30,6 +32,17 @@
 
 namespace Fossilize
 {
+enum class ObjectCachePolicy
+{
+	// Plain least recently used.
+	LRU,
+	// Simplified 2Q. New objects go on a probation queue and are only promoted to the LRU once they are used again,
+	// so a long run of objects which are used once cannot flush out the objects which are used all the time.
+	// Uses before the next prune_cache() are considered correlated with the insertion and don't promote.
+	// Objects which were evicted from probation recently are remembered and go straight to the LRU when they come back.
+	TwoQueue
+};
+
 template <typename T>
 class ObjectCache
 {
@@ -41,6 +54,7 @@ public:
 	~ObjectCache()
 	{
 		assert(lru_cache.empty());
+		assert(probation.empty());
 	}
 
 	void set_target_size(size_t size)
@@ -48,50 +62,124 @@ public:
 		target_size = size;
 	}
 
+	void set_policy(ObjectCachePolicy policy_)
+	{
+		assert(hash_to_objects.empty());
+		policy = policy_;
+	}
+
 	std::pair<T, bool> find_object(Hash hash)
 	{
 		auto itr = hash_to_objects.find(hash);
 		if (itr == std::end(hash_to_objects))
 			return { static_cast<T>(0), false };
 
-		lru_cache.move_to_front(lru_cache, itr->second);
-		return { itr->second->object, true };
+		auto *entry = itr->second;
+		if (entry->on_probation && entry->insert_epoch == prune_epoch)
+		{
+			// Keep probation in FIFO order.
+		}
+		else if (entry->on_probation)
+		{
+			probation.erase(entry);
+			probation_size -= entry->size;
+			entry->on_probation = false;
+			lru_cache.insert_front(entry);
+		}
+		else
+			lru_cache.move_to_front(lru_cache, entry);
+		return { entry->object, true };
+	}
+
+	// Unlike find_object(), does not count as a use.
+	bool has_object(Hash hash) const
+	{
+		return hash_to_objects.count(hash) != 0;
+	}
+
+	// Pinned objects are never evicted, they still count towards the total size.
+	// Pins are counted, every pin_object() needs a matching unpin_object().
+	bool pin_object(Hash hash)
+	{
+		auto itr = hash_to_objects.find(hash);
+		if (itr == std::end(hash_to_objects))
+			return false;
+		itr->second->pin_count++;
+		return true;
+	}
+
+	void unpin_object(Hash hash)
+	{
+		auto itr = hash_to_objects.find(hash);
+		assert(itr != std::end(hash_to_objects));
+		if (itr != std::end(hash_to_objects))
+		{
+			assert(itr->second->pin_count != 0);
+			itr->second->pin_count--;
+		}
+	}
+
+	// The size passed to insert_object() might just be an estimate. If the real cost of an object
+	// becomes known later, it can be updated here.
+	void update_object_size(Hash hash, size_t object_size)
+	{
+		auto itr = hash_to_objects.find(hash);
+		if (itr == std::end(hash_to_objects))
+			return;
+
+		auto *entry = itr->second;
+		total_size = total_size - entry->size + object_size;
+		if (entry->on_probation)
+			probation_size = probation_size - entry->size + object_size;
+		entry->size = object_size;
 	}
 
 	template <typename Deleter>
 	void prune_cache(const Deleter &deleter)
 	{
+		prune_epoch++;
 		while (total_size > target_size)
 		{
-			assert(!lru_cache.empty());
-			auto last_used_entry = lru_cache.rbegin();
-			assert(last_used_entry->size <= total_size);
-			total_size -= last_used_entry->size;
-			lru_cache.erase(last_used_entry);
-
-			deleter(last_used_entry->hash, last_used_entry->object);
-			hash_to_objects.erase(last_used_entry->hash);
-			pool.free(last_used_entry.get());
+			// 2Q keeps the probation queue at around a quarter of the cache.
+			typename IntrusiveList<CacheEntry>::Iterator victim;
+			if (probation_size > target_size / 4)
+				victim = find_eviction_candidate(probation);
+			if (!victim)
+				victim = find_eviction_candidate(lru_cache);
+			if (!victim)
+				victim = find_eviction_candidate(probation);
+
+			// Everything which is left is pinned.
+			if (!victim)
+				break;
+
+			assert(victim->size <= total_size);
+			total_size -= victim->size;
+			if (victim->on_probation)
+			{
+				probation_size -= victim->size;
+				probation.erase(victim);
+				remember_evicted(victim->hash);
+			}
+			else
+				lru_cache.erase(victim);
+
+			deleter(victim->hash, victim->object);
+			hash_to_objects.erase(victim->hash);
+			pool.free(victim.get());
 		}
 	}
 
 	template <typename Deleter>
 	void delete_cache(const Deleter &deleter)
 	{
-		auto itr = lru_cache.begin();
-		while (itr != std::end(lru_cache))
-		{
-			auto entry = itr;
-			itr = lru_cache.erase(entry);
-			deleter(entry->hash, entry->object);
-			assert(entry->size <= total_size);
-			total_size -= entry->size;
-			pool.free(entry.get());
-		}
-
-		lru_cache.clear();
+		delete_list(lru_cache, deleter);
+		delete_list(probation, deleter);
 		hash_to_objects.clear();
+		recently_evicted.clear();
+		recently_evicted_order.clear();
 		assert(total_size == 0);
+		probation_size = 0;
 	}
 
 	void insert_object(Hash hash, T object, size_t object_size)
@@ -100,7 +188,17 @@ public:
 		entry->hash = hash;
 		entry->object = object;
 		entry->size = object_size;
-		lru_cache.insert_front(entry);
+		entry->insert_epoch = prune_epoch;
+
+		if (policy == ObjectCachePolicy::TwoQueue && recently_evicted.erase(hash) == 0)
+		{
+			entry->on_probation = true;
+			probation.insert_front(entry);
+			probation_size += object_size;
+		}
+		else
+			lru_cache.insert_front(entry);
+
 		auto map_itr = hash_to_objects.insert({ hash, entry });
 		(void)map_itr;
 		assert(map_itr.second);
@@ -121,16 +219,69 @@ public:
 private:
 	size_t target_size = 0;
 	size_t total_size = 0;
+	size_t probation_size = 0;
+	unsigned prune_epoch = 0;
+	ObjectCachePolicy policy = ObjectCachePolicy::LRU;
 
 	struct CacheEntry : IntrusiveListEnabled<CacheEntry>
 	{
 		T object = static_cast<T>(0);
 		Hash hash = 0;
 		size_t size = 0;
+		unsigned pin_count = 0;
+		unsigned insert_epoch = 0;
+		bool on_probation = false;
 	};
 
 	ObjectPool<CacheEntry> pool;
 	std::unordered_map<Hash, CacheEntry *> hash_to_objects;
 	IntrusiveList<CacheEntry> lru_cache;
+	IntrusiveList<CacheEntry> probation;
+
+	// Hashes evicted from probation, oldest first. Bounded by the number of live objects.
+	// The serial lets us tell stale queue entries apart from hashes which were evicted again later.
+	std::unordered_map<Hash, uint64_t> recently_evicted;
+	std::deque<std::pair<Hash, uint64_t>> recently_evicted_order;
+	uint64_t eviction_serial = 0;
+
+	static typename IntrusiveList<CacheEntry>::Iterator find_eviction_candidate(IntrusiveList<CacheEntry> &list)
+	{
+		auto itr = list.rbegin();
+		while (itr && itr->pin_count != 0)
+			--itr;
+		return itr;
+	}
+
+	void remember_evicted(Hash hash)
+	{
+		size_t max_count = hash_to_objects.size() > 64 ? hash_to_objects.size() : 64;
+		while (recently_evicted_order.size() >= max_count)
+		{
+			auto &oldest = recently_evicted_order.front();
+			auto itr = recently_evicted.find(oldest.first);
+			if (itr != std::end(recently_evicted) && itr->second == oldest.second)
+				recently_evicted.erase(itr);
+			recently_evicted_order.pop_front();
+		}
+
+		recently_evicted[hash] = ++eviction_serial;
+		recently_evicted_order.push_back({ hash, eviction_serial });
+	}
+
+	template <typename Deleter>
+	void delete_list(IntrusiveList<CacheEntry> &list, const Deleter &deleter)
+	{
+		auto itr = list.begin();
+		while (itr != std::end(list))
+		{
+			auto entry = itr;
+			itr = list.erase(entry);
+			deleter(entry->hash, entry->object);
+			assert(entry->size <= total_size);
+			total_size -= entry->size;
+			pool.free(entry.get());
+		}
+		list.clear();
+	}
 };
 }
@@ -0,0 +1,134 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Immutable set of 64-bit hashes, stored as one sorted array.
+// A table of offsets indexed by the top bits of a hash narrows a lookup down to a handful of entries,
+// so with uniformly distributed hashes a lookup costs about as much as with a hash table,
+// for a little over 8 bytes per hash and no per-entry allocation.
+// Hashes which cluster in a few buckets fall back to a binary search within the bucket.
+class SortedHashSet
+{
+public:
+	// Takes over hashes, which must be sorted and unique.
+	void assign(std::vector<uint64_t> sorted_hashes)
+	{
+		hashes = std::move(sorted_hashes);
+		build_buckets();
+	}
+
+	// Returns the position of the hash in the sorted array, or size() if it is not in the set.
+	// Values can be kept in an array alongside.
+	size_t find(uint64_t hash) const
+	{
+		if (hashes.empty())
+			return 0;
+
+		size_t b = bucket(hash);
+		auto first = hashes.begin() + bucket_offsets[b];
+		auto last = hashes.begin() + bucket_offsets[b + 1];
+		auto itr = std::lower_bound(first, last, hash);
+		if (itr != last && *itr == hash)
+			return size_t(itr - hashes.begin());
+		return hashes.size();
+	}
+
+	size_t count(uint64_t hash) const
+	{
+		return find(hash) != hashes.size() ? 1 : 0;
+	}
+
+	size_t size() const
+	{
+		return hashes.size();
+	}
+
+	bool empty() const
+	{
+		return hashes.empty();
+	}
+
+	const uint64_t *data() const
+	{
+		return hashes.data();
+	}
+
+	std::vector<uint64_t>::const_iterator begin() const
+	{
+		return hashes.begin();
+	}
+
+	std::vector<uint64_t>::const_iterator end() const
+	{
+		return hashes.end();
+	}
+
+	void clear()
+	{
+		std::vector<uint64_t>().swap(hashes);
+		std::vector<uint32_t>().swap(bucket_offsets);
+		bucket_bits = 0;
+	}
+
+private:
+	// About this many hashes share a bucket.
+	enum { HashesPerBucket = 4 };
+
+	std::vector<uint64_t> hashes;
+	std::vector<uint32_t> bucket_offsets;
+	unsigned bucket_bits = 0;
+
+	size_t bucket(uint64_t hash) const
+	{
+		return bucket_bits ? size_t(hash >> (64 - bucket_bits)) : 0;
+	}
+
+	void build_buckets()
+	{
+		bucket_bits = 0;
+		while (bucket_bits < 32 && (size_t(HashesPerBucket) << bucket_bits) < hashes.size())
+			bucket_bits++;
+
+		size_t bucket_count = size_t(1) << bucket_bits;
+		bucket_offsets.assign(bucket_count + 1, 0);
+
+		size_t index = 0;
+		for (size_t b = 0; b < bucket_count; b++)
+		{
+			bucket_offsets[b] = uint32_t(index);
+			while (index < hashes.size() && bucket(hashes[index]) == b)
+				index++;
+		}
+		bucket_offsets[bucket_count] = uint32_t(index);
+	}
+};
+}
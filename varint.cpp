@@ -21,6 +21,21 @@
  */
 
 #include "varint.hpp"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define FOSSILIZE_STREAM_VBYTE_X86
+#define FOSSILIZE_STREAM_VBYTE_TARGET __attribute__((target("ssse3")))
+#include <tmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define FOSSILIZE_STREAM_VBYTE_X86
+#define FOSSILIZE_STREAM_VBYTE_TARGET
+#include <intrin.h>
+#include <tmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define FOSSILIZE_STREAM_VBYTE_NEON
+#include <arm_neon.h>
+#endif
 
 namespace Fossilize
 {
@@ -102,4 +117,202 @@ bool decode_varint(uint32_t *words, size_t words_size, const uint8_t *buffer, si
 
 	return buffer_size == offset;
 }
+
+namespace
+{
+// For every control byte, the number of data bytes in its group of four words,
+// and the shuffle which spreads those bytes out into four 32-bit words.
+struct StreamVByteTables
+{
+	StreamVByteTables()
+	{
+		for (unsigned control = 0; control < 256; control++)
+		{
+			uint8_t offset = 0;
+			for (unsigned word = 0; word < 4; word++)
+			{
+				unsigned bytes = ((control >> (2 * word)) & 3) + 1;
+				for (unsigned byte = 0; byte < 4; byte++)
+					shuffle[control][4 * word + byte] = byte < bytes ? uint8_t(offset + byte) : 0x80;
+				offset += bytes;
+			}
+			length[control] = offset;
+		}
+	}
+
+	uint8_t shuffle[256][16];
+	uint8_t length[256];
+};
+
+static const StreamVByteTables &get_stream_vbyte_tables()
+{
+	static const StreamVByteTables tables;
+	return tables;
+}
+
+static unsigned stream_vbyte_word_code(uint32_t w)
+{
+	if (w < (1u << 8))
+		return 0;
+	else if (w < (1u << 16))
+		return 1;
+	else if (w < (1u << 24))
+		return 2;
+	else
+		return 3;
+}
+
+static size_t stream_vbyte_control_size(size_t word_count)
+{
+	return (word_count + 3) / 4;
+}
+
+// Decodes full groups of four words as long as 16 bytes can be loaded from the data stream.
+// Returns the number of words decoded.
+typedef size_t (*StreamVByteGroupDecoder)(uint32_t *, size_t, const uint8_t *, const uint8_t *, size_t, size_t *);
+
+static size_t decode_stream_vbyte_groups_portable(uint32_t *, size_t, const uint8_t *, const uint8_t *, size_t, size_t *)
+{
+	return 0;
+}
+
+#if defined(FOSSILIZE_STREAM_VBYTE_X86)
+FOSSILIZE_STREAM_VBYTE_TARGET
+static size_t decode_stream_vbyte_groups_simd(uint32_t *words, size_t word_count, const uint8_t *control,
+                                              const uint8_t *data, size_t data_size, size_t *data_offset)
+{
+	auto &tables = get_stream_vbyte_tables();
+	size_t offset = 0;
+	size_t i = 0;
+	for (; i + 4 <= word_count && offset + 16 <= data_size; i += 4)
+	{
+		uint8_t c = control[i / 4];
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + offset));
+		__m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables.shuffle[c]));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(words + i), _mm_shuffle_epi8(bytes, shuffle));
+		offset += tables.length[c];
+	}
+	*data_offset = offset;
+	return i;
+}
+
+static bool detect_simd_support()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	return __builtin_cpu_supports("ssse3") != 0;
+#endif
+}
+#elif defined(FOSSILIZE_STREAM_VBYTE_NEON)
+static size_t decode_stream_vbyte_groups_simd(uint32_t *words, size_t word_count, const uint8_t *control,
+                                              const uint8_t *data, size_t data_size, size_t *data_offset)
+{
+	auto &tables = get_stream_vbyte_tables();
+	size_t offset = 0;
+	size_t i = 0;
+	for (; i + 4 <= word_count && offset + 16 <= data_size; i += 4)
+	{
+		uint8_t c = control[i / 4];
+		// Out of range indices, like the 0x80 in the shuffle table, read as zero in TBL.
+		uint8x16_t bytes = vld1q_u8(data + offset);
+		uint8x16_t shuffle = vld1q_u8(tables.shuffle[c]);
+		vst1q_u8(reinterpret_cast<uint8_t *>(words + i), vqtbl1q_u8(bytes, shuffle));
+		offset += tables.length[c];
+	}
+	*data_offset = offset;
+	return i;
+}
+
+static bool detect_simd_support()
+{
+	return true;
+}
+#endif
+
+static StreamVByteGroupDecoder get_stream_vbyte_group_decoder()
+{
+#if defined(FOSSILIZE_STREAM_VBYTE_X86) || defined(FOSSILIZE_STREAM_VBYTE_NEON)
+	if (detect_simd_support())
+		return decode_stream_vbyte_groups_simd;
+#endif
+	return decode_stream_vbyte_groups_portable;
+}
+}
+
+size_t compute_size_stream_vbyte(const uint32_t *words, size_t word_count)
+{
+	size_t size = stream_vbyte_control_size(word_count);
+	for (size_t i = 0; i < word_count; i++)
+		size += stream_vbyte_word_code(words[i]) + 1;
+	return size;
+}
+
+uint8_t *encode_stream_vbyte(uint8_t *buffer, const uint32_t *words, size_t word_count)
+{
+	uint8_t *control = buffer;
+	uint8_t *data = buffer + stream_vbyte_control_size(word_count);
+	memset(control, 0, stream_vbyte_control_size(word_count));
+
+	for (size_t i = 0; i < word_count; i++)
+	{
+		auto w = words[i];
+		unsigned code = stream_vbyte_word_code(w);
+		control[i / 4] |= uint8_t(code << (2 * (i & 3)));
+		for (unsigned byte = 0; byte <= code; byte++)
+			*data++ = uint8_t(w >> (8 * byte));
+	}
+
+	return data;
+}
+
+bool decode_stream_vbyte(uint32_t *words, size_t word_count, const uint8_t *buffer, size_t buffer_size)
+{
+	size_t control_size = stream_vbyte_control_size(word_count);
+	if (buffer_size < control_size)
+		return false;
+
+	const uint8_t *control = buffer;
+	const uint8_t *data = buffer + control_size;
+	size_t data_size = buffer_size - control_size;
+
+	// Validate the control stream up front, so the decode loops do not need to check bounds per word.
+	// Unused codes in a trailing partial group must be zero.
+	auto &tables = get_stream_vbyte_tables();
+	size_t expected_size = 0;
+	for (size_t i = 0; i < word_count / 4; i++)
+		expected_size += tables.length[control[i]];
+
+	if (word_count & 3)
+	{
+		unsigned tail = unsigned(word_count & 3);
+		uint8_t c = control[control_size - 1];
+		if ((c >> (2 * tail)) != 0)
+			return false;
+		for (unsigned word = 0; word < tail; word++)
+			expected_size += ((c >> (2 * word)) & 3) + 1;
+	}
+
+	if (expected_size != data_size)
+		return false;
+
+	static const StreamVByteGroupDecoder decode_groups = get_stream_vbyte_group_decoder();
+	size_t offset = 0;
+	size_t i = decode_groups(words, word_count, control, data, data_size, &offset);
+
+	// Whatever is left over is too close to the end of the data stream for a 16 byte load.
+	for (; i < word_count; i++)
+	{
+		unsigned bytes = ((control[i / 4] >> (2 * (i & 3))) & 3) + 1;
+		uint32_t w = 0;
+		for (unsigned byte = 0; byte < bytes; byte++)
+			w |= uint32_t(data[offset + byte]) << (8 * byte);
+		words[i] = w;
+		offset += bytes;
+	}
+
+	return true;
+}
 }
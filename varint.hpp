@@ -29,4 +29,10 @@ namespace Fossilize
 size_t compute_size_varint(const uint32_t *words, size_t word_count);
 uint8_t *encode_varint(uint8_t *buffer, const uint32_t *words, size_t word_count);
 bool decode_varint(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size);
+
+// Stream VByte: all 2-bit length codes for the words come first, four to a byte, followed by the
+// 1 to 4 little-endian bytes of every word. Groups of four words decode with a single byte shuffle.
+size_t compute_size_stream_vbyte(const uint32_t *words, size_t word_count);
+uint8_t *encode_stream_vbyte(uint8_t *buffer, const uint32_t *words, size_t word_count);
+bool decode_stream_vbyte(uint32_t *words, size_t word_count, const uint8_t *buffer, size_t buffer_size);
 }
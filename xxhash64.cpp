@@ -0,0 +1,130 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "xxhash64.hpp"
+
+namespace Fossilize
+{
+static const uint64_t Prime1 = 0x9e3779b185ebca87ull;
+static const uint64_t Prime2 = 0xc2b2ae3d27d4eb4full;
+static const uint64_t Prime3 = 0x165667b19e3779f9ull;
+static const uint64_t Prime4 = 0x85ebca77c2b2ae63ull;
+static const uint64_t Prime5 = 0x27d4eb2f165667c5ull;
+
+static inline uint64_t rotl(uint64_t v, unsigned shift)
+{
+	return (v << shift) | (v >> (64 - shift));
+}
+
+// Compilers turn these into plain loads on little-endian targets.
+static inline uint64_t read_le64(const uint8_t *ptr)
+{
+	uint64_t v = 0;
+	for (unsigned i = 0; i < 8; i++)
+		v |= uint64_t(ptr[i]) << (8 * i);
+	return v;
+}
+
+static inline uint32_t read_le32(const uint8_t *ptr)
+{
+	uint32_t v = 0;
+	for (unsigned i = 0; i < 4; i++)
+		v |= uint32_t(ptr[i]) << (8 * i);
+	return v;
+}
+
+static inline uint64_t lane_round(uint64_t acc, uint64_t input)
+{
+	acc += input * Prime2;
+	acc = rotl(acc, 31);
+	return acc * Prime1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t v)
+{
+	acc ^= lane_round(0, v);
+	return acc * Prime1 + Prime4;
+}
+
+uint64_t xxhash64(const void *data, size_t size, uint64_t seed)
+{
+	auto *ptr = static_cast<const uint8_t *>(data);
+	const uint8_t *end = ptr + size;
+	uint64_t h;
+
+	if (size >= 32)
+	{
+		uint64_t v1 = seed + Prime1 + Prime2;
+		uint64_t v2 = seed + Prime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - Prime1;
+
+		const uint8_t *limit = end - 32;
+		do
+		{
+			v1 = lane_round(v1, read_le64(ptr + 0));
+			v2 = lane_round(v2, read_le64(ptr + 8));
+			v3 = lane_round(v3, read_le64(ptr + 16));
+			v4 = lane_round(v4, read_le64(ptr + 24));
+			ptr += 32;
+		} while (ptr <= limit);
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge_round(h, v1);
+		h = merge_round(h, v2);
+		h = merge_round(h, v3);
+		h = merge_round(h, v4);
+	}
+	else
+		h = seed + Prime5;
+
+	h += uint64_t(size);
+
+	while (ptr + 8 <= end)
+	{
+		h ^= lane_round(0, read_le64(ptr));
+		h = rotl(h, 27) * Prime1 + Prime4;
+		ptr += 8;
+	}
+
+	if (ptr + 4 <= end)
+	{
+		h ^= uint64_t(read_le32(ptr)) * Prime1;
+		h = rotl(h, 23) * Prime2 + Prime3;
+		ptr += 4;
+	}
+
+	while (ptr < end)
+	{
+		h ^= uint64_t(*ptr) * Prime5;
+		h = rotl(h, 11) * Prime1;
+		ptr++;
+	}
+
+	h ^= h >> 33;
+	h *= Prime2;
+	h ^= h >> 29;
+	h *= Prime3;
+	h ^= h >> 32;
+	return h;
+}
+}